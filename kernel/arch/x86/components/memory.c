@@ -54,11 +54,15 @@ uintptr_t g_lastReservedAddress = 0;
 
 void
 PrintPhysicalMemoryUsage(void) {
-    int    maxBlocks       = READ_VOLATILE(GetMachine()->PhysicalMemory.capacity);
-    int    freeBlocks      = READ_VOLATILE(GetMachine()->PhysicalMemory.index);
-    int    allocatedBlocks = maxBlocks - freeBlocks;
-    size_t reservedMemory  = READ_VOLATILE(g_lastReservedAddress);
-    size_t memoryInUse     = reservedMemory + ((size_t)allocatedBlocks * (size_t)PAGE_SIZE);
+    size_t reservedMemory = READ_VOLATILE(g_lastReservedAddress);
+    size_t maxBlocks;
+    size_t freeBlocks;
+    size_t allocatedBlocks;
+    size_t memoryInUse;
+    
+    PhysicalMemoryGetStatistics(&GetMachine()->PhysicalMemory, &maxBlocks, &freeBlocks, NULL);
+    allocatedBlocks = maxBlocks - freeBlocks;
+    memoryInUse     = reservedMemory + (allocatedBlocks * (size_t)PAGE_SIZE);
     
     TRACE("Memory in use %" PRIuIN " Bytes", memoryInUse);
     TRACE("Block status %" PRIuIN "/%" PRIuIN, allocatedBlocks, maxBlocks);
@@ -86,7 +90,7 @@ AllocateBootMemory(
 OsStatus_t
 InitializeSystemMemory(
     _In_  Multiboot_t*        bootInformation,
-    _In_  bounded_stack_t*    boundedStack,
+    _In_  PhysicalMemory_t*   physicalMemory,
     _In_  StaticMemoryPool_t* globalAccessMemory,
     _In_  SystemMemoryMap_t*  memoryMap,
     _Out_ size_t*             memoryGranularityOut,
@@ -100,7 +104,7 @@ InitializeSystemMemory(
     OsStatus_t          osStatus;
     int                 i;
 
-    if (!bootInformation || !boundedStack || !globalAccessMemory ||
+    if (!bootInformation || !physicalMemory || !globalAccessMemory ||
         !memoryMap || !memoryGranularityOut || !numberOfMemoryBlocksOut) {
         return OsInvalidParameters;
     }
@@ -133,7 +137,8 @@ InitializeSystemMemory(
     
     // Create the physical memory map
     count = memorySize / PAGE_SIZE;
-    bounded_stack_construct(boundedStack, (void*)AllocateBootMemory(count * sizeof(void*)), (int)count);
+    PhysicalMemoryConstruct(physicalMemory, (void*)AllocateBootMemory(PhysicalMemoryCalculateSize(count)),
+        count, PAGE_SIZE);
     
     // Create the global access memory, it needs to start after the last reserved
     // memory address, because the reserved memory is not freeable or allocatable.
@@ -167,7 +172,7 @@ InitializeSystemMemory(
     // So now we go through the memory regions provided by the system and add the physical pages
     // we can use, that are not already pre-allocated by the system.
     // ISSUE: it seems that the highest address (total number of blocks) actually
-    // exceeds the number of initial blocks available
+    // exceeds the number of initial blocks available, those pages are ignored
     TRACE("[pmem] [mem_init] region count %i, block count %u", bootInformation->MemoryMapLength, count);
     for (i = 0; i < (int)bootInformation->MemoryMapLength; i++) {
         if (regionPointer->Type == 1) {
@@ -178,9 +183,8 @@ InitializeSystemMemory(
                 baseAddress = g_lastReservedAddress;
             }
             
-            while (baseAddress < limit) {
-                bounded_stack_push(boundedStack, (void*)baseAddress);
-                baseAddress += PAGE_SIZE;
+            if (baseAddress < limit) {
+                PhysicalMemoryAddRange(physicalMemory, baseAddress, limit);
             }
         }
         regionPointer++;
@@ -241,6 +241,8 @@ DestroyVirtualSpace(
         _In_ MemorySpace_t* memorySpace)
 {
     PageDirectory_t* pageDirectory = (PageDirectory_t*)memorySpace->Data[MEMORY_SPACE_DIRECTORY];
+    uintptr_t        addresses[PHYSICAL_MEMORY_CACHE_BATCH];
+    int              addressCount = 0;
     int              i, j;
 
     // Iterate page-mappings
@@ -261,9 +263,8 @@ DestroyVirtualSpace(
             continue;
         }
 
-        // Iterate pages in table
+        // Iterate pages in table, the pages are returned in batches
         pageTable = (PageTable_t*)pageDirectory->vTables[i];
-        IrqSpinlockAcquire(&GetMachine()->PhysicalMemoryLock);
         for (j = 0; j < ENTRIES_PER_PAGE; j++) {
             currentMapping = atomic_load_explicit(&pageTable->Pages[j], memory_order_relaxed);
             if ((currentMapping & PAGE_PERSISTENT) || !(currentMapping & PAGE_PRESENT)) {
@@ -272,11 +273,17 @@ DestroyVirtualSpace(
 
             // If it has a mapping - free it
             if ((currentMapping & PAGE_MASK) != 0) {
-                currentMapping &= PAGE_MASK;
-                bounded_stack_push(&GetMachine()->PhysicalMemory, (void*)currentMapping);
+                addresses[addressCount++] = currentMapping & PAGE_MASK;
+                if (addressCount == PHYSICAL_MEMORY_CACHE_BATCH) {
+                    FreePhysicalMemory(addressCount, &addresses[0]);
+                    addressCount = 0;
+                }
             }
         }
-        IrqSpinlockRelease(&GetMachine()->PhysicalMemoryLock);
+        if (addressCount) {
+            FreePhysicalMemory(addressCount, &addresses[0]);
+            addressCount = 0;
+        }
         kfree(pageTable);
     }
     kfree(pageDirectory);
@@ -342,8 +342,10 @@ OsStatus_t
 MmVirtualDestroyPageTable(
 	_In_ PageTable_t* pageTable)
 {
-    // Handle PT[0..511] normally
-    IrqSpinlockAcquire(&GetMachine()->PhysicalMemoryLock);
+    uintptr_t addresses[PHYSICAL_MEMORY_CACHE_BATCH];
+    int       addressCount = 0;
+    
+    // Handle PT[0..511] normally, the pages are returned in batches
     for (int i = 0; i < ENTRIES_PER_PAGE; i++) {
         uint64_t mapping = atomic_load_explicit(&pageTable->Pages[i], memory_order_relaxed);
         uint64_t address = mapping & PAGE_MASK;
@@ -351,9 +353,15 @@ MmVirtualDestroyPageTable(
             continue;
         }
 
-        bounded_stack_push(&GetMachine()->PhysicalMemory, (void*)address);
+        addresses[addressCount++] = (uintptr_t)address;
+        if (addressCount == PHYSICAL_MEMORY_CACHE_BATCH) {
+            FreePhysicalMemory(addressCount, &addresses[0]);
+            addressCount = 0;
+        }
+    }
+    if (addressCount) {
+        FreePhysicalMemory(addressCount, &addresses[0]);
     }
-    IrqSpinlockRelease(&GetMachine()->PhysicalMemoryLock);
     kfree(pageTable);
     return OsSuccess;
 }
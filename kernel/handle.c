@@ -25,37 +25,135 @@
 #define __MODULE "handle"
 //#define __TRACE
 
+#include <arch/thread.h>
 #include <ddk/barrier.h>
-#include <ds/list.h>
+#include <ds/hashtable.h>
+#include <ds/hash_sip.h>
 #include <ds/queue.h>
 #include <debug.h>
 #include <handle.h>
 #include <heap.h>
+#include <irq_spinlock.h>
+#include <mutex.h>
 #include <threading.h>
 #include <string.h>
 
+// Handle ids are made of the index of the handle slot and the generation of that slot,
+// so slots can be reused without stale ids resolving to the new handle. Index 0 is reserved
+// so 0 is never a valid id, and the last index is reserved so UUID_INVALID never is either.
+#define HANDLE_INDEX_BITS      22
+#define HANDLE_INDEX_MASK      ((1U << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GENERATION_MASK (0xFFFFFFFFU >> HANDLE_INDEX_BITS)
+#define HANDLE_CHUNK_SHIFT     10
+#define HANDLE_CHUNK_SIZE      (1U << HANDLE_CHUNK_SHIFT)
+#define HANDLE_CHUNK_COUNT     ((HANDLE_INDEX_MASK + 1) >> HANDLE_CHUNK_SHIFT)
+#define HANDLE_INDEX_NONE      0
+
 typedef struct ResourceHandle {
+    UUId_t             Id;
     void*              Resource;
     atomic_int         References;
     HandleType_t       Type;
     unsigned int       Flags;
     HandleDestructorFn Destructor;
-    element_t*         PathHeader;
+    char*              Path;
     element_t          Header;
 } ResourceHandle_t;
 
-static Semaphore_t     EventHandle   = SEMAPHORE_INIT(0, 1);
-static queue_t         CleanQueue    = QUEUE_INIT;
-static list_t          Handles       = LIST_INIT;                      // TODO: hashtable
-static list_t          PathRegister  = LIST_INIT_CMP(list_cmp_string); // TODO: hashtable
-static UUId_t          JanitorHandle = UUID_INVALID;
-static _Atomic(UUId_t) HandleIdGen   = ATOMIC_VAR_INIT(1); // 0 is reserved for invalid
+// Chunks are never freed once published, so readers can walk the table without
+// taking the lock. Handle instances are freed by the janitor once they have been
+// removed from the table and a grace period has passed.
+typedef struct HandleChunk {
+    _Atomic(ResourceHandle_t*) Slots[HANDLE_CHUNK_SIZE];
+    uint32_t                   Generations[HANDLE_CHUNK_SIZE];
+    uint32_t                   NextFree[HANDLE_CHUNK_SIZE];
+} HandleChunk_t;
+
+// Readers of handle instances announce themselves in the counter of the current epoch.
+// The janitor advances the epoch and waits for the counter of the previous epoch to
+// drain, twice, so every reader that could still have found a removed instance is done.
+typedef struct HandleReaders {
+    atomic_int Count;
+    uint8_t    Padding[64 - sizeof(atomic_int)];
+} HandleReaders_t;
+
+struct HandlePathEntry {
+    const char*       Path;
+    ResourceHandle_t* Instance;
+};
+
+static uint64_t HandlePathHash(const void*);
+static int      HandlePathCompare(const void*, const void*);
+
+static Semaphore_t             EventHandle      = SEMAPHORE_INIT(0, 1);
+static queue_t                 CleanQueue       = QUEUE_INIT;
+static UUId_t                  JanitorHandle    = UUID_INVALID;
+static IrqSpinlock_t           HandleLock       = OS_IRQ_SPINLOCK_INIT;
+static _Atomic(HandleChunk_t*) HandleChunks[HANDLE_CHUNK_COUNT] = { NULL };
+static uint32_t                HandleChunkCount = 0;
+static uint32_t                FreeHead         = HANDLE_INDEX_NONE; // Slots are reused in FIFO order to keep
+static uint32_t                FreeTail         = HANDLE_INDEX_NONE; // generations from wrapping early
+static Mutex_t                 PathLock         = OS_MUTEX_INIT(MUTEX_FLAG_PLAIN);
+static hashtable_t             PathRegister;
+static uint8_t                 PathHashKey[16]  = { 11, 183, 72, 249, 6, 130, 54, 201, 97, 18, 230, 75, 163, 40, 219, 92 };
+static atomic_uint             ReaderEpoch      = ATOMIC_VAR_INIT(0);
+static HandleReaders_t         Readers[2]       = { { ATOMIC_VAR_INIT(0) }, { ATOMIC_VAR_INIT(0) } };
+
+static inline unsigned int
+HandleReadLock(void)
+{
+    unsigned int Epoch = atomic_load(&ReaderEpoch) & 1;
+    atomic_fetch_add(&Readers[Epoch].Count, 1);
+    return Epoch;
+}
+
+static inline void
+HandleReadUnlock(
+    _In_ unsigned int Epoch)
+{
+    atomic_fetch_sub_explicit(&Readers[Epoch].Count, 1, memory_order_release);
+}
+
+// Waits until no reader that started before the call can still hold an instance that
+// was removed from the table before the call
+static void
+HandleSynchronize(void)
+{
+    unsigned int Epoch;
+    int          i;
+
+    smp_mb();
+    for (i = 0; i < 2; i++) {
+        Epoch = atomic_fetch_add(&ReaderEpoch, 1) & 1;
+        while (atomic_load(&Readers[Epoch].Count)) {
+            ThreadingYield();
+        }
+    }
+}
+
+static inline HandleChunk_t*
+GetHandleChunk(
+    _In_ uint32_t Index)
+{
+    return atomic_load_explicit(&HandleChunks[Index >> HANDLE_CHUNK_SHIFT], memory_order_acquire);
+}
 
 static inline ResourceHandle_t*
 LookupHandleInstance(
     _In_ UUId_t Handle)
 {
-    return (ResourceHandle_t*)list_find_value(&Handles, (void*)(uintptr_t)Handle);
+    uint32_t          Index = Handle & HANDLE_INDEX_MASK;
+    HandleChunk_t*    Chunk = GetHandleChunk(Index);
+    ResourceHandle_t* Instance;
+    if (!Chunk) {
+        return NULL;
+    }
+
+    Instance = atomic_load_explicit(&Chunk->Slots[Index & (HANDLE_CHUNK_SIZE - 1)], memory_order_acquire);
+    if (!Instance || Instance->Id != Handle) {
+        return NULL;
+    }
+    return Instance;
 }
 
 static inline ResourceHandle_t*
@@ -82,7 +180,7 @@ AcquireHandleInstance(
     ResourceHandle_t* Instance = LookupHandleInstance(Handle);
     int               PreviousReferences;
     if (!Instance) {
-        WARNING("[acquire_handle] failed to find %u");
+        WARNING("[acquire_handle] failed to find %u", Handle);
         return NULL;
     }
 
@@ -97,6 +195,109 @@ AcquireHandleInstance(
     return Instance;
 }
 
+// Adds a new chunk of slots to the free list, the lock must not be held as the
+// chunk is allocated from the heap
+static OsStatus_t
+GrowHandleTable(void)
+{
+    HandleChunk_t* Chunk;
+    uint32_t       ChunkIndex;
+    uint32_t       i;
+
+    Chunk = (HandleChunk_t*)kmalloc(sizeof(HandleChunk_t));
+    if (!Chunk) {
+        return OsOutOfMemory;
+    }
+    memset(Chunk, 0, sizeof(HandleChunk_t));
+
+    IrqSpinlockAcquire(&HandleLock);
+    if (FreeHead != HANDLE_INDEX_NONE || HandleChunkCount == HANDLE_CHUNK_COUNT) {
+        // Either someone else grew the table in the meantime, or it is full
+        OsStatus_t Status = (FreeHead != HANDLE_INDEX_NONE) ? OsSuccess : OsOutOfMemory;
+        IrqSpinlockRelease(&HandleLock);
+        kfree(Chunk);
+        return Status;
+    }
+
+    ChunkIndex = HandleChunkCount++;
+    for (i = 0; i < HANDLE_CHUNK_SIZE; i++) {
+        uint32_t Index = (ChunkIndex << HANDLE_CHUNK_SHIFT) | i;
+        if (Index == HANDLE_INDEX_NONE || Index == HANDLE_INDEX_MASK) {
+            continue;
+        }
+
+        Chunk->NextFree[i] = HANDLE_INDEX_NONE;
+        if (FreeTail != HANDLE_INDEX_NONE) {
+            // The tail is either in the new chunk, or the list was empty when we grew
+            Chunk->NextFree[FreeTail & (HANDLE_CHUNK_SIZE - 1)] = Index;
+        }
+        else {
+            FreeHead = Index;
+        }
+        FreeTail = Index;
+    }
+    atomic_store_explicit(&HandleChunks[ChunkIndex], Chunk, memory_order_release);
+    IrqSpinlockRelease(&HandleLock);
+    return OsSuccess;
+}
+
+// Publishes the instance in a free slot and assigns the handle id
+static OsStatus_t
+InsertHandleInstance(
+    _In_ ResourceHandle_t* Instance)
+{
+    HandleChunk_t* Chunk;
+    uint32_t       Index;
+    uint32_t       Slot;
+    OsStatus_t     Status;
+
+    IrqSpinlockAcquire(&HandleLock);
+    while (FreeHead == HANDLE_INDEX_NONE) {
+        IrqSpinlockRelease(&HandleLock);
+        Status = GrowHandleTable();
+        if (Status != OsSuccess) {
+            return Status;
+        }
+        IrqSpinlockAcquire(&HandleLock);
+    }
+
+    Index = FreeHead;
+    Chunk = atomic_load_explicit(&HandleChunks[Index >> HANDLE_CHUNK_SHIFT], memory_order_relaxed);
+    Slot  = Index & (HANDLE_CHUNK_SIZE - 1);
+    FreeHead = Chunk->NextFree[Slot];
+    if (FreeHead == HANDLE_INDEX_NONE) {
+        FreeTail = HANDLE_INDEX_NONE;
+    }
+
+    Instance->Id = (UUId_t)((Chunk->Generations[Slot] << HANDLE_INDEX_BITS) | Index);
+    atomic_store_explicit(&Chunk->Slots[Slot], Instance, memory_order_release);
+    IrqSpinlockRelease(&HandleLock);
+    return OsSuccess;
+}
+
+// Unpublishes the instance and retires the id by advancing the slot generation
+static void
+RemoveHandleInstance(
+    _In_ ResourceHandle_t* Instance)
+{
+    uint32_t       Index = Instance->Id & HANDLE_INDEX_MASK;
+    HandleChunk_t* Chunk = GetHandleChunk(Index);
+    uint32_t       Slot  = Index & (HANDLE_CHUNK_SIZE - 1);
+
+    IrqSpinlockAcquire(&HandleLock);
+    atomic_store_explicit(&Chunk->Slots[Slot], NULL, memory_order_release);
+    Chunk->Generations[Slot] = (Chunk->Generations[Slot] + 1) & HANDLE_GENERATION_MASK;
+    Chunk->NextFree[Slot]    = HANDLE_INDEX_NONE;
+    if (FreeTail != HANDLE_INDEX_NONE) {
+        GetHandleChunk(FreeTail)->NextFree[FreeTail & (HANDLE_CHUNK_SIZE - 1)] = Index;
+    }
+    else {
+        FreeHead = Index;
+    }
+    FreeTail = Index;
+    IrqSpinlockRelease(&HandleLock);
+}
+
 UUId_t
 CreateHandle(
     _In_ HandleType_t Type,
@@ -104,27 +305,26 @@ CreateHandle(
     _In_ void*              Resource)
 {
     ResourceHandle_t* Instance;
-    UUId_t            HandleId;
     
     Instance = (ResourceHandle_t*)kmalloc(sizeof(ResourceHandle_t));
     if (!Instance) {
         return UUID_INVALID;
     }
     
-    HandleId = atomic_fetch_add(&HandleIdGen, 1);
     memset(Instance, 0, sizeof(ResourceHandle_t));
-    
-    ELEMENT_INIT(&Instance->Header, (uintptr_t)HandleId, Instance);
     Instance->Type       = Type;
     Instance->Resource   = Resource;
     Instance->Destructor = Destructor;
     Instance->References = ATOMIC_VAR_INIT(1);
-    smp_wmb();
     
-    list_append(&Handles, &Instance->Header);
+    if (InsertHandleInstance(Instance) != OsSuccess) {
+        kfree(Instance);
+        return UUID_INVALID;
+    }
+    ELEMENT_INIT(&Instance->Header, (uintptr_t)Instance->Id, Instance);
     
-    TRACE("[create_handle] => id %u", HandleId);
-    return HandleId;
+    TRACE("[create_handle] => id %u", Instance->Id);
+    return Instance->Id;
 }
 
 OsStatus_t
@@ -132,7 +332,9 @@ AcquireHandle(
     _In_  UUId_t Handle,
     _Out_ void** ResourceOut)
 {
+    unsigned int      Epoch    = HandleReadLock();
     ResourceHandle_t* Instance = AcquireHandleInstance(Handle);
+    HandleReadUnlock(Epoch);
     if (!Instance) {
         return OsDoesNotExist;
     }
@@ -149,10 +351,10 @@ RegisterHandlePath(
     _In_ UUId_t      Handle,
     _In_ const char* Path)
 {
-    ResourceHandle_t* Instance;
-    UUId_t            ExistingHandle;
-    char*             PathKey;
-    OsStatus_t        Status;
+    struct HandlePathEntry* Existing;
+    ResourceHandle_t*       Instance;
+    char*                   PathKey;
+    unsigned int            Epoch;
     TRACE("[handle_register_path] %u => %s", Handle, Path);
     
     if (!Path) {
@@ -160,34 +362,33 @@ RegisterHandlePath(
         return OsInvalidParameters;
     }
     
+    PathKey = strdup(Path);
+    if (!PathKey) {
+        return OsOutOfMemory;
+    }
+    
+    // The caller owns a reference, the read lock only covers ids that are stale
+    Epoch    = HandleReadLock();
     Instance = LookupSafeHandleInstance(Handle);
+    HandleReadUnlock(Epoch);
     if (!Instance) {
         ERROR("[handle_register_path] handle did not exist");
+        kfree(PathKey);
         return OsDoesNotExist;
     }
     
-    Status = LookupHandleByPath(Path, &ExistingHandle);
-    if (Instance->PathHeader || Status != OsDoesNotExist) {
-        ERROR("[handle_register_path] path already registered [%u]", Status);
+    MutexLock(&PathLock);
+    Existing = hashtable_get(&PathRegister, &(struct HandlePathEntry) { .Path = Path });
+    if (Instance->Path || Existing) {
+        MutexUnlock(&PathLock);
+        ERROR("[handle_register_path] path already registered");
+        kfree(PathKey);
         return OsExists;
     }
     
-    Instance->PathHeader = kmalloc(sizeof(element_t));
-    if (!Instance->PathHeader) {
-        return OsOutOfMemory;
-    }
-    
-    PathKey = strdup(Path);
-    if (!PathKey) {
-        kfree(Instance->PathHeader);
-        Instance->PathHeader = NULL;
-        return OsOutOfMemory;
-    }
-    
-    ELEMENT_INIT(Instance->PathHeader, PathKey, Instance);
-    smp_wmb();
-    
-    list_append(&PathRegister, Instance->PathHeader);
+    Instance->Path = PathKey;
+    hashtable_set(&PathRegister, &(struct HandlePathEntry) { .Path = PathKey, .Instance = Instance });
+    MutexUnlock(&PathLock);
     return OsSuccess;
 }
 
@@ -196,30 +397,33 @@ LookupHandleByPath(
     _In_  const char* Path,
     _Out_ UUId_t*     HandleOut)
 {
-    ResourceHandle_t* Instance;
+    struct HandlePathEntry* Entry;
+    OsStatus_t              Status = OsDoesNotExist;
     TRACE("[handle_lookup_by_path] %s", Path);
     
-    Instance = list_find_value(&PathRegister, (void*)Path);
-    if (!Instance) {
-        return OsDoesNotExist;
+    MutexLock(&PathLock);
+    Entry = hashtable_get(&PathRegister, &(struct HandlePathEntry) { .Path = Path });
+    if (Entry) {
+        *HandleOut = Entry->Instance->Id;
+        Status     = OsSuccess;
     }
-    
-    smp_rmb();
-    *HandleOut = (UUId_t)(uintptr_t)Instance->Header.key;
-    return OsSuccess;
+    MutexUnlock(&PathLock);
+    return Status;
 }
 
 void*
 LookupHandle(
     _In_ UUId_t Handle)
 {
+    unsigned int      Epoch    = HandleReadLock();
     ResourceHandle_t* Instance = LookupSafeHandleInstance(Handle);
-    if (!Instance) {
-        return NULL;
+    void*             Resource = NULL;
+    if (Instance) {
+        smp_rmb();
+        Resource = Instance->Resource;
     }
-    
-    smp_rmb();
-    return Instance->Resource;
+    HandleReadUnlock(Epoch);
+    return Resource;
 }
 
 void*
@@ -227,75 +431,121 @@ LookupHandleOfType(
     _In_ UUId_t       Handle,
     _In_ HandleType_t Type)
 {
+    unsigned int      Epoch    = HandleReadLock();
     ResourceHandle_t* Instance = LookupSafeHandleInstance(Handle);
-    if (!Instance) {
-        return NULL;
-    }
-    
-    smp_rmb();
-    if (Instance->Type != Type) {
-        return NULL;
+    void*             Resource = NULL;
+    if (Instance) {
+        smp_rmb();
+        if (Instance->Type == Type) {
+            Resource = Instance->Resource;
+        }
     }
-    return Instance->Resource;
+    HandleReadUnlock(Epoch);
+    return Resource;
 }
 
 void
 DestroyHandle(
     _In_ UUId_t Handle)
 {
+    unsigned int      Epoch    = HandleReadLock();
     ResourceHandle_t* Instance = LookupSafeHandleInstance(Handle);
     int               References;
     if (!Instance) {
+        HandleReadUnlock(Epoch);
         return;
     }
     TRACE("[destroy_handle] => %u", Handle);
 
     References = atomic_fetch_sub(&Instance->References, 1);
+    HandleReadUnlock(Epoch);
     if ((References - 1) == 0) {
         TRACE("[destroy_handle] cleaning up %u", Handle);
-        if (Instance->PathHeader) {
-            list_remove(&PathRegister, Instance->PathHeader);
+        if (Instance->Path) {
+            MutexLock(&PathLock);
+            hashtable_remove(&PathRegister, &(struct HandlePathEntry) { .Path = Instance->Path });
+            MutexUnlock(&PathLock);
         }
         
-        list_remove(&Handles, &Instance->Header);
+        RemoveHandleInstance(Instance);
         queue_push(&CleanQueue, &Instance->Header);
         SemaphoreSignal(&EventHandle, 1);
     }
 }
 
+// Frees the instances in the clean queue once no reader can reach them anymore
 static void
-HandleJanitorThread(
-    _In_Opt_ void* Args)
+ReleaseRemovedHandles(void)
 {
+    element_t*        Batch = NULL;
     element_t*        Element;
     ResourceHandle_t* Instance;
-    int               Run = 1;
+
+    Element = queue_pop(&CleanQueue);
+    while (Element) {
+        Element->next = Batch;
+        Batch         = Element;
+        Element       = queue_pop(&CleanQueue);
+    }
+
+    if (!Batch) {
+        return;
+    }
+
+    HandleSynchronize();
+    while (Batch) {
+        Element  = Batch;
+        Batch    = Batch->next;
+        Instance = (ResourceHandle_t*)Element->value;
+        if (Instance->Destructor) {
+            Instance->Destructor(Instance->Resource);
+        }
+        if (Instance->Path) {
+            kfree(Instance->Path);
+        }
+        kfree(Instance);
+    }
+}
+
+static void
+HandleJanitorThread(
+    _In_Opt_ void* Args)
+{
+    int Run = 1;
     _CRT_UNUSED(Args);
     
     while (Run) {
         SemaphoreWait(&EventHandle, 0);
-        
-        Element = queue_pop(&CleanQueue);
-        while (Element) {
-            smp_rmb();
-            Instance = (ResourceHandle_t*)Element->value;
-            if (Instance->Destructor) {
-                Instance->Destructor(Instance->Resource);
-            }
-            if (Instance->PathHeader) {
-                kfree((void*)Instance->PathHeader->key);
-                kfree((void*)Instance->PathHeader);
-            }
-            kfree(Instance);
-            
-            Element = queue_pop(&CleanQueue);
-        }
+        smp_rmb();
+        ReleaseRemovedHandles();
     }
 }
 
+static uint64_t
+HandlePathHash(
+    _In_ const void* Element)
+{
+    const struct HandlePathEntry* Entry = Element;
+    return siphash_64((const uint8_t*)Entry->Path, strlen(Entry->Path), &PathHashKey[0]);
+}
+
+static int
+HandlePathCompare(
+    _In_ const void* Element1,
+    _In_ const void* Element2)
+{
+    const struct HandlePathEntry* Entry1 = Element1;
+    const struct HandlePathEntry* Entry2 = Element2;
+    return strcmp(Entry1->Path, Entry2->Path);
+}
+
 OsStatus_t
 InitializeHandles(void)
 {
+    if (hashtable_construct(&PathRegister, HASHTABLE_MINIMUM_CAPACITY,
+            sizeof(struct HandlePathEntry), HandlePathHash, HandlePathCompare)) {
+        return OsOutOfMemory;
+    }
     return OsSuccess;
 }
 
@@ -29,9 +29,16 @@
 KERNELAPI void KERNELABI
 FutexInitialize(void);
 
+/* FutexInitializeBuckets
+ * Replaces the boot hash table with one sized after the number of cores and the amount
+ * of memory. Must be called before any threads are able to wait. */
+KERNELAPI void KERNELABI
+FutexInitializeBuckets(void);
+
 /* FutexWait
  * Performs an atomic check-and-wait operation on the given atomic variable. It must match
- * the expected value otherwise the wait is ignored. */
+ * the expected value otherwise the wait is ignored and OsExists is returned. A wait that is
+ * cut short by a signal or termination returns OsInterrupted. */
 KERNELAPI OsStatus_t KERNELABI
 FutexWait(
     _In_ _Atomic(int)* Futex,
@@ -41,7 +48,8 @@ FutexWait(
 
 /* FutexWaitOperation
  * Performs an atomic check-and-wait operation on the given atomic variable. It must match
- * the expected value otherwise the wait is ignored. */    
+ * the expected value otherwise the wait is ignored, the operation is not performed and
+ * OsExists is returned. */    
 KERNELAPI OsStatus_t KERNELABI
 FutexWaitOperation(
     _In_ _Atomic(int)* Futex,
@@ -71,4 +79,17 @@ FutexWakeOperation(
     _In_ int           Operation,
     _In_ int           Flags);
 
+/* FutexRequeue
+ * Wakes up to Count threads blocked on Futex, and moves up to Count2 of the remaining
+ * waiters to Futex2 without waking them. Nothing is done if Futex no longer holds the
+ * expected value, in which case OsInterrupted is returned. */
+KERNELAPI OsStatus_t KERNELABI
+FutexRequeue(
+    _In_ _Atomic(int)* Futex,
+    _In_ int           Count,
+    _In_ _Atomic(int)* Futex2,
+    _In_ int           Count2,
+    _In_ int           ExpectedValue,
+    _In_ int           Flags);
+
 #endif //!__FUTEX_H__
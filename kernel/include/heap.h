@@ -32,7 +32,7 @@ typedef struct MemoryCache MemoryCache_t;
 
 // Configuration options for caches
 #define HEAP_CACHE_DEFAULT        0x04U // Only set for fixed size caches
-#define HEAP_SLAB_NO_ATOMIC_CACHE 0x08U // Set to disable smp optimizations
+#define HEAP_SLAB_NO_ATOMIC_CACHE 0x08U // Set to disable the per-cpu magazines
 #define HEAP_INITIAL_SLAB         0x10U // Set to allocate the initial slab
 #define HEAP_SINGLE_SLAB          0x20U // Set to disable multiple slabs
 #define HEAP_CACHE_USERSPACE      0x40U // Set to allow the pages to accessed by userspace
@@ -69,7 +69,8 @@ void MemoryCacheDestroy(MemoryCache_t* Cache);
 
 // MemoryCacheReap
 // Performs memory cleanup on all system caches, also shrinks them if possible
-// to free up memory. Returns number of pages freed.
+// to free up memory. The per-cpu magazines are drained back into the slabs and all
+// free slabs are released. Returns number of pages freed.
 int MemoryCacheReap(void);
 
 // MemoryCacheDump
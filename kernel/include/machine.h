@@ -25,11 +25,11 @@
 #ifndef __VALI_MACHINE__
 #define __VALI_MACHINE__
 
-#include <ds/bounded_stack.h>
 #include <os/osdefs.h>
 #include <os/mollenos.h>
 #include <irq_spinlock.h>
 #include <multiboot.h>
+#include <physical_memory.h>
 #include <time.h>
 #include <utils/static_memory_pool.h>
 
@@ -51,10 +51,9 @@ typedef struct SystemMachine {
     Multiboot_t                 BootInformation;
 
     // UMA Hardware Resources
-    SystemCpu_t     Processor;      // Used in UMA mode
-    MemorySpace_t   SystemSpace;    // Used in UMA mode
-    bounded_stack_t PhysicalMemory;
-    IrqSpinlock_t   PhysicalMemoryLock;
+    SystemCpu_t      Processor;      // Used in UMA mode
+    MemorySpace_t    SystemSpace;    // Used in UMA mode
+    PhysicalMemory_t PhysicalMemory;
     
     // Global Hardware Resources
     StaticMemoryPool_t          GlobalAccessMemory;
@@ -103,7 +102,7 @@ InitializeSystemTimers(void);
 KERNELAPI OsStatus_t KERNELABI
 InitializeSystemMemory(
     _In_ Multiboot_t*        bootInformation,
-    _In_ bounded_stack_t*    boundedStack,
+    _In_ PhysicalMemory_t*   physicalMemory,
     _In_ StaticMemoryPool_t* globalAccessMemory,
     _In_ SystemMemoryMap_t*  memoryMap,
     _In_ size_t*             memoryGranularityOut,
@@ -119,4 +118,25 @@ KERNELAPI OsStatus_t KERNELABI
 AllocatePhysicalMemory(
     _In_ int        PageCount,
     _In_ uintptr_t* Pages);
+
+/**
+ * AllocatePhysicalMemoryContiguous
+ * Tries to allocate the requested number of physically contiguous memory pages
+ * @param PageCount The number of physical memory pages to allocate
+ * @return          The status of the operation
+ */
+KERNELAPI OsStatus_t KERNELABI
+AllocatePhysicalMemoryContiguous(
+    _In_ int        PageCount,
+    _In_ uintptr_t* Pages);
+
+/**
+ * FreePhysicalMemory
+ * Returns the given memory pages to the system
+ * @param PageCount The number of physical memory pages to free
+ */
+KERNELAPI void KERNELABI
+FreePhysicalMemory(
+    _In_ int        PageCount,
+    _In_ uintptr_t* Pages);
 #endif // !__VALI_MACHINE__
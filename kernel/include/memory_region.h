@@ -194,6 +194,24 @@ MemoryRegionGetSg(
     _Out_ int*           sgCountOut,
     _Out_ struct dma_sg* sgListOut);
 
+/**
+ * Retrieves the part of the scatter gather list of a memory region that covers the
+ * given range of the buffer. The first and last entries are trimmed to the range.
+ * @param handle
+ * @param offset     The offset into the buffer where the range starts.
+ * @param length     The length of the range, it is clamped to the end of the buffer.
+ * @param sgCountOut
+ * @param sgListOut
+ * @return Status of the operation
+ */
+KERNELAPI OsStatus_t KERNELABI
+MemoryRegionGetSgRange(
+    _In_  UUId_t         handle,
+    _In_  size_t         offset,
+    _In_  size_t         length,
+    _Out_ int*           sgCountOut,
+    _Out_ struct dma_sg* sgListOut);
+
 /**
  * Retrieves the kernel memory mapping for a given memory region handle
  * @param handle    The handle of the memory region
@@ -65,6 +65,7 @@ DECL_STRUCT(Context);
 #define MAPPING_TRAPPAGE                0x00000400U  // Memory pages should trigger a trpap
 
 #define MAPPING_PHYSICAL_FIXED          0x00000001U  // (Physical) Mappings are supplied
+#define MAPPING_PHYSICAL_CONTIGUOUS     0x00000020U  // (Physical) Mappings are allocated physically contiguous
 
 #define MAPPING_VIRTUAL_GLOBAL          0x00000002U  // (Virtual) Mapping is done in global access memory
 #define MAPPING_VIRTUAL_PROCESS         0x00000004U  // (Virtual) Mapping is process specific
@@ -0,0 +1,138 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Physical Memory Allocator
+ * - Buddy allocator for physical pages, fronted by per-cpu lists of hot pages
+ *   that are refilled from and drained to the buddy allocator in batches.
+ */
+
+#ifndef __PHYSICAL_MEMORY_H__
+#define __PHYSICAL_MEMORY_H__
+
+#include <os/osdefs.h>
+#include <irq_spinlock.h>
+
+#define PHYSICAL_MEMORY_ORDER_COUNT 11 // Blocks of 1 page up to 1024 pages
+#define PHYSICAL_MEMORY_MAX_CPUS    64 // Cores with a higher id use the buddy allocator directly
+#define PHYSICAL_MEMORY_CACHE_SIZE  64
+#define PHYSICAL_MEMORY_CACHE_BATCH 16
+
+typedef struct PhysicalPage PhysicalPage_t;
+
+typedef struct PhysicalMemoryCpuCache {
+    int       Count;
+    uintptr_t Pages[PHYSICAL_MEMORY_CACHE_SIZE];
+} PhysicalMemoryCpuCache_t;
+
+typedef struct PhysicalMemory {
+    IrqSpinlock_t            SyncObject;
+    PhysicalPage_t*          Pages;
+    size_t                   PageCount;
+    size_t                   PageSize;
+    uint32_t                 FreeLists[PHYSICAL_MEMORY_ORDER_COUNT];
+    size_t                   FreeBlocks[PHYSICAL_MEMORY_ORDER_COUNT];
+    PhysicalMemoryCpuCache_t CpuCaches[PHYSICAL_MEMORY_MAX_CPUS];
+} PhysicalMemory_t;
+
+/**
+ * PhysicalMemoryCalculateSize
+ * * Calculates the number of bytes of storage needed to track the given number of pages.
+ */
+KERNELAPI size_t KERNELABI
+PhysicalMemoryCalculateSize(
+    _In_ size_t PageCount);
+
+/**
+ * PhysicalMemoryConstruct
+ * * Initializes the allocator for the physical range 0 => PageCount * PageSize. All pages
+ * * start out as allocated, and usable memory must be added with PhysicalMemoryAddRange.
+ * @param PhysicalMemory [In] The allocator to initialize.
+ * @param Storage        [In] Storage of PhysicalMemoryCalculateSize(PageCount) bytes.
+ * @param PageCount      [In] The number of pages covered by the allocator.
+ * @param PageSize       [In] The size of a page in bytes.
+ */
+KERNELAPI void KERNELABI
+PhysicalMemoryConstruct(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ void*             Storage,
+    _In_ size_t            PageCount,
+    _In_ size_t            PageSize);
+
+/**
+ * PhysicalMemoryAddRange
+ * * Adds the physical range Start => End to the free memory. The range is shrunk to
+ * * page boundaries and to the pages covered by the allocator.
+ */
+KERNELAPI void KERNELABI
+PhysicalMemoryAddRange(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ uintptr_t         Start,
+    _In_ uintptr_t         End);
+
+/**
+ * PhysicalMemoryAllocate
+ * * Allocates the requested number of pages, the pages are not neccessarily contiguous.
+ * * Either all pages are allocated or none of them.
+ * @param PageCount [In]  The number of pages to allocate.
+ * @param Pages     [Out] Array of PageCount entries that receives the page addresses.
+ */
+KERNELAPI OsStatus_t KERNELABI
+PhysicalMemoryAllocate(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ int               PageCount,
+    _In_ uintptr_t*        Pages);
+
+/**
+ * PhysicalMemoryAllocateContiguous
+ * * Allocates a physically contiguous run of pages, the run is aligned to the
+ * * next power of two of the number of pages.
+ * @param PageCount [In]  The number of pages to allocate, at most 2^(PHYSICAL_MEMORY_ORDER_COUNT - 1).
+ * @param Pages     [Out] Array of PageCount entries that receives the page addresses.
+ */
+KERNELAPI OsStatus_t KERNELABI
+PhysicalMemoryAllocateContiguous(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ int               PageCount,
+    _In_ uintptr_t*        Pages);
+
+/**
+ * PhysicalMemoryFree
+ * * Frees the given pages, they can be freed in any order and grouping regardless of
+ * * how they were allocated.
+ */
+KERNELAPI void KERNELABI
+PhysicalMemoryFree(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ int               PageCount,
+    _In_ uintptr_t*        Pages);
+
+/**
+ * PhysicalMemoryGetStatistics
+ * * Retrieves the number of pages covered and the number of free pages. Pages held
+ * * in the per-cpu lists are counted as free.
+ * @param FreeBlocks [Out] Optional, receives the number of free blocks of each order.
+ */
+KERNELAPI void KERNELABI
+PhysicalMemoryGetStatistics(
+    _In_      PhysicalMemory_t* PhysicalMemory,
+    _Out_     size_t*           PageCountOut,
+    _Out_     size_t*           FreePagesOut,
+    _Out_Opt_ size_t*           FreeBlocks);
+
+#endif //!__PHYSICAL_MEMORY_H__
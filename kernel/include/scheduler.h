@@ -38,11 +38,21 @@ typedef struct list list_t;
 #define SCHEDULER_LEVEL_CRITICAL        60
 #define SCHEDULER_LEVEL_COUNT           61
 
+// The occupancy bitmap keeps one bit per level, set when the level has objects queued
+#define SCHEDULER_BITMAP_BITS           32
+#define SCHEDULER_BITMAP_WORDS          ((SCHEDULER_LEVEL_COUNT + (SCHEDULER_BITMAP_BITS - 1)) / SCHEDULER_BITMAP_BITS)
+
 // Boosts happen every 10 seconds to prevent starvation in the scheduler
 // Timeslices go from initial => initial + (2 * SCHEDULER_LEVEL_COUNT)
 #define SCHEDULER_TIMESLICE_INITIAL     10
 #define SCHEDULER_BOOST                 10000
 
+// Load balancing runs every 100ms on busy cores, and will pull an object from the
+// busiest core when the bandwidth difference exceeds the threshold. Idle cores
+// will always try to steal work before going idle.
+#define SCHEDULER_BALANCE_INTERVAL      100
+#define SCHEDULER_BALANCE_THRESHOLD     (SCHEDULER_TIMESLICE_INITIAL * 4)
+
 #define SCHEDULER_TIMEOUT_INFINITE      0
 #define SCHEDULER_SLEEP_OK              0
 #define SCHEDULER_SLEEP_INTERRUPTED     1
@@ -51,23 +61,31 @@ typedef struct list list_t;
 
 typedef struct SchedulerObject SchedulerObject_t;
 
-// Low overhead queues that are used by the scheduler, only in
-// it's own core context, so no per list locking needed
+// Low overhead queues that are used by the scheduler, they are protected
+// by the scheduler lock as other cores may steal objects from them
 typedef struct SchedulerQueue {
     SchedulerObject_t* Head;
     SchedulerObject_t* Tail;
 } SchedulerQueue_t;
 
+// The sleep queue is a deadline ordered pairing heap of objects, keyed on the
+// absolute scheduler clock. The root is always the next object to time out.
 typedef struct Scheduler {
     IrqSpinlock_t          SyncObject;
-    SchedulerQueue_t       SleepQueue;
+    SchedulerObject_t*     SleepQueue;
+    uint64_t               Clock;
+    size_t                 SleepSequence;
     SchedulerQueue_t       Queues[SCHEDULER_LEVEL_COUNT];
+    uint32_t               QueueBitmap[SCHEDULER_BITMAP_WORDS];
     _Atomic(int)           ObjectCount;
     _Atomic(unsigned long) Bandwidth;
     clock_t                LastBoost;
+    uint64_t               LastBalance;
+    size_t                 Generation;
+    _Atomic(size_t)        Migrations;
 } Scheduler_t;
 
-#define SCHEDULER_INIT { { 0 }, { 0 }, { { 0 } }, ATOMIC_VAR_INIT(0), ATOMIC_VAR_INIT(0), 0 }
+#define SCHEDULER_INIT { { 0 }, NULL, 0, 0, { { 0 } }, { 0 }, ATOMIC_VAR_INIT(0), ATOMIC_VAR_INIT(0), 0, 0, 0, ATOMIC_VAR_INIT(0) }
 
 /* SchedulerCreateObject
  * Creates a new scheduling object and allocates a cpu core for the object.
@@ -132,6 +150,15 @@ SchedulerAdvance(
     _In_  size_t             MillisecondsPassed,
     _Out_ size_t*            NextDeadlineOut);
 
+/**
+ * SchedulerGetMigrations
+ * * Retrieves the number of objects that have been migrated to the scheduler
+ * * from other cores, either by stealing or load balancing.
+ */
+KERNELAPI size_t KERNELABI
+SchedulerGetMigrations(
+    _In_ Scheduler_t* Scheduler);
+
 KERNELAPI int KERNELABI
 SchedulerObjectGetQueue(
     _In_ SchedulerObject_t*);
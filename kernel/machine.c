@@ -53,7 +53,7 @@ static SystemMachine_t Machine = {
     { 0 }, { 0 }, { 0 }, { 0 },                        // Strings
     REVISION_MAJOR, REVISION_MINOR, REVISION_BUILD,
     { 0 }, SYSTEM_CPU_INIT, { 0 }, { 0 },              // BootInformation, Processor, MemorySpace, PhysicalMemory
-    OS_IRQ_SPINLOCK_INIT, { 0 }, { { 0 } }, LIST_INIT, // GAMemory, Memory Map, SystemDomains
+    { 0 }, { { 0 } }, LIST_INIT,                       // GAMemory, Memory Map, SystemDomains
     NULL, 0, NULL,                                     // InterruptControllers
     { { { 0 } } },                                     // SystemTime
     ATOMIC_VAR_INIT(1), ATOMIC_VAR_INIT(1), 
@@ -143,6 +143,7 @@ InitializeMachine(
 #endif
 
     // Create the rest of the OS systems
+    FutexInitializeBuckets();
     Status = InitializeHandles();
     if (Status != OsSuccess) {
         ERROR("Failed to initialize the handle subsystem.");
@@ -226,16 +227,21 @@ AllocatePhysicalMemory(
     _In_ int        PageCount,
     _In_ uintptr_t* Pages)
 {
-    OsStatus_t Status = OsSuccess;
-    int        PagesAllocated;
-
-    IrqSpinlockAcquire(&GetMachine()->PhysicalMemoryLock);
-    PagesAllocated = bounded_stack_pop_multiple(&GetMachine()->PhysicalMemory, (void**)&Pages[0], PageCount);
-    if (PagesAllocated < PageCount) {
-        bounded_stack_push_multiple(&GetMachine()->PhysicalMemory, (void**)&Pages[0], PagesAllocated);
-        Status = OsOutOfMemory;
-    }
-    IrqSpinlockRelease(&GetMachine()->PhysicalMemoryLock);
+    return PhysicalMemoryAllocate(&GetMachine()->PhysicalMemory, PageCount, Pages);
+}
+
+OsStatus_t
+AllocatePhysicalMemoryContiguous(
+    _In_ int        PageCount,
+    _In_ uintptr_t* Pages)
+{
+    return PhysicalMemoryAllocateContiguous(&GetMachine()->PhysicalMemory, PageCount, Pages);
+}
 
-    return Status;
+void
+FreePhysicalMemory(
+    _In_ int        PageCount,
+    _In_ uintptr_t* Pages)
+{
+    PhysicalMemoryFree(&GetMachine()->PhysicalMemory, PageCount, Pages);
 }
\ No newline at end of file
@@ -23,6 +23,7 @@
 #define __MODULE "HEAP"
 //#define __TRACE
 
+#include <arch/interrupts.h>
 #include <arch/utils.h>
 #include <assert.h>
 #include <ddk/io.h>
@@ -36,27 +37,54 @@
 
 #define MEMORY_OVERRUN_PATTERN                      0xA5A5A5A5U
 #define MEMORY_SLAB_ONSITE_THRESHOLD                512
-#define MEMORY_ATOMIC_CACHE(Cache, Core)            (MemoryAtomicCache_t*)(Cache->AtomicCaches + (Core * (sizeof(MemoryAtomicCache_t) + (Cache->ObjectCount * sizeof(void*)))))
-#define MEMORY_ATOMIC_ELEMENT(AtomicCache, Element) ((uintptr_t**)((uintptr_t)AtomicCache + sizeof(MemoryAtomicCache_t) + (Element * sizeof(void*))))
+#define MEMORY_MAGAZINE_MAX_ROUNDS                  32
+#define MEMORY_SLAB_MAP_CHUNK_PAGES                 512
 #define MEMORY_SLAB_ELEMENT(Cache, Slab, Element)   (void*)((uintptr_t)Slab->Address + (Element * (Cache->ObjectSize + Cache->ObjectPadding)))
 
 // Slab size is equal to a page size, and memory layout of a slab is as below
 // FreeBitmap | Object | Object | Object |
 typedef struct MemorySlab {
-    element_t  Header;
-    int        NumberOfFreeObjects;
-    uintptr_t* Address;  // Points to first object
-    uint8_t*   FreeBitmap;
+    element_t           Header;
+    struct MemoryCache* Cache;
+    int                 NumberOfFreeObjects;
+    uintptr_t*          Address;  // Points to first object
+    uint8_t*            FreeBitmap;
 } MemorySlab_t;
 
-// Memory Atomic Cache is followed directly by the buffer area for pointers
-// MemoryAtomicCache_t | Pointer | Pointer | Pointer | Pointer | MemoryAtomicCache_t ...
-typedef struct MemoryAtomicCache {
-    _Atomic(int) Available;
-    int          Limit;
-} MemoryAtomicCache_t;
+// The slab map translates every page of the global access memory, which is where
+// all slabs are allocated, to the slab that owns it. It is split into chunks that
+// are allocated when the first slab is placed in the memory they cover.
+typedef _Atomic(MemorySlab_t*) MemorySlabMapEntry_t;
+
+typedef struct MemorySlabMap {
+    uintptr_t                      BaseAddress;
+    size_t                         PageCount;
+    int                            ChunkCount;
+    _Atomic(MemorySlabMapEntry_t*)* Chunks;
+} MemorySlabMap_t;
+
+// Magazines are fixed size stacks of object pointers, each core has a loaded and a
+// previous magazine it allocates from and frees to without taking any locks. Only
+// when both are exhausted are whole magazines exchanged with the depot of the cache.
+typedef struct MemoryMagazine {
+    struct MemoryMagazine* Link;
+    int                    Rounds;
+    void*                  Objects[];
+} MemoryMagazine_t;
+
+typedef struct MemoryCpuCache {
+    MemoryMagazine_t* Loaded;
+    MemoryMagazine_t* Previous;
+} MemoryCpuCache_t;
+
+typedef struct MemoryDepot {
+    IrqSpinlock_t     SyncObject;
+    MemoryMagazine_t* FullMagazines;
+    MemoryMagazine_t* EmptyMagazines;
+} MemoryDepot_t;
 
 typedef struct MemoryCache {
+    element_t        Header;
     const char*      Name;
     Mutex_t          SyncObject;
     unsigned int     Flags;
@@ -76,11 +104,17 @@ typedef struct MemoryCache {
     list_t           PartialSlabs;
     list_t           FullSlabs;
 
-    uintptr_t        AtomicCaches;
+    MemoryCpuCache_t* CpuCaches;
+    int               CpuCacheCount;
+    int               MagazineSize;
+    MemoryDepot_t     Depot;
 } MemoryCache_t;
 
 // All the standard caches DO not use contigious memory
 static MemoryCache_t g_initialCache = { 0 };
+static list_t        g_caches       = LIST_INIT;
+static _Atomic(int)  g_reaping      = ATOMIC_VAR_INIT(0);
+static MemorySlabMap_t g_slabMap    = { 0 };
 static struct FixedCache {
     size_t         ObjectSize;
     const char*    Name;
@@ -141,6 +175,107 @@ free_virtual_memory(
     }
 }
 
+static int
+slab_map_pages_for(
+    _In_ size_t Length)
+{
+    size_t PageSize = GetMemorySpacePageSize();
+    return (int)((Length + PageSize - 1) / PageSize);
+}
+
+static void
+slab_map_initialize(void)
+{
+    size_t    PageSize = GetMemorySpacePageSize();
+    size_t    Length;
+    uintptr_t Chunks;
+
+    g_slabMap.BaseAddress = GetMachine()->GlobalAccessMemory.StartAddress;
+    g_slabMap.PageCount   = GetMachine()->GlobalAccessMemory.Length / PageSize;
+    g_slabMap.ChunkCount  = (int)((g_slabMap.PageCount + MEMORY_SLAB_MAP_CHUNK_PAGES - 1) / MEMORY_SLAB_MAP_CHUNK_PAGES);
+
+    Length = g_slabMap.ChunkCount * sizeof(MemorySlabMapEntry_t*);
+    Chunks = allocate_virtual_memory(slab_map_pages_for(Length), 0);
+    if (!Chunks) {
+        FATAL(FATAL_SCOPE_KERNEL, "Failed to allocate the slab map");
+    }
+    memset((void*)Chunks, 0, Length);
+    g_slabMap.Chunks = (_Atomic(MemorySlabMapEntry_t*)*)Chunks;
+}
+
+static MemorySlabMapEntry_t*
+slab_map_entry(
+    _In_ uintptr_t Address,
+    _In_ int       Create)
+{
+    MemorySlabMapEntry_t* Chunk;
+    MemorySlabMapEntry_t* Expected = NULL;
+    size_t                Length   = MEMORY_SLAB_MAP_CHUNK_PAGES * sizeof(MemorySlabMapEntry_t);
+    size_t                Page;
+
+    if (Address < g_slabMap.BaseAddress) {
+        return NULL;
+    }
+
+    Page = (Address - g_slabMap.BaseAddress) / GetMemorySpacePageSize();
+    if (Page >= g_slabMap.PageCount) {
+        return NULL;
+    }
+
+    Chunk = atomic_load(&g_slabMap.Chunks[Page / MEMORY_SLAB_MAP_CHUNK_PAGES]);
+    if (!Chunk && Create) {
+        // Chunks are never freed again, install it unless someone else beat us to it
+        Chunk = (MemorySlabMapEntry_t*)allocate_virtual_memory(slab_map_pages_for(Length), 0);
+        if (!Chunk) {
+            return NULL;
+        }
+        memset(Chunk, 0, Length);
+
+        if (!atomic_compare_exchange_strong(&g_slabMap.Chunks[Page / MEMORY_SLAB_MAP_CHUNK_PAGES], &Expected, Chunk)) {
+            free_virtual_memory((uintptr_t)Chunk, slab_map_pages_for(Length));
+            Chunk = Expected;
+        }
+    }
+
+    if (!Chunk) {
+        return NULL;
+    }
+    return &Chunk[Page % MEMORY_SLAB_MAP_CHUNK_PAGES];
+}
+
+static OsStatus_t
+slab_map_set(
+    _In_ uintptr_t     Address,
+    _In_ int           PageCount,
+    _In_ MemorySlab_t* Slab)
+{
+    size_t PageSize = GetMemorySpacePageSize();
+    int    i;
+
+    for (i = 0; i < PageCount; i++) {
+        MemorySlabMapEntry_t* Entry = slab_map_entry(Address + (i * PageSize), Slab != NULL);
+        if (!Entry) {
+            if (Slab != NULL) {
+                return OsOutOfMemory;
+            }
+            continue;
+        }
+        atomic_store(Entry, Slab);
+    }
+    return OsSuccess;
+}
+
+static MemorySlab_t*
+slab_map_lookup(
+    _In_ uintptr_t Address)
+{
+    MemorySlabMapEntry_t* Entry = slab_map_entry(Address, 0);
+    if (!Entry) {
+        return NULL;
+    }
+    return atomic_load(Entry);
+}
+
 static inline struct FixedCache*
 cache_find_fixed_size(
     _In_ size_t Size)
@@ -249,6 +384,8 @@ slab_destroy_objects(
     }
 }
 
+static void slab_destroy(MemoryCache_t*, MemorySlab_t*);
+
 static MemorySlab_t* 
 slab_create(
     _In_ MemoryCache_t* cache)
@@ -297,10 +434,18 @@ slab_create(
     memset(slab, 0, cache->SlabStructureSize);
 
     ELEMENT_INIT(&slab->Header, 0, slab);
+    slab->Cache               = cache;
     slab->NumberOfFreeObjects = cache->ObjectCount;
     slab->FreeBitmap          = (uint8_t*)((uintptr_t)slab + sizeof(MemorySlab_t));
     slab->Address             = (uintptr_t*)objectAddress;
     slab_initalize_objects(cache, slab);
+    
+    // Register the pages of the slab so objects can be traced back to it
+    if (slab_map_set(dataAddress, cache->PageCount, slab) != OsSuccess) {
+        ERROR("[heap] [slab_create] failed to register slab in the slab map");
+        slab_destroy(cache, slab);
+        return NULL;
+    }
     return slab;
 }
 
@@ -308,6 +453,9 @@ static void slab_destroy(
     _In_ MemoryCache_t* Cache,
     _In_ MemorySlab_t*  Slab)
 {
+    uintptr_t DataAddress = Cache->SlabOnSite ? (uintptr_t)Slab : (uintptr_t)Slab->Address;
+    
+    (void)slab_map_set(DataAddress, Cache->PageCount, NULL);
     slab_destroy_objects(Cache, Slab);
     if (!Cache->SlabOnSite) {
         free_virtual_memory((uintptr_t)Slab->Address, Cache->PageCount);
@@ -359,114 +507,236 @@ cache_dump_information(
     WRITELINE("");
 }
 
-struct FindSlabContext {
-    MemoryCache_t* Cache;
-    uintptr_t      Address;
-    int            Found;
-};
+static inline size_t
+cache_calculate_slab_structure_size(
+    _In_ size_t objectsPerSlab)
+{
+    size_t slabStructure = sizeof(MemorySlab_t);
+    // Calculate how many bytes the slab metadata will need
+    slabStructure += (objectsPerSlab / 8);
+    if (objectsPerSlab % 8) {
+        slabStructure++;
+    }
+    return slabStructure;
+}
 
-static int
-SlabContainsAddress(
-    _In_ int        Unused,
-    _In_ element_t* element,
-    _In_ void*      contextPointer)
+static MemoryMagazine_t*
+magazine_create(
+    _In_ MemoryCache_t* Cache)
 {
-    struct FindSlabContext* Context = contextPointer;
-    int                     Index   = slab_contains_address(
-            Context->Cache, element->value, Context->Address);
-    
-    if (Index == -1) {
-        return LIST_ENUMERATE_CONTINUE;
+    MemoryMagazine_t* Magazine = kmalloc(sizeof(MemoryMagazine_t) + (Cache->MagazineSize * sizeof(void*)));
+    if (Magazine) {
+        Magazine->Link   = NULL;
+        Magazine->Rounds = 0;
     }
-    
-    Context->Found = 1;
-    return LIST_ENUMERATE_STOP;
+    return Magazine;
 }
 
-static int
-cache_contains_address(
-    _In_ MemoryCache_t* cache,
-    _In_ uintptr_t      address)
+// Per-cpu caches are created on first use, as the number of cores is not known
+// when the first caches are constructed, and to avoid recursive allocations in
+// the default caches while they are being created.
+static void
+cache_initialize_cpu_caches(
+    _In_ MemoryCache_t* Cache)
 {
-    struct FindSlabContext Context = {
-        .Cache   = cache,
-        .Address = address,
-        .Found   = 0
-    };
+    int               NumberOfCores = atomic_load(&GetMachine()->NumberOfCores);
+    MemoryCpuCache_t* CpuCaches;
     
-    TRACE("cache_contains_address(%s, 0x%" PRIxIN ")", cache->Name, address);
-
-    // Check partials first, we have to lock the cache as slabs can 
-    // get rearranged as we go, which is not ideal
-    MutexLock(&cache->SyncObject);
-    list_enumerate(&cache->PartialSlabs, SlabContainsAddress, &Context);
-    if (!Context.Found) {
-        list_enumerate(&cache->FullSlabs, SlabContainsAddress, &Context);
+    if (NumberOfCores <= 0) {
+        return;
+    }
+    
+    MutexLock(&Cache->SyncObject);
+    if (Cache->CpuCaches == NULL) {
+        CpuCaches = kmalloc(NumberOfCores * sizeof(MemoryCpuCache_t));
+        if (CpuCaches) {
+            memset(CpuCaches, 0, NumberOfCores * sizeof(MemoryCpuCache_t));
+            Cache->CpuCacheCount = NumberOfCores;
+            smp_wmb();
+            Cache->CpuCaches = CpuCaches;
+        }
     }
-    MutexUnlock(&cache->SyncObject);
-    return Context.Found;
+    MutexUnlock(&Cache->SyncObject);
 }
 
-static inline size_t
-cache_calculate_slab_structure_size(
-    _In_ size_t objectsPerSlab)
+static void*
+cache_cpu_allocate(
+    _In_ MemoryCache_t* Cache)
 {
-    size_t slabStructure = sizeof(MemorySlab_t);
-    // Calculate how many bytes the slab metadata will need
-    slabStructure += (objectsPerSlab / 8);
-    if (objectsPerSlab % 8) {
-        slabStructure++;
+    MemoryCpuCache_t* CpuCache;
+    MemoryMagazine_t* Magazine;
+    void*             Object = NULL;
+    IntStatus_t       IrqState;
+    UUId_t            CoreId;
+    
+    // Disabling interrupts keeps us on this core and protects against
+    // preemption while the magazines are touched
+    IrqState = InterruptDisable();
+    CoreId   = ArchGetProcessorCoreId();
+    if (CoreId >= (UUId_t)Cache->CpuCacheCount) {
+        InterruptRestoreState(IrqState);
+        return NULL;
     }
-    return slabStructure;
+    
+    CpuCache = &Cache->CpuCaches[CoreId];
+    if (!CpuCache->Loaded || !CpuCache->Loaded->Rounds) {
+        if (CpuCache->Previous && CpuCache->Previous->Rounds) {
+            Magazine           = CpuCache->Loaded;
+            CpuCache->Loaded   = CpuCache->Previous;
+            CpuCache->Previous = Magazine;
+        }
+        else {
+            // Exchange the empty previous magazine with a full one from the depot
+            IrqSpinlockAcquire(&Cache->Depot.SyncObject);
+            Magazine = Cache->Depot.FullMagazines;
+            if (Magazine) {
+                Cache->Depot.FullMagazines = Magazine->Link;
+                if (CpuCache->Previous) {
+                    CpuCache->Previous->Link    = Cache->Depot.EmptyMagazines;
+                    Cache->Depot.EmptyMagazines = CpuCache->Previous;
+                }
+                CpuCache->Previous = CpuCache->Loaded;
+                CpuCache->Loaded   = Magazine;
+            }
+            IrqSpinlockRelease(&Cache->Depot.SyncObject);
+        }
+    }
+    
+    if (CpuCache->Loaded && CpuCache->Loaded->Rounds) {
+        Object = CpuCache->Loaded->Objects[--CpuCache->Loaded->Rounds];
+    }
+    InterruptRestoreState(IrqState);
+    return Object;
 }
 
-static size_t
-cache_calculate_atomic_cache(
-    _In_ MemoryCache_t* cache)
+static int
+cache_cpu_free(
+    _In_ MemoryCache_t* Cache,
+    _In_ void*          Object)
 {
-    // number of cpu * cpu_cache_objects + number of cpu * objects per slab * pointer size
-    size_t bytesRequired = 0;
-    int    numberOfCores = atomic_load(&GetMachine()->NumberOfCores);
+    MemoryCpuCache_t* CpuCache;
+    MemoryMagazine_t* Magazine;
+    IntStatus_t       IrqState;
+    UUId_t            CoreId;
+    int               Stored = 0;
+    
+    IrqState = InterruptDisable();
+    CoreId   = ArchGetProcessorCoreId();
+    if (CoreId >= (UUId_t)Cache->CpuCacheCount) {
+        InterruptRestoreState(IrqState);
+        return 0;
+    }
     
-    if (numberOfCores > 1) {
-        bytesRequired = (numberOfCores *
-                         (sizeof(MemoryAtomicCache_t) + (cache->ObjectCount * sizeof(void*))));
-        if (cache_find_fixed_size(bytesRequired) == NULL) {
-            bytesRequired = 0;
+    CpuCache = &Cache->CpuCaches[CoreId];
+    if (!CpuCache->Loaded || CpuCache->Loaded->Rounds == Cache->MagazineSize) {
+        if (CpuCache->Previous && !CpuCache->Previous->Rounds) {
+            Magazine           = CpuCache->Loaded;
+            CpuCache->Loaded   = CpuCache->Previous;
+            CpuCache->Previous = Magazine;
+        }
+        else {
+            // Exchange the full previous magazine with an empty one from the depot
+            IrqSpinlockAcquire(&Cache->Depot.SyncObject);
+            Magazine = Cache->Depot.EmptyMagazines;
+            if (Magazine) {
+                Cache->Depot.EmptyMagazines = Magazine->Link;
+                if (CpuCache->Previous) {
+                    CpuCache->Previous->Link   = Cache->Depot.FullMagazines;
+                    Cache->Depot.FullMagazines = CpuCache->Previous;
+                }
+                CpuCache->Previous = CpuCache->Loaded;
+                CpuCache->Loaded   = Magazine;
+            }
+            IrqSpinlockRelease(&Cache->Depot.SyncObject);
         }
     }
-    return bytesRequired;
+    
+    if (CpuCache->Loaded && CpuCache->Loaded->Rounds < Cache->MagazineSize) {
+        CpuCache->Loaded->Objects[CpuCache->Loaded->Rounds++] = Object;
+        Stored = 1;
+    }
+    InterruptRestoreState(IrqState);
+    return Stored;
 }
 
 static void
-cache_initialize_atomic_cache(
-    _In_ MemoryCache_t* cache)
+cache_depot_add_empty(
+    _In_ MemoryCache_t*    Cache,
+    _In_ MemoryMagazine_t* Magazine)
 {
-    size_t atomicCacheSize = cache_calculate_atomic_cache(cache);
-    int    numberOfCores   = atomic_load(&GetMachine()->NumberOfCores);
-    int    i;
-    if (atomicCacheSize) {
-        cache->AtomicCaches = (uintptr_t)kmalloc(atomicCacheSize);
-        if (!cache->AtomicCaches) {
-            return;
+    // Surplus empty magazines are released again by MemoryCacheReap
+    IrqSpinlockAcquire(&Cache->Depot.SyncObject);
+    Magazine->Link              = Cache->Depot.EmptyMagazines;
+    Cache->Depot.EmptyMagazines = Magazine;
+    IrqSpinlockRelease(&Cache->Depot.SyncObject);
+}
+
+// Moves the magazines of the calling core into the depot of the cache, after this
+// the objects can be returned to their slabs.
+static void
+cache_drain_cpu_cache(
+    _In_ MemoryCache_t* Cache)
+{
+    MemoryMagazine_t* Magazines[2];
+    MemoryCpuCache_t* CpuCache;
+    IntStatus_t       IrqState;
+    UUId_t            CoreId;
+    int               i;
+    
+    IrqState = InterruptDisable();
+    CoreId   = ArchGetProcessorCoreId();
+    if (Cache->CpuCaches == NULL || CoreId >= (UUId_t)Cache->CpuCacheCount) {
+        InterruptRestoreState(IrqState);
+        return;
+    }
+    
+    CpuCache           = &Cache->CpuCaches[CoreId];
+    Magazines[0]       = CpuCache->Loaded;
+    Magazines[1]       = CpuCache->Previous;
+    CpuCache->Loaded   = NULL;
+    CpuCache->Previous = NULL;
+    
+    IrqSpinlockAcquire(&Cache->Depot.SyncObject);
+    for (i = 0; i < 2; i++) {
+        if (Magazines[i] == NULL) {
+            continue;
         }
         
-        memset((void*)cache->AtomicCaches, 0, atomicCacheSize);
-        for (i = 0; i < numberOfCores; i++) {
-            MemoryAtomicCache_t* AtomicCache = MEMORY_ATOMIC_CACHE(cache, i);
-            AtomicCache->Available           = ATOMIC_VAR_INIT(0);
-            AtomicCache->Limit               = cache->ObjectCount;
+        if (Magazines[i]->Rounds) {
+            Magazines[i]->Link         = Cache->Depot.FullMagazines;
+            Cache->Depot.FullMagazines = Magazines[i];
+        }
+        else {
+            Magazines[i]->Link          = Cache->Depot.EmptyMagazines;
+            Cache->Depot.EmptyMagazines = Magazines[i];
         }
     }
+    IrqSpinlockRelease(&Cache->Depot.SyncObject);
+    InterruptRestoreState(IrqState);
 }
 
 static void
-cache_drain_atomic_cache(
-    _In_ MemoryCache_t* Cache)
+cache_drain_all_on_core(
+    _In_ void* Context)
+{
+    element_t* i;
+    _CRT_UNUSED(Context);
+    
+    cache_drain_cpu_cache(&g_initialCache);
+    _foreach(i, &g_caches) {
+        cache_drain_cpu_cache(i->value);
+    }
+}
+
+static void
+cache_free_magazines(
+    _In_ MemoryMagazine_t* Magazine)
 {
-    // Send out IPI to all cores to empty their caches and put them into the gloal
-    // cache, this should be done when attempting to free up memory.
-    // @todo
+    while (Magazine) {
+        MemoryMagazine_t* Next = Magazine->Link;
+        kfree(Magazine);
+        Magazine = Next;
+    }
 }
 
 // Object size is the size of the actual object
@@ -584,19 +854,21 @@ MemoryCacheConstruct(
     Cache->ObjectPadding       = ObjectPadding;
     Cache->ObjectConstructor   = ObjectConstructor;
     Cache->ObjectDestructor    = ObjectDestructor;
-    Cache->AtomicCaches        = 0;
+    Cache->CpuCaches           = NULL;
+    Cache->CpuCacheCount       = 0;
     Cache->NumberOfFreeObjects = 0;
     
+    ELEMENT_INIT(&Cache->Header, 0, Cache);
     list_construct(&Cache->FreeSlabs);
     list_construct(&Cache->PartialSlabs);
     list_construct(&Cache->FullSlabs);
     
-    cache_calculate_slab_size(Cache, ObjectSize, ObjectAlignment, ObjectPadding, ObjectMinCount);
+    IrqSpinlockConstruct(&Cache->Depot.SyncObject);
+    Cache->Depot.FullMagazines  = NULL;
+    Cache->Depot.EmptyMagazines = NULL;
     
-    // We only perform this if it has been requested and is not a default cache
-    if (!(Cache->Flags & (HEAP_CACHE_DEFAULT | HEAP_SLAB_NO_ATOMIC_CACHE))) {
-        cache_initialize_atomic_cache(Cache);
-    }
+    cache_calculate_slab_size(Cache, ObjectSize, ObjectAlignment, ObjectPadding, ObjectMinCount);
+    Cache->MagazineSize = MIN(Cache->ObjectCount, MEMORY_MAGAZINE_MAX_ROUNDS);
     
     // Should we create the initial slab?
     if (Flags & HEAP_INITIAL_SLAB) {
@@ -642,6 +914,7 @@ MemoryCacheCreate(
     
     MemoryCacheConstruct(Cache, Name, ObjectSize, ObjectAlignment, ObjectMinCount, 
         Flags, ObjectConstructor, ObjectDestructor);
+    list_append(&g_caches, &Cache->Header);
     return Cache;
 }
 
@@ -667,40 +940,35 @@ void
 MemoryCacheDestroy(
     _In_ MemoryCache_t* Cache)
 {
-    // If there are any cpu caches, free them, there is no need to drain the cpu caches
-    // here at this point as we assume that when destroying a cache we do it for good reason
-    if (Cache->AtomicCaches != 0) {
-        kfree((void*)Cache->AtomicCaches);
+    int i;
+    
+    list_remove(&g_caches, &Cache->Header);
+    
+    // If there are any cpu caches, free them, there is no need to return the objects
+    // to the slabs at this point as we assume that when destroying a cache we do it for good reason
+    if (Cache->CpuCaches != NULL) {
+        for (i = 0; i < Cache->CpuCacheCount; i++) {
+            cache_free_magazines(Cache->CpuCaches[i].Loaded);
+            cache_free_magazines(Cache->CpuCaches[i].Previous);
+        }
+        kfree(Cache->CpuCaches);
     }
+    cache_free_magazines(Cache->Depot.FullMagazines);
+    cache_free_magazines(Cache->Depot.EmptyMagazines);
+    
     cache_destroy_list(Cache, &Cache->FreeSlabs);
     cache_destroy_list(Cache, &Cache->PartialSlabs);
     cache_destroy_list(Cache, &Cache->FullSlabs);
     MemoryCacheFree(&g_initialCache, Cache);
 }
 
-void*
-MemoryCacheAllocate(
+static void*
+cache_slab_allocate(
     _In_ MemoryCache_t* Cache)
 {
     MemorySlab_t* Slab;
     void*         Allocated;
     int           Index;
-    TRACE("MemoryCacheAllocate(%s)", Cache->Name);
-
-    // Can we allocate from cpu cache? No need to use explicit macros with memory
-    // barriers here as there is no risc of other cpus changing the atomic caches
-    if (Cache->AtomicCaches != 0) {
-        MemoryAtomicCache_t* AtomicCache = MEMORY_ATOMIC_CACHE(Cache, ArchGetProcessorCoreId());
-        int Available = atomic_load(&AtomicCache->Available);
-        while (Available) {
-            if (atomic_compare_exchange_weak(&AtomicCache->Available, &Available, Available - 1)) {
-                Allocated = MEMORY_ATOMIC_ELEMENT(AtomicCache, (Available - 1))[0];
-                TRACE("[heap] [%s] ATOMIC ALLOC 0x%" PRIxIN " (%u, %u, %u)", 
-                    Cache->Name, Allocated, Cache->ObjectSize, Cache->ObjectPadding, Available);
-                return Allocated;
-            }
-        }
-    }
 
     MutexLock(&Cache->SyncObject);
     if (Cache->NumberOfFreeObjects) {
@@ -767,38 +1035,66 @@ MemoryCacheAllocate(
     return Allocated;
 }
 
-struct FreeContext {
-    MemoryCache_t* Cache;
-    uintptr_t      Object;
-    element_t*     Element;
-    int            AddToFree;
-};
-
-static int
-FreeInSlab(
-    _In_ int        Unused,
-    _In_ element_t* Element,
-    _In_ void*      ContextPointer)
+void*
+MemoryCacheAllocate(
+    _In_ MemoryCache_t* Cache)
 {
-    struct FreeContext* Context = ContextPointer;
-    MemorySlab_t*       Slab    = Element->value;
-    int                 Index   = slab_contains_address(Context->Cache, Slab, Context->Object);
-    int                 Result  = LIST_ENUMERATE_STOP;
-    
-    if (Index == -1) {
-        return LIST_ENUMERATE_CONTINUE;
+    void* Allocated;
+    TRACE("MemoryCacheAllocate(%s)", Cache->Name);
+
+    // Can we allocate from cpu cache?
+    if (Cache->CpuCaches != NULL) {
+        Allocated = cache_cpu_allocate(Cache);
+        if (Allocated) {
+            TRACE("[heap] [%s] CPU ALLOC 0x%" PRIxIN, Cache->Name, Allocated);
+            return Allocated;
+        }
+    }
+
+    Allocated = cache_slab_allocate(Cache);
+    if (!Allocated && !(Cache->Flags & HEAP_SINGLE_SLAB)) {
+        // Return the memory held by the cpu caches and free slabs of all caches
+        // to the system, and then give it one more try
+        if (MemoryCacheReap()) {
+            Allocated = cache_slab_allocate(Cache);
+        }
     }
+    return Allocated;
+}
+
+static void
+cache_slab_free(
+    _In_ MemoryCache_t* Cache,
+    _In_ void*          Object)
+{
+    MemorySlab_t* Slab = slab_map_lookup((uintptr_t)Object);
+    int           Index;
+    int           WasFull;
     
-    slab_free_index(Context->Cache, Slab, Index);
-    if (Slab->NumberOfFreeObjects == Context->Cache->ObjectCount) {
-        Context->AddToFree = 1;
-        Result |= LIST_ENUMERATE_REMOVE;
+    if (!Slab || Slab->Cache != Cache) {
+        ERROR("[heap] [%s] object 0x%" PRIxIN " does not belong to the cache", Cache->Name, Object);
+        assert(0);
+        return;
     }
     
-    Context->Element = Element;
-    Context->Cache->NumberOfFreeObjects++;
+    Index = slab_contains_address(Cache, Slab, (uintptr_t)Object);
+    assert(Index != -1);
+
+    MutexLock(&Cache->SyncObject);
+    WasFull = (Slab->NumberOfFreeObjects == 0);
+    slab_free_index(Cache, Slab, Index);
+    Cache->NumberOfFreeObjects++;
     
-    return Result;
+    // A slab can go directly from full to free if the count is 1
+    if (Slab->NumberOfFreeObjects == Cache->ObjectCount) {
+        list_remove(WasFull ? &Cache->FullSlabs : &Cache->PartialSlabs, &Slab->Header);
+        list_append(&Cache->FreeSlabs, &Slab->Header);
+    }
+    else if (WasFull) {
+        list_remove(&Cache->FullSlabs, &Slab->Header);
+        list_append(&Cache->PartialSlabs, &Slab->Header);
+    }
+    MutexUnlock(&Cache->SyncObject);
 }
 
 void
@@ -806,12 +1102,7 @@ MemoryCacheFree(
     _In_ MemoryCache_t* Cache,
     _In_ void*          Object)
 {
-    struct FreeContext Context = { 
-        .Cache     = Cache, 
-        .Object    = (uintptr_t)Object, 
-        .Element   = NULL, 
-        .AddToFree = 0
-    };
+    MemoryMagazine_t* Magazine;
     
     TRACE("MemoryCacheFree(%s, 0x%" PRIxIN ")", Cache->Name, Object);
 
@@ -820,53 +1111,103 @@ MemoryCacheFree(
         memset(Object, MEMORY_OVERRUN_PATTERN, Cache->ObjectSize);
     }
 
-    // Can we push to cpu cache?
-    if (Cache->AtomicCaches != 0) {
-        TRACE("[heap] [%s] ATOMIC FREE 0x%" PRIxIN, Cache->Name, Object);
-        MemoryAtomicCache_t* AtomicCache = MEMORY_ATOMIC_CACHE(Cache, ArchGetProcessorCoreId());
-        int Available = atomic_load(&AtomicCache->Available);
-        while (Available < AtomicCache->Limit) {
-            if (atomic_compare_exchange_weak(&AtomicCache->Available, &Available, Available + 1)) {
-                MEMORY_ATOMIC_ELEMENT(AtomicCache, Available)[0] = Object;
+    if (Cache->CpuCaches == NULL && !(Cache->Flags & HEAP_SLAB_NO_ATOMIC_CACHE)) {
+        cache_initialize_cpu_caches(Cache);
+    }
+
+    // Can we push to cpu cache? If both magazines of this core are full and the depot
+    // has no empty magazines, then allocate a new one for the depot and try again
+    if (Cache->CpuCaches != NULL) {
+        if (cache_cpu_free(Cache, Object)) {
+            return;
+        }
+        
+        Magazine = magazine_create(Cache);
+        if (Magazine) {
+            cache_depot_add_empty(Cache, Magazine);
+            if (cache_cpu_free(Cache, Object)) {
                 return;
             }
         }
-        
-        // If the atomic cache is full then drain it
     }
+    cache_slab_free(Cache, Object);
+}
 
-    MutexLock(&Cache->SyncObject);
-    list_enumerate(&Cache->PartialSlabs, FreeInSlab, &Context);
-    if (Context.AddToFree) {
-        list_append(&Cache->FreeSlabs, Context.Element);
-    }
-    
-    // Element was not present in partial slabs, check the full slabs now
-    if (!Context.Element) {
-        list_enumerate(&Cache->FullSlabs, FreeInSlab, &Context);
-        if (Context.Element) {
-            // AddToFree is set if the object was removed already
-            if (!Context.AddToFree) {
-                list_remove(&Cache->FullSlabs, Context.Element);
-            }
-            
-            // A slab can go directly from full to free if the count is 1
-            if (Cache->ObjectCount == 1) {
-                list_append(&Cache->FreeSlabs, Context.Element);
-            }
-            else {
-                list_append(&Cache->PartialSlabs, Context.Element);
-            }
+static size_t
+cache_reap(
+    _In_ MemoryCache_t* Cache)
+{
+    MemoryMagazine_t* FullMagazines;
+    MemoryMagazine_t* EmptyMagazines;
+    MemoryMagazine_t* Magazine;
+    element_t*        Element;
+    size_t            PagesFreed = 0;
+    int               i;
+    
+    // Detach all the magazines that were drained into the depot
+    IrqSpinlockAcquire(&Cache->Depot.SyncObject);
+    FullMagazines               = Cache->Depot.FullMagazines;
+    EmptyMagazines              = Cache->Depot.EmptyMagazines;
+    Cache->Depot.FullMagazines  = NULL;
+    Cache->Depot.EmptyMagazines = NULL;
+    IrqSpinlockRelease(&Cache->Depot.SyncObject);
+    
+    // Return the objects of the full magazines to their slabs
+    Magazine = FullMagazines;
+    while (Magazine) {
+        for (i = 0; i < Magazine->Rounds; i++) {
+            cache_slab_free(Cache, Magazine->Objects[i]);
         }
+        Magazine = Magazine->Link;
     }
-    MutexUnlock(&Cache->SyncObject);
+    
+    // Free slabs are of no use, unless the cache can only have one
+    if (!(Cache->Flags & HEAP_SINGLE_SLAB)) {
+        MutexLock(&Cache->SyncObject);
+        Element = list_front(&Cache->FreeSlabs);
+        while (Element) {
+            list_remove(&Cache->FreeSlabs, Element);
+            slab_destroy(Cache, Element->value);
+            Cache->NumberOfFreeObjects -= Cache->ObjectCount;
+            PagesFreed                 += Cache->PageCount;
+            Element = list_front(&Cache->FreeSlabs);
+        }
+        MutexUnlock(&Cache->SyncObject);
+    }
+    
+    cache_free_magazines(FullMagazines);
+    cache_free_magazines(EmptyMagazines);
+    return PagesFreed;
 }
 
 int MemoryCacheReap(void)
 {
-    // Iterate the caches in the system and drain their cpu caches
-    // Then start looking at the entirely free slabs, and free them.
-    return 0;
+    element_t* i;
+    size_t     PagesFreed = 0;
+    int        Reaping    = 0;
+    
+    // Sending the drain messages may allocate, and fail, so protect against recursion
+    if (!atomic_compare_exchange_strong(&g_reaping, &Reaping, 1)) {
+        return 0;
+    }
+    
+    // Drain the cpu caches of this core, and ask the other cores to do the same. Their
+    // magazines will be picked up by the next reap if they are not done in time.
+    cache_drain_all_on_core(NULL);
+    if (atomic_load(&GetMachine()->NumberOfActiveCores) > 1) {
+        (void)ProcessorMessageSend(1, CpuFunctionCustom, cache_drain_all_on_core, NULL, 1);
+    }
+    
+    _foreach(i, &g_caches) {
+        PagesFreed += cache_reap(i->value);
+    }
+    
+    // Default caches are all present in the cache list, so only their structure
+    // cache needs to be reaped here, do it last as we freed caches above
+    PagesFreed += cache_reap(&g_initialCache);
+    atomic_store(&g_reaping, 0);
+    TRACE("[heap] [reap] %" PRIuIN " pages returned", PagesFreed);
+    return (int)PagesFreed;
 }
 
 void* kmalloc(size_t Size)
@@ -902,34 +1243,24 @@ void* kmalloc_p(size_t Size, uintptr_t* DmaOut)
 
 void kfree(void* Object)
 {
-    struct FixedCache* Selected = NULL;
-    int                i = 0;
-
     // Find the cache that the allocation was done in
-    while (g_defaultCaches[i].ObjectSize != 0) {
-        if (g_defaultCaches[i].Cache != NULL) {
-            if (cache_contains_address(g_defaultCaches[i].Cache, (uintptr_t)Object)) {
-                Selected = &g_defaultCaches[i];
-                break;
-            }
-        }
-        i++;
-    }
-    if (Selected == NULL) {
+    MemorySlab_t* Slab = slab_map_lookup((uintptr_t)Object);
+    if (Slab == NULL || !(Slab->Cache->Flags & HEAP_CACHE_DEFAULT)) {
         ERROR("Could not find a cache for object 0x%" PRIxIN "", Object);
         MemoryCacheDump(NULL);
         assert(0);
+        return;
     }
-    MemoryCacheFree(Selected->Cache, Object);
+    MemoryCacheFree(Slab->Cache, Object);
 }
 
 void
 MemoryCacheDump(
     _In_ MemoryCache_t* Cache)
 {
-    int MaxBlocks  = GetMachine()->PhysicalMemory.capacity;
-    int FreeBlocks = GetMachine()->PhysicalMemory.index;
-    int i          = 0;
+    size_t MaxBlocks;
+    size_t FreeBlocks;
+    int    i = 0;
     
     if (Cache != NULL) {
         cache_dump_information(Cache);
@@ -945,6 +1276,7 @@ MemoryCacheDump(
     }
     
     // Dump memory information
+    PhysicalMemoryGetStatistics(&GetMachine()->PhysicalMemory, &MaxBlocks, &FreeBlocks, NULL);
     WRITELINE("\nMemory Stats: %" PRIuIN "/%" PRIuIN " Bytes, %" PRIuIN "/%" PRIuIN " Blocks",
         (MaxBlocks - FreeBlocks) * GetMemorySpacePageSize(), 
         MaxBlocks * GetMemorySpacePageSize(), MaxBlocks - FreeBlocks, MaxBlocks);
@@ -953,6 +1285,9 @@ MemoryCacheDump(
 void
 MemoryCacheInitialize(void)
 {
+    // The slab map must be present before the first slab is created
+    slab_map_initialize();
+    
     // Initialize the default cache and disable atomics for this one
     MemoryCacheConstruct(&g_initialCache, "cache_cache", sizeof(MemoryCache_t),
                          16, 0, HEAP_CACHE_DEFAULT, NULL, NULL);
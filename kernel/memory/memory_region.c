@@ -36,14 +36,19 @@
 #include <string.h>
 #include <threading.h>
 
+// The scatter-gather list is built on the first request, and kept until the pages
+// of the region change. SgOffsets holds the buffer offset of each entry.
 typedef struct MemoryRegion {
-    Mutex_t      SyncObject;
-    uintptr_t    KernelMapping;
-    size_t       Length;
-    size_t       Capacity;
-    unsigned int Flags;
-    int          PageCount;
-    uintptr_t    Pages[];
+    Mutex_t        SyncObject;
+    uintptr_t      KernelMapping;
+    size_t         Length;
+    size_t         Capacity;
+    unsigned int   Flags;
+    struct dma_sg* SgList;
+    size_t*        SgOffsets;
+    int            SgCount;
+    int            PageCount;
+    uintptr_t      Pages[];
 } MemoryRegion_t;
 
 static OsStatus_t __CreateUserMapping(
@@ -118,6 +123,17 @@ static OsStatus_t __CreateKernelMappingFromExisting(
     return status;
 }
 
+static void __InvalidateSgList(
+        _In_ MemoryRegion_t* region)
+{
+    if (region->SgList) {
+        kfree(region->SgList);
+        region->SgList    = NULL;
+        region->SgOffsets = NULL;
+        region->SgCount   = 0;
+    }
+}
+
 static void
 MemoryRegionDestroy(
     _In_ void* resource)
@@ -126,6 +142,7 @@ MemoryRegionDestroy(
     if (region->KernelMapping) {
         MemorySpaceUnmap(GetCurrentMemorySpace(), region->KernelMapping, region->Capacity);
     }
+    __InvalidateSgList(region);
     kfree(region);
 }
 
@@ -415,6 +432,7 @@ MemoryRegionResize(
     }
     else {
         osStatus = __ExpandMemoryRegion(memoryRegion, (uintptr_t)memory, currentPages, newLength);
+        __InvalidateSgList(memoryRegion);
     }
 
     if (osStatus == OsSuccess) {
@@ -512,8 +530,10 @@ MemoryRegionCommit(
         _In_ size_t length)
 {
     MemoryRegion_t* memoryRegion;
-    OsStatus_t      osStatus;
-    uintptr_t       userAddress = (uintptr_t)memory;
+    OsStatus_t      osStatus    = OsSuccess;
+    size_t          pageSize    = GetMemorySpacePageSize();
+    size_t          offset      = (uintptr_t)memory - (uintptr_t)memoryBase;
+    uintptr_t       userAddress;
     uintptr_t       kernelAddress;
     int             limit;
     int             i;
@@ -524,12 +544,14 @@ MemoryRegionCommit(
         return OsDoesNotExist;
     }
 
-    i     = DIVUP((uintptr_t)memoryBase - userAddress, GetMemorySpacePageSize());
-    limit = i + (int)(DIVUP(length, GetMemorySpacePageSize()));
-    kernelAddress = memoryRegion->KernelMapping;
+    // Start at the page that contains the address, in both mappings
+    i             = (int)(offset / pageSize);
+    limit         = MIN((int)DIVUP((offset + length), pageSize), memoryRegion->PageCount);
+    userAddress   = (uintptr_t)memoryBase + (i * pageSize);
+    kernelAddress = memoryRegion->KernelMapping + (i * pageSize);
 
     MutexLock(&memoryRegion->SyncObject);
-    for (; i < limit; i++, kernelAddress += GetMemorySpacePageSize(), userAddress += GetMemorySpacePageSize()) {
+    for (; i < limit; i++, kernelAddress += pageSize, userAddress += pageSize) {
         if (!memoryRegion->Pages[i]) {
             // handle kernel mapping first
             osStatus = MemorySpaceCommit(GetCurrentMemorySpace(), kernelAddress, &memoryRegion->Pages[i],
@@ -546,6 +568,7 @@ MemoryRegionCommit(
                 ERROR("MemoryRegionCommit failed to commit user mapping at 0x%" PRIxIN ", i=%i", userAddress, i);
                 break;
             }
+            __InvalidateSgList(memoryRegion);
         }
     }
 
@@ -621,6 +644,122 @@ MemoryRegionWrite(
     (((memory_region)->Pages[idx] + (pageSize) == (memory_region)->Pages[idx2]) || \
      ((memory_region)->Pages[idx] == 0 && (memory_region)->Pages[idx2] == 0))
 
+// The cached list comes from the heap, regions too fragmented to fit the largest heap
+// cache build their entries from the pages on every request instead
+#define SG_CACHE_MAX_BYTES (256 * 1024)
+
+// Fills in the entry that starts at the given page and returns the page after it
+static int __NextSgEntry(
+        _In_  MemoryRegion_t* memoryRegion,
+        _In_  int             pageIndex,
+        _Out_ struct dma_sg*  sg)
+{
+    size_t pageSize = GetMemorySpacePageSize();
+    int    j        = pageIndex;
+
+    sg->address = memoryRegion->Pages[j++];
+    sg->length  = pageSize;
+    while ((j < memoryRegion->PageCount) && SG_IS_SAME_REGION(memoryRegion, j - 1, j, pageSize)) {
+        sg->length += pageSize;
+        j++;
+    }
+
+    // Adjust the initial sg entry for offset
+    if (pageIndex == 0) {
+        sg->length -= sg->address % pageSize;
+    }
+    return j;
+}
+
+static int __CountSgEntries(
+        _In_ MemoryRegion_t* memoryRegion)
+{
+    size_t pageSize = GetMemorySpacePageSize();
+    int    sgCount  = 0;
+
+    for (int i = 0; i < memoryRegion->PageCount; i++) {
+        if (i == 0 || !SG_IS_SAME_REGION(memoryRegion, i - 1, i, pageSize)) {
+            sgCount++;
+        }
+    }
+    return sgCount;
+}
+
+static OsStatus_t __BuildSgList(
+        _In_ MemoryRegion_t* memoryRegion)
+{
+    size_t offset  = 0;
+    int    sgCount = __CountSgEntries(memoryRegion);
+    size_t bytes   = (sizeof(struct dma_sg) + sizeof(size_t)) * sgCount;
+
+    if (!sgCount) {
+        return OsSuccess;
+    }
+
+    if (bytes > SG_CACHE_MAX_BYTES) {
+        return OsNotSupported;
+    }
+
+    memoryRegion->SgList = (struct dma_sg*)kmalloc(bytes);
+    if (!memoryRegion->SgList) {
+        return OsOutOfMemory;
+    }
+    memoryRegion->SgOffsets = (size_t*)&memoryRegion->SgList[sgCount];
+    memoryRegion->SgCount   = sgCount;
+
+    for (int i = 0, j = 0; (i < sgCount) && (j < memoryRegion->PageCount); i++) {
+        j = __NextSgEntry(memoryRegion, j, &memoryRegion->SgList[i]);
+        memoryRegion->SgOffsets[i] = offset;
+        offset += memoryRegion->SgList[i].length;
+    }
+    return OsSuccess;
+}
+
+// Builds the requested entries of the range from the pages without caching them
+static OsStatus_t __GetSgRangeUncached(
+        _In_  MemoryRegion_t* memoryRegion,
+        _In_  size_t          offset,
+        _In_  size_t          length,
+        _Out_ int*            sgCountOut,
+        _Out_ struct dma_sg*  sgListOut)
+{
+    struct dma_sg sg;
+    size_t        sgOffset = 0;
+    size_t        end      = offset + length;
+    int           sgCount  = 0;
+    int           found    = 0;
+
+    for (int j = 0; j < memoryRegion->PageCount && sgOffset < end; sgOffset += sg.length) {
+        size_t sgStart;
+        size_t sgEnd;
+
+        j = __NextSgEntry(memoryRegion, j, &sg);
+        if (sgOffset + sg.length <= offset) {
+            continue;
+        }
+
+        found = 1;
+        if (sgListOut) {
+            if (sgCount == *sgCountOut) {
+                break;
+            }
+            sgStart = MAX(offset, sgOffset);
+            sgEnd   = MIN(end, sgOffset + sg.length);
+
+            // Entries of uncommitted pages have no address to offset
+            sgListOut[sgCount].address = sg.address ? sg.address + (sgStart - sgOffset) : 0;
+            sgListOut[sgCount].length  = sgEnd - sgStart;
+        }
+        sgCount++;
+    }
+
+    if (!found) {
+        return OsInvalidParameters;
+    }
+    *sgCountOut = sgCount;
+    return OsSuccess;
+}
+
 OsStatus_t
 MemoryRegionGetSg(
     _In_  UUId_t         handle,
@@ -628,7 +767,6 @@ MemoryRegionGetSg(
     _Out_ struct dma_sg* sgListOut)
 {
     MemoryRegion_t* memoryRegion;
-    size_t          pageSize = GetMemorySpacePageSize();
     
     if (!sgCountOut) {
         return OsInvalidParameters;
@@ -638,40 +776,133 @@ MemoryRegionGetSg(
     if (!memoryRegion) {
         return OsDoesNotExist;
     }
+
+    MutexLock(&memoryRegion->SyncObject);
+    if (!memoryRegion->SgList && __BuildSgList(memoryRegion) != OsSuccess) {
+        // The list could not be cached, build the entries from the pages
+        if (!sgListOut) {
+            *sgCountOut = __CountSgEntries(memoryRegion);
+        }
+        else {
+            int sgCount = 0;
+            for (int j = 0; (sgCount < *sgCountOut) && (j < memoryRegion->PageCount); sgCount++) {
+                j = __NextSgEntry(memoryRegion, j, &sgListOut[sgCount]);
+            }
+            *sgCountOut = sgCount;
+        }
+        goto exit;
+    }
     
-    // Requested count of the scatter-gather units, so count
-    // how many entries it would take to fill a list
-    // Assume that if both pointers are supplied we are trying to fill
-    // the list with the requested amount, and thus skip this step.
+    // Requested count of the scatter-gather units, otherwise fill the list with
+    // at most the requested amount of entries
     if (!sgListOut) {
-        int sgCount = 0;
-        for (int i = 0; i < memoryRegion->PageCount; i++) {
-            if (i == 0 || !SG_IS_SAME_REGION(memoryRegion, i - 1, i, pageSize)) {
-                sgCount++;
-            }
+        *sgCountOut = memoryRegion->SgCount;
+    }
+    else {
+        int sgCount = MAX(0, MIN(*sgCountOut, memoryRegion->SgCount));
+        if (sgCount) {
+            memcpy(sgListOut, memoryRegion->SgList, sizeof(struct dma_sg) * sgCount);
         }
         *sgCountOut = sgCount;
     }
-    
-    // In order to get the list both counters must be filled
-    if (sgListOut) {
-        int sgCount = *sgCountOut;
-        for (int i = 0, j = 0; (i < sgCount) && (j < memoryRegion->PageCount); i++) {
-            struct dma_sg* sg = &sgListOut[i];
 
-            sg->address = memoryRegion->Pages[j++];
-            sg->length  = pageSize;
-            
-            while ((j < memoryRegion->PageCount) && SG_IS_SAME_REGION(memoryRegion, j - 1, j, pageSize)) {
-                sg->length += pageSize;
-                j++;
-            }
+exit:
+    MutexUnlock(&memoryRegion->SyncObject);
+    return OsSuccess;
+}
+
+OsStatus_t
+MemoryRegionGetSgRange(
+    _In_  UUId_t         handle,
+    _In_  size_t         offset,
+    _In_  size_t         length,
+    _Out_ int*           sgCountOut,
+    _Out_ struct dma_sg* sgListOut)
+{
+    MemoryRegion_t* memoryRegion;
+    OsStatus_t      osStatus = OsSuccess;
+    struct dma_sg*  last;
+    size_t          end;
+    int             first;
+    int             sgCount;
+    int             low;
+    int             high;
+
+    if (!sgCountOut || !length) {
+        return OsInvalidParameters;
+    }
+
+    memoryRegion = (MemoryRegion_t*)LookupHandleOfType(handle, HandleTypeMemoryRegion);
+    if (!memoryRegion) {
+        return OsDoesNotExist;
+    }
+
+    MutexLock(&memoryRegion->SyncObject);
+    if (!memoryRegion->SgList && __BuildSgList(memoryRegion) != OsSuccess) {
+        osStatus = __GetSgRangeUncached(memoryRegion, offset, length, sgCountOut, sgListOut);
+        goto exit;
+    }
+
+    if (!memoryRegion->SgCount) {
+        osStatus = OsInvalidParameters;
+        goto exit;
+    }
+
+    last = &memoryRegion->SgList[memoryRegion->SgCount - 1];
+    end  = memoryRegion->SgOffsets[memoryRegion->SgCount - 1] + last->length;
+    if (offset >= end) {
+        osStatus = OsInvalidParameters;
+        goto exit;
+    }
+    end = MIN(end, offset + length);
+
+    // Find the entries that contain the first and the last byte of the range
+    low  = 0;
+    high = memoryRegion->SgCount - 1;
+    while (low < high) {
+        int middle = low + ((high - low + 1) / 2);
+        if (memoryRegion->SgOffsets[middle] <= offset) {
+            low = middle;
+        }
+        else {
+            high = middle - 1;
         }
-        
-        // Adjust the initial sg entry for offset
-        sgListOut[0].length -= sgListOut[0].address % pageSize;
     }
-    return OsSuccess;
+    first = low;
+
+    high = memoryRegion->SgCount - 1;
+    while (low < high) {
+        int middle = low + ((high - low + 1) / 2);
+        if (memoryRegion->SgOffsets[middle] < end) {
+            low = middle;
+        }
+        else {
+            high = middle - 1;
+        }
+    }
+    sgCount = (low - first) + 1;
+
+    if (!sgListOut) {
+        *sgCountOut = sgCount;
+        goto exit;
+    }
+
+    sgCount = MAX(0, MIN(*sgCountOut, sgCount));
+    for (int i = 0; i < sgCount; i++) {
+        struct dma_sg* sg      = &memoryRegion->SgList[first + i];
+        size_t         sgStart = MAX(offset, memoryRegion->SgOffsets[first + i]);
+        size_t         sgEnd   = MIN(end, memoryRegion->SgOffsets[first + i] + sg->length);
+        size_t         sgSkip  = sgStart - memoryRegion->SgOffsets[first + i];
+
+        // Entries of uncommitted pages have no address to offset
+        sgListOut[i].address = sg->address ? sg->address + sgSkip : 0;
+        sgListOut[i].length  = sgEnd - sgStart;
+    }
+    *sgCountOut = sgCount;
+
+exit:
+    MutexUnlock(&memoryRegion->SyncObject);
+    return osStatus;
 }
 
 OsStatus_t
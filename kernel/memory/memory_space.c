@@ -488,7 +488,12 @@ MemorySpaceMap(
         MemoryFlags |= MAPPING_COMMIT;
     }
     else if (MemoryFlags & MAPPING_COMMIT) {
-        Status = AllocatePhysicalMemory(PageCount, &PhysicalAddressValues[0]);
+        if (PlacementFlags & MAPPING_PHYSICAL_CONTIGUOUS) {
+            Status = AllocatePhysicalMemoryContiguous(PageCount, &PhysicalAddressValues[0]);
+        }
+        else {
+            Status = AllocatePhysicalMemory(PageCount, &PhysicalAddressValues[0]);
+        }
         if (Status != OsSuccess) {
             return Status;
         }
@@ -498,9 +503,10 @@ MemorySpaceMap(
     // went wrong during the phase to figure out where to place
     VirtualBase = __AllocateVirtualMemory(MemorySpace, Address, Length, MemoryFlags, PlacementFlags);
     if (!VirtualBase) {
-        // Cleanup physical mappings
-        // TODO
-        ERROR("[memory_map] implement cleanup of phys virt");
+        // Return the pages we allocated, fixed physical pages are owned by the caller
+        if (!(PlacementFlags & MAPPING_PHYSICAL_FIXED)) {
+            FreePhysicalMemory(PageCount, &PhysicalAddressValues[0]);
+        }
         return OsInvalidParameters;
     }
     
@@ -621,10 +627,7 @@ MemorySpaceCommit(
         ERROR("[memory] [commit] status %u, comitting address 0x%" PRIxIN ", length 0x%" PRIxIN,
               osStatus, address, size);
         if (!(placementFlags & MAPPING_PHYSICAL_FIXED)) {
-            IrqSpinlockAcquire(&GetMachine()->PhysicalMemoryLock);
-            bounded_stack_push_multiple(&GetMachine()->PhysicalMemory,
-                                        (void**)&physicalAddressValues[0], pageCount);
-            IrqSpinlockRelease(&GetMachine()->PhysicalMemoryLock);
+            FreePhysicalMemory(pageCount, &physicalAddressValues[0]);
         }
     }
     return osStatus;
@@ -729,9 +732,7 @@ static OsStatus_t __ClearPhysicalPages(
     if (pagesCleared) {
         // free the physical memory
         if (pagesFreed) {
-            IrqSpinlockAcquire(&GetMachine()->PhysicalMemoryLock);
-            bounded_stack_push_multiple(&GetMachine()->PhysicalMemory, (void**)&addresses[0], pagesFreed);
-            IrqSpinlockRelease(&GetMachine()->PhysicalMemoryLock);
+            FreePhysicalMemory(pagesFreed, &addresses[0]);
         }
         __SyncMemoryRegion(memorySpace, address, size);
     }
@@ -0,0 +1,416 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Physical Memory Allocator
+ * - Buddy allocator for physical pages, fronted by per-cpu lists of hot pages
+ *   that are refilled from and drained to the buddy allocator in batches.
+ */
+
+#define __MODULE "pmem"
+//#define __TRACE
+
+#include <arch/interrupts.h>
+#include <arch/utils.h>
+#include <assert.h>
+#include <ddk/io.h>
+#include <debug.h>
+#include <physical_memory.h>
+#include <string.h>
+
+#define PHYSICAL_PAGE_NONE 0xFFFFFFFFU
+
+// Only the first page of a free block is marked free and carries the order, the
+// links are used for the free list of that order.
+struct PhysicalPage {
+    uint32_t Next;
+    uint32_t Previous;
+    uint8_t  Order;
+    uint8_t  Free;
+};
+
+static inline uintptr_t
+__PageAddress(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ uint32_t          PageFrame)
+{
+    return (uintptr_t)PageFrame * PhysicalMemory->PageSize;
+}
+
+static void
+__AddToFreeList(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ uint32_t          PageFrame,
+    _In_ int               Order)
+{
+    PhysicalPage_t* Page = &PhysicalMemory->Pages[PageFrame];
+    uint32_t        Head = PhysicalMemory->FreeLists[Order];
+
+    Page->Order    = (uint8_t)Order;
+    Page->Free     = 1;
+    Page->Previous = PHYSICAL_PAGE_NONE;
+    Page->Next     = Head;
+    if (Head != PHYSICAL_PAGE_NONE) {
+        PhysicalMemory->Pages[Head].Previous = PageFrame;
+    }
+    PhysicalMemory->FreeLists[Order] = PageFrame;
+    PhysicalMemory->FreeBlocks[Order]++;
+}
+
+static void
+__RemoveFromFreeList(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ uint32_t          PageFrame)
+{
+    PhysicalPage_t* Page = &PhysicalMemory->Pages[PageFrame];
+
+    if (Page->Previous != PHYSICAL_PAGE_NONE) {
+        PhysicalMemory->Pages[Page->Previous].Next = Page->Next;
+    }
+    else {
+        PhysicalMemory->FreeLists[Page->Order] = Page->Next;
+    }
+
+    if (Page->Next != PHYSICAL_PAGE_NONE) {
+        PhysicalMemory->Pages[Page->Next].Previous = Page->Previous;
+    }
+    PhysicalMemory->FreeBlocks[Page->Order]--;
+    Page->Free = 0;
+}
+
+// Frees a block and merges it with its buddy for as long as the buddy is free as well
+static void
+__FreeBlock(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ uint32_t          PageFrame,
+    _In_ int               Order)
+{
+    while (Order < (PHYSICAL_MEMORY_ORDER_COUNT - 1)) {
+        uint32_t Buddy = PageFrame ^ (1U << Order);
+        if (Buddy >= PhysicalMemory->PageCount ||
+            !PhysicalMemory->Pages[Buddy].Free ||
+            PhysicalMemory->Pages[Buddy].Order != Order) {
+            break;
+        }
+
+        __RemoveFromFreeList(PhysicalMemory, Buddy);
+        PageFrame &= ~(1U << Order);
+        Order++;
+    }
+    __AddToFreeList(PhysicalMemory, PageFrame, Order);
+}
+
+// Allocates a block of the given order, larger blocks are split when needed
+static uint32_t
+__AllocateBlock(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ int               Order)
+{
+    uint32_t PageFrame;
+    int      i = Order;
+
+    while (i < PHYSICAL_MEMORY_ORDER_COUNT && PhysicalMemory->FreeLists[i] == PHYSICAL_PAGE_NONE) {
+        i++;
+    }
+
+    if (i == PHYSICAL_MEMORY_ORDER_COUNT) {
+        return PHYSICAL_PAGE_NONE;
+    }
+
+    PageFrame = PhysicalMemory->FreeLists[i];
+    __RemoveFromFreeList(PhysicalMemory, PageFrame);
+    while (i > Order) {
+        i--;
+        __AddToFreeList(PhysicalMemory, PageFrame + (1U << i), i);
+    }
+    return PageFrame;
+}
+
+// Allocates the pages as the largest blocks available, lock must be held
+static int
+__AllocatePages(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ int               PageCount,
+    _In_ uintptr_t*        Pages)
+{
+    int PagesAllocated = 0;
+    int Order          = PHYSICAL_MEMORY_ORDER_COUNT - 1;
+
+    while (PagesAllocated < PageCount && Order >= 0) {
+        uint32_t PageFrame;
+        int      i;
+
+        if ((1 << Order) > (PageCount - PagesAllocated)) {
+            Order--;
+            continue;
+        }
+
+        PageFrame = __AllocateBlock(PhysicalMemory, Order);
+        if (PageFrame == PHYSICAL_PAGE_NONE) {
+            // Nothing left of this size or larger, so try smaller blocks
+            Order--;
+            continue;
+        }
+
+        for (i = 0; i < (1 << Order); i++) {
+            Pages[PagesAllocated++] = __PageAddress(PhysicalMemory, PageFrame + i);
+        }
+    }
+    return PagesAllocated;
+}
+
+static void
+__FreePages(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ int               PageCount,
+    _In_ uintptr_t*        Pages)
+{
+    int i;
+    for (i = 0; i < PageCount; i++) {
+        uint32_t PageFrame = (uint32_t)(Pages[i] / PhysicalMemory->PageSize);
+        assert(PageFrame < PhysicalMemory->PageCount);
+        assert(!PhysicalMemory->Pages[PageFrame].Free);
+        __FreeBlock(PhysicalMemory, PageFrame, 0);
+    }
+}
+
+static PhysicalMemoryCpuCache_t*
+__GetCpuCache(
+    _In_ PhysicalMemory_t* PhysicalMemory)
+{
+    UUId_t CoreId = ArchGetProcessorCoreId();
+    if (CoreId >= PHYSICAL_MEMORY_MAX_CPUS) {
+        return NULL;
+    }
+    return &PhysicalMemory->CpuCaches[CoreId];
+}
+
+size_t
+PhysicalMemoryCalculateSize(
+    _In_ size_t PageCount)
+{
+    return PageCount * sizeof(PhysicalPage_t);
+}
+
+void
+PhysicalMemoryConstruct(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ void*             Storage,
+    _In_ size_t            PageCount,
+    _In_ size_t            PageSize)
+{
+    int i;
+
+    assert(PhysicalMemory != NULL);
+    assert(Storage != NULL);
+    assert(PageCount < PHYSICAL_PAGE_NONE);
+
+    memset(PhysicalMemory, 0, sizeof(PhysicalMemory_t));
+    memset(Storage, 0, PhysicalMemoryCalculateSize(PageCount));
+    IrqSpinlockConstruct(&PhysicalMemory->SyncObject);
+    PhysicalMemory->Pages     = Storage;
+    PhysicalMemory->PageCount = PageCount;
+    PhysicalMemory->PageSize  = PageSize;
+    for (i = 0; i < PHYSICAL_MEMORY_ORDER_COUNT; i++) {
+        PhysicalMemory->FreeLists[i] = PHYSICAL_PAGE_NONE;
+    }
+}
+
+void
+PhysicalMemoryAddRange(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ uintptr_t         Start,
+    _In_ uintptr_t         End)
+{
+    uint32_t PageFrame = (uint32_t)DIVUP(Start, PhysicalMemory->PageSize);
+    uint32_t EndFrame  = (uint32_t)MIN(End / PhysicalMemory->PageSize, PhysicalMemory->PageCount);
+    TRACE("[pmem] [add_range] 0x%" PRIxIN " => 0x%" PRIxIN, Start, End);
+
+    IrqSpinlockAcquire(&PhysicalMemory->SyncObject);
+    while (PageFrame < EndFrame) {
+        int Order = 0;
+
+        // Free the largest naturally aligned block that fits in the range
+        while ((Order + 1) < PHYSICAL_MEMORY_ORDER_COUNT &&
+               !(PageFrame & ((1U << (Order + 1)) - 1)) &&
+               (PageFrame + (1U << (Order + 1))) <= EndFrame) {
+            Order++;
+        }
+
+        __FreeBlock(PhysicalMemory, PageFrame, Order);
+        PageFrame += (1U << Order);
+    }
+    IrqSpinlockRelease(&PhysicalMemory->SyncObject);
+}
+
+OsStatus_t
+PhysicalMemoryAllocate(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ int               PageCount,
+    _In_ uintptr_t*        Pages)
+{
+    PhysicalMemoryCpuCache_t* CpuCache;
+    IntStatus_t               IrqState;
+    OsStatus_t                Status = OsSuccess;
+    int                       PagesAllocated;
+
+    if (!PhysicalMemory || !Pages || PageCount <= 0) {
+        return OsInvalidParameters;
+    }
+
+    // Single pages are served from the hot pages of this core, which are refilled in
+    // batches. Larger requests go straight to the buddy allocator.
+    IrqState = InterruptDisable();
+    CpuCache = __GetCpuCache(PhysicalMemory);
+    if (CpuCache && PageCount <= PHYSICAL_MEMORY_CACHE_BATCH) {
+        if (CpuCache->Count < PageCount) {
+            IrqSpinlockAcquire(&PhysicalMemory->SyncObject);
+            CpuCache->Count += __AllocatePages(PhysicalMemory, PHYSICAL_MEMORY_CACHE_BATCH,
+                &CpuCache->Pages[CpuCache->Count]);
+            IrqSpinlockRelease(&PhysicalMemory->SyncObject);
+        }
+
+        if (CpuCache->Count >= PageCount) {
+            CpuCache->Count -= PageCount;
+            memcpy(&Pages[0], &CpuCache->Pages[CpuCache->Count], PageCount * sizeof(uintptr_t));
+            InterruptRestoreState(IrqState);
+            return OsSuccess;
+        }
+    }
+
+    IrqSpinlockAcquire(&PhysicalMemory->SyncObject);
+    PagesAllocated = __AllocatePages(PhysicalMemory, PageCount, Pages);
+    if (PagesAllocated < PageCount) {
+        __FreePages(PhysicalMemory, PagesAllocated, Pages);
+        Status = OsOutOfMemory;
+    }
+    IrqSpinlockRelease(&PhysicalMemory->SyncObject);
+    InterruptRestoreState(IrqState);
+    return Status;
+}
+
+OsStatus_t
+PhysicalMemoryAllocateContiguous(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ int               PageCount,
+    _In_ uintptr_t*        Pages)
+{
+    uint32_t PageFrame;
+    int      Order = 0;
+    int      i;
+
+    if (!PhysicalMemory || !Pages || PageCount <= 0) {
+        return OsInvalidParameters;
+    }
+
+    while ((1 << Order) < PageCount) {
+        Order++;
+    }
+
+    if (Order >= PHYSICAL_MEMORY_ORDER_COUNT) {
+        return OsInvalidParameters;
+    }
+
+    IrqSpinlockAcquire(&PhysicalMemory->SyncObject);
+    PageFrame = __AllocateBlock(PhysicalMemory, Order);
+    if (PageFrame != PHYSICAL_PAGE_NONE) {
+        // Return the tail of the block that was not requested
+        for (i = PageCount; i < (1 << Order); i++) {
+            __FreeBlock(PhysicalMemory, PageFrame + i, 0);
+        }
+    }
+    IrqSpinlockRelease(&PhysicalMemory->SyncObject);
+
+    if (PageFrame == PHYSICAL_PAGE_NONE) {
+        return OsOutOfMemory;
+    }
+
+    for (i = 0; i < PageCount; i++) {
+        Pages[i] = __PageAddress(PhysicalMemory, PageFrame + i);
+    }
+    return OsSuccess;
+}
+
+void
+PhysicalMemoryFree(
+    _In_ PhysicalMemory_t* PhysicalMemory,
+    _In_ int               PageCount,
+    _In_ uintptr_t*        Pages)
+{
+    PhysicalMemoryCpuCache_t* CpuCache;
+    IntStatus_t               IrqState;
+    int                       PagesCached = 0;
+
+    if (!PhysicalMemory || !Pages || PageCount <= 0) {
+        return;
+    }
+
+    IrqState = InterruptDisable();
+    CpuCache = __GetCpuCache(PhysicalMemory);
+    if (CpuCache) {
+        // Make room for the pages by draining a batch of the coldest pages
+        if ((CpuCache->Count + PageCount) > PHYSICAL_MEMORY_CACHE_SIZE && PageCount <= PHYSICAL_MEMORY_CACHE_BATCH) {
+            IrqSpinlockAcquire(&PhysicalMemory->SyncObject);
+            __FreePages(PhysicalMemory, PHYSICAL_MEMORY_CACHE_BATCH, &CpuCache->Pages[0]);
+            IrqSpinlockRelease(&PhysicalMemory->SyncObject);
+
+            CpuCache->Count -= PHYSICAL_MEMORY_CACHE_BATCH;
+            memmove(&CpuCache->Pages[0], &CpuCache->Pages[PHYSICAL_MEMORY_CACHE_BATCH],
+                CpuCache->Count * sizeof(uintptr_t));
+        }
+
+        PagesCached = MIN(PageCount, PHYSICAL_MEMORY_CACHE_SIZE - CpuCache->Count);
+        memcpy(&CpuCache->Pages[CpuCache->Count], &Pages[0], PagesCached * sizeof(uintptr_t));
+        CpuCache->Count += PagesCached;
+    }
+
+    if (PagesCached < PageCount) {
+        IrqSpinlockAcquire(&PhysicalMemory->SyncObject);
+        __FreePages(PhysicalMemory, PageCount - PagesCached, &Pages[PagesCached]);
+        IrqSpinlockRelease(&PhysicalMemory->SyncObject);
+    }
+    InterruptRestoreState(IrqState);
+}
+
+void
+PhysicalMemoryGetStatistics(
+    _In_      PhysicalMemory_t* PhysicalMemory,
+    _Out_     size_t*           PageCountOut,
+    _Out_     size_t*           FreePagesOut,
+    _Out_Opt_ size_t*           FreeBlocks)
+{
+    size_t FreePages = 0;
+    int    i;
+
+    IrqSpinlockAcquire(&PhysicalMemory->SyncObject);
+    for (i = 0; i < PHYSICAL_MEMORY_ORDER_COUNT; i++) {
+        FreePages += PhysicalMemory->FreeBlocks[i] << i;
+        if (FreeBlocks) {
+            FreeBlocks[i] = PhysicalMemory->FreeBlocks[i];
+        }
+    }
+    IrqSpinlockRelease(&PhysicalMemory->SyncObject);
+
+    // The per-cpu lists are read without synchronization, it's only statistics
+    for (i = 0; i < PHYSICAL_MEMORY_MAX_CPUS; i++) {
+        FreePages += (size_t)READ_VOLATILE(PhysicalMemory->CpuCaches[i].Count);
+    }
+
+    *PageCountOut = PhysicalMemory->PageCount;
+    *FreePagesOut = FreePages;
+}
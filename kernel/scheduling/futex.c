@@ -29,33 +29,40 @@
 #include <ds/list.h>
 #include <debug.h>
 #include <ddk/barrier.h>
+#include <ddk/io.h>
 #include <futex.h>
 #include <heap.h>
 #include <irq_spinlock.h>
+#include <machine.h>
 #include <memoryspace.h>
 #include <scheduler.h>
 #include <string.h>
 
-#define FUTEX_HASHTABLE_CAPACITY 64
+#define FUTEX_BOOT_BUCKETS     64
+#define FUTEX_BUCKETS_PER_CORE 256
+#define FUTEX_MEMORY_FRACTION  1024 // The table may use at most this fraction of physical memory
 
-// One per memory context
-typedef struct FutexItem {
-    element_t     Header;
-    list_t        BlockQueue;
-    IrqSpinlock_t BlockQueueSyncObject;
-    _Atomic(int)  Waiters;
-    
-    MemorySpaceContext_t* Context;
-    uintptr_t             FutexAddress;
-} FutexItem_t;
-
-// One per futex key
 typedef struct FutexBucket {
     IrqSpinlock_t SyncObject;
-    list_t        Futexes;
+    list_t        Waiters;
 } FutexBucket_t;
 
-static FutexBucket_t FutexBuckets[FUTEX_HASHTABLE_CAPACITY] = { 0 };
+// The wait node lives on the stack of the waiting thread for the duration of the wait. The
+// bucket and queued members are protected by the lock of the bucket the waiter is queued in.
+typedef struct FutexWaiter {
+    element_t             Header;
+    list_t                BlockQueue;
+    FutexBucket_t*        Bucket;
+    int                   Queued;
+    MemorySpaceContext_t* Context;
+    uintptr_t             FutexAddress;
+} FutexWaiter_t;
+
+// Until the system is far enough into boot to size the table, the boot table is used. No
+// threads can wait before the scheduler is running, so the tables are swapped while empty.
+static FutexBucket_t  FutexBootBuckets[FUTEX_BOOT_BUCKETS];
+static FutexBucket_t* FutexBuckets    = &FutexBootBuckets[0];
+static size_t         FutexBucketMask = FUTEX_BOOT_BUCKETS - 1;
 
 static size_t
 GetIntegerHash(
@@ -87,75 +94,91 @@ SchedulerGetCurrentObject(
 
 static FutexBucket_t*
 FutexGetBucket(
-        _In_ uintptr_t futexAddress)
+        _In_ uintptr_t             futexAddress,
+        _In_ MemorySpaceContext_t* context)
 {
-    return &FutexBuckets[GetIntegerHash(futexAddress) & (FUTEX_HASHTABLE_CAPACITY - 1)];
+    size_t hash = GetIntegerHash(futexAddress) ^ GetIntegerHash((uintptr_t)context);
+    return &FutexBuckets[hash & FutexBucketMask];
 }
 
-// Must be called with the bucket lock held
-static FutexItem_t*
-FutexGetNode(
-        _In_ FutexBucket_t*        bucket,
-        _In_ uintptr_t             futexAddress,
-        _In_ MemorySpaceContext_t* context)
+// Get the futex context, if the context is private we can stick to the virtual
+// address for sleeping otherwise we need to lookup the physical page
+static OsStatus_t
+FutexGetKey(
+        _In_  _Atomic(int)*          futex,
+        _In_  int                    isPrivate,
+        _Out_ uintptr_t*             futexAddressOut,
+        _Out_ MemorySpaceContext_t** contextOut)
 {
-    foreach(i, &bucket->Futexes) {
-        FutexItem_t* Item = (FutexItem_t*)i->value;
-        if (Item->FutexAddress == futexAddress &&
-            Item->Context == context) {
-            return Item;
-        }
+    if (isPrivate) {
+        *contextOut      = GetCurrentMemorySpace()->Context;
+        *futexAddressOut = (uintptr_t)futex;
+        return OsSuccess;
     }
-    return NULL;
+
+    *contextOut = NULL;
+    return GetMemorySpaceMapping(GetCurrentMemorySpace(), (uintptr_t)futex, 1, futexAddressOut);
 }
 
-static FutexItem_t*
-FutexGetNodeLocked(
+// Must be called with the bucket lock held
+static int
+FutexWakeWaiters(
         _In_ FutexBucket_t*        bucket,
         _In_ uintptr_t             futexAddress,
-        _In_ MemorySpaceContext_t* context)
+        _In_ MemorySpaceContext_t* context,
+        _In_ int                   count)
 {
-    FutexItem_t* item;
+    element_t* i = bucket->Waiters.head;
+    int        woken = 0;
 
-    IrqSpinlockAcquire(&bucket->SyncObject);
-    item = FutexGetNode(bucket, futexAddress, context);
-    IrqSpinlockRelease(&bucket->SyncObject);
+    while (i && woken < count) {
+        FutexWaiter_t* waiter = (FutexWaiter_t*)i->value;
+        element_t*     next   = i->next;
+
+        if (waiter->FutexAddress == futexAddress && waiter->Context == context) {
+            element_t* front;
+
+            (void)list_remove(&bucket->Waiters, &waiter->Header);
+            waiter->Queued = 0;
 
-    return item;
+            // If the waiter timed out or was interrupted, the scheduler has already
+            // taken it out of the block queue, and it's on its way out
+            front = list_front(&waiter->BlockQueue);
+            if (front && !list_remove(&waiter->BlockQueue, front)) {
+                if (SchedulerQueueObject(front->value) == OsSuccess) {
+                    woken++;
+                }
+            }
+        }
+        i = next;
+    }
+    return woken;
 }
 
-// Must be called with the bucket lock held
-static FutexItem_t*
-FutexCreateNode(
-        _In_ FutexBucket_t*        bucket,
-        _In_ uintptr_t             futexAddress,
-        _In_ MemorySpaceContext_t* context)
+// Takes the waiter out of its bucket in case it was not woken. Once this returns nobody
+// else references the waiter.
+static void
+FutexUnlinkWaiter(
+        _In_ FutexWaiter_t* waiter)
 {
-    FutexItem_t* existing;
-    FutexItem_t* item = (FutexItem_t*)kmalloc(sizeof(FutexItem_t));
-    if (!item) {
-        return NULL;
+    FutexBucket_t* bucket;
+
+    while (1) {
+        bucket = READ_VOLATILE(waiter->Bucket);
+        IrqSpinlockAcquire(&bucket->SyncObject);
+        if (READ_VOLATILE(waiter->Bucket) == bucket) {
+            break;
+        }
+
+        // The waiter was requeued while we acquired the lock
+        IrqSpinlockRelease(&bucket->SyncObject);
     }
-    
-    memset(item, 0, sizeof(FutexItem_t));
-    ELEMENT_INIT(&item->Header, 0, item);
-    list_construct(&item->BlockQueue);
-    IrqSpinlockConstruct(&item->BlockQueueSyncObject);
-    item->FutexAddress = futexAddress;
-    item->Context      = context;
-    
-    IrqSpinlockAcquire(&bucket->SyncObject);
-    existing = FutexGetNode(bucket, futexAddress, context);
-    if (!existing) {
-        list_append(&bucket->Futexes, &item->Header);
+
+    if (waiter->Queued) {
+        (void)list_remove(&bucket->Waiters, &waiter->Header);
+        waiter->Queued = 0;
     }
     IrqSpinlockRelease(&bucket->SyncObject);
-    
-    if (existing) {
-        kfree(item);
-        item = existing;
-    }
-    return item;
 }
 
 static void
@@ -239,26 +262,96 @@ void
 FutexInitialize(void)
 {
     int i;
-    for (i = 0; i < FUTEX_HASHTABLE_CAPACITY; i++) {
-        IrqSpinlockConstruct(&FutexBuckets[i].SyncObject);
-        list_construct(&FutexBuckets[i].Futexes);
+    for (i = 0; i < FUTEX_BOOT_BUCKETS; i++) {
+        IrqSpinlockConstruct(&FutexBootBuckets[i].SyncObject);
+        list_construct(&FutexBootBuckets[i].Waiters);
     }
     smp_wmb();
 }
 
-OsStatus_t
-FutexWait(
+// The table is allocated from pages, with many cores it is larger than the biggest
+// cache kmalloc can serve
+static FutexBucket_t*
+FutexAllocateTable(
+        _In_ size_t bucketCount)
+{
+    size_t     tableSize = bucketCount * sizeof(FutexBucket_t);
+    int        pageCount = (int)DIVUP(tableSize, GetMemorySpacePageSize());
+    uintptr_t* pages;
+    vaddr_t    table;
+    OsStatus_t status;
+
+    pages = (uintptr_t*)kmalloc(sizeof(uintptr_t) * pageCount);
+    if (!pages) {
+        return NULL;
+    }
+
+    status = MemorySpaceMap(GetCurrentMemorySpace(), &table, &pages[0], tableSize,
+                            MAPPING_COMMIT, MAPPING_VIRTUAL_GLOBAL);
+    kfree(pages);
+    if (status != OsSuccess) {
+        ERROR("[futex] failed to map %" PRIuIN " bytes for the bucket table: %u", tableSize, status);
+        return NULL;
+    }
+    return (FutexBucket_t*)table;
+}
+
+void
+FutexInitializeBuckets(void)
+{
+    FutexBucket_t* buckets;
+    size_t         bucketCount = FUTEX_BOOT_BUCKETS;
+    size_t         maxBuckets;
+    size_t         pageCount;
+    size_t         freePages;
+    size_t         i;
+
+    // Size the table after the number of cores, but never let it take up more than a
+    // small fraction of the memory in the system
+    PhysicalMemoryGetStatistics(&GetMachine()->PhysicalMemory, &pageCount, &freePages, NULL);
+    maxBuckets = (pageCount * GetMemorySpacePageSize()) / FUTEX_MEMORY_FRACTION / sizeof(FutexBucket_t);
+    while (bucketCount < (size_t)atomic_load(&GetMachine()->NumberOfCores) * FUTEX_BUCKETS_PER_CORE &&
+           (bucketCount << 1) <= maxBuckets) {
+        bucketCount <<= 1;
+    }
+
+    if (bucketCount == FUTEX_BOOT_BUCKETS) {
+        WARNING("[futex] not enough memory to grow the table, keeping the %i boot buckets", FUTEX_BOOT_BUCKETS);
+        return;
+    }
+
+    buckets = FutexAllocateTable(bucketCount);
+    if (!buckets) {
+        WARNING("[futex] failed to allocate %" PRIuIN " buckets, keeping the boot table", bucketCount);
+        return;
+    }
+
+    for (i = 0; i < bucketCount; i++) {
+        IrqSpinlockConstruct(&buckets[i].SyncObject);
+        list_construct(&buckets[i].Waiters);
+    }
+    smp_wmb();
+
+    FutexBuckets    = buckets;
+    FutexBucketMask = bucketCount - 1;
+    smp_wmb();
+    TRACE("[futex] using %" PRIuIN " buckets", bucketCount);
+}
+
+static OsStatus_t
+FutexWaitInternal(
     _In_ _Atomic(int)* Futex,
     _In_ int           ExpectedValue,
+    _In_ _Atomic(int)* Futex2,
+    _In_ int           Count2,
+    _In_ int           Operation,
     _In_ int           Flags,
     _In_ size_t        Timeout)
 {
-    MemorySpaceContext_t * Context = NULL;
-    FutexBucket_t        *              Bucket;
-    FutexItem_t*                FutexItem;
-    uintptr_t                   FutexAddress;
-    IntStatus_t                 CpuState;
-    TRACE("%u: FutexWait(f 0x%llx, t %u)", ThreadCurrentHandle(), Futex, Timeout);
+    FutexWaiter_t Waiter;
+    FutexBucket_t* Bucket;
+    IntStatus_t    CpuState;
+    OsStatus_t     Status;
     
     if (!SchedulerGetCurrentObject(ArchGetProcessorCoreId())) {
         // This is called by the ACPICA implemention indirectly through the Semaphore
@@ -268,51 +361,55 @@ FutexWait(
         return OsNotSupported;
     }
     
-    // Get the futex context, if the context is private
-    // we can stick to the virtual address for sleeping
-    // otherwise we need to lookup the physical page
-    if (Flags & FUTEX_WAIT_PRIVATE) {
-        Context = GetCurrentMemorySpace()->Context;
-        FutexAddress = (uintptr_t)Futex;
-    }
-    else {
-        if (GetMemorySpaceMapping(GetCurrentMemorySpace(), (uintptr_t)Futex, 
-                1, &FutexAddress) != OsSuccess) {
-            return OsDoesNotExist;
-        }
+    Status = FutexGetKey(Futex, Flags & FUTEX_WAIT_PRIVATE, &Waiter.FutexAddress, &Waiter.Context);
+    if (Status != OsSuccess) {
+        return OsDoesNotExist;
     }
 
-    Bucket = FutexGetBucket(FutexAddress);
+    ELEMENT_INIT(&Waiter.Header, 0, &Waiter);
+    list_construct(&Waiter.BlockQueue);
+    Bucket        = FutexGetBucket(Waiter.FutexAddress, Waiter.Context);
+    Waiter.Bucket = Bucket;
+    Waiter.Queued = 1;
     
     // Disable interrupts here to gain safe passage, as we don't want to be
-    // interrupted in this 'atomic' action. However when competing with other
-    // cpus here, we must take care to flush any changes and reload any changes
+    // interrupted in this 'atomic' action. The value is checked with the bucket
+    // lock held, which means a waker either sees us queued or we see the new value.
     CpuState = InterruptDisable();
-
-    FutexItem = FutexGetNodeLocked(Bucket, FutexAddress, Context);
-    if (!FutexItem) {
-        FutexItem = FutexCreateNode(Bucket, FutexAddress, Context);
-        if (!FutexItem) {
-            return OsOutOfMemory;
-        }
-    }
-    
-    (void)atomic_fetch_add(&FutexItem->Waiters, 1);
+    IrqSpinlockAcquire(&Bucket->SyncObject);
     if (atomic_load(Futex) != ExpectedValue) {
-        (void)atomic_fetch_sub(&FutexItem->Waiters, 1);
+        IrqSpinlockRelease(&Bucket->SyncObject);
         InterruptRestoreState(CpuState);
-        return OsInterrupted;
+        return OsExists;
     }
     
-    SchedulerBlock(&FutexItem->BlockQueue, Timeout);
+    list_append(&Bucket->Waiters, &Waiter.Header);
+    SchedulerBlock(&Waiter.BlockQueue, Timeout);
+    IrqSpinlockRelease(&Bucket->SyncObject);
+    
+    if (Futex2) {
+        FutexPerformOperation(Futex2, Operation);
+        FutexWake(Futex2, Count2, (Flags & FUTEX_WAIT_PRIVATE) ? FUTEX_WAKE_PRIVATE : 0);
+    }
     InterruptRestoreState(CpuState);
     ThreadingYield();
 
-    (void)atomic_fetch_sub(&FutexItem->Waiters, 1);
+    FutexUnlinkWaiter(&Waiter);
     TRACE("%u: woke up", ThreadCurrentHandle());
     return SchedulerGetTimeoutReason();
 }
 
+OsStatus_t
+FutexWait(
+    _In_ _Atomic(int)* Futex,
+    _In_ int           ExpectedValue,
+    _In_ int           Flags,
+    _In_ size_t        Timeout)
+{
+    TRACE("%u: FutexWait(f 0x%llx, t %u)", ThreadCurrentHandle(), Futex, Timeout);
+    return FutexWaitInternal(Futex, ExpectedValue, NULL, 0, 0, Flags, Timeout);
+}
+
 OsStatus_t
 FutexWaitOperation(
     _In_ _Atomic(int)* Futex,
@@ -323,66 +420,8 @@ FutexWaitOperation(
     _In_ int           Flags,
     _In_ size_t        Timeout)
 {
-    MemorySpaceContext_t * Context = NULL;
-    FutexBucket_t        *              Bucket;
-    FutexItem_t*                FutexItem;
-    uintptr_t                   FutexAddress;
-    IntStatus_t                 CpuState;
     TRACE("%u: FutexWaitOperation(f 0x%llx, t %u)", ThreadCurrentHandle(), Futex, Timeout);
-    
-    if (!SchedulerGetCurrentObject(ArchGetProcessorCoreId())) {
-        // This is called by the ACPICA implemention indirectly through the Semaphore
-        // implementation, which occurs during boot up of cores before a scheduler is running.
-        // In this case we want the semaphore to act like a spinlock, which it will if we just
-        // return anything else than OsTimeout.
-        return OsNotSupported;
-    }
-    
-    // Get the futex context, if the context is private
-    // we can stick to the virtual address for sleeping
-    // otherwise we need to lookup the physical page
-    if (Flags & FUTEX_WAIT_PRIVATE) {
-        Context = GetCurrentMemorySpace()->Context;
-        FutexAddress = (uintptr_t)Futex;
-    }
-    else {
-        if (GetMemorySpaceMapping(GetCurrentMemorySpace(), (uintptr_t)Futex, 
-                1, &FutexAddress) != OsSuccess) {
-            return OsDoesNotExist;
-        }
-    }
-    
-    Bucket = FutexGetBucket(FutexAddress);
-    
-    // Disable interrupts here to gain safe passage, as we don't want to be
-    // interrupted in this 'atomic' action. However when competing with other
-    // cpus here, we must take care to flush any changes and reload any changes
-    CpuState = InterruptDisable();
-
-    FutexItem = FutexGetNodeLocked(Bucket, FutexAddress, Context);
-    if (!FutexItem) {
-        FutexItem = FutexCreateNode(Bucket, FutexAddress, Context);
-        if (!FutexItem) {
-            return OsOutOfMemory;
-        }
-    }
-    
-    (void)atomic_fetch_add(&FutexItem->Waiters, 1);
-    if (atomic_load(Futex) != ExpectedValue) {
-        (void)atomic_fetch_sub(&FutexItem->Waiters, 1);
-        InterruptRestoreState(CpuState);
-        return OsInterrupted;
-    }
-    
-    SchedulerBlock(&FutexItem->BlockQueue, Timeout);
-    FutexPerformOperation(Futex2, Operation);
-    FutexWake(Futex2, Count2, Flags);
-    InterruptRestoreState(CpuState);
-    ThreadingYield();
-    
-    (void)atomic_fetch_sub(&FutexItem->Waiters, 1);
-    TRACE("%u: woke up", ThreadCurrentHandle());
-    return SchedulerGetTimeoutReason();
+    return FutexWaitInternal(Futex, ExpectedValue, Futex2, Count2, Operation, Flags, Timeout);
 }
 
 OsStatus_t
@@ -391,70 +430,20 @@ FutexWake(
     _In_ int           Count,
     _In_ int           Flags)
 {
-    MemorySpaceContext_t* Context = NULL;
+    MemorySpaceContext_t* Context;
     FutexBucket_t*        Bucket;
-    FutexItem_t*          FutexItem;
-    OsStatus_t            Status = OsDoesNotExist;
     uintptr_t             FutexAddress;
-    int                   WaiterCount;
-    int                   i;
-    
-    // Get the futex context, if the context is private
-    // we can stick to the virtual address for sleeping
-    // otherwise we need to lookup the physical page
-    if (Flags & FUTEX_WAKE_PRIVATE) {
-        Context = GetCurrentMemorySpace()->Context;
-        FutexAddress = (uintptr_t)Futex;
-    }
-    else {
-        if (GetMemorySpaceMapping(GetCurrentMemorySpace(), (uintptr_t)Futex, 
-                1, &FutexAddress) != OsSuccess) {
-            return OsDoesNotExist;
-        }
-    }
+    int                   Woken;
     
-    Bucket = FutexGetBucket(FutexAddress);
-
-    FutexItem = FutexGetNodeLocked(Bucket, FutexAddress, Context);
-    if (!FutexItem) {
+    if (FutexGetKey(Futex, Flags & FUTEX_WAKE_PRIVATE, &FutexAddress, &Context) != OsSuccess) {
         return OsDoesNotExist;
     }
     
-    WaiterCount = atomic_load(&FutexItem->Waiters);
-    
-WakeWaiters:
-    for (i = 0; i < Count; i++) {
-        element_t* Front;
-        
-        IrqSpinlockAcquire(&FutexItem->BlockQueueSyncObject);
-        Front = list_front(&FutexItem->BlockQueue);
-        if (Front) {
-            // This is only neccessary while the list itself is thread-safe
-            // otherwise we need a new list structure that can be shared including
-            // a lock.
-            if (list_remove(&FutexItem->BlockQueue, Front)) {
-                Front = NULL;
-            }
-        }
-        IrqSpinlockRelease(&FutexItem->BlockQueueSyncObject);
-        
-        if (Front) {
-            Status = SchedulerQueueObject(Front->value);
-            if (Status != OsSuccess) {
-                break;
-            }
-        }
-        else {
-            break;
-        }
-    }
-    
-    // Handle possible race-condition between wait/wake
-    if (!WaiterCount && atomic_load(&FutexItem->Waiters) != 0) {
-        WaiterCount = 1; // Only do this once!
-        goto WakeWaiters;
-    }
-    return Status;
+    Bucket = FutexGetBucket(FutexAddress, Context);
+    IrqSpinlockAcquire(&Bucket->SyncObject);
+    Woken = FutexWakeWaiters(Bucket, FutexAddress, Context, Count);
+    IrqSpinlockRelease(&Bucket->SyncObject);
+    return Woken != 0 ? OsSuccess : OsDoesNotExist;
 }
 
 OsStatus_t
@@ -478,3 +467,75 @@ FutexWakeOperation(
     }
     return Status;
 }
+
+OsStatus_t
+FutexRequeue(
+    _In_ _Atomic(int)* Futex,
+    _In_ int           Count,
+    _In_ _Atomic(int)* Futex2,
+    _In_ int           Count2,
+    _In_ int           ExpectedValue,
+    _In_ int           Flags)
+{
+    MemorySpaceContext_t* Context;
+    MemorySpaceContext_t* Context2;
+    FutexBucket_t*        Bucket;
+    FutexBucket_t*        Bucket2;
+    uintptr_t             FutexAddress;
+    uintptr_t             FutexAddress2;
+    OsStatus_t            Status = OsDoesNotExist;
+    element_t*            i;
+    int                   Woken;
+    int                   Moved = 0;
+    TRACE("%u: FutexRequeue(f 0x%llx => 0x%llx)", ThreadCurrentHandle(), Futex, Futex2);
+    
+    if (FutexGetKey(Futex, Flags & FUTEX_WAKE_PRIVATE, &FutexAddress, &Context) != OsSuccess ||
+        FutexGetKey(Futex2, Flags & FUTEX_WAKE_PRIVATE, &FutexAddress2, &Context2) != OsSuccess) {
+        return OsDoesNotExist;
+    }
+    
+    // Always lock the buckets in the same order
+    Bucket  = FutexGetBucket(FutexAddress, Context);
+    Bucket2 = FutexGetBucket(FutexAddress2, Context2);
+    IrqSpinlockAcquire(&MIN(Bucket, Bucket2)->SyncObject);
+    if (Bucket != Bucket2) {
+        IrqSpinlockAcquire(&MAX(Bucket, Bucket2)->SyncObject);
+    }
+    
+    // Like a wait, the value must be checked while holding the lock, otherwise the
+    // waiters might be moved after the condition they wait for has changed again.
+    if (atomic_load(Futex) != ExpectedValue) {
+        Status = OsInterrupted;
+        goto Exit;
+    }
+    
+    Woken = FutexWakeWaiters(Bucket, FutexAddress, Context, Count);
+    i     = Bucket->Waiters.head;
+    while (i && Moved < Count2) {
+        FutexWaiter_t* Waiter = (FutexWaiter_t*)i->value;
+        element_t*     Next   = i->next;
+        
+        if (Waiter->FutexAddress == FutexAddress && Waiter->Context == Context) {
+            if (Bucket != Bucket2) {
+                (void)list_remove(&Bucket->Waiters, &Waiter->Header);
+                list_append(&Bucket2->Waiters, &Waiter->Header);
+                WRITE_VOLATILE(Waiter->Bucket, Bucket2);
+            }
+            Waiter->FutexAddress = FutexAddress2;
+            Waiter->Context      = Context2;
+            Moved++;
+        }
+        i = Next;
+    }
+    
+    if (Woken || Moved) {
+        Status = OsSuccess;
+    }
+    
+Exit:
+    if (Bucket != Bucket2) {
+        IrqSpinlockRelease(&MAX(Bucket, Bucket2)->SyncObject);
+    }
+    IrqSpinlockRelease(&MIN(Bucket, Bucket2)->SyncObject);
+    return Status;
+}
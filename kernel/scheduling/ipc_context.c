@@ -72,7 +72,10 @@ IpcContextCreate(
     
     Context->CreatorThreadHandle = ThreadCurrentHandle();
     
-    Status = MemoryRegionCreate(Size, Size, 0, &KernelMapping, UserContextOut,
+    // The stream capacity is rounded down to a power of two, so make room for the
+    // header to avoid halving it
+    Status = MemoryRegionCreate(Size + sizeof(streambuffer_t), Size + sizeof(streambuffer_t), 0,
+        &KernelMapping, UserContextOut,
         &Context->MemoryRegionHandle);
     if (Status != OsSuccess) {
         kfree(Context);
@@ -81,7 +84,7 @@ IpcContextCreate(
     
     Context->Handle       = CreateHandle(HandleTypeIpcContext, IpcContextDestroy, Context);
     Context->KernelStream = (streambuffer_t*)KernelMapping;
-    streambuffer_construct(Context->KernelStream, Size - sizeof(streambuffer_t), 
+    streambuffer_construct(Context->KernelStream, Size, 
         STREAMBUFFER_GLOBAL | STREAMBUFFER_MULTIPLE_WRITERS);
     
     *HandleOut = Context->Handle;
@@ -61,11 +61,17 @@ typedef struct SchedulerObject {
     size_t                  TimeSlice;
     size_t                  TimeSliceLeft;
     int                     Queue;
+    size_t                  QueuedGeneration;
     struct SchedulerObject* Link;
     void*                   Object;
     
     list_t*                 WaitQueueHandle;
     size_t                  TimeLeft;
+    uint64_t                Deadline;
+    size_t                  DeadlineSequence;
+    struct SchedulerObject* SleepChild;
+    struct SchedulerObject* SleepSibling;
+    struct SchedulerObject* SleepPrevious;
     OsStatus_t              TimeoutReason;
     clock_t                 InterruptedAt;
 } SchedulerObject_t;
@@ -174,7 +180,7 @@ GetNameOfObject(
 }
 
 static void
-AppendToQueue(
+AppendToList(
     _In_ SchedulerQueue_t*  Queue,
     _In_ SchedulerObject_t* Start,
     _In_ SchedulerObject_t* End)
@@ -194,7 +200,7 @@ AppendToQueue(
 }
 
 static OsStatus_t
-RemoveFromQueue(
+RemoveFromList(
     _In_ SchedulerQueue_t*  Queue,
     _In_ SchedulerObject_t* Object)
 {
@@ -223,6 +229,190 @@ RemoveFromQueue(
     return OsDoesNotExist;
 }
 
+static inline void
+MarkQueueOccupied(
+    _In_ Scheduler_t* Scheduler,
+    _In_ int          Level)
+{
+    Scheduler->QueueBitmap[Level / SCHEDULER_BITMAP_BITS] |= (1U << (Level % SCHEDULER_BITMAP_BITS));
+}
+
+static inline void
+MarkQueueEmpty(
+    _In_ Scheduler_t* Scheduler,
+    _In_ int          Level)
+{
+    Scheduler->QueueBitmap[Level / SCHEDULER_BITMAP_BITS] &= ~(1U << (Level % SCHEDULER_BITMAP_BITS));
+}
+
+// Returns the highest priority level that has objects queued, or -1 if
+// all the levels are empty.
+static inline int
+GetFirstOccupiedQueue(
+    _In_ Scheduler_t* Scheduler)
+{
+    int i;
+    for (i = 0; i < SCHEDULER_BITMAP_WORDS; i++) {
+        if (Scheduler->QueueBitmap[i]) {
+            return (i * SCHEDULER_BITMAP_BITS) + __builtin_ctz(Scheduler->QueueBitmap[i]);
+        }
+    }
+    return -1;
+}
+
+static void
+AppendToQueue(
+    _In_ Scheduler_t*       Scheduler,
+    _In_ int                Level,
+    _In_ SchedulerObject_t* Start,
+    _In_ SchedulerObject_t* End)
+{
+    AppendToList(&Scheduler->Queues[Level], Start, End);
+    MarkQueueOccupied(Scheduler, Level);
+}
+
+static OsStatus_t
+RemoveFromQueue(
+    _In_ Scheduler_t*       Scheduler,
+    _In_ int                Level,
+    _In_ SchedulerObject_t* Object)
+{
+    OsStatus_t Status = RemoveFromList(&Scheduler->Queues[Level], Object);
+    if (Scheduler->Queues[Level].Head == NULL) {
+        MarkQueueEmpty(Scheduler, Level);
+    }
+    return Status;
+}
+
+// Objects are ordered by their absolute deadline, and objects sharing a deadline
+// are ordered by the time they were put to sleep.
+static inline int
+DeadlineBefore(
+    _In_ SchedulerObject_t* Object1,
+    _In_ SchedulerObject_t* Object2)
+{
+    if (Object1->Deadline != Object2->Deadline) {
+        return Object1->Deadline < Object2->Deadline;
+    }
+    return (Object1->DeadlineSequence - Object2->DeadlineSequence) > (__MASK >> 1);
+}
+
+static SchedulerObject_t*
+MeldSleepObjects(
+    _In_ SchedulerObject_t* Root1,
+    _In_ SchedulerObject_t* Root2)
+{
+    SchedulerObject_t* Parent;
+    SchedulerObject_t* Child;
+
+    if (Root1 == NULL) return Root2;
+    if (Root2 == NULL) return Root1;
+
+    if (DeadlineBefore(Root2, Root1)) {
+        Parent = Root2;
+        Child  = Root1;
+    }
+    else {
+        Parent = Root1;
+        Child  = Root2;
+    }
+
+    // Insert the child as the first child of the parent
+    Child->SleepSibling  = Parent->SleepChild;
+    Child->SleepPrevious = Parent;
+    if (Parent->SleepChild) {
+        Parent->SleepChild->SleepPrevious = Child;
+    }
+    Parent->SleepChild = Child;
+    return Parent;
+}
+
+// Standard two-pass pairing of a list of siblings, first pass melds pairs from
+// left to right, the second pass melds the results from right to left.
+static SchedulerObject_t*
+MergeSleepSiblings(
+    _In_ SchedulerObject_t* First)
+{
+    SchedulerObject_t* Pairs = NULL;
+    SchedulerObject_t* Result = NULL;
+
+    while (First) {
+        SchedulerObject_t* Object1 = First;
+        SchedulerObject_t* Object2 = First->SleepSibling;
+        
+        First = (Object2 != NULL) ? Object2->SleepSibling : NULL;
+        Object1->SleepSibling  = NULL;
+        Object1->SleepPrevious = NULL;
+        if (Object2 != NULL) {
+            Object2->SleepSibling  = NULL;
+            Object2->SleepPrevious = NULL;
+            Object1 = MeldSleepObjects(Object1, Object2);
+        }
+
+        Object1->SleepSibling = Pairs;
+        Pairs                 = Object1;
+    }
+
+    while (Pairs) {
+        SchedulerObject_t* Next = Pairs->SleepSibling;
+        Pairs->SleepSibling = NULL;
+        Result = MeldSleepObjects(Result, Pairs);
+        Pairs  = Next;
+    }
+    return Result;
+}
+
+static inline int
+IsInSleepQueue(
+    _In_ Scheduler_t*       Scheduler,
+    _In_ SchedulerObject_t* Object)
+{
+    return Scheduler->SleepQueue == Object || Object->SleepPrevious != NULL;
+}
+
+static void
+AppendToSleepQueue(
+    _In_ Scheduler_t*       Scheduler,
+    _In_ SchedulerObject_t* Object)
+{
+    Object->Deadline         = Scheduler->Clock + Object->TimeLeft;
+    Object->DeadlineSequence = Scheduler->SleepSequence++;
+    Object->SleepChild       = NULL;
+    Object->SleepSibling     = NULL;
+    Object->SleepPrevious    = NULL;
+    Scheduler->SleepQueue = MeldSleepObjects(Scheduler->SleepQueue, Object);
+}
+
+static void
+RemoveFromSleepQueue(
+    _In_ Scheduler_t*       Scheduler,
+    _In_ SchedulerObject_t* Object)
+{
+    SchedulerObject_t* Children = MergeSleepSiblings(Object->SleepChild);
+    
+    if (Scheduler->SleepQueue == Object) {
+        Scheduler->SleepQueue = Children;
+    }
+    else {
+        // Unlink the object from either its parent or its left sibling
+        if (Object->SleepPrevious->SleepChild == Object) {
+            Object->SleepPrevious->SleepChild = Object->SleepSibling;
+        }
+        else {
+            Object->SleepPrevious->SleepSibling = Object->SleepSibling;
+        }
+        
+        if (Object->SleepSibling) {
+            Object->SleepSibling->SleepPrevious = Object->SleepPrevious;
+        }
+        Scheduler->SleepQueue = MeldSleepObjects(Scheduler->SleepQueue, Children);
+    }
+
+    Object->SleepChild    = NULL;
+    Object->SleepSibling  = NULL;
+    Object->SleepPrevious = NULL;
+}
+
 static void
 QueueForScheduler(
         _In_ Scheduler_t* Scheduler,
@@ -231,19 +421,17 @@ QueueForScheduler(
 {
     int ResultState;
     
-    // Verify it doesn't exist in sleep queue, and check both the case where
-    // it is the end of the list and if it's not
-    if (Object->Link != NULL ||
-        Scheduler->SleepQueue.Tail == Object ||
-        Scheduler->SleepQueue.Head == Object) {
-        RemoveFromQueue(&Scheduler->SleepQueue, Object);
+    // Verify it doesn't exist in sleep queue
+    if (IsInSleepQueue(Scheduler, Object)) {
+        RemoveFromSleepQueue(Scheduler, Object);
     }
     
     ResultState = ExecuteEvent(Object, EVENT_QUEUE_FINISH);
     if (ResultState == STATE_INVALID) {
         FATAL(FATAL_SCOPE_KERNEL, "[scheduler] [queue] object was NOT in correct state for queueing");
     }
-    AppendToQueue(&Scheduler->Queues[Object->Queue], Object, Object);
+    Object->QueuedGeneration = Scheduler->Generation;
+    AppendToQueue(Scheduler, Object->Queue, Object, Object);
 }
 
 static void
@@ -252,7 +440,9 @@ QueueOnCoreFunction(
 {
     Scheduler_t*       scheduler = CpuCoreScheduler(CpuCoreCurrent());
     SchedulerObject_t* object    = (SchedulerObject_t*)Context;
+    IrqSpinlockAcquire(&scheduler->SyncObject);
     QueueForScheduler(scheduler, object, 1);
+    IrqSpinlockRelease(&scheduler->SyncObject);
     if (ThreadIsCurrentIdle(object->CoreId)) {
         ThreadingYield();
     }
@@ -280,21 +470,27 @@ QueueObjectImmediately(
     }
 }
 
+static SystemCpu_t*
+GetSchedulingCoreGroup(void)
+{
+    SystemDomain_t* domain = GetCurrentDomain();
+    
+    // Select the default core range, or use the core range from our domain
+    if (domain != NULL) {
+        return &domain->CoreGroup;
+    }
+    return &GetMachine()->Processor;
+}
+
 static void
 AllocateScheduler(
     _In_ SchedulerObject_t* Object)
 {
-    SystemDomain_t*  domain    = GetCurrentDomain();
-    SystemCpu_t*     coreGroup = &GetMachine()->Processor;
+    SystemCpu_t*     coreGroup = GetSchedulingCoreGroup();
     SystemCpuCore_t* iter;
     Scheduler_t*     scheduler;
     UUId_t           coreId;
     
-    // Select the default core range
-    if (domain != NULL) {
-        // Use the core range from our domain
-        coreGroup = &domain->CoreGroup;
-    }
     scheduler = CpuCoreScheduler(coreGroup->Cores);
     coreId    = CpuCoreId(coreGroup->Cores);
     iter      = CpuCoreNext(coreGroup->Cores);
@@ -544,10 +740,11 @@ SchedulerBoost(
 {
     for (int i = 1; i < SCHEDULER_LEVEL_CRITICAL; i++) {
         if (Scheduler->Queues[i].Head) {
-            AppendToQueue(&Scheduler->Queues[0], 
+            AppendToQueue(Scheduler, 0, 
                 Scheduler->Queues[i].Head, Scheduler->Queues[i].Tail);
             Scheduler->Queues[i].Head = NULL;
             Scheduler->Queues[i].Tail = NULL;
+            MarkQueueEmpty(Scheduler, i);
         }
     }
 }
@@ -559,6 +756,10 @@ PerformObjectTimeout(
 {
     int ResultState;
     
+    // Always take it out of the sleep queue, otherwise it would be timed out again
+    RemoveFromSleepQueue(Scheduler, Object);
+    Object->TimeLeft = 0;
+    
     ResultState = ExecuteEvent(Object, EVENT_QUEUE);
     if (ResultState != STATE_INVALID) {
         if (Object->WaitQueueHandle != NULL) {
@@ -574,32 +775,22 @@ PerformObjectTimeout(
     }
 }
 
-// The sleep list is thread-safe due to the fact that the function that removes
+// The sleep queue is thread-safe due to the fact that the function that removes
 // from the sleep queue is only called on this core, while the function that adds
-// is also only called on this core, and the list here is only iterated on this core.
+// is also only called on this core. Only the objects that have timed out are
+// visited, the heap root provides the next deadline.
 static size_t
 SchedulerUpdateSleepQueue(
-        _In_ Scheduler_t* Scheduler,
-        _In_ SchedulerObject_t* IgnoreObject,
-        _In_ size_t             MillisecondsPassed)
+        _In_ Scheduler_t* Scheduler)
 {
-    size_t             NextUpdate = __MASK;
-    SchedulerObject_t* i          = Scheduler->SleepQueue.Head;
-    
-    while (i) {
-        if (i != IgnoreObject && i->TimeLeft) {
-            i->TimeLeft -= MIN(i->TimeLeft, MillisecondsPassed);
-            if (!i->TimeLeft) {
-                PerformObjectTimeout(Scheduler, i);
-            }
-        }
-        
-        if (i->TimeLeft) {
-            NextUpdate = MIN(i->TimeLeft, NextUpdate);
-        }
-        i = i->Link;
+    while (Scheduler->SleepQueue != NULL && Scheduler->SleepQueue->Deadline <= Scheduler->Clock) {
+        PerformObjectTimeout(Scheduler, Scheduler->SleepQueue);
     }
-    return NextUpdate;
+
+    if (Scheduler->SleepQueue == NULL) {
+        return __MASK;
+    }
+    return (size_t)(Scheduler->SleepQueue->Deadline - Scheduler->Clock);
 }
 
 static void
@@ -629,12 +820,120 @@ HandleObjectRequeue(
         QueueForScheduler(Scheduler, Object, 0);
     }
     else if (Object->TimeLeft != 0) {
-        TRACE("[scheduler] [advance] sleep 0x%llx (Head 0x%llx, Tail 0x%llx)", 
-            Object->Link, Scheduler->SleepQueue.Head, Scheduler->SleepQueue.Tail);
+        TRACE("[scheduler] [advance] sleep 0x%llx for %" PRIuIN " (Root 0x%llx)", 
+            Object, Object->TimeLeft, Scheduler->SleepQueue);
         // OK, so the we are blocking this object which means we won't be
         // queuing the object up again, should we track the sleep?
-        AppendToQueue(&Scheduler->SleepQueue, Object, Object);
+        AppendToSleepQueue(Scheduler, Object);
+    }
+}
+
+static Scheduler_t*
+FindBusiestScheduler(
+    _In_  Scheduler_t*   Scheduler,
+    _Out_ unsigned long* BandwidthOut)
+{
+    SystemCpuCore_t* iter    = GetSchedulingCoreGroup()->Cores;
+    Scheduler_t*     busiest = NULL;
+    unsigned long    busiestBandwidth = 0;
+
+    while (iter) {
+        Scheduler_t*  iterScheduler = CpuCoreScheduler(iter);
+        unsigned long bandwidth;
+        
+        smp_rmb();
+        if (iterScheduler == Scheduler || !(CpuCoreState(iter) & CpuStateRunning)) {
+            iter = CpuCoreNext(iter);
+            continue;
+        }
+        
+        bandwidth = atomic_load(&iterScheduler->Bandwidth);
+        if (bandwidth > busiestBandwidth) {
+            busiest          = iterScheduler;
+            busiestBandwidth = bandwidth;
+        }
+        iter = CpuCoreNext(iter);
+    }
+    
+    *BandwidthOut = busiestBandwidth;
+    return busiest;
+}
+
+// Objects queued during the current generation of the victim might still be
+// executing on the stack of the victim core, they are not stealable until the
+// victim has advanced again. Lower priority levels are preferred.
+static SchedulerObject_t*
+StealFromScheduler(
+    _In_ Scheduler_t* Victim)
+{
+    SchedulerObject_t* object = NULL;
+    int                level;
+    
+    IrqSpinlockAcquire(&Victim->SyncObject);
+    for (level = SCHEDULER_LEVEL_LOW; level >= 0 && object == NULL; level--) {
+        SchedulerObject_t* i;
+        
+        if (!(Victim->QueueBitmap[level / SCHEDULER_BITMAP_BITS] & (1U << (level % SCHEDULER_BITMAP_BITS)))) {
+            continue;
+        }
+        
+        for (i = Victim->Queues[level].Head; i != NULL; i = i->Link) {
+            if (!(READ_VOLATILE(i->Flags) & SCHEDULER_FLAG_BOUND) &&
+                i->QueuedGeneration != Victim->Generation) {
+                object = i;
+                break;
+            }
+        }
+        
+        if (object != NULL) {
+            RemoveFromQueue(Victim, level, object);
+            atomic_fetch_sub(&Victim->Bandwidth, object->TimeSlice);
+            atomic_fetch_sub(&Victim->ObjectCount, 1);
+        }
     }
+    IrqSpinlockRelease(&Victim->SyncObject);
+    return object;
+}
+
+// Pulls an object from the busiest core in the core group, this must be called
+// without holding the scheduler lock of the current core.
+static SchedulerObject_t*
+MigrateObject(
+    _In_ Scheduler_t* Scheduler,
+    _In_ UUId_t       CoreId,
+    _In_ int          Balance)
+{
+    SchedulerObject_t* object;
+    Scheduler_t*       busiest;
+    unsigned long      busiestBandwidth;
+    
+    busiest = FindBusiestScheduler(Scheduler, &busiestBandwidth);
+    if (busiest == NULL || atomic_load(&busiest->ObjectCount) <= 1) {
+        return NULL;
+    }
+    
+    if (Balance && busiestBandwidth < (atomic_load(&Scheduler->Bandwidth) + SCHEDULER_BALANCE_THRESHOLD)) {
+        return NULL;
+    }
+    
+    object = StealFromScheduler(busiest);
+    if (object != NULL) {
+        TRACE("[scheduler] [migrate] %s to core %u", GetNameOfObject(object), CoreId);
+        object->CoreId = CoreId;
+        atomic_fetch_add(&Scheduler->Bandwidth, object->TimeSlice);
+        atomic_fetch_add(&Scheduler->ObjectCount, 1);
+        atomic_fetch_add(&Scheduler->Migrations, 1);
+        smp_wmb();
+    }
+    return object;
+}
+
+size_t
+SchedulerGetMigrations(
+    _In_ Scheduler_t* Scheduler)
+{
+    assert(Scheduler != NULL);
+    return atomic_load(&Scheduler->Migrations);
 }
 
 void*
@@ -644,7 +943,8 @@ SchedulerAdvance(
     _In_  size_t             MillisecondsPassed,
     _Out_ size_t*            NextDeadlineOut)
 {
-    Scheduler_t*       scheduler  = CpuCoreScheduler(CpuCoreCurrent());
+    SystemCpuCore_t*   core       = CpuCoreCurrent();
+    Scheduler_t*       scheduler  = CpuCoreScheduler(core);
     SchedulerObject_t* nextObject = NULL;
     clock_t            currentClock;
     size_t             nextDeadline;
@@ -655,13 +955,21 @@ SchedulerAdvance(
     // Allow Object to be NULL but not NextDeadlineOut
     assert(NextDeadlineOut != NULL);
     
+    IrqSpinlockAcquire(&scheduler->SyncObject);
+    
+    // Move the scheduler clock forward, all deadlines are relative to this
+    scheduler->Clock += MillisecondsPassed;
+    scheduler->Generation++;
+    
     // In one case we can skip the whole requeue etc etc. This happens when there
     // was a sleep event before the objects time-slice is out. Adjust and continue
     if (Object != NULL && Preemptive && MillisecondsPassed < Object->TimeSliceLeft) {
         // Steps to take here is, adjusting the current time-slice,
         // updating the sleep queue and returning the current task again
         Object->TimeSliceLeft -= MillisecondsPassed;
-        nextDeadline = SchedulerUpdateSleepQueue(scheduler, NULL, MillisecondsPassed);
+        nextDeadline = SchedulerUpdateSleepQueue(scheduler);
+        IrqSpinlockRelease(&scheduler->SyncObject);
+        
         *NextDeadlineOut       = MIN(Object->TimeSliceLeft, nextDeadline);
         TRACE("[scheduler] [advance] redeploy next deadline %llu", *NextDeadlineOut);
         return Object->Object;
@@ -673,18 +981,14 @@ SchedulerAdvance(
     if (Object != NULL) {
         HandleObjectRequeue(scheduler, Object, Preemptive);
     }
-    nextDeadline = SchedulerUpdateSleepQueue(scheduler, Object, MillisecondsPassed);
-
-    // Get next object
-    for (i = 0; i < SCHEDULER_LEVEL_COUNT; i++) {
-        if (scheduler->Queues[i].Head != NULL) {
-            nextObject = scheduler->Queues[i].Head;
-            RemoveFromQueue(&scheduler->Queues[i], nextObject);
-            UpdatePressureForObject(scheduler, nextObject, i);
-            nextDeadline = MIN(nextObject->TimeSlice, nextDeadline);
-            ExecuteEvent(nextObject, EVENT_EXECUTE);
-            break;
-        }
+    nextDeadline = SchedulerUpdateSleepQueue(scheduler);
+
+    // Get next object from the highest priority level that is occupied
+    i = GetFirstOccupiedQueue(scheduler);
+    if (i != -1) {
+        nextObject = scheduler->Queues[i].Head;
+        RemoveFromQueue(scheduler, i, nextObject);
+        UpdatePressureForObject(scheduler, nextObject, i);
     }
     
     // Handle the boost timer as long as there are active objects running
@@ -703,12 +1007,40 @@ SchedulerAdvance(
                 scheduler->LastBoost = currentClock;
             }
         }
-        *NextDeadlineOut = nextDeadline;
-        TRACE("[scheduler] [advance] next 0x%llx, deadline in %llu", nextObject, nextDeadline);
     }
     else {
         // Reset boost
         scheduler->LastBoost = 0;
+    }
+    IrqSpinlockRelease(&scheduler->SyncObject);
+    
+    // Idle cores steal work from the busiest core before going idle, while busy
+    // cores periodically pull work if the load between cores is skewed.
+    if (nextObject == NULL) {
+        nextObject = MigrateObject(scheduler, CpuCoreId(core), 0);
+    }
+    else if ((scheduler->Clock - scheduler->LastBalance) >= SCHEDULER_BALANCE_INTERVAL) {
+        SchedulerObject_t* migrated = MigrateObject(scheduler, CpuCoreId(core), 1);
+        scheduler->LastBalance = scheduler->Clock;
+        if (migrated != NULL) {
+            IrqSpinlockAcquire(&scheduler->SyncObject);
+            migrated->QueuedGeneration = scheduler->Generation;
+            AppendToQueue(scheduler, migrated->Queue, migrated, migrated);
+            IrqSpinlockRelease(&scheduler->SyncObject);
+        }
+    }
+    
+    if (nextObject != NULL) {
+        nextDeadline = MIN(nextObject->TimeSlice, nextDeadline);
+        ExecuteEvent(nextObject, EVENT_EXECUTE);
+        *NextDeadlineOut = nextDeadline;
+        TRACE("[scheduler] [advance] next 0x%llx, deadline in %llu", nextObject, nextDeadline);
+    }
+    else {
+        // Keep idle cores ticking on multicore systems so they can steal work
+        if (nextDeadline == __MASK && atomic_load(&GetMachine()->NumberOfActiveCores) > 1) {
+            nextDeadline = SCHEDULER_BALANCE_INTERVAL;
+        }
         *NextDeadlineOut = (nextDeadline == __MASK) ? 0 : nextDeadline;
         TRACE("[scheduler] [advance] no next object, deadline in %llu", *NextDeadlineOut);
     }
@@ -69,6 +69,7 @@ extern OsStatus_t ScGetAssemblyDirectory(char* PathBuffer, size_t MaxLength);
 extern OsStatus_t ScCreateMemorySpace(unsigned int Flags, UUId_t* Handle);
 extern OsStatus_t ScGetThreadMemorySpaceHandle(UUId_t ThreadHandle, UUId_t* Handle);
 extern OsStatus_t ScCreateMemorySpaceMapping(UUId_t Handle, struct MemoryMappingParameters* Parameters, void** AddressOut);
+extern OsStatus_t ScShareMemorySpaceMapping(UUId_t Handle, void* LocalAddress, struct MemoryMappingParameters* Parameters);
 
 // Driver system calls
 extern OsStatus_t ScAcpiQueryStatus(AcpiDescriptor_t* AcpiDescriptor);
@@ -125,6 +126,7 @@ extern OsStatus_t ScDmaAttachmentCommit(struct dma_attachment*, void*, size_t);
 extern OsStatus_t ScDmaAttachmentUnmap(struct dma_attachment*);
 extern OsStatus_t ScDmaDetach(struct dma_attachment*);
 extern OsStatus_t ScDmaGetMetrics(UUId_t, int*, struct dma_sg*);
+extern OsStatus_t ScDmaGetSgRange(UUId_t, size_t, size_t, int*, struct dma_sg*);
 
 extern OsStatus_t ScCreateHandle(UUId_t*);
 extern OsStatus_t ScDestroyHandle(UUId_t Handle);
@@ -145,7 +147,7 @@ extern OsStatus_t ScSystemTick(int tickBase, LargeUInteger_t* tick);
 extern OsStatus_t ScPerformanceFrequency(LargeInteger_t *Frequency);
 extern OsStatus_t ScPerformanceTick(LargeInteger_t *Value);
 
-#define SYSTEM_CALL_COUNT 75
+#define SYSTEM_CALL_COUNT 77
 
 typedef size_t(*SystemCallHandlerFn)(void*,void*,void*,void*,void*);
 
@@ -261,7 +263,13 @@ static struct SystemCallDescriptor {
     DefineSyscall(71, ScSystemTick),
     DefineSyscall(72, ScPerformanceFrequency),
     DefineSyscall(73, ScPerformanceTick),
-    DefineSyscall(74, ScSystemTime)
+    DefineSyscall(74, ScSystemTime),
+
+    // Dma system calls
+    DefineSyscall(75, ScDmaGetSgRange),
+
+    // Memory space system calls
+    DefineSyscall(76, ScShareMemorySpaceMapping)
 };
 
 Context_t*
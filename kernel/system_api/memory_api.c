@@ -352,6 +352,17 @@ ScDmaGetMetrics(
     return MemoryRegionGetSg(Handle, SgCountOut, SgListOut);
 }
 
+OsStatus_t
+ScDmaGetSgRange(
+    _In_  UUId_t         Handle,
+    _In_  size_t         Offset,
+    _In_  size_t         Length,
+    _Out_ int*           SgCountOut,
+    _Out_ struct dma_sg* SgListOut)
+{
+    return MemoryRegionGetSgRange(Handle, Offset, Length, SgCountOut, SgListOut);
+}
+
 OsStatus_t
 ScDmaAttachmentMap(
     _In_ struct dma_attachment* attachment,
@@ -516,6 +527,44 @@ ScCreateMemorySpaceMapping(
 }
 
 
+OsStatus_t
+ScShareMemorySpaceMapping(
+    _In_ UUId_t                          Handle,
+    _In_ void*                           LocalAddress,
+    _In_ struct MemoryMappingParameters* Parameters)
+{
+    SystemModule_t* Module        = GetCurrentModule();
+    MemorySpace_t*  MemorySpace   = (MemorySpace_t*)LookupHandleOfType(Handle, HandleTypeMemorySpace);
+    unsigned int    RequiredFlags = MAPPING_COMMIT | MAPPING_USERSPACE;
+    vaddr_t         Placement;
+
+    if (Parameters == NULL || LocalAddress == NULL || Module == NULL) {
+        if (Module == NULL) {
+            return OsDoesNotExist;
+        }
+        return OsInvalidParameters;
+    }
+    TRACE("[sc_share] local address 0x%" PRIxIN ", target address 0x%" PRIxIN ", length 0x%" PRIxIN,
+        LocalAddress, Parameters->VirtualAddress, Parameters->Length);
+
+    if (MemorySpace == NULL) {
+        return OsDoesNotExist;
+    }
+
+    if (Parameters->Flags & MEMORY_EXECUTABLE) {
+        RequiredFlags |= MAPPING_EXECUTABLE;
+    }
+    if (!(Parameters->Flags & MEMORY_WRITE)) {
+        RequiredFlags |= MAPPING_READONLY;
+    }
+
+    // The pages stay owned by the caller, the target space gets a persistent mapping
+    // of them that keeps the allocation of the caller alive until it is unmapped
+    Placement = Parameters->VirtualAddress;
+    return MemorySpaceCloneMapping(GetCurrentMemorySpace(), MemorySpace, (vaddr_t)LocalAddress,
+                                   &Placement, Parameters->Length, RequiredFlags, MAPPING_VIRTUAL_FIXED);
+}
+
 OsStatus_t
 ScMapThreadMemoryRegion(
     _In_  UUId_t    threadHandle,
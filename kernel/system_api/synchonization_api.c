@@ -45,7 +45,12 @@ OsStatus_t
 ScFutexWake(
     _In_ FutexParameters_t* parameters)
 {
-    // Also two versions of wake
+    // Also two versions of wake, and the requeue
+    if (parameters->_flags & FUTEX_WAKE_REQUEUE) {
+        return FutexRequeue(parameters->_futex0, parameters->_val0,
+                            parameters->_futex1, parameters->_val1, parameters->_val2,
+                            parameters->_flags);
+    }
     if (parameters->_flags & FUTEX_WAKE_OP) {
         return FutexWakeOperation(parameters->_futex0, parameters->_val0,
                                   parameters->_futex1, parameters->_val1, parameters->_val2,
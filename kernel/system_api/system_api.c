@@ -26,6 +26,7 @@
 #include <arch/utils.h>
 #include <os/mollenos.h>
 #include <memoryspace.h>
+#include <scheduler.h>
 #include <threading.h>
 #include <console.h>
 #include <machine.h>
@@ -66,16 +67,32 @@ OsStatus_t
 ScSystemQuery(
     _In_ SystemDescriptor_t* Descriptor)
 {
-    int MaxBlocks = GetMachine()->PhysicalMemory.capacity;
-    int FreeBlocks = GetMachine()->PhysicalMemory.index;
+    SystemCpuCore_t* Core = GetMachine()->Processor.Cores;
+    size_t           FreeBlocks[PHYSICAL_MEMORY_ORDER_COUNT];
+    size_t           MaxBlocks;
+    size_t           FreePages;
+    int              i;
     
     Descriptor->NumberOfProcessors  = atomic_load(&GetMachine()->NumberOfProcessors);
     Descriptor->NumberOfActiveCores = atomic_load(&GetMachine()->NumberOfActiveCores);
+    
+    for (i = 0; i < SYSTEM_DESCRIPTOR_MAX_CORES; i++) {
+        Descriptor->ThreadMigrations[i] = 0;
+        if (Core != NULL) {
+            Descriptor->ThreadMigrations[i] = SchedulerGetMigrations(CpuCoreScheduler(Core));
+            Core = CpuCoreNext(Core);
+        }
+    }
+
+    PhysicalMemoryGetStatistics(&GetMachine()->PhysicalMemory, &MaxBlocks, &FreePages, &FreeBlocks[0]);
+    for (i = 0; i < SYSTEM_DESCRIPTOR_MAX_ORDERS; i++) {
+        Descriptor->FreeBlocks[i] = (i < PHYSICAL_MEMORY_ORDER_COUNT) ? FreeBlocks[i] : 0;
+    }
 
     Descriptor->AllocationGranularityBytes = GetMachine()->MemoryGranularity;
     Descriptor->PageSizeBytes              = GetMemorySpacePageSize();
     Descriptor->PagesTotal                 = MaxBlocks;
-    Descriptor->PagesUsed                  = MaxBlocks - FreeBlocks;
+    Descriptor->PagesUsed                  = MaxBlocks - FreePages;
     return OsSuccess;
 }
 
@@ -112,4 +112,7 @@ _CODE_END
 #define Syscall_SystemPerformanceTime(Value)                               (OsStatus_t)syscall1(73, SCPARAM(Value))
 #define Syscall_SystemTime(Time)                                           (OsStatus_t)syscall1(74, SCPARAM(Time))
 
+#define Syscall_DmaGetSgRange(Handle, Offset, Length, SizeOut, VectorsOut) (OsStatus_t)syscall5(75, SCPARAM(Handle), SCPARAM(Offset), SCPARAM(Length), SCPARAM(SizeOut), SCPARAM(VectorsOut))
+#define Syscall_ShareMemorySpaceMapping(Handle, LocalAddress, Parameters) (OsStatus_t)syscall3(76, SCPARAM(Handle), SCPARAM(LocalAddress), SCPARAM(Parameters))
+
 #endif //!__INTERNAL_CRT_SYSCALLS__
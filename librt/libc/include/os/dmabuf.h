@@ -153,6 +153,17 @@ CRTDECL(OsStatus_t, dma_detach(struct dma_attachment* attachment));
  */
 CRTDECL(OsStatus_t, dma_get_sg_table(struct dma_attachment* attachment, struct dma_sg_table* sg_table, int max_count));
 
+/**
+ * Retrieves the scatter-gather entries that cover a range of the dma buffer. The first
+ * entry starts at the offset, and the last entry ends with the range.
+ * @param attachment [In]  Attachment to the dma buffer to query the dma entries of.
+ * @param offset     [In]  The offset into the buffer where the range starts.
+ * @param length     [In]  The length of the range.
+ * @param sg_table   [Out] Pointer to storage for the sg_table. This must be manually freed.
+ * @return Status of the operation.
+ */
+CRTDECL(OsStatus_t, dma_get_sg_range(struct dma_attachment* attachment, size_t offset, size_t length, struct dma_sg_table* sg_table));
+
 /**
  * Converts a virtual buffer offset into a dma_sg index + offset
  * @param sg_table  [In]  Scatter-gather table to perform the lookup in.
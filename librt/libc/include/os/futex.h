@@ -32,6 +32,7 @@
 #define FUTEX_WAIT_OP           0x2U
 #define FUTEX_WAKE_PRIVATE      0x4U
 #define FUTEX_WAKE_OP           0x8U
+#define FUTEX_WAKE_REQUEUE      0x10U // Wake _val0 on _futex0, move _val1 to _futex1 if *_futex0 == _val2
 
 //int futex(int *uaddr, int op, int val, const struct timespec *timeout,
 //          int *uaddr2, int val3);
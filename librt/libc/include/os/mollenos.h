@@ -33,12 +33,20 @@
 #include <os/types/memory.h>
 #include <time.h>
 
+// Per-core statistics are reported for the first SYSTEM_DESCRIPTOR_MAX_CORES cores
+#define SYSTEM_DESCRIPTOR_MAX_CORES 32
+
+// Free physical memory is reported in blocks of 2^order pages, for order 0 => SYSTEM_DESCRIPTOR_MAX_ORDERS - 1
+#define SYSTEM_DESCRIPTOR_MAX_ORDERS 11
+
 PACKED_TYPESTRUCT(SystemDescriptor, {
     size_t NumberOfProcessors;
     size_t NumberOfActiveCores;
+    size_t ThreadMigrations[SYSTEM_DESCRIPTOR_MAX_CORES];
 
     size_t PagesTotal;
     size_t PagesUsed;
+    size_t FreeBlocks[SYSTEM_DESCRIPTOR_MAX_ORDERS];
     size_t PageSizeBytes;
     size_t AllocationGranularityBytes;
 });
@@ -114,6 +122,7 @@ CRTDECL(OsStatus_t, GetFileSystemInformationFromPath(const char *Path, OsFileSys
 CRTDECL(OsStatus_t, GetFileSystemInformationFromFd(int FileDescriptor, OsFileSystemDescriptor_t *Information));
 CRTDECL(OsStatus_t, GetFileInformationFromPath(const char *Path, OsFileDescriptor_t *Information));
 CRTDECL(OsStatus_t, GetFileInformationFromFd(int FileDescriptor, OsFileDescriptor_t *Information));
+CRTDECL(OsStatus_t, GetFileCacheStatistics(OsFileCacheStatistics_t *Statistics));
 CRTDECL(OsStatus_t, CreateFileMapping(int FileDescriptor, int Flags, uint64_t Offset, size_t Length, void **MemoryPointer));
 CRTDECL(OsStatus_t, FlushFileMapping(void* MemoryPointer, size_t Length));
 CRTDECL(OsStatus_t, DestroyFileMapping(void* MemoryPointer));
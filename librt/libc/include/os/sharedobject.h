@@ -26,6 +26,21 @@
 
 #include <os/osdefs.h>
 
+typedef struct OsImageCacheStatistics {
+    uint64_t Hits;        // Images that were mapped from the cache
+    uint64_t Misses;      // Images that were read from file
+    size_t   Images;      // Images in the cache
+    size_t   Mappings;    // Loaded images that are mapped from the cache
+    size_t   SharedBytes; // Bytes of the cached images that are shared
+    size_t   SavedBytes;  // Bytes that would have been copied without sharing
+
+    uint64_t PathHits;          // Paths that were resolved from the cache
+    uint64_t PathNegativeHits;  // Paths that were known not to resolve
+    uint64_t PathMisses;        // Paths that were resolved by the filemanager
+    uint64_t PathInvalidations; // Resolutions dropped because a path changed
+    size_t   PathEntries;       // Resolutions in the cache
+} OsImageCacheStatistics_t;
+
 _CODE_BEGIN
 /* SharedObjectLoad
  * Load a shared object given a path which must exists otherwise NULL is returned */
@@ -48,6 +63,14 @@ SharedObjectGetFunction(
 CRTDECL(OsStatus_t,
 SharedObjectUnload(
 	_In_ Handle_t Handle));
+
+/* SharedObjectGetCacheStatistics
+ * Retrieves the statistics of the image cache of the process manager, which
+ * shares the read-only sections of images between processes, and of the cache
+ * of the paths the images were resolved from. */
+CRTDECL(OsStatus_t,
+SharedObjectGetCacheStatistics(
+	_In_ OsImageCacheStatistics_t* Statistics));
 _CODE_END
 
 #endif //!__SHAREDOBJECT_H__
@@ -60,6 +60,24 @@ typedef struct {
     struct timespec AccessedAt;
 } OsFileDescriptor_t;
 
+typedef struct {
+    uint64_t Hits;
+    uint64_t Misses;
+    uint64_t ReadAheadPages;
+    uint64_t WriteBackPages;
+    uint64_t Evictions;
+    size_t   PagesUsed;
+    size_t   PageBudget;
+    size_t   PageSize;
+    uint64_t DentryHits;
+    uint64_t DentryNegativeHits;
+    uint64_t DentryMisses;
+    uint64_t DentryFlushes;
+    size_t   DentryCount;
+    uint64_t BufferHits;
+    uint64_t BufferMisses;
+} OsFileCacheStatistics_t;
+
 // OsFileDescriptor_t::Flags
 #define FILE_FLAG_FILE          0x00000000
 #define FILE_FLAG_DIRECTORY     0x00000001
@@ -44,6 +44,7 @@ typedef UUId_t       thrd_t;
 // Condition Synchronization Object
 typedef struct cnd {
     _Atomic(int) syncobject;
+    struct mtx*  mutex; // The mutex used by the waiters, broadcasts requeue onto it
 } cnd_t;
 
 // Mutex Synchronization Object
@@ -153,6 +153,37 @@ dma_get_sg_table(
     return Syscall_DmaGetMetrics(attachment->handle, &sg_table->count, sg_table->entries);
 }
 
+OsStatus_t
+dma_get_sg_range(
+    _In_ struct dma_attachment* attachment,
+    _In_ size_t                 offset,
+    _In_ size_t                 length,
+    _In_ struct dma_sg_table*   sg_table)
+{
+    OsStatus_t status;
+
+    if (!attachment || !sg_table) {
+        return OsInvalidParameters;
+    }
+
+    status = Syscall_DmaGetSgRange(attachment->handle, offset, length, &sg_table->count, NULL);
+    if (status != OsSuccess) {
+        return status;
+    }
+
+    sg_table->entries = malloc(sizeof(struct dma_sg) * sg_table->count);
+    if (!sg_table->entries) {
+        return OsOutOfMemory;
+    }
+
+    status = Syscall_DmaGetSgRange(attachment->handle, offset, length, &sg_table->count, sg_table->entries);
+    if (status != OsSuccess) {
+        free(sg_table->entries);
+        sg_table->entries = NULL;
+    }
+    return status;
+}
+
 
 OsStatus_t
 dma_sg_table_offset(
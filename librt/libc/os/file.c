@@ -158,6 +158,43 @@ GetFileSystemInformationFromFd(
     return status;
 }
 
+OsStatus_t
+GetFileCacheStatistics(
+    _In_ OsFileCacheStatistics_t* Statistics)
+{
+    struct vali_link_message    msg = VALI_MSG_INIT_HANDLE(GetFileService());
+    OsStatus_t                  status;
+    struct sys_file_cache_stats gstats;
+
+    if (Statistics == NULL) {
+        return OsInvalidParameters;
+    }
+
+    sys_file_get_cache_stats(GetGrachtClient(), &msg.base);
+    gracht_client_wait_message(GetGrachtClient(), &msg.base, GRACHT_MESSAGE_BLOCK);
+    sys_file_get_cache_stats_result(GetGrachtClient(), &msg.base, &status, &gstats);
+
+    if (status == OsSuccess) {
+        Statistics->Hits           = gstats.hits;
+        Statistics->Misses         = gstats.misses;
+        Statistics->ReadAheadPages = gstats.readahead_pages;
+        Statistics->WriteBackPages = gstats.writeback_pages;
+        Statistics->Evictions      = gstats.evictions;
+        Statistics->PagesUsed      = (size_t)gstats.pages_used;
+        Statistics->PageBudget     = (size_t)gstats.page_budget;
+        Statistics->PageSize       = gstats.page_size;
+
+        Statistics->DentryHits         = gstats.dentry_hits;
+        Statistics->DentryNegativeHits = gstats.dentry_negative_hits;
+        Statistics->DentryMisses       = gstats.dentry_misses;
+        Statistics->DentryFlushes      = gstats.dentry_flushes;
+        Statistics->DentryCount        = (size_t)gstats.dentry_count;
+        Statistics->BufferHits         = gstats.buffer_hits;
+        Statistics->BufferMisses       = gstats.buffer_misses;
+    }
+    return status;
+}
+
 OsStatus_t
 GetFileInformationFromPath(
     _In_ const char*            Path,
@@ -213,6 +213,39 @@ SharedObjectUnload(
     return status;
 }
 
+OsStatus_t
+SharedObjectGetCacheStatistics(
+    _In_ OsImageCacheStatistics_t* Statistics)
+{
+    struct vali_link_message     msg = VALI_MSG_INIT_HANDLE(GetProcessService());
+    OsStatus_t                   status;
+    struct sys_image_cache_stats gstats;
+
+    if (Statistics == NULL) {
+        return OsInvalidParameters;
+    }
+
+    sys_library_get_cache_stats(GetGrachtClient(), &msg.base);
+    gracht_client_wait_message(GetGrachtClient(), &msg.base, GRACHT_MESSAGE_BLOCK);
+    sys_library_get_cache_stats_result(GetGrachtClient(), &msg.base, &status, &gstats);
+
+    if (status == OsSuccess) {
+        Statistics->Hits        = gstats.hits;
+        Statistics->Misses      = gstats.misses;
+        Statistics->Images      = (size_t)gstats.images;
+        Statistics->Mappings    = (size_t)gstats.mappings;
+        Statistics->SharedBytes = (size_t)gstats.shared_bytes;
+        Statistics->SavedBytes  = (size_t)gstats.saved_bytes;
+
+        Statistics->PathHits          = gstats.path_hits;
+        Statistics->PathNegativeHits  = gstats.path_negative_hits;
+        Statistics->PathMisses        = gstats.path_misses;
+        Statistics->PathInvalidations = gstats.path_invalidations;
+        Statistics->PathEntries       = (size_t)gstats.path_entries;
+    }
+    return status;
+}
+
 static void so_enumerate(int index, const void* element, void* userContext)
 {
     const struct library_element* library     = element;
@@ -69,8 +69,8 @@ int pipe(long size, int flags)
 
     // create the dma attachment
     bufferInfo.name     = "libc_pipe";
-    bufferInfo.length   = size;
-    bufferInfo.capacity = size;
+    bufferInfo.length   = size + sizeof(struct streambuffer);
+    bufferInfo.capacity = size + sizeof(struct streambuffer);
     bufferInfo.flags    = 0;
 
     osStatus = dma_create(&bufferInfo, &attachment);
@@ -80,7 +80,7 @@ int pipe(long size, int flags)
 
     streambuffer_construct(
         attachment.buffer,
-        size - sizeof(struct streambuffer),
+        size,
         STREAMBUFFER_MULTIPLE_WRITERS | STREAMBUFFER_GLOBAL);
 
     status = stdio_handle_create(-1, WX_OPEN | wxflags, &ioObject);
@@ -25,10 +25,13 @@
 #include <errno.h>
 #include <internal/_syscalls.h>
 #include <internal/_utils.h>
+#include <limits.h>
 #include <os/futex.h>
 #include <threads.h>
 #include <time.h>
 
+extern int __mtx_lock_contended(mtx_t* mutex);
+
 int
 cnd_init(
     _In_ cnd_t* cond)
@@ -37,6 +40,7 @@ cnd_init(
         return thrd_error;
     }
     atomic_store(&cond->syncobject, 0);
+    cond->mutex = NULL;
     return thrd_success;
 }
 
@@ -61,6 +65,8 @@ cnd_signal(
 		return thrd_error;
 	}
 	
+    // Waiters that have yet to go to sleep will see the sequence change
+    atomic_fetch_add(&cond->syncobject, 1);
     parameters._futex0  = &cond->syncobject;
     parameters._val0    = 1;
     parameters._flags   = FUTEX_WAKE_PRIVATE;
@@ -76,43 +82,85 @@ cnd_broadcast(
     _In_ cnd_t *cond)
 {
     FutexParameters_t parameters;
+    mtx_t*            mutex;
+    int               sequence;
     
 	if (cond == NULL) {
 		return thrd_error;
 	}
 	
-    parameters._futex0  = &cond->syncobject;
-    parameters._val0    = atomic_load(&cond->syncobject);
-    parameters._flags   = FUTEX_WAKE_PRIVATE;
+    sequence = atomic_fetch_add(&cond->syncobject, 1) + 1;
+    mutex    = cond->mutex;
+    
+    // Wake one waiter and move the rest onto the mutex, they can only proceed one at
+    // the time anyway. If the sequence changed in the meantime, just wake everyone.
+    parameters._futex0 = &cond->syncobject;
+    parameters._val0   = 1;
+    if (mutex != NULL) {
+        parameters._futex1 = &mutex->value;
+        parameters._val1   = INT_MAX;
+        parameters._val2   = sequence;
+        parameters._flags  = FUTEX_WAKE_PRIVATE | FUTEX_WAKE_REQUEUE;
+        if (Syscall_FutexWake(&parameters) != OsInterrupted) {
+            return thrd_success;
+        }
+    }
+    
+    parameters._val0  = INT_MAX;
+    parameters._flags = FUTEX_WAKE_PRIVATE;
 	(void)Syscall_FutexWake(&parameters);
     return thrd_success;
 }
 
-int
-cnd_wait(
+static int
+__cnd_wait(
     _In_ cnd_t* cond,
-    _In_ mtx_t* mutex)
+    _In_ mtx_t* mutex,
+    _In_ size_t timeout)
 {
     FutexParameters_t parameters;
     OsStatus_t        status;
-	if (cond == NULL || mutex == NULL) {
-		return thrd_error;
-	}
-
+    
+    cond->mutex = mutex;
+    
+    // The mutex is released by the kernel once we are queued, unless the sequence
+    // changed before that (OsExists), in which case we still hold it. Every other
+    // outcome, including an interrupted wait, leaves the mutex released.
     parameters._futex0  = &cond->syncobject;
     parameters._futex1  = &mutex->value;
     parameters._val0    = atomic_load(&cond->syncobject);
     parameters._val1    = 1; // Wakeup one on the mutex
-    parameters._val2    = FUTEX_OP(FUTEX_OP_SET, 0, 0, 0);
+    parameters._val2    = FUTEX_OP(FUTEX_OP_SET, 0, 0, 0); // Reset mutex to 0
     parameters._flags   = FUTEX_WAIT_PRIVATE | FUTEX_WAIT_OP;
-    parameters._timeout = 0;
+    parameters._timeout = timeout;
     
     status = Syscall_FutexWait(&parameters);
-    mtx_lock(mutex);
-    if (status != OsSuccess) {
+    if (status == OsExists) {
+        return thrd_success;
+    }
+    
+    if (__mtx_lock_contended(mutex) != thrd_success) {
         return thrd_error;
     }
-    return thrd_success;
+    
+	if (status == OsTimeout) {
+		return thrd_timedout;
+	}
+	else if (status != OsSuccess) {
+	    return thrd_error;
+	}
+	return thrd_success;
+}
+
+int
+cnd_wait(
+    _In_ cnd_t* cond,
+    _In_ mtx_t* mutex)
+{
+	if (cond == NULL || mutex == NULL) {
+		return thrd_error;
+	}
+    return __cnd_wait(cond, mutex, 0);
 }
 
 int
@@ -121,8 +169,6 @@ cnd_timedwait(
     _In_ mtx_t* restrict                 mutex,
     _In_ const struct timespec* restrict time_point)
 {
-    FutexParameters_t parameters;
-	OsStatus_t        status;
     time_t            msec;
 	struct timespec   now, result;
 
@@ -141,22 +187,5 @@ cnd_timedwait(
     if (result.tv_nsec != 0) {
         msec += ((result.tv_nsec - 1) / NSEC_PER_MSEC) + 1;
     }
-
-    parameters._futex0  = &cond->syncobject;
-    parameters._futex1  = &mutex->value;
-    parameters._val0    = atomic_load(&cond->syncobject);
-    parameters._val1    = 1; // Wakeup one on the mutex
-    parameters._val2    = FUTEX_OP(FUTEX_OP_SET, 0, 0, 0); // Reset mutex to 0
-    parameters._flags   = FUTEX_WAIT_PRIVATE | FUTEX_WAIT_OP;
-    parameters._timeout = msec;
-    
-    status = Syscall_FutexWait(&parameters);
-    mtx_lock(mutex);
-	if (status  == OsTimeout) {
-		return thrd_timedout;
-	}
-	else if (status != OsSuccess) {
-	    return thrd_error;
-	}
-	return thrd_success;
+    return __cnd_wait(cond, mutex, msec);
 }
@@ -193,6 +193,31 @@ mtx_lock(
     return __perform_lock(mutex, 0);
 }
 
+// Used by the condition variables, a waiter might have been requeued onto the mutex
+// so it must always be locked as contended to make sure unlock wakes the next waiter.
+int
+__mtx_lock_contended(
+    _In_ mtx_t* mutex)
+{
+    FutexParameters_t parameters;
+    
+    parameters._futex0  = &mutex->value;
+    parameters._val0    = 2;
+    parameters._timeout = 0;
+    parameters._flags   = FUTEX_WAIT_PRIVATE;
+    
+    while (atomic_exchange(&mutex->value, 2) != 0) {
+        Syscall_FutexWait(&parameters);
+        if (mutex->flags & MUTEX_DESTROYED) {
+            return thrd_error;
+        }
+    }
+    
+    mutex->owner = thrd_current();
+    atomic_store(&mutex->references, 1);
+    return thrd_success;
+}
+
 int
 mtx_timedlock(
     _In_ mtx_t* restrict                 mutex,
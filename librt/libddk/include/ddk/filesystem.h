@@ -46,12 +46,21 @@ typedef struct MString MString_t;
  * Used the describe the various possible flags for the given filesystem */
 #define __FILESYSTEM_BOOT           0x00000001
 
+struct StorageQueue;
+
 typedef struct FileSystemDisk {
     element_t           header;
     UUId_t              driver_id;
     UUId_t              device_id;
     unsigned int        flags;
     StorageDescriptor_t descriptor;
+
+    // Set by the filemanager, transfers should be passed to the request queue of the
+    // disk instead of going to the storage driver directly
+    struct StorageQueue* queue;
+    OsStatus_t         (*transfer)(struct StorageQueue* queue, int direction, uint64_t sector,
+                                   UUId_t bufferHandle, size_t bufferOffset, size_t sectorCount,
+                                   size_t* sectorsTransferred);
 } FileSystemDisk_t;
 
 PACKED_TYPESTRUCT(FileSystemDescriptor, {
@@ -61,4 +61,16 @@ CreateMemoryMapping(
     _In_  struct MemoryMappingParameters* Parameters,
     _Out_ void**                          AddressOut));
 
+/**
+ * ShareMemoryMapping
+ * Maps the pages backing a page-aligned range of the callers memory into the memory space at
+ * the fixed address given by the parameters. The pages are shared, not copied, and remain owned
+ * by the caller, which must keep them alive for as long as the memory space uses them.
+ */
+DDKDECL(OsStatus_t,
+ShareMemoryMapping(
+    _In_ UUId_t                          Handle,
+    _In_ void*                           LocalAddress,
+    _In_ struct MemoryMappingParameters* Parameters));
+
 #endif //!__MEMORY_INTERFACE__
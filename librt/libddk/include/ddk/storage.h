@@ -30,6 +30,19 @@
 #define __STORAGE_OPERATION_READ            0x00000001
 #define __STORAGE_OPERATION_WRITE           0x00000002
 
+// Flags for vectored submissions
+#define __STORAGE_SUBMIT_NOTIFY             0x00000001 // Send transfer_complete instead of waiting for poll
+
+#define __STORAGE_MAX_SEGMENTS              64
+#define __STORAGE_MAX_FINISHED              256 // Unpolled results kept per client, the oldest are dropped
+
+typedef struct StorageTransferSegment {
+    uint64_t Sector;
+    UUId_t   BufferHandle;
+    size_t   BufferOffset;
+    size_t   SectorCount;
+} StorageTransferSegment_t;
+
 typedef struct StorageDescriptor {
     UUId_t   Device;
     UUId_t   Driver;
@@ -57,3 +57,15 @@ CreateMemoryMapping(
     }
     return Syscall_CreateMemorySpaceMapping(Handle, Parameters, AddressOut);
 }
+
+OsStatus_t
+ShareMemoryMapping(
+    _In_ UUId_t                          Handle,
+    _In_ void*                           LocalAddress,
+    _In_ struct MemoryMappingParameters* Parameters)
+{
+    if (LocalAddress == NULL || Parameters == NULL) {
+        return OsError;
+    }
+    return Syscall_ShareMemorySpaceMapping(Handle, LocalAddress, Parameters);
+}
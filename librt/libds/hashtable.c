@@ -298,6 +298,8 @@ static void hashtable_remove_and_bump(
         index    = (index + 1) & (hashtable->capacity - 1);
     }
 
+    // the last element moved up leaves its old slot free
+    previous->probeCount = 0;
     hashtable->element_count--;
 }
 
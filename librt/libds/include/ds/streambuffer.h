@@ -54,6 +54,8 @@ typedef struct streambuffer {
     uint8_t buffer[];
 } streambuffer_t;
 
+// The capacity of a streambuffer is always a power of two. streambuffer_construct rounds the
+// capacity down as the storage is provided by the caller, streambuffer_create rounds it up.
 DSDECL(void,
 streambuffer_construct(
     _In_ streambuffer_t* stream,
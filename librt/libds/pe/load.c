@@ -114,34 +114,58 @@ GetExportedFunctionByOrdinal(
     return NULL;
 }
 
+struct ExportIndexEntry {
+    const char* Name;
+    int         Index;
+};
+
+static uint64_t export_hash(const void*);
+static int      export_cmp(const void*, const void*);
+
+static PeExportedFunction_t*
+GetExportedFunctionByName(
+    _In_ PeExecutable_t* Library,
+    _In_ const char*     Name)
+{
+    struct ExportIndexEntry* Entry;
+
+    if (Library->ExportedFunctionsIndex.elements == NULL) {
+        return NULL;
+    }
+
+    Entry = hashtable_get(&Library->ExportedFunctionsIndex, &(struct ExportIndexEntry) { .Name = Name });
+    return Entry != NULL ? &Library->ExportedFunctions[Entry->Index] : NULL;
+}
+
 static PeExportedFunction_t*
 GetExportedFunctionByNameDescriptor(
-    _In_ PeExportedFunction_t*     Exports,
-    _In_ int                       NumberOfExports,
+    _In_ PeExecutable_t*           Library,
     _In_ PeImportNameDescriptor_t* Descriptor)
 {
-    int i;
-
-    // Use the hint if provided
-    if (Descriptor->OrdinalHint != 0) {
-        for (i = 0; i < NumberOfExports; i++) {
-            if (Exports[i].Ordinal == Descriptor->OrdinalHint) {
-                if (!strcmp(Exports[i].Name, (const char*)&Descriptor->Name[0])) {
-                    return &Exports[i];
-                }
-            }
-        }
+    const char* Name = (const char*)&Descriptor->Name[0];
+    int         Hint = (int)Descriptor->OrdinalHint;
+
+    // The hint is the index into the export name table the linker saw, which is
+    // the order the exports are stored in. It only saves the lookup if it matches.
+    if (Hint < Library->NumberOfExportedFunctions && Library->ExportedFunctions[Hint].Name != NULL &&
+        !strcmp(Library->ExportedFunctions[Hint].Name, Name)) {
+        return &Library->ExportedFunctions[Hint];
     }
+    return GetExportedFunctionByName(Library, Name);
+}
 
-    // Hint was invalid or not present
-    for (i = 0; i < NumberOfExports; i++) {
-        if (Exports[i].Name != NULL) {
-            if (!strcmp(Exports[i].Name, (const char*)&Descriptor->Name[0])) {
-                return &Exports[i];
-            }
-        }
+static unsigned int
+GetSectionPageFlags(
+    _In_ PeSectionHeader_t* Section)
+{
+    unsigned int PageFlags = MEMORY_READ;
+    if (Section->Flags & PE_SECTION_EXECUTE) {
+        PageFlags |= MEMORY_EXECUTABLE;
     }
-    return NULL;
+    if (Section->Flags & PE_SECTION_WRITE) {
+        PageFlags |= MEMORY_WRITE;
+    }
+    return PageFlags;
 }
 
 static OsStatus_t
@@ -166,7 +190,7 @@ PeHandleSections(
         // in memory we want to copy data to
         uintptr_t    VirtualDestination = Image->VirtualAddress + Section->VirtualAddress;
         uint8_t*     FileBuffer         = (uint8_t*)(Data + Section->RawAddress);
-        unsigned int PageFlags          = MEMORY_READ;
+        unsigned int PageFlags          = GetSectionPageFlags(Section);
         size_t       SectionSize        = MAX(Section->RawSize, Section->VirtualSize);
         uint8_t*     Destination;
 
@@ -175,12 +199,32 @@ PeHandleSections(
         memcpy(&SectionName[0], &Section->Name[0], 8);
         SectionName[8] = 0;
 
-        // Handle page flags for this section
-        if (Section->Flags & PE_SECTION_EXECUTE) {
-            PageFlags |= MEMORY_EXECUTABLE;
+        // Store first code segment we encounter
+        if (Section->Flags & PE_SECTION_CODE) {
+            if (Image->CodeBase == 0) {
+                Image->CodeBase = (uintptr_t)Image->VirtualAddress + Section->VirtualAddress;
+                Image->CodeSize = Section->VirtualSize;
+            }
         }
-        if (Section->Flags & PE_SECTION_WRITE) {
-            PageFlags |= MEMORY_WRITE;
+        CurrentAddress = (Image->VirtualAddress + Section->VirtualAddress + SectionSize);
+
+        // Sections that are never written are mapped straight from the cache, the
+        // pages are the same in every memory space that has the image at this address
+        if (Image->Cache != NULL && Image->Cache->Sections[i].Shared) {
+            Status = ShareImageMapping(Image->MemorySpace, Image->Cache->Snapshot + Section->VirtualAddress,
+                VirtualDestination, SectionSize, PageFlags);
+            if (Status != OsSuccess) {
+                dserror("%s: Failed to share section %s at 0x%" PRIxIN ": %u",
+                    MStringRaw(Image->Name), &SectionName[0], VirtualDestination, Status);
+                return Status;
+            }
+
+            SectionHandles[i].Handle      = NULL;
+            SectionHandles[i].BasePointer = Image->Cache->Snapshot + Section->VirtualAddress;
+            SectionHandles[i].RVA         = Section->VirtualAddress;
+            SectionHandles[i].Size        = SectionSize;
+            Section++;
+            continue;
         }
 
         // Iterate pages and map them in our memory space
@@ -197,19 +241,15 @@ PeHandleSections(
         SectionHandles[i].RVA         = Section->VirtualAddress;
         SectionHandles[i].Size        = SectionSize;
 
-        // Store first code segment we encounter
-        if (Section->Flags & PE_SECTION_CODE) {
-            if (Image->CodeBase == 0) {
-                Image->CodeBase = (uintptr_t)Image->VirtualAddress + Section->VirtualAddress;
-                Image->CodeSize = Section->VirtualSize;
-            }
-        }
-
         // Handle sections specifics, we want to:
+        // Cached: Copy the relocated memory
         // BSS: Zero out the memory 
         // Code: Copy memory 
         // Data: Copy memory
-        if (Section->RawSize == 0 || (Section->Flags & PE_SECTION_BSS)) {
+        if (Image->Cache != NULL) {
+            memcpy(Destination, Image->Cache->Snapshot + Section->VirtualAddress, SectionSize);
+        }
+        else if (Section->RawSize == 0 || (Section->Flags & PE_SECTION_BSS)) {
             dstrace("section(%i): clearing %u bytes => 0x%x (0x%x, 0x%x)", i, Section->VirtualSize, Destination,
                 Image->VirtualAddress + Section->VirtualAddress, PageFlags);
             memset(Destination, 0, Section->VirtualSize);
@@ -229,7 +269,6 @@ PeHandleSections(
                 memset(Destination, 0, (Section->VirtualSize - Section->RawSize));
             }
         }
-        CurrentAddress = (Image->VirtualAddress + Section->VirtualAddress + SectionSize);
         Section++;
     }
 
@@ -290,7 +329,7 @@ PeResolveImportDescriptor(
             }
             else {
                 NameDescriptor = (PeImportNameDescriptor_t*)OFFSET_IN_SECTION(Section, Value & PE_IMPORT_NAMEMASK);
-                Function       = GetExportedFunctionByNameDescriptor(Exports, NumberOfExports, NameDescriptor);
+                Function       = GetExportedFunctionByNameDescriptor(ResolvedLibrary, NameDescriptor);
                 if (!Function) {
                     dserror("Failed to locate function (%s)", &NameDescriptor->Name[0]);
                     return OsError;
@@ -317,7 +356,7 @@ PeResolveImportDescriptor(
             }
             else {
                 NameDescriptor = (PeImportNameDescriptor_t*)OFFSET_IN_SECTION(Section, Value & PE_IMPORT_NAMEMASK);
-                Function       = GetExportedFunctionByNameDescriptor(Exports, NumberOfExports, NameDescriptor);
+                Function       = GetExportedFunctionByNameDescriptor(ResolvedLibrary, NameDescriptor);
                 if (!Function) {
                     dserror("Failed to locate function (%s)", &NameDescriptor->Name[0]);
                     return OsError;
@@ -541,6 +580,21 @@ PeHandleExports(
         ExFunc->Name         = NameBuffer;
         FunctionNameLengths += FunctionLength;
     }
+
+    // Index the names so imports can be resolved without scanning the table. The
+    // capacity is chosen so the index never has to grow while it is filled, and it
+    // is filled backwards so the first of any duplicate names is the one kept.
+    if (hashtable_construct(&Image->ExportedFunctionsIndex,
+            ((size_t)Image->NumberOfExportedFunctions * 100) / HASHTABLE_LOADFACTOR_GROW + 1,
+            sizeof(struct ExportIndexEntry), export_hash, export_cmp)) {
+        dserror("%s: failed to allocate export index", MStringRaw(Image->Name));
+        return OsOutOfMemory;
+    }
+
+    for (i = Image->NumberOfExportedFunctions - 1; i >= 0; i--) {
+        hashtable_set(&Image->ExportedFunctionsIndex, &(struct ExportIndexEntry) {
+            .Name = Image->ExportedFunctions[i].Name, .Index = i });
+    }
     return OsSuccess;
 }
 
@@ -569,6 +623,71 @@ PeHandleImports(
     return OsSuccess;
 }
 
+// Takes a snapshot of the image once it is relocated and its exports are parsed, which is
+// the state every further load at the same address would reach before binding imports.
+static void
+PeCacheImage(
+    _In_ PeExecutable_t*    Image,
+    _In_ uint8_t*           ImageBuffer,
+    _In_ size_t             SizeOfMetaData,
+    _In_ uintptr_t          SectionBase,
+    _In_ SectionMapping_t*  SectionMappings,
+    _In_ int                SectionCount,
+    _In_ uint8_t*           ImportDirectory)
+{
+    PeSectionHeader_t* Section  = (PeSectionHeader_t*)SectionBase;
+    uintptr_t          PageSize = GetPageSize();
+    PeImageCache_t*    Cache;
+    size_t             Length = SizeOfMetaData;
+    int                i, j;
+
+    for (i = 0; i < SectionCount; i++) {
+        Length = MAX(Length, SectionMappings[i].RVA + SectionMappings[i].Size);
+    }
+    Length = DIVUP(Length, PageSize) * PageSize;
+
+    // The host may not cache images at all, the image just isn't shared then
+    if (CreateImageCache(Image->FullPath, Image->VirtualAddress, Length, SectionCount, &Cache) != OsSuccess) {
+        return;
+    }
+
+    memcpy(Cache->Snapshot, ImageBuffer, SizeOfMetaData);
+    for (i = 0; i < SectionCount; i++) {
+        uintptr_t RVA     = SectionMappings[i].RVA;
+        uintptr_t PageEnd = DIVUP((RVA + SectionMappings[i].Size), PageSize) * PageSize;
+
+        memcpy(Cache->Snapshot + RVA, SectionMappings[i].BasePointer, SectionMappings[i].Size);
+        Cache->Sections[i].RVA    = RVA;
+        Cache->Sections[i].Size   = SectionMappings[i].Size;
+        Cache->Sections[i].Flags  = GetSectionPageFlags(&Section[i]);
+        Cache->Sections[i].Shared = !(Cache->Sections[i].Flags & MEMORY_WRITE) && (RVA % PageSize) == 0;
+
+        // Pages can only be shared when no other section lives in them
+        for (j = 0; j < SectionCount && Cache->Sections[i].Shared; j++) {
+            if (j != i && SectionMappings[j].RVA < PageEnd &&
+                SectionMappings[j].RVA + SectionMappings[j].Size > RVA) {
+                Cache->Sections[i].Shared = 0;
+            }
+        }
+    }
+
+    // The import address tables are written for each process
+    if (ImportDirectory != NULL) {
+        PeImportDescriptor_t* ImportDescriptor = (PeImportDescriptor_t*)ImportDirectory;
+        while (ImportDescriptor->ImportAddressTable != 0) {
+            SectionMapping_t* IatSection = GetSectionFromRVA(SectionMappings, SectionCount,
+                ImportDescriptor->ImportAddressTable);
+            Cache->Sections[IatSection - SectionMappings].Shared = 0;
+            ImportDescriptor++;
+        }
+    }
+
+    // This image was loaded from file and keeps its own copy, it was only needed
+    // for the snapshot, so the reference we got from the host is dropped again
+    PublishImageCache(Cache);
+    ReleaseImageCache(Cache);
+}
+
 static OsStatus_t
 PeParseAndMapImage(
     _In_ PeExecutable_t*    Parent,
@@ -640,6 +759,16 @@ PeParseAndMapImage(
             break; // End of list of handlers
         }
 
+        // A cached image was relocated before the snapshot was taken, and a new image
+        // is cached before the imports are bound, as those are private to the process
+        if (DataDirectoryIndex == PE_SECTION_BASE_RELOCATION && Image->Cache != NULL) {
+            continue;
+        }
+        if (DataDirectoryIndex == PE_SECTION_IMPORT && Image->Cache == NULL && Status == OsSuccess) {
+            PeCacheImage(Image, ImageBuffer, SizeOfMetaData, SectionBase, SectionMappings,
+                SectionCount, DirectoryContents[PE_SECTION_IMPORT]);
+        }
+
         // Is there any directory available for the handler?
         if (DirectoryContents[DataDirectoryIndex] != NULL) {
             dstrace("parsing data-directory[%i]", DataDirectoryIndex);
@@ -667,8 +796,10 @@ static OsStatus_t
 ResolvePeImagePath(
     _In_  UUId_t           Owner,
     _In_  MString_t*       Path,
+    _In_  uintptr_t        LoadAddress,
     _Out_ uint8_t**        BufferOut,
-    _Out_ MString_t**      FullPathOut)
+    _Out_ MString_t**      FullPathOut,
+    _Out_ PeImageCache_t** CacheOut)
 {
     MString_t* FullPath;
     uint8_t*   Buffer;
@@ -681,6 +812,15 @@ ResolvePeImagePath(
         dserror("Failed to resolve path for executable: %s (%u)", MStringRaw(Path), Status);
         return Status;
     }
+
+    // An image that is already loaded at this address is mapped from the
+    // cache, which saves reading, validating and relocating the file
+    *CacheOut = AcquireImageCache(FullPath, LoadAddress);
+    if (*CacheOut != NULL) {
+        *BufferOut   = (*CacheOut)->Snapshot;
+        *FullPathOut = FullPath;
+        return OsSuccess;
+    }
     
     // Load the file
     Status = LoadFile(FullPath, (void**)&Buffer, &Length);
@@ -692,7 +832,23 @@ ResolvePeImagePath(
 
     *BufferOut   = Buffer;
     *FullPathOut = FullPath;
-    return PeValidateImageBuffer(Buffer, Length);
+
+    // The checksum covers every byte of the file, and would read all of it in, so
+    // it is only verified the first time the host sees this version of the file
+    if (IsFileVerified(FullPath, Buffer)) {
+        Status = PeValidateImageBuffer(Buffer, Length, 0);
+    }
+    else {
+        Status = PeValidateImageBuffer(Buffer, Length, PE_VALIDATE_CHECKSUM);
+        if (Status == OsSuccess) {
+            MarkFileVerified(FullPath, Buffer);
+        }
+    }
+
+    if (Status != OsSuccess) {
+        UnloadFile(FullPath, Buffer);
+    }
+    return Status;
 }
 
 OsStatus_t
@@ -714,6 +870,8 @@ PeLoadImage(
     size_t             SizeOfMetaData;
     PeDataDirectory_t* DirectoryPtr;
     PeExecutable_t*    Image;
+    PeImageCache_t*    Cache = NULL;
+    uintptr_t          LoadAddress;
     OsStatus_t         Status;
     uint8_t*           Buffer;
     int                Index;
@@ -721,7 +879,8 @@ PeLoadImage(
     dstrace("PeLoadImage(Path %s, Parent %s)",
         MStringRaw(Path), (Parent == NULL) ? "None" : MStringRaw(Parent->Name));
     
-    Status = ResolvePeImagePath(Owner, Path, &Buffer, &FullPath);
+    LoadAddress = (Parent == NULL) ? GetBaseAddress() : Parent->NextLoadingAddress;
+    Status      = ResolvePeImagePath(Owner, Path, LoadAddress, &Buffer, &FullPath, &Cache);
     if (Status != OsSuccess) {
         if (FullPath != NULL) {
             MStringDestroy(FullPath);
@@ -775,6 +934,9 @@ PeLoadImage(
 
     Image = (PeExecutable_t*)dsalloc(sizeof(PeExecutable_t));
     if (!Image) {
+        if (Cache != NULL) {
+            ReleaseImageCache(Cache);
+        }
         return OsOutOfMemory;
     }
     
@@ -784,7 +946,8 @@ PeLoadImage(
     Image->Owner             = Owner;
     Image->FullPath          = FullPath;
     Image->Architecture      = OptHeader->Architecture;
-    Image->VirtualAddress    = (Parent == NULL) ? GetBaseAddress() : Parent->NextLoadingAddress;
+    Image->VirtualAddress    = LoadAddress;
+    Image->Cache             = Cache;
     Image->Libraries         = dsalloc(sizeof(list_t));
     Image->References        = 1;
     Image->OriginalImageBase = ImageBase;
@@ -800,6 +963,9 @@ PeLoadImage(
         Status = CreateImageSpace(&Image->MemorySpace);
         if (Status != OsSuccess) {
             dserror("Failed to create pe's memory space");
+            if (Cache != NULL) {
+                ReleaseImageCache(Cache);
+            }
             MStringDestroy(Image->Name);
             MStringDestroy(Image->FullPath);
             dsfree(Image->Libraries);
@@ -814,7 +980,9 @@ PeLoadImage(
     // Parse the headers, directories and handle them.
     Status = PeParseAndMapImage(Parent, Image, Buffer, SizeOfMetaData, SectionAddress, 
         (int)BaseHeader->NumSections, DirectoryPtr);
-    UnloadFile(FullPath, (void*)Buffer);
+    if (Cache == NULL) {
+        UnloadFile(FullPath, (void*)Buffer);
+    }
     if (Status != OsSuccess) {
         PeUnloadLibrary(Parent, Image);
         return OsError;
@@ -834,10 +1002,22 @@ PeUnloadImage(
         if (Image->ExportedFunctions != NULL) {
             dsfree(Image->ExportedFunctions);
         }
+        if (Image->ExportedFunctionNames != NULL) {
+            dsfree(Image->ExportedFunctionNames);
+        }
+        hashtable_destroy(&Image->ExportedFunctionsIndex);
+        if (Image->Cache != NULL) {
+            ReleaseImageCache(Image->Cache);
+        }
         if (Image->Libraries != NULL) {
-            _foreach(Element, Image->Libraries) {
+            // The elements are part of the libraries, so get the next before unloading
+            Element = Image->Libraries->head;
+            while (Element != NULL) {
+                element_t* Next = Element->next;
                 PeUnloadImage(Element->value);
+                Element = Next;
             }
+            dsfree(Image->Libraries);
         }
         dsfree(Image);
         return OsSuccess;
@@ -868,3 +1048,31 @@ PeUnloadLibrary(
     }
     return OsSuccess;
 }
+
+uintptr_t
+PeResolveFunction(
+    _In_ PeExecutable_t* Library,
+    _In_ const char*     Function)
+{
+    PeExportedFunction_t* Export = GetExportedFunctionByName(Library, Function);
+    return Export != NULL ? Export->Address : 0;
+}
+
+static uint64_t export_hash(const void* element)
+{
+    const struct ExportIndexEntry* entry = element;
+    const uint8_t*                 name  = (const uint8_t*)entry->Name;
+    uint64_t                       hash  = 0xCBF29CE484222325ULL;
+
+    while (*name) {
+        hash ^= *name++;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static int export_cmp(const void* element1, const void* element2)
+{
+    return strcmp(((const struct ExportIndexEntry*)element1)->Name,
+                  ((const struct ExportIndexEntry*)element2)->Name);
+}
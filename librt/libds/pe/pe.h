@@ -26,6 +26,7 @@
 
 #include <os/osdefs.h>
 #include <os/types/process.h>
+#include <ds/hashtable.h>
 #include <ds/list.h>
 #include <os/pe.h>
 #include <time.h>
@@ -51,6 +52,25 @@ typedef struct PeExportedFunction {
     uintptr_t   Address;
 } PeExportedFunction_t;
 
+// A section of a cached image, shared sections are mapped from the snapshot into
+// every memory space the image is loaded in, the others are copied from it.
+typedef struct PeImageSection {
+    uintptr_t    RVA;
+    size_t       Size;
+    unsigned int Flags;
+    int          Shared;
+} PeImageSection_t;
+
+// An image that has been loaded, relocated and had its exports parsed at a specific
+// address. The snapshot is laid out by RVA with the headers at offset 0, and is taken
+// before any imports are bound, as those differ between processes.
+typedef struct PeImageCache {
+    uint8_t*          Snapshot;
+    size_t            Length;
+    int               SectionCount;
+    PeImageSection_t* Sections;
+} PeImageCache_t;
+
 typedef struct PeExecutable {
     UUId_t                Owner;
     MString_t*            Name;
@@ -71,6 +91,8 @@ typedef struct PeExecutable {
     int                   NumberOfExportedFunctions;
     PeExportedFunction_t* ExportedFunctions;
     char*                 ExportedFunctionNames;
+    hashtable_t           ExportedFunctionsIndex; // Name => ExportedFunctions index
+    PeImageCache_t*       Cache;
     list_t*               Libraries;
 } PeExecutable_t;
 
@@ -83,9 +105,16 @@ __EXTERN clock_t    GetTimestamp(void);
 __EXTERN OsStatus_t ResolveFilePath(UUId_t, MString_t*, MString_t**);
 __EXTERN OsStatus_t LoadFile(MString_t*, void**, size_t*);
 __EXTERN void       UnloadFile(MString_t*, void*);
+__EXTERN int        IsFileVerified(MString_t*, void*);
+__EXTERN void       MarkFileVerified(MString_t*, void*);
 __EXTERN OsStatus_t CreateImageSpace(MemorySpaceHandle_t*);
 __EXTERN OsStatus_t AcquireImageMapping(MemorySpaceHandle_t, uintptr_t*, size_t, unsigned int, MemoryMapHandle_t*);
 __EXTERN void       ReleaseImageMapping(MemoryMapHandle_t);
+__EXTERN OsStatus_t ShareImageMapping(MemorySpaceHandle_t, void*, uintptr_t, size_t, unsigned int);
+__EXTERN PeImageCache_t* AcquireImageCache(MString_t*, uintptr_t);
+__EXTERN OsStatus_t CreateImageCache(MString_t*, uintptr_t, size_t, int, PeImageCache_t**);
+__EXTERN void       PublishImageCache(PeImageCache_t*);
+__EXTERN void       ReleaseImageCache(PeImageCache_t*);
 
 /*******************************************************************************
  * Public API 
@@ -93,11 +122,14 @@ __EXTERN void       ReleaseImageMapping(MemoryMapHandle_t);
 
 /* PeValidateImageBuffer
  * Validates a file-buffer of the given length, does initial header 
- * checks and performs a checksum validation. */
+ * checks and performs a checksum validation if PE_VALIDATE_CHECKSUM is given. */
+#define PE_VALIDATE_CHECKSUM 0x1
+
 __EXTERN OsStatus_t
 PeValidateImageBuffer(
-    _In_ uint8_t* Buffer,
-    _In_ size_t   Length);
+    _In_ uint8_t*     Buffer,
+    _In_ size_t       Length,
+    _In_ unsigned int Flags);
 
 /* PeLoadImage
  * Loads the given file-buffer as a pe image into the current address space 
@@ -78,22 +78,6 @@ PeResolveLibrary(
     return Exports;
 }
 
-uintptr_t
-PeResolveFunction(
-    _In_ PeExecutable_t* Library, 
-    _In_ const char*    Function)
-{
-    PeExportedFunction_t* Exports = Library->ExportedFunctions;
-    if (Exports != NULL) {
-        for (int i = 0; i < Library->NumberOfExportedFunctions; i++) {
-            if (Exports[i].Name != NULL && !strcmp(Exports[i].Name, Function)) {
-                return Exports[i].Address;
-            }
-        }
-    }
-    return 0;
-}
-
 OsStatus_t
 PeGetModuleHandles(
     _In_  PeExecutable_t* executable,
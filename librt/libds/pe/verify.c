@@ -56,8 +56,9 @@ PeCalculateChecksum(
 
 OsStatus_t
 PeValidateImageBuffer(
-    _In_ uint8_t* Buffer,
-    _In_ size_t   Length)
+    _In_ uint8_t*     Buffer,
+    _In_ size_t       Length,
+    _In_ unsigned int Flags)
 {
     PeOptionalHeader_t* OptHeader;
     PeHeader_t*         BaseHeader;
@@ -103,7 +104,7 @@ PeValidateImageBuffer(
 
     // Now do the actual checksum calc if the checksum
     // of the PE header is not 0
-    if (HeaderCheckSum != 0) {
+    if (HeaderCheckSum != 0 && (Flags & PE_VALIDATE_CHECKSUM)) {
         dstrace("Checksum validation phase");
         CalculatedCheckSum = PeCalculateChecksum(
             Buffer, Length, CheckSumAddress - ((size_t)Buffer));
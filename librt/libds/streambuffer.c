@@ -45,6 +45,13 @@
 #define STREAMBUFFER_WAIT_FLAGS(stream)           ((stream->options & STREAMBUFFER_GLOBAL) ? 0 : FUTEX_WAIT_PRIVATE)
 #define STREAMBUFFER_WAKE_FLAGS(stream)           ((stream->options & STREAMBUFFER_GLOBAL) ? 0 : FUTEX_WAKE_PRIVATE)
 
+// The capacity is always a power of two, which keeps the buffer offsets valid when the
+// indices wrap around at UINT_MAX
+#define STREAMBUFFER_OFFSET(stream, index) ((index) & (unsigned int)((stream)->capacity - 1))
+
+// Number of times a producer or consumer polls for its turn to commit before going to sleep
+#define STREAMBUFFER_COMMIT_SPINS 100
+
 typedef struct sb_packethdr {
     size_t packet_len;
 } sb_packethdr_t;
@@ -69,8 +76,15 @@ streambuffer_construct(
     _In_ size_t          capacity,
     _In_ unsigned int    options)
 {
+    size_t actual_capacity = 1;
+    
+    // The storage is provided by the caller, so we can only round down
+    while ((actual_capacity << 1) <= capacity && (actual_capacity << 1) <= (UINT_MAX >> 1)) {
+        actual_capacity <<= 1;
+    }
+    
     memset(stream, 0, sizeof(streambuffer_t));
-    stream->capacity = capacity;
+    stream->capacity = actual_capacity;
     stream->options  = options;
 }
 
@@ -80,14 +94,25 @@ streambuffer_create(
     _In_  unsigned int     options,
     _Out_ streambuffer_t** stream_out)
 {
+    streambuffer_t* stream;
+    size_t          actual_capacity = 1;
+    
+    if (!capacity || capacity > (UINT_MAX >> 1)) {
+        return OsInvalidParameters;
+    }
+    
+    while (actual_capacity < capacity) {
+        actual_capacity <<= 1;
+    }
+    
     // When calculating the number of bytes we want to actual structure size
     // without the buffer[1] and then capacity
-    streambuffer_t* stream = (streambuffer_t*)dsalloc(sizeof(streambuffer_t) + capacity);
+    stream = (streambuffer_t*)dsalloc(sizeof(streambuffer_t) + actual_capacity);
     if (!stream) {
         return OsOutOfMemory;
     }
     
-    streambuffer_construct(stream, capacity, options);
+    streambuffer_construct(stream, actual_capacity, options);
     *stream_out = stream;
     return OsSuccess;
 }
@@ -118,38 +143,95 @@ streambuffer_clear_option(
 
 static inline size_t
 bytes_writable(
-    _In_ size_t capacity,
-    _In_ size_t read_index,
-    _In_ size_t write_index)
+    _In_ size_t       capacity,
+    _In_ unsigned int read_index,
+    _In_ unsigned int write_index)
 {
-    if (read_index > write_index) {
-        // If we somehow ended up in a state where read_index got ahead of write_index
-        // fix this by treating us a empty capacity
-        if ((UINT_MAX - read_index) - write_index > capacity) {
-            return capacity;
-        }
-        return capacity - (write_index - (read_index - UINT_MAX));
+    unsigned int bytes_used = write_index - read_index;
+    
+    // If the read index is ahead of the write index, the write index was loaded
+    // before another writer moved it, the allocation will fail and be retried
+    if ((int)bytes_used < 0) {
+        return capacity;
     }
-    return capacity - (write_index - read_index);
+    return bytes_used >= capacity ? 0 : capacity - bytes_used;
 }
 
 static inline size_t
 bytes_readable(
-    _In_ size_t capacity,
-    _In_ size_t read_index,
-    _In_ size_t write_index)
+    _In_ size_t       capacity,
+    _In_ unsigned int read_index,
+    _In_ unsigned int write_index)
+{
+    unsigned int bytes_used = write_index - read_index;
+    
+    // Same as above, the read index was moved by another reader
+    if ((int)bytes_used < 0) {
+        return 0;
+    }
+    return MIN(bytes_used, capacity);
+}
+
+// Copies into the buffer at the given index, splitting the copy at the end of the buffer
+static void
+streambuffer_copy_in(
+    _In_ streambuffer_t* stream,
+    _In_ unsigned int    index,
+    _In_ const void*     buffer,
+    _In_ size_t          length)
+{
+    size_t offset      = STREAMBUFFER_OFFSET(stream, index);
+    size_t first_chunk = MIN(length, stream->capacity - offset);
+    
+    memcpy(&stream->buffer[offset], buffer, first_chunk);
+    if (first_chunk < length) {
+        memcpy(&stream->buffer[0], (const uint8_t*)buffer + first_chunk, length - first_chunk);
+    }
+}
+
+static void
+streambuffer_copy_out(
+    _In_ streambuffer_t* stream,
+    _In_ unsigned int    index,
+    _In_ void*           buffer,
+    _In_ size_t          length)
+{
+    size_t offset      = STREAMBUFFER_OFFSET(stream, index);
+    size_t first_chunk = MIN(length, stream->capacity - offset);
+    
+    memcpy(buffer, &stream->buffer[offset], first_chunk);
+    if (first_chunk < length) {
+        memcpy((uint8_t*)buffer + first_chunk, &stream->buffer[0], length - first_chunk);
+    }
+}
+
+// Waits for the comitted index to reach the index where our allocation starts. Waiters
+// register in the count that is woken whenever the comitted index moves.
+static void
+streambuffer_wait_for_commit(
+    _In_ streambuffer_t*        stream,
+    _In_ _Atomic(unsigned int)* comitted_index,
+    _In_ _Atomic(int)*          waiter_count,
+    _In_ unsigned int           index)
 {
-    // Handle wrap-around
-    if (read_index > write_index) {
-        if (read_index >= (UINT_MAX - capacity)) {
-            // (capacity - (read_index & (capacity- 1))) + (write_index & (capacity - 1)) - 1;
-            return (capacity - (read_index % capacity)) + (write_index % capacity) - 1;
+    FutexParameters_t parameters;
+    unsigned int      current_commit = atomic_load(comitted_index);
+    int               spins          = 0;
+    
+    while (current_commit != index) {
+        if (spins < STREAMBUFFER_COMMIT_SPINS) {
+            spins++;
         }
         else {
-            return 0; // Overcommitted
+            parameters._futex0  = (atomic_int*)comitted_index;
+            parameters._val0    = (int)current_commit;
+            parameters._timeout = 0;
+            parameters._flags   = STREAMBUFFER_WAIT_FLAGS(stream);
+            atomic_fetch_add(waiter_count, 1);
+            dswait(&parameters);
         }
+        current_commit = atomic_load(comitted_index);
     }
-    return write_index - read_index;
 }
 
 static void
@@ -161,12 +243,13 @@ streambuffer_try_truncate(
     // when we check, we must check how many bytes are actually allocated, not currently comitted
     // as we have to take into account current readers. The write index however
     // we have to only take into account how many bytes are actually comitted
-    unsigned int write_index     = atomic_load(&stream->producer_comitted_index);
-    unsigned int read_index      = atomic_load(&stream->consumer_index);
-    size_t       bytes_available = MIN(
+    FutexParameters_t parameters;
+    unsigned int      write_index     = atomic_load(&stream->producer_comitted_index);
+    unsigned int      read_index      = atomic_load(&stream->consumer_index);
+    size_t            bytes_available = MIN(
         bytes_readable(stream->capacity, read_index, write_index), 
         length);
-    size_t       bytes_comitted  = bytes_available;
+    size_t            bytes_comitted  = bytes_available;
     if (!STREAMBUFFER_CAN_READ(options, bytes_available, length)) {
         // should not happen but abort if this occurs
         return;
@@ -183,12 +266,17 @@ streambuffer_try_truncate(
     // the comitted index, otherwise we could end up telling writers that the wrong
     // index is writable. This can be skipped for single reader
     if (STREAMBUFFER_HAS_MULTIPLE_READERS(stream)) {
-        unsigned int current_commit = atomic_load(&stream->consumer_comitted_index);
-        while (current_commit < (read_index - bytes_comitted)) {
-            current_commit = atomic_load(&stream->consumer_comitted_index);
-        }
+        streambuffer_wait_for_commit(stream, &stream->consumer_comitted_index,
+            &stream->producer_count, read_index);
     }
+    
     atomic_fetch_add(&stream->consumer_comitted_index, bytes_comitted);
+    parameters._val0 = atomic_exchange(&stream->producer_count, 0);
+    if (parameters._val0 != 0) {
+        parameters._futex0 = (atomic_int*)&stream->consumer_comitted_index;
+        parameters._flags  = STREAMBUFFER_WAKE_FLAGS(stream);
+        dswake(&parameters);
+    }
 }
 
 void
@@ -279,19 +367,15 @@ streambuffer_stream_out(
         }
 
         // Write the data to the internal buffer
-        while (bytes_available--) {
-            // (write_index++ & (stream->capacity - 1))
-            stream->buffer[(write_index++ % stream->capacity)] = casted_ptr[bytes_written++];
-        }
+        streambuffer_copy_in(stream, write_index, &casted_ptr[bytes_written], bytes_available);
+        bytes_written += bytes_available;
         
         // Synchronize with other producers, we must wait for our turn to increament
         // the comitted index, otherwise we could end up telling readers that the wrong
         // index is readable. This can be skipped for single writer
         if (STREAMBUFFER_HAS_MULTIPLE_WRITERS(stream)) {
-            unsigned int current_commit = atomic_load(&stream->producer_comitted_index);
-            while (current_commit < (write_index - bytes_comitted)) {
-                current_commit = atomic_load(&stream->producer_comitted_index);
-            }
+            streambuffer_wait_for_commit(stream, &stream->producer_comitted_index,
+                &stream->consumer_count, write_index);
         }
 
         atomic_fetch_add(&stream->producer_comitted_index, bytes_comitted);
@@ -378,19 +462,8 @@ streambuffer_write_packet_data(
     _In_  size_t          length,
     _Out_ unsigned int*   state)
 {
-    uint8_t*     casted_ptr    = (uint8_t*)buffer;
-    unsigned int write_index   = (*state % stream->capacity);
-    size_t       bytes_written = 0;
-    
-    while (length--) {
-        // write_index++ & (stream->capacity - 1)
-        stream->buffer[write_index++] = casted_ptr[bytes_written++];
-        if (write_index == stream->capacity) {
-            write_index = 0;
-        }
-    }
-    
-    *state = write_index;
+    streambuffer_copy_in(stream, *state, buffer, length);
+    *state = STREAMBUFFER_OFFSET(stream, *state + (unsigned int)length);
 }
 
 void
@@ -406,11 +479,8 @@ streambuffer_write_packet_end(
     // the comitted index, otherwise we could end up telling readers that the wrong
     // index is readable. This can be skipped for single writer
     if (STREAMBUFFER_HAS_MULTIPLE_WRITERS(stream)) {
-        unsigned int write_index    = base;
-        unsigned int current_commit = atomic_load(&stream->producer_comitted_index);
-        while (current_commit < write_index) {
-            current_commit = atomic_load(&stream->producer_comitted_index);
-        }
+        streambuffer_wait_for_commit(stream, &stream->producer_comitted_index,
+            &stream->consumer_count, base);
     }
 
     adjusted_length = length + sizeof(sb_packethdr_t);
@@ -474,19 +544,15 @@ streambuffer_stream_in(
         }
         
         // Write the data to the provided buffer
-        while (bytes_available--) {
-            // read_index++ & (stream->capacity - 1)
-            casted_ptr[bytes_read++] = stream->buffer[(read_index++ % stream->capacity)];
-        }
+        streambuffer_copy_out(stream, read_index, &casted_ptr[bytes_read], bytes_available);
+        bytes_read += bytes_available;
         
         // Synchronize with other consumers, we must wait for our turn to increament
         // the comitted index, otherwise we could end up telling writers that the wrong
         // index is writable. This can be skipped for single reader
         if (STREAMBUFFER_HAS_MULTIPLE_READERS(stream)) {
-            unsigned int current_commit = atomic_load(&stream->consumer_comitted_index);
-            while (current_commit < (read_index - bytes_comitted)) {
-                current_commit = atomic_load(&stream->consumer_comitted_index);
-            }
+            streambuffer_wait_for_commit(stream, &stream->consumer_comitted_index,
+                &stream->producer_count, read_index);
         }
 
         atomic_fetch_add(&stream->consumer_comitted_index, bytes_comitted);
@@ -576,19 +642,8 @@ streambuffer_read_packet_data(
     _In_    size_t          length,
     _InOut_ unsigned int*   state)
 {
-    uint8_t*     casted_ptr = (uint8_t*)buffer;
-    unsigned int read_index = (*state % stream->capacity);
-    size_t       bytes_read = 0;
-    
-    // Write the data to the provided buffer
-    while (length--) {
-        casted_ptr[bytes_read++] = stream->buffer[read_index++];
-        if (read_index == stream->capacity) {
-            read_index = 0;
-        }
-    }
-    
-    *state = read_index;
+    streambuffer_copy_out(stream, *state, buffer, length);
+    *state = STREAMBUFFER_OFFSET(stream, *state + (unsigned int)length);
 }
 
 void
@@ -603,11 +658,8 @@ streambuffer_read_packet_end(
     // the comitted index, otherwise we could end up telling writers that the wrong
     // index is writable. This can be skipped for single reader
     if (STREAMBUFFER_HAS_MULTIPLE_READERS(stream)) {
-        unsigned int read_index     = base;
-        unsigned int current_commit = atomic_load(&stream->consumer_comitted_index);
-        while (current_commit < read_index) {
-            current_commit = atomic_load(&stream->consumer_comitted_index);
-        }
+        streambuffer_wait_for_commit(stream, &stream->consumer_comitted_index,
+            &stream->producer_count, base);
     }
 
     // Take into account an invisible instance of sb_packethdr_t
@@ -621,27 +673,3 @@ streambuffer_read_packet_end(
         dswake(&parameters);
     }
 }
-
-#if 0
-int main()
-{
-    cout << "read: 0, write: 15 == " << bytes_readable(128, 0, 15) << endl; // == 15
-    cout << "read: 120, write: 130 == " << bytes_readable(128, 120, 130) << endl; // == 10
-    cout << "read: 130, write: 200 == " << bytes_readable(128, 130, 200) << endl; // == 70
-    cout << "read: 20, write: 15 == " << bytes_readable(128, 20, 15) << endl; // == 0
-
-    // test rollover
-    unsigned int almost_at_max = UINT_MAX - 15;
-    cout << "read: " << almost_at_max << ", write: 15 == " << bytes_readable(128, almost_at_max, 15) << endl << endl; // == 30
-    
-    cout << "write: 0, read: 15 == " << bytes_writable(128, 15, 0) << endl; // == 128
-    cout << "write: 120, read: 130 == " << bytes_writable(128, 130, 120) << endl; // == 128
-    cout << "write: 200, read: 130 == " << bytes_writable(128, 130, 200) << endl; // == 58
-    cout << "write: 20, read: 15 == " << bytes_writable(128, 15, 20) << endl; // == 123
-    
-    // test rollover
-    almost_at_max = UINT_MAX - 15;
-    cout << "read: " << almost_at_max << ", write: 15 == " << bytes_writable(128, almost_at_max, 15) << endl; // == 98
-    return 0;
-}
-#endif
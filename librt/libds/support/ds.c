@@ -274,6 +274,48 @@ void UnloadFile(MString_t* FullPath, void* Buffer)
     _CRT_UNUSED(FullPath);
     _CRT_UNUSED(Buffer);
 }
+
+// Modules are loaded once, so they are verified every time
+int IsFileVerified(MString_t* FullPath, void* Buffer)
+{
+    _CRT_UNUSED(FullPath);
+    _CRT_UNUSED(Buffer);
+    return 0;
+}
+
+void MarkFileVerified(MString_t* FullPath, void* Buffer)
+{
+    _CRT_UNUSED(FullPath);
+    _CRT_UNUSED(Buffer);
+}
+
+// The kernel only loads each module once, so there is nothing to share
+PeImageCache_t* AcquireImageCache(MString_t* FullPath, uintptr_t Base)
+{
+    _CRT_UNUSED(FullPath);
+    _CRT_UNUSED(Base);
+    return NULL;
+}
+
+OsStatus_t CreateImageCache(MString_t* FullPath, uintptr_t Base, size_t Length, int SectionCount, PeImageCache_t** CacheOut)
+{
+    _CRT_UNUSED(FullPath);
+    _CRT_UNUSED(Base);
+    _CRT_UNUSED(Length);
+    _CRT_UNUSED(SectionCount);
+    _CRT_UNUSED(CacheOut);
+    return OsNotSupported;
+}
+
+void PublishImageCache(PeImageCache_t* Cache)
+{
+    _CRT_UNUSED(Cache);
+}
+
+void ReleaseImageCache(PeImageCache_t* Cache)
+{
+    _CRT_UNUSED(Cache);
+}
 #endif
 
 OsStatus_t CreateImageSpace(MemorySpaceHandle_t* HandleOut)
@@ -366,3 +408,28 @@ void ReleaseImageMapping(MemoryMapHandle_t Handle)
 #endif
     dsfree(StateObject);
 }
+
+// Maps memory of the loader into the given memory space, the pages are shared and not
+// copied, so the memory must stay allocated for as long as the memory space uses it.
+OsStatus_t ShareImageMapping(MemorySpaceHandle_t Handle, void* Source, uintptr_t Address, size_t Length, unsigned int Flags)
+{
+#ifdef LIBC_KERNEL
+    unsigned int KernelFlags = MAPPING_COMMIT | MAPPING_USERSPACE;
+    vaddr_t      Placement   = Address;
+    
+    if (Flags & MEMORY_EXECUTABLE) {
+        KernelFlags |= MAPPING_EXECUTABLE;
+    }
+    if (!(Flags & MEMORY_WRITE)) {
+        KernelFlags |= MAPPING_READONLY;
+    }
+    return MemorySpaceCloneMapping(GetCurrentMemorySpace(), (MemorySpace_t*)Handle, (vaddr_t)Source,
+        &Placement, Length, KernelFlags, MAPPING_VIRTUAL_FIXED);
+#else
+    struct MemoryMappingParameters Parameters;
+    Parameters.VirtualAddress = Address;
+    Parameters.Length         = Length;
+    Parameters.Flags          = Flags;
+    return ShareMemoryMapping((UUId_t)(uintptr_t)Handle, Source, &Parameters);
+#endif
+}
@@ -0,0 +1,889 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * General File System (MFS) Driver
+ *  - Bucket-map and master-record management. Changes are made to the cached copies
+ *    and the sectors they touch are marked dirty. Dirty sectors are written back in
+ *    batches, each batch is first written to the journal so a batch that was
+ *    interrupted can be completed when the filesystem is mounted again.
+ */
+//#define __TRACE
+
+#include <ddk/utils.h>
+#include "mfs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t
+MfsGetTimestamp(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_MONOTONIC);
+    return ((uint64_t)ts.tv_sec * 1000) + ((uint64_t)ts.tv_nsec / 1000000);
+}
+
+static uint32_t
+MfsJournalChecksum(
+    _In_ JournalHeader_t* Header,
+    _In_ uint8_t*         Payload,
+    _In_ size_t           Length)
+{
+    uint32_t Checksum = 2166136261U;
+    uint8_t* Bytes    = (uint8_t*)&Header->Targets[0];
+    size_t   i;
+
+    Checksum = (Checksum ^ Header->Sequence) * 16777619U;
+    Checksum = (Checksum ^ Header->Count) * 16777619U;
+    for (i = 0; i < Header->Count * sizeof(uint64_t); i++) {
+        Checksum = (Checksum ^ Bytes[i]) * 16777619U;
+    }
+    for (i = 0; i < Length; i++) {
+        Checksum = (Checksum ^ Payload[i]) * 16777619U;
+    }
+    return Checksum;
+}
+
+// Writes the payload sectors to their home locations, sectors that follow
+// each other on disk are written with a single request
+static OsStatus_t
+MfsWriteJournalTargets(
+    _In_ FileSystemDescriptor_t* FileSystem,
+    _In_ JournalHeader_t*        Header)
+{
+    MfsInstance_t* Mfs        = (MfsInstance_t*)FileSystem->ExtensionData;
+    size_t         SectorSize = FileSystem->Disk.descriptor.SectorSize;
+    size_t         SectorsTransferred;
+    size_t         i = 0;
+
+    while (i < Header->Count) {
+        size_t Count = 1;
+        while ((i + Count) < Header->Count && Header->Targets[i + Count] == Header->Targets[i] + Count) {
+            Count++;
+        }
+
+        if (MfsWriteSectors(FileSystem, Mfs->JournalBuffer.handle, (i + 1) * SectorSize,
+                Header->Targets[i], Count, &SectorsTransferred) != OsSuccess || SectorsTransferred != Count) {
+            ERROR("Failed to write %u metadata sectors at %u", Count, LODWORD(Header->Targets[i]));
+            return OsDeviceError;
+        }
+        i += Count;
+    }
+    return OsSuccess;
+}
+
+static OsStatus_t
+MfsWriteJournalHeader(
+    _In_ FileSystemDescriptor_t* FileSystem,
+    _In_ uint32_t                Sequence,
+    _In_ uint32_t                Count,
+    _In_ uint32_t                Checksum)
+{
+    MfsInstance_t*   Mfs    = (MfsInstance_t*)FileSystem->ExtensionData;
+    JournalHeader_t* Header = (JournalHeader_t*)Mfs->JournalBuffer.buffer;
+    size_t           SectorsTransferred;
+
+    Header->Magic    = MFS_JOURNAL_MAGIC;
+    Header->Sequence = Sequence;
+    Header->Count    = Count;
+    Header->Checksum = Checksum;
+    if (MfsWriteSectors(FileSystem, Mfs->JournalBuffer.handle, 0, Mfs->JournalSector, 1,
+            &SectorsTransferred) != OsSuccess || SectorsTransferred != 1) {
+        ERROR("Failed to write the journal header");
+        return OsDeviceError;
+    }
+    return OsSuccess;
+}
+
+// Writes one batch, the payload goes to the journal before the header that commits
+// it. Once the header is on disk the batch is replayed if it is not completed.
+static OsStatus_t
+MfsFlushBatch(
+    _In_ FileSystemDescriptor_t* FileSystem,
+    _In_ size_t                  Count)
+{
+    MfsInstance_t*   Mfs        = (MfsInstance_t*)FileSystem->ExtensionData;
+    JournalHeader_t* Header     = (JournalHeader_t*)Mfs->JournalBuffer.buffer;
+    size_t           SectorSize = FileSystem->Disk.descriptor.SectorSize;
+    uint8_t*         Payload    = (uint8_t*)Mfs->JournalBuffer.buffer + SectorSize;
+    size_t           SectorsTransferred;
+    uint32_t         Sequence   = Mfs->JournalSequence + 1;
+    OsStatus_t       Status;
+
+    Header->Count = (uint32_t)Count;
+    if (Mfs->JournalSector) {
+        if (MfsWriteSectors(FileSystem, Mfs->JournalBuffer.handle, SectorSize, Mfs->JournalSector + 1,
+                Count, &SectorsTransferred) != OsSuccess || SectorsTransferred != Count) {
+            ERROR("Failed to write %u sectors to the journal", Count);
+            return OsDeviceError;
+        }
+
+        Header->Sequence = Sequence;
+        Status = MfsWriteJournalHeader(FileSystem, Sequence, (uint32_t)Count,
+            MfsJournalChecksum(Header, Payload, Count * SectorSize));
+        if (Status != OsSuccess) {
+            return Status;
+        }
+    }
+
+    Status = MfsWriteJournalTargets(FileSystem, Header);
+    if (Status != OsSuccess) {
+        return Status;
+    }
+
+    Mfs->JournalSequence = Sequence;
+    if (Mfs->JournalSector) {
+        return MfsWriteJournalHeader(FileSystem, Sequence, 0, 0);
+    }
+    return OsSuccess;
+}
+
+OsStatus_t
+MfsFlushMetadata(
+    _In_ FileSystemDescriptor_t* FileSystem)
+{
+    MfsInstance_t*   Mfs        = (MfsInstance_t*)FileSystem->ExtensionData;
+    JournalHeader_t* Header;
+    size_t           SectorSize = FileSystem->Disk.descriptor.SectorSize;
+    size_t           MapSectors;
+    size_t           Count      = 0;
+    size_t           i;
+    OsStatus_t       Status;
+
+    if (!Mfs || !Mfs->DirtyMap || (!Mfs->DirtyCount && !Mfs->MasterRecordDirty)) {
+        return OsSuccess;
+    }
+
+    TRACE("MfsFlushMetadata(Sectors %u, MasterRecord %i)", Mfs->DirtyCount, Mfs->MasterRecordDirty);
+
+    // Collect the dirty map sectors in ascending order, the batch is only split if a
+    // single operation dirtied more sectors than the journal holds
+    Header     = (JournalHeader_t*)Mfs->JournalBuffer.buffer;
+    MapSectors = DIVUP((size_t)Mfs->MasterRecord.MapSize, SectorSize);
+    for (i = 0; i < MapSectors; i++) {
+        if (!(Mfs->DirtyMap[i / 8] & (1 << (i % 8)))) {
+            continue;
+        }
+
+        if (Count == Mfs->JournalCapacity - 2) {
+            Status = MfsFlushBatch(FileSystem, Count);
+            if (Status != OsSuccess) {
+                return Status;
+            }
+            Count = 0;
+        }
+
+        Header->Targets[Count] = Mfs->MasterRecord.MapSector + i;
+        memcpy((uint8_t*)Mfs->JournalBuffer.buffer + ((Count + 1) * SectorSize),
+               (uint8_t*)Mfs->BucketMap + (i * SectorSize), SectorSize);
+        Count++;
+    }
+
+    // The master-record is always part of the last batch, it holds the free pointer
+    // that has to match the map
+    if (Mfs->MasterRecordDirty) {
+        uint8_t* Payload = (uint8_t*)Mfs->JournalBuffer.buffer + ((Count + 1) * SectorSize);
+
+        memset(Payload, 0, SectorSize);
+        memcpy(Payload, &Mfs->MasterRecord, sizeof(MasterRecord_t));
+        memcpy(Payload + SectorSize, Payload, SectorSize);
+        Header->Targets[Count]     = Mfs->MasterRecordSector;
+        Header->Targets[Count + 1] = Mfs->MasterRecordMirrorSector;
+        Count += 2;
+    }
+
+    if (Count) {
+        Status = MfsFlushBatch(FileSystem, Count);
+        if (Status != OsSuccess) {
+            return Status;
+        }
+    }
+
+    memset(Mfs->DirtyMap, 0, DIVUP(MapSectors, 8));
+    Mfs->DirtyCount        = 0;
+    Mfs->MasterRecordDirty = 0;
+    Mfs->DirtySince        = 0;
+    return OsSuccess;
+}
+
+// Flushes when the journal is about to fill up, or when the oldest change
+// has waited long enough. There is no flusher thread, the age is checked as
+// metadata is updated and records are always written after a flush. Room is
+// kept for the master-record and the map sectors an update can touch, so a
+// batch is not split and stays atomic.
+static OsStatus_t
+MfsCheckMetadata(
+    _In_ FileSystemDescriptor_t* FileSystem)
+{
+    MfsInstance_t* Mfs = (MfsInstance_t*)FileSystem->ExtensionData;
+
+    if (!Mfs->DirtySince) {
+        Mfs->DirtySince = MfsGetTimestamp();
+        if (!Mfs->DirtySince) {
+            Mfs->DirtySince = 1;
+        }
+    }
+
+    if ((Mfs->DirtyCount + 2 + MFS_UPDATE_SECTORS) >= Mfs->JournalCapacity ||
+        (MfsGetTimestamp() - Mfs->DirtySince) >= MFS_METADATA_FLUSH_DELAY) {
+        return MfsFlushMetadata(FileSystem);
+    }
+    return OsSuccess;
+}
+
+OsStatus_t
+MfsReplayJournal(
+    _In_ FileSystemDescriptor_t* FileSystem)
+{
+    MfsInstance_t*   Mfs        = (MfsInstance_t*)FileSystem->ExtensionData;
+    JournalHeader_t* Header     = (JournalHeader_t*)Mfs->JournalBuffer.buffer;
+    size_t           SectorSize = FileSystem->Disk.descriptor.SectorSize;
+    uint8_t*         Payload    = (uint8_t*)Mfs->JournalBuffer.buffer + SectorSize;
+    size_t           SectorsTransferred;
+    OsStatus_t       Status;
+    size_t           i;
+
+    TRACE("MfsReplayJournal(Index %u)", Mfs->MasterRecord.JournalIndex);
+
+    // Older images might not have a journal, batches are then written without one
+    Mfs->JournalCapacity = MIN(MFS_JOURNAL_TARGETS, (Mfs->JournalBuffer.length / SectorSize) - 1);
+    if (!Mfs->MasterRecord.JournalIndex || (Mfs->MasterRecord.JournalIndex + MFS_JOURNALSIZE) > Mfs->BucketCount) {
+        WARNING("[mfs] [journal] no journal present, metadata is not protected");
+        Mfs->JournalSector = 0;
+        return OsSuccess;
+    }
+    Mfs->JournalSector   = MFS_GETSECTOR(Mfs, Mfs->MasterRecord.JournalIndex);
+    Mfs->JournalCapacity = MIN(Mfs->JournalCapacity, (MFS_JOURNALSIZE * Mfs->SectorsPerBucket) - 1);
+
+    if (MfsReadSectors(FileSystem, Mfs->JournalBuffer.handle, 0, Mfs->JournalSector, 1,
+            &SectorsTransferred) != OsSuccess) {
+        ERROR("Failed to read the journal header");
+        return OsDeviceError;
+    }
+
+    Mfs->JournalSequence = (Header->Magic == MFS_JOURNAL_MAGIC) ? Header->Sequence : 0;
+    if (Header->Magic != MFS_JOURNAL_MAGIC || Header->Count == 0) {
+        return OsSuccess;
+    }
+
+    if (Header->Count > Mfs->JournalCapacity) {
+        WARNING("[mfs] [journal] invalid batch of %u sectors, ignoring it", Header->Count);
+        return OsSuccess;
+    }
+
+    if (MfsReadSectors(FileSystem, Mfs->JournalBuffer.handle, SectorSize, Mfs->JournalSector + 1,
+            Header->Count, &SectorsTransferred) != OsSuccess) {
+        ERROR("Failed to read the journal");
+        return OsDeviceError;
+    }
+
+    // A header that does not match the payload was never committed
+    if (MfsJournalChecksum(Header, Payload, Header->Count * SectorSize) != Header->Checksum) {
+        WARNING("[mfs] [journal] batch %u was not committed, ignoring it", Header->Sequence);
+        return OsSuccess;
+    }
+
+    WARNING("[mfs] [journal] completing batch %u of %u sectors", Header->Sequence, Header->Count);
+    Status = MfsWriteJournalTargets(FileSystem, Header);
+    if (Status != OsSuccess) {
+        return Status;
+    }
+
+    // The master-record might have been part of it
+    for (i = 0; i < Header->Count; i++) {
+        if (Header->Targets[i] == Mfs->MasterRecordSector) {
+            memcpy(&Mfs->MasterRecord, Payload + (i * SectorSize), sizeof(MasterRecord_t));
+        }
+    }
+    return MfsWriteJournalHeader(FileSystem, Header->Sequence, 0, 0);
+}
+
+OsStatus_t
+MfsUpdateMasterRecord(
+    _In_ FileSystemDescriptor_t* FileSystem)
+{
+    MfsInstance_t* Mfs = (MfsInstance_t*)FileSystem->ExtensionData;
+
+    TRACE("MfsUpdateMasterRecord()");
+
+    Mfs->MasterRecordDirty = 1;
+    return MfsCheckMetadata(FileSystem);
+}
+
+OsStatus_t
+MfsGetBucketLink(
+    _In_  FileSystemDescriptor_t* FileSystem,
+    _In_  uint32_t                Bucket,
+    _Out_ MapRecord_t*            Link)
+{
+    MfsInstance_t* Mfs = (MfsInstance_t*)FileSystem->ExtensionData;
+
+    TRACE("MfsGetBucketLink(Bucket %u)", Bucket);
+    if (Bucket < Mfs->BucketCount) {
+        Link->Link   = Mfs->BucketMap[(Bucket * 2)];
+        Link->Length = Mfs->BucketMap[(Bucket * 2) + 1];
+        TRACE("... link %u, length %u", Link->Link, Link->Length);
+        return OsSuccess;
+    }
+    return OsInvalidParameters;
+}
+
+OsStatus_t
+MfsSetBucketLink(
+    _In_ FileSystemDescriptor_t*    FileSystem,
+    _In_ uint32_t                   Bucket,
+    _In_ MapRecord_t*               Link,
+    _In_ int                        UpdateLength)
+{
+    MfsInstance_t* Mfs = (MfsInstance_t*)FileSystem->ExtensionData;
+    size_t         SectorOffset;
+
+    TRACE("MfsSetBucketLink(Bucket %u, Link %u)", Bucket, Link->Link);
+
+    if (Bucket >= Mfs->BucketCount) {
+        return OsInvalidParameters;
+    }
+
+    // Update in-memory map first
+    Mfs->BucketMap[(Bucket * 2)] = Link->Link;
+    if (UpdateLength) {
+        Mfs->BucketMap[(Bucket * 2) + 1] = Link->Length;
+    }
+
+    // Calculate which sector that is dirty now
+    SectorOffset = Bucket / Mfs->BucketsPerSectorInMap;
+    if (!(Mfs->DirtyMap[SectorOffset / 8] & (1 << (SectorOffset % 8)))) {
+        Mfs->DirtyMap[SectorOffset / 8] |= (uint8_t)(1 << (SectorOffset % 8));
+        Mfs->DirtyCount++;
+    }
+
+    // Write-back is only considered once the master-record is updated, that
+    // is when the operation that changed the map is complete
+    return OsSuccess;
+}
+
+// Keeps room in the journal for one more update of a run, a batch is
+// flushed before an operation that touches many runs could split it
+static OsStatus_t
+MfsReserveMetadata(
+    _In_ FileSystemDescriptor_t* FileSystem)
+{
+    MfsInstance_t* Mfs = (MfsInstance_t*)FileSystem->ExtensionData;
+
+    if ((Mfs->DirtyCount + 2 + MFS_UPDATE_SECTORS) >= Mfs->JournalCapacity) {
+        return MfsFlushMetadata(FileSystem);
+    }
+    return OsSuccess;
+}
+
+static int
+MfsCompareFreeBucket(
+    _In_ const void* Left,
+    _In_ const void* Right)
+{
+    uint32_t LeftBucket  = ((const MfsFreeExtent_t*)Left)->Bucket;
+    uint32_t RightBucket = ((const MfsFreeExtent_t*)Right)->Bucket;
+    return (LeftBucket > RightBucket) - (LeftBucket < RightBucket);
+}
+
+static int
+MfsCompareFreeLength(
+    _In_ const void* Left,
+    _In_ const void* Right)
+{
+    const MfsFreeExtent_t* LeftExtent  = (const MfsFreeExtent_t*)Left;
+    const MfsFreeExtent_t* RightExtent = (const MfsFreeExtent_t*)Right;
+    if (LeftExtent->Length != RightExtent->Length) {
+        return (LeftExtent->Length > RightExtent->Length) ? 1 : -1;
+    }
+    return MfsCompareFreeBucket(Left, Right);
+}
+
+// Returns the index of the first free extent that starts at or after the bucket
+static size_t
+MfsFindFreeByPosition(
+    _In_ MfsInstance_t* Mfs,
+    _In_ uint32_t       Bucket)
+{
+    size_t Low  = 0;
+    size_t High = Mfs->FreeExtentCount;
+
+    while (Low < High) {
+        size_t Middle = Low + ((High - Low) / 2);
+        if (Mfs->FreeByPosition[Middle].Bucket < Bucket) {
+            Low = Middle + 1;
+        }
+        else {
+            High = Middle;
+        }
+    }
+    return Low;
+}
+
+// Returns the index of the smallest free extent of at least the length
+static size_t
+MfsFindFreeBySize(
+    _In_ MfsInstance_t* Mfs,
+    _In_ uint32_t       Length,
+    _In_ uint32_t       Bucket)
+{
+    size_t Low  = 0;
+    size_t High = Mfs->FreeExtentCount;
+
+    while (Low < High) {
+        size_t           Middle = Low + ((High - Low) / 2);
+        MfsFreeExtent_t* Extent = &Mfs->FreeBySize[Middle];
+        if (Extent->Length < Length || (Extent->Length == Length && Extent->Bucket < Bucket)) {
+            Low = Middle + 1;
+        }
+        else {
+            High = Middle;
+        }
+    }
+    return Low;
+}
+
+static OsStatus_t
+MfsGrowFreeIndex(
+    _In_ MfsInstance_t* Mfs,
+    _In_ size_t         Count)
+{
+    MfsFreeExtent_t* ByPosition;
+    MfsFreeExtent_t* BySize;
+    size_t           Capacity;
+
+    if (Mfs->FreeExtentCount + Count <= Mfs->FreeExtentCapacity) {
+        return OsSuccess;
+    }
+
+    Capacity = MAX(Mfs->FreeExtentCapacity * 2, Mfs->FreeExtentCount + Count);
+    Capacity = MAX(Capacity, MFS_FREEINDEX_INITIAL);
+    ByPosition = (MfsFreeExtent_t*)realloc(Mfs->FreeByPosition, Capacity * sizeof(MfsFreeExtent_t));
+    if (!ByPosition) {
+        return OsOutOfMemory;
+    }
+    Mfs->FreeByPosition = ByPosition;
+
+    BySize = (MfsFreeExtent_t*)realloc(Mfs->FreeBySize, Capacity * sizeof(MfsFreeExtent_t));
+    if (!BySize) {
+        return OsOutOfMemory;
+    }
+    Mfs->FreeBySize         = BySize;
+    Mfs->FreeExtentCapacity = Capacity;
+    return OsSuccess;
+}
+
+static void
+MfsInsertFreeExtent(
+    _In_ MfsInstance_t* Mfs,
+    _In_ uint32_t       Bucket,
+    _In_ uint32_t       Length,
+    _In_ uint32_t       Previous)
+{
+    size_t Position = MfsFindFreeByPosition(Mfs, Bucket);
+    size_t Size     = MfsFindFreeBySize(Mfs, Length, Bucket);
+
+    memmove(&Mfs->FreeByPosition[Position + 1], &Mfs->FreeByPosition[Position],
+        (Mfs->FreeExtentCount - Position) * sizeof(MfsFreeExtent_t));
+    memmove(&Mfs->FreeBySize[Size + 1], &Mfs->FreeBySize[Size],
+        (Mfs->FreeExtentCount - Size) * sizeof(MfsFreeExtent_t));
+
+    Mfs->FreeByPosition[Position].Bucket   = Bucket;
+    Mfs->FreeByPosition[Position].Length   = Length;
+    Mfs->FreeByPosition[Position].Previous = Previous;
+    Mfs->FreeBySize[Size]                  = Mfs->FreeByPosition[Position];
+    Mfs->FreeExtentCount++;
+    Mfs->FreeBucketCount += Length;
+}
+
+static void
+MfsRemoveFreeExtent(
+    _In_ MfsInstance_t* Mfs,
+    _In_ size_t         Position)
+{
+    MfsFreeExtent_t* Extent = &Mfs->FreeByPosition[Position];
+    size_t           Size   = MfsFindFreeBySize(Mfs, Extent->Length, Extent->Bucket);
+
+    Mfs->FreeBucketCount -= Extent->Length;
+    Mfs->FreeExtentCount--;
+    memmove(&Mfs->FreeBySize[Size], &Mfs->FreeBySize[Size + 1],
+        (Mfs->FreeExtentCount - Size) * sizeof(MfsFreeExtent_t));
+    memmove(&Mfs->FreeByPosition[Position], &Mfs->FreeByPosition[Position + 1],
+        (Mfs->FreeExtentCount - Position) * sizeof(MfsFreeExtent_t));
+}
+
+// Updates the free chain and the index when a free run gets a new predecessor
+static void
+MfsSetFreePrevious(
+    _In_ MfsInstance_t* Mfs,
+    _In_ uint32_t       Bucket,
+    _In_ uint32_t       Previous)
+{
+    size_t Position;
+
+    if (Bucket == MFS_ENDOFCHAIN) {
+        return;
+    }
+
+    Position = MfsFindFreeByPosition(Mfs, Bucket);
+    if (Position < Mfs->FreeExtentCount && Mfs->FreeByPosition[Position].Bucket == Bucket) {
+        Mfs->FreeByPosition[Position].Previous = Previous;
+    }
+}
+
+static OsStatus_t
+MfsSetFreeLink(
+    _In_ FileSystemDescriptor_t* FileSystem,
+    _In_ uint32_t                Previous,
+    _In_ uint32_t                Next)
+{
+    MfsInstance_t* Mfs = (MfsInstance_t*)FileSystem->ExtensionData;
+    MapRecord_t    Record;
+
+    if (Previous == MFS_ENDOFCHAIN) {
+        Mfs->MasterRecord.FreeBucket = Next;
+        Mfs->MasterRecordDirty       = 1;
+        return OsSuccess;
+    }
+
+    Record.Link   = Next;
+    Record.Length = 0;
+    return MfsSetBucketLink(FileSystem, Previous, &Record, 0);
+}
+
+OsStatus_t
+MfsBuildFreeIndex(
+    _In_ FileSystemDescriptor_t* FileSystem)
+{
+    MfsInstance_t* Mfs      = (MfsInstance_t*)FileSystem->ExtensionData;
+    uint32_t       Previous = MFS_ENDOFCHAIN;
+    uint32_t       Bucket   = Mfs->MasterRecord.FreeBucket;
+    size_t         i;
+    OsStatus_t     Status;
+
+    free(Mfs->FreeByPosition);
+    free(Mfs->FreeBySize);
+    Mfs->FreeByPosition     = NULL;
+    Mfs->FreeBySize         = NULL;
+    Mfs->FreeExtentCount    = 0;
+    Mfs->FreeExtentCapacity = 0;
+    Mfs->FreeBucketCount    = 0;
+
+    while (Bucket != MFS_ENDOFCHAIN) {
+        MapRecord_t Record;
+
+        if (MfsGetBucketLink(FileSystem, Bucket, &Record) != OsSuccess ||
+            Record.Length == 0 || (Bucket + (uint64_t)Record.Length) > Mfs->BucketCount ||
+            Mfs->FreeExtentCount == Mfs->BucketCount) {
+            ERROR("The free chain is invalid at bucket %u", Bucket);
+            return OsError;
+        }
+
+        Status = MfsGrowFreeIndex(Mfs, 1);
+        if (Status != OsSuccess) {
+            return Status;
+        }
+
+        Mfs->FreeByPosition[Mfs->FreeExtentCount].Bucket   = Bucket;
+        Mfs->FreeByPosition[Mfs->FreeExtentCount].Length   = Record.Length;
+        Mfs->FreeByPosition[Mfs->FreeExtentCount].Previous = Previous;
+        Mfs->FreeExtentCount++;
+        Mfs->FreeBucketCount += Record.Length;
+        Previous = Bucket;
+        Bucket   = Record.Link;
+    }
+
+    if (Mfs->FreeExtentCount) {
+        qsort(Mfs->FreeByPosition, Mfs->FreeExtentCount, sizeof(MfsFreeExtent_t), MfsCompareFreeBucket);
+        memcpy(Mfs->FreeBySize, Mfs->FreeByPosition, Mfs->FreeExtentCount * sizeof(MfsFreeExtent_t));
+        qsort(Mfs->FreeBySize, Mfs->FreeExtentCount, sizeof(MfsFreeExtent_t), MfsCompareFreeLength);
+    }
+
+    for (i = 1; i < Mfs->FreeExtentCount; i++) {
+        if (Mfs->FreeByPosition[i - 1].Bucket + Mfs->FreeByPosition[i - 1].Length > Mfs->FreeByPosition[i].Bucket) {
+            ERROR("The free runs at bucket %u and %u overlap",
+                Mfs->FreeByPosition[i - 1].Bucket, Mfs->FreeByPosition[i].Bucket);
+            return OsError;
+        }
+    }
+
+    TRACE("MfsBuildFreeIndex(Free %u, Extents %u, Largest %u)", LODWORD(Mfs->FreeBucketCount),
+        LODWORD(Mfs->FreeExtentCount),
+        Mfs->FreeExtentCount ? Mfs->FreeBySize[Mfs->FreeExtentCount - 1].Length : 0);
+    return OsSuccess;
+}
+
+// Selects the free extent to allocate from. The run that starts at the hint is taken
+// so the chain can be extended in place, otherwise a nearby run that is large enough,
+// otherwise the smallest run that is large enough or the largest run there is.
+static size_t
+MfsSelectFreeExtent(
+    _In_ MfsInstance_t* Mfs,
+    _In_ uint32_t       Hint,
+    _In_ uint32_t       Count)
+{
+    size_t Position;
+    size_t Size;
+    size_t i;
+
+    if (Hint != MFS_ENDOFCHAIN) {
+        Position = MfsFindFreeByPosition(Mfs, Hint);
+        if (Position < Mfs->FreeExtentCount && Mfs->FreeByPosition[Position].Bucket == Hint) {
+            return Position;
+        }
+
+        for (i = Position; i < Mfs->FreeExtentCount && i < (Position + MFS_LOCALITY_WINDOW); i++) {
+            if (Mfs->FreeByPosition[i].Length >= Count) {
+                return i;
+            }
+        }
+    }
+
+    Size = MfsFindFreeBySize(Mfs, Count, 0);
+    if (Size == Mfs->FreeExtentCount) {
+        Size--;
+    }
+    return MfsFindFreeByPosition(Mfs, Mfs->FreeBySize[Size].Bucket);
+}
+
+// Takes buckets from the start of a free extent, the rest of the
+// extent replaces it in the free chain
+static OsStatus_t
+MfsTakeFreeExtent(
+    _In_  FileSystemDescriptor_t* FileSystem,
+    _In_  size_t                  Position,
+    _In_  uint32_t                Count,
+    _Out_ uint32_t*               Taken)
+{
+    MfsInstance_t*  Mfs    = (MfsInstance_t*)FileSystem->ExtensionData;
+    MfsFreeExtent_t Extent = Mfs->FreeByPosition[Position];
+    MapRecord_t     Record;
+    uint32_t        Next   = Mfs->BucketMap[Extent.Bucket * 2];
+    OsStatus_t      Status;
+
+    *Taken = MIN(Count, Extent.Length);
+    MfsRemoveFreeExtent(Mfs, Position);
+
+    if (*Taken < Extent.Length) {
+        uint32_t Rest = Extent.Bucket + *Taken;
+
+        Record.Link   = Next;
+        Record.Length = Extent.Length - *Taken;
+        Status = MfsSetBucketLink(FileSystem, Rest, &Record, 1);
+        if (Status == OsSuccess) {
+            Status = MfsSetFreeLink(FileSystem, Extent.Previous, Rest);
+        }
+        MfsSetFreePrevious(Mfs, Next, Rest);
+        MfsInsertFreeExtent(Mfs, Rest, Record.Length, Extent.Previous);
+    }
+    else {
+        Status = MfsSetFreeLink(FileSystem, Extent.Previous, Next);
+        MfsSetFreePrevious(Mfs, Next, Extent.Previous);
+    }
+
+    if (Status != OsSuccess) {
+        return Status;
+    }
+
+    Record.Link   = MFS_ENDOFCHAIN;
+    Record.Length = *Taken;
+    return MfsSetBucketLink(FileSystem, Extent.Bucket, &Record, 1);
+}
+
+// Returns a run to the free chain, it is merged with the free runs
+// that are next to it on disk
+static OsStatus_t
+MfsReleaseRun(
+    _In_ FileSystemDescriptor_t* FileSystem,
+    _In_ uint32_t                Bucket,
+    _In_ uint32_t                Length)
+{
+    MfsInstance_t*  Mfs      = (MfsInstance_t*)FileSystem->ExtensionData;
+    size_t          Position = MfsFindFreeByPosition(Mfs, Bucket);
+    MfsFreeExtent_t Left, Right;
+    int             HasLeft  = 0;
+    int             HasRight = 0;
+    MapRecord_t     Record;
+    OsStatus_t      Status;
+
+    if (Position > 0 && Mfs->FreeByPosition[Position - 1].Bucket + Mfs->FreeByPosition[Position - 1].Length == Bucket) {
+        Left    = Mfs->FreeByPosition[Position - 1];
+        HasLeft = 1;
+    }
+    if (Position < Mfs->FreeExtentCount && Mfs->FreeByPosition[Position].Bucket == Bucket + Length) {
+        Right    = Mfs->FreeByPosition[Position];
+        HasRight = 1;
+    }
+
+    if (HasRight) {
+        uint32_t Next = Mfs->BucketMap[Right.Bucket * 2];
+
+        // Drop the run to the right, it becomes part of the released run
+        MfsRemoveFreeExtent(Mfs, Position);
+        if (HasLeft) {
+            Status = MfsSetFreeLink(FileSystem, Right.Previous, Next);
+            MfsSetFreePrevious(Mfs, Next, Right.Previous);
+            if (Left.Bucket == Next) {
+                Left.Previous = Right.Previous;
+            }
+        }
+        else {
+            Record.Link   = Next;
+            Record.Length = Length + Right.Length;
+            Status = MfsSetBucketLink(FileSystem, Bucket, &Record, 1);
+            if (Status == OsSuccess) {
+                Status = MfsSetFreeLink(FileSystem, Right.Previous, Bucket);
+            }
+            MfsSetFreePrevious(Mfs, Next, Bucket);
+            MfsInsertFreeExtent(Mfs, Bucket, Record.Length, Right.Previous);
+            return Status;
+        }
+
+        if (Status != OsSuccess) {
+            return Status;
+        }
+        Length += Right.Length;
+    }
+
+    if (HasLeft) {
+        MfsRemoveFreeExtent(Mfs, MfsFindFreeByPosition(Mfs, Left.Bucket));
+        Record.Link   = Mfs->BucketMap[Left.Bucket * 2];
+        Record.Length = Left.Length + Length;
+        MfsInsertFreeExtent(Mfs, Left.Bucket, Record.Length, Left.Previous);
+        return MfsSetBucketLink(FileSystem, Left.Bucket, &Record, 1);
+    }
+
+    // Nothing to merge with, the run becomes the head of the free chain
+    Record.Link   = Mfs->MasterRecord.FreeBucket;
+    Record.Length = Length;
+    Status = MfsSetBucketLink(FileSystem, Bucket, &Record, 1);
+    MfsSetFreePrevious(Mfs, Record.Link, Bucket);
+    MfsInsertFreeExtent(Mfs, Bucket, Length, MFS_ENDOFCHAIN);
+    if (Status == OsSuccess) {
+        Status = MfsSetFreeLink(FileSystem, MFS_ENDOFCHAIN, Bucket);
+    }
+    return Status;
+}
+
+OsStatus_t
+MfsAllocateBuckets(
+    _In_ FileSystemDescriptor_t*    FileSystem,
+    _In_ uint32_t                   Hint,
+    _In_ size_t                     BucketCount,
+    _In_ MapRecord_t*               RecordResult)
+{
+    MfsInstance_t*  Mfs         = (MfsInstance_t*)FileSystem->ExtensionData;
+    uint32_t        PreviousRun = MFS_ENDOFCHAIN;
+    size_t          Counter     = BucketCount;
+    MapRecord_t     Record;
+    OsStatus_t      Status;
+
+    TRACE("MfsAllocateBuckets(Hint %u, Count %u)", Hint, BucketCount);
+
+    RecordResult->Link   = MFS_ENDOFCHAIN;
+    RecordResult->Length = 0;
+
+    if (!BucketCount || BucketCount > Mfs->FreeBucketCount) {
+        ERROR("Failed to allocate %u buckets, %u are free", BucketCount, LODWORD(Mfs->FreeBucketCount));
+        return OsError;
+    }
+
+    // Buckets are allocated in as few runs as possible, each run is taken from the
+    // start of a free extent and linked to the previous one
+    while (Counter > 0) {
+        size_t   Position;
+        uint32_t Taken;
+
+        Status = MfsReserveMetadata(FileSystem);
+        if (Status == OsSuccess) {
+            Status = MfsGrowFreeIndex(Mfs, 1);
+        }
+        if (Status != OsSuccess) {
+            return Status;
+        }
+
+        Position = MfsSelectFreeExtent(Mfs, Hint, (uint32_t)Counter);
+        Hint     = Mfs->FreeByPosition[Position].Bucket;
+        Status   = MfsTakeFreeExtent(FileSystem, Position, (uint32_t)Counter, &Taken);
+        if (Status != OsSuccess) {
+            ERROR("Failed to allocate buckets at %u", Hint);
+            return Status;
+        }
+
+        if (PreviousRun == MFS_ENDOFCHAIN) {
+            RecordResult->Link   = Hint;
+            RecordResult->Length = Taken;
+        }
+        else {
+            Record.Link = Hint;
+            if (MfsSetBucketLink(FileSystem, PreviousRun, &Record, 0) != OsSuccess) {
+                ERROR("Failed to update link for bucket %u", PreviousRun);
+                return OsError;
+            }
+        }
+
+        PreviousRun = Hint;
+        Hint       += Taken;
+        Counter    -= Taken;
+    }
+    return MfsUpdateMasterRecord(FileSystem);
+}
+
+/* MfsFreeBuckets
+ * Frees an entire chain of buckets that has been allocated for a file-record */
+OsStatus_t
+MfsFreeBuckets(
+    _In_ FileSystemDescriptor_t*    FileSystem,
+    _In_ uint32_t                   StartBucket,
+    _In_ uint32_t                   StartLength)
+{
+    MfsInstance_t*  Mfs    = (MfsInstance_t*)FileSystem->ExtensionData;
+    uint32_t        Bucket = StartBucket;
+    MapRecord_t     Record;
+    OsStatus_t      Status;
+
+    TRACE("MfsFreeBuckets(Bucket %u, Length %u)", StartBucket, StartLength);
+
+    if (StartLength == 0) {
+        return OsError;
+    }
+
+    // Each run is released on its own and merged with its free neighbours, this
+    // keeps the free space in as few extents as possible
+    while (Bucket != MFS_ENDOFCHAIN) {
+        if (MfsGetBucketLink(FileSystem, Bucket, &Record) != OsSuccess) {
+            ERROR("Failed to retrieve the next bucket-link");
+            return OsError;
+        }
+
+        Status = MfsReserveMetadata(FileSystem);
+        if (Status == OsSuccess) {
+            Status = MfsGrowFreeIndex(Mfs, 1);
+        }
+        if (Status == OsSuccess) {
+            Status = MfsReleaseRun(FileSystem, Bucket, Record.Length);
+        }
+        if (Status != OsSuccess) {
+            ERROR("Failed to release the run at bucket %u", Bucket);
+            return Status;
+        }
+        Bucket = Record.Link;
+    }
+    return MfsUpdateMasterRecord(FileSystem);
+}
@@ -0,0 +1,735 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2017, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * General File System (MFS) Driver
+ *  - Contains the hash-index of large directories, the table maps the hash of a
+ *    record name to the location of the record so lookups do not scan the directory
+ */
+
+//#define __TRACE
+
+#include <ddk/utils.h>
+#include "mfs.h"
+#include <stdlib.h>
+#include <string.h>
+
+static inline size_t
+MfsRecordsInRun(
+    _In_ FileSystemDescriptor_t* fileSystem,
+    _In_ MfsInstance_t*          mfs,
+    _In_ uint32_t                length)
+{
+    return (mfs->SectorsPerBucket * length * fileSystem->Disk.descriptor.SectorSize) / sizeof(FileRecord_t);
+}
+
+/**
+ * Hashes a record name, the names are compared without case for ascii characters
+ * so they are folded before hashing.
+ * @param name [In] The zero terminated utf8 name.
+ * @return     The FNV-1a hash of the name.
+ */
+static uint32_t
+MfsHashName(
+    _In_ const char* name)
+{
+    uint32_t hash = 2166136261U;
+    while (*name) {
+        uint8_t character = (uint8_t)*(name++);
+        if (character >= 'A' && character <= 'Z') {
+            character += 'a' - 'A';
+        }
+        hash = (hash ^ character) * 16777619U;
+    }
+    return hash;
+}
+
+/**
+ * Reads the header of a hash-index into the start of the index buffer.
+ * @return OsNotSupported if the header is not valid.
+ */
+static OsStatus_t
+MfsReadIndexHeader(
+    _In_  FileSystemDescriptor_t*  fileSystem,
+    _In_  MfsInstance_t*           mfs,
+    _In_  uint32_t                 indexBucket,
+    _Out_ DirectoryIndexHeader_t** headerOut)
+{
+    DirectoryIndexHeader_t* header = (DirectoryIndexHeader_t*)mfs->IndexBuffer.buffer;
+    size_t                  sectorsTransferred;
+
+    if (MfsReadSectors(fileSystem, mfs->IndexBuffer.handle, 0, MFS_GETSECTOR(mfs, indexBucket),
+                       1, &sectorsTransferred) != OsSuccess) {
+        ERROR("MfsReadIndexHeader failed to read index at bucket %u", indexBucket);
+        return OsDeviceError;
+    }
+
+    if (header->Magic != MFS_DIRECTORYINDEX_MAGIC || header->SlotCount < MFS_DIRECTORYINDEX_MINSLOTS ||
+        (header->SlotCount & (header->SlotCount - 1))) {
+        WARNING("MfsReadIndexHeader index at bucket %u is not valid", indexBucket);
+        return OsNotSupported;
+    }
+
+    *headerOut = header;
+    return OsSuccess;
+}
+
+static OsStatus_t
+MfsWriteIndexHeader(
+    _In_ FileSystemDescriptor_t* fileSystem,
+    _In_ MfsInstance_t*          mfs,
+    _In_ uint32_t                indexBucket)
+{
+    size_t sectorsTransferred;
+    if (MfsWriteSectors(fileSystem, mfs->IndexBuffer.handle, 0, MFS_GETSECTOR(mfs, indexBucket),
+                        1, &sectorsTransferred) != OsSuccess) {
+        ERROR("MfsWriteIndexHeader failed to write index at bucket %u", indexBucket);
+        return OsDeviceError;
+    }
+    return OsSuccess;
+}
+
+/**
+ * Loads the sector of an index entry into the index buffer after the header. Entries below
+ * SlotCount are the stack of free records, the table slots follow them.
+ * @param loadedSector [In] The sector currently in the buffer, it is updated when another is read.
+ * @param entry        [In] The entry to load.
+ * @param slotOut      [Out] Pointer to the entry in the index buffer.
+ */
+static OsStatus_t
+MfsLoadIndexEntry(
+    _In_    FileSystemDescriptor_t* fileSystem,
+    _In_    MfsInstance_t*          mfs,
+    _In_    uint32_t                indexBucket,
+    _InOut_ uint64_t*               loadedSector,
+    _In_    size_t                  entry,
+    _Out_   DirectoryIndexSlot_t**  slotOut)
+{
+    size_t   sectorSize = fileSystem->Disk.descriptor.SectorSize;
+    size_t   perSector  = sectorSize / sizeof(DirectoryIndexSlot_t);
+    uint64_t sector     = MFS_GETSECTOR(mfs, indexBucket) + 1 + (entry / perSector);
+    size_t   sectorsTransferred;
+
+    if (*loadedSector != sector) {
+        if (MfsReadSectors(fileSystem, mfs->IndexBuffer.handle, sectorSize, sector,
+                           1, &sectorsTransferred) != OsSuccess) {
+            ERROR("MfsLoadIndexEntry failed to read sector %u", LODWORD(sector));
+            return OsDeviceError;
+        }
+        *loadedSector = sector;
+    }
+
+    *slotOut = (DirectoryIndexSlot_t*)((uint8_t*)mfs->IndexBuffer.buffer + sectorSize) + (entry % perSector);
+    return OsSuccess;
+}
+
+static OsStatus_t
+MfsStoreIndexEntry(
+    _In_ FileSystemDescriptor_t* fileSystem,
+    _In_ MfsInstance_t*          mfs,
+    _In_ uint64_t                loadedSector)
+{
+    size_t sectorsTransferred;
+    if (MfsWriteSectors(fileSystem, mfs->IndexBuffer.handle, fileSystem->Disk.descriptor.SectorSize,
+                        loadedSector, 1, &sectorsTransferred) != OsSuccess) {
+        ERROR("MfsStoreIndexEntry failed to write sector %u", LODWORD(loadedSector));
+        return OsDeviceError;
+    }
+    return OsSuccess;
+}
+
+/**
+ * Updates the directory record with the current hash-index of the directory. The root
+ * directory has no record, it is referenced by the master-record instead.
+ */
+static OsStatus_t
+MfsPersistDirectoryIndex(
+    _In_ FileSystemDescriptor_t* fileSystem,
+    _In_ MfsInstance_t*          mfs,
+    _In_ MfsEntry_t*             directory)
+{
+    if (directory->DirectoryBucket == 0) {
+        mfs->MasterRecord.RootHashIndex = directory->HashIndex;
+        mfs->RootRecord.Flags           = (mfs->RootRecord.Flags & ~MFS_FILERECORD_INDEXED) |
+            (directory->NativeFlags & MFS_FILERECORD_INDEXED);
+        mfs->RootRecord.SparseMap       = directory->HashIndex;
+        return MfsUpdateMasterRecord(fileSystem);
+    }
+    return MfsUpdateRecord(fileSystem, directory, MFS_ACTION_UPDATE);
+}
+
+/**
+ * Reads the directory run of an index slot and checks the record it points to, the
+ * index can point to records that were changed without it so the name is verified.
+ * @return OsExists if the record matches <entryName>, otherwise OsDoesNotExist.
+ */
+static OsStatus_t
+MfsMatchIndexedRecord(
+    _In_ FileSystemDescriptor_t* fileSystem,
+    _In_ MfsInstance_t*          mfs,
+    _In_ MfsEntry_t*             directory,
+    _In_ DirectoryIndexSlot_t*   slot,
+    _In_ MString_t*              entryName,
+    _In_ MfsEntry_t*             resultEntry)
+{
+    FileRecord_t* record;
+    MString_t*    filename;
+    int           compareResult;
+    size_t        sectorsTransferred;
+
+    if (!slot->Length || slot->Index >= MfsRecordsInRun(fileSystem, mfs, slot->Length) ||
+        (mfs->SectorsPerBucket * slot->Length * fileSystem->Disk.descriptor.SectorSize) > mfs->TransferBuffer.length) {
+        return OsDoesNotExist;
+    }
+
+    // The entire run is read as the callers expect the directory bucket to be loaded
+    if (MfsReadSectors(fileSystem, mfs->TransferBuffer.handle, 0, MFS_GETSECTOR(mfs, slot->Bucket),
+                       mfs->SectorsPerBucket * slot->Length, &sectorsTransferred) != OsSuccess) {
+        ERROR("MfsMatchIndexedRecord failed to read directory-bucket %u", slot->Bucket);
+        return OsDeviceError;
+    }
+
+    record = (FileRecord_t*)mfs->TransferBuffer.buffer + slot->Index;
+    if (!(record->Flags & MFS_FILERECORD_INUSE)) {
+        return OsDoesNotExist;
+    }
+
+    filename      = MStringCreate((const char*)&record->Name[0], StrUTF8);
+    compareResult = MStringCompare(entryName, filename, 1);
+    MStringDestroy(filename);
+    if (compareResult != MSTRING_FULL_MATCH) {
+        return OsDoesNotExist;
+    }
+
+    MfsFileRecordToVfsFile(fileSystem, record, resultEntry);
+    resultEntry->DirectoryBucket = slot->Bucket;
+    resultEntry->DirectoryLength = slot->Length;
+    resultEntry->DirectoryIndex  = slot->Index;
+    resultEntry->ParentIndex     = directory->HashIndex;
+    return OsExists;
+}
+
+OsStatus_t
+MfsExpandDirectory(
+    _In_ FileSystemDescriptor_t* fileSystem,
+    _In_ uint32_t                currentBucket,
+    _In_ MapRecord_t*            mapRecord)
+{
+    MapRecord_t current;
+    OsStatus_t  osStatus;
+
+    // Allocate bucket, preferably right after the current one
+    osStatus = MfsGetBucketLink(fileSystem, currentBucket, &current);
+    if (osStatus != OsSuccess) {
+        return osStatus;
+    }
+
+    osStatus = MfsAllocateBuckets(fileSystem, currentBucket + current.Length, MFS_DIRECTORYEXPANSION, mapRecord);
+    if (osStatus != OsSuccess) {
+        ERROR("MfsExpandDirectory failed to allocate bucket for expansion");
+        return osStatus;
+    }
+
+    // Update link, the length of the current run stays the same
+    osStatus = MfsSetBucketLink(fileSystem, currentBucket, mapRecord, 0);
+    if (osStatus != OsSuccess) {
+        ERROR("MfsExpandDirectory failed to update bucket-link for expansion");
+        return osStatus;
+    }
+
+    // Zero the bucket
+    osStatus = MfsZeroBucket(fileSystem, mapRecord->Link, mapRecord->Length);
+    if (osStatus != OsSuccess) {
+        ERROR("MfsExpandDirectory failed to zero bucket %u", mapRecord->Link);
+    }
+    return osStatus;
+}
+
+OsStatus_t
+MfsFindIndexedRecord(
+    _In_ FileSystemDescriptor_t* fileSystem,
+    _In_ MfsEntry_t*             directory,
+    _In_ MString_t*              entryName,
+    _In_ int                     allowExpansion,
+    _In_ MfsEntry_t*             resultEntry)
+{
+    MfsInstance_t*          mfs          = (MfsInstance_t*)fileSystem->ExtensionData;
+    uint32_t                hash         = MfsHashName(MStringRaw(entryName));
+    uint64_t                loadedSector = 0;
+    DirectoryIndexHeader_t* header;
+    DirectoryIndexSlot_t*   slot;
+    OsStatus_t              osStatus;
+
+    TRACE("MfsFindIndexedRecord(index=%u, name=%s)", directory->HashIndex, MStringRaw(entryName));
+
+    osStatus = MfsReadIndexHeader(fileSystem, mfs, directory->HashIndex, &header);
+    if (osStatus != OsSuccess) {
+        return osStatus;
+    }
+
+    // Probe from the home slot until an unused slot ends the sequence
+    for (uint32_t i = 0; i < header->SlotCount; i++) {
+        size_t position = header->SlotCount + ((hash + i) & (header->SlotCount - 1));
+
+        osStatus = MfsLoadIndexEntry(fileSystem, mfs, directory->HashIndex, &loadedSector, position, &slot);
+        if (osStatus != OsSuccess) {
+            return osStatus;
+        }
+
+        if (slot->Bucket == 0) {
+            break;
+        }
+
+        if (slot->Bucket != MFS_ENDOFCHAIN && slot->Hash == hash) {
+            DirectoryIndexSlot_t candidate = *slot;
+            osStatus = MfsMatchIndexedRecord(fileSystem, mfs, directory, &candidate, entryName, resultEntry);
+            if (osStatus != OsDoesNotExist) {
+                return osStatus;
+            }
+        }
+    }
+
+    if (!allowExpansion) {
+        return OsDoesNotExist;
+    }
+
+    // Provide a free record, the ones released by deletion are used before
+    // the unused records at the end of the directory
+    if (header->FreeCount) {
+        osStatus = MfsLoadIndexEntry(fileSystem, mfs, directory->HashIndex, &loadedSector,
+                                     header->FreeCount - 1, &slot);
+        if (osStatus != OsSuccess) {
+            return osStatus;
+        }
+
+        resultEntry->DirectoryBucket = slot->Bucket;
+        resultEntry->DirectoryLength = slot->Length;
+        resultEntry->DirectoryIndex  = slot->Index;
+        return OsDoesNotExist;
+    }
+
+    if (header->Tail.Index >= MfsRecordsInRun(fileSystem, mfs, header->Tail.Length)) {
+        MapRecord_t link;
+
+        osStatus = MfsExpandDirectory(fileSystem, header->Tail.Bucket, &link);
+        if (osStatus != OsSuccess) {
+            ERROR("MfsFindIndexedRecord failed to expand directory");
+            return osStatus;
+        }
+
+        header->Tail.Bucket = link.Link;
+        header->Tail.Length = link.Length;
+        header->Tail.Index  = 0;
+        osStatus = MfsWriteIndexHeader(fileSystem, mfs, directory->HashIndex);
+        if (osStatus != OsSuccess) {
+            return osStatus;
+        }
+    }
+
+    resultEntry->DirectoryBucket = header->Tail.Bucket;
+    resultEntry->DirectoryLength = header->Tail.Length;
+    resultEntry->DirectoryIndex  = header->Tail.Index;
+    return OsDoesNotExist;
+}
+
+OsStatus_t
+MfsInsertIndexedRecord(
+    _In_ FileSystemDescriptor_t* fileSystem,
+    _In_ MfsEntry_t*             directory,
+    _In_ MfsEntry_t*             entry)
+{
+    MfsInstance_t*          mfs          = (MfsInstance_t*)fileSystem->ExtensionData;
+    uint32_t                hash         = MfsHashName(MStringRaw(entry->Base.Name));
+    uint64_t                loadedSector = 0;
+    DirectoryIndexHeader_t* header;
+    DirectoryIndexSlot_t*   slot = NULL;
+    OsStatus_t              osStatus;
+
+    if (!directory->HashIndex) {
+        return OsSuccess;
+    }
+
+    osStatus = MfsReadIndexHeader(fileSystem, mfs, directory->HashIndex, &header);
+    if (osStatus != OsSuccess) {
+        // Lookups do not use an index that is not valid
+        return osStatus == OsNotSupported ? OsSuccess : osStatus;
+    }
+
+    // Grow the table before it gets too full, the new table is built from the
+    // records of the directory so it already contains the new record
+    if ((header->Used + header->Removed + 1) * 4 > header->SlotCount * 3) {
+        if (MfsBuildDirectoryIndex(fileSystem, directory) == OsSuccess) {
+            entry->ParentIndex = directory->HashIndex;
+            return OsSuccess;
+        }
+
+        osStatus = MfsReadIndexHeader(fileSystem, mfs, directory->HashIndex, &header);
+        if (osStatus != OsSuccess) {
+            return osStatus == OsNotSupported ? OsSuccess : osStatus;
+        }
+    }
+
+    for (uint32_t i = 0; i < header->SlotCount; i++) {
+        size_t position = header->SlotCount + ((hash + i) & (header->SlotCount - 1));
+
+        osStatus = MfsLoadIndexEntry(fileSystem, mfs, directory->HashIndex, &loadedSector, position, &slot);
+        if (osStatus != OsSuccess) {
+            return osStatus;
+        }
+
+        if (slot->Bucket == 0 || slot->Bucket == MFS_ENDOFCHAIN) {
+            break;
+        }
+        slot = NULL;
+    }
+
+    // The table is full and could not be rebuilt, the directory is scanned instead
+    if (!slot) {
+        WARNING("MfsInsertIndexedRecord index at bucket %u is full, dropping it", directory->HashIndex);
+        osStatus = MfsFreeDirectoryIndex(fileSystem, directory);
+        if (osStatus == OsSuccess) {
+            osStatus = MfsPersistDirectoryIndex(fileSystem, mfs, directory);
+        }
+        return osStatus;
+    }
+
+    if (slot->Bucket == MFS_ENDOFCHAIN) {
+        header->Removed--;
+    }
+    slot->Hash   = hash;
+    slot->Bucket = entry->DirectoryBucket;
+    slot->Length = entry->DirectoryLength;
+    slot->Index  = (uint32_t)entry->DirectoryIndex;
+    osStatus = MfsStoreIndexEntry(fileSystem, mfs, loadedSector);
+    if (osStatus != OsSuccess) {
+        return osStatus;
+    }
+    header->Used++;
+
+    // Consume the free record that was provided by the lookup
+    if (header->FreeCount) {
+        osStatus = MfsLoadIndexEntry(fileSystem, mfs, directory->HashIndex, &loadedSector,
+                                     header->FreeCount - 1, &slot);
+        if (osStatus != OsSuccess) {
+            return osStatus;
+        }
+
+        if (slot->Bucket == entry->DirectoryBucket && slot->Index == entry->DirectoryIndex) {
+            header->FreeCount--;
+        }
+    }
+    else if (header->Tail.Bucket == entry->DirectoryBucket && header->Tail.Index == entry->DirectoryIndex) {
+        header->Tail.Index++;
+    }
+
+    entry->ParentIndex = directory->HashIndex;
+    return MfsWriteIndexHeader(fileSystem, mfs, directory->HashIndex);
+}
+
+OsStatus_t
+MfsRemoveIndexedRecord(
+    _In_ FileSystemDescriptor_t* fileSystem,
+    _In_ MfsEntry_t*             entry)
+{
+    MfsInstance_t*          mfs          = (MfsInstance_t*)fileSystem->ExtensionData;
+    uint64_t                loadedSector = 0;
+    DirectoryIndexHeader_t* header;
+    DirectoryIndexSlot_t*   slot;
+    DirectoryIndexSlot_t    location;
+    uint32_t                hash;
+    OsStatus_t              osStatus;
+
+    if (!entry->ParentIndex || !entry->Base.Name) {
+        return OsSuccess;
+    }
+
+    osStatus = MfsReadIndexHeader(fileSystem, mfs, entry->ParentIndex, &header);
+    if (osStatus != OsSuccess) {
+        return osStatus == OsNotSupported ? OsSuccess : osStatus;
+    }
+
+    hash = MfsHashName(MStringRaw(entry->Base.Name));
+    for (uint32_t i = 0; i < header->SlotCount; i++) {
+        size_t position = header->SlotCount + ((hash + i) & (header->SlotCount - 1));
+
+        osStatus = MfsLoadIndexEntry(fileSystem, mfs, entry->ParentIndex, &loadedSector, position, &slot);
+        if (osStatus != OsSuccess) {
+            return osStatus;
+        }
+
+        // The index was rebuilt since the entry was located if it is not there, the
+        // slot of the record is then cleaned up by the next rebuild
+        if (slot->Bucket == 0) {
+            return OsSuccess;
+        }
+
+        if (slot->Bucket == entry->DirectoryBucket && slot->Index == entry->DirectoryIndex) {
+            break;
+        }
+        slot = NULL;
+    }
+
+    if (!slot) {
+        return OsSuccess;
+    }
+
+    location     = *slot;
+    slot->Bucket = MFS_ENDOFCHAIN;
+    osStatus = MfsStoreIndexEntry(fileSystem, mfs, loadedSector);
+    if (osStatus != OsSuccess) {
+        return osStatus;
+    }
+    header->Used--;
+    header->Removed++;
+
+    if (header->FreeCount < header->SlotCount) {
+        osStatus = MfsLoadIndexEntry(fileSystem, mfs, entry->ParentIndex, &loadedSector,
+                                     header->FreeCount, &slot);
+        if (osStatus != OsSuccess) {
+            return osStatus;
+        }
+
+        *slot = location;
+        osStatus = MfsStoreIndexEntry(fileSystem, mfs, loadedSector);
+        if (osStatus != OsSuccess) {
+            return osStatus;
+        }
+        header->FreeCount++;
+    }
+    return MfsWriteIndexHeader(fileSystem, mfs, entry->ParentIndex);
+}
+
+static OsStatus_t
+MfsAppendIndexSlot(
+    _InOut_ DirectoryIndexSlot_t** slots,
+    _InOut_ size_t*                count,
+    _InOut_ size_t*                capacity,
+    _In_    DirectoryIndexSlot_t*  slot)
+{
+    if (*count == *capacity) {
+        size_t                newCapacity = *capacity ? (*capacity * 2) : 64;
+        DirectoryIndexSlot_t* newSlots    = realloc(*slots, newCapacity * sizeof(DirectoryIndexSlot_t));
+        if (!newSlots) {
+            return OsOutOfMemory;
+        }
+        *slots    = newSlots;
+        *capacity = newCapacity;
+    }
+    (*slots)[(*count)++] = *slot;
+    return OsSuccess;
+}
+
+/**
+ * Collects the records of a directory, the records in use with the hash of their name
+ * and the free records except the unused ones at the end of the directory.
+ */
+static OsStatus_t
+MfsCollectDirectoryRecords(
+    _In_  FileSystemDescriptor_t* fileSystem,
+    _In_  MfsInstance_t*          mfs,
+    _In_  MfsEntry_t*             directory,
+    _Out_ DirectoryIndexSlot_t**  records,
+    _Out_ size_t*                 recordCount,
+    _Out_ DirectoryIndexSlot_t**  frees,
+    _Out_ size_t*                 freeCount,
+    _Out_ DirectoryIndexSlot_t*   tail)
+{
+    uint32_t   currentBucket  = directory->StartBucket;
+    size_t     recordCapacity = 0;
+    size_t     freeCapacity   = 0;
+    OsStatus_t osStatus       = OsSuccess;
+
+    *records     = NULL;
+    *recordCount = 0;
+    *frees       = NULL;
+    *freeCount   = 0;
+    memset(tail, 0, sizeof(DirectoryIndexSlot_t));
+
+    while (currentBucket != MFS_ENDOFCHAIN && osStatus == OsSuccess) {
+        FileRecord_t* record;
+        MapRecord_t   link;
+        size_t        sectorsTransferred;
+
+        osStatus = MfsGetBucketLink(fileSystem, currentBucket, &link);
+        if (osStatus != OsSuccess || !link.Length ||
+            (mfs->SectorsPerBucket * link.Length * fileSystem->Disk.descriptor.SectorSize) > mfs->TransferBuffer.length) {
+            ERROR("MfsCollectDirectoryRecords invalid directory-bucket %u", currentBucket);
+            osStatus = OsError;
+            break;
+        }
+
+        if (MfsReadSectors(fileSystem, mfs->TransferBuffer.handle, 0, MFS_GETSECTOR(mfs, currentBucket),
+                           mfs->SectorsPerBucket * link.Length, &sectorsTransferred) != OsSuccess) {
+            ERROR("MfsCollectDirectoryRecords failed to read directory-bucket %u", currentBucket);
+            osStatus = OsDeviceError;
+            break;
+        }
+
+        tail->Bucket = currentBucket;
+        tail->Length = link.Length;
+        tail->Index  = 0;
+
+        record = (FileRecord_t*)mfs->TransferBuffer.buffer;
+        for (size_t i = 0; i < MfsRecordsInRun(fileSystem, mfs, link.Length) && osStatus == OsSuccess; i++, record++) {
+            DirectoryIndexSlot_t slot = { 0, currentBucket, link.Length, (uint32_t)i };
+            if (record->Flags & MFS_FILERECORD_INUSE) {
+                slot.Hash   = MfsHashName((const char*)&record->Name[0]);
+                tail->Index = (uint32_t)i + 1;
+                osStatus    = MfsAppendIndexSlot(records, recordCount, &recordCapacity, &slot);
+            }
+            else {
+                osStatus = MfsAppendIndexSlot(frees, freeCount, &freeCapacity, &slot);
+            }
+        }
+        currentBucket = link.Link;
+    }
+
+    // The free records after the last one in use are provided through the tail
+    while (*freeCount && (*frees)[*freeCount - 1].Bucket == tail->Bucket &&
+           (*frees)[*freeCount - 1].Index >= tail->Index) {
+        (*freeCount)--;
+    }
+    return osStatus;
+}
+
+OsStatus_t
+MfsBuildDirectoryIndex(
+    _In_ FileSystemDescriptor_t* fileSystem,
+    _In_ MfsEntry_t*             directory)
+{
+    MfsInstance_t*          mfs        = (MfsInstance_t*)fileSystem->ExtensionData;
+    size_t                  sectorSize = fileSystem->Disk.descriptor.SectorSize;
+    size_t                  bucketSize = mfs->SectorsPerBucket * sectorSize;
+    DirectoryIndexSlot_t*   records    = NULL;
+    DirectoryIndexSlot_t*   frees      = NULL;
+    DirectoryIndexSlot_t*   table;
+    DirectoryIndexHeader_t* header;
+    DirectoryIndexSlot_t    tail;
+    MapRecord_t             run;
+    MapRecord_t             previous;
+    uint8_t*                image      = NULL;
+    size_t                  recordCount;
+    size_t                  freeCount;
+    size_t                  bucketCount;
+    uint32_t                slotCount  = MFS_DIRECTORYINDEX_MINSLOTS;
+    uint32_t                oldIndex   = directory->HashIndex;
+    OsStatus_t              osStatus;
+
+    TRACE("MfsBuildDirectoryIndex(directory=%u, index=%u)", directory->StartBucket, directory->HashIndex);
+
+    osStatus = MfsCollectDirectoryRecords(fileSystem, mfs, directory, &records, &recordCount,
+                                          &frees, &freeCount, &tail);
+    if (osStatus != OsSuccess) {
+        goto exit;
+    }
+
+    // Keep the table at most half full after it is built
+    while (slotCount < recordCount * 2) {
+        slotCount <<= 1;
+    }
+    freeCount   = MIN(freeCount, slotCount);
+    bucketCount = DIVUP((sectorSize + (2 * slotCount * sizeof(DirectoryIndexSlot_t))), bucketSize);
+
+    image = calloc(bucketCount, bucketSize);
+    if (!image) {
+        osStatus = OsOutOfMemory;
+        goto exit;
+    }
+
+    header            = (DirectoryIndexHeader_t*)image;
+    header->Magic     = MFS_DIRECTORYINDEX_MAGIC;
+    header->SlotCount = slotCount;
+    header->Used      = (uint32_t)recordCount;
+    header->FreeCount = (uint32_t)freeCount;
+    header->Tail      = tail;
+
+    table = (DirectoryIndexSlot_t*)(image + sectorSize);
+    memcpy(table, frees, freeCount * sizeof(DirectoryIndexSlot_t));
+    table += slotCount;
+    for (size_t i = 0; i < recordCount; i++) {
+        uint32_t position = records[i].Hash & (slotCount - 1);
+        while (table[position].Bucket != 0) {
+            position = (position + 1) & (slotCount - 1);
+        }
+        table[position] = records[i];
+    }
+
+    // The index must be contiguous as slots are addressed by their position
+    osStatus = MfsAllocateBuckets(fileSystem, tail.Bucket + tail.Length, bucketCount, &run);
+    if (osStatus != OsSuccess) {
+        goto exit;
+    }
+
+    if (run.Length != bucketCount) {
+        WARNING("MfsBuildDirectoryIndex no contiguous run of %u buckets", LODWORD(bucketCount));
+        MfsFreeBuckets(fileSystem, run.Link, run.Length);
+        osStatus = OsError;
+        goto exit;
+    }
+
+    for (size_t i = 0; i < bucketCount; i++) {
+        size_t sectorsTransferred;
+        memcpy(mfs->IndexBuffer.buffer, image + (i * bucketSize), bucketSize);
+        if (MfsWriteSectors(fileSystem, mfs->IndexBuffer.handle, 0, MFS_GETSECTOR(mfs, (run.Link + i)),
+                            mfs->SectorsPerBucket, &sectorsTransferred) != OsSuccess) {
+            ERROR("MfsBuildDirectoryIndex failed to write bucket %u", run.Link + i);
+            MfsFreeBuckets(fileSystem, run.Link, run.Length);
+            osStatus = OsDeviceError;
+            goto exit;
+        }
+    }
+
+    directory->HashIndex    = run.Link;
+    directory->NativeFlags |= MFS_FILERECORD_INDEXED;
+    osStatus = MfsPersistDirectoryIndex(fileSystem, mfs, directory);
+    if (osStatus != OsSuccess) {
+        goto exit;
+    }
+
+    if (oldIndex && MfsGetBucketLink(fileSystem, oldIndex, &previous) == OsSuccess) {
+        osStatus = MfsFreeBuckets(fileSystem, oldIndex, previous.Length);
+    }
+
+exit:
+    free(image);
+    free(records);
+    free(frees);
+    return osStatus;
+}
+
+OsStatus_t
+MfsFreeDirectoryIndex(
+    _In_ FileSystemDescriptor_t* fileSystem,
+    _In_ MfsEntry_t*             directory)
+{
+    MapRecord_t link;
+    OsStatus_t  osStatus;
+
+    if (!directory->HashIndex) {
+        return OsSuccess;
+    }
+
+    osStatus = MfsGetBucketLink(fileSystem, directory->HashIndex, &link);
+    if (osStatus == OsSuccess) {
+        osStatus = MfsFreeBuckets(fileSystem, directory->HashIndex, link.Length);
+    }
+
+    directory->HashIndex    = 0;
+    directory->NativeFlags &= ~MFS_FILERECORD_INDEXED;
+    return osStatus;
+}
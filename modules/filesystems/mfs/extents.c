@@ -0,0 +1,142 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * General File System (MFS) Driver
+ *  - Extent index of the bucket chain of files. Finding the bucket of a position
+ *    otherwise requires following the chain from the start of the file.
+ */
+//#define __TRACE
+
+#include <ddk/utils.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mfs.h"
+
+#define MFS_EXTENTS_INITIAL 16
+
+static OsStatus_t
+MfsAppendExtent(
+    _In_ MfsEntry_t* Entry,
+    _In_ uint64_t    Offset,
+    _In_ uint32_t    Bucket,
+    _In_ uint32_t    Length)
+{
+    if (Entry->ExtentCount == Entry->ExtentCapacity) {
+        size_t       Capacity = Entry->ExtentCapacity ? (Entry->ExtentCapacity * 2) : MFS_EXTENTS_INITIAL;
+        MfsExtent_t* Extents  = (MfsExtent_t*)realloc(Entry->Extents, Capacity * sizeof(MfsExtent_t));
+        if (!Extents) {
+            return OsOutOfMemory;
+        }
+        Entry->Extents        = Extents;
+        Entry->ExtentCapacity = Capacity;
+    }
+
+    Entry->Extents[Entry->ExtentCount].Offset = Offset;
+    Entry->Extents[Entry->ExtentCount].Bucket = Bucket;
+    Entry->Extents[Entry->ExtentCount].Length = Length;
+    Entry->ExtentCount++;
+    return OsSuccess;
+}
+
+OsStatus_t
+MfsLocateExtent(
+    _In_  FileSystemDescriptor_t* FileSystem,
+    _In_  MfsEntry_t*             Entry,
+    _In_  uint64_t                Position,
+    _Out_ MfsExtent_t*            Extent)
+{
+    MfsInstance_t* Mfs             = (MfsInstance_t*)FileSystem->ExtensionData;
+    size_t         BucketSizeBytes = Mfs->SectorsPerBucket * FileSystem->Disk.descriptor.SectorSize;
+    MfsExtent_t*   Last;
+    MapRecord_t    Link;
+    size_t         Low, High;
+    OsStatus_t     Status;
+
+    TRACE("MfsLocateExtent(Position 0x%x)", LODWORD(Position));
+
+    if (Entry->StartBucket == MFS_ENDOFCHAIN) {
+        Extent->Offset = 0;
+        Extent->Bucket = MFS_ENDOFCHAIN;
+        Extent->Length = 0;
+        return OsDoesNotExist;
+    }
+
+    if (!Entry->ExtentCount) {
+        Status = MfsAppendExtent(Entry, 0, Entry->StartBucket, Entry->StartLength);
+        if (Status != OsSuccess) {
+            return Status;
+        }
+    }
+
+    // Extend the index until it covers the position, each link is only
+    // followed once as long as the chain stays the same
+    Last = &Entry->Extents[Entry->ExtentCount - 1];
+    while (Position >= Last->Offset + ((uint64_t)Last->Length * BucketSizeBytes)) {
+        uint64_t Offset = Last->Offset + ((uint64_t)Last->Length * BucketSizeBytes);
+
+        if (MfsGetBucketLink(FileSystem, Last->Bucket, &Link) != OsSuccess) {
+            ERROR("Failed to get link for bucket %u", Last->Bucket);
+            return OsDeviceError;
+        }
+
+        if (Link.Link == MFS_ENDOFCHAIN) {
+            memcpy(Extent, Last, sizeof(MfsExtent_t));
+            return OsDoesNotExist;
+        }
+
+        Status = MfsAppendExtent(Entry, Offset, Link.Link, 0);
+        if (Status != OsSuccess) {
+            return Status;
+        }
+        Last = &Entry->Extents[Entry->ExtentCount - 1];
+
+        if (MfsGetBucketLink(FileSystem, Last->Bucket, &Link) != OsSuccess) {
+            ERROR("Failed to get length for bucket %u", Last->Bucket);
+            Entry->ExtentCount--;
+            return OsDeviceError;
+        }
+        Last->Length = Link.Length;
+    }
+
+    // Find the last extent that starts at or before the position
+    Low  = 0;
+    High = Entry->ExtentCount - 1;
+    while (Low < High) {
+        size_t Middle = Low + ((High - Low + 1) / 2);
+        if (Entry->Extents[Middle].Offset <= Position) {
+            Low = Middle;
+        }
+        else {
+            High = Middle - 1;
+        }
+    }
+
+    memcpy(Extent, &Entry->Extents[Low], sizeof(MfsExtent_t));
+    return OsSuccess;
+}
+
+void
+MfsInvalidateExtents(
+    _In_ MfsEntry_t* Entry)
+{
+    free(Entry->Extents);
+    Entry->Extents        = NULL;
+    Entry->ExtentCount    = 0;
+    Entry->ExtentCapacity = 0;
+}
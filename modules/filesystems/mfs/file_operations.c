@@ -28,6 +28,64 @@
 #include <string.h>
 #include "mfs.h"
 
+// Reads the batched runs that go directly into the user buffer, the runs
+// were accounted as read when queued so anything missing is subtracted again
+static OsStatus_t
+FlushDirectReads(
+    _In_    FileSystemDescriptor_t*   FileSystem,
+    _In_    StorageTransferSegment_t* Segments,
+    _InOut_ size_t*                   SegmentCount,
+    _InOut_ uint64_t*                 Position,
+    _InOut_ size_t*                   UnitsRead)
+{
+    size_t     SectorsRequested = 0;
+    size_t     SectorsRead      = 0;
+    size_t     BytesUnread;
+    OsStatus_t Result;
+    size_t     i;
+
+    if (*SegmentCount == 0) {
+        return OsSuccess;
+    }
+
+    for (i = 0; i < *SegmentCount; i++) {
+        SectorsRequested += Segments[i].SectorCount;
+    }
+
+    Result        = MfsTransferSegments(FileSystem, __STORAGE_OPERATION_READ, Segments, *SegmentCount, &SectorsRead);
+    *SegmentCount = 0;
+    if (Result != OsSuccess || SectorsRead != SectorsRequested) {
+        ERROR("Failed to read sectors, read %u of %u", SectorsRead, SectorsRequested);
+        BytesUnread = (SectorsRequested - MIN(SectorsRead, SectorsRequested)) * FileSystem->Disk.descriptor.SectorSize;
+        *UnitsRead -= BytesUnread;
+        *Position  -= BytesUnread;
+        return OsDeviceError;
+    }
+    return OsSuccess;
+}
+
+// Moves the handle to the bucket run that follows the current one
+static OsStatus_t
+SwitchToNextExtent(
+    _In_ FileSystemDescriptor_t* FileSystem,
+    _In_ MfsEntryHandle_t*       Handle,
+    _In_ size_t                  BucketSizeBytes)
+{
+    uint64_t    Position = Handle->BucketByteBoundary + ((uint64_t)Handle->DataBucketLength * BucketSizeBytes);
+    MfsExtent_t Extent;
+    OsStatus_t  Status;
+
+    Status = MfsLocateExtent(FileSystem, (MfsEntry_t*)Handle->Base.Entry, Position, &Extent);
+    if (Status != OsSuccess) {
+        return Status;
+    }
+
+    Handle->DataBucketPosition = Extent.Bucket;
+    Handle->DataBucketLength   = Extent.Length;
+    Handle->BucketByteBoundary = Extent.Offset;
+    return OsSuccess;
+}
+
 OsStatus_t
 FsReadFromFile(
     _In_  FileSystemDescriptor_t* FileSystem,
@@ -44,6 +102,9 @@ FsReadFromFile(
     uint64_t       Position        = Handle->Base.Position;
     size_t         BucketSizeBytes = Mfs->SectorsPerBucket * FileSystem->Disk.descriptor.SectorSize;
     size_t         BytesToRead     = UnitCount;
+    size_t         SegmentCount    = 0;
+
+    StorageTransferSegment_t Segments[MFS_READSEGMENTS];
 
     TRACE("[mfs] [read_file] id 0x%x, position %u, length %u",
         Handle->Base.Id, LODWORD(Handle->Base.Position), LODWORD(UnitCount));
@@ -147,7 +208,23 @@ FsReadFromFile(
             TRACE(" > sector %u (b-start %u, b-index %u), num-sectors %u, sector-byte-offset %u, bytecount %u",
                 LODWORD(Sector), LODWORD(Sector) - SectorIndex, SectorIndex, SectorCount, LODWORD(SectorOffset), ByteCount);
     
-            if (MfsReadSectors(FileSystem, SelectedHandle, SelectedOffset, 
+            // Direct reads don't need the data before the next iteration, so they are
+            // collected and read with a single request per batch
+            if (SelectedHandle == BufferHandle) {
+                if (SegmentCount == MFS_READSEGMENTS) {
+                    Result = FlushDirectReads(FileSystem, &Segments[0], &SegmentCount, &Position, UnitsRead);
+                    if (Result != OsSuccess) {
+                        break;
+                    }
+                }
+                Segments[SegmentCount].Sector       = Sector;
+                Segments[SegmentCount].BufferHandle = BufferHandle;
+                Segments[SegmentCount].BufferOffset = SelectedOffset;
+                Segments[SegmentCount].SectorCount  = SectorCount;
+                SegmentCount++;
+                SectorsRead = SectorCount;
+            }
+            else if (MfsReadSectors(FileSystem, SelectedHandle, SelectedOffset, 
                     Sector, SectorCount, &SectorsRead) != OsSuccess) {
                 ERROR("Failed to read sector");
                 Result = OsDeviceError;
@@ -175,7 +252,7 @@ FsReadFromFile(
         // Do we need to switch bucket?
         // We do if the position we have read to equals end of bucket
         if (Position == (Handle->BucketByteBoundary + (Handle->DataBucketLength * BucketSizeBytes))) {
-            Result = MfsSwitchToNextBucketLink(FileSystem, Handle, BucketSizeBytes);
+            Result = SwitchToNextExtent(FileSystem, Handle, BucketSizeBytes);
             if (Result != OsSuccess) {
                 if (Result == OsDoesNotExist) {
                     Result = OsSuccess;
@@ -185,6 +262,24 @@ FsReadFromFile(
         }
     }
 
+    if (SegmentCount) {
+        OsStatus_t FlushResult = FlushDirectReads(FileSystem, &Segments[0], &SegmentCount, &Position, UnitsRead);
+        if (Result == OsSuccess) {
+            Result = FlushResult;
+        }
+    }
+
+    // A failed batch may have been queued from bucket runs past the position that
+    // was actually read, move the handle back to the run it ended in
+    if (Result != OsSuccess && Position < Handle->BucketByteBoundary) {
+        MfsExtent_t Extent;
+        if (MfsLocateExtent(FileSystem, Entry, Position, &Extent) == OsSuccess) {
+            Handle->DataBucketPosition = Extent.Bucket;
+            Handle->DataBucketLength   = Extent.Length;
+            Handle->BucketByteBoundary = Extent.Offset;
+        }
+    }
+
     // if (update_when_accessed) @todo
     // entry->accessed = now
     // entry->action_on_close = update
@@ -324,29 +419,13 @@ FsWriteToFile(
         // Do we need to switch bucket?
         // We do if the position we have read to equals end of bucket
         if (Position == (Handle->BucketByteBoundary + (Handle->DataBucketLength * BucketSizeBytes))) {
-            MapRecord_t Link;
-
-            // We have to lookup the link for current bucket
-            if (MfsGetBucketLink(FileSystem, Handle->DataBucketPosition, &Link) != OsSuccess) {
-                ERROR("Failed to get link for bucket %u", Handle->DataBucketPosition);
-                Result = OsDeviceError;
-                break;
-            }
-
-            // Check for EOL
-            if (Link.Link == MFS_ENDOFCHAIN) {
-                break;
-            }
-            Handle->DataBucketPosition = Link.Link;
-
-            // Lookup length of link
-            if (MfsGetBucketLink(FileSystem, Handle->DataBucketPosition, &Link) != OsSuccess) {
-                ERROR("Failed to get length for bucket %u", Handle->DataBucketPosition);
-                Result = OsDeviceError;
+            Result = SwitchToNextExtent(FileSystem, Handle, BucketSizeBytes);
+            if (Result != OsSuccess) {
+                if (Result == OsDoesNotExist) {
+                    Result = OsSuccess;
+                }
                 break;
             }
-            Handle->DataBucketLength    = Link.Length;
-            Handle->BucketByteBoundary  += (Link.Length * BucketSizeBytes);
         }
     }
 
@@ -361,91 +440,39 @@ FsSeekInFile(
     _In_ MfsEntryHandle_t*       Handle,
     _In_ uint64_t                AbsolutePosition)
 {
-    MfsInstance_t* Mfs              = (MfsInstance_t*)FileSystem->ExtensionData;
-    MfsEntry_t*    Entry            = (MfsEntry_t*)Handle->Base.Entry;
-    size_t         InitialBucketMax = 0;
-    int            ConstantLoop     = 1;
+    MfsInstance_t* Mfs             = (MfsInstance_t*)FileSystem->ExtensionData;
+    MfsEntry_t*    Entry           = (MfsEntry_t*)Handle->Base.Entry;
+    size_t         BucketSizeBytes = Mfs->SectorsPerBucket * FileSystem->Disk.descriptor.SectorSize;
+    uint64_t       OldBucketLow, OldBucketHigh;
+    MfsExtent_t    Extent;
+    OsStatus_t     Status;
 
     TRACE("FsSeekInFile(Id 0x%x, Position 0x%x)", Handle->Base.Id, LODWORD(AbsolutePosition));
 
-    // Step 1, if the new position is in
-    // initial bucket, we need to do no actual seeking
-    InitialBucketMax = (Entry->StartLength * (Mfs->SectorsPerBucket * FileSystem->Disk.descriptor.SectorSize));
-    if (AbsolutePosition < InitialBucketMax) {
-        Handle->DataBucketPosition   = Entry->StartBucket;
-        Handle->DataBucketLength     = Entry->StartLength;
-        Handle->BucketByteBoundary   = 0;
-    }
-    else {
-        // Step 2. We might still get out easy
-        // if we are setting a new position that's 
-        // within the current bucket
-        uint64_t OldBucketLow, OldBucketHigh;
-
-        // Calculate bucket boundaries
-        OldBucketLow  = Handle->BucketByteBoundary;
-        OldBucketHigh = OldBucketLow + (Handle->DataBucketLength 
-            * (Mfs->SectorsPerBucket * FileSystem->Disk.descriptor.SectorSize));
-
-        // If we are seeking inside the same bucket no need
-        // to do anything else
-        if (AbsolutePosition >= OldBucketLow && AbsolutePosition < OldBucketHigh) {
-            // Same bucket
-        }
-        else {
-            // We need to figure out which bucket the position is in
-            uint64_t    PositionBoundLow  = 0;
-            uint64_t    PositionBoundHigh = InitialBucketMax;
-            MapRecord_t Link;
-
-            // Start at the file-bucket
-            uint32_t BucketPtr    = Entry->StartBucket;
-            uint32_t BucketLength = Entry->StartLength;
-            while (ConstantLoop) {
-                // Check if we reached correct bucket
-                TRACE("[mfs] [seek] are we there yeti? [%llu-%llu]/%llu",
-                    PositionBoundLow, PositionBoundLow + PositionBoundHigh, AbsolutePosition);
-                
-                // Check termination conditions
-                if (AbsolutePosition >= PositionBoundLow && AbsolutePosition < (PositionBoundLow + PositionBoundHigh)) {
-                    break;
-                }
-
-                // Get link
-                if (MfsGetBucketLink(FileSystem, BucketPtr, &Link) != OsSuccess) {
-                    ERROR("Failed to get link for bucket %u", BucketPtr);
-                    return OsDeviceError;
-                }
-
-                // If we do reach end of chain, then we handle this case by setting
-                // the pointer to the wished destination, and store the last indices
-                if (Link.Link == MFS_ENDOFCHAIN) {
-                    WARNING("[mfs] [seek] seeking beyond eof [%llu-%llu]/%llu",
-                        PositionBoundLow, PositionBoundLow + PositionBoundHigh, AbsolutePosition);
-                    break;
-                }
-                
-                BucketPtr = Link.Link;
-
-                // Get length of link
-                if (MfsGetBucketLink(FileSystem, BucketPtr, &Link) != OsSuccess) {
-                    ERROR("Failed to get length for bucket %u", BucketPtr);
-                    return OsDeviceError;
-                }
-                BucketLength = Link.Length;
-
-                // Calculate bounds for the new bucket
-                PositionBoundLow += PositionBoundHigh;
-                PositionBoundHigh = (BucketLength * (Mfs->SectorsPerBucket * FileSystem->Disk.descriptor.SectorSize));
+    // We might get out easy if we are setting a new position that's
+    // within the current bucket
+    OldBucketLow  = Handle->BucketByteBoundary;
+    OldBucketHigh = OldBucketLow + ((uint64_t)Handle->DataBucketLength * BucketSizeBytes);
+    if (AbsolutePosition < OldBucketLow || AbsolutePosition >= OldBucketHigh) {
+        // Otherwise look up the bucket in the extent index of the file. Seeking beyond
+        // the end of the chain leaves us at the last bucket like before
+        Status = MfsLocateExtent(FileSystem, Entry, AbsolutePosition, &Extent);
+        if (Status == OsDoesNotExist) {
+            if (Extent.Bucket != MFS_ENDOFCHAIN) {
+                WARNING("[mfs] [seek] seeking beyond eof [%llu-%llu]/%llu", Extent.Offset,
+                    Extent.Offset + ((uint64_t)Extent.Length * BucketSizeBytes), AbsolutePosition);
             }
-
-            // Update handle positioning
-            Handle->DataBucketPosition = BucketPtr;
-            Handle->DataBucketLength   = BucketLength;
-            Handle->BucketByteBoundary = PositionBoundLow;
         }
+        else if (Status != OsSuccess) {
+            return Status;
+        }
+
+        // Update handle positioning
+        Handle->DataBucketPosition = Extent.Bucket;
+        Handle->DataBucketLength   = Extent.Length;
+        Handle->BucketByteBoundary = Extent.Offset;
     }
-    
+
     // Update the new position since everything went ok
     Handle->Base.Position = AbsolutePosition;
     return OsSuccess;
@@ -467,6 +494,7 @@ FsChangeFileSize(
         // Free all buckets allocated, if any are allocated
         if (Entry->StartBucket != MFS_ENDOFCHAIN) {
             OsStatus_t Status = MfsFreeBuckets(FileSystem, Entry->StartBucket, Entry->StartLength);
+            MfsInvalidateExtents(Entry);
             if (Status != OsSuccess) {
                 ERROR("Failed to free the buckets at start 0x%x, length 0x%x. when truncating",
                     Entry->StartBucket, Entry->StartLength);
@@ -57,7 +57,7 @@ FsOpenEntry(
     }
     
     memset(Entry, 0, sizeof(MfsEntry_t));
-    Result     = MfsLocateRecord(FileSystem, Mfs->MasterRecord.RootIndex, Entry, Path);
+    Result     = MfsLocateRecord(FileSystem, Entry, Path);
     *BaseEntry = (FileSystemEntry_t*)Entry;
     if (Result != OsSuccess) {
         free(Entry);
@@ -72,7 +72,6 @@ FsCreatePath(
     _In_  unsigned int            Options,
     _Out_ FileSystemEntry_t**     BaseEntry)
 {
-    MfsInstance_t* mfs;
     OsStatus_t     osStatus;
     MfsEntry_t*    entry;
 
@@ -80,8 +79,7 @@ FsCreatePath(
         return OsInvalidParameters;
     }
 
-    mfs      = (MfsInstance_t*)FileSystem->ExtensionData;
-    osStatus = MfsCreateRecord(FileSystem, Options, mfs->MasterRecord.RootIndex, Path, &entry);
+    osStatus = MfsCreateRecord(FileSystem, Options, Path, &entry);
     if (osStatus == OsSuccess) {
         *BaseEntry = &entry->Base;
     }
@@ -100,6 +98,7 @@ FsCloseEntry(
     if (Entry->ActionOnClose) {
         Code = MfsUpdateRecord(FileSystem, Entry, Entry->ActionOnClose);
     }
+    MfsInvalidateExtents(Entry);
     if (BaseEntry->Name != NULL) { MStringDestroy(BaseEntry->Name); }
     if (BaseEntry->Path != NULL) { MStringDestroy(BaseEntry->Path); }
     free(Entry);
@@ -117,6 +116,10 @@ FsDeleteEntry(
     OsStatus_t        Status;
 
     Status = MfsFreeBuckets(FileSystem, Entry->StartBucket, Entry->StartLength);
+    MfsInvalidateExtents(Entry);
+    if (Status == OsSuccess) {
+        Status = MfsFreeDirectoryIndex(FileSystem, Entry);
+    }
     if (Status != OsSuccess) {
         ERROR("Failed to free the buckets at start 0x%x, length 0x%x",
             Entry->StartBucket, Entry->StartLength);
@@ -124,6 +127,9 @@ FsDeleteEntry(
     }
 
     Code = MfsUpdateRecord(FileSystem, Entry, MFS_ACTION_DELETE);
+    if (Code == OsSuccess) {
+        Code = MfsRemoveIndexedRecord(FileSystem, Entry);
+    }
     if (Code == OsSuccess) {
         Code = FsCloseHandle(FileSystem, BaseHandle);
         if (Code == OsSuccess) {
@@ -237,7 +243,9 @@ FsDestroy(
     // Which kind of unmount is it?
     if (!(UnmountFlags & 0x1)) {
         // Flush everything
-        // @todo
+        if (MfsFlushMetadata(Descriptor) != OsSuccess) {
+            ERROR("Failed to flush the bucket-map, the journal is replayed on next mount");
+        }
     }
 
     // Cleanup all allocated resources
@@ -246,11 +254,29 @@ FsDestroy(
         dma_detach(&Mfs->TransferBuffer);
     }
 
+    if (Mfs->JournalBuffer.buffer != NULL) {
+        dma_attachment_unmap(&Mfs->JournalBuffer);
+        dma_detach(&Mfs->JournalBuffer);
+    }
+
+    if (Mfs->IndexBuffer.buffer != NULL) {
+        dma_attachment_unmap(&Mfs->IndexBuffer);
+        dma_detach(&Mfs->IndexBuffer);
+    }
+
     // Free the bucket-map
     if (Mfs->BucketMap != NULL) {
         free(Mfs->BucketMap);
     }
 
+    if (Mfs->DirtyMap != NULL) {
+        free(Mfs->DirtyMap);
+    }
+
+    // Free the free space index
+    free(Mfs->FreeByPosition);
+    free(Mfs->FreeBySize);
+
     // Free structure and return
     free(Mfs);
     Descriptor->ExtensionData = NULL;
@@ -268,6 +294,12 @@ FsInitializeRootRecord(
         MFS_FILERECORD_SYSTEM | MFS_FILERECORD_DIRECTORY;
     FileSystem->RootRecord.StartBucket = FileSystem->MasterRecord.RootIndex;
     FileSystem->RootRecord.StartLength = MFS_ROOTSIZE;
+
+    // The root directory has no record to reference its hash-index
+    if (FileSystem->MasterRecord.RootHashIndex != 0) {
+        FileSystem->RootRecord.Flags    |= MFS_FILERECORD_INDEXED;
+        FileSystem->RootRecord.SparseMap = FileSystem->MasterRecord.RootHashIndex;
+    }
 }
 
 OsStatus_t
@@ -367,7 +399,32 @@ FsInitialize(
         free(mfsInstance);
         return osStatus;
     }
-    
+
+    // The metadata buffer holds the journal header and a batch of sectors, any batch
+    // that was committed but not completed is written before the map is loaded
+    bufferInfo.length   = MIN(MFS_JOURNAL_TARGETS + 1, MFS_JOURNALSIZE * mfsInstance->SectorsPerBucket) *
+        Descriptor->Disk.descriptor.SectorSize;
+    bufferInfo.capacity = bufferInfo.length;
+    osStatus = dma_create(&bufferInfo, &mfsInstance->JournalBuffer);
+    if (osStatus != OsSuccess) {
+        goto error_exit;
+    }
+
+    // The directory hash-index buffer holds the index header and a sector of slots,
+    // and a bucket of the index when it is built
+    bufferInfo.length   = MAX(mfsInstance->SectorsPerBucket, 2) * Descriptor->Disk.descriptor.SectorSize;
+    bufferInfo.capacity = bufferInfo.length;
+    osStatus = dma_create(&bufferInfo, &mfsInstance->IndexBuffer);
+    if (osStatus != OsSuccess) {
+        goto error_exit;
+    }
+
+    osStatus = MfsReplayJournal(Descriptor);
+    if (osStatus != OsSuccess) {
+        ERROR("Failed to replay the mfs journal");
+        goto error_exit;
+    }
+
     TRACE("Caching bucket-map (Sector %u - Size %u Bytes)",
         LODWORD(mfsInstance->MasterRecord.MapSector),
         LODWORD(mfsInstance->MasterRecord.MapSize));
@@ -442,6 +499,18 @@ FsInitialize(
 
     dma_detach(&mapAttachment);
 #endif
+
+    mfsInstance->DirtyMap = (uint8_t*)calloc(DIVUP(imax * mfsInstance->SectorsPerBucket, 8), 1);
+    if (!mfsInstance->DirtyMap) {
+        osStatus = OsOutOfMemory;
+        goto error_exit;
+    }
+
+    osStatus = MfsBuildFreeIndex(Descriptor);
+    if (osStatus != OsSuccess) {
+        ERROR("Failed to index the free space of the bucket-map");
+        goto error_exit;
+    }
     
     FsInitializeRootRecord(mfsInstance);
     return OsSuccess;
@@ -43,6 +43,18 @@
 #define MFS_GETSECTOR(mInstance, Bucket)        ((mInstance->SectorsPerBucket * Bucket))
 #define MFS_ROOTSIZE                            8
 #define MFS_DIRECTORYEXPANSION                  4
+#define MFS_READSEGMENTS                        16    // Direct reads batched per disk request
+#define MFS_JOURNALSIZE                         8     // Buckets reserved at JournalIndex by the formatter
+#define MFS_JOURNAL_MAGIC                       0x4A53464D // MFSJ
+#define MFS_JOURNAL_TARGETS                     62    // Sectors per journal batch, fits a 512 byte header
+#define MFS_METADATA_FLUSH_DELAY                1000  // Milliseconds dirty metadata can wait for write-back
+#define MFS_UPDATE_SECTORS                      4     // Map sectors one allocation or release of a run touches
+#define MFS_FREEINDEX_INITIAL                   64
+#define MFS_LOCALITY_WINDOW                     16    // Free extents after the hint that are considered
+#define MFS_PREALLOCATION                       64    // Maximum buckets reserved ahead for sequential writers
+#define MFS_DIRECTORYINDEX_THRESHOLD            256   // Records in a directory before it is hash-indexed
+#define MFS_DIRECTORYINDEX_MINSLOTS             1024
+#define MFS_DIRECTORYINDEX_MAGIC                0x4944464D // MFDI
 
 #define MFS_ACTION_NONE     0x0
 #define MFS_ACTION_UPDATE   0x1
@@ -105,6 +117,7 @@ PACKED_TYPESTRUCT(MasterRecord, {
 
     uint64_t MapSector;          // Start sector of bucket-map
     uint64_t MapSize;            // Size of bucket map
+    uint32_t RootHashIndex;      // Pointer to the hash-index of the root directory, 0 if none
 });
 
 /* The bucket-map record
@@ -117,6 +130,39 @@ PACKED_TYPESTRUCT(MapRecord, {
     uint32_t Length;
 });
 
+/* The journal header
+ * First sector of the journal, followed by the sectors of the batch. A batch is only
+ * replayed when the checksum matches, which covers the targets and the payload. A
+ * completed batch is marked by a count of zero. */
+PACKED_TYPESTRUCT(JournalHeader, {
+    uint32_t Magic;
+    uint32_t Sequence;
+    uint32_t Count;
+    uint32_t Checksum;
+    uint64_t Targets[MFS_JOURNAL_TARGETS]; // Home sectors of the payload sectors
+});
+
+/* The directory hash-index
+ * Large directories keep an open addressed table of their records in a contiguous run
+ * of buckets, which is referenced by the directory record. The first sector is the header,
+ * it is followed by a stack of free records of SlotCount entries and then the SlotCount
+ * slots of the table. A slot with Bucket 0 is unused, MFS_ENDOFCHAIN marks a removed one. */
+PACKED_TYPESTRUCT(DirectoryIndexSlot, {
+    uint32_t Hash;
+    uint32_t Bucket;   // Run of the directory the record is in
+    uint32_t Length;   // Length of that run
+    uint32_t Index;    // Record index in the run
+});
+
+PACKED_TYPESTRUCT(DirectoryIndexHeader, {
+    uint32_t             Magic;
+    uint32_t             SlotCount;
+    uint32_t             Used;
+    uint32_t             Removed;
+    uint32_t             FreeCount;
+    DirectoryIndexSlot_t Tail; // First record after the last one in use
+});
+
 /* The file-time structure
  * Keeps track of the last time records were modified */
 PACKED_TYPESTRUCT(DateTimeRecord, {
@@ -160,7 +206,7 @@ PACKED_TYPESTRUCT(FileRecord, {
     
     uint64_t         Size;                // 0x30 - Size of data (Set size if sparse)
     uint64_t         AllocatedSize;        // 0x38 - Actual size allocated
-    uint32_t         SparseMap;            // 0x40 - Bucket of sparse-map
+    uint32_t         SparseMap;            // 0x40 - Bucket of sparse-map, or of the hash-index for directories
 
     uint8_t          Name[300];            // 0x44 - Record name (150 UTF16)
     
@@ -184,12 +230,31 @@ PACKED_TYPESTRUCT(FileRecord, {
 #define MFS_FILERECORD_HIDDEN           0x10        // Don't show
 #define MFS_FILERECORD_CHAINED          0x20        // Means all buckets are adjacent
 #define MFS_FILERECORD_LOCKED           0x40        // File is deep-locked
+#define MFS_FILERECORD_INDEXED          0x80        // Directory has a hash-index
 
 #define MFS_FILERECORD_VERSIONED        0x10000000  // Record is versioned
 #define MFS_FILERECORD_INLINE           0x20000000  // Inline data is present
 #define MFS_FILERECORD_SPARSE           0x40000000  // Record-sparse map is in use
 #define MFS_FILERECORD_INUSE            0x80000000  // Record is in use
 
+/* The extent index record
+ * Describes a run of buckets in a file, Offset is the byte offset in the
+ * file where the run starts and Length is the number of buckets in it */
+typedef struct MfsExtent {
+    uint64_t Offset;
+    uint32_t Bucket;
+    uint32_t Length;
+} MfsExtent_t;
+
+/* A run of the free chain, the free space index keeps these sorted by position
+ * and by size. Previous is the run before it in the chain, it is only maintained
+ * in the position index. */
+typedef struct MfsFreeExtent {
+    uint32_t Bucket;
+    uint32_t Length;
+    uint32_t Previous;
+} MfsFreeExtent_t;
+
 PACKED_TYPESTRUCT(MfsEntry, {
     FileSystemEntry_t Base;
     uint32_t          NativeFlags;
@@ -209,6 +274,17 @@ PACKED_TYPESTRUCT(MfsEntry, {
     uint32_t DirectoryBucket;
     uint32_t DirectoryLength;
     size_t   DirectoryIndex;
+
+    // The hash-index of the directory if this is an indexed directory,
+    // and the hash-index of the directory this entry resides in
+    uint32_t HashIndex;
+    uint32_t ParentIndex;
+
+    // Index of the bucket chain sorted by file offset, it is filled as
+    // the file is accessed and dropped when the chain changes
+    MfsExtent_t* Extents;
+    size_t       ExtentCount;
+    size_t       ExtentCapacity;
 });
 
 PACKED_TYPESTRUCT(MfsEntryHandle, {
@@ -226,6 +302,7 @@ typedef struct MfsInstance {
     int                   Version;
     size_t                SectorsPerBucket;
     struct dma_attachment TransferBuffer;
+    struct dma_attachment IndexBuffer;
     
     uint64_t MasterRecordSector;
     uint64_t MasterRecordMirrorSector;
@@ -236,6 +313,23 @@ typedef struct MfsInstance {
     uint32_t*      BucketMap;
     MasterRecord_t MasterRecord;
     FileRecord_t   RootRecord;
+
+    // Metadata write-back, one bit per sector of the bucket-map
+    struct dma_attachment JournalBuffer;
+    uint8_t*              DirtyMap;
+    size_t                DirtyCount;
+    int                   MasterRecordDirty;
+    uint64_t              DirtySince;
+    uint64_t              JournalSector;
+    size_t                JournalCapacity;
+    uint32_t              JournalSequence;
+
+    // Free space index
+    MfsFreeExtent_t* FreeByPosition;
+    MfsFreeExtent_t* FreeBySize;
+    size_t           FreeExtentCount;
+    size_t           FreeExtentCapacity;
+    uint64_t         FreeBucketCount;
 } MfsInstance_t;
 
 /* MfsReadSectors 
@@ -262,6 +356,17 @@ MfsWriteSectors(
     _In_ size_t                     Count,
     _In_ size_t*                    SectorsWritten);
 
+/* MfsTransferSegments
+ * Transfers a list of sector runs with a single request to the disk, the
+ * sectors of the segments are relative to the file-system and are rebased. */
+__EXTERN OsStatus_t
+MfsTransferSegments(
+    _In_  FileSystemDescriptor_t*   FileSystem,
+    _In_  int                       Direction,
+    _In_  StorageTransferSegment_t* Segments,
+    _In_  size_t                    Count,
+    _Out_ size_t*                   SectorsTransferred);
+
 /* MfsGetBucketLink
  * Looks up the next bucket link by utilizing the cached
  * in-memory version of the bucketmap */
@@ -272,8 +377,8 @@ MfsGetBucketLink(
     _Out_ MapRecord_t*              Link);
 
 /* MfsSetBucketLink
- * Updates the next link for the given bucket and flushes
- * the changes to disk */
+ * Updates the next link for the given bucket, the map sector is
+ * marked dirty and written back by MfsFlushMetadata */
 __EXTERN OsStatus_t 
 MfsSetBucketLink(
     _In_ FileSystemDescriptor_t*    FileSystem,
@@ -290,6 +395,25 @@ MfsSwitchToNextBucketLink(
     _In_ MfsEntryHandle_t*          Handle,
     _In_ size_t                     BucketSizeBytes);
 
+/* MfsLocateExtent
+ * Looks up the run of buckets that contains the given file position, the index of the
+ * file is extended by walking the chain as far as needed. Returns OsDoesNotExist if the
+ * position is beyond the chain, the last extent is then provided, or an extent at
+ * MFS_ENDOFCHAIN when the file has no buckets. */
+__EXTERN OsStatus_t
+MfsLocateExtent(
+    _In_  FileSystemDescriptor_t*   FileSystem,
+    _In_  MfsEntry_t*               Entry,
+    _In_  uint64_t                  Position,
+    _Out_ MfsExtent_t*              Extent);
+
+/* MfsInvalidateExtents
+ * Drops the extent index of the file, must be called when the bucket chain
+ * of the file is changed. */
+__EXTERN void
+MfsInvalidateExtents(
+    _In_ MfsEntry_t*                Entry);
+
 /* MfsZeroBucket
  * Wipes the given bucket and count with zero values
  * useful for clearing clusters of sectors */
@@ -300,14 +424,23 @@ MfsZeroBucket(
     _In_ size_t                     Count);
 
 /* MfsAllocateBuckets
- * Allocates the number of requested buckets in the bucket-map
- * if the allocation could not be done, it'll return OsError */
+ * Allocates the number of requested buckets in the bucket-map, Hint is the bucket the
+ * allocation should preferably start at or MFS_ENDOFCHAIN. If the allocation could not
+ * be done, it'll return OsError */
 __EXTERN OsStatus_t
 MfsAllocateBuckets(
-    _In_  FileSystemDescriptor_t*   FileSystem, 
+    _In_  FileSystemDescriptor_t*   FileSystem,
+    _In_  uint32_t                  Hint,
     _In_  size_t                    BucketCount, 
     _Out_ MapRecord_t*              RecordResult);
 
+/* MfsBuildFreeIndex
+ * Builds the free space index from the free chain, must be called
+ * once the bucket-map is loaded. */
+__EXTERN OsStatus_t
+MfsBuildFreeIndex(
+    _In_  FileSystemDescriptor_t*   FileSystem);
+
 /* MfsFreeBucketsMfsFreeBuckets
  * Frees an entire chain of buckets that has been allocated for 
  * a file-record */
@@ -317,6 +450,27 @@ MfsFreeBuckets(
     _In_ uint32_t                   StartBucket,
     _In_ uint32_t                   StartLength);
 
+/* MfsUpdateMasterRecord
+ * Marks the master-record dirty, this completes an update of the bucket-map
+ * and the batch is written back if the journal is full or it is too old */
+__EXTERN OsStatus_t
+MfsUpdateMasterRecord(
+    _In_ FileSystemDescriptor_t*    FileSystem);
+
+/* MfsFlushMetadata
+ * Writes the dirty bucket-map sectors and the master-record through the journal,
+ * the sectors are written home in sorted order. */
+__EXTERN OsStatus_t
+MfsFlushMetadata(
+    _In_ FileSystemDescriptor_t*    FileSystem);
+
+/* MfsReplayJournal
+ * Completes a committed batch left in the journal, must be called on mount
+ * before the bucket-map is loaded. */
+__EXTERN OsStatus_t
+MfsReplayJournal(
+    _In_ FileSystemDescriptor_t*    FileSystem);
+
 /* MfsEnsureRecordSpace
  * Ensures that the given record has the space neccessary for the required data. */
 __EXTERN OsStatus_t
@@ -335,12 +489,11 @@ MfsUpdateRecord(
     _In_ int                        action);
 
 /* MfsLocateRecord
- * Locates a given file-record by the path given, all sub entries must be 
- * directories. File is only allocated and set if the function returns OsSuccess */
+ * Locates a given file-record by the path given from the root directory, all sub entries
+ * must be directories. File is only allocated and set if the function returns OsSuccess */
 __EXTERN OsStatus_t
 MfsLocateRecord(
     _In_ FileSystemDescriptor_t*    fileSystem,
-    _In_ uint32_t                   bucketOfDirectory,
     _In_ MfsEntry_t*                entry,
     _In_ MString_t*                 path);
 
@@ -349,8 +502,7 @@ MfsLocateRecord(
  * <flags>. Other records created along the path will be created as directories with deduced permissions.
  * @param fileSystem        [In]
  * @param flags             [In]
- * @param bucketOfDirectory [In]
- * @param path              [In]
+ * @param path              [In] Path relative to the root directory.
  * @param entryOut          [Out]
  * @return                  Status of the record creation
  */
@@ -358,10 +510,60 @@ __EXTERN OsStatus_t
 MfsCreateRecord(
         _In_ FileSystemDescriptor_t* fileSystem,
         _In_ unsigned int            flags,
-        _In_ uint32_t                bucketOfDirectory,
         _In_ MString_t*              path,
         _In_ MfsEntry_t**            entryOut);
 
+/* MfsExpandDirectory
+ * Links a new zeroed run of buckets after the given run of a directory. */
+__EXTERN OsStatus_t
+MfsExpandDirectory(
+    _In_ FileSystemDescriptor_t*    fileSystem,
+    _In_ uint32_t                   currentBucket,
+    _In_ MapRecord_t*               mapRecord);
+
+/* MfsFindIndexedRecord
+ * Looks up a record in a directory with a hash-index. A free record is provided on OsDoesNotExist
+ * if <allowExpansion> is set, and OsNotSupported is returned if the index is not usable. */
+__EXTERN OsStatus_t
+MfsFindIndexedRecord(
+    _In_ FileSystemDescriptor_t*    fileSystem,
+    _In_ MfsEntry_t*                directory,
+    _In_ MString_t*                 entryName,
+    _In_ int                        allowExpansion,
+    _In_ MfsEntry_t*                resultEntry);
+
+/* MfsInsertIndexedRecord
+ * Adds a created record to the hash-index of its directory, the index is rebuilt
+ * when it is too full. */
+__EXTERN OsStatus_t
+MfsInsertIndexedRecord(
+    _In_ FileSystemDescriptor_t*    fileSystem,
+    _In_ MfsEntry_t*                directory,
+    _In_ MfsEntry_t*                entry);
+
+/* MfsRemoveIndexedRecord
+ * Removes a deleted record from the hash-index of its directory, and
+ * makes the record available for the next creation. */
+__EXTERN OsStatus_t
+MfsRemoveIndexedRecord(
+    _In_ FileSystemDescriptor_t*    fileSystem,
+    _In_ MfsEntry_t*                entry);
+
+/* MfsBuildDirectoryIndex
+ * Builds a new hash-index for the directory from its records and replaces the
+ * current one. The directory record is updated to reference it. */
+__EXTERN OsStatus_t
+MfsBuildDirectoryIndex(
+    _In_ FileSystemDescriptor_t*    fileSystem,
+    _In_ MfsEntry_t*                directory);
+
+/* MfsFreeDirectoryIndex
+ * Releases the hash-index of a directory that is deleted. */
+__EXTERN OsStatus_t
+MfsFreeDirectoryIndex(
+    _In_ FileSystemDescriptor_t*    fileSystem,
+    _In_ MfsEntry_t*                directory);
+
 /* MfsVfsFlagsToFileRecordFlags
  * Converts the generic vfs options/permissions to the native mfs representation. */
 __EXTERN unsigned int
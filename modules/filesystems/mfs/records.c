@@ -68,6 +68,20 @@ static void __ExtractPathToken(
           MStringRaw(*remainingPath), remainingPath, MStringRaw(*token), token);
 }
 
+static void __GetRootDirectory(
+        _In_ MfsInstance_t* mfs,
+        _In_ MfsEntry_t*    directory)
+{
+    // The root directory has no record on disk, the directory bucket of 0 marks it
+    memset(directory, 0, sizeof(MfsEntry_t));
+    directory->NativeFlags = mfs->RootRecord.Flags;
+    directory->StartBucket = mfs->RootRecord.StartBucket;
+    directory->StartLength = mfs->RootRecord.StartLength;
+    if (mfs->RootRecord.Flags & MFS_FILERECORD_INDEXED) {
+        directory->HashIndex = mfs->RootRecord.SparseMap;
+    }
+}
+
 static inline void __StoreRecord(
         _In_ FileSystemDescriptor_t* fileSystem,
         _In_ FileRecord_t*           record,
@@ -115,58 +129,39 @@ static OsStatus_t __ReadCurrentBucket(
     return osStatus;
 }
 
-static OsStatus_t __ExpandDirectory(
-        _In_ FileSystemDescriptor_t* fileSystem,
-        _In_ uint32_t                currentBucket,
-        _In_ MapRecord_t*            mapRecord)
-{
-    OsStatus_t osStatus;
-
-    // Allocate bucket
-    osStatus = MfsAllocateBuckets(fileSystem, MFS_DIRECTORYEXPANSION, mapRecord);
-    if (osStatus != OsSuccess) {
-        ERROR("__ExpandDirectory failed to allocate bucket for expansion");
-        return osStatus;
-    }
-
-    // Update link
-    osStatus = MfsSetBucketLink(fileSystem, currentBucket, mapRecord, 1);
-    if (osStatus != OsSuccess) {
-        ERROR("__ExpandDirectory failed to update bucket-link for expansion");
-        return osStatus;
-    }
-
-    // Zero the bucket
-    osStatus = MfsZeroBucket(fileSystem, mapRecord->Link, mapRecord->Length);
-    if (osStatus != OsSuccess) {
-        ERROR("__ExpandDirectory failed to zero bucket %u", mapRecord->Link);
-    }
-    return osStatus;
-}
-
 /**
  * Finds an entry matching the name given, or returns a free entry. A guarantee of a free entry can only be made
  * if the <allowExpansion> is set to a non-zero value.
  * @param fileSystem        [In] A pointer to an instance of the filesystem data.
  * @param mfs               [In] A pointer to an instance of the mfs data.
- * @param bucketOfDirectory [In] The first data bucket of the directory to search in.
+ * @param directory         [In] The directory to search in, its hash-index is used if it has one.
  * @param entryName         [In] Name of the entry that we are searchin for.
  * @param allowExpansion    [In] Whether or not we can expand the directory if no free entry was found.
  * @param resultEntry       [In] A pointer to an MfsEntry_t structure where the found entry can be stored.
+ * @param recordsInUse      [Out] Optional, the number of records in use that were scanned.
  * @return                  OsExists if entry with <entryName> was found, OsDoesNotExist if a free entry was found.
  *                          Any other Os* value is indicative of an error.
  */
 static OsStatus_t __FindEntryOrFreeInDirectoryBucket(
-        _In_ FileSystemDescriptor_t* fileSystem,
-        _In_ MfsInstance_t*          mfs,
-        _In_ uint32_t                bucketOfDirectory,
-        _In_ MString_t*              entryName,
-        _In_ int                     allowExpansion,
-        _In_ MfsEntry_t*             resultEntry)
+        _In_  FileSystemDescriptor_t* fileSystem,
+        _In_  MfsInstance_t*          mfs,
+        _In_  MfsEntry_t*             directory,
+        _In_  MString_t*              entryName,
+        _In_  int                     allowExpansion,
+        _In_  MfsEntry_t*             resultEntry,
+        _Out_ size_t*                 recordsInUse)
 {
-    uint32_t   currentBucket = bucketOfDirectory;
+    uint32_t   currentBucket = directory->StartBucket;
+    size_t     inUse         = 0;
     OsStatus_t osStatus;
 
+    if (directory->HashIndex) {
+        osStatus = MfsFindIndexedRecord(fileSystem, directory, entryName, allowExpansion, resultEntry);
+        if (osStatus != OsNotSupported) {
+            return osStatus;
+        }
+    }
+
     // iterate untill end of folder with two tasks in mind, either find matching entry
     // or one thats free so we can create it
     while (1) {
@@ -198,6 +193,7 @@ static OsStatus_t __FindEntryOrFreeInDirectoryBucket(
                 record++;
                 continue;
             }
+            inUse++;
 
             // Convert the filename into a mstring object
             // and try to match it with our token (ignore case)
@@ -210,6 +206,7 @@ static OsStatus_t __FindEntryOrFreeInDirectoryBucket(
             if (compareResult == MSTRING_FULL_MATCH) {
                 // it was end of path, and the entry exists
                 __StoreRecord(fileSystem, record, currentBucket, link.Length, i, resultEntry);
+                resultEntry->ParentIndex = directory->HashIndex;
                 osStatus = OsExists;
                 exitLoop = 1;
                 break;
@@ -228,7 +225,7 @@ static OsStatus_t __FindEntryOrFreeInDirectoryBucket(
         if (link.Link == MFS_ENDOFCHAIN) {
             if (resultEntry->DirectoryBucket == 0 && allowExpansion) {
                 // Expand directory as we have not found a free record
-                osStatus = __ExpandDirectory(fileSystem, currentBucket, &link);
+                osStatus = MfsExpandDirectory(fileSystem, currentBucket, &link);
                 if (osStatus != OsSuccess) {
                     ERROR("__FindEntryOrFreeInDirectoryBucket failed to expand directory");
                     break;
@@ -238,6 +235,7 @@ static OsStatus_t __FindEntryOrFreeInDirectoryBucket(
                 resultEntry->DirectoryBucket = link.Link;
                 resultEntry->DirectoryLength = link.Length;
                 resultEntry->DirectoryIndex  = 0;
+                osStatus = OsDoesNotExist;
             }
             else {
                 osStatus = OsDoesNotExist;
@@ -248,13 +246,17 @@ static OsStatus_t __FindEntryOrFreeInDirectoryBucket(
         // Update current bucket pointer
         currentBucket = link.Link;
     }
+
+    if (recordsInUse) {
+        *recordsInUse = inUse;
+    }
     return osStatus;
 }
 
 static OsStatus_t __InitiateDirectory(
         _In_ FileSystemDescriptor_t* fileSystem,
         _In_ MfsInstance_t*          mfs,
-        _In_ uint32_t                currentBucket,
+        _In_ MfsEntry_t*             directoryEntry,
         _In_ FileRecord_t*           record)
 {
     MapRecord_t expansion;
@@ -262,7 +264,7 @@ static OsStatus_t __InitiateDirectory(
     size_t      sectorsTransferred;
 
     // Allocate bucket
-    osStatus = MfsAllocateBuckets(fileSystem, 1, &expansion);
+    osStatus = MfsAllocateBuckets(fileSystem, MFS_ENDOFCHAIN, 1, &expansion);
     if (osStatus != OsSuccess) {
         ERROR("__InitiateDirectory failed to allocate bucket");
         return osStatus;
@@ -273,19 +275,29 @@ static OsStatus_t __InitiateDirectory(
     record->StartLength   = expansion.Length;
     record->AllocatedSize = mfs->SectorsPerBucket * fileSystem->Disk.descriptor.SectorSize;
 
-    // Write back record bucket
+    directoryEntry->StartBucket   = record->StartBucket;
+    directoryEntry->StartLength   = record->StartLength;
+    directoryEntry->AllocatedSize = record->AllocatedSize;
+
+    // Write back record bucket, the allocation must reach the disk first
+    osStatus = MfsFlushMetadata(fileSystem);
+    if (osStatus != OsSuccess) {
+        ERROR("__InitiateDirectory failed to flush the bucket map");
+        return osStatus;
+    }
+
     osStatus = MfsWriteSectors(fileSystem, mfs->TransferBuffer.handle,
-                               0, MFS_GETSECTOR(mfs, currentBucket),
-                               mfs->SectorsPerBucket, &sectorsTransferred);
+                               0, MFS_GETSECTOR(mfs, directoryEntry->DirectoryBucket),
+                               mfs->SectorsPerBucket * directoryEntry->DirectoryLength, &sectorsTransferred);
     if (osStatus != OsSuccess) {
-        ERROR("__InitiateDirectory failed to update bucket %u", currentBucket);
+        ERROR("__InitiateDirectory failed to update bucket %u", directoryEntry->DirectoryBucket);
         return osStatus;
     }
 
     // Zero the bucket
-    osStatus = MfsZeroBucket(fileSystem, record->StartBucket, record->StartLength);
+    osStatus = MfsZeroBucket(fileSystem, directoryEntry->StartBucket, directoryEntry->StartLength);
     if (osStatus != OsSuccess) {
-        ERROR("__InitiateDirectory failed to zero bucket %u", record->StartBucket);
+        ERROR("__InitiateDirectory failed to zero bucket %u", directoryEntry->StartBucket);
     }
 
     return osStatus;
@@ -324,6 +336,9 @@ static OsStatus_t __CreateEntryInDirectory(
             return OsOutOfMemory;
         }
         memcpy(*entryOut, &entry, sizeof(MfsEntry_t));
+
+        // The name is owned by the entry, the token is released by the caller
+        (*entryOut)->Base.Name = MStringClone(name);
     }
     return OsSuccess;
 }
@@ -337,7 +352,7 @@ static OsStatus_t __CreateDirectory(
     OsStatus_t    osStatus;
     FileRecord_t* record;
 
-    osStatus = __CreateEntryInDirectory(fileSystem, name, MFS_FILERECORD_DIRECTORY,
+    osStatus = __CreateEntryInDirectory(fileSystem, name, __FILE_DIRECTORY,
                                         directoryEntry->DirectoryBucket, directoryEntry->DirectoryLength,
                                         directoryEntry->DirectoryIndex, NULL);
     if (osStatus != OsSuccess) {
@@ -346,35 +361,55 @@ static OsStatus_t __CreateDirectory(
     }
 
     record   = (FileRecord_t*)((uint8_t*)mfs->TransferBuffer.buffer + (sizeof(FileRecord_t) * directoryEntry->DirectoryIndex));
-    osStatus = __InitiateDirectory(fileSystem, mfs, directoryEntry->DirectoryBucket, record);
+    directoryEntry->NativeFlags = record->Flags;
+    directoryEntry->HashIndex   = 0;
+    osStatus = __InitiateDirectory(fileSystem, mfs, directoryEntry, record);
     if (osStatus != OsSuccess) {
         ERROR("__CreateDirectory failed to initiate new directory record");
     }
     return osStatus;
 }
 
-OsStatus_t
-MfsLocateRecord(
+/**
+ * Adds a record that was just created to the hash-index of the directory. Directories without
+ * an index get one when the number of records reaches MFS_DIRECTORYINDEX_THRESHOLD.
+ * @param directory    [In] The directory the record was created in.
+ * @param entry        [In] The created record, the name and directory location must be set.
+ * @param recordsInUse [In] The number of records in use in the directory before the creation.
+ */
+static OsStatus_t __IndexCreatedRecord(
         _In_ FileSystemDescriptor_t* fileSystem,
-        _In_ uint32_t                bucketOfDirectory,
+        _In_ MfsEntry_t*             directory,
         _In_ MfsEntry_t*             entry,
-        _In_ MString_t*              path)
+        _In_ size_t                  recordsInUse)
 {
-    MfsInstance_t* mfs;
-    OsStatus_t     osStatus;
-    MString_t*     remainingPath = NULL;
-    MString_t*     currentToken  = NULL;
-    MfsEntry_t     nextEntry = { { { 0 } } };
-    int            isEndOfPath = 0;
-
-    TRACE("MfsLocateRecord(fileSystem=0x%" PRIxIN ", bucketOfDirectory=%u, entry=0x%" PRIxIN ", path=%s [0x%" PRIxIN "])",
-          fileSystem, bucketOfDirectory, entry, MStringRaw(path), path);
+    if (directory->HashIndex) {
+        return MfsInsertIndexedRecord(fileSystem, directory, entry);
+    }
 
-    if (!fileSystem || !entry) {
-        return OsInvalidParameters;
+    // A directory that can not be indexed is still searched by scanning it
+    if (recordsInUse + 1 >= MFS_DIRECTORYINDEX_THRESHOLD &&
+        MfsBuildDirectoryIndex(fileSystem, directory) == OsSuccess) {
+        entry->ParentIndex = directory->HashIndex;
     }
+    return OsSuccess;
+}
 
-    mfs = (MfsInstance_t*)fileSystem->ExtensionData;
+static OsStatus_t __LocateRecord(
+        _In_ FileSystemDescriptor_t* fileSystem,
+        _In_ MfsInstance_t*          mfs,
+        _In_ MfsEntry_t*             directory,
+        _In_ MfsEntry_t*             entry,
+        _In_ MString_t*              path)
+{
+    OsStatus_t osStatus;
+    MString_t* remainingPath = NULL;
+    MString_t* currentToken  = NULL;
+    MfsEntry_t nextEntry = { { { 0 } } };
+    int        isEndOfPath = 0;
+
+    TRACE("__LocateRecord(fileSystem=0x%" PRIxIN ", bucketOfDirectory=%u, entry=0x%" PRIxIN ", path=%s [0x%" PRIxIN "])",
+          fileSystem, directory->StartBucket, entry, MStringRaw(path), path);
 
     // Either get next part of the path, or end at this entry
     if (MStringLength(path) != 0) {
@@ -394,8 +429,8 @@ MfsLocateRecord(
     }
 
     // Iterate untill we reach end of folder
-    osStatus = __FindEntryOrFreeInDirectoryBucket(fileSystem, mfs, bucketOfDirectory,
-                                                  currentToken, 0, &nextEntry);
+    osStatus = __FindEntryOrFreeInDirectoryBucket(fileSystem, mfs, directory,
+                                                  currentToken, 0, &nextEntry, NULL);
     if (osStatus == OsExists) {
         if (!isEndOfPath) {
             if (!(nextEntry.NativeFlags & MFS_FILERECORD_DIRECTORY)) {
@@ -408,10 +443,11 @@ MfsLocateRecord(
                 goto exit;
             }
 
-            osStatus = MfsLocateRecord(fileSystem, nextEntry.StartBucket, entry, remainingPath);
+            osStatus = __LocateRecord(fileSystem, mfs, &nextEntry, entry, remainingPath);
         }
         else {
             memcpy(entry, &nextEntry, sizeof(MfsEntry_t));
+            nextEntry.Base.Name = NULL;
             osStatus = OsSuccess;
         }
     }
@@ -421,33 +457,48 @@ exit:
     if (remainingPath != NULL) {
         MStringDestroy(remainingPath);
     }
+    if (nextEntry.Base.Name != NULL) {
+        MStringDestroy(nextEntry.Base.Name);
+    }
     MStringDestroy(currentToken);
     return osStatus;
 }
 
 OsStatus_t
-MfsCreateRecord(
-    _In_ FileSystemDescriptor_t* fileSystem,
-    _In_ unsigned int            flags,
-    _In_ uint32_t                bucketOfDirectory,
-    _In_ MString_t*              path,
-    _In_ MfsEntry_t**            entryOut)
+MfsLocateRecord(
+        _In_ FileSystemDescriptor_t* fileSystem,
+        _In_ MfsEntry_t*             entry,
+        _In_ MString_t*              path)
 {
     MfsInstance_t* mfs;
-    OsStatus_t     osStatus;
-    MfsEntry_t     nextEntry = { { { 0 } } };
-    MString_t*     remainingPath = NULL;
-    MString_t*     currentToken  = NULL;
-    int            isEndOfPath = 0;
-
-    TRACE("MfsCreateRecord(fileSystem=0x%" PRIxIN ", flags=0x%x, bucketOfDirectory=%u, path=%s [0x%" PRIxIN "])",
-          fileSystem, flags, bucketOfDirectory, MStringRaw(path), path);
+    MfsEntry_t     rootDirectory;
 
-    if (!fileSystem) {
+    if (!fileSystem || !entry) {
         return OsInvalidParameters;
     }
 
     mfs = (MfsInstance_t*)fileSystem->ExtensionData;
+    __GetRootDirectory(mfs, &rootDirectory);
+    return __LocateRecord(fileSystem, mfs, &rootDirectory, entry, path);
+}
+
+static OsStatus_t __CreateRecord(
+    _In_ FileSystemDescriptor_t* fileSystem,
+    _In_ MfsInstance_t*          mfs,
+    _In_ MfsEntry_t*             directory,
+    _In_ unsigned int            flags,
+    _In_ MString_t*              path,
+    _In_ MfsEntry_t**            entryOut)
+{
+    OsStatus_t osStatus;
+    MfsEntry_t nextEntry = { { { 0 } } };
+    MString_t* remainingPath = NULL;
+    MString_t* currentToken  = NULL;
+    size_t     recordsInUse  = 0;
+    int        isEndOfPath = 0;
+
+    TRACE("__CreateRecord(fileSystem=0x%" PRIxIN ", flags=0x%x, bucketOfDirectory=%u, path=%s [0x%" PRIxIN "])",
+          fileSystem, flags, directory->StartBucket, MStringRaw(path), path);
 
     // Get next token
     __ExtractPathToken(path, &remainingPath, &currentToken);
@@ -455,7 +506,8 @@ MfsCreateRecord(
         isEndOfPath = 1;
     }
 
-    osStatus = __FindEntryOrFreeInDirectoryBucket(fileSystem, mfs, bucketOfDirectory, currentToken, 1, &nextEntry);
+    osStatus = __FindEntryOrFreeInDirectoryBucket(fileSystem, mfs, directory, currentToken, 1,
+                                                  &nextEntry, &recordsInUse);
     if (osStatus == OsDoesNotExist) {
         // if this is not the end of path, recursive create flag must be provided
         if (!isEndOfPath && !(flags & __FILE_CREATE_RECURSIVE)) {
@@ -465,17 +517,30 @@ MfsCreateRecord(
         // create either a new directory entry
         if (!isEndOfPath) {
             osStatus = __CreateDirectory(fileSystem, mfs, currentToken, &nextEntry);
+            if (osStatus == OsSuccess) {
+                nextEntry.Base.Name = currentToken;
+                osStatus = __IndexCreatedRecord(fileSystem, directory, &nextEntry, recordsInUse);
+                nextEntry.Base.Name = NULL;
+            }
             if (osStatus != OsSuccess) {
                 goto exit;
             }
 
-            osStatus = MfsCreateRecord(fileSystem, flags, nextEntry.StartBucket, remainingPath, entryOut);
+            osStatus = __CreateRecord(fileSystem, mfs, &nextEntry, flags, remainingPath, entryOut);
         }
         else {
             // Last creation step.
             osStatus = __CreateEntryInDirectory(fileSystem, currentToken, flags,
                                                 nextEntry.DirectoryBucket, nextEntry.DirectoryLength,
                                                 nextEntry.DirectoryIndex, entryOut);
+            if (osStatus == OsSuccess) {
+                nextEntry.Base.Name = currentToken;
+                osStatus = __IndexCreatedRecord(fileSystem, directory, &nextEntry, recordsInUse);
+                nextEntry.Base.Name = NULL;
+                if (entryOut) {
+                    (*entryOut)->ParentIndex = nextEntry.ParentIndex;
+                }
+            }
         }
     }
     else if (osStatus == OsExists) {
@@ -495,13 +560,13 @@ MfsCreateRecord(
         // If directory has no data-bucket allocated then initiate the directory
         if (nextEntry.StartBucket == MFS_ENDOFCHAIN) {
             FileRecord_t* record = (FileRecord_t*)((uint8_t*)mfs->TransferBuffer.buffer + (sizeof(FileRecord_t) * nextEntry.DirectoryIndex));
-            osStatus = __InitiateDirectory(fileSystem, mfs, nextEntry.DirectoryBucket, record);
+            osStatus = __InitiateDirectory(fileSystem, mfs, &nextEntry, record);
             if (osStatus != OsSuccess) {
-                ERROR("MfsCreateRecord failed to initiate directory");
+                ERROR("__CreateRecord failed to initiate directory");
                 goto exit;
             }
         }
-        osStatus = MfsCreateRecord(fileSystem, flags, nextEntry.StartBucket, remainingPath, entryOut);
+        osStatus = __CreateRecord(fileSystem, mfs, &nextEntry, flags, remainingPath, entryOut);
     }
 
 exit:
@@ -509,7 +574,29 @@ exit:
     if (remainingPath != NULL) {
         MStringDestroy(remainingPath);
     }
+    if (nextEntry.Base.Name != NULL) {
+        MStringDestroy(nextEntry.Base.Name);
+    }
     MStringDestroy(currentToken);
-    TRACE("MfsCreateRecord returns=%u", osStatus);
+    TRACE("__CreateRecord returns=%u", osStatus);
     return osStatus;
 }
+
+OsStatus_t
+MfsCreateRecord(
+    _In_ FileSystemDescriptor_t* fileSystem,
+    _In_ unsigned int            flags,
+    _In_ MString_t*              path,
+    _In_ MfsEntry_t**            entryOut)
+{
+    MfsInstance_t* mfs;
+    MfsEntry_t     rootDirectory;
+
+    if (!fileSystem) {
+        return OsInvalidParameters;
+    }
+
+    mfs = (MfsInstance_t*)fileSystem->ExtensionData;
+    __GetRootDirectory(mfs, &rootDirectory);
+    return __CreateRecord(fileSystem, mfs, &rootDirectory, flags, path, entryOut);
+}
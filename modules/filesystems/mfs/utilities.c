@@ -41,6 +41,12 @@ MfsReadSectors(
 	struct vali_link_message msg            = VALI_MSG_INIT_HANDLE(FileSystem->Disk.driver_id);
     uint64_t                 absoluteSector = FileSystem->SectorStart + Sector;
 	OsStatus_t               status;
+
+	// Let the filemanager merge and order the transfer with those of other callers
+	if (FileSystem->Disk.transfer) {
+	    return FileSystem->Disk.transfer(FileSystem->Disk.queue, __STORAGE_OPERATION_READ,
+	        absoluteSector, BufferHandle, BufferOffset, Count, SectorsRead);
+	}
 	
 	ctt_storage_transfer(GetGrachtClient(), &msg.base, FileSystem->Disk.device_id,
 			__STORAGE_OPERATION_READ, LODWORD(absoluteSector), HIDWORD(absoluteSector), 
@@ -62,6 +68,12 @@ MfsWriteSectors(
 	struct vali_link_message msg            = VALI_MSG_INIT_HANDLE(FileSystem->Disk.driver_id);
     uint64_t                 absoluteSector = FileSystem->SectorStart + Sector;
 	OsStatus_t               status;
+
+	// Let the filemanager merge and order the transfer with those of other callers
+	if (FileSystem->Disk.transfer) {
+	    return FileSystem->Disk.transfer(FileSystem->Disk.queue, __STORAGE_OPERATION_WRITE,
+	        absoluteSector, BufferHandle, BufferOffset, Count, SectorsWritten);
+	}
 	
 	ctt_storage_transfer(GetGrachtClient(), &msg.base, FileSystem->Disk.device_id,
 			__STORAGE_OPERATION_WRITE, LODWORD(absoluteSector), HIDWORD(absoluteSector), 
@@ -72,81 +84,51 @@ MfsWriteSectors(
 }
 
 OsStatus_t
-MfsUpdateMasterRecord(
-    _In_ FileSystemDescriptor_t* FileSystem)
-{
-    MfsInstance_t* Mfs = (MfsInstance_t*)FileSystem->ExtensionData;
-    size_t         SectorsTransferred;
-
-    TRACE("MfsUpdateMasterRecord()");
-
-    memset(Mfs->TransferBuffer.buffer, 0, FileSystem->Disk.descriptor.SectorSize);
-    memcpy(Mfs->TransferBuffer.buffer, &Mfs->MasterRecord, sizeof(MasterRecord_t));
-
-    if (MfsWriteSectors(FileSystem, Mfs->TransferBuffer.handle, 0, Mfs->MasterRecordSector, 1, &SectorsTransferred)       != OsSuccess || 
-        MfsWriteSectors(FileSystem, Mfs->TransferBuffer.handle, 0, Mfs->MasterRecordMirrorSector, 1, &SectorsTransferred) != OsSuccess) {
-        ERROR("Failed to write master-record to disk");
-        return OsError;
-    }
-    return OsSuccess;
-}
-
-OsStatus_t
-MfsGetBucketLink(
-    _In_  FileSystemDescriptor_t* FileSystem,
-    _In_  uint32_t                Bucket, 
-    _Out_ MapRecord_t*            Link)
+MfsTransferSegments(
+    _In_  FileSystemDescriptor_t*   FileSystem,
+    _In_  int                       Direction,
+    _In_  StorageTransferSegment_t* Segments,
+    _In_  size_t                    Count,
+    _Out_ size_t*                   SectorsTransferred)
 {
-    MfsInstance_t* Mfs = (MfsInstance_t*)FileSystem->ExtensionData;
-
-    TRACE("MfsGetBucketLink(Bucket %u)", Bucket);
-    if (Bucket < Mfs->BucketCount) {
-        Link->Link   = Mfs->BucketMap[(Bucket * 2)];
-        Link->Length = Mfs->BucketMap[(Bucket * 2) + 1];
-        TRACE("... link %u, length %u", Link->Link, Link->Length);
-        return OsSuccess;
-    }
-    return OsInvalidParameters;
-}
-
-OsStatus_t 
-MfsSetBucketLink(
-    _In_ FileSystemDescriptor_t*    FileSystem,
-    _In_ uint32_t                   Bucket, 
-    _In_ MapRecord_t*               Link,
-    _In_ int                        UpdateLength)
-{
-    MfsInstance_t*  Mfs             = (MfsInstance_t*)FileSystem->ExtensionData;
-    uint8_t*        BufferOffset    = NULL;
-    size_t          SectorOffset    = 0;
-    size_t          SectorsTransferred;
-
-    TRACE("MfsSetBucketLink(Bucket %u, Link %u)", Bucket, Link->Link);
-
-    // Update in-memory map first
-    Mfs->BucketMap[(Bucket * 2)] = Link->Link;
-    if (UpdateLength) {
-        Mfs->BucketMap[(Bucket * 2) + 1] = Link->Length;
-    }
-
-    // Calculate which sector that is dirty now
-    SectorOffset = Bucket / Mfs->BucketsPerSectorInMap;
-
-    // Calculate offset into buffer
-    BufferOffset = (uint8_t*)Mfs->BucketMap;
-    BufferOffset += (SectorOffset * FileSystem->Disk.descriptor.SectorSize);
-
-    // Copy a sector's worth of data into the buffer
-    memcpy(Mfs->TransferBuffer.buffer, BufferOffset, FileSystem->Disk.descriptor.SectorSize);
+	struct vali_link_message msg = VALI_MSG_INIT_HANDLE(FileSystem->Disk.driver_id);
+	OsStatus_t               status;
+	UUId_t                   requestId;
+	size_t                   i;
+
+	*SectorsTransferred = 0;
+	for (i = 0; i < Count; i++) {
+	    Segments[i].Sector += FileSystem->SectorStart;
+	}
+
+	// The request queue of the disk orders transfers against those of other callers, so
+	// the segments must go through it as well
+	if (FileSystem->Disk.transfer) {
+	    for (i = 0; i < Count; i++) {
+	        size_t sectorsDone = 0;
+	        status = FileSystem->Disk.transfer(FileSystem->Disk.queue, Direction, Segments[i].Sector,
+	            Segments[i].BufferHandle, Segments[i].BufferOffset, Segments[i].SectorCount, &sectorsDone);
+	        *SectorsTransferred += sectorsDone;
+	        if (status != OsSuccess || sectorsDone != Segments[i].SectorCount) {
+	            break;
+	        }
+	    }
+	    return status;
+	}
+
+	// Queue all segments with one call, then block until the driver has completed them
+	ctt_storage_submit(GetGrachtClient(), &msg.base, FileSystem->Disk.device_id,
+			Direction, (uint8_t*)Segments, (uint32_t)(Count * sizeof(StorageTransferSegment_t)), 0);
+    gracht_client_wait_message(GetGrachtClient(), &msg.base, GRACHT_MESSAGE_BLOCK);
+	ctt_storage_submit_result(GetGrachtClient(), &msg.base, &status, &requestId);
+	if (status != OsSuccess) {
+	    return status;
+	}
 
-    // Flush buffer to disk
-    if (MfsWriteSectors(FileSystem, Mfs->TransferBuffer.handle, 0, 
-        Mfs->MasterRecord.MapSector + SectorOffset, 1, &SectorsTransferred) != OsSuccess) {
-        ERROR("Failed to update the given map-sector %u on disk",
-            LODWORD(Mfs->MasterRecord.MapSector + SectorOffset));
-        return OsError;
-    }
-    return OsSuccess;
+	ctt_storage_poll(GetGrachtClient(), &msg.base, FileSystem->Disk.device_id, requestId, 1);
+    gracht_client_wait_message(GetGrachtClient(), &msg.base, GRACHT_MESSAGE_BLOCK);
+	ctt_storage_poll_result(GetGrachtClient(), &msg.base, &status, SectorsTransferred);
+	return status;
 }
 
 OsStatus_t
@@ -183,158 +165,6 @@ MfsSwitchToNextBucketLink(
     return OsSuccess;
 }
 
-OsStatus_t
-MfsAllocateBuckets(
-    _In_ FileSystemDescriptor_t*    FileSystem, 
-    _In_ size_t                     BucketCount, 
-    _In_ MapRecord_t*               RecordResult)
-{
-    MfsInstance_t*  Mfs             = (MfsInstance_t*)FileSystem->ExtensionData;
-    uint32_t        PreviousBucket  = 0;
-    uint32_t        Bucket          = Mfs->MasterRecord.FreeBucket;
-    size_t          Counter         = BucketCount;
-    MapRecord_t     Record;
-
-    TRACE("MfsAllocateBuckets(FreeAt %u, Count %u)", Bucket, BucketCount);
-
-    RecordResult->Link      = Mfs->MasterRecord.FreeBucket;
-    RecordResult->Length    = 0;
-
-    // Do allocation in a for-loop as bucket-sizes
-    // are variable and thus we might need multiple
-    // allocations to satisfy the demand
-    while (Counter > 0) {
-        // Get next free bucket
-        if (MfsGetBucketLink(FileSystem, Bucket, &Record) != OsSuccess) {
-            ERROR("Failed to retrieve link for bucket %u", Bucket);
-            return OsError;
-        }
-
-        // Bucket points to the free bucket index
-        // Record.Link holds the link of <Bucket>
-        // Record.Length holds the length of <Bucket>
-
-        // We now have two cases, either the next block is
-        // larger than the number of buckets we are asking for
-        // or it's smaller
-        if (Record.Length > Counter) {
-            // Ok, this block is larger than what we need
-            // We now need to first, update the free index to these values
-            // Map[Bucket] = (Counter) | (MFS_ENDOFCHAIN)
-            // Map[Bucket + Counter] = (Length - Counter) | Link
-            MapRecord_t Update, Next;
-
-            // Set update
-            Update.Link     = MFS_ENDOFCHAIN;
-            Update.Length   = Counter;
-
-            // Set next
-            Next.Link       = Record.Link;
-            Next.Length     = Record.Length - Counter;
-
-            // Make sure only to update out once, we just need
-            // the initial size, not for each new allocation
-            if (RecordResult->Length == 0) {
-                RecordResult->Length = Update.Length;
-            }
-
-            // We have to adjust now, since we are taking 
-            // only a chunk of the available length
-            // Map[Bucket] = (Counter) | (MFS_ENDOFCHAIN)
-            // Map[Bucket + Counter] = (Length - Counter) | PreviousLink
-            if (MfsSetBucketLink(FileSystem, Bucket, &Update, 1)            != OsSuccess &&
-                MfsSetBucketLink(FileSystem, Bucket + Counter, &Next, 1)    != OsSuccess) {
-                ERROR("Failed to update link for bucket %u and %u", 
-                    Bucket, Bucket + Counter);
-                return OsError;
-            }
-            Mfs->MasterRecord.FreeBucket = Bucket + Counter;
-            return MfsUpdateMasterRecord(FileSystem);
-        }
-        else {
-            // Ok, block is either exactly the size we need or less
-            // than what we need
-
-            // Make sure only to update out once, we just need
-            // the initial size, not for each new allocation
-            if (RecordResult->Length == 0) {
-                RecordResult->Length = Record.Length;
-            }
-            Counter         -= Record.Length;
-            PreviousBucket  = Bucket;
-            Bucket          = Record.Link;
-        }
-    }
-
-    // If we reach here it was because we encountered a block
-    // that was exactly the fit we needed. So we set FreeIndex to Bucket
-    // We set Record.Link to ENDOFCHAIN. We leave size unchanged
-
-    // We want to update the last bucket of the chain but not update the length
-    Record.Link = MFS_ENDOFCHAIN;
-
-    // Update the previous bucket to MFS_ENDOFCHAIN
-    if (MfsSetBucketLink(FileSystem, PreviousBucket, &Record, 0) != OsSuccess) {
-        ERROR("Failed to update link for bucket %u", PreviousBucket);
-        return OsError;
-    }
-    
-    // Update the master-record and we are done
-    Mfs->MasterRecord.FreeBucket = Bucket;
-    return MfsUpdateMasterRecord(FileSystem);
-}
-
-/* MfsFreeBuckets
- * Frees an entire chain of buckets that has been allocated for a file-record */
-OsStatus_t
-MfsFreeBuckets(
-    _In_ FileSystemDescriptor_t*    FileSystem, 
-    _In_ uint32_t                   StartBucket,
-    _In_ uint32_t                   StartLength)
-{
-    MfsInstance_t*  Mfs = (MfsInstance_t*)FileSystem->ExtensionData;
-    uint32_t        PreviousBucket;
-    MapRecord_t     Record;
-
-    TRACE("MfsFreeBuckets(Bucket %u, Length %u)", StartBucket, StartLength);
-
-    if (StartLength == 0) {
-        return OsError;
-    }
-
-    // Essentially there is two algorithms we can deploy here
-    // The quick one - Which is just to add the allocated bucket list
-    // to the free and set the last allocated to point to the first free
-    // OR there is the slow one that makes sure that buckets are <in order> as
-    // they get freed, and gets inserted or extended correctly. This will reduce
-    // fragmentation by A LOT
-    Record.Link = StartBucket;
-
-    // Start by iterating to the last bucket
-    PreviousBucket = MFS_ENDOFCHAIN;
-    while (Record.Link != MFS_ENDOFCHAIN) {
-        PreviousBucket = Record.Link;
-        if (MfsGetBucketLink(FileSystem, Record.Link, &Record) != OsSuccess) {
-            ERROR("Failed to retrieve the next bucket-link");
-            return OsError;
-        }
-    }
-
-    // If there was no allocated buckets to start with then do nothing
-    if (PreviousBucket != MFS_ENDOFCHAIN) {
-        Record.Link = Mfs->MasterRecord.FreeBucket;
-
-        // Ok, so now update the pointer to free list
-        if (MfsSetBucketLink(FileSystem, PreviousBucket, &Record, 0)) {
-            ERROR("Failed to update the next bucket-link");
-            return OsError;
-        }
-        Mfs->MasterRecord.FreeBucket = StartBucket;
-        return MfsUpdateMasterRecord(FileSystem);
-    }
-    return OsSuccess;
-}
-
 /* MfsZeroBucket
  * Wipes the given bucket and count with zero values useful for clearing clusters of sectors */
 OsStatus_t
@@ -411,6 +241,7 @@ MfsFileRecordToVfsFile(
     mfsEntry->AllocatedSize                 = nativeEntry->AllocatedSize;
     mfsEntry->StartBucket                   = nativeEntry->StartBucket;
     mfsEntry->StartLength                   = nativeEntry->StartLength;
+    mfsEntry->HashIndex                     = (nativeEntry->Flags & MFS_FILERECORD_INDEXED) ? nativeEntry->SparseMap : 0;
 
     // Convert flags to generic vfs flags and permissions
     MfsFileRecordFlagsToVfsFlags(nativeEntry,
@@ -436,6 +267,12 @@ MfsUpdateRecord(
 
     TRACE("MfsUpdateEntry(File %s)", MStringRaw(entry->Base.Name));
 
+    // Records are written immediately, so the map changes they depend on go first
+    osStatus = MfsFlushMetadata(fileSystem);
+    if (osStatus != OsSuccess) {
+        goto Cleanup;
+    }
+
     // Read the stored data bucket where the record is
     if (MfsReadSectors(fileSystem, mfs->TransferBuffer.handle, 0,
                        MFS_GETSECTOR(mfs, entry->DirectoryBucket),
@@ -466,6 +303,9 @@ MfsUpdateRecord(
         record->Flags       = entry->NativeFlags | MFS_FILERECORD_INUSE;
         record->StartBucket = entry->StartBucket;
         record->StartLength = entry->StartLength;
+        if (MFS_FILERECORD_TYPE(entry->NativeFlags) == MFS_FILERECORD_DIRECTORY) {
+            record->SparseMap = entry->HashIndex;
+        }
 
         // Update modified / accessed dates
 
@@ -503,15 +343,11 @@ MfsEnsureRecordSpace(
         size_t      NumSectors = (size_t)(DIVUP((SpaceRequired - Entry->AllocatedSize), FileSystem->Disk.descriptor.SectorSize));
         size_t      NumBuckets = DIVUP(NumSectors, Mfs->SectorsPerBucket);
         uint32_t    BucketPointer, PreviousBucketPointer;
+        uint32_t    Hint    = MFS_ENDOFCHAIN;
+        size_t      Reserve = 0;
         MapRecord_t Iterator, Link;
 
-        // Perform the allocation of buckets
-        if (MfsAllocateBuckets(FileSystem, NumBuckets, &Link) != OsSuccess) {
-            ERROR("Failed to allocate %u buckets for file", NumBuckets);
-            return OsDeviceError;
-        }
-
-        // Now iterate to end
+        // Iterate to the end, the new buckets should follow the last run
         BucketPointer         = Entry->StartBucket;
         PreviousBucketPointer = MFS_ENDOFCHAIN;
         while (BucketPointer != MFS_ENDOFCHAIN) {
@@ -523,19 +359,57 @@ MfsEnsureRecordSpace(
             BucketPointer = Iterator.Link;
         }
 
+        // A file that keeps growing is written sequentially, so buckets are reserved
+        // ahead for it. The reservation doubles with the file up to MFS_PREALLOCATION.
+        if (PreviousBucketPointer != MFS_ENDOFCHAIN) {
+            Hint    = PreviousBucketPointer + Iterator.Length;
+            Reserve = MIN((size_t)(Entry->AllocatedSize / BucketSizeBytes), MFS_PREALLOCATION);
+        }
+
+        // Perform the allocation of buckets, without the reservation if space is short
+        if (Reserve > NumBuckets && MfsAllocateBuckets(FileSystem, Hint, Reserve, &Link) == OsSuccess) {
+            NumBuckets = Reserve;
+        }
+        else if (MfsAllocateBuckets(FileSystem, Hint, NumBuckets, &Link) != OsSuccess) {
+            ERROR("Failed to allocate %u buckets for file", NumBuckets);
+            return OsDeviceError;
+        }
+
         // We have a special case if previous == MFS_ENDOFCHAIN
         if (PreviousBucketPointer == MFS_ENDOFCHAIN) {
             // This means file had nothing allocated
             Entry->StartBucket = Link.Link;
             Entry->StartLength = Link.Length;
         }
+        else if (Link.Link == Hint) {
+            // The buckets continue the last run, so it is extended instead of linked
+            MapRecord_t Continued;
+            if (MfsGetBucketLink(FileSystem, Link.Link, &Continued) != OsSuccess) {
+                ERROR("Failed to get link for bucket %u", Link.Link);
+                return OsDeviceError;
+            }
+
+            Iterator.Link    = Continued.Link;
+            Iterator.Length += Continued.Length;
+            if (MfsSetBucketLink(FileSystem, PreviousBucketPointer, &Iterator, 1) != OsSuccess) {
+                ERROR("Failed to extend the run at bucket %u", PreviousBucketPointer);
+                return OsDeviceError;
+            }
+
+            if (PreviousBucketPointer == Entry->StartBucket) {
+                Entry->StartLength = Iterator.Length;
+            }
+        }
         else {
-            if (MfsSetBucketLink(FileSystem, PreviousBucketPointer, &Link, 1) != OsSuccess) {
+            if (MfsSetBucketLink(FileSystem, PreviousBucketPointer, &Link, 0) != OsSuccess) {
                 ERROR("Failed to set link for bucket %u", PreviousBucketPointer);
                 return OsDeviceError;
             }
         }
 
+        // The lengths in the chain changed with the new link
+        MfsInvalidateExtents(Entry);
+
         // Adjust the allocated-size of record
         Entry->AllocatedSize += (NumBuckets * BucketSizeBytes);
         Entry->ActionOnClose = MFS_ACTION_UPDATE;
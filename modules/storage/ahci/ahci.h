@@ -329,7 +329,12 @@ typedef struct AhciPort {
     struct dma_attachment   CommandTableDMA;
     struct dma_attachment   RecievedFisDMA;
 
-    _Atomic(int)            Slots;
+    // Slots tracks the allocated command slots, ActiveSlots the ones that have been
+    // issued to the port and QueuedSlots the subset of those that were issued as
+    // native queued commands.
+    _Atomic(reg32_t)        Slots;
+    _Atomic(reg32_t)        ActiveSlots;
+    _Atomic(reg32_t)        QueuedSlots;
     int                     SlotCount;
     list_t                  Transactions;
 } AhciPort_t;
@@ -416,16 +421,29 @@ AhciPortStart(
     _In_ AhciController_t*  controller,
     _In_ AhciPort_t*        port);
 
-OsStatus_t
+/* AhciPortAllocateCommandSlot
+ * Allocates a free command slot on the port. Native queued commands and non-queued
+ * commands are never in flight at the same time, so OsBusy is returned if the slot
+ * cannot be used right now. */
+__EXTERN OsStatus_t
 AhciPortAllocateCommandSlot(
     _In_  AhciPort_t* port,
+    _In_  int         nqc,
     _Out_ int*        slotOut);
 
-void
+/* AhciPortFreeCommandSlot
+ * Releases a command slot allocated by AhciPortAllocateCommandSlot. */
+__EXTERN void
 AhciPortFreeCommandSlot(
     _In_ AhciPort_t* port,
     _In_ int         slot);
 
+/* AhciPortGetCommandTable
+ * Retrieves the command table that belongs to the command slot, each slot has
+ * its own table so commands can be built while others are in flight. */
+#define AhciPortGetCommandTable(port, slot) \
+    ((AHCICommandTable_t*)((uint8_t*)(port)->CommandTableDMA.buffer + ((slot) * AHCI_COMMAND_TABLE_SIZE)))
+
 /* AhciPortStartCommandSlot
  * Starts a command slot on the given port */
 __EXTERN void
@@ -64,14 +64,6 @@ static void __DumpCurrentState(
           port->Registers->SACT);
 }
 
-static int __CommandIsNQC(uint8_t command)
-{
-    if (command == AtaFPDmaReadQueued || command == AtaFPDmaWriteQueued) {
-        return 1;
-    }
-    return 0;
-}
-
 static void __BuildPRDTTable(
     _In_  AhciTransaction_t*  transaction,
     _In_  AHCICommandTable_t* commandTable,
@@ -130,7 +122,9 @@ static void __BuildPRDTTable(
     }
 
     // Set IOC on the last PRDT entry
-    commandTable->PrdtEntry[i].Descriptor |= AHCI_PRDT_IOC;
+    if (i > 0) {
+        commandTable->PrdtEntry[i - 1].Descriptor |= AHCI_PRDT_IOC;
+    }
     *prdtCountOut = i;
 }
 
@@ -151,7 +145,7 @@ static size_t __PrepareCommandSlot(
 
     // Get a reference to the command slot and reset the data in the command table
     commandList   = (AHCICommandList_t*)port->CommandListDMA.buffer;
-    commandTable  = (AHCICommandTable_t*)port->CommandTableDMA.buffer;
+    commandTable  = AhciPortGetCommandTable(port, commandSlot);
     commandHeader = &commandList->Headers[commandSlot];
 
     // Build the PRDT table
@@ -160,8 +154,9 @@ static size_t __PrepareCommandSlot(
     // Update command table to the new command
     commandHeader->PRDByteCount = 0;
     commandHeader->TableLength  = (uint16_t)(prdtCount & 0xFFFF);
-    TRACE("__PrepareCommandSlot returns=%" PRIuIN, bytesQueued - transaction->BytesLeft);
-    return bytesQueued - transaction->BytesLeft;
+    transaction->BytesQueued = bytesQueued - transaction->BytesLeft;
+    TRACE("__PrepareCommandSlot returns=%" PRIuIN, transaction->BytesQueued);
+    return transaction->BytesQueued;
 }
 
 static OsStatus_t __DispatchCommand(
@@ -203,7 +198,7 @@ static OsStatus_t __DispatchCommand(
     }
 
     commandList   = (AHCICommandList_t*)port->CommandListDMA.buffer;
-    commandTable  = (AHCICommandTable_t*)port->CommandTableDMA.buffer;
+    commandTable  = AhciPortGetCommandTable(port, commandSlot);
     commandHeader = &commandList->Headers[commandSlot];
 
     if (ataCommand != NULL) {
@@ -237,7 +232,7 @@ static OsStatus_t __DispatchCommand(
 
     TRACE("__DispatchCommand transaction->Slot=%u, commandHeader->Flags=0x%x",
           commandSlot, commandHeader->Flags);
-    AhciPortStartCommandSlot(port, commandSlot, __CommandIsNQC(transaction->Command));
+    AhciPortStartCommandSlot(port, commandSlot, AhciCommandIsQueued(transaction->Command));
 
 #ifdef __TRACE
     // Dump state
@@ -267,6 +262,7 @@ PrintTaskDataErrorString(uint8_t taskDataError)
 static void __FillRegisterFIS(
     _In_ AhciTransaction_t* transaction,
     _In_ FISRegisterH2D_t*  registerH2D,
+    _In_ int                commandSlot,
     _In_ int                bytesQueued,
     _In_ size_t             sectorSize,
     _In_ int                addressingMode)
@@ -285,6 +281,15 @@ static void __FillRegisterFIS(
     registerH2D->Command = LOBYTE(transaction->Command);
     registerH2D->Device  = FIS_REGISTER_H2D_DEVICE_LBAMODE | ((LOBYTE(deviceLun) & 0x1) << 4);
     registerH2D->Count   = (uint16_t)sectorCount;
+
+    // Native queued commands carry the sector count in the features register and
+    // the tag, which is the command slot, in bits 7:3 of the count register
+    if (AhciCommandIsQueued(transaction->Command)) {
+        registerH2D->FeaturesLow  = LOBYTE(sectorCount);
+        registerH2D->FeaturesHigh = (uint8_t)((sectorCount >> 8) & 0xFF);
+        registerH2D->Count        = (uint16_t)((commandSlot & 0x1F) << 3);
+        registerH2D->Device       = FIS_REGISTER_H2D_DEVICE_LBAMODE;
+    }
     
     // Handle LBA to CHS translation if disk uses
     // the CHS scheme
@@ -327,7 +332,7 @@ AhciDispatchRegisterFIS(
     
     // Initialize the command
     bytesQueued = __PrepareCommandSlot(port, transaction, transaction->Target.SectorSize, commandSlot);
-    __FillRegisterFIS(transaction, &fis, bytesQueued,
+    __FillRegisterFIS(transaction, &fis, commandSlot, bytesQueued,
                       transaction->Target.SectorSize,
                       transaction->Target.AddressingMode);
     
@@ -344,7 +349,7 @@ AhciDispatchRegisterFIS(
 
     // Prefetch can only be enabled when PMP == 0 and !NQC. Also cannot be enabled when
     // FIS-based switching is used
-    if (!transaction->Target.PortMultiplier && !__CommandIsNQC(transaction->Command)) {
+    if (!transaction->Target.PortMultiplier && !AhciCommandIsQueued(transaction->Command)) {
         flags |= DISPATCH_PREFETCH;
     }
 
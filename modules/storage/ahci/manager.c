@@ -273,6 +273,23 @@ HandleIdentifyCommand(
         device->AddressingMode = 0; // CHS
     }
 
+    // Native command queueing requires support from both the device and the HBA, and
+    // is only used with LBA48 DMA transfers. The tag of a queued command is the command
+    // slot, so the slots in use on the port are limited by the device queue depth.
+    if (deviceInformation->SATACapabilities != 0xFFFF &&
+        (deviceInformation->SATACapabilities & (1 << 8)) &&
+        (device->Controller->Registers->Capabilities & AHCI_CAPABILITIES_SNCQ) &&
+        device->HasDMAEngine && device->AddressingMode == AHCI_DEVICE_MODE_LBA48) {
+        device->HasNCQ     = 1;
+        device->QueueDepth = (deviceInformation->QueueDepth & 0x1F) + 1;
+        device->Port->SlotCount = MIN(device->Port->SlotCount, device->QueueDepth);
+    }
+    else {
+        device->HasNCQ     = 0;
+        device->QueueDepth = 1;
+    }
+    TRACE("HandleIdentifyCommand HasNCQ=%i, QueueDepth=%i", device->HasNCQ, device->QueueDepth);
+
     // Calculate sector size if neccessary
     if (deviceInformation->SectorSize & (1 << 12)) {
         device->SectorSize = deviceInformation->WordsPerLogicalSector * 2;
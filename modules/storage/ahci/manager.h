@@ -60,6 +60,8 @@ typedef struct AhciDevice {
 
     DeviceType_t      Type;
     int               HasDMAEngine;
+    int               HasNCQ;           // READ/WRITE FPDMA QUEUED can be used
+    int               QueueDepth;
     size_t            SectorSize;
     uint64_t          SectorCount;
     
@@ -75,6 +77,22 @@ typedef struct AhciDevice {
 #define AHCI_DEVICE_MODE_LBA28  1
 #define AHCI_DEVICE_MODE_LBA48  2
 
+/**
+ * A vectored request from the storage submit call. Each segment is split into
+ * transactions, and the request completes when the last of them finishes.
+ */
+typedef struct AhciRequest {
+    element_t              Header;
+    UUId_t                 Id;
+    UUId_t                 DeviceId;
+    unsigned int           Flags;
+    int                    TransactionsLeft;
+    size_t                 SectorsTransferred;
+    OsStatus_t             Status;
+    struct gracht_message* Waiter;      // A blocking poll waiting for completion
+    struct gracht_message  DeferredMessage[];
+} AhciRequest_t;
+
 typedef struct AhciTransation {
     element_t             Header;
     UUId_t                Id;
@@ -98,9 +116,12 @@ typedef struct AhciTransation {
     size_t                SectorsTransferred;
     int                   SectorAlignment;
     size_t                BytesLeft;
+    size_t                BytesQueued;   // Bytes in the currently dispatched command
     
     int                   SgIndex;
     size_t                SgOffset;
+
+    AhciRequest_t*        Request;       // Set when the transaction is part of a submit
     
     struct gracht_message DeferredMessage[];
 } AhciTransaction_t;
@@ -161,6 +182,16 @@ AhciTransactionHandleResponse(
         _In_ AhciTransaction_t* transaction,
         _In_ size_t             bytesTransferred);
 
+/**
+ * AhciCommandIsQueued
+ * * Returns whether or not the command is a native queued command (FPDMA).
+ */
+static inline int AhciCommandIsQueued(
+        _In_ AtaCommand_t command)
+{
+    return command == AtaFPDmaReadQueued || command == AtaFPDmaWriteQueued;
+}
+
 static inline void __SetTransferKey(
         _In_ AhciTransaction_t* transaction,
         _In_ int                key)
@@ -297,7 +297,7 @@ AhciPortRebase(
 
         PhysicalAddress           += AHCI_COMMAND_TABLE_SIZE;
         SgTable.entries[j].length -= AHCI_COMMAND_TABLE_SIZE;
-        if (!SgTable.entries[j].length) {
+        if (!SgTable.entries[j].length && (j + 1) < SgTable.count) {
             j++;
             PhysicalAddress = SgTable.entries[j].address;
         }
@@ -442,6 +442,14 @@ AhciPortStartCommandSlot(
     _In_ int         nqc)
 {
     reg32_t bitIndex = (1U << slot);
+
+    // Mark the slot active before issuing it, the interrupt handler only completes
+    // slots that are marked as active
+    if (nqc) {
+        atomic_fetch_or(&port->QueuedSlots, bitIndex);
+    }
+    atomic_fetch_or(&port->ActiveSlots, bitIndex);
+
     if (nqc) {
         WRITE_VOLATILE(port->Registers->SACT, bitIndex);
     }
@@ -451,34 +459,47 @@ AhciPortStartCommandSlot(
 OsStatus_t
 AhciPortAllocateCommandSlot(
     _In_  AhciPort_t* port,
+    _In_  int         nqc,
     _Out_ int*        slotOut)
 {
-    OsStatus_t osStatus = OsError;
-    int        i;
-    
-    while (osStatus != OsSuccess) {
-        int slots = atomic_load(&port->Slots);
-        
-        for (i = 0; i < port->SlotCount; i++) {
-            int swapped;
-
-            // Check availability status on this command slot
-            if (slots & (1 << i)) {
-                continue;
-            }
+    reg32_t slots = atomic_load(&port->Slots);
+    int     i;
+
+    TRACE("AhciPortAllocateCommandSlot(port=%i, nqc=%i)", port->Id, nqc);
 
-            swapped = atomic_compare_exchange_strong(&port->Slots, &slots, slots | (1 << i));
-            if (!swapped) {
-                i--;
-                continue;
+    for (i = 0; i < port->SlotCount; i++) {
+        // A non-queued command must wait for the port to go idle, and queued commands
+        // must wait for any non-queued command to complete. This is checked against
+        // every reload of the slots
+        if (nqc) {
+            if (slots & ~atomic_load(&port->QueuedSlots)) {
+                return OsBusy;
             }
+        }
+        else if (slots) {
+            return OsBusy;
+        }
+
+        // Check availability status on this command slot
+        if (slots & (1U << i)) {
+            continue;
+        }
+
+        if (!atomic_compare_exchange_strong(&port->Slots, &slots, slots | (1U << i))) {
+            // Slots has been reloaded, check this slot again
+            i--;
+            continue;
+        }
 
-            osStatus = OsSuccess;
-            *slotOut = i;
-            break;
+        // Reserve the slot as a queued slot right away to keep non-queued commands
+        // out until it has completed
+        if (nqc) {
+            atomic_fetch_or(&port->QueuedSlots, (1U << i));
         }
+        *slotOut = i;
+        return OsSuccess;
     }
-    return osStatus;
+    return OsBusy;
 }
 
 void
@@ -486,14 +507,17 @@ AhciPortFreeCommandSlot(
     _In_ AhciPort_t* port,
     _In_ int         slot)
 {
-    // simply just clear it
-    atomic_fetch_xor(&port->Slots, (1 << slot));
+    reg32_t bitIndex = (1U << slot);
+    atomic_fetch_and(&port->ActiveSlots, ~bitIndex);
+    atomic_fetch_and(&port->QueuedSlots, ~bitIndex);
+    atomic_fetch_and(&port->Slots, ~bitIndex);
 }
 
 static inline void __UpdateTransaction(
         _In_ AhciController_t* controller,
         _In_ AhciPort_t*       port,
-        _In_ int               portSlot)
+        _In_ int               portSlot,
+        _In_ int               nqc)
 {
     AHCICommandList_t*   commandList;
     AHCICommandHeader_t* commandHeader;
@@ -510,7 +534,15 @@ static inline void __UpdateTransaction(
     commandList   = (AHCICommandList_t*)port->CommandListDMA.buffer;
     commandHeader = &commandList->Headers[portSlot];
 
-    bytesTransferred = commandHeader->PRDByteCount;
+    // The PRD byte count is not required to be valid for native queued commands, for
+    // those the data phase is only complete once the device clears the bit in SActive
+    // which means everything we queued has been transferred.
+    if (nqc) {
+        bytesTransferred = transaction->BytesQueued;
+    }
+    else {
+        bytesTransferred = commandHeader->PRDByteCount;
+    }
 
     // Handle transaction completion, release slot, queue up a new command if any
     // and then handle the event
@@ -525,7 +557,10 @@ AhciPortInterruptHandler(
 {
     reg32_t interruptStatus = atomic_exchange(&controller->InterruptResource.PortInterruptStatus[port->Index], 0);
     reg32_t doneCommands;
+    reg32_t activeSlots;
+    reg32_t queuedSlots;
     reg32_t sact;
+    reg32_t ci;
     int     i;
 
     TRACE("AhciPortInterruptHandler(Port %i, Interrupt Status 0x%x)", port->Id, interruptStatus);
@@ -597,18 +632,25 @@ handler_loop:
         }
     }
 
-    // Get completed commands, by using our own slot-status
-    sact = READ_VOLATILE(port->Registers->SACT);
-    doneCommands = atomic_load(&port->Slots) ^ sact;
-    TRACE("DoneCommands(0x%x) <= SlotStatus(0x%x) ^ AtaActive(0x%x)",
-          doneCommands, atomic_load(&port->Slots), sact);
-
-    // Check for command completion by iterating through the command slots
-    if (doneCommands != 0) {
-        for (i = 0; i < port->SlotCount; i++) {
-            if (doneCommands & (1 << i)) {
-                __UpdateTransaction(controller, port, i);
-            }
+    // Get completed commands, an issued command is done once the port has cleared its
+    // bit in CommandIssue and, for native queued commands, the device has cleared it
+    // in SActive. Queued commands complete in whichever order the device chooses.
+    sact         = READ_VOLATILE(port->Registers->SACT);
+    ci           = READ_VOLATILE(port->Registers->CI);
+    activeSlots  = atomic_load(&port->ActiveSlots);
+    queuedSlots  = atomic_load(&port->QueuedSlots);
+    doneCommands = activeSlots & ~(sact | ci);
+    TRACE("DoneCommands(0x%x) <= ActiveSlots(0x%x) & ~(AtaActive(0x%x) | CommandIssue(0x%x))",
+          doneCommands, activeSlots, sact, ci);
+
+    // Check for command completion by iterating through the command slots. The slot
+    // is retired before the transaction is handled, as the transaction may be requeued
+    // into the same slot.
+    for (i = 0; doneCommands != 0 && i < port->SlotCount; i++) {
+        if (doneCommands & (1U << i)) {
+            doneCommands &= ~(1U << i);
+            atomic_fetch_and(&port->ActiveSlots, ~(1U << i));
+            __UpdateTransaction(controller, port, i, (queuedSlots & (1U << i)) != 0);
         }
     }
 
@@ -35,30 +35,37 @@
 #include "ctt_driver_service_server.h"
 #include "ctt_storage_service_server.h"
 
+extern gracht_server_t* __crt_get_module_server(void);
+
 static UUId_t g_nextTransactionId = 0;
+static UUId_t g_nextRequestId     = 1;
+static list_t g_requests          = LIST_INIT;
 
 static struct __AhciCommandTableEntry {
     int          Direction;
     int          DMA;
+    int          NCQ;
     int          AddressingMode;
     AtaCommand_t Command;
     size_t       SectorAlignment;
     size_t       MaxSectors;
 } CommandTable[] = {
-    { __STORAGE_OPERATION_READ, 0, 2, AtaPIOReadExt, 1, 0xFFFF },
-    { __STORAGE_OPERATION_READ, 0, 1, AtaPIORead, 1, 0xFF },
-    { __STORAGE_OPERATION_READ, 0, 0, AtaPIORead, 1, 0xFF },
-    { __STORAGE_OPERATION_READ, 1, 2, AtaDMAReadExt, 1, 0xFFFF },
-    { __STORAGE_OPERATION_READ, 1, 1, AtaDMARead, 1, 0xFF },
-    { __STORAGE_OPERATION_READ, 1, 0, AtaDMARead, 1, 0xFF },
+    { __STORAGE_OPERATION_READ, 0, 0, 2, AtaPIOReadExt, 1, 0xFFFF },
+    { __STORAGE_OPERATION_READ, 0, 0, 1, AtaPIORead, 1, 0xFF },
+    { __STORAGE_OPERATION_READ, 0, 0, 0, AtaPIORead, 1, 0xFF },
+    { __STORAGE_OPERATION_READ, 1, 1, 2, AtaFPDmaReadQueued, 1, 0xFFFF },
+    { __STORAGE_OPERATION_READ, 1, 0, 2, AtaDMAReadExt, 1, 0xFFFF },
+    { __STORAGE_OPERATION_READ, 1, 0, 1, AtaDMARead, 1, 0xFF },
+    { __STORAGE_OPERATION_READ, 1, 0, 0, AtaDMARead, 1, 0xFF },
     
-    { __STORAGE_OPERATION_WRITE, 0, 2, AtaPIOWriteExt, 1, 0xFFFF },
-    { __STORAGE_OPERATION_WRITE, 0, 1, AtaPIOWrite, 1, 0xFF },
-    { __STORAGE_OPERATION_WRITE, 0, 0, AtaPIOWrite, 1, 0xFF },
-    { __STORAGE_OPERATION_WRITE, 1, 2, AtaDMAWriteExt, 1, 0xFFFF },
-    { __STORAGE_OPERATION_WRITE, 1, 1, AtaDMAWrite, 1, 0xFF },
-    { __STORAGE_OPERATION_WRITE, 1, 0, AtaDMAWrite, 1, 0xFF },
-    { -1, -1, -1, 0, 0, 0 }
+    { __STORAGE_OPERATION_WRITE, 0, 0, 2, AtaPIOWriteExt, 1, 0xFFFF },
+    { __STORAGE_OPERATION_WRITE, 0, 0, 1, AtaPIOWrite, 1, 0xFF },
+    { __STORAGE_OPERATION_WRITE, 0, 0, 0, AtaPIOWrite, 1, 0xFF },
+    { __STORAGE_OPERATION_WRITE, 1, 1, 2, AtaFPDmaWriteQueued, 1, 0xFFFF },
+    { __STORAGE_OPERATION_WRITE, 1, 0, 2, AtaDMAWriteExt, 1, 0xFFFF },
+    { __STORAGE_OPERATION_WRITE, 1, 0, 1, AtaDMAWrite, 1, 0xFF },
+    { __STORAGE_OPERATION_WRITE, 1, 0, 0, AtaDMAWrite, 1, 0xFF },
+    { -1, -1, -1, -1, 0, 0, 0 }
 };
 
 static OsStatus_t __AllocateCommandSlot(
@@ -70,7 +77,7 @@ static OsStatus_t __AllocateCommandSlot(
 
     // OK so the transaction we just recieved needs to be queued up,
     // so we must initally see if we can allocate a new slot on the port
-    status = AhciPortAllocateCommandSlot(port, &portSlot);
+    status = AhciPortAllocateCommandSlot(port, AhciCommandIsQueued(transaction->Command), &portSlot);
 
     __SetTransferKey(transaction, portSlot);
     if (status == OsSuccess) {
@@ -79,10 +86,21 @@ static OsStatus_t __AllocateCommandSlot(
     else {
         transaction->State = TransactionQueued;
     }
-    list_append(&port->Transactions, &transaction->Header);
     return status;
 }
 
+static int __HasQueuedTransactions(
+        _In_ AhciPort_t* port)
+{
+    foreach(element, &port->Transactions) {
+        AhciTransaction_t* transaction = (AhciTransaction_t*)element->value;
+        if (transaction->State == TransactionQueued) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 static OsStatus_t __QueueTransaction(
     _In_ AhciController_t*  controller,
     _In_ AhciPort_t*        port,
@@ -93,6 +111,18 @@ static OsStatus_t __QueueTransaction(
     TRACE("__QueueTransaction(controller=0x%" PRIxIN ", port=0x%" PRIxIN ", transaction=0x%" PRIxIN ")",
           controller, port, transaction);
 
+    // Transactions are tracked by the port from the first time they are queued, those
+    // that could not get a slot are dispatched once a slot is freed. New transactions
+    // must queue up behind those to keep a non-queued command from being starved.
+    if (transaction->State == TransactionCreated) {
+        int waiting = __HasQueuedTransactions(port);
+        list_append(&port->Transactions, &transaction->Header);
+        if (waiting) {
+            transaction->State = TransactionQueued;
+            goto exit;
+        }
+    }
+
     // update header with the slot
     if (__GetTransferKey(transaction) == -1) {
         if (__AllocateCommandSlot(port, transaction) != OsSuccess) {
@@ -132,12 +162,13 @@ AhciTransactionDestroy(
 
     portSlot = __GetTransferKey(transaction);
     if (portSlot != -1) {
-        // we need port
+        AhciPortFreeCommandSlot(port, portSlot);
     }
 
     // Detach from our buffer reference
-    list_remove(&port->Transactions, &transaction->Header);
-    AhciPortFreeCommandSlot(port, portSlot);
+    if (transaction->State != TransactionCreated) {
+        list_remove(&port->Transactions, &transaction->Header);
+    }
     dma_detach(&transaction->DmaAttachment);
     free(transaction->DmaTable.entries);
     free(transaction);
@@ -252,6 +283,7 @@ static inline struct __AhciCommandTableEntry* __GetCommand(
     while (CommandTable[i].Direction != -1) {
         if (CommandTable[i].Direction      == direction &&
             CommandTable[i].DMA            == device->HasDMAEngine &&
+            CommandTable[i].NCQ            == device->HasNCQ &&
             CommandTable[i].AddressingMode == device->AddressingMode) {
             return &CommandTable[i];
         }
@@ -260,24 +292,25 @@ static inline struct __AhciCommandTableEntry* __GetCommand(
     return NULL;
 }
 
-OsStatus_t
-AhciTransactionStorageCreate(
-    _In_ AhciDevice_t*          device,
-    _In_ struct gracht_message* message,
-    _In_ int                    direction,
-    _In_ uint64_t               sector,
-    _In_ UUId_t                 bufferHandle,
-    _In_ unsigned int           bufferOffset,
-    _In_ size_t                 sectorCount)
+static OsStatus_t __CreateStorageTransaction(
+        _In_  AhciDevice_t*          device,
+        _In_  struct gracht_message* message,
+        _In_  AhciRequest_t*         request,
+        _In_  int                    direction,
+        _In_  uint64_t               sector,
+        _In_  UUId_t                 bufferHandle,
+        _In_  unsigned int           bufferOffset,
+        _In_  size_t                 sectorCount,
+        _Out_ size_t*                sectorsQueued)
 {
     struct __AhciCommandTableEntry* command;
     struct dma_attachment           dmaAttachment;
     AhciTransaction_t*              transaction = NULL;
     OsStatus_t                      status;
-    TRACE("AhciTransactionStorageCreate(device=0x%" PRIxIN ", sector=0x%" PRIxIN ", sectorCount=0x%" PRIxIN ", direction=%i)",
+    TRACE("__CreateStorageTransaction(device=0x%" PRIxIN ", sector=0x%" PRIxIN ", sectorCount=0x%" PRIxIN ", direction=%i)",
           device, sector, sectorCount, direction);
 
-    if (!device) {
+    if (!device || sector >= device->SectorCount) {
         status = OsInvalidParameters;
         goto exit;
     }
@@ -298,7 +331,7 @@ AhciTransactionStorageCreate(
     // Set upper bound on transaction
     if ((transaction->Sector + sectorCount) >= device->SectorCount) {
         sectorCount = device->SectorCount - transaction->Sector;
-        TRACE("AhciTransactionStorageCreate truncated sectorCount=" PRIxIN ", device->SectorCount=%" PRIuIN,
+        TRACE("__CreateStorageTransaction truncated sectorCount=" PRIxIN ", device->SectorCount=%" PRIuIN,
               sectorCount, device->SectorCount);
     }
     
@@ -312,9 +345,19 @@ AhciTransactionStorageCreate(
     transaction->Command = command->Command;
     transaction->SectorAlignment = command->SectorAlignment;
     transaction->BytesLeft = MIN(sectorCount, command->MaxSectors) * device->SectorSize;
+    *sectorsQueued = MIN(sectorCount, command->MaxSectors);
+
+    // Requests are referenced by each of their transactions until they finish
+    if (request) {
+        transaction->Request = request;
+        request->TransactionsLeft++;
+    }
 
     // The transaction is now prepared and ready for the dispatch
     status = __QueueTransaction(device->Controller, device->Port, transaction);
+    if (status != OsSuccess && request) {
+        request->TransactionsLeft--;
+    }
 
 exit:
     if (status != OsSuccess && device && transaction) {
@@ -323,6 +366,21 @@ exit:
     return status;
 }
 
+OsStatus_t
+AhciTransactionStorageCreate(
+    _In_ AhciDevice_t*          device,
+    _In_ struct gracht_message* message,
+    _In_ int                    direction,
+    _In_ uint64_t               sector,
+    _In_ UUId_t                 bufferHandle,
+    _In_ unsigned int           bufferOffset,
+    _In_ size_t                 sectorCount)
+{
+    size_t sectorsQueued;
+    return __CreateStorageTransaction(device, message, NULL, direction, sector,
+        bufferHandle, bufferOffset, sectorCount, &sectorsQueued);
+}
+
 void ctt_storage_transfer_invocation(struct gracht_message* message, const UUId_t deviceId,
         const enum sys_transfer_direction direction, const unsigned int sectorLow, const unsigned int sectorHigh,
         const UUId_t bufferId, const size_t offset, const size_t sectorCount)
@@ -341,6 +399,164 @@ void ctt_storage_transfer_invocation(struct gracht_message* message, const UUId_
     }
 }
 
+// Results are only released by poll, so a client that never polls would keep them
+// around forever. Drop the oldest finished request of a client past the limit
+static void __PruneFinishedRequests(
+        _In_ int client)
+{
+    AhciRequest_t* oldest   = NULL;
+    int            finished = 0;
+
+    foreach(element, &g_requests) {
+        AhciRequest_t* request = (AhciRequest_t*)element->value;
+        if (request->TransactionsLeft || request->DeferredMessage[0].client != client) {
+            continue;
+        }
+
+        if (!oldest) {
+            oldest = request;
+        }
+        finished++;
+    }
+
+    if (finished > __STORAGE_MAX_FINISHED) {
+        WARNING("__PruneFinishedRequests dropping unpolled request %u", oldest->Id);
+        list_remove(&g_requests, &oldest->Header);
+        free(oldest);
+    }
+}
+
+static void __CompleteRequest(
+        _In_ AhciRequest_t* request)
+{
+    int release = 0;
+
+    TRACE("__CompleteRequest(request=%u, status=%u, sectorsTransferred=%" PRIuIN ")",
+          request->Id, request->Status, request->SectorsTransferred);
+
+    if (request->Flags & __STORAGE_SUBMIT_NOTIFY) {
+        ctt_storage_event_transfer_complete_single(__crt_get_module_server(), request->DeferredMessage[0].client,
+                                                   request->DeviceId, request->Id, request->Status,
+                                                   request->SectorsTransferred);
+        release = 1;
+    }
+
+    if (request->Waiter) {
+        ctt_storage_poll_response(request->Waiter, request->Status, request->SectorsTransferred);
+        free(request->Waiter);
+        release = 1;
+    }
+
+    // Otherwise the result is kept until it is polled
+    if (release) {
+        list_remove(&g_requests, &request->Header);
+        free(request);
+    }
+    else {
+        __PruneFinishedRequests(request->DeferredMessage[0].client);
+    }
+}
+
+static void __ReleaseRequest(
+        _In_ AhciRequest_t* request)
+{
+    if (--request->TransactionsLeft == 0) {
+        __CompleteRequest(request);
+    }
+}
+
+void ctt_storage_submit_invocation(struct gracht_message* message, const UUId_t deviceId,
+        const enum sys_transfer_direction direction, const uint8_t* segments, const uint32_t segments_count,
+        const unsigned int flags)
+{
+    AhciDevice_t*                   device       = AhciManagerGetDevice(deviceId);
+    const StorageTransferSegment_t* segment      = (const StorageTransferSegment_t*)segments;
+    size_t                          segmentCount = segments_count / sizeof(StorageTransferSegment_t);
+    AhciRequest_t*                  request;
+    size_t                          i;
+
+    if (!device || !segmentCount || segmentCount > __STORAGE_MAX_SEGMENTS ||
+        (segments_count % sizeof(StorageTransferSegment_t))) {
+        ctt_storage_submit_response(message, OsInvalidParameters, UUID_INVALID);
+        return;
+    }
+
+    request = (AhciRequest_t*)malloc(sizeof(AhciRequest_t) + GRACHT_MESSAGE_DEFERRABLE_SIZE(message));
+    if (!request) {
+        ctt_storage_submit_response(message, OsOutOfMemory, UUID_INVALID);
+        return;
+    }
+
+    memset(request, 0, sizeof(AhciRequest_t));
+    ELEMENT_INIT(&request->Header, (void*)(uintptr_t)g_nextRequestId, request);
+    request->Id               = g_nextRequestId++;
+    request->DeviceId         = deviceId;
+    request->Flags            = flags;
+    request->Status           = OsSuccess;
+    request->TransactionsLeft = 1; // Held until all segments are queued
+    gracht_server_defer_message(message, &request->DeferredMessage[0]);
+    list_append(&g_requests, &request->Header);
+
+    // Split the segments into commands the device accepts, the first segment that
+    // can't be queued fails the request but lets the queued ones finish
+    for (i = 0; i < segmentCount && request->Status == OsSuccess; i++) {
+        uint64_t sector       = segment[i].Sector;
+        size_t   bufferOffset = segment[i].BufferOffset;
+        size_t   sectorsLeft  = segment[i].SectorCount;
+
+        while (sectorsLeft) {
+            size_t     sectorsQueued = 0;
+            OsStatus_t status = __CreateStorageTransaction(device, NULL, request, (int)direction, sector,
+                segment[i].BufferHandle, bufferOffset, sectorsLeft, &sectorsQueued);
+            if (status != OsSuccess) {
+                request->Status = status;
+                break;
+            }
+
+            sector       += sectorsQueued;
+            bufferOffset += sectorsQueued * device->SectorSize;
+            sectorsLeft  -= MIN(sectorsLeft, sectorsQueued);
+            if (sector >= device->SectorCount) {
+                break;
+            }
+        }
+    }
+
+    ctt_storage_submit_response(message, OsSuccess, request->Id);
+    __ReleaseRequest(request);
+}
+
+void ctt_storage_poll_invocation(struct gracht_message* message, const UUId_t deviceId,
+        const UUId_t requestId, const uint8_t block)
+{
+    AhciRequest_t* request = list_find_value(&g_requests, (void*)(uintptr_t)requestId);
+
+    if (!request || request->DeviceId != deviceId ||
+        request->DeferredMessage[0].client != message->client) {
+        ctt_storage_poll_response(message, OsDoesNotExist, 0);
+        return;
+    }
+
+    if (request->TransactionsLeft) {
+        if (!block || request->Waiter) {
+            ctt_storage_poll_response(message, OsBusy, 0);
+            return;
+        }
+
+        request->Waiter = (struct gracht_message*)malloc(GRACHT_MESSAGE_DEFERRABLE_SIZE(message));
+        if (!request->Waiter) {
+            ctt_storage_poll_response(message, OsOutOfMemory, 0);
+            return;
+        }
+        gracht_server_defer_message(message, request->Waiter);
+        return;
+    }
+
+    ctt_storage_poll_response(message, request->Status, request->SectorsTransferred);
+    list_remove(&g_requests, &request->Header);
+    free(request);
+}
+
 OsStatus_t
 AhciManagerCancelTransaction(
     _In_ AhciTransaction_t* transaction)
@@ -369,6 +585,15 @@ static OsStatus_t __VerifyRegisterFISD2H(
     FISRegisterD2H_t* result = (FISRegisterD2H_t*)&transaction->Response.RegisterD2H;
     TRACE("__VerifyRegisterFISD2H(transaction=0x%" PRIxIN ")", transaction);
 
+    // Native queued commands complete through a Set Device Bits FIS
+    if (AhciCommandIsQueued(transaction->Command)) {
+        FISDeviceBits_t* deviceBits = &transaction->Response.DeviceBits;
+        if (deviceBits->Status & ATA_STS_DEV_ERROR) {
+            PrintTaskDataErrorString(deviceBits->Error);
+            return OsDeviceError;
+        }
+    }
+
     // Is the error bit set?
     TRACE("__VerifyRegisterFISD2H result->Status=0x%x", result->Status);
     if (result->Status & (ATA_STS_DEV_ERROR | ATA_STS_DEV_FAULT)) {
@@ -387,6 +612,16 @@ static void __FinishTransaction(
     if (transaction->Internal) {
         AhciManagerHandleControlResponse(port, transaction);
     }
+    else if (transaction->Request) {
+        AhciRequest_t* request = transaction->Request;
+        request->SectorsTransferred += transaction->SectorsTransferred;
+        if (status != OsSuccess && request->Status == OsSuccess) {
+            request->Status = status;
+        }
+        AhciTransactionDestroy(port, transaction);
+        __ReleaseRequest(request);
+        return;
+    }
     else {
         ctt_storage_transfer_response(&transaction->DeferredMessage[0],
                                       status, transaction->SectorsTransferred);
@@ -394,6 +629,33 @@ static void __FinishTransaction(
     AhciTransactionDestroy(port, transaction);
 }
 
+static void __DispatchQueuedTransactions(
+        _In_ AhciController_t* controller,
+        _In_ AhciPort_t*       port)
+{
+    element_t* element = list_front(&port->Transactions);
+
+    // Dispatch the transactions waiting for a slot in the order they were
+    // queued, and stop at the first one that still can't get a slot
+    while (element) {
+        AhciTransaction_t* transaction = (AhciTransaction_t*)element->value;
+        OsStatus_t         osStatus;
+
+        element = element->next;
+        if (transaction->State != TransactionQueued) {
+            continue;
+        }
+
+        osStatus = __QueueTransaction(controller, port, transaction);
+        if (osStatus != OsSuccess) {
+            __FinishTransaction(port, transaction, osStatus);
+        }
+        else if (transaction->State == TransactionQueued) {
+            break;
+        }
+    }
+}
+
 void
 AhciTransactionHandleResponse(
     _In_ AhciController_t*  controller,
@@ -421,11 +683,13 @@ AhciTransactionHandleResponse(
     // Is the transaction finished? (Or did it error?)
     if (osStatus != OsSuccess || transaction->BytesLeft == 0) {
         __FinishTransaction(port, transaction, osStatus);
+        __DispatchQueuedTransactions(controller, port);
         return;
     }
 
     osStatus = __QueueTransaction(controller, port, transaction);
     if (osStatus != OsSuccess) {
         __FinishTransaction(port, transaction, osStatus);
+        __DispatchQueuedTransactions(controller, port);
     }
 }
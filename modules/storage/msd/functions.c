@@ -25,11 +25,14 @@
 #include "msd.h"
 #include <ddk/utils.h>
 #include <internal/_ipc.h>
+#include <stdlib.h>
 #include <threads.h>
 
 #include "ctt_driver_service_server.h"
 #include "ctt_storage_service_server.h"
 
+extern gracht_server_t* __crt_get_module_server(void);
+
 extern MsdOperations_t  BulkOperations;
 extern MsdOperations_t  UfiOperations;
 static MsdOperations_t* ProtocolOperations[ProtocolCount] = {
@@ -434,3 +437,145 @@ void ctt_storage_transfer_invocation(struct gracht_message* message, const UUId_
         &sectorsTransferred);
     ctt_storage_transfer_response(message, status, sectorsTransferred);
 }
+
+/**
+ * Vectored requests complete before the submit returns, as the usb transfers are
+ * blocking. The result is kept until it is polled, unless the submitter asked to
+ * be notified.
+ */
+typedef struct MsdRequest {
+    element_t  Header;
+    UUId_t     DeviceId;
+    int        Client;
+    OsStatus_t Status;
+    size_t     SectorsTransferred;
+} MsdRequest_t;
+
+static UUId_t g_nextRequestId = 1;
+static list_t g_requests      = LIST_INIT;
+
+// Keeps only the newest __STORAGE_MAX_FINISHED results of a client, so one that submits
+// without ever polling does not grow the list without bound
+static void
+MsdPruneFinishedRequests(
+    _In_ int client)
+{
+    MsdRequest_t* oldest   = NULL;
+    int           finished = 0;
+
+    foreach(element, &g_requests) {
+        MsdRequest_t* request = (MsdRequest_t*)element->value;
+        if (request->Client != client) {
+            continue;
+        }
+
+        if (!oldest) {
+            oldest = request;
+        }
+        finished++;
+    }
+
+    if (finished > __STORAGE_MAX_FINISHED) {
+        WARNING("MsdPruneFinishedRequests dropping unpolled request %u",
+            (UUId_t)(uintptr_t)oldest->Header.key);
+        list_remove(&g_requests, &oldest->Header);
+        free(oldest);
+    }
+}
+
+static OsStatus_t
+MsdTransferSegment(
+    _In_  MsdDevice_t*                    device,
+    _In_  int                             direction,
+    _In_  const StorageTransferSegment_t* segment,
+    _Out_ size_t*                         sectorsTransferred)
+{
+    uint64_t   sector       = segment->Sector;
+    size_t     bufferOffset = segment->BufferOffset;
+    size_t     sectorsLeft  = segment->SectorCount;
+    OsStatus_t status       = OsSuccess;
+
+    // MsdTransferSectors caps at the command limit, so keep going until the segment is done
+    while (sectorsLeft) {
+        size_t sectorsDone = 0;
+        status = MsdTransferSectors(device, direction, sector, segment->BufferHandle,
+            bufferOffset, sectorsLeft, &sectorsDone);
+        *sectorsTransferred += sectorsDone;
+        if (status != OsSuccess || sectorsDone == 0) {
+            break;
+        }
+
+        sector       += sectorsDone;
+        bufferOffset += sectorsDone * device->Descriptor.SectorSize;
+        sectorsLeft  -= MIN(sectorsLeft, sectorsDone);
+        if (sector >= device->Descriptor.SectorCount) {
+            break;
+        }
+    }
+    return status;
+}
+
+void ctt_storage_submit_invocation(struct gracht_message* message, const UUId_t deviceId,
+        const enum sys_transfer_direction direction, const uint8_t* segments, const uint32_t segments_count,
+        const unsigned int flags)
+{
+    MsdDevice_t*                    device             = MsdDeviceGet(deviceId);
+    const StorageTransferSegment_t* segment            = (const StorageTransferSegment_t*)segments;
+    size_t                          segmentCount       = segments_count / sizeof(StorageTransferSegment_t);
+    OsStatus_t                      status             = OsSuccess;
+    size_t                          sectorsTransferred = 0;
+    MsdRequest_t*                   request;
+    UUId_t                          requestId;
+    size_t                          i;
+
+    if (!device || !segmentCount || segmentCount > __STORAGE_MAX_SEGMENTS ||
+        (segments_count % sizeof(StorageTransferSegment_t))) {
+        ctt_storage_submit_response(message, OsInvalidParameters, UUID_INVALID);
+        return;
+    }
+
+    request = NULL;
+    if (!(flags & __STORAGE_SUBMIT_NOTIFY)) {
+        request = (MsdRequest_t*)malloc(sizeof(MsdRequest_t));
+        if (!request) {
+            ctt_storage_submit_response(message, OsOutOfMemory, UUID_INVALID);
+            return;
+        }
+    }
+
+    for (i = 0; i < segmentCount && status == OsSuccess; i++) {
+        status = MsdTransferSegment(device, (int)direction, &segment[i], &sectorsTransferred);
+    }
+
+    requestId = g_nextRequestId++;
+    ctt_storage_submit_response(message, OsSuccess, requestId);
+    if (flags & __STORAGE_SUBMIT_NOTIFY) {
+        ctt_storage_event_transfer_complete_single(__crt_get_module_server(), message->client,
+            deviceId, requestId, status, sectorsTransferred);
+        return;
+    }
+
+    ELEMENT_INIT(&request->Header, (void*)(uintptr_t)requestId, request);
+    request->DeviceId           = deviceId;
+    request->Client             = message->client;
+    request->Status             = status;
+    request->SectorsTransferred = sectorsTransferred;
+    list_append(&g_requests, &request->Header);
+    MsdPruneFinishedRequests(request->Client);
+}
+
+void ctt_storage_poll_invocation(struct gracht_message* message, const UUId_t deviceId,
+        const UUId_t requestId, const uint8_t block)
+{
+    MsdRequest_t* request = list_find_value(&g_requests, (void*)(uintptr_t)requestId);
+    _CRT_UNUSED(block);
+
+    if (!request || request->DeviceId != deviceId || request->Client != message->client) {
+        ctt_storage_poll_response(message, OsDoesNotExist, 0);
+        return;
+    }
+
+    ctt_storage_poll_response(message, request->Status, request->SectorsTransferred);
+    list_remove(&g_requests, &request->Header);
+    free(request);
+}
@@ -202,8 +202,20 @@ PACKED_TYPESTRUCT(ATAIdentify, {
 	uint32_t SectorCountLBA28;
 
 	/* Obsolete AND i don't care 
-	 * Words 62-79 */
-	uint16_t Obsolete5[18];
+	 * Words 62-74 */
+	uint16_t Obsolete5[13];
+
+	/* 75: Queue Depth
+	 * Bits 0-4: Maximum queue depth - 1 */
+	uint16_t QueueDepth;
+
+	/* 76: Serial ATA Capabilities
+	 * Bit 8: Native Command Queuing Supported
+	 * (0x0000 or 0xFFFF if the device is not a Serial ATA device) */
+	uint16_t SATACapabilities;
+
+	/* 77-79: Serial ATA additional capabilities and features */
+	uint16_t SATAFeatures[3];
 
 	/* 80: Drive Revision 
 	 * - Major */
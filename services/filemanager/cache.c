@@ -33,9 +33,8 @@ struct FileCacheEntry {
     FileSystemEntry_t* file;
 };
 
-static uint64_t      file_hash(const void*);
-static int           file_cmp(const void*, const void*);
-static FileSystem_t* __GetFileSystemFromPath(MString_t* path, MString_t** subPathOut);
+static uint64_t file_hash(const void*);
+static int      file_cmp(const void*, const void*);
 
 static hashtable_t g_openFiles;
 static uint8_t     g_hashKey[16] = {196, 179, 43, 202, 48, 240, 236, 199, 229, 122, 94, 143, 20, 251, 63, 66 };
@@ -69,14 +68,28 @@ VfsCacheGetFile(
     if (!cacheEntry) {
         FileSystemEntry_t* entry   = NULL;
         MString_t*         subPath = NULL;
+        int                dentryState;
 
-        fileSystem = __GetFileSystemFromPath(path, &subPath);
+        // Paths that are known not to exist are only passed on to the filesystem
+        // if they are to be created
+        dentryState = VfsDentryLookup(path);
+        if (dentryState == VFS_DENTRY_NEGATIVE && !(options & (__FILE_CREATE | __FILE_CREATE_RECURSIVE))) {
+            return OsDoesNotExist;
+        }
+
+        fileSystem = VfsDentryGetFileSystem(path, &subPath);
         if (fileSystem == NULL) {
             return OsDoesNotExist;
         }
 
         // Let the module do the rest
-        status = fileSystem->module->OpenEntry(&fileSystem->descriptor, subPath, &entry);
+        if (dentryState == VFS_DENTRY_NEGATIVE) {
+            status = OsDoesNotExist;
+        }
+        else {
+            status = fileSystem->module->OpenEntry(&fileSystem->descriptor, subPath, &entry);
+        }
+
         if (status == OsDoesNotExist && (options & (__FILE_CREATE | __FILE_CREATE_RECURSIVE))) {
             TRACE("[vfs] [cache_get] file was not found, but options are to create 0x%x", options);
             status  = fileSystem->module->CreatePath(&fileSystem->descriptor, subPath, options, &entry);
@@ -84,9 +97,17 @@ VfsCacheGetFile(
         }
 
         if (status != OsSuccess) {
+            if (status == OsDoesNotExist) {
+                VfsDentryUpdate(path, 0);
+            }
             WARNING("[vfs] [cache_get] %s opening/creation failed with code: %i", MStringRaw(path), status);
+            MStringDestroy(subPath);
             return status;
         }
+        VfsDentryUpdate(path, 1);
+        if (created) {
+            VfsNotifyPathChanged(path);
+        }
 
         entry->System     = (uintptr_t*)fileSystem;
         entry->Path       = MStringCreate((void*)MStringRaw(path), StrUTF8);
@@ -124,52 +145,15 @@ VfsCacheRemoveFile(
     entry = hashtable_remove(&g_openFiles, &(struct FileCacheEntry) { .path = path });
     if (entry) {
         MString_t*    subPath;
-        FileSystem_t* fileSystem = __GetFileSystemFromPath(path, &subPath);
+        FileSystem_t* fileSystem = VfsDentryGetFileSystem(path, &subPath);
         if (fileSystem) {
+            VfsPageCacheInvalidate(entry->file);
             fileSystem->module->CloseEntry(&fileSystem->descriptor, entry->file);
             MStringDestroy(subPath);
         }
     }
 }
 
-static FileSystem_t* __GetFileSystemFromPath(MString_t* path, MString_t** subPathOut)
-{
-    element_t* header;
-    MString_t* identifier;
-    MString_t* subPath;
-    int        index;
-
-    // To open a new file we need to find the correct
-    // filesystem identifier and seperate it from it's absolute path
-    index = MStringFind(path, ':', 0);
-    if (index == MSTRING_NOT_FOUND) {
-        return NULL;
-    }
-
-    identifier = MStringSubString(path, 0, index);
-    subPath    = MStringSubString(path, index + 2, -1);
-
-    _foreach(header, VfsGetFileSystems()) {
-        FileSystem_t* fileSystem = (FileSystem_t*)header->value;
-        if (fileSystem->state != FSLoaded) {
-            continue;
-        }
-
-        if (MStringCompare(identifier, fileSystem->identifier, 1)) {
-            MStringDestroy(identifier);
-
-            // set path out and return
-            *subPathOut = subPath;
-            return fileSystem;
-        }
-    }
-
-    // clean up, not found
-    MStringDestroy(identifier);
-    MStringDestroy(subPath);
-    return NULL;
-}
-
 static uint64_t file_hash(const void* element)
 {
     const struct FileCacheEntry* cacheEntry = element;
@@ -0,0 +1,352 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * File and storage service, Dentry Cache implementation
+ *   Remembers which path components exist, and which do not, keyed by (parent, component).
+ *   Mount points are kept in a separate table so the filesystem of a path is found
+ *   without allocating, and negative entries let repeated lookups of missing paths
+ *   complete without asking the filesystem.
+ */
+
+//#define __TRACE
+
+#include <ctype.h>
+#include "include/vfs.h"
+#include <ddk/utils.h>
+#include <ds/hashtable.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Names are compared without case, as the filesystems we support are case-insensitive.
+// Otherwise a negative entry for one spelling would outlive the creation of another.
+struct DentryEntry {
+    UUId_t      parent;
+    const char* name;
+    size_t      length;
+    UUId_t      id;
+    int         state;
+};
+
+struct MountEntry {
+    const char*   name;
+    size_t        length;
+    UUId_t        root;
+    FileSystem_t* fileSystem;
+};
+
+static uint64_t dentry_hash(const void*);
+static int      dentry_cmp(const void*, const void*);
+static uint64_t mount_hash(const void*);
+static int      mount_cmp(const void*, const void*);
+
+static hashtable_t g_dentries;
+static hashtable_t g_mounts;
+static UUId_t      g_nextDentryId = 1;
+static uint64_t    g_hits         = 0;
+static uint64_t    g_negativeHits = 0;
+static uint64_t    g_misses       = 0;
+static uint64_t    g_flushes      = 0;
+
+static uint64_t __HashName(uint64_t hash, const char* name, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)tolower((unsigned char)name[i]);
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static int __CompareName(const char* name1, size_t length1, const char* name2, size_t length2)
+{
+    if (length1 != length2) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < length1; i++) {
+        if (tolower((unsigned char)name1[i]) != tolower((unsigned char)name2[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void __FreeDentry(int index, const void* element, void* context)
+{
+    const struct DentryEntry* dentry = element;
+    _CRT_UNUSED(index);
+    _CRT_UNUSED(context);
+    free((void*)dentry->name);
+}
+
+// Dentries are never evicted one by one, once the cache is full it is dropped
+// as a whole. Mount points are kept and their subtrees are simply rebuilt.
+static void __FlushDentries(void)
+{
+    TRACE("[vfs] [dentry] flushing cache");
+    hashtable_enumerate(&g_dentries, __FreeDentry, NULL);
+    hashtable_destroy(&g_dentries);
+    hashtable_construct(&g_dentries, VFS_DENTRY_CAPACITY / 2,
+                        sizeof(struct DentryEntry), dentry_hash, dentry_cmp);
+    g_flushes++;
+}
+
+static struct MountEntry* __GetMount(const char* path, const char** remainderOut)
+{
+    const char* separator = strchr(path, ':');
+    if (!separator) {
+        return NULL;
+    }
+
+    *remainderOut = separator + 1;
+    return hashtable_get(&g_mounts, &(struct MountEntry) {
+        .name = path, .length = (size_t)(separator - path) });
+}
+
+static const char* __NextComponent(const char* path, size_t* lengthOut)
+{
+    const char* end;
+
+    while (*path == '/') {
+        path++;
+    }
+
+    end = path;
+    while (*end && *end != '/') {
+        end++;
+    }
+
+    *lengthOut = (size_t)(end - path);
+    return *lengthOut ? path : NULL;
+}
+
+static struct DentryEntry* __GetDentry(UUId_t parent, const char* name, size_t length)
+{
+    return hashtable_get(&g_dentries, &(struct DentryEntry) {
+        .parent = parent, .name = name, .length = length });
+}
+
+static struct DentryEntry* __CreateDentry(UUId_t parent, const char* name, size_t length, int state)
+{
+    char* copy = malloc(length + 1);
+    if (!copy) {
+        return NULL;
+    }
+
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    hashtable_set(&g_dentries, &(struct DentryEntry) {
+        .parent = parent, .name = copy, .length = length,
+        .id = g_nextDentryId++, .state = state });
+    return __GetDentry(parent, name, length);
+}
+
+void
+VfsDentryInitialize(void)
+{
+    hashtable_construct(&g_dentries, VFS_DENTRY_CAPACITY / 2,
+                        sizeof(struct DentryEntry), dentry_hash, dentry_cmp);
+    hashtable_construct(&g_mounts, HASHTABLE_MINIMUM_CAPACITY,
+                        sizeof(struct MountEntry), mount_hash, mount_cmp);
+}
+
+void
+VfsDentryMount(
+        _In_ FileSystem_t* fileSystem)
+{
+    TRACE("[vfs] [dentry] mount %s", MStringRaw(fileSystem->identifier));
+    hashtable_set(&g_mounts, &(struct MountEntry) {
+        .name       = MStringRaw(fileSystem->identifier),
+        .length     = MStringLength(fileSystem->identifier),
+        .root       = g_nextDentryId++,
+        .fileSystem = fileSystem });
+}
+
+void
+VfsDentryUnmount(
+        _In_ FileSystem_t* fileSystem)
+{
+    TRACE("[vfs] [dentry] unmount %s", MStringRaw(fileSystem->identifier));
+    if (hashtable_remove(&g_mounts, &(struct MountEntry) {
+            .name   = MStringRaw(fileSystem->identifier),
+            .length = MStringLength(fileSystem->identifier) })) {
+        // The dentries of the filesystem can no longer be reached, drop them
+        // now instead of waiting for the cache to fill up.
+        __FlushDentries();
+    }
+}
+
+FileSystem_t*
+VfsDentryGetFileSystem(
+        _In_  MString_t*  path,
+        _Out_ MString_t** subPathOut)
+{
+    struct MountEntry* mount;
+    const char*        remainder;
+
+    mount = __GetMount(MStringRaw(path), &remainder);
+    if (!mount || mount->fileSystem->state != FSLoaded) {
+        return NULL;
+    }
+
+    // Paths are on the form identifier:/path, the sub-path excludes the leading slash
+    *subPathOut = MStringSubString(path, (int)(remainder - MStringRaw(path)) + 1, -1);
+    return mount->fileSystem;
+}
+
+int
+VfsDentryLookup(
+        _In_ MString_t* path)
+{
+    struct MountEntry*  mount;
+    struct DentryEntry* dentry = NULL;
+    const char*         component;
+    size_t              length;
+    UUId_t              parent;
+
+    mount = __GetMount(MStringRaw(path), &component);
+    if (!mount) {
+        return VFS_DENTRY_UNKNOWN;
+    }
+
+    // A missing component means every path below it is missing too, so the
+    // walk ends at the first negative entry no matter how deep the path is.
+    parent = mount->root;
+    while ((component = __NextComponent(component, &length)) != NULL) {
+        dentry = __GetDentry(parent, component, length);
+        if (!dentry) {
+            g_misses++;
+            return VFS_DENTRY_UNKNOWN;
+        }
+
+        if (dentry->state == VFS_DENTRY_NEGATIVE) {
+            g_negativeHits++;
+            return VFS_DENTRY_NEGATIVE;
+        }
+
+        parent     = dentry->id;
+        component += length;
+    }
+
+    if (!dentry || dentry->state != VFS_DENTRY_POSITIVE) {
+        g_misses++;
+        return VFS_DENTRY_UNKNOWN;
+    }
+    g_hits++;
+    return VFS_DENTRY_POSITIVE;
+}
+
+void
+VfsDentryUpdate(
+        _In_ MString_t* path,
+        _In_ int        exists)
+{
+    struct MountEntry*  mount;
+    struct DentryEntry* dentry;
+    const char*         component;
+    const char*         next;
+    size_t              length;
+    UUId_t              parent;
+
+    TRACE("[vfs] [dentry] update %s, exists=%i", MStringRaw(path), exists);
+
+    mount = __GetMount(MStringRaw(path), &component);
+    if (!mount) {
+        return;
+    }
+
+    if (g_dentries.element_count >= VFS_DENTRY_CAPACITY) {
+        __FlushDentries();
+    }
+
+    // An existing path implies that all its parents exist. A missing path tells us
+    // nothing about its parents, they are only added as placeholders.
+    parent    = mount->root;
+    component = __NextComponent(component, &length);
+    while (component) {
+        size_t nextLength;
+        next = __NextComponent(component + length, &nextLength);
+
+        dentry = __GetDentry(parent, component, length);
+        if (!dentry) {
+            int state = exists ? VFS_DENTRY_POSITIVE : (next ? VFS_DENTRY_UNKNOWN : VFS_DENTRY_NEGATIVE);
+            dentry = __CreateDentry(parent, component, length, state);
+            if (!dentry) {
+                return;
+            }
+        }
+        else if (exists) {
+            dentry->state = VFS_DENTRY_POSITIVE;
+        }
+        else if (!next && dentry->state != VFS_DENTRY_NEGATIVE) {
+            // The entry was removed, give it a new identity so anything cached
+            // below it is orphaned and can't be found again if it is recreated.
+            dentry->state = VFS_DENTRY_NEGATIVE;
+            dentry->id    = g_nextDentryId++;
+        }
+        else if (dentry->state == VFS_DENTRY_NEGATIVE) {
+            // A missing parent already covers this path
+            return;
+        }
+
+        parent    = dentry->id;
+        component = next;
+        length    = nextLength;
+    }
+}
+
+void
+VfsDentryGetStatistics(
+        _In_ OsFileCacheStatistics_t* statistics)
+{
+    statistics->DentryHits         = g_hits;
+    statistics->DentryNegativeHits = g_negativeHits;
+    statistics->DentryMisses       = g_misses;
+    statistics->DentryFlushes      = g_flushes;
+    statistics->DentryCount        = g_dentries.element_count;
+}
+
+static uint64_t dentry_hash(const void* element)
+{
+    const struct DentryEntry* dentry = element;
+    return __HashName(0xCBF29CE484222325ULL ^ ((uint64_t)dentry->parent * 0x9E3779B97F4A7C15ULL),
+                      dentry->name, dentry->length);
+}
+
+static int dentry_cmp(const void* element1, const void* element2)
+{
+    const struct DentryEntry* dentry1 = element1;
+    const struct DentryEntry* dentry2 = element2;
+    if (dentry1->parent != dentry2->parent) {
+        return 1;
+    }
+    return __CompareName(dentry1->name, dentry1->length, dentry2->name, dentry2->length);
+}
+
+static uint64_t mount_hash(const void* element)
+{
+    const struct MountEntry* mount = element;
+    return __HashName(0xCBF29CE484222325ULL, mount->name, mount->length);
+}
+
+static int mount_cmp(const void* element1, const void* element2)
+{
+    const struct MountEntry* mount1 = element1;
+    const struct MountEntry* mount2 = element2;
+    return __CompareName(mount1->name, mount1->length, mount2->name, mount2->length);
+}
@@ -61,45 +61,6 @@ static inline int __IsAccessExclusive(unsigned int access)
     return 0;
 }
 
-static FileSystem_t* __GetFileSystemFromPath(MString_t* path, MString_t** subPathOut)
-{
-    element_t* header;
-    MString_t* identifier;
-    MString_t* subPath;
-    int        index;
-    TRACE("__GetFileSystemFromPath(path=%s)", MStringRaw(path));
-
-    // To open a new file we need to find the correct
-    // filesystem identifier and seperate it from it's absolute path
-    index = MStringFind(path, ':', 0);
-    if (index == MSTRING_NOT_FOUND) {
-        return NULL;
-    }
-
-    identifier = MStringSubString(path, 0, index);
-    subPath    = MStringSubString(path, index + 2, -1);
-
-    _foreach(header, VfsGetFileSystems()) {
-        FileSystem_t* fileSystem = (FileSystem_t*)header->value;
-        if (fileSystem->state != FSLoaded) {
-            continue;
-        }
-
-        if (MStringCompare(identifier, fileSystem->identifier, 1)) {
-            MStringDestroy(identifier);
-
-            // set path out and return
-            *subPathOut = subPath;
-            return fileSystem;
-        }
-    }
-
-    // clean up, not found
-    MStringDestroy(identifier);
-    MStringDestroy(subPath);
-    return NULL;
-}
-
 static OsStatus_t
 VfsIsHandleValid(
     _In_  UUId_t                    processId,
@@ -107,17 +68,15 @@ VfsIsHandleValid(
     _In_  unsigned int              requiredAccess,
     _Out_ FileSystemEntryHandle_t** handleOut)
 {
-    element_t*               header = list_find(&g_fileHandles, (void*)(uintptr_t)handle);
-    FileSystemEntryHandle_t* entry;
+    FileSystemEntryHandle_t* entry = VfsHandleLookup(handle);
     TRACE("VfsIsHandleValid(processId=%u, handle=%u, requiredAccess=0x%x)",
           processId, handle, requiredAccess);
 
-    if (!header) {
+    if (!entry) {
         ERROR("VfsIsHandleValid not found: %u", handle);
         return OsInvalidParameters;
     }
 
-    entry = (FileSystemEntryHandle_t*)header->value;
     if (entry->Owner != processId) {
         ERROR("VfsIsHandleValid Owner of the handle did not match the requester. Access Denied.");
         return OsInvalidPermissions;
@@ -208,6 +167,11 @@ VfsVerifyAccessToPath(
 
     // we should at this point check other handles to see how many have this file
     // opened, and see if there is any other handles using it
+    if (!fileEntry->References) {
+        *existingEntry = fileEntry;
+        return OsSuccess;
+    }
+
     _foreach(element, &g_fileHandles) {
         FileSystemEntryHandle_t* handle = element->value;
         if (handle->Entry == fileEntry) {
@@ -371,6 +335,13 @@ OpenFile(
     entry->Access  = access;
     entry->Options = options;
 
+    status = VfsHandleRegister(entry);
+    if (status != OsSuccess) {
+        FileSystem_t* fileSystem = (FileSystem_t*)entry->Entry->System;
+        fileSystem->module->CloseHandle(&fileSystem->descriptor, entry);
+        entry->Entry->References--;
+        return status;
+    }
     list_append(&g_fileHandles, &entry->header);
 
     *handleOut = id;
@@ -398,7 +369,6 @@ CloseFile(
     FileSystemEntryHandle_t* entryHandle;
     FileSystemEntry_t*       entry;
     OsStatus_t               status;
-    element_t*               header;
     FileSystem_t*            fileSystem;
 
     TRACE("CloseFile handle %u", handle);
@@ -421,10 +391,8 @@ CloseFile(
     }
 
     // remove the entry after flushing
-    header = list_find(&g_fileHandles, (void*)(uintptr_t)handle);
-    if (header) {
-        list_remove(&g_fileHandles, header);
-    }
+    list_remove(&g_fileHandles, &entryHandle->header);
+    VfsHandleUnregister(entryHandle);
 
     // Call the filesystem close-handle to cleanup
     fileSystem = (FileSystem_t*)entryHandle->Entry->System;
@@ -467,30 +435,35 @@ DeletePath(
         return OsDoesNotExist;
     }
     
-    fileSystem = __GetFileSystemFromPath(resolvedPath, &subPath);
-    MStringDestroy(resolvedPath);
+    fileSystem = VfsDentryGetFileSystem(resolvedPath, &subPath);
     if (fileSystem == NULL) {
+        MStringDestroy(resolvedPath);
         return OsDoesNotExist;
     }
+    MStringDestroy(subPath);
 
     // First step is to open the path in exclusive mode
     status = OpenFile(processId, path, __FILE_VOLATILE, __FILE_READ_ACCESS | __FILE_WRITE_ACCESS, &handle);
     if (status == OsSuccess) {
         status = VfsIsHandleValid(processId, handle, 0, &entryHandle);
         if (status != OsSuccess) {
+            MStringDestroy(resolvedPath);
             return status;
         }
 
+        VfsPageCacheInvalidate(entryHandle->Entry);
         status = fileSystem->module->DeleteEntry(&fileSystem->descriptor, entryHandle);
         (void)CloseFile(processId, handle);
     }
 
-    // remove it after closing the handle so we don't keep any references
+    // remove it after closing the handle so we don't keep any references, the
+    // file cache is keyed by the resolved path
     if (status == OsSuccess) {
-        MString_t* pathAsMstring = MStringCreate(path, StrUTF8);
-        VfsCacheRemoveFile(pathAsMstring);
-        MStringDestroy(pathAsMstring);
+        VfsCacheRemoveFile(resolvedPath);
+        VfsDentryUpdate(resolvedPath, 0);
+        VfsNotifyPathChanged(resolvedPath);
     }
+    MStringDestroy(resolvedPath);
     return status;
 }
 
@@ -513,7 +486,7 @@ ReadFile(
     FileSystemEntryHandle_t* entryHandle;
     OsStatus_t               status;
     FileSystem_t*            fileSystem;
-    struct dma_attachment    dmaAttachment;
+    void*                    buffer;
 
     TRACE("[vfs_read] pid => %u, id => %u, b_id => %u, len => %u", 
         processId, handle, bufferHandle, LODWORD(length));
@@ -528,35 +501,35 @@ ReadFile(
         return status;
     }
 
-    // Sanity -> Flush if we wrote and now read
-    if ((entryHandle->LastOperation != __FILE_OPERATION_READ) && __IsEntryFile(entryHandle->Entry)) {
-        (void)Flush(processId, handle);
-    }
-
-    status = dma_attach(bufferHandle, &dmaAttachment);
+    // The buffer stays mapped between transfers, clients usually reuse one buffer
+    status = VfsClientMapBuffer(processId, bufferHandle, offset + length, &buffer);
     if (status != OsSuccess) {
-        ERROR("[vfs_read] [dma_attach] failed: %u", status);
-        return OsInvalidParameters;
+        return status;
     }
-    
-    status = dma_attachment_map(&dmaAttachment, DMA_ACCESS_WRITE);
-    if (status != OsSuccess) {
-        ERROR("[vfs_read] [dma_attachment_map] failed: %u", status);
-        dma_detach(&dmaAttachment);
-        return OsInvalidParameters;
+
+    fileSystem = (FileSystem_t*)entryHandle->Entry->System;
+    if (VfsPageCacheIsCacheable(entryHandle)) {
+        status = VfsPageCacheRead(entryHandle, (uint8_t*)buffer + offset, length, bytesRead);
     }
+    else {
+        // Uncached reads must see data that is still dirty in the page cache, and the
+        // filesystem handle must be positioned as it may have been bypassed
+        if (__IsEntryFile(entryHandle->Entry)) {
+            status = VfsPageCacheFlush(entryHandle->Entry);
+            if (status == OsSuccess) {
+                status = fileSystem->module->SeekInEntry(&fileSystem->descriptor, entryHandle, entryHandle->Position);
+            }
+        }
 
-    fileSystem   = (FileSystem_t*)entryHandle->Entry->System;
-    status = fileSystem->module->ReadEntry(&fileSystem->descriptor, entryHandle, bufferHandle,
-        dmaAttachment.buffer, offset, length, bytesRead);
+        if (status == OsSuccess) {
+            status = fileSystem->module->ReadEntry(&fileSystem->descriptor, entryHandle, bufferHandle,
+                buffer, offset, length, bytesRead);
+        }
+    }
     if (status == OsSuccess) {
         entryHandle->LastOperation  = __FILE_OPERATION_READ;
         entryHandle->Position       += *bytesRead;
     }
-    
-    // Unregister the dma buffer
-    dma_attachment_unmap(&dmaAttachment);
-    dma_detach(&dmaAttachment);
     return status;
 }
 
@@ -572,7 +545,7 @@ WriteFile(
     FileSystemEntryHandle_t* entryHandle;
     OsStatus_t               status;
     FileSystem_t*            fileSystem;
-    struct dma_attachment    dmaAttachment;
+    void*                    buffer;
 
     TRACE("[vfs_write] pid => %u, id => %u, b_id => %u", processId, handle, bufferHandle);
 
@@ -586,27 +559,32 @@ WriteFile(
         return status;
     }
 
-    // Sanity -> Clear read buffer if we are writing
-    if ((entryHandle->LastOperation != __FILE_OPERATION_WRITE) && __IsEntryFile(entryHandle->Entry)) {
-        (void)Flush(processId, handle);
-    }
-
-    status = dma_attach(bufferHandle, &dmaAttachment);
+    // The buffer stays mapped between transfers, clients usually reuse one buffer
+    status = VfsClientMapBuffer(processId, bufferHandle, offset + length, &buffer);
     if (status != OsSuccess) {
-        ERROR("[vfs_write] [dma_attach] failed: %u", status);
-        return OsInvalidParameters;
+        return status;
     }
-    
-    status = dma_attachment_map(&dmaAttachment, DMA_ACCESS_WRITE);
-    if (status != OsSuccess) {
-        ERROR("[vfs_write] [dma_attachment_map] failed: %u", status);
-        dma_detach(&dmaAttachment);
-        return OsInvalidParameters;
+
+    fileSystem = (FileSystem_t*)entryHandle->Entry->System;
+    if (VfsPageCacheIsCacheable(entryHandle)) {
+        status = VfsPageCacheWrite(entryHandle, (uint8_t*)buffer + offset, length, bytesWritten);
     }
+    else {
+        // Uncached writes go straight to the filesystem, so write back and drop the cached
+        // pages of the entry first to keep them from going stale
+        if (__IsEntryFile(entryHandle->Entry)) {
+            status = VfsPageCacheFlush(entryHandle->Entry);
+            if (status == OsSuccess) {
+                VfsPageCacheInvalidate(entryHandle->Entry);
+                status = fileSystem->module->SeekInEntry(&fileSystem->descriptor, entryHandle, entryHandle->Position);
+            }
+        }
 
-    fileSystem   = (FileSystem_t*)entryHandle->Entry->System;
-    status = fileSystem->module->WriteEntry(&fileSystem->descriptor, entryHandle, bufferHandle,
-        dmaAttachment.buffer, offset, length, bytesWritten);
+        if (status == OsSuccess) {
+            status = fileSystem->module->WriteEntry(&fileSystem->descriptor, entryHandle, bufferHandle,
+                buffer, offset, length, bytesWritten);
+        }
+    }
     if (status == OsSuccess) {
         entryHandle->LastOperation  = __FILE_OPERATION_WRITE;
         entryHandle->Position       += *bytesWritten;
@@ -614,10 +592,6 @@ WriteFile(
             entryHandle->Entry->Descriptor.Size.QuadPart = entryHandle->Position;
         }
     }
-    
-    // Unregister the dma buffer
-    dma_attachment_unmap(&dmaAttachment);
-    dma_detach(&dmaAttachment);
     return status;
 }
 
@@ -670,15 +644,6 @@ Seek(
         return status;
     }
 
-    // Flush buffers before seeking
-    if (!(entryHandle->Options & __FILE_VOLATILE) && __IsEntryFile(entryHandle->Entry)) {
-        status = Flush(processId, handle);
-        if (status != OsSuccess) {
-            TRACE("Failed to flush file before seek");
-            return status;
-        }
-    }
-
     // Perform the seek on a file-system level
     fileSystem = (FileSystem_t*)entryHandle->Entry->System;
     status     = fileSystem->module->SeekInEntry(&fileSystem->descriptor, entryHandle, seekOffsetAbs.Full);
@@ -727,31 +692,18 @@ Flush(
 {
     FileSystemEntryHandle_t* entryHandle = NULL;
     OsStatus_t               status;
-    //FileSystem_t *fileSystem;
 
     status = VfsIsHandleValid(processId, handle, 0, &entryHandle);
     if (status != OsSuccess) {
         return status;
     }
 
-    // If no buffering enabled skip, or if not a file skip
-    if ((entryHandle->Options & __FILE_VOLATILE) || !__IsEntryFile(entryHandle->Entry)) {
+    // If not a file skip, otherwise write back the cached pages of the entry. The pages
+    // are shared by all handles of the entry, so volatile handles flush them as well
+    if (!__IsEntryFile(entryHandle->Entry)) {
         return OsSuccess;
     }
-
-    // Empty output buffer 
-    // - But sanitize the buffers first
-    if (entryHandle->OutBuffer != NULL && entryHandle->OutBufferPosition != 0) {
-        size_t BytesWritten = 0;
-#if 0
-        fileSystem = (FileSystem_t*)entryHandle->File->System;
-        status     = fileSystem->Module->WriteFile(&fileSystem->Descriptor, entryHandle, NULL, &BytesWritten);
-#endif
-        if (BytesWritten != entryHandle->OutBufferPosition) {
-            return OsDeviceError;
-        }
-    }
-    return status;
+    return VfsPageCacheFlush(entryHandle->Entry);
 }
 
 
@@ -983,3 +935,30 @@ void sys_file_fsstat_path_invocation(struct gracht_message* message, const UUId_
     struct sys_filesystem_descriptor gdescriptor = { 0 };
     sys_file_fsstat_path_response(message, OsNotSupported, &gdescriptor);
 }
+
+void sys_file_get_cache_stats_invocation(struct gracht_message* message)
+{
+    OsFileCacheStatistics_t     statistics;
+    struct sys_file_cache_stats gstats;
+
+    VfsPageCacheGetStatistics(&statistics);
+    VfsDentryGetStatistics(&statistics);
+    VfsClientGetStatistics(&statistics);
+    gstats.hits            = statistics.Hits;
+    gstats.misses          = statistics.Misses;
+    gstats.readahead_pages = statistics.ReadAheadPages;
+    gstats.writeback_pages = statistics.WriteBackPages;
+    gstats.evictions       = statistics.Evictions;
+    gstats.pages_used      = statistics.PagesUsed;
+    gstats.page_budget     = statistics.PageBudget;
+    gstats.page_size       = (unsigned int)statistics.PageSize;
+
+    gstats.dentry_hits          = statistics.DentryHits;
+    gstats.dentry_negative_hits = statistics.DentryNegativeHits;
+    gstats.dentry_misses        = statistics.DentryMisses;
+    gstats.dentry_flushes       = statistics.DentryFlushes;
+    gstats.dentry_count         = statistics.DentryCount;
+    gstats.buffer_hits          = statistics.BufferHits;
+    gstats.buffer_misses        = statistics.BufferMisses;
+    sys_file_get_cache_stats_response(message, OsSuccess, &gstats);
+}
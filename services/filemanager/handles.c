@@ -0,0 +1,231 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * File and storage service, Handle and Client implementation
+ *   Indexes the open file handles by id, and keeps the transfer buffers of each
+ *   client mapped for as long as the client has files open.
+ */
+
+//#define __TRACE
+
+#include "include/vfs.h"
+#include <ddk/utils.h>
+#include <ds/hashtable.h>
+#include <os/dmabuf.h>
+#include <string.h>
+
+struct HandleEntry {
+    UUId_t                   id;
+    FileSystemEntryHandle_t* handle;
+};
+
+struct ClientBuffer {
+    UUId_t                handle;
+    unsigned int          lastUse;
+    struct dma_attachment attachment;
+};
+
+// Attachments keep a reference to the buffer, so a buffer the client has destroyed
+// stays alive until it is evicted, and its id can't be handed out to a new buffer.
+struct ClientEntry {
+    UUId_t              id;
+    int                 handles;
+    unsigned int        clock;
+    struct ClientBuffer buffers[VFS_CLIENT_BUFFER_SLOTS];
+};
+
+static uint64_t id_hash(const void*);
+static int      handle_cmp(const void*, const void*);
+static int      client_cmp(const void*, const void*);
+
+static hashtable_t g_handles;
+static hashtable_t g_clients;
+static uint64_t    g_bufferHits   = 0;
+static uint64_t    g_bufferMisses = 0;
+
+static void __ReleaseBuffer(struct ClientBuffer* buffer)
+{
+    TRACE("[vfs] [client] releasing buffer %u", buffer->handle);
+    dma_attachment_unmap(&buffer->attachment);
+    dma_detach(&buffer->attachment);
+    buffer->handle = UUID_INVALID;
+}
+
+void
+VfsHandlesInitialize(void)
+{
+    hashtable_construct(&g_handles, HASHTABLE_MINIMUM_CAPACITY,
+                        sizeof(struct HandleEntry), id_hash, handle_cmp);
+    hashtable_construct(&g_clients, HASHTABLE_MINIMUM_CAPACITY,
+                        sizeof(struct ClientEntry), id_hash, client_cmp);
+}
+
+OsStatus_t
+VfsHandleRegister(
+        _In_ FileSystemEntryHandle_t* handle)
+{
+    struct ClientEntry* client;
+
+    client = hashtable_get(&g_clients, &(struct ClientEntry) { .id = handle->Owner });
+    if (!client) {
+        struct ClientEntry newClient = { .id = handle->Owner };
+        for (int i = 0; i < VFS_CLIENT_BUFFER_SLOTS; i++) {
+            newClient.buffers[i].handle = UUID_INVALID;
+        }
+        hashtable_set(&g_clients, &newClient);
+        client = hashtable_get(&g_clients, &newClient);
+        if (!client) {
+            return OsOutOfMemory;
+        }
+    }
+
+    hashtable_set(&g_handles, &(struct HandleEntry) { .id = handle->Id, .handle = handle });
+    client->handles++;
+    return OsSuccess;
+}
+
+void
+VfsHandleUnregister(
+        _In_ FileSystemEntryHandle_t* handle)
+{
+    struct ClientEntry* client;
+
+    if (!hashtable_remove(&g_handles, &(struct HandleEntry) { .id = handle->Id })) {
+        return;
+    }
+
+    // Clients are not tracked once their last file is closed, which is also
+    // the only point we can clean up after a client that has exited
+    client = hashtable_get(&g_clients, &(struct ClientEntry) { .id = handle->Owner });
+    if (client && --client->handles == 0) {
+        for (int i = 0; i < VFS_CLIENT_BUFFER_SLOTS; i++) {
+            if (client->buffers[i].handle != UUID_INVALID) {
+                __ReleaseBuffer(&client->buffers[i]);
+            }
+        }
+        hashtable_remove(&g_clients, &(struct ClientEntry) { .id = handle->Owner });
+    }
+}
+
+FileSystemEntryHandle_t*
+VfsHandleLookup(
+        _In_ UUId_t id)
+{
+    struct HandleEntry* entry = hashtable_get(&g_handles, &(struct HandleEntry) { .id = id });
+    return entry ? entry->handle : NULL;
+}
+
+OsStatus_t
+VfsClientMapBuffer(
+        _In_  UUId_t  processId,
+        _In_  UUId_t  bufferHandle,
+        _In_  size_t  length,
+        _Out_ void**  bufferOut)
+{
+    struct ClientEntry*  client;
+    struct ClientBuffer* buffer = NULL;
+    OsStatus_t           status;
+
+    client = hashtable_get(&g_clients, &(struct ClientEntry) { .id = processId });
+    if (!client) {
+        return OsInvalidParameters;
+    }
+
+    for (int i = 0; i < VFS_CLIENT_BUFFER_SLOTS; i++) {
+        if (client->buffers[i].handle == bufferHandle) {
+            buffer = &client->buffers[i];
+            break;
+        }
+    }
+
+    if (buffer) {
+        g_bufferHits++;
+
+        // The client may have resized the buffer since it was mapped
+        if (length > buffer->attachment.length) {
+            status = dma_attachment_refresh_map(&buffer->attachment);
+            if (status != OsSuccess) {
+                ERROR("[vfs] [client] [dma_attachment_refresh_map] failed: %u", status);
+                __ReleaseBuffer(buffer);
+                return OsInvalidParameters;
+            }
+        }
+    }
+    else {
+        g_bufferMisses++;
+
+        // Replace the least recently used buffer of the client
+        buffer = &client->buffers[0];
+        for (int i = 1; i < VFS_CLIENT_BUFFER_SLOTS; i++) {
+            if (buffer->handle == UUID_INVALID) {
+                break;
+            }
+            if (client->buffers[i].handle == UUID_INVALID ||
+                (int)(client->buffers[i].lastUse - buffer->lastUse) < 0) {
+                buffer = &client->buffers[i];
+            }
+        }
+
+        if (buffer->handle != UUID_INVALID) {
+            __ReleaseBuffer(buffer);
+        }
+
+        status = dma_attach(bufferHandle, &buffer->attachment);
+        if (status != OsSuccess) {
+            ERROR("[vfs] [client] [dma_attach] failed: %u", status);
+            return OsInvalidParameters;
+        }
+
+        status = dma_attachment_map(&buffer->attachment, DMA_ACCESS_WRITE);
+        if (status != OsSuccess) {
+            ERROR("[vfs] [client] [dma_attachment_map] failed: %u", status);
+            dma_detach(&buffer->attachment);
+            return OsInvalidParameters;
+        }
+        buffer->handle = bufferHandle;
+    }
+
+    buffer->lastUse = client->clock++;
+    *bufferOut      = buffer->attachment.buffer;
+    return OsSuccess;
+}
+
+void
+VfsClientGetStatistics(
+        _In_ OsFileCacheStatistics_t* statistics)
+{
+    statistics->BufferHits   = g_bufferHits;
+    statistics->BufferMisses = g_bufferMisses;
+}
+
+static uint64_t id_hash(const void* element)
+{
+    // Both element types start with their id
+    return (uint64_t)(*(const UUId_t*)element) * 0x9E3779B97F4A7C15ULL;
+}
+
+static int handle_cmp(const void* element1, const void* element2)
+{
+    return ((const struct HandleEntry*)element1)->id != ((const struct HandleEntry*)element2)->id;
+}
+
+static int client_cmp(const void* element1, const void* element2)
+{
+    return ((const struct ClientEntry*)element1)->id != ((const struct ClientEntry*)element2)->id;
+}
@@ -35,6 +35,42 @@
 #define __FILE_OPERATION_READ  0x00000001
 #define __FILE_OPERATION_WRITE 0x00000002
 
+// Page cache configuration, the budget is the maximum number of bytes of file
+// data that is kept in memory
+#define VFS_PAGECACHE_PAGE_SIZE     0x1000
+#define VFS_PAGECACHE_READAHEAD_MIN 4
+#define VFS_PAGECACHE_READAHEAD_MAX 32
+#ifndef VFS_PAGECACHE_BUDGET
+#define VFS_PAGECACHE_BUDGET        (16 * 1024 * 1024)
+#endif
+
+// Storage request queue configuration. Read and write deadlines are in milliseconds,
+// merged transfers are capped at VFS_STORAGEQUEUE_MAX_BYTES. The filemanager serves its
+// clients from a single thread, so every transfer finds the queue idle and nothing is
+// ever merged. Disks only get a queue once it has several callers to merge between.
+#ifndef VFS_STORAGEQUEUE_ENABLED
+#define VFS_STORAGEQUEUE_ENABLED       0
+#endif
+#define VFS_STORAGEQUEUE_FIFO          0
+#define VFS_STORAGEQUEUE_DEADLINE      1
+#define VFS_STORAGEQUEUE_READ_EXPIRE   50
+#define VFS_STORAGEQUEUE_WRITE_EXPIRE  500
+#define VFS_STORAGEQUEUE_WRITE_STARVE  2
+#define VFS_STORAGEQUEUE_MAX_BYTES     (256 * 1024)
+#define VFS_STORAGEQUEUE_HISTOGRAM     16
+
+// Dentry cache configuration, the cache is flushed once it holds VFS_DENTRY_CAPACITY entries
+#ifndef VFS_DENTRY_CAPACITY
+#define VFS_DENTRY_CAPACITY 4096
+#endif
+
+// Number of transfer buffers that are kept mapped per client
+#define VFS_CLIENT_BUFFER_SLOTS 4
+
+#define VFS_DENTRY_UNKNOWN  0
+#define VFS_DENTRY_POSITIVE 1
+#define VFS_DENTRY_NEGATIVE 2
+
 typedef enum FileSystemType {
     FSUnknown = 0,
     FSFAT,
@@ -109,6 +145,224 @@ __EXTERN void
 VfsCacheRemoveFile(
         _In_ MString_t* path);
 
+/**
+ * Initializes the page cache subsystem.
+ */
+__EXTERN void VfsDentryInitialize(void);
+
+__EXTERN void
+VfsDentryMount(
+        _In_ FileSystem_t* fileSystem);
+
+__EXTERN void
+VfsDentryUnmount(
+        _In_ FileSystem_t* fileSystem);
+
+/**
+ * Resolves the mounted filesystem of a path, and returns the path relative to it.
+ */
+__EXTERN FileSystem_t*
+VfsDentryGetFileSystem(
+        _In_  MString_t*  path,
+        _Out_ MString_t** subPathOut);
+
+/**
+ * Returns VFS_DENTRY_NEGATIVE if the path is known not to exist, VFS_DENTRY_POSITIVE
+ * if it is known to exist and VFS_DENTRY_UNKNOWN if the filesystem must be asked.
+ */
+__EXTERN int
+VfsDentryLookup(
+        _In_ MString_t* path);
+
+/**
+ * Records the result of a filesystem lookup, or that a path was created or removed.
+ */
+__EXTERN void
+VfsDentryUpdate(
+        _In_ MString_t* path,
+        _In_ int        exists);
+
+__EXTERN void
+VfsDentryGetStatistics(
+        _In_ OsFileCacheStatistics_t* statistics);
+
+__EXTERN void VfsHandlesInitialize(void);
+
+/**
+ * Indexes the handle by its id, and registers it with its owner.
+ */
+__EXTERN OsStatus_t
+VfsHandleRegister(
+        _In_ FileSystemEntryHandle_t* handle);
+
+__EXTERN void
+VfsHandleUnregister(
+        _In_ FileSystemEntryHandle_t* handle);
+
+__EXTERN FileSystemEntryHandle_t*
+VfsHandleLookup(
+        _In_ UUId_t id);
+
+/**
+ * Returns the mapping of a transfer buffer of a client that has files open. The
+ * mapping stays valid until the buffer is evicted or the client closes its last file.
+ */
+__EXTERN OsStatus_t
+VfsClientMapBuffer(
+        _In_  UUId_t  processId,
+        _In_  UUId_t  bufferHandle,
+        _In_  size_t  length,
+        _Out_ void**  bufferOut);
+
+__EXTERN void
+VfsClientGetStatistics(
+        _In_ OsFileCacheStatistics_t* statistics);
+
+__EXTERN void VfsPageCacheInitialize(void);
+
+/**
+ * Returns whether or not transfers on the handle should go through the page cache. Volatile
+ * handles, directories and filesystems with sectors larger than a page are not cached.
+ * @param handle [In] The handle that will be used for the transfer.
+ * @return       1 if the page cache should be used, otherwise 0.
+ */
+__EXTERN int
+VfsPageCacheIsCacheable(
+        _In_ FileSystemEntryHandle_t* handle);
+
+/**
+ * Reads from the current position of the handle through the page cache. Missing pages are
+ * read from the filesystem, and sequential access grows the number of pages read ahead.
+ * @param handle    [In]  The handle to read from, the position is not updated.
+ * @param buffer    [In]  The buffer to read into.
+ * @param length    [In]  The number of bytes to read.
+ * @param bytesRead [Out] The number of bytes read, capped at the end of the file.
+ * @return          Status of the operation
+ */
+__EXTERN OsStatus_t
+VfsPageCacheRead(
+        _In_  FileSystemEntryHandle_t* handle,
+        _In_  void*                    buffer,
+        _In_  size_t                   length,
+        _Out_ size_t*                  bytesRead);
+
+/**
+ * Writes at the current position of the handle into the page cache. The pages are marked
+ * dirty and the size of the entry is updated, the data reaches the filesystem on flush.
+ * @param handle       [In]  The handle to write to, the position is not updated.
+ * @param buffer       [In]  The data to write.
+ * @param length       [In]  The number of bytes to write.
+ * @param bytesWritten [Out] The number of bytes written.
+ * @return             Status of the operation
+ */
+__EXTERN OsStatus_t
+VfsPageCacheWrite(
+        _In_  FileSystemEntryHandle_t* handle,
+        _In_  const void*              buffer,
+        _In_  size_t                   length,
+        _Out_ size_t*                  bytesWritten);
+
+/**
+ * Writes back all dirty pages of the entry to the filesystem.
+ * @param entry [In] The entry to flush.
+ * @return      Status of the write-back.
+ */
+__EXTERN OsStatus_t
+VfsPageCacheFlush(
+        _In_ FileSystemEntry_t* entry);
+
+/**
+ * Drops all cached pages of the entry without writing them back. Must be called before
+ * the entry is deleted or closed by the filesystem.
+ * @param entry [In] The entry to invalidate.
+ */
+__EXTERN void
+VfsPageCacheInvalidate(
+        _In_ FileSystemEntry_t* entry);
+
+/**
+ * Retrieves the hit/miss counters and the page usage of the page cache.
+ * @param statistics [In] The structure to fill.
+ */
+__EXTERN void
+VfsPageCacheGetStatistics(
+        _In_ OsFileCacheStatistics_t* statistics);
+
+typedef struct StorageQueue StorageQueue_t;
+
+/**
+ * Issues a transfer of a list of sector-contiguous segments to the device, this is
+ * a single call to the storage driver.
+ */
+typedef OsStatus_t (*StorageQueueDispatch_t)(void* context, int direction,
+    StorageTransferSegment_t* segments, size_t count, size_t* sectorsTransferred);
+
+typedef struct StorageQueueStatistics {
+    size_t   Depth;              // Requests waiting right now
+    size_t   MaxDepth;
+    uint64_t Requests;
+    uint64_t Dispatches;         // Calls made to the storage driver
+    uint64_t Merges;             // Requests that were served by the dispatch of another
+    uint64_t Expired;            // Dispatched out of order because their deadline passed
+    uint64_t Latency[VFS_STORAGEQUEUE_HISTOGRAM]; // Bucket n counts requests of [2^n, 2^(n+1)) microseconds
+} StorageQueueStatistics_t;
+
+/**
+ * Creates a request queue for a disk. Requests that are waiting while a dispatch is in
+ * progress are merged with requests for adjacent or overlapping sectors.
+ * @param policy     [In] VFS_STORAGEQUEUE_FIFO or VFS_STORAGEQUEUE_DEADLINE.
+ * @param sectorSize [In] The sector size of the disk.
+ * @param dispatch   [In] Issues the merged transfers to the device.
+ * @param context    [In] Passed on to dispatch.
+ * @return           The queue, or NULL if out of memory.
+ */
+__EXTERN StorageQueue_t*
+StorageQueueCreate(
+        _In_ int                    policy,
+        _In_ size_t                 sectorSize,
+        _In_ StorageQueueDispatch_t dispatch,
+        _In_ void*                  context);
+
+/**
+ * Destroys the queue, there must be no transfers in progress.
+ * @param queue [In] The queue to destroy.
+ */
+__EXTERN void
+StorageQueueDestroy(
+        _In_ StorageQueue_t* queue);
+
+/**
+ * Queues a transfer and waits for it to complete. The caller dispatches requests on behalf
+ * of the queue when no other caller is, this matches the FileSystemDisk_t transfer hook.
+ * @param queue              [In]  The queue of the disk.
+ * @param direction          [In]  __STORAGE_OPERATION_READ or __STORAGE_OPERATION_WRITE.
+ * @param sector             [In]  The absolute sector to start at.
+ * @param bufferHandle       [In]  The dma buffer to transfer from or into.
+ * @param bufferOffset       [In]  The offset into the buffer.
+ * @param sectorCount        [In]  The number of sectors to transfer.
+ * @param sectorsTransferred [Out] The number of sectors transferred.
+ * @return                   Status of the transfer.
+ */
+__EXTERN OsStatus_t
+StorageQueueTransfer(
+        _In_  StorageQueue_t* queue,
+        _In_  int             direction,
+        _In_  uint64_t        sector,
+        _In_  UUId_t          bufferHandle,
+        _In_  size_t          bufferOffset,
+        _In_  size_t          sectorCount,
+        _Out_ size_t*         sectorsTransferred);
+
+/**
+ * Retrieves the depth, merge and latency counters of the queue.
+ * @param queue      [In] The queue to retrieve statistics for.
+ * @param statistics [In] The structure to fill.
+ */
+__EXTERN void
+StorageQueueGetStatistics(
+        _In_ StorageQueue_t*           queue,
+        _In_ StorageQueueStatistics_t* statistics);
+
 /* DiskRegisterFileSystem 
  * Registers a new filesystem of the given type, on
  * the given disk with the given position on the disk 
@@ -160,6 +414,11 @@ VfsUnloadModule(
  * and provides access for manipulation */
 __EXTERN list_t* VfsGetFileSystems(void);
 
+/* VfsNotifyPathChanged
+ * Tells the process manager that a path was created or removed, so it can drop the
+ * path resolutions that depend on it. NULL is used when a filesystem comes or goes. */
+__EXTERN void VfsNotifyPathChanged(MString_t* path);
+
 /**
  * Allocates a new disk identifier.
  * @param disk [In] The disk that should have an identifier allocated.
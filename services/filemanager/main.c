@@ -39,6 +39,12 @@ list_t* VfsGetFileSystems(void) {
     return &g_fileSystems;
 }
 
+void VfsNotifyPathChanged(MString_t* path)
+{
+    struct vali_link_message msg = VALI_MSG_INIT_HANDLE(GetProcessService());
+    (void)sys_library_notify_path_changed(GetGrachtClient(), &msg.base, path ? MStringRaw(path) : "");
+}
+
 OsStatus_t OnUnload(void)
 {
     return OsSuccess;
@@ -54,6 +60,9 @@ OsStatus_t OnLoad(void)
 {
     // Initialize subsystems
     VfsCacheInitialize();
+    VfsDentryInitialize();
+    VfsHandlesInitialize();
+    VfsPageCacheInitialize();
 
     // Register supported interfaces
     gracht_server_register_protocol(__crt_get_service_server(), &sys_file_server_protocol);
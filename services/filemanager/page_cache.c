@@ -0,0 +1,748 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * File and storage service, Page Cache implementation
+ *   Caches file data in pages keyed by (filesystem, entry, page index). Pages are
+ *   filled with sequential read-ahead, written back when flushed and evicted in
+ *   LRU order once the page budget has been used.
+ */
+
+//#define __TRACE
+
+#include "include/vfs.h"
+#include <ddk/utils.h>
+#include <ds/hashtable.h>
+#include <os/dmabuf.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGECACHE_BUDGET_PAGES  (VFS_PAGECACHE_BUDGET / VFS_PAGECACHE_PAGE_SIZE)
+#define PAGECACHE_RUN_SIZE      (VFS_PAGECACHE_READAHEAD_MAX * VFS_PAGECACHE_PAGE_SIZE)
+#define PAGECACHE_DIRTY_LIMIT   (PAGECACHE_BUDGET_PAGES / 4)
+
+#if PAGECACHE_BUDGET_PAGES < (2 * VFS_PAGECACHE_READAHEAD_MAX)
+#error "VFS_PAGECACHE_BUDGET must fit atleast two read-ahead runs"
+#endif
+
+// The per-entry state of the cache. Cache transfers go through a private handle
+// to the entry, so they never disturb the positioning of the handles of clients.
+typedef struct CacheFile {
+    FileSystemEntry_t*       Entry;
+    FileSystemEntryHandle_t* Handle;
+    list_t                   Pages;
+    int                      DirtyPages;
+    uint64_t                 NextIndex;
+    int                      Window;
+} CacheFile_t;
+
+typedef struct CachePage {
+    element_t    LruHeader;
+    element_t    FileHeader;
+    CacheFile_t* File;
+    uint64_t     Index;
+    int          Dirty;
+    uint8_t*     Data;
+} CachePage_t;
+
+struct PageCacheEntry {
+    FileSystem_t*      fileSystem;
+    FileSystemEntry_t* entry;
+    uint64_t           index;
+    CachePage_t*       page;
+};
+
+struct FileCacheEntry {
+    FileSystemEntry_t* entry;
+    CacheFile_t*       file;
+};
+
+static uint64_t page_hash(const void*);
+static int      page_cmp(const void*, const void*);
+static uint64_t file_hash(const void*);
+static int      file_cmp(const void*, const void*);
+
+static hashtable_t           g_pages;
+static hashtable_t           g_files;
+static list_t                g_lru = LIST_INIT;
+static size_t                g_pagesAllocated = 0;
+static int                   g_totalDirty     = 0;
+static struct dma_attachment g_transferBuffer = { UUID_INVALID, NULL, 0 };
+
+static uint64_t g_hits      = 0;
+static uint64_t g_misses    = 0;
+static uint64_t g_readAhead = 0;
+static uint64_t g_writeBack = 0;
+static uint64_t g_evictions = 0;
+
+static inline int __IsEntryFile(FileSystemEntry_t* entry)
+{
+    return (entry->Descriptor.Flags & FILE_FLAG_DIRECTORY) == 0 ? 1 : 0;
+}
+
+void
+VfsPageCacheInitialize(void)
+{
+    struct dma_buffer_info dmaInfo;
+    OsStatus_t             status;
+
+    hashtable_construct(&g_pages, PAGECACHE_BUDGET_PAGES, sizeof(struct PageCacheEntry), page_hash, page_cmp);
+    hashtable_construct(&g_files, HASHTABLE_MINIMUM_CAPACITY, sizeof(struct FileCacheEntry), file_hash, file_cmp);
+
+    // All cache transfers are staged through one buffer large enough for the
+    // biggest read-ahead run
+    dmaInfo.name     = "vfs_page_cache";
+    dmaInfo.length   = PAGECACHE_RUN_SIZE;
+    dmaInfo.capacity = PAGECACHE_RUN_SIZE;
+    dmaInfo.flags    = 0;
+
+    status = dma_create(&dmaInfo, &g_transferBuffer);
+    if (status != OsSuccess) {
+        ERROR("[vfs] [page_cache] failed to create transfer buffer, caching disabled: %u", status);
+        g_transferBuffer.handle = UUID_INVALID;
+    }
+}
+
+int
+VfsPageCacheIsCacheable(
+        _In_ FileSystemEntryHandle_t* handle)
+{
+    FileSystem_t* fileSystem = (FileSystem_t*)handle->Entry->System;
+
+    if (g_transferBuffer.handle == UUID_INVALID || (handle->Options & __FILE_VOLATILE) ||
+        !__IsEntryFile(handle->Entry)) {
+        return 0;
+    }
+
+    // Pages must consist of whole sectors, otherwise a page write-back would have to
+    // read-modify-write sectors it does not own
+    return (fileSystem->descriptor.Disk.descriptor.SectorSize <= VFS_PAGECACHE_PAGE_SIZE) ? 1 : 0;
+}
+
+static CacheFile_t*
+__GetFile(
+        _In_ FileSystemEntry_t* entry,
+        _In_ int                create)
+{
+    struct FileCacheEntry* fileEntry;
+    FileSystem_t*          fileSystem;
+    CacheFile_t*           file;
+    OsStatus_t             status;
+
+    fileEntry = hashtable_get(&g_files, &(struct FileCacheEntry) { .entry = entry });
+    if (fileEntry || !create) {
+        return fileEntry ? fileEntry->file : NULL;
+    }
+
+    file = malloc(sizeof(CacheFile_t));
+    if (!file) {
+        return NULL;
+    }
+
+    fileSystem = (FileSystem_t*)entry->System;
+    status     = fileSystem->module->OpenHandle(&fileSystem->descriptor, entry, &file->Handle);
+    if (status != OsSuccess) {
+        ERROR("[vfs] [page_cache] failed to open cache handle for %s: %u", MStringRaw(entry->Path), status);
+        free(file);
+        return NULL;
+    }
+
+    file->Handle->Entry         = entry;
+    file->Handle->Id            = UUID_INVALID;
+    file->Handle->Owner         = UUID_INVALID;
+    file->Handle->Access        = __FILE_READ_ACCESS | __FILE_WRITE_ACCESS;
+    file->Handle->Options       = __FILE_VOLATILE;
+    file->Handle->LastOperation = __FILE_OPERATION_NONE;
+    file->Handle->Position      = 0;
+    file->Handle->OutBuffer     = NULL;
+
+    file->Entry      = entry;
+    file->DirtyPages = 0;
+    file->NextIndex  = 0;
+    file->Window     = VFS_PAGECACHE_READAHEAD_MIN;
+    list_construct(&file->Pages);
+
+    hashtable_set(&g_files, &(struct FileCacheEntry) { .entry = entry, .file = file });
+    return file;
+}
+
+static CachePage_t*
+__GetPage(
+        _In_ CacheFile_t* file,
+        _In_ uint64_t     index)
+{
+    struct PageCacheEntry* pageEntry = hashtable_get(&g_pages, &(struct PageCacheEntry) {
+        .fileSystem = (FileSystem_t*)file->Entry->System, .entry = file->Entry, .index = index });
+    return pageEntry ? pageEntry->page : NULL;
+}
+
+static OsStatus_t
+__SetPosition(
+        _In_ CacheFile_t* file,
+        _In_ uint64_t     position)
+{
+    FileSystem_t* fileSystem = (FileSystem_t*)file->Entry->System;
+    OsStatus_t    status;
+
+    if (file->Handle->Position == position) {
+        return OsSuccess;
+    }
+
+    status = fileSystem->module->SeekInEntry(&fileSystem->descriptor, file->Handle, position);
+    if (status == OsSuccess) {
+        file->Handle->Position = position;
+    }
+    return status;
+}
+
+static int
+__ComparePages(
+        _In_ const void* page1,
+        _In_ const void* page2)
+{
+    uint64_t index1 = (*(CachePage_t* const*)page1)->Index;
+    uint64_t index2 = (*(CachePage_t* const*)page2)->Index;
+    return (index1 > index2) - (index1 < index2);
+}
+
+/**
+ * Writes back a run of dirty pages with consecutive indices. Only the last page of
+ * the file can be partial, so the run is written in one transfer.
+ */
+static OsStatus_t
+__WriteBackRun(
+        _In_ CacheFile_t*  file,
+        _In_ CachePage_t** pages,
+        _In_ int           count)
+{
+    FileSystem_t* fileSystem = (FileSystem_t*)file->Entry->System;
+    uint64_t      fileSize   = file->Entry->Descriptor.Size.QuadPart;
+    uint64_t      start      = pages[0]->Index * VFS_PAGECACHE_PAGE_SIZE;
+    size_t        length;
+    size_t        bytesWritten;
+    OsStatus_t    status;
+    int           i;
+
+    if (start >= fileSize) {
+        // The file was shrunk below the pages, nothing to write
+        length = 0;
+    }
+    else {
+        length = (size_t)MIN((uint64_t)count * VFS_PAGECACHE_PAGE_SIZE, fileSize - start);
+        for (i = 0; i < count; i++) {
+            memcpy((uint8_t*)g_transferBuffer.buffer + (i * VFS_PAGECACHE_PAGE_SIZE),
+                   pages[i]->Data, VFS_PAGECACHE_PAGE_SIZE);
+        }
+
+        status = __SetPosition(file, start);
+        if (status != OsSuccess) {
+            return status;
+        }
+
+        status = fileSystem->module->WriteEntry(&fileSystem->descriptor, file->Handle,
+            g_transferBuffer.handle, g_transferBuffer.buffer, 0, length, &bytesWritten);
+        if (status == OsSuccess) {
+            file->Handle->Position += bytesWritten;
+            if (bytesWritten != length) {
+                status = OsDeviceError;
+            }
+        }
+        if (status != OsSuccess) {
+            ERROR("[vfs] [page_cache] write-back of %s failed at page %llu: %u",
+                  MStringRaw(file->Entry->Path), pages[0]->Index, status);
+            return status;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        pages[i]->Dirty = 0;
+    }
+    file->DirtyPages -= count;
+    g_totalDirty     -= count;
+    g_writeBack      += (uint64_t)count;
+    return OsSuccess;
+}
+
+static OsStatus_t
+__FlushFile(
+        _In_ CacheFile_t* file)
+{
+    CachePage_t*  run[VFS_PAGECACHE_READAHEAD_MAX];
+    CachePage_t** pages;
+    element_t*    header;
+    OsStatus_t    status   = OsSuccess;
+    int           count    = 0;
+    int           runCount = 0;
+    int           i;
+
+    if (!file->DirtyPages) {
+        return OsSuccess;
+    }
+
+    // Write back in file order, this keeps the transfers sequential and makes sure
+    // no write starts beyond the data that is already on disk
+    pages = malloc(sizeof(CachePage_t*) * file->DirtyPages);
+    if (!pages) {
+        return OsOutOfMemory;
+    }
+
+    _foreach(header, &file->Pages) {
+        CachePage_t* page = header->value;
+        if (page->Dirty) {
+            pages[count++] = page;
+        }
+    }
+    qsort(pages, count, sizeof(CachePage_t*), __ComparePages);
+
+    for (i = 0; i < count && status == OsSuccess; i++) {
+        if (runCount && (runCount == VFS_PAGECACHE_READAHEAD_MAX ||
+                         run[runCount - 1]->Index + 1 != pages[i]->Index)) {
+            status   = __WriteBackRun(file, &run[0], runCount);
+            runCount = 0;
+        }
+        run[runCount++] = pages[i];
+    }
+
+    if (status == OsSuccess && runCount) {
+        status = __WriteBackRun(file, &run[0], runCount);
+    }
+    free(pages);
+    return status;
+}
+
+static void
+__RemovePage(
+        _In_ CachePage_t* page)
+{
+    CacheFile_t* file = page->File;
+
+    hashtable_remove(&g_pages, &(struct PageCacheEntry) {
+        .fileSystem = (FileSystem_t*)file->Entry->System, .entry = file->Entry, .index = page->Index });
+    list_remove(&g_lru, &page->LruHeader);
+    list_remove(&file->Pages, &page->FileHeader);
+    if (page->Dirty) {
+        file->DirtyPages--;
+        g_totalDirty--;
+    }
+}
+
+static void
+__TouchPage(
+        _In_ CachePage_t* page)
+{
+    list_remove(&g_lru, &page->LruHeader);
+    list_append(&g_lru, &page->LruHeader);
+}
+
+/**
+ * Allocates a page that is not yet part of the cache. Once the budget is used the least
+ * recently used page is reused, dirty pages are written back together with the rest of
+ * the dirty pages of their file. Write-back goes through the transfer buffer, so this must
+ * never be called while the transfer buffer holds data that has not been copied out yet.
+ */
+static CachePage_t*
+__AllocatePage(void)
+{
+    CacheFile_t* failedFile = NULL;
+    CachePage_t* page;
+    element_t*   header;
+    int          attempts;
+
+    if (g_pagesAllocated < PAGECACHE_BUDGET_PAGES) {
+        page = malloc(sizeof(CachePage_t) + VFS_PAGECACHE_PAGE_SIZE);
+        if (page) {
+            page->Data = (uint8_t*)page + sizeof(CachePage_t);
+            g_pagesAllocated++;
+            return page;
+        }
+    }
+
+    // Dirty pages that cannot be written back are moved to the back of the LRU instead
+    // of being reused, their data is not on disk anywhere else
+    for (attempts = list_count(&g_lru); attempts > 0; attempts--) {
+        header = list_front(&g_lru);
+        page   = header->value;
+        if (page->Dirty && (page->File == failedFile || __FlushFile(page->File) != OsSuccess)) {
+            if (page->File != failedFile) {
+                WARNING("[vfs] [page_cache] keeping dirty pages of %s after failed write-back",
+                        MStringRaw(page->File->Entry->Path));
+                failedFile = page->File;
+            }
+            __TouchPage(page);
+            continue;
+        }
+
+        __RemovePage(page);
+        g_evictions++;
+        return page;
+    }
+    return NULL;
+}
+
+static void
+__ReleasePage(
+        _In_ CachePage_t* page)
+{
+    free(page);
+    g_pagesAllocated--;
+}
+
+static void
+__AttachPage(
+        _In_ CacheFile_t* file,
+        _In_ CachePage_t* page,
+        _In_ uint64_t     index)
+{
+    ELEMENT_INIT(&page->LruHeader, 0, page);
+    ELEMENT_INIT(&page->FileHeader, 0, page);
+    page->File  = file;
+    page->Index = index;
+    page->Dirty = 0;
+
+    hashtable_set(&g_pages, &(struct PageCacheEntry) {
+        .fileSystem = (FileSystem_t*)file->Entry->System, .entry = file->Entry, .index = index, .page = page });
+    list_append(&g_lru, &page->LruHeader);
+    list_append(&file->Pages, &page->FileHeader);
+}
+
+static CachePage_t*
+__InsertPage(
+        _In_ CacheFile_t* file,
+        _In_ uint64_t     index)
+{
+    CachePage_t* page = __AllocatePage();
+    if (page) {
+        __AttachPage(file, page, index);
+    }
+    return page;
+}
+
+/**
+ * Reads pages [index, index + count) from the filesystem into the cache, the run stops
+ * early at the end of the file or at the first page that is already cached. Returns
+ * the page at index.
+ */
+static CachePage_t*
+__FetchPages(
+        _In_ CacheFile_t* file,
+        _In_ uint64_t     index,
+        _In_ int          count)
+{
+    FileSystem_t* fileSystem = (FileSystem_t*)file->Entry->System;
+    uint64_t      fileSize   = file->Entry->Descriptor.Size.QuadPart;
+    uint64_t      pageCount  = DIVUP(fileSize, VFS_PAGECACHE_PAGE_SIZE);
+    CachePage_t*  pages[VFS_PAGECACHE_READAHEAD_MAX];
+    size_t        bytesRead  = 0;
+    OsStatus_t    status;
+    int           pageTotal;
+    int           i;
+
+    count = MIN(count, VFS_PAGECACHE_READAHEAD_MAX);
+    if (index + count > pageCount) {
+        count = (index < pageCount) ? (int)(pageCount - index) : 0;
+    }
+    for (i = 1; i < count; i++) {
+        if (__GetPage(file, index + i)) {
+            count = i;
+            break;
+        }
+    }
+
+    // Reading data that has not been written back yet would read stale or unallocated
+    // space on disk
+    if (count && file->DirtyPages) {
+        if (__FlushFile(file) != OsSuccess) {
+            return NULL;
+        }
+    }
+
+    // Allocate all pages before the read, evicting a dirty page writes it back through
+    // the transfer buffer. A page beyond the end of the file starts out zeroed
+    pageTotal = MAX(count, 1);
+    for (i = 0; i < pageTotal; i++) {
+        pages[i] = __AllocatePage();
+        if (!pages[i]) {
+            break;
+        }
+    }
+
+    if (!i) {
+        return NULL;
+    }
+    count     = MIN(count, i);
+    pageTotal = i;
+
+    if (count) {
+        status = __SetPosition(file, index * VFS_PAGECACHE_PAGE_SIZE);
+        if (status == OsSuccess) {
+            status = fileSystem->module->ReadEntry(&fileSystem->descriptor, file->Handle, g_transferBuffer.handle,
+                g_transferBuffer.buffer, 0, (size_t)count * VFS_PAGECACHE_PAGE_SIZE, &bytesRead);
+        }
+        if (status != OsSuccess) {
+            ERROR("[vfs] [page_cache] read of %s failed at page %llu: %u",
+                  MStringRaw(file->Entry->Path), index, status);
+            for (i = 0; i < pageTotal; i++) {
+                __ReleasePage(pages[i]);
+            }
+            return NULL;
+        }
+        file->Handle->Position += bytesRead;
+    }
+
+    for (i = 0; i < pageTotal; i++) {
+        CachePage_t* page = pages[i];
+        size_t       pageBytes;
+
+        pageBytes = (bytesRead > (size_t)i * VFS_PAGECACHE_PAGE_SIZE) ?
+            MIN(bytesRead - ((size_t)i * VFS_PAGECACHE_PAGE_SIZE), VFS_PAGECACHE_PAGE_SIZE) : 0;
+        if (pageBytes) {
+            memcpy(page->Data, (uint8_t*)g_transferBuffer.buffer + (i * VFS_PAGECACHE_PAGE_SIZE), pageBytes);
+        }
+        if (pageBytes < VFS_PAGECACHE_PAGE_SIZE) {
+            memset(page->Data + pageBytes, 0, VFS_PAGECACHE_PAGE_SIZE - pageBytes);
+        }
+        __AttachPage(file, page, index + i);
+    }
+    return pages[0];
+}
+
+OsStatus_t
+VfsPageCacheRead(
+        _In_  FileSystemEntryHandle_t* handle,
+        _In_  void*                    buffer,
+        _In_  size_t                   length,
+        _Out_ size_t*                  bytesRead)
+{
+    CacheFile_t* file;
+    uint64_t     position = handle->Position;
+    uint64_t     fileSize = handle->Entry->Descriptor.Size.QuadPart;
+    size_t       bytesLeft;
+
+    TRACE("[vfs] [page_cache] read %s, position %llu, length %u",
+          MStringRaw(handle->Entry->Path), position, LODWORD(length));
+
+    *bytesRead = 0;
+    if (position >= fileSize) {
+        return OsSuccess;
+    }
+
+    file = __GetFile(handle->Entry, 1);
+    if (!file) {
+        return OsOutOfMemory;
+    }
+
+    bytesLeft = (size_t)MIN((uint64_t)length, fileSize - position);
+    while (bytesLeft) {
+        uint64_t     index      = position / VFS_PAGECACHE_PAGE_SIZE;
+        size_t       pageOffset = (size_t)(position % VFS_PAGECACHE_PAGE_SIZE);
+        size_t       byteCount  = MIN(VFS_PAGECACHE_PAGE_SIZE - pageOffset, bytesLeft);
+        CachePage_t* page       = __GetPage(file, index);
+
+        if (page) {
+            __TouchPage(page);
+            g_hits++;
+        }
+        else {
+            size_t span        = pageOffset + bytesLeft;
+            int    pagesNeeded = (int)MIN(DIVUP(span, VFS_PAGECACHE_PAGE_SIZE), VFS_PAGECACHE_READAHEAD_MAX);
+            int    pageCount;
+
+            // Sequential misses grow the read-ahead window, random misses reset it
+            if (index == file->NextIndex) {
+                file->Window = MIN(file->Window * 2, VFS_PAGECACHE_READAHEAD_MAX);
+            }
+            else {
+                file->Window = VFS_PAGECACHE_READAHEAD_MIN;
+            }
+
+            pageCount = MAX(pagesNeeded, file->Window);
+            page      = __FetchPages(file, index, pageCount);
+            if (!page) {
+                return (*bytesRead != 0) ? OsSuccess : OsDeviceError;
+            }
+            g_misses++;
+            if (pageCount > pagesNeeded) {
+                g_readAhead += (uint64_t)(pageCount - pagesNeeded);
+            }
+        }
+
+        memcpy((uint8_t*)buffer + *bytesRead, page->Data + pageOffset, byteCount);
+        *bytesRead     += byteCount;
+        position       += byteCount;
+        bytesLeft      -= byteCount;
+        file->NextIndex = index + 1;
+    }
+    return OsSuccess;
+}
+
+OsStatus_t
+VfsPageCacheWrite(
+        _In_  FileSystemEntryHandle_t* handle,
+        _In_  const void*              buffer,
+        _In_  size_t                   length,
+        _Out_ size_t*                  bytesWritten)
+{
+    CacheFile_t* file;
+    uint64_t     position = handle->Position;
+    OsStatus_t   status   = OsSuccess;
+
+    TRACE("[vfs] [page_cache] write %s, position %llu, length %u",
+          MStringRaw(handle->Entry->Path), position, LODWORD(length));
+
+    *bytesWritten = 0;
+    file = __GetFile(handle->Entry, 1);
+    if (!file) {
+        return OsOutOfMemory;
+    }
+
+    while (*bytesWritten < length) {
+        uint64_t     index      = position / VFS_PAGECACHE_PAGE_SIZE;
+        size_t       pageOffset = (size_t)(position % VFS_PAGECACHE_PAGE_SIZE);
+        size_t       byteCount  = MIN(VFS_PAGECACHE_PAGE_SIZE - pageOffset, length - *bytesWritten);
+        CachePage_t* page       = __GetPage(file, index);
+
+        if (page) {
+            __TouchPage(page);
+            g_hits++;
+        }
+        else {
+            // Pages that are fully overwritten do not need their old contents
+            if (byteCount == VFS_PAGECACHE_PAGE_SIZE) {
+                page = __InsertPage(file, index);
+            }
+            else {
+                page = __FetchPages(file, index, 1);
+            }
+            if (!page) {
+                status = OsOutOfMemory;
+                break;
+            }
+            g_misses++;
+        }
+
+        memcpy(page->Data + pageOffset, (const uint8_t*)buffer + *bytesWritten, byteCount);
+        if (!page->Dirty) {
+            page->Dirty = 1;
+            file->DirtyPages++;
+            g_totalDirty++;
+        }
+
+        *bytesWritten += byteCount;
+        position      += byteCount;
+        if (position > handle->Entry->Descriptor.Size.QuadPart) {
+            handle->Entry->Descriptor.Size.QuadPart = position;
+        }
+    }
+
+    // Write back early when too much of the cache is dirty, otherwise eviction ends up
+    // doing the write-back one file at a time
+    if (g_totalDirty > PAGECACHE_DIRTY_LIMIT) {
+        (void)__FlushFile(file);
+    }
+    return (*bytesWritten != 0) ? OsSuccess : status;
+}
+
+OsStatus_t
+VfsPageCacheFlush(
+        _In_ FileSystemEntry_t* entry)
+{
+    CacheFile_t* file = __GetFile(entry, 0);
+    if (!file) {
+        return OsSuccess;
+    }
+    return __FlushFile(file);
+}
+
+void
+VfsPageCacheInvalidate(
+        _In_ FileSystemEntry_t* entry)
+{
+    CacheFile_t*  file = __GetFile(entry, 0);
+    FileSystem_t* fileSystem;
+    element_t*    header;
+
+    if (!file) {
+        return;
+    }
+
+    TRACE("[vfs] [page_cache] invalidate %s", MStringRaw(entry->Path));
+    header = list_front(&file->Pages);
+    while (header) {
+        CachePage_t* page = header->value;
+        __RemovePage(page);
+        __ReleasePage(page);
+        header = list_front(&file->Pages);
+    }
+
+    fileSystem = (FileSystem_t*)entry->System;
+    fileSystem->module->CloseHandle(&fileSystem->descriptor, file->Handle);
+    hashtable_remove(&g_files, &(struct FileCacheEntry) { .entry = entry });
+    free(file);
+}
+
+void
+VfsPageCacheGetStatistics(
+        _In_ OsFileCacheStatistics_t* statistics)
+{
+    statistics->Hits           = g_hits;
+    statistics->Misses         = g_misses;
+    statistics->ReadAheadPages = g_readAhead;
+    statistics->WriteBackPages = g_writeBack;
+    statistics->Evictions      = g_evictions;
+    statistics->PagesUsed      = (size_t)list_count(&g_lru);
+    statistics->PageBudget     = PAGECACHE_BUDGET_PAGES;
+    statistics->PageSize       = VFS_PAGECACHE_PAGE_SIZE;
+}
+
+static uint64_t page_hash(const void* element)
+{
+    const struct PageCacheEntry* pageEntry = element;
+    uint64_t                     hash;
+
+    // The entry pointer is unique across filesystems, mix it with the page index so
+    // consecutive pages of a file spread over the table
+    hash  = (uint64_t)(uintptr_t)pageEntry->entry ^ ((uint64_t)(uintptr_t)pageEntry->fileSystem << 17);
+    hash ^= pageEntry->index * 0x9E3779B97F4A7C15ULL;
+    hash ^= hash >> 29;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    return hash ^ (hash >> 32);
+}
+
+static int page_cmp(const void* element1, const void* element2)
+{
+    const struct PageCacheEntry* pageEntry1 = element1;
+    const struct PageCacheEntry* pageEntry2 = element2;
+    return (pageEntry1->fileSystem == pageEntry2->fileSystem && pageEntry1->entry == pageEntry2->entry &&
+            pageEntry1->index == pageEntry2->index) ? 0 : 1;
+}
+
+static uint64_t file_hash(const void* element)
+{
+    const struct FileCacheEntry* fileEntry = element;
+    uint64_t                     hash      = (uint64_t)(uintptr_t)fileEntry->entry;
+    hash ^= hash >> 29;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    return hash ^ (hash >> 32);
+}
+
+static int file_cmp(const void* element1, const void* element2)
+{
+    const struct FileCacheEntry* fileEntry1 = element1;
+    const struct FileCacheEntry* fileEntry2 = element2;
+    return fileEntry1->entry == fileEntry2->entry ? 0 : 1;
+}
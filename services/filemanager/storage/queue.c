@@ -0,0 +1,524 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * File and storage service, Storage request queue
+ *   Transfers to a disk are issued by one caller at a time. Requests that arrive while
+ *   a transfer is in progress wait in the queue, and the next caller to dispatch merges
+ *   those for adjacent or overlapping sectors into a single call to the driver. The
+ *   deadline policy dispatches in ascending sector order, unless a request has waited
+ *   for longer than its deadline.
+ *
+ *   Merging only happens when several threads transfer to the same disk. The filemanager
+ *   currently serves all requests from one thread, where every transfer would find the
+ *   queue idle and only pay for the locking, so disks are set up without a queue unless
+ *   VFS_STORAGEQUEUE_ENABLED is set.
+ */
+
+//#define __TRACE
+
+#include "../include/vfs.h"
+#include <ddk/utils.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+// Requests are kept on the stack of the callers, they wait for them to complete
+typedef struct StorageRequest {
+    element_t  Header;
+    uint64_t   Sequence;
+    int        Direction;
+    uint64_t   Sector;
+    size_t     SectorCount;
+    UUId_t     BufferHandle;
+    size_t     BufferOffset;
+    uint64_t   Submitted;
+    uint64_t   Deadline;
+    int        Done;
+    OsStatus_t Status;
+    size_t     SectorsTransferred;
+} StorageRequest_t;
+
+struct StorageQueue {
+    mtx_t                    Lock;
+    cnd_t                    Completed;
+    int                      Policy;
+    size_t                   SectorSize;
+    size_t                   MaxSectors;
+    StorageQueueDispatch_t   Dispatch;
+    void*                    Context;
+    list_t                   Pending;      // In order of arrival
+    int                      Dispatching;
+    uint64_t                 NextSequence;
+    uint64_t                 HeadSector;   // Where the last dispatch ended
+    int                      WritesStarved;
+    StorageQueueStatistics_t Statistics;
+};
+
+static inline uint64_t
+__GetTimestamp(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_MONOTONIC);
+    return ((uint64_t)ts.tv_sec * 1000000ULL) + ((uint64_t)ts.tv_nsec / 1000ULL);
+}
+
+static inline uint64_t
+__RequestEnd(
+        _In_ StorageRequest_t* request)
+{
+    return request->Sector + request->SectorCount;
+}
+
+static inline int
+__Overlaps(
+        _In_ StorageRequest_t* request1,
+        _In_ StorageRequest_t* request2)
+{
+    return request1->Sector < __RequestEnd(request2) && request2->Sector < __RequestEnd(request1);
+}
+
+static inline int
+__Contains(
+        _In_ uint64_t          sector,
+        _In_ size_t            sectorCount,
+        _In_ StorageRequest_t* request)
+{
+    return request->Sector >= sector && __RequestEnd(request) <= sector + sectorCount;
+}
+
+// Returns whether the two ranges map the same sectors to the same bytes of a buffer
+static int
+__SameLayout(
+        _In_ StorageQueue_t* queue,
+        _In_ UUId_t          bufferHandle,
+        _In_ size_t          bufferOffset,
+        _In_ uint64_t        sector,
+        _In_ UUId_t          otherHandle,
+        _In_ size_t          otherOffset,
+        _In_ uint64_t        otherSector)
+{
+    if (bufferHandle != otherHandle) {
+        return 0;
+    }
+
+    if (otherSector >= sector) {
+        return otherOffset == bufferOffset + (size_t)(otherSector - sector) * queue->SectorSize;
+    }
+    return bufferOffset == otherOffset + (size_t)(sector - otherSector) * queue->SectorSize;
+}
+
+// Reads must see the writes that were queued before them and the other way around, the
+// same goes for writes that partially overlap. These have to wait for the pending request
+// to be dispatched, as the order of dispatch is not the order of arrival.
+static int
+__HasConflict(
+        _In_ StorageQueue_t*   queue,
+        _In_ StorageRequest_t* request)
+{
+    element_t* header;
+
+    _foreach(header, &queue->Pending) {
+        StorageRequest_t* pending = header->value;
+        if (!__Overlaps(pending, request)) {
+            continue;
+        }
+
+        if (pending->Direction != request->Direction) {
+            return 1;
+        }
+
+        if (request->Direction == __STORAGE_OPERATION_WRITE &&
+            !__Contains(request->Sector, request->SectorCount, pending) &&
+            !__SameLayout(queue, pending->BufferHandle, pending->BufferOffset, pending->Sector,
+                          request->BufferHandle, request->BufferOffset, request->Sector)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static StorageRequest_t*
+__SelectNext(
+        _In_ StorageQueue_t* queue)
+{
+    StorageRequest_t* expired  = NULL;
+    StorageRequest_t* next     = NULL;
+    StorageRequest_t* lowest   = NULL;
+    int               reads    = 0;
+    int               writes   = 0;
+    int               direction;
+    element_t*        header;
+    uint64_t          now;
+
+    header = list_front(&queue->Pending);
+    if (!header || queue->Policy == VFS_STORAGEQUEUE_FIFO) {
+        return header ? header->value : NULL;
+    }
+
+    now = __GetTimestamp();
+    _foreach(header, &queue->Pending) {
+        StorageRequest_t* request = header->value;
+        if (request->Deadline <= now && (!expired || request->Deadline < expired->Deadline)) {
+            expired = request;
+        }
+        if (request->Direction == __STORAGE_OPERATION_READ) reads++;
+        else                                                 writes++;
+    }
+
+    if (expired) {
+        queue->Statistics.Expired++;
+        return expired;
+    }
+
+    // Reads are preferred as someone is waiting for the data, but writes only
+    // get passed over a limited number of times
+    if (reads && (!writes || queue->WritesStarved < VFS_STORAGEQUEUE_WRITE_STARVE)) {
+        direction = __STORAGE_OPERATION_READ;
+        if (writes) {
+            queue->WritesStarved++;
+        }
+    }
+    else {
+        direction = __STORAGE_OPERATION_WRITE;
+        queue->WritesStarved = 0;
+    }
+
+    // Sweep upwards from where the last dispatch ended, and start over at the lowest sector
+    _foreach(header, &queue->Pending) {
+        StorageRequest_t* request = header->value;
+        if (request->Direction != direction) {
+            continue;
+        }
+        if (!lowest || request->Sector < lowest->Sector) {
+            lowest = request;
+        }
+        if (request->Sector >= queue->HeadSector && (!next || request->Sector < next->Sector)) {
+            next = request;
+        }
+    }
+    return next ? next : lowest;
+}
+
+// Absorbs a pending request whose sectors are already part of the run. Reads need the data
+// to land in the same place of the same buffer, writes also when a newer write covers them.
+static int
+__AbsorbRequest(
+        _In_ StorageQueue_t*           queue,
+        _In_ list_t*                   run,
+        _In_ StorageTransferSegment_t* segments,
+        _In_ int                       segmentCount,
+        _In_ StorageRequest_t*         request)
+{
+    element_t* header;
+    int        i;
+
+    for (i = 0; i < segmentCount; i++) {
+        if (__Contains(segments[i].Sector, segments[i].SectorCount, request) &&
+            __SameLayout(queue, segments[i].BufferHandle, segments[i].BufferOffset, segments[i].Sector,
+                         request->BufferHandle, request->BufferOffset, request->Sector)) {
+            return 1;
+        }
+    }
+
+    if (request->Direction == __STORAGE_OPERATION_WRITE) {
+        _foreach(header, run) {
+            StorageRequest_t* member = header->value;
+            if (member->Sequence > request->Sequence &&
+                __Contains(member->Sector, member->SectorCount, request)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Extends the run with pending requests of the same direction that are adjacent to it or
+// overlap it. Requests that continue in the same buffer extend the segment they follow.
+static int
+__BuildRun(
+        _In_ StorageQueue_t*           queue,
+        _In_ StorageRequest_t*         first,
+        _In_ list_t*                   run,
+        _In_ StorageTransferSegment_t* segments)
+{
+    uint64_t runStart     = first->Sector;
+    uint64_t runEnd       = __RequestEnd(first);
+    int      segmentCount = 1;
+    int      changed      = 1;
+
+    segments[0].Sector       = first->Sector;
+    segments[0].BufferHandle = first->BufferHandle;
+    segments[0].BufferOffset = first->BufferOffset;
+    segments[0].SectorCount  = first->SectorCount;
+    list_append(run, &first->Header);
+
+    while (changed) {
+        element_t* header = list_front(&queue->Pending);
+
+        changed = 0;
+        while (header) {
+            StorageRequest_t*         request = header->value;
+            StorageTransferSegment_t* last    = &segments[segmentCount - 1];
+            int                       merged  = 0;
+
+            header = header->next;
+            if (request->Direction != first->Direction) {
+                continue;
+            }
+
+            if (__Contains(runStart, (size_t)(runEnd - runStart), request)) {
+                merged = __AbsorbRequest(queue, run, segments, segmentCount, request);
+            }
+            else if (request->Sector == runEnd && (size_t)(runEnd - runStart) + request->SectorCount <= queue->MaxSectors) {
+                if (__SameLayout(queue, last->BufferHandle, last->BufferOffset, last->Sector,
+                                 request->BufferHandle, request->BufferOffset, request->Sector)) {
+                    last->SectorCount += request->SectorCount;
+                    merged = 1;
+                }
+                else if (segmentCount < __STORAGE_MAX_SEGMENTS) {
+                    segments[segmentCount].Sector       = request->Sector;
+                    segments[segmentCount].BufferHandle = request->BufferHandle;
+                    segments[segmentCount].BufferOffset = request->BufferOffset;
+                    segments[segmentCount].SectorCount  = request->SectorCount;
+                    segmentCount++;
+                    merged = 1;
+                }
+                runEnd = merged ? __RequestEnd(request) : runEnd;
+            }
+            else if (__RequestEnd(request) == runStart && (size_t)(runEnd - runStart) + request->SectorCount <= queue->MaxSectors) {
+                if (__SameLayout(queue, segments[0].BufferHandle, segments[0].BufferOffset, segments[0].Sector,
+                                 request->BufferHandle, request->BufferOffset, request->Sector)) {
+                    segments[0].Sector       = request->Sector;
+                    segments[0].BufferOffset = request->BufferOffset;
+                    segments[0].SectorCount += request->SectorCount;
+                    merged = 1;
+                }
+                else if (segmentCount < __STORAGE_MAX_SEGMENTS) {
+                    memmove(&segments[1], &segments[0], sizeof(StorageTransferSegment_t) * segmentCount);
+                    segments[0].Sector       = request->Sector;
+                    segments[0].BufferHandle = request->BufferHandle;
+                    segments[0].BufferOffset = request->BufferOffset;
+                    segments[0].SectorCount  = request->SectorCount;
+                    segmentCount++;
+                    merged = 1;
+                }
+                runStart = merged ? request->Sector : runStart;
+            }
+
+            if (merged) {
+                list_remove(&queue->Pending, &request->Header);
+                list_append(run, &request->Header);
+                changed = 1;
+            }
+        }
+    }
+    return segmentCount;
+}
+
+static void
+__CompleteRequest(
+        _In_ StorageQueue_t*   queue,
+        _In_ StorageRequest_t* request,
+        _In_ OsStatus_t        status,
+        _In_ uint64_t          transferredEnd,
+        _In_ uint64_t          now)
+{
+    uint64_t latency = now - request->Submitted;
+    int      bucket  = 0;
+
+    while ((latency >>= 1) && bucket < (VFS_STORAGEQUEUE_HISTOGRAM - 1)) {
+        bucket++;
+    }
+    queue->Statistics.Latency[bucket]++;
+
+    request->Status = status;
+    if (transferredEnd > request->Sector) {
+        request->SectorsTransferred = (size_t)MIN(transferredEnd - request->Sector, (uint64_t)request->SectorCount);
+    }
+    request->Done = 1;
+}
+
+// Dispatches the next run of requests, the lock is released while the driver is busy so
+// new requests can queue up behind it
+static void
+__DispatchNext(
+        _In_ StorageQueue_t* queue)
+{
+    StorageTransferSegment_t segments[__STORAGE_MAX_SEGMENTS];
+    StorageRequest_t*        first;
+    list_t                   run = LIST_INIT;
+    element_t*               header;
+    OsStatus_t               status;
+    size_t                   sectorsTransferred = 0;
+    uint64_t                 runStart;
+    uint64_t                 now;
+    int                      segmentCount;
+
+    first = __SelectNext(queue);
+    if (!first) {
+        return;
+    }
+
+    list_remove(&queue->Pending, &first->Header);
+    segmentCount = __BuildRun(queue, first, &run, &segments[0]);
+    runStart     = segments[0].Sector;
+
+    queue->Dispatching = 1;
+    queue->Statistics.Dispatches++;
+    queue->Statistics.Merges += (uint64_t)(list_count(&run) - 1);
+    queue->Statistics.Depth   = (size_t)list_count(&queue->Pending);
+    TRACE("[vfs] [storage_queue] dispatch %u requests, %i segments at sector %llu",
+          list_count(&run), segmentCount, runStart);
+
+    mtx_unlock(&queue->Lock);
+    status = queue->Dispatch(queue->Context, first->Direction, &segments[0], (size_t)segmentCount, &sectorsTransferred);
+    mtx_lock(&queue->Lock);
+
+    // The callers return as soon as they see their request done, so read the
+    // link before completing it
+    now    = __GetTimestamp();
+    header = list_front(&run);
+    while (header) {
+        StorageRequest_t* request = header->value;
+        header = header->next;
+        __CompleteRequest(queue, request, status, runStart + sectorsTransferred, now);
+    }
+    queue->HeadSector  = runStart + sectorsTransferred;
+    queue->Dispatching = 0;
+    cnd_broadcast(&queue->Completed);
+}
+
+StorageQueue_t*
+StorageQueueCreate(
+        _In_ int                    policy,
+        _In_ size_t                 sectorSize,
+        _In_ StorageQueueDispatch_t dispatch,
+        _In_ void*                  context)
+{
+    StorageQueue_t* queue;
+
+    if (!sectorSize || !dispatch) {
+        return NULL;
+    }
+
+    queue = (StorageQueue_t*)malloc(sizeof(StorageQueue_t));
+    if (!queue) {
+        return NULL;
+    }
+
+    memset(queue, 0, sizeof(StorageQueue_t));
+    mtx_init(&queue->Lock, mtx_plain);
+    cnd_init(&queue->Completed);
+    list_construct(&queue->Pending);
+    queue->Policy     = policy;
+    queue->SectorSize = sectorSize;
+    queue->MaxSectors = MAX(VFS_STORAGEQUEUE_MAX_BYTES / sectorSize, 1);
+    queue->Dispatch   = dispatch;
+    queue->Context    = context;
+    return queue;
+}
+
+void
+StorageQueueDestroy(
+        _In_ StorageQueue_t* queue)
+{
+    if (!queue) {
+        return;
+    }
+
+    TRACE("[vfs] [storage_queue] %llu requests, %llu dispatches, %llu merged, %llu expired",
+          queue->Statistics.Requests, queue->Statistics.Dispatches,
+          queue->Statistics.Merges, queue->Statistics.Expired);
+    cnd_destroy(&queue->Completed);
+    mtx_destroy(&queue->Lock);
+    free(queue);
+}
+
+OsStatus_t
+StorageQueueTransfer(
+        _In_  StorageQueue_t* queue,
+        _In_  int             direction,
+        _In_  uint64_t        sector,
+        _In_  UUId_t          bufferHandle,
+        _In_  size_t          bufferOffset,
+        _In_  size_t          sectorCount,
+        _Out_ size_t*         sectorsTransferred)
+{
+    StorageRequest_t request;
+
+    if (!queue || !sectorCount || !sectorsTransferred) {
+        return OsInvalidParameters;
+    }
+
+    memset(&request, 0, sizeof(StorageRequest_t));
+    ELEMENT_INIT(&request.Header, 0, &request);
+    request.Direction    = direction;
+    request.Sector       = sector;
+    request.SectorCount  = sectorCount;
+    request.BufferHandle = bufferHandle;
+    request.BufferOffset = bufferOffset;
+
+    mtx_lock(&queue->Lock);
+    while (__HasConflict(queue, &request)) {
+        if (!queue->Dispatching) {
+            __DispatchNext(queue);
+        }
+        else {
+            cnd_wait(&queue->Completed, &queue->Lock);
+        }
+    }
+
+    request.Sequence  = queue->NextSequence++;
+    request.Submitted = __GetTimestamp();
+    request.Deadline  = request.Submitted + 1000ULL * (direction == __STORAGE_OPERATION_READ ?
+            VFS_STORAGEQUEUE_READ_EXPIRE : VFS_STORAGEQUEUE_WRITE_EXPIRE);
+    list_append(&queue->Pending, &request.Header);
+    queue->Statistics.Requests++;
+    queue->Statistics.Depth    = (size_t)list_count(&queue->Pending);
+    queue->Statistics.MaxDepth = MAX(queue->Statistics.MaxDepth, queue->Statistics.Depth);
+
+    // Whoever finds the driver idle dispatches, which is not necessarily their own request
+    while (!request.Done) {
+        if (!queue->Dispatching) {
+            __DispatchNext(queue);
+        }
+        else {
+            cnd_wait(&queue->Completed, &queue->Lock);
+        }
+    }
+    mtx_unlock(&queue->Lock);
+
+    *sectorsTransferred = request.SectorsTransferred;
+    return request.Status;
+}
+
+void
+StorageQueueGetStatistics(
+        _In_ StorageQueue_t*           queue,
+        _In_ StorageQueueStatistics_t* statistics)
+{
+    if (!queue || !statistics) {
+        return;
+    }
+
+    mtx_lock(&queue->Lock);
+    memcpy(statistics, &queue->Statistics, sizeof(StorageQueueStatistics_t));
+    mtx_unlock(&queue->Lock);
+}
@@ -59,6 +59,8 @@ static void __LoadDelayedFileSystems(void)
             continue;
         }
         fs->state = FSLoaded;
+        VfsDentryMount(fs);
+        VfsNotifyPathChanged(NULL);
     }
 }
 
@@ -123,6 +125,8 @@ DiskRegisterFileSystem(
 
         // set state to loaded
         fileSystem->state = FSLoaded;
+        VfsDentryMount(fileSystem);
+        VfsNotifyPathChanged(NULL);
 
         // Send notification to sessionmanager
         __NotifySessionManager(&buffer[0]);
@@ -149,6 +153,8 @@ StorageUnloadFilesystem(
         FileSystem_t* fileSystem = (FileSystem_t*)header->value;
 
         list_remove(VfsGetFileSystems(), header);
+        VfsDentryUnmount(fileSystem);
+        VfsNotifyPathChanged(NULL);
 
         // Close all open files that relate to this filesystem
         // @todo
@@ -171,6 +177,46 @@ StorageUnloadFilesystem(
     }
 }
 
+#if VFS_STORAGEQUEUE_ENABLED
+static OsStatus_t
+StorageDispatch(
+        _In_  void*                     context,
+        _In_  int                       direction,
+        _In_  StorageTransferSegment_t* segments,
+        _In_  size_t                    count,
+        _Out_ size_t*                   sectorsTransferred)
+{
+    FileSystemDisk_t*        disk = context;
+    struct vali_link_message msg  = VALI_MSG_INIT_HANDLE(disk->driver_id);
+    OsStatus_t               status;
+    UUId_t                   requestId;
+
+    if (count == 1) {
+        ctt_storage_transfer(GetGrachtClient(), &msg.base, disk->device_id, direction,
+                LODWORD(segments[0].Sector), HIDWORD(segments[0].Sector),
+                segments[0].BufferHandle, segments[0].BufferOffset, segments[0].SectorCount);
+        gracht_client_wait_message(GetGrachtClient(), &msg.base, GRACHT_MESSAGE_BLOCK);
+        ctt_storage_transfer_result(GetGrachtClient(), &msg.base, &status, sectorsTransferred);
+        return status;
+    }
+
+    // Merged requests in different buffers go as one vectored request
+    ctt_storage_submit(GetGrachtClient(), &msg.base, disk->device_id, direction,
+            (uint8_t*)segments, (uint32_t)(count * sizeof(StorageTransferSegment_t)), 0);
+    gracht_client_wait_message(GetGrachtClient(), &msg.base, GRACHT_MESSAGE_BLOCK);
+    ctt_storage_submit_result(GetGrachtClient(), &msg.base, &status, &requestId);
+    if (status != OsSuccess) {
+        *sectorsTransferred = 0;
+        return status;
+    }
+
+    ctt_storage_poll(GetGrachtClient(), &msg.base, disk->device_id, requestId, 1);
+    gracht_client_wait_message(GetGrachtClient(), &msg.base, GRACHT_MESSAGE_BLOCK);
+    ctt_storage_poll_result(GetGrachtClient(), &msg.base, &status, sectorsTransferred);
+    return status;
+}
+#endif
+
 static int
 StorageInitialize(void* Context)
 {
@@ -189,6 +235,15 @@ StorageInitialize(void* Context)
     }
 
     from_sys_disk_descriptor_dkk(&gdescriptor, &disk->descriptor);
+
+#if VFS_STORAGEQUEUE_ENABLED
+    // The filesystems copy the disk, so the queue must be set up before the layout is read
+    disk->queue = StorageQueueCreate(VFS_STORAGEQUEUE_DEADLINE, disk->descriptor.SectorSize,
+                                     StorageDispatch, disk);
+    if (disk->queue) {
+        disk->transfer = StorageQueueTransfer;
+    }
+#endif
     
     // Detect the disk layout, and if it fails
     // try to detect which kind of filesystem is present
@@ -218,6 +273,8 @@ StorageCreate(
     disk->driver_id = driverId;
     disk->device_id = deviceId;
     disk->flags     = flags;
+    disk->queue     = NULL;
+    disk->transfer  = NULL;
     // TODO: disk states
     //Disk->State = Initializing
 
@@ -237,6 +294,7 @@ StorageDestroy(
 
         list_remove(&g_disks, (void*)(uintptr_t)deviceId);
         StorageUnloadFilesystem(deviceId, flags);
+        StorageQueueDestroy(disk->queue);
         free(disk);
     }
 }
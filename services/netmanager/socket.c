@@ -39,9 +39,8 @@ static void
 InitializeStreambuffer(
     _In_ streambuffer_t* Stream)
 {
-    size_t       ActualBufferSize = SOCKET_DEFAULT_BUFFER_SIZE - sizeof(streambuffer_t);
-    unsigned int BufferOptions    = STREAMBUFFER_MULTIPLE_READERS | STREAMBUFFER_MULTIPLE_WRITERS | STREAMBUFFER_GLOBAL;
-    streambuffer_construct(Stream, ActualBufferSize, BufferOptions);
+    unsigned int BufferOptions = STREAMBUFFER_MULTIPLE_READERS | STREAMBUFFER_MULTIPLE_WRITERS | STREAMBUFFER_GLOBAL;
+    streambuffer_construct(Stream, SOCKET_DEFAULT_BUFFER_SIZE, BufferOptions);
 }
 
 static OsStatus_t
@@ -53,7 +52,7 @@ CreateSocketPipe(
     TRACE("CreateSocketPipe()");
     
     Buffer.name     = "socket_buffer";
-    Buffer.length   = SOCKET_DEFAULT_BUFFER_SIZE;
+    Buffer.length   = SOCKET_DEFAULT_BUFFER_SIZE + sizeof(streambuffer_t);
     Buffer.capacity = SOCKET_SYSMAX_BUFFER_SIZE; // Should be from global settings
     Buffer.flags    = 0;
     
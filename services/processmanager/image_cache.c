@@ -0,0 +1,301 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Process Manager, Image Cache implementation
+ *   Keeps a relocated snapshot of every image loaded, keyed by path and load address,
+ *   so further loads of the image map its read-only sections from the snapshot.
+ */
+
+//#define __TRACE
+
+#include <ddk/utils.h>
+#include <ds/hashtable.h>
+#include <ds/mstring.h>
+#include <os/mollenos.h>
+#include "../../librt/libds/pe/pe.h"
+#include "process.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Images no process uses are kept until the cache holds this many
+#define IMAGE_CACHE_CAPACITY 64
+
+// The index holds a reference to the entry, as does every loaded image that
+// was mapped from it. The image member must be first, as the loader only knows it.
+struct ImageCacheEntry {
+    PeImageCache_t  Image;
+    char*           Path;
+    uintptr_t       Base;
+    long            FileId;
+    long            StorageId;
+    uint64_t        FileSize;
+    struct timespec ModifiedAt;
+    size_t          SharedBytes;
+    int             References;
+    int             Indexed;
+};
+
+struct ImageIndexEntry {
+    const char*             Path;
+    uintptr_t               Base;
+    struct ImageCacheEntry* Entry;
+};
+
+struct ImageTrimContext {
+    struct ImageCacheEntry* Unused[IMAGE_CACHE_CAPACITY];
+    int                     Count;
+};
+
+static uint64_t image_hash(const void*);
+static int      image_cmp(const void*, const void*);
+
+static hashtable_t g_images;
+static uint64_t    g_hits   = 0;
+static uint64_t    g_misses = 0;
+
+void
+ImageCacheInitialize(void)
+{
+    hashtable_construct(&g_images, HASHTABLE_MINIMUM_CAPACITY,
+                        sizeof(struct ImageIndexEntry), image_hash, image_cmp);
+}
+
+static void
+__ReleaseEntry(
+        _In_ struct ImageCacheEntry* entry)
+{
+    if (--entry->References) {
+        return;
+    }
+
+    TRACE("[image_cache] destroying %s at 0x%" PRIxIN, entry->Path, entry->Base);
+    if (entry->Image.Snapshot) {
+        MemoryFree(entry->Image.Snapshot, entry->Image.Length);
+    }
+    free(entry->Image.Sections);
+    free(entry->Path);
+    free(entry);
+}
+
+static void
+__RemoveEntry(
+        _In_ struct ImageCacheEntry* entry)
+{
+    hashtable_remove(&g_images, &(struct ImageIndexEntry) { .Path = entry->Path, .Base = entry->Base });
+    entry->Indexed = 0;
+    __ReleaseEntry(entry);
+}
+
+static int
+__IsSameFile(
+        _In_ struct ImageCacheEntry* entry,
+        _In_ OsFileDescriptor_t*     file)
+{
+    return entry->FileId == file->Id && entry->StorageId == file->StorageId &&
+           entry->FileSize == (uint64_t)file->Size.QuadPart &&
+           entry->ModifiedAt.tv_sec == file->ModifiedAt.tv_sec &&
+           entry->ModifiedAt.tv_nsec == file->ModifiedAt.tv_nsec;
+}
+
+static void
+__CollectUnused(
+        _In_ int         index,
+        _In_ const void* element,
+        _In_ void*       userContext)
+{
+    const struct ImageIndexEntry* indexEntry = element;
+    struct ImageTrimContext*      context    = userContext;
+    _CRT_UNUSED(index);
+
+    if (indexEntry->Entry->References == 1 && context->Count < IMAGE_CACHE_CAPACITY) {
+        context->Unused[context->Count++] = indexEntry->Entry;
+    }
+}
+
+PeImageCache_t*
+AcquireImageCache(
+        _In_ MString_t* fullPath,
+        _In_ uintptr_t  base)
+{
+    struct ImageIndexEntry* indexEntry;
+    struct ImageCacheEntry* entry;
+    OsFileDescriptor_t      file;
+
+    indexEntry = hashtable_get(&g_images, &(struct ImageIndexEntry) { .Path = MStringRaw(fullPath), .Base = base });
+    if (!indexEntry) {
+        g_misses++;
+        return NULL;
+    }
+    entry = indexEntry->Entry;
+
+    // The file may have been replaced since the snapshot was taken
+    if (GetFileInformationFromPath(entry->Path, &file) != OsSuccess || !__IsSameFile(entry, &file)) {
+        TRACE("[image_cache] %s has changed", entry->Path);
+        __RemoveEntry(entry);
+        g_misses++;
+        return NULL;
+    }
+
+    g_hits++;
+    entry->References++;
+    return &entry->Image;
+}
+
+OsStatus_t
+CreateImageCache(
+        _In_  MString_t*       fullPath,
+        _In_  uintptr_t        base,
+        _In_  size_t           length,
+        _In_  int              sectionCount,
+        _Out_ PeImageCache_t** cacheOut)
+{
+    struct ImageCacheEntry* entry;
+    OsFileDescriptor_t      file;
+    OsStatus_t              osStatus;
+
+    // Images that can't be identified can't be told apart from a replaced file
+    osStatus = GetFileInformationFromPath(MStringRaw(fullPath), &file);
+    if (osStatus != OsSuccess) {
+        return OsNotSupported;
+    }
+
+    entry = malloc(sizeof(struct ImageCacheEntry));
+    if (!entry) {
+        return OsOutOfMemory;
+    }
+    memset(entry, 0, sizeof(struct ImageCacheEntry));
+
+    entry->Path                = strdup(MStringRaw(fullPath));
+    entry->Base                = base;
+    entry->FileId              = file.Id;
+    entry->StorageId           = file.StorageId;
+    entry->FileSize            = (uint64_t)file.Size.QuadPart;
+    entry->ModifiedAt          = file.ModifiedAt;
+    entry->References          = 1;
+    entry->Image.Length        = length;
+    entry->Image.SectionCount  = sectionCount;
+    entry->Image.Sections      = calloc(sectionCount, sizeof(PeImageSection_t));
+    if (!entry->Path || !entry->Image.Sections) {
+        __ReleaseEntry(entry);
+        return OsOutOfMemory;
+    }
+
+    // The snapshot must be page-aligned memory of its own, as the pages are mapped
+    // into the memory spaces of the processes that load the image
+    osStatus = MemoryAllocate(NULL, length, MEMORY_COMMIT | MEMORY_READ | MEMORY_WRITE,
+                              (void**)&entry->Image.Snapshot);
+    if (osStatus != OsSuccess) {
+        ERROR("[image_cache] [create] failed to allocate %" PRIuIN " bytes: %u", length, osStatus);
+        entry->Image.Snapshot = NULL;
+        __ReleaseEntry(entry);
+        return osStatus;
+    }
+
+    *cacheOut = &entry->Image;
+    return OsSuccess;
+}
+
+void
+PublishImageCache(
+        _In_ PeImageCache_t* cache)
+{
+    struct ImageCacheEntry* entry = (struct ImageCacheEntry*)cache;
+    struct ImageIndexEntry* indexEntry;
+    int                     i;
+
+    for (i = 0; i < cache->SectionCount; i++) {
+        if (cache->Sections[i].Shared) {
+            entry->SharedBytes += cache->Sections[i].Size;
+        }
+    }
+
+    // Replace the snapshot of an older version of the file
+    indexEntry = hashtable_get(&g_images, &(struct ImageIndexEntry) { .Path = entry->Path, .Base = entry->Base });
+    if (indexEntry) {
+        __RemoveEntry(indexEntry->Entry);
+    }
+
+    if (g_images.element_count >= IMAGE_CACHE_CAPACITY) {
+        struct ImageTrimContext context = { .Count = 0 };
+        hashtable_enumerate(&g_images, __CollectUnused, &context);
+        for (i = 0; i < context.Count; i++) {
+            __RemoveEntry(context.Unused[i]);
+        }
+    }
+
+    TRACE("[image_cache] caching %s at 0x%" PRIxIN ", %" PRIuIN " bytes shared",
+          entry->Path, entry->Base, entry->SharedBytes);
+    hashtable_set(&g_images, &(struct ImageIndexEntry) { .Path = entry->Path, .Base = entry->Base, .Entry = entry });
+    entry->Indexed = 1;
+    entry->References++;
+}
+
+void
+ReleaseImageCache(
+        _In_ PeImageCache_t* cache)
+{
+    __ReleaseEntry((struct ImageCacheEntry*)cache);
+}
+
+static void
+__AddStatistics(
+        _In_ int         index,
+        _In_ const void* element,
+        _In_ void*       userContext)
+{
+    const struct ImageIndexEntry* indexEntry = element;
+    OsImageCacheStatistics_t*     statistics = userContext;
+    size_t                        mappings   = (size_t)indexEntry->Entry->References - 1;
+    _CRT_UNUSED(index);
+
+    statistics->Images++;
+    statistics->Mappings    += mappings;
+    statistics->SharedBytes += indexEntry->Entry->SharedBytes;
+    statistics->SavedBytes  += indexEntry->Entry->SharedBytes * mappings;
+}
+
+void
+ImageCacheGetStatistics(
+        _In_ OsImageCacheStatistics_t* statistics)
+{
+    memset(statistics, 0, sizeof(OsImageCacheStatistics_t));
+    statistics->Hits   = g_hits;
+    statistics->Misses = g_misses;
+    hashtable_enumerate(&g_images, __AddStatistics, statistics);
+}
+
+static uint64_t image_hash(const void* element)
+{
+    const struct ImageIndexEntry* indexEntry = element;
+    const uint8_t*                pointer    = (const uint8_t*)indexEntry->Path;
+    uint64_t                      hash       = 14695981039346656037ULL;
+
+    while (*pointer) {
+        hash ^= *pointer++;
+        hash *= 1099511628211ULL;
+    }
+    return hash ^ ((uint64_t)indexEntry->Base * 0x9E3779B97F4A7C15ULL);
+}
+
+static int image_cmp(const void* element1, const void* element2)
+{
+    const struct ImageIndexEntry* indexEntry1 = element1;
+    const struct ImageIndexEntry* indexEntry2 = element2;
+    return indexEntry1->Base != indexEntry2->Base || strcmp(indexEntry1->Path, indexEntry2->Path);
+}
@@ -0,0 +1,231 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Process Manager, Image File implementation
+ *   Maps the files of images while they are loaded, so only the pages the loader
+ *   touches are read, and remembers the versions of files that passed verification.
+ */
+
+//#define __TRACE
+
+#include <ddk/utils.h>
+#include <ds/hashtable.h>
+#include <ds/mstring.h>
+#include <errno.h>
+#include <os/mollenos.h>
+#include "../../librt/libds/pe/pe.h"
+#include "process.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A file is considered changed once any of these differ
+struct image_file_version {
+    long            id;
+    long            storageId;
+    uint64_t        size;
+    struct timespec modifiedAt;
+};
+
+struct image_file {
+    void*                     buffer;
+    size_t                    length;
+    FILE*                     file;
+    int                       mapped;
+    struct image_file_version version;
+};
+
+static uint64_t open_hash(const void*);
+static int      open_cmp(const void*, const void*);
+static uint64_t version_hash(const void*);
+static int      version_cmp(const void*, const void*);
+
+static hashtable_t g_openFiles;     // buffer => image_file
+static hashtable_t g_verifiedFiles; // file => image_file_version
+
+void
+ImageFileInitialize(void)
+{
+    hashtable_construct(&g_openFiles, HASHTABLE_MINIMUM_CAPACITY,
+                        sizeof(struct image_file), open_hash, open_cmp);
+    hashtable_construct(&g_verifiedFiles, HASHTABLE_MINIMUM_CAPACITY,
+                        sizeof(struct image_file_version), version_hash, version_cmp);
+}
+
+static OsStatus_t
+__ReadFile(
+        _In_ struct image_file* imageFile)
+{
+    size_t bytesRead;
+
+    imageFile->buffer = malloc(imageFile->length);
+    if (!imageFile->buffer) {
+        ERROR("LoadFile null");
+        return OsOutOfMemory;
+    }
+
+    bytesRead = fread(imageFile->buffer, 1, imageFile->length, imageFile->file);
+    TRACE("LoadFile read %" PRIuIN " bytes from file", bytesRead);
+    if (bytesRead != imageFile->length) {
+        free(imageFile->buffer);
+        return OsError;
+    }
+    return OsSuccess;
+}
+
+OsStatus_t
+LoadFile(
+        _In_  MString_t* fullPath,
+        _Out_ void**     bufferOut,
+        _Out_ size_t*    lengthOut)
+{
+    struct image_file  imageFile = { 0 };
+    OsFileDescriptor_t descriptor;
+    OsStatus_t         osStatus;
+    ENTRY("LoadFile %s", MStringRaw(fullPath));
+
+    imageFile.file = fopen(MStringRaw(fullPath), "rb");
+    if (!imageFile.file) {
+        ERROR("LoadFile fopen failed: %i", errno);
+        osStatus = OsDoesNotExist;
+        goto exit;
+    }
+
+    osStatus = GetFileInformationFromFd(fileno(imageFile.file), &descriptor);
+    if (osStatus != OsSuccess) {
+        ERROR("LoadFile failed to stat file: %u", osStatus);
+        fclose(imageFile.file);
+        goto exit;
+    }
+
+    imageFile.length             = (size_t)descriptor.Size.QuadPart;
+    imageFile.version.id         = descriptor.Id;
+    imageFile.version.storageId  = descriptor.StorageId;
+    imageFile.version.size       = descriptor.Size.QuadPart;
+    imageFile.version.modifiedAt = descriptor.ModifiedAt;
+    TRACE("[load_file] size %" PRIuIN, imageFile.length);
+
+    // Pages of the mapping are read from storage the first time the loader touches
+    // them, so parts of the file the loader skips are never read at all
+    osStatus = CreateFileMapping(fileno(imageFile.file), FILE_MAPPING_READ, 0,
+                                 imageFile.length, &imageFile.buffer);
+    if (osStatus == OsSuccess) {
+        imageFile.mapped = 1;
+    }
+    else {
+        TRACE("[load_file] mapping failed with %u, reading file", osStatus);
+        osStatus = __ReadFile(&imageFile);
+        if (osStatus != OsSuccess) {
+            fclose(imageFile.file);
+            goto exit;
+        }
+    }
+
+    hashtable_set(&g_openFiles, &imageFile);
+    *bufferOut = imageFile.buffer;
+    *lengthOut = imageFile.length;
+
+exit:
+    EXIT("LoadFile");
+    return osStatus;
+}
+
+void
+UnloadFile(
+        _In_ MString_t* fullPath,
+        _In_ void*      buffer)
+{
+    struct image_file* imageFile;
+    _CRT_UNUSED(fullPath);
+
+    imageFile = hashtable_get(&g_openFiles, &(struct image_file) { .buffer = buffer });
+    if (!imageFile) {
+        return;
+    }
+
+    if (imageFile->mapped) {
+        DestroyFileMapping(buffer);
+    }
+    else {
+        free(buffer);
+    }
+    fclose(imageFile->file);
+    hashtable_remove(&g_openFiles, &(struct image_file) { .buffer = buffer });
+}
+
+int
+IsFileVerified(
+        _In_ MString_t* fullPath,
+        _In_ void*      buffer)
+{
+    struct image_file*         imageFile;
+    struct image_file_version* version;
+    _CRT_UNUSED(fullPath);
+
+    imageFile = hashtable_get(&g_openFiles, &(struct image_file) { .buffer = buffer });
+    if (!imageFile) {
+        return 0;
+    }
+
+    version = hashtable_get(&g_verifiedFiles, &imageFile->version);
+    return version != NULL && version->size == imageFile->version.size &&
+           version->modifiedAt.tv_sec == imageFile->version.modifiedAt.tv_sec &&
+           version->modifiedAt.tv_nsec == imageFile->version.modifiedAt.tv_nsec;
+}
+
+void
+MarkFileVerified(
+        _In_ MString_t* fullPath,
+        _In_ void*      buffer)
+{
+    struct image_file* imageFile;
+    _CRT_UNUSED(fullPath);
+
+    // Replaces the version that was verified before, if the file has changed
+    imageFile = hashtable_get(&g_openFiles, &(struct image_file) { .buffer = buffer });
+    if (imageFile) {
+        hashtable_set(&g_verifiedFiles, &imageFile->version);
+    }
+}
+
+static uint64_t open_hash(const void* element)
+{
+    const struct image_file* imageFile = element;
+    return (uint64_t)(uintptr_t)imageFile->buffer * 0x9E3779B97F4A7C15ULL;
+}
+
+static int open_cmp(const void* element1, const void* element2)
+{
+    const struct image_file* imageFile1 = element1;
+    const struct image_file* imageFile2 = element2;
+    return imageFile1->buffer != imageFile2->buffer;
+}
+
+static uint64_t version_hash(const void* element)
+{
+    const struct image_file_version* version = element;
+    return ((uint64_t)version->storageId << 32 ^ (uint64_t)version->id) * 0x9E3779B97F4A7C15ULL;
+}
+
+static int version_cmp(const void* element1, const void* element2)
+{
+    const struct image_file_version* version1 = element1;
+    const struct image_file_version* version2 = element2;
+    return version1->id != version2->id || version1->storageId != version2->storageId;
+}
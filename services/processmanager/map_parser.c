@@ -85,6 +85,11 @@ LoadObjectsInMap(
         _In_ void*                  fileBuffer,
         _In_ size_t                 fileLength);
 
+static int
+SymbolCompare(
+        _In_ const void* element1,
+        _In_ const void* element2);
+
 // Structure
 // 1.       Address  Size     Align Out     In      Symbol
 // Section. 00001000 01dc3906  4096 .text
@@ -133,9 +138,33 @@ SymbolParseMapFile(
 
     TRACE(STR("[SymbolParseMapFile] Loading objects.."));
     LoadObjectsInMap(symbolContext, fileBuffer, fileLength);
+
+    // the map file does not guarantee any address order, sort the symbols once here so
+    // lookups can use a binary search
+    qsort(symbolContext->symbols, symbolCount, sizeof(struct map_symbol), SymbolCompare);
     return OsSuccess;
 }
 
+static int
+SymbolCompare(
+        _In_ const void* element1,
+        _In_ const void* element2)
+{
+    const struct map_symbol* lh = element1;
+    const struct map_symbol* rh = element2;
+
+    if (lh->address != rh->address) {
+        return lh->address < rh->address ? -1 : 1;
+    }
+
+    // names are stored in the order of the map file, use them to keep symbols
+    // at the same address in file order
+    if (lh->name != rh->name) {
+        return (uintptr_t)lh->name < (uintptr_t)rh->name ? -1 : 1;
+    }
+    return 0;
+}
+
 static void
 CalculateSpaceRequirements(
         _In_  void*   fileBuffer,
@@ -0,0 +1,421 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Process Manager, Path Resolution implementation
+ *   Resolves the paths of images, and remembers how they were resolved keyed by the
+ *   working directory and the requested path, including the paths that could not be.
+ */
+
+//#define __TRACE
+
+#include <ddk/utils.h>
+#include <ds/hashtable.h>
+#include <ds/mstring.h>
+#include <os/mollenos.h>
+#include "../../librt/libds/pe/pe.h"
+#include "process.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// The cache is flushed once it holds this many resolutions
+#define PATH_CACHE_CAPACITY 512
+
+// A result without a path is a negative entry, the status is why it failed
+struct path_cache_entry {
+    const char* workingDirectory;
+    const char* path;
+    char*       fullPath;
+    OsStatus_t  status;
+};
+
+struct path_invalidate_context {
+    const char*             path;
+    const char*             name;
+    size_t                  pathLength;
+    struct path_cache_entry entries[PATH_CACHE_CAPACITY];
+    int                     count;
+};
+
+static uint64_t path_hash(const void*);
+static int      path_cmp(const void*, const void*);
+
+static hashtable_t g_paths;
+static uint64_t    g_hits          = 0;
+static uint64_t    g_negativeHits  = 0;
+static uint64_t    g_misses        = 0;
+static uint64_t    g_invalidations = 0;
+
+void
+PathCacheInitialize(void)
+{
+    hashtable_construct(&g_paths, HASHTABLE_MINIMUM_CAPACITY,
+                        sizeof(struct path_cache_entry), path_hash, path_cmp);
+}
+
+static void
+__FreeEntry(
+        _In_ struct path_cache_entry* entry)
+{
+    free((void*)entry->workingDirectory);
+    free((void*)entry->path);
+    free(entry->fullPath);
+}
+
+static void
+__CollectAll(
+        _In_ int         index,
+        _In_ const void* element,
+        _In_ void*       userContext)
+{
+    struct path_invalidate_context* context = userContext;
+    _CRT_UNUSED(index);
+
+    if (context->count < PATH_CACHE_CAPACITY) {
+        context->entries[context->count++] = *(const struct path_cache_entry*)element;
+    }
+}
+
+static const char*
+__GetName(
+        _In_ const char* path)
+{
+    const char* separator = strrchr(path, '/');
+    return separator ? separator + 1 : path;
+}
+
+// A changed path affects the resolutions that end in the same name, as the name
+// may now be found in a directory that is searched before, and the resolutions
+// that led to a file below it, in case a directory was removed
+static void
+__CollectChanged(
+        _In_ int         index,
+        _In_ const void* element,
+        _In_ void*       userContext)
+{
+    const struct path_cache_entry*  entry   = element;
+    struct path_invalidate_context* context = userContext;
+    _CRT_UNUSED(index);
+
+    if (!strcasecmp(__GetName(entry->path), context->name) ||
+        (entry->fullPath && !strncasecmp(entry->fullPath, context->path, context->pathLength) &&
+         entry->fullPath[context->pathLength] == '/')) {
+        __CollectAll(index, element, userContext);
+    }
+}
+
+static void
+__RemoveEntries(
+        _In_ struct path_invalidate_context* context)
+{
+    int i;
+
+    for (i = 0; i < context->count; i++) {
+        hashtable_remove(&g_paths, &context->entries[i]);
+        __FreeEntry(&context->entries[i]);
+    }
+    g_invalidations += context->count;
+}
+
+int
+PathCacheLookup(
+        _In_  const char* workingDirectory,
+        _In_  MString_t*  path,
+        _Out_ OsStatus_t* statusOut,
+        _Out_ MString_t** fullPathOut)
+{
+    struct path_cache_entry* entry;
+
+    entry = hashtable_get(&g_paths, &(struct path_cache_entry) {
+        .workingDirectory = workingDirectory ? workingDirectory : "", .path = MStringRaw(path) });
+    if (!entry) {
+        g_misses++;
+        return 0;
+    }
+
+    TRACE("[path_cache] %s resolved to %s", MStringRaw(path), entry->fullPath ? entry->fullPath : "nothing");
+    *statusOut = entry->status;
+    if (entry->fullPath) {
+        *fullPathOut = MStringCreate(entry->fullPath, StrUTF8);
+        g_hits++;
+    }
+    else {
+        g_negativeHits++;
+    }
+    return 1;
+}
+
+void
+PathCacheInvalidate(
+        _In_ const char* path)
+{
+    struct path_invalidate_context* context;
+
+    if (!g_paths.element_count) {
+        return;
+    }
+
+    context = malloc(sizeof(struct path_invalidate_context));
+    if (!context) {
+        return;
+    }
+    context->count = 0;
+
+    if (path && *path) {
+        context->path       = path;
+        context->name       = __GetName(path);
+        context->pathLength = strlen(path);
+        hashtable_enumerate(&g_paths, __CollectChanged, context);
+    }
+    else {
+        hashtable_enumerate(&g_paths, __CollectAll, context);
+    }
+
+    TRACE("[path_cache] %s changed, dropping %i resolutions", (path && *path) ? path : "filesystem", context->count);
+    __RemoveEntries(context);
+    free(context);
+}
+
+void
+PathCacheStore(
+        _In_ const char* workingDirectory,
+        _In_ MString_t*  path,
+        _In_ OsStatus_t  status,
+        _In_ MString_t*  fullPath)
+{
+    struct path_cache_entry entry;
+
+    // Running out of memory says nothing about the path
+    if (status == OsOutOfMemory) {
+        return;
+    }
+
+    if (g_paths.element_count >= PATH_CACHE_CAPACITY) {
+        PathCacheInvalidate(NULL);
+    }
+
+    entry.workingDirectory = strdup(workingDirectory ? workingDirectory : "");
+    entry.path             = strdup(MStringRaw(path));
+    entry.fullPath         = (status == OsSuccess) ? strdup(MStringRaw(fullPath)) : NULL;
+    entry.status           = status;
+    if (!entry.workingDirectory || !entry.path || (status == OsSuccess && !entry.fullPath)) {
+        __FreeEntry(&entry);
+        return;
+    }
+
+    // Another thread may have resolved the same path meanwhile
+    if (hashtable_get(&g_paths, &entry)) {
+        __FreeEntry(&entry);
+        return;
+    }
+    hashtable_set(&g_paths, &entry);
+}
+
+void
+PathCacheGetStatistics(
+        _In_ OsImageCacheStatistics_t* statistics)
+{
+    statistics->PathHits          = g_hits;
+    statistics->PathNegativeHits  = g_negativeHits;
+    statistics->PathMisses        = g_misses;
+    statistics->PathInvalidations = g_invalidations;
+    statistics->PathEntries       = g_paths.element_count;
+}
+
+static OsStatus_t
+TestFilePath(
+        _In_
+        MString_t *Path)
+{
+    OsFileDescriptor_t FileStats;
+    if (GetFileInformationFromPath((const char *) MStringRaw(Path), &FileStats) != FsOk) {
+        return OsError;
+    }
+    return OsSuccess;
+}
+
+static OsStatus_t
+GuessBasePath(
+        _In_  MString_t *WorkingDirectory,
+        _In_  MString_t *Path,
+        _Out_ MString_t **FullPathOut)
+{
+    // Check the working directory, if it fails iterate the environment defaults
+    MString_t *Result;
+    int       IsApp;
+    int       IsDll;
+
+    // Start by testing against the loaders current working directory,
+    // however this won't work for the base process
+    if (WorkingDirectory != NULL) {
+        Result = MStringClone(WorkingDirectory);
+        MStringAppendCharacter(Result, '/');
+        MStringAppend(Result, Path);
+        if (TestFilePath(Result) == OsSuccess) {
+            *FullPathOut = Result;
+            return OsSuccess;
+        }
+    }
+    else {
+        Result = MStringCreate(NULL, StrUTF8);
+    }
+
+    // At this point we have to run through all PATH values
+    // Look at the type of file we are trying to load. .app? .dll? 
+    // for other types its most likely resource load
+    IsApp = MStringFindCString(Path, ".app");
+    IsDll = MStringFindCString(Path, ".dll");
+    if (IsApp != MSTRING_NOT_FOUND || IsDll != MSTRING_NOT_FOUND) {
+        MStringReset(Result, "$bin/", StrUTF8);
+    }
+    else {
+        MStringReset(Result, "$sys/", StrUTF8);
+    }
+    MStringAppend(Result, Path);
+    if (TestFilePath(Result) == OsSuccess) {
+        *FullPathOut = Result;
+        return OsSuccess;
+    }
+    else {
+        MStringDestroy(Result);
+        return OsError;
+    }
+}
+
+static OsStatus_t
+ResolveRelativePath(
+        _In_  MString_t*  workingDirectory,
+        _In_  MString_t*  path,
+        _Out_ MString_t** fullPathOut)
+{
+    OsStatus_t osStatus        = OsSuccess;
+    MString_t* temporaryResult = path;
+    char*      canonicalizedPath;
+
+    // If we don't even have an environmental identifier present, we
+    // have to get creative and guess away
+    if (MStringFind(path, '$', 0) == MSTRING_NOT_FOUND) {
+        osStatus = GuessBasePath(workingDirectory, path, &temporaryResult);
+        if (osStatus != OsSuccess) {
+            return osStatus;
+        }
+
+        TRACE("ResolveFilePath basePath=%s", MStringRaw(temporaryResult));
+
+        // If we already deduced an absolute path skip the canonicalizing moment
+        if (MStringFind(temporaryResult, ':', 0) != MSTRING_NOT_FOUND) {
+            *fullPathOut = temporaryResult;
+            return osStatus;
+        }
+    }
+
+    canonicalizedPath = (char *)malloc(_MAXPATH);
+    if (!canonicalizedPath) {
+        ERROR("ResolveFilePath failed to allocate memory buffer for the canonicalized path");
+        osStatus = OsOutOfMemory;
+        goto exit;
+    }
+    memset(canonicalizedPath, 0, _MAXPATH);
+
+    osStatus = PathCanonicalize(MStringRaw(temporaryResult), canonicalizedPath, _MAXPATH);
+    TRACE("ResolveFilePath canonicalizedPath=%s", canonicalizedPath);
+    if (osStatus == OsSuccess) {
+        *fullPathOut = MStringCreate(canonicalizedPath, StrUTF8);
+    }
+    free(canonicalizedPath);
+
+exit:
+    if (temporaryResult != path) {
+        MStringDestroy(temporaryResult);
+    }
+    return osStatus;
+}
+
+OsStatus_t
+ResolveFilePath(
+        _In_  UUId_t      processId,
+        _In_  MString_t*  path,
+        _Out_ MString_t** fullPathOut)
+{
+    Process_t*  process;
+    MString_t*  workingDirectory = NULL;
+    const char* cacheDirectory   = NULL;
+    OsStatus_t  osStatus;
+    ENTRY("ResolveFilePath(processId=%u, path=%s)", processId, MStringRaw(path));
+
+    if (MStringFind(path, ':', 0) != MSTRING_NOT_FOUND) {
+        // Assume absolute path
+        *fullPathOut = MStringClone(path);
+        EXIT("ResolveFilePath");
+        return OsSuccess;
+    }
+
+    // Guessed paths depend on the working directory of the loader, environment
+    // paths only on the filesystem
+    if (MStringFind(path, '$', 0) == MSTRING_NOT_FOUND) {
+        process = AcquireProcess(processId);
+        if (process != NULL) {
+            workingDirectory = MStringClone(process->WorkingDirectory);
+            cacheDirectory   = MStringRaw(workingDirectory);
+            ReleaseProcess(process);
+        }
+    }
+
+    // Every candidate path is a filemanager request, and the same libraries are
+    // resolved for every process, so the results are cached until a path changes
+    if (!PathCacheLookup(cacheDirectory, path, &osStatus, fullPathOut)) {
+        osStatus = ResolveRelativePath(workingDirectory, path, fullPathOut);
+        PathCacheStore(cacheDirectory, path, osStatus, (osStatus == OsSuccess) ? *fullPathOut : NULL);
+    }
+
+    if (workingDirectory != NULL) {
+        MStringDestroy(workingDirectory);
+    }
+    EXIT("ResolveFilePath");
+    return osStatus;
+}
+
+
+static uint64_t path_hash(const void* element)
+{
+    const struct path_cache_entry* entry = element;
+    const uint8_t*                 pointer;
+    uint64_t                       hash  = 14695981039346656037ULL;
+
+    for (pointer = (const uint8_t*)entry->workingDirectory; *pointer; pointer++) {
+        hash ^= *pointer;
+        hash *= 1099511628211ULL;
+    }
+
+    // Keep the two strings apart, so the split between them is part of the key
+    hash ^= 0xFF;
+    hash *= 1099511628211ULL;
+    for (pointer = (const uint8_t*)entry->path; *pointer; pointer++) {
+        hash ^= *pointer;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int path_cmp(const void* element1, const void* element2)
+{
+    const struct path_cache_entry* entry1 = element1;
+    const struct path_cache_entry* entry2 = element2;
+    return strcmp(entry1->path, entry2->path) || strcmp(entry1->workingDirectory, entry2->workingDirectory);
+}
@@ -148,178 +148,6 @@ HandleJoinProcess(
     free(waitContext);
 }
 
-static OsStatus_t
-TestFilePath(
-        _In_
-        MString_t *Path)
-{
-    OsFileDescriptor_t FileStats;
-    if (GetFileInformationFromPath((const char *) MStringRaw(Path), &FileStats) != FsOk) {
-        return OsError;
-    }
-    return OsSuccess;
-}
-
-static OsStatus_t
-GuessBasePath(
-        _In_  UUId_t ProcessId,
-        _In_  MString_t *Path,
-        _Out_ MString_t **FullPathOut)
-{
-    // Check the working directory, if it fails iterate the environment defaults
-    Process_t *Process = AcquireProcess(ProcessId);
-    MString_t *Result;
-    int       IsApp;
-    int       IsDll;
-
-    // Start by testing against the loaders current working directory,
-    // however this won't work for the base process
-    if (Process != NULL) {
-        Result = MStringClone(Process->WorkingDirectory);
-        ReleaseProcess(Process);
-        MStringAppendCharacter(Result, '/');
-        MStringAppend(Result, Path);
-        if (TestFilePath(Result) == OsSuccess) {
-            *FullPathOut = Result;
-            return OsSuccess;
-        }
-    }
-    else {
-        Result = MStringCreate(NULL, StrUTF8);
-    }
-
-    // At this point we have to run through all PATH values
-    // Look at the type of file we are trying to load. .app? .dll? 
-    // for other types its most likely resource load
-    IsApp = MStringFindCString(Path, ".app");
-    IsDll = MStringFindCString(Path, ".dll");
-    if (IsApp != MSTRING_NOT_FOUND || IsDll != MSTRING_NOT_FOUND) {
-        MStringReset(Result, "$bin/", StrUTF8);
-    }
-    else {
-        MStringReset(Result, "$sys/", StrUTF8);
-    }
-    MStringAppend(Result, Path);
-    if (TestFilePath(Result) == OsSuccess) {
-        *FullPathOut = Result;
-        return OsSuccess;
-    }
-    else {
-        MStringDestroy(Result);
-        return OsError;
-    }
-}
-
-OsStatus_t
-ResolveFilePath(
-        _In_  UUId_t      processId,
-        _In_  MString_t*  path,
-        _Out_ MString_t** fullPathOut)
-{
-    OsStatus_t osStatus        = OsSuccess;
-    MString_t* temporaryResult = path;
-    ENTRY("ResolveFilePath(processId=%u, path=%s)", processId, MStringRaw(path));
-
-    if (MStringFind(path, ':', 0) == MSTRING_NOT_FOUND) {
-        // If we don't even have an environmental identifier present, we
-        // have to get creative and guess away
-        if (MStringFind(path, '$', 0) == MSTRING_NOT_FOUND) {
-            osStatus = GuessBasePath(processId, path, &temporaryResult);
-
-            TRACE("ResolveFilePath basePath=%s", MStringRaw(temporaryResult));
-
-            // If we already deduced an absolute path skip the canonicalizing moment
-            if (osStatus == OsSuccess && MStringFind(temporaryResult, ':', 0) != MSTRING_NOT_FOUND) {
-                *fullPathOut = temporaryResult;
-                EXIT("ResolveFilePath");
-                return osStatus;
-            }
-        }
-
-        // Take into account we might have failed to guess base path
-        if (osStatus == OsSuccess) {
-            char* canonicalizedPath = (char *)malloc(_MAXPATH);
-            if (!canonicalizedPath) {
-                ERROR("ResolveFilePath failed to allocate memory buffer for the canonicalized path");
-                EXIT("ResolveFilePath");
-                return OsOutOfMemory;
-            }
-            memset(canonicalizedPath, 0, _MAXPATH);
-
-            osStatus = PathCanonicalize(MStringRaw(temporaryResult), canonicalizedPath, _MAXPATH);
-            TRACE("ResolveFilePath canonicalizedPath=%s", canonicalizedPath);
-            if (osStatus == OsSuccess) {
-                *fullPathOut = MStringCreate(canonicalizedPath, StrUTF8);
-            }
-            free(canonicalizedPath);
-        }
-    }
-    else {
-        // Assume absolute path
-        *fullPathOut = MStringClone(temporaryResult);
-    }
-
-    EXIT("ResolveFilePath");
-    return osStatus;
-}
-
-OsStatus_t
-LoadFile(
-        _In_  MString_t* fullPath,
-        _Out_ void**     bufferOut,
-        _Out_ size_t*    lengthOut)
-{
-    FILE*      file;
-    long       fileSize;
-    void*      fileBuffer;
-    size_t     bytesRead;
-    OsStatus_t osStatus = OsSuccess;
-    ENTRY("LoadFile %s", MStringRaw(fullPath));
-
-    file = fopen(MStringRaw(fullPath), "rb");
-    if (!file) {
-        ERROR("LoadFile fopen failed: %i", errno);
-        osStatus = OsDoesNotExist;
-        goto exit;
-    }
-
-    fseek(file, 0, SEEK_END);
-    fileSize = ftell(file);
-    rewind(file);
-
-    TRACE("[load_file] size %" PRIuIN, fileSize);
-    fileBuffer = malloc(fileSize);
-    if (!fileBuffer) {
-        ERROR("LoadFile null");
-        fclose(file);
-        osStatus = OsOutOfMemory;
-        goto exit;
-    }
-
-    bytesRead = fread(fileBuffer, 1, fileSize, file);
-    fclose(file);
-
-    TRACE("LoadFile read %" PRIuIN " bytes from file", bytesRead);
-
-    *bufferOut = fileBuffer;
-    *lengthOut = fileSize;
-
-exit:
-    EXIT("LoadFile");
-    return osStatus;
-}
-
-void
-UnloadFile(
-        _In_ MString_t* FullPath,
-        _In_ void*      Buffer)
-{
-    // So right now we will simply free the buffer, 
-    // but when we implement caching we will check if it should stay cached
-    _CRT_UNUSED(FullPath);
-    free(Buffer);
-}
-
 OsStatus_t
 InitializeProcessManager(void)
 {
@@ -327,6 +155,9 @@ InitializeProcessManager(void)
                         sizeof(struct process_history_entry), ProcessHistoryHash,
                         ProcessHistoryCmp);
     CreateEventQueue(&g_eventQueue);
+    ImageFileInitialize();
+    ImageCacheInitialize();
+    PathCacheInitialize();
     DebuggerInitialize();
     return OsSuccess;
 }
@@ -790,6 +621,33 @@ void sys_library_unload_invocation(struct gracht_message* message, const UUId_t
     sys_library_unload_response(message, status);
 }
 
+void sys_library_notify_path_changed_invocation(struct gracht_message* message, const char* path)
+{
+    _CRT_UNUSED(message);
+    PathCacheInvalidate(path);
+}
+
+void sys_library_get_cache_stats_invocation(struct gracht_message* message)
+{
+    OsImageCacheStatistics_t     statistics;
+    struct sys_image_cache_stats gstats;
+
+    ImageCacheGetStatistics(&statistics);
+    PathCacheGetStatistics(&statistics);
+    gstats.hits               = statistics.Hits;
+    gstats.misses             = statistics.Misses;
+    gstats.images             = statistics.Images;
+    gstats.mappings           = statistics.Mappings;
+    gstats.shared_bytes       = statistics.SharedBytes;
+    gstats.saved_bytes        = statistics.SavedBytes;
+    gstats.path_hits          = statistics.PathHits;
+    gstats.path_negative_hits = statistics.PathNegativeHits;
+    gstats.path_misses        = statistics.PathMisses;
+    gstats.path_invalidations = statistics.PathInvalidations;
+    gstats.path_entries       = statistics.PathEntries;
+    sys_library_get_cache_stats_response(message, OsSuccess, &gstats);
+}
+
 void sys_process_get_modules_invocation(struct gracht_message* message, const UUId_t handle)
 {
     Process_t* process     = AcquireProcess(handle);
@@ -26,6 +26,7 @@
 
 #include <os/osdefs.h>
 #include <os/process.h>
+#include <os/sharedobject.h>
 #include <os/spinlock.h>
 #include <ds/list.h>
 #include <gracht/server.h>
@@ -81,6 +82,74 @@ InitializeProcessManager(void);
 __EXTERN void
 DebuggerInitialize(void);
 
+/**
+ * ImageFileInitialize
+ * Initializes the tracking of the image files that are loaded and verified
+ */
+__EXTERN void
+ImageFileInitialize(void);
+
+/**
+ * ImageCacheInitialize
+ * Initializes the cache of loaded images that is shared between processes
+ */
+__EXTERN void
+ImageCacheInitialize(void);
+
+/**
+ * ImageCacheGetStatistics
+ * Retrieves the hit rates and the amount of memory shared by the image cache
+ */
+__EXTERN void
+ImageCacheGetStatistics(
+        _In_ OsImageCacheStatistics_t* statistics);
+
+/**
+ * PathCacheInitialize
+ * Initializes the cache of the paths that images were resolved from
+ */
+__EXTERN void
+PathCacheInitialize(void);
+
+/**
+ * PathCacheLookup
+ * Looks up how a path was resolved from the working directory before. Returns 1 if
+ * it was, in which case the path is only provided if the resolution succeeded
+ */
+__EXTERN int
+PathCacheLookup(
+        _In_  const char* workingDirectory,
+        _In_  MString_t*  path,
+        _Out_ OsStatus_t* statusOut,
+        _Out_ MString_t** fullPathOut);
+
+/**
+ * PathCacheStore
+ * Stores the result of resolving a path from the working directory, failures included
+ */
+__EXTERN void
+PathCacheStore(
+        _In_ const char* workingDirectory,
+        _In_ MString_t*  path,
+        _In_ OsStatus_t  status,
+        _In_ MString_t*  fullPath);
+
+/**
+ * PathCacheInvalidate
+ * Drops the resolutions a created or removed path may change, or all of them if NULL
+ */
+__EXTERN void
+PathCacheInvalidate(
+        _In_ const char* path);
+
+/**
+ * PathCacheGetStatistics
+ * Fills in the path resolution part of the statistics
+ */
+__EXTERN void
+PathCacheGetStatistics(
+        _In_ OsImageCacheStatistics_t* statistics);
+
 /* AcquireProcess
  * Acquires a reference to a process and allows safe access to the structure. */
 __EXTERN Process_t*
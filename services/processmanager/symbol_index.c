@@ -0,0 +1,176 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Process Manager - Symbol index
+ *  Contains the binary symbol index that is generated from map files at build time, and
+ *  the lookup of symbols in a loaded symbol context
+ */
+
+//#define __TRACE
+
+#ifndef __TEST
+#include <ddk/utils.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "symbols.h"
+
+OsStatus_t
+SymbolParseIndexFile(
+        _In_ struct symbol_context* symbolContext,
+        _In_ void*                  fileBuffer,
+        _In_ size_t                 fileLength)
+{
+    struct symbol_index_header* header = fileBuffer;
+    struct symbol_index_entry*  entries;
+    const char*                 stringPool;
+    size_t                      tableBytes;
+    uint32_t                    i;
+    TRACE(STR("[SymbolParseIndexFile]"));
+
+    if (fileLength < sizeof(struct symbol_index_header) ||
+        header->magic != SYMBOL_INDEX_MAGIC || header->version != SYMBOL_INDEX_VERSION ||
+        !header->symbol_count || !header->string_pool_size) {
+        return OsError;
+    }
+
+    tableBytes = sizeof(struct symbol_index_entry) * header->symbol_count;
+    if (fileLength - sizeof(struct symbol_index_header) < tableBytes ||
+        fileLength - sizeof(struct symbol_index_header) - tableBytes < header->string_pool_size) {
+        return OsError;
+    }
+
+    entries    = (struct symbol_index_entry*)(header + 1);
+    stringPool = (const char*)&entries[header->symbol_count];
+    if (stringPool[header->string_pool_size - 1] != '\0') {
+        return OsError;
+    }
+
+    TRACE(STR("[SymbolParseIndexFile] symbolCount 0x%x, stringPoolSize 0x%x"),
+          header->symbol_count, header->string_pool_size);
+
+    symbolContext->section_storage = NULL;
+    symbolContext->file_storage    = NULL;
+    symbolContext->symbol_storage  = (char*)malloc(header->string_pool_size);
+    symbolContext->symbols         = (struct map_symbol*)malloc(sizeof(struct map_symbol) * header->symbol_count);
+    if (!symbolContext->symbol_storage || !symbolContext->symbols) {
+        free(symbolContext->symbol_storage);
+        free(symbolContext->symbols);
+        return OsOutOfMemory;
+    }
+
+    memcpy(symbolContext->symbol_storage, stringPool, header->string_pool_size);
+    for (i = 0; i < header->symbol_count; i++) {
+        struct map_symbol* symbol = &symbolContext->symbols[i];
+        if (entries[i].name_offset >= header->string_pool_size ||
+            (i && entries[i].address < entries[i - 1].address)) {
+            free(symbolContext->symbol_storage);
+            free(symbolContext->symbols);
+            return OsError;
+        }
+
+        symbol->section = NULL;
+        symbol->file    = NULL;
+        symbol->name    = &symbolContext->symbol_storage[entries[i].name_offset];
+        symbol->address = (uintptr_t)entries[i].address;
+        symbol->length  = entries[i].length;
+    }
+
+    symbolContext->symbol_count = (int)header->symbol_count;
+    return OsSuccess;
+}
+
+OsStatus_t
+SymbolBuildIndex(
+        _In_  struct symbol_context* symbolContext,
+        _Out_ void**                 bufferOut,
+        _Out_ size_t*                lengthOut)
+{
+    struct symbol_index_header* header;
+    struct symbol_index_entry*  entries;
+    char*                       stringPool;
+    size_t                      stringPoolSize = 0;
+    size_t                      length;
+    uint32_t                    nameOffset = 0;
+    int                         i;
+
+    if (!symbolContext->symbol_count) {
+        return OsError;
+    }
+
+    for (i = 0; i < symbolContext->symbol_count; i++) {
+        stringPoolSize += strlen(symbolContext->symbols[i].name) + 1; // include terminating null
+    }
+
+    length = sizeof(struct symbol_index_header) +
+             (sizeof(struct symbol_index_entry) * symbolContext->symbol_count) + stringPoolSize;
+    header = (struct symbol_index_header*)malloc(length);
+    if (!header) {
+        return OsOutOfMemory;
+    }
+
+    header->magic            = SYMBOL_INDEX_MAGIC;
+    header->version          = SYMBOL_INDEX_VERSION;
+    header->symbol_count     = (uint32_t)symbolContext->symbol_count;
+    header->string_pool_size = (uint32_t)stringPoolSize;
+
+    entries    = (struct symbol_index_entry*)(header + 1);
+    stringPool = (char*)&entries[symbolContext->symbol_count];
+    for (i = 0; i < symbolContext->symbol_count; i++) {
+        struct map_symbol* symbol     = &symbolContext->symbols[i];
+        size_t             nameLength = strlen(symbol->name) + 1;
+
+        entries[i].address     = symbol->address;
+        entries[i].length      = (uint32_t)symbol->length;
+        entries[i].name_offset = nameOffset;
+        memcpy(&stringPool[nameOffset], symbol->name, nameLength);
+        nameOffset += (uint32_t)nameLength;
+    }
+
+    *bufferOut = header;
+    *lengthOut = length;
+    return OsSuccess;
+}
+
+struct map_symbol*
+SymbolContextFind(
+        _In_ struct symbol_context* symbolContext,
+        _In_ uintptr_t              binaryOffset)
+{
+    int low  = 0;
+    int high = symbolContext->symbol_count;
+
+    // find the first symbol above the offset, the one before it contains the offset. Symbols
+    // at the same address resolve to the last of them in map file order
+    while (low < high) {
+        int middle = low + ((high - low) / 2);
+        if (symbolContext->symbols[middle].address <= binaryOffset) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    if (!low) {
+        return NULL;
+    }
+    return &symbolContext->symbols[low - 1];
+}
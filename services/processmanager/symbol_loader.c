@@ -34,8 +34,9 @@
 #include <ctype.h>
 
 static OsStatus_t
-SymbolLoadMapFile(
+SymbolLoadFile(
         _In_  const char* binaryName,
+        _In_  const char* extension,
         _Out_ void**      fileBufferOut,
         _Out_ long*       fileSizeOut);
 
@@ -60,25 +61,38 @@ SymbolsLoadContext(
         _In_  const char*             binaryName,
         _Out_ struct symbol_context** symbolContextOut)
 {
-    // replace extension with .map and see if it exists
+    // replace extension with .idx or .map and see if it exists
     struct symbol_context symbolContext = { 0 };
     long                  fileSize;
     void*                 fileBuffer;
     OsStatus_t            status;
 
-    TRACE("[SymbolsLoadContext] loading map file");
-    status = SymbolLoadMapFile(binaryName, &fileBuffer, &fileSize);
-    if (status != OsSuccess) {
-        WARNING("[SymbolsLoadContext] failed to load map for %s", binaryName);
-        return status;
+    // prefer the prebuilt index, it is already sorted and needs no parsing
+    TRACE("[SymbolsLoadContext] loading index file");
+    status = SymbolLoadFile(binaryName, "idx", &fileBuffer, &fileSize);
+    if (status == OsSuccess) {
+        status = SymbolParseIndexFile(&symbolContext, fileBuffer, fileSize);
+        free(fileBuffer);
+        if (status != OsSuccess) {
+            WARNING("[SymbolsLoadContext] invalid index for %s, falling back to map", binaryName);
+        }
     }
 
-    TRACE("[SymbolsLoadContext] parsing map file, 0x%llx - %llu", fileBuffer, fileSize);
-    status = SymbolParseMapFile(&symbolContext, fileBuffer, fileSize);
-    free(fileBuffer);
     if (status != OsSuccess) {
-        WARNING("[SymbolsLoadContext] failed to parse map for %s", binaryName);
-        return status;
+        TRACE("[SymbolsLoadContext] loading map file");
+        status = SymbolLoadFile(binaryName, "map", &fileBuffer, &fileSize);
+        if (status != OsSuccess) {
+            WARNING("[SymbolsLoadContext] failed to load map for %s", binaryName);
+            return status;
+        }
+
+        TRACE("[SymbolsLoadContext] parsing map file, 0x%llx - %llu", fileBuffer, fileSize);
+        status = SymbolParseMapFile(&symbolContext, fileBuffer, fileSize);
+        free(fileBuffer);
+        if (status != OsSuccess) {
+            WARNING("[SymbolsLoadContext] failed to parse map for %s", binaryName);
+            return status;
+        }
     }
 
     // ok create key now everything is done
@@ -98,9 +112,8 @@ SymbolLookup(
         _Out_ uintptr_t*   symbolOffset)
 {
     struct symbol_context* symbolContext;
-    struct map_symbol*     symbol = NULL;
+    struct map_symbol*     symbol;
     OsStatus_t             status;
-    int                    i;
 
     if (!binaryName) {
         return OsInvalidParameters;
@@ -115,19 +128,10 @@ SymbolLookup(
         }
     }
 
-    // iterate symbols and find matching symbol, always selects last
-    // symbol if the loop reaches end of list
-    for (i = 0; i < symbolContext->symbol_count; i++) {
-        if (i == (symbolContext->symbol_count - 1)) {
-            symbol = &symbolContext->symbols[i];
-            break;
-        }
-
-        if (binaryOffset >= symbolContext->symbols[i].address &&
-            binaryOffset <  symbolContext->symbols[i + 1].address) {
-            symbol = &symbolContext->symbols[i];
-            break;
-        }
+    // symbols are sorted by address, the last symbol covers the rest of the image
+    symbol = SymbolContextFind(symbolContext, binaryOffset);
+    if (!symbol) {
+        return OsDoesNotExist;
     }
 
     *symbolName   = symbol->name;
@@ -136,8 +140,9 @@ SymbolLookup(
 }
 
 static OsStatus_t
-SymbolLoadMapFile(
+SymbolLoadFile(
         _In_  const char* binaryName,
+        _In_  const char* extension,
         _Out_ void**      fileBufferOut,
         _Out_ long*       fileSizeOut)
 {
@@ -157,13 +162,13 @@ SymbolLoadMapFile(
         strcpy(&tmp[0], binaryName);
     }
 
-    sprintf(&path[0], "$bin/../maps/%s.map", &tmp[0]);
+    sprintf(&path[0], "$bin/../maps/%s.%s", &tmp[0], extension);
 
     TRACE("[SymbolsLoadContext] trying to load %s", &path[0]);
-    file = fopen(&path[0], "r");
+    file = fopen(&path[0], "rb");
     if (!file) {
-        // map did not exist
-        ERROR("[SymbolsLoadContext] map file not found at %s", &path[0]);
+        // file did not exist, not all binaries have an index
+        TRACE("[SymbolsLoadContext] file not found at %s", &path[0]);
         return OsDoesNotExist;
     }
 
@@ -187,6 +192,7 @@ SymbolLoadMapFile(
 
     if (bytesRead != fileSize) {
         ERROR("[SymbolsLoadContext] fread returned %i", (int)bytesRead);
+        free(fileBuffer);
         return OsError;
     }
 
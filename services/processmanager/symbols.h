@@ -46,6 +46,24 @@ struct symbol_context {
     int                symbol_count;
 };
 
+// Binary symbol index, produced at build time by tools/mapindex from the .map files.
+// Layout: header, symbol_count entries sorted by address, string pool with the names.
+#define SYMBOL_INDEX_MAGIC   0x5844494D // "MIDX"
+#define SYMBOL_INDEX_VERSION 1
+
+struct symbol_index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t symbol_count;
+    uint32_t string_pool_size;
+};
+
+struct symbol_index_entry {
+    uint64_t address;
+    uint32_t length;
+    uint32_t name_offset;
+};
+
 /**
  * SymbolInitialize
  */
@@ -82,4 +100,46 @@ SymbolParseMapFile(
         _In_ void*                  fileBuffer,
         _In_ size_t                 fileLength);
 
+/**
+ * SymbolParseIndexFile
+ * Loads a binary symbol index into the provided symbol context. The index is already sorted, so
+ * no parsing of the map is needed. Section and file information is not part of the index.
+ * @param symbolContext The symbol context to fill
+ * @param fileBuffer    The contents of the index file
+ * @param fileLength    Length of the index file
+ * @return              OsError if the index is malformed
+ */
+__EXTERN OsStatus_t
+SymbolParseIndexFile(
+        _In_ struct symbol_context* symbolContext,
+        _In_ void*                  fileBuffer,
+        _In_ size_t                 fileLength);
+
+/**
+ * SymbolBuildIndex
+ * Serializes the symbols of a loaded symbol context into the binary index format.
+ * @param symbolContext The symbol context, symbols must be sorted by address
+ * @param bufferOut     Pointer to storage for the allocated index, must be freed by the caller
+ * @param lengthOut     Pointer to storage for the length of the index
+ * @return              Status of the operation
+ */
+__EXTERN OsStatus_t
+SymbolBuildIndex(
+        _In_  struct symbol_context* symbolContext,
+        _Out_ void**                 bufferOut,
+        _Out_ size_t*                lengthOut);
+
+/**
+ * SymbolContextFind
+ * Finds the symbol that contains the given offset, which is the symbol with the highest address
+ * that is less than or equal to the offset. The symbols must be sorted by address.
+ * @param symbolContext The symbol context to search
+ * @param binaryOffset  Address offset into the binary file
+ * @return              The symbol, or NULL if the offset lies before the first symbol
+ */
+__EXTERN struct map_symbol*
+SymbolContextFind(
+        _In_ struct symbol_context* symbolContext,
+        _In_ uintptr_t              binaryOffset);
+
 #endif //__PROCESSMANAGER_SYMBOLS_H__
@@ -0,0 +1,102 @@
+/* MapIndex Utility
+ * Author: Philip Meulengracht
+ * Date: 17-10-26
+ * Used as a utility for MollenOS to convert linker map files into the binary symbol
+ * index that the process manager loads when symbolizing crash stacks */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+// Build the process manager parser for the host, this provides the parts of the
+// os headers it depends on
+#define __TEST
+#define _In_
+#define _Out_
+#define __EXTERN extern
+#define _MAXPATH 512
+#define __BITS   (UINTPTR_MAX == 0xFFFFFFFF ? 32 : 64)
+
+typedef int OsStatus_t;
+#define OsSuccess     (int)0
+#define OsOutOfMemory (int)-1
+#define OsError       (int)-2
+
+#define PRIxIN     "zx"
+#define STR(str)   str "\n"
+#define TRACE(...)
+
+#include "../../services/processmanager/map_parser.c"
+#include "../../services/processmanager/symbol_index.c"
+
+int main(int argc, char *argv[])
+{
+    struct symbol_context Context = { 0 };
+    FILE *Input = NULL, *Output = NULL;
+    void *Buffer = NULL, *Index = NULL;
+    size_t IndexLength;
+    long FileSize;
+    int Status;
+
+    // Sanitize parameters
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <input.map> <output.idx>\n", argv[0]);
+        return -1;
+    }
+
+    // Open input file
+    Input = fopen(argv[1], "rb");
+    if (Input == NULL) {
+        fprintf(stderr, "%s: can't open %s for reading\n", argv[0], argv[1]);
+        return -1;
+    }
+
+    // Get the file length
+    fseek(Input, 0, SEEK_END);
+    FileSize = ftell(Input);
+    fseek(Input, 0, SEEK_SET);
+
+    // Read the file and cleanup
+    Buffer = malloc(FileSize);
+    if (Buffer == NULL || fread(Buffer, 1, FileSize, Input) != (size_t)FileSize) {
+        fprintf(stderr, "%s: can't read %s\n", argv[0], argv[1]);
+        fclose(Input);
+        free(Buffer);
+        return -1;
+    }
+    fclose(Input);
+
+    // Parse and sort the symbols, then serialize them
+    Status = SymbolParseMapFile(&Context, Buffer, FileSize);
+    free(Buffer);
+    if (Status != OsSuccess) {
+        fprintf(stderr, "%s: no symbols found in %s\n", argv[0], argv[1]);
+        return -1;
+    }
+
+    Status = SymbolBuildIndex(&Context, &Index, &IndexLength);
+    if (Status != OsSuccess) {
+        fprintf(stderr, "%s: failed to build index for %s\n", argv[0], argv[1]);
+        return -1;
+    }
+
+    // Write the output file
+    Output = fopen(argv[2], "wb");
+    if (Output == NULL) {
+        fprintf(stderr, "%s: can't open %s for writing\n", argv[0], argv[2]);
+        free(Index);
+        return -1;
+    }
+
+    if (fwrite(Index, 1, IndexLength, Output) != IndexLength) {
+        fprintf(stderr, "%s: can't write %s\n", argv[0], argv[2]);
+        fclose(Output);
+        free(Index);
+        return -1;
+    }
+    free(Index);
+
+    printf("%s: %i symbols, %zu bytes\n", argv[2], Context.symbol_count, IndexLength);
+    return fclose(Output);
+}
@@ -100,12 +100,32 @@ def recursive_copy_files(source_path, destination_path, pattern='*', overwrite=F
     return files_count
 
 
+def create_map_indices(source_path, tool_path):
+    """
+    Converts all map files in a directory to binary symbol indices next to them.
+    :param source_path: directory containing the map files
+    :param tool_path: path to the mapindex utility
+    :return: count of created indices
+    """
+    files_count = 0
+    items = glob.glob(source_path + '/*.map')
+    for item in items:
+        index = os.path.splitext(item)[0] + '.idx'
+        if subprocess.call([tool_path, item, index]) == 0:
+            files_count += 1
+        else:
+            print("utils: failed to create index for " + item)
+    return files_count
+
+
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(description='Installation utilities for building and releasing Vali.')
     parser.add_argument('--cp', default=False, action='store_true',
                         help='invoke script in copy-file mode, use --source, --dest and --pattern')
     parser.add_argument('--create-zip', default=False, action='store_true',
                         help='create a release zip from a directory with the current versioning')
+    parser.add_argument('--map-index', default=False, action='store_true',
+                        help='convert map files to symbol indices, use --source and --tool')
 
     cpArguments = parser.add_argument_group('cp')
     cpArguments.add_argument('--source', default=None, help='source directory for cp')
@@ -116,6 +136,9 @@ if __name__ == "__main__":
     czArguments.add_argument('--zip-dirs', default=None, help='source directory for create-zip')
     czArguments.add_argument('--zip-out', default=None, help='zip file output path')
 
+    miArguments = parser.add_argument_group('map-index')
+    miArguments.add_argument('--tool', default=None, help='path to the mapindex utility')
+
     pargs = parser.parse_args()
 
     if pargs.cp:
@@ -124,6 +147,12 @@ if __name__ == "__main__":
             sys.exit(0)
         else:
             print("utils: missing arg --source or --dest")
+    elif pargs.map_index:
+        if pargs.source and pargs.tool:
+            create_map_indices(pargs.source, pargs.tool)
+            sys.exit(0)
+        else:
+            print("utils: missing arg --source or --tool")
     elif pargs.create_zip:
         output_regex = re.compile('([0-9]+).([0-9]+).([0-9]+)', re.IGNORECASE)
 
@@ -0,0 +1,807 @@
+
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+#include <math.h>
+
+#define _Out_Opt_
+#define _CRT_UNUSED(x) (void)x
+#define OsDeviceError  (int)10
+#define UUID_INVALID   (UUId_t)0xFFFFFFFF
+
+#define PACKED_TYPESTRUCT(name, body) typedef struct __attribute__((packed)) name body name##_t
+#define LOBYTE(l)  ((uint8_t)(uint16_t)(l))
+#define HIBYTE(l)  ((uint8_t)((((uint16_t)(l)) >> 8) & 0xFF))
+#define LODWORD(l) ((uint32_t)(l))
+#define HIDWORD(l) ((uint32_t)(((uint64_t)(l)) >> 32))
+#define LOWORD(l)  ((uint16_t)(uint32_t)(l))
+
+typedef uint32_t reg32_t;
+typedef int      spinlock_t;
+
+typedef struct BusDevice { int Id; } BusDevice_t;
+typedef struct DeviceIo { int Id; } DeviceIo_t;
+
+typedef union {
+    struct { uint32_t LowPart; uint32_t HighPart; } u;
+    uint64_t QuadPart;
+} LargeUInteger_t;
+
+#define __STORAGE_OPERATION_READ  0x00000001
+#define __STORAGE_OPERATION_WRITE 0x00000002
+#define __STORAGE_SUBMIT_NOTIFY   0x00000001
+#define __STORAGE_MAX_SEGMENTS    64
+#define __STORAGE_MAX_FINISHED    256
+
+typedef struct StorageTransferSegment {
+    uint64_t Sector;
+    UUId_t   BufferHandle;
+    size_t   BufferOffset;
+    size_t   SectorCount;
+} StorageTransferSegment_t;
+
+typedef struct StorageDescriptor {
+    UUId_t       Driver;
+    UUId_t       Device;
+    unsigned int Flags;
+    char         Model[64];
+    char         Serial[32];
+    size_t       SectorSize;
+    uint64_t     SectorCount;
+} StorageDescriptor_t;
+
+// Dma buffers are plain host memory, physical addresses are the virtual addresses
+#define DMA_UNCACHEABLE 0x00000002U
+#define DMA_CLEAN       0x00000004U
+#define DMA_PAGE_SIZE   0x1000
+
+struct dma_sg {
+    uintptr_t address;
+    size_t    length;
+};
+
+struct dma_sg_table {
+    struct dma_sg* entries;
+    int            count;
+};
+
+struct dma_buffer_info {
+    const char*  name;
+    size_t       length;
+    size_t       capacity;
+    unsigned int flags;
+};
+
+struct dma_attachment {
+    UUId_t handle;
+    void*  buffer;
+    size_t length;
+};
+
+static struct dma_attachment g_dmaBuffers[128];
+static int                   g_dmaBufferCount = 1;
+
+static OsStatus_t
+dma_create(struct dma_buffer_info* info, struct dma_attachment* attachment)
+{
+    size_t length = (info->capacity + DMA_PAGE_SIZE - 1) & ~(size_t)(DMA_PAGE_SIZE - 1);
+    if (g_dmaBufferCount == SIZEOF_ARRAY(g_dmaBuffers)) {
+        return OsOutOfMemory;
+    }
+
+    attachment->handle = (UUId_t)g_dmaBufferCount;
+    attachment->buffer = aligned_alloc(DMA_PAGE_SIZE, length);
+    attachment->length = info->length;
+    memset(attachment->buffer, 0, length);
+    g_dmaBuffers[g_dmaBufferCount++] = *attachment;
+    return OsSuccess;
+}
+
+static OsStatus_t
+dma_attach(UUId_t handle, struct dma_attachment* attachment)
+{
+    if (handle == 0 || handle >= (UUId_t)g_dmaBufferCount) {
+        return OsDoesNotExist;
+    }
+    *attachment = g_dmaBuffers[handle];
+    return OsSuccess;
+}
+
+static OsStatus_t dma_detach(struct dma_attachment* attachment) { return OsSuccess; }
+static OsStatus_t dma_attachment_unmap(struct dma_attachment* attachment) { return OsSuccess; }
+
+// Every page is its own entry, like a buffer that is not physically contiguous
+static OsStatus_t
+dma_get_sg_table(struct dma_attachment* attachment, struct dma_sg_table* table, int maxCount)
+{
+    int i;
+
+    table->count   = (int)((attachment->length + DMA_PAGE_SIZE - 1) / DMA_PAGE_SIZE);
+    table->entries = malloc(sizeof(struct dma_sg) * (size_t)table->count);
+    for (i = 0; i < table->count; i++) {
+        table->entries[i].address = (uintptr_t)attachment->buffer + ((size_t)i * DMA_PAGE_SIZE);
+        table->entries[i].length  = MIN((size_t)DMA_PAGE_SIZE, attachment->length - ((size_t)i * DMA_PAGE_SIZE));
+    }
+    return OsSuccess;
+}
+
+static OsStatus_t
+dma_sg_table_offset(struct dma_sg_table* table, size_t offset, int* sgIndex, size_t* sgOffset)
+{
+    int i;
+    for (i = 0; i < table->count; i++) {
+        if (offset < table->entries[i].length) {
+            *sgIndex  = i;
+            *sgOffset = offset;
+            return OsSuccess;
+        }
+        offset -= table->entries[i].length;
+    }
+    return OsInvalidParameters;
+}
+
+struct gracht_message {
+    int client;
+    int Request;
+};
+
+typedef struct gracht_server gracht_server_t;
+static gracht_server_t* __crt_get_module_server(void) { return NULL; }
+
+#define GRACHT_MESSAGE_DEFERRABLE_SIZE(message) sizeof(struct gracht_message)
+
+static void
+gracht_server_defer_message(struct gracht_message* message, struct gracht_message* deferred)
+{
+    *deferred = *message;
+}
+
+enum sys_transfer_direction {
+    SYS_TRANSFER_DIRECTION_READ  = __STORAGE_OPERATION_READ,
+    SYS_TRANSFER_DIRECTION_WRITE = __STORAGE_OPERATION_WRITE
+};
+
+void ctt_storage_transfer_response(struct gracht_message* message, OsStatus_t status, size_t sectorsTransferred);
+
+// Vectored requests are covered by storage_batch_bench
+static void ctt_storage_submit_response(struct gracht_message* message, OsStatus_t status, UUId_t requestId) { }
+static void ctt_storage_poll_response(struct gracht_message* message, OsStatus_t status, size_t sectorsTransferred) { }
+static void ctt_storage_event_transfer_complete_single(gracht_server_t* server, int client, UUId_t deviceId,
+    UUId_t requestId, OsStatus_t status, size_t sectorsTransferred) { }
+
+static int thrd_sleepex(size_t milliseconds) { return 0; }
+
+#define WaitForConditionWithFault(fault, condition, runs, wait) \
+    fault = 0; \
+    for (unsigned int timeout_ = 0; !(condition); timeout_++) { \
+        if (timeout_ >= runs) { fault = 1; break; } \
+        thrd_sleepex(wait); \
+    }
+
+// The port registers are plain memory, so writes are routed through the mock HBA to give
+// CI and SACT their write-1-to-set behaviour and to let it fetch commands as they are issued
+static void hba_write_register(reg32_t* reg, reg32_t value);
+
+#undef WRITE_VOLATILE
+#define WRITE_VOLATILE(x, v) hba_write_register((reg32_t*)&(x), (reg32_t)(v))
+
+// Lets a test take slots from under the slot allocator, as another thread would between
+// its load of the slots and the compare exchange
+static reg32_t g_racedSlots;
+static int     g_raceArmed;
+
+#undef atomic_compare_exchange_strong
+#define atomic_compare_exchange_strong(object, expected, desired) \
+    (g_raceArmed && (g_raceArmed = 0, atomic_fetch_or(object, g_racedSlots), 1) ? \
+        (*(expected) = atomic_load(object), 0) : \
+        __atomic_compare_exchange_n(object, expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+
+#include "../modules/storage/ahci/dispatch.c"
+#include "../modules/storage/ahci/port.c"
+#include "../modules/storage/ahci/transactions.c"
+
+#define TEST_NAME "ahci_ncq_test"
+
+#define HBA_ERROR(...) do { \
+    fprintf(stderr, "ahci_ncq_test: hba: " __VA_ARGS__); fprintf(stderr, "\n"); g_hba.Errors++; } while (0)
+
+// Seek model of a 7200rpm disk, 1TB of 512 byte sectors
+#define DISK_SECTORS       (1ULL << 31)
+#define SECTOR_SIZE        512
+#define SECTORS_PER_TRACK  2048
+#define DISK_TRACKS        (DISK_SECTORS / SECTORS_PER_TRACK)
+#define ROTATION_NS        8333333ULL
+#define SEEK_SETTLE_NS     500000.0
+#define SEEK_FULL_NS       16000000.0
+#define COMMAND_NS         20000ULL
+
+#define REQUEST_COUNT      3000
+#define BUFFER_COUNT       64
+
+struct hba_command {
+    int              Queued;
+    int              Write;
+    uint64_t         Sector;
+    uint32_t         Count;
+    uint64_t         Sequence;
+    FISRegisterH2D_t Fis;
+};
+
+static struct {
+    AhciController_t*  Controller;
+    AhciPort_t*        Port;
+    reg32_t            Accepted;
+    struct hba_command Commands[32];
+    uint64_t           Sequence;
+    uint64_t           Now;
+    uint64_t           Track;
+    int                MaxOutstanding;
+    int                OutOfOrder;
+    int                QueuedCommands;
+    int                LegacyCommands;
+    int                Errors;
+} g_hba;
+
+static uint32_t
+sector_word(uint64_t sector, int index)
+{
+    return (uint32_t)(sector * 0x9E3779B1ULL) ^ (uint32_t)index ^ (uint32_t)(sector >> 32);
+}
+
+static void
+hba_accept(int slot)
+{
+    AHCICommandList_t*   commandList = (AHCICommandList_t*)g_hba.Port->CommandListDMA.buffer;
+    AHCICommandHeader_t* header      = &commandList->Headers[slot];
+    struct hba_command*  command     = &g_hba.Commands[slot];
+    AHCICommandTable_t*  table;
+    FISRegisterH2D_t*    fis;
+    uint64_t             tableAddress;
+    int                  outstanding = 0;
+    int                  i;
+
+    tableAddress = header->CmdTableBaseAddress | ((uint64_t)header->CmdTableBaseAddressUpper << 32);
+    table        = (AHCICommandTable_t*)(uintptr_t)tableAddress;
+    fis          = (FISRegisterH2D_t*)&table->FISCommand[0];
+    if (table != AhciPortGetCommandTable(g_hba.Port, slot)) {
+        HBA_ERROR("slot %i does not use its own command table", slot);
+    }
+    if (g_hba.Accepted & (1U << slot)) {
+        HBA_ERROR("slot %i was issued while in flight", slot);
+    }
+    if (!(atomic_load(&g_hba.Port->Slots) & (1U << slot))) {
+        HBA_ERROR("slot %i was issued without being allocated", slot);
+    }
+    if (fis->Type != FISRegisterH2D || !(fis->Flags & FIS_REGISTER_H2D_FLAG_COMMAND)) {
+        HBA_ERROR("slot %i has an invalid FIS", slot);
+    }
+
+    memset(command, 0, sizeof(struct hba_command));
+    memcpy(&command->Fis, fis, sizeof(FISRegisterH2D_t));
+    command->Sequence = g_hba.Sequence++;
+    command->Sector   = (uint64_t)fis->SectorNo | ((uint64_t)fis->CylinderLow << 8) |
+        ((uint64_t)fis->CylinderHigh << 16) | ((uint64_t)fis->SectorNoExtended << 24) |
+        ((uint64_t)fis->CylinderLowExtended << 32) | ((uint64_t)fis->CylinderHighExtended << 40);
+
+    switch (fis->Command) {
+        case AtaFPDmaReadQueued:
+        case AtaFPDmaWriteQueued: {
+            command->Queued = 1;
+            command->Write  = fis->Command == AtaFPDmaWriteQueued;
+            command->Count  = (uint32_t)fis->FeaturesLow | ((uint32_t)fis->FeaturesHigh << 8);
+            if (!command->Count) {
+                command->Count = 0x10000;
+            }
+            if ((fis->Count >> 3) != slot || (fis->Count & 0x7)) {
+                HBA_ERROR("slot %i was issued with tag %i", slot, fis->Count >> 3);
+            }
+            if (fis->Device != FIS_REGISTER_H2D_DEVICE_LBAMODE) {
+                HBA_ERROR("slot %i has device register 0x%x", slot, fis->Device);
+            }
+            if (!(READ_VOLATILE(g_hba.Port->Registers->SACT) & (1U << slot))) {
+                HBA_ERROR("queued slot %i was issued without setting SActive", slot);
+            }
+            if (!(header->Flags & (1 << 6)) != !command->Write) {
+                HBA_ERROR("slot %i has the wrong direction in the command header", slot);
+            }
+            g_hba.QueuedCommands++;
+        } break;
+        case AtaDMAReadExt:
+        case AtaDMAWriteExt: {
+            command->Write = fis->Command == AtaDMAWriteExt;
+            command->Count = fis->Count ? fis->Count : 0x10000;
+            g_hba.LegacyCommands++;
+        } break;
+        case AtaPIOIdentifyDevice: {
+            command->Count = 1;
+            g_hba.LegacyCommands++;
+        } break;
+        default: {
+            HBA_ERROR("slot %i has unsupported command 0x%x", slot, fis->Command);
+        } break;
+    }
+
+    // Queued and non-queued commands must never be outstanding at the same time
+    for (i = 0; i < 32; i++) {
+        if (i != slot && (g_hba.Accepted & (1U << i))) {
+            if (!command->Queued || !g_hba.Commands[i].Queued) {
+                HBA_ERROR("slot %i (queued %i) was issued while slot %i (queued %i) is in flight",
+                    slot, command->Queued, i, g_hba.Commands[i].Queued);
+            }
+            outstanding++;
+        }
+    }
+    g_hba.Accepted      |= (1U << slot);
+    g_hba.MaxOutstanding = MAX(g_hba.MaxOutstanding, outstanding + 1);
+
+    // The device clears CI once it has received a queued command, the D2H FIS that
+    // goes with it clears BSY
+    if (command->Queued) {
+        AHCIFis_t* receivedFis = (AHCIFis_t*)g_hba.Port->RecievedFisDMA.buffer;
+        receivedFis->RegisterD2H.Type   = FISRegisterD2H;
+        receivedFis->RegisterD2H.Status = ATA_STS_DEV_READY;
+        g_hba.Port->Registers->CI &= ~(1U << slot);
+    }
+}
+
+static void
+hba_write_register(reg32_t* reg, reg32_t value)
+{
+    reg32_t issued;
+    int     i;
+
+    if (!g_hba.Port || (reg != &g_hba.Port->Registers->CI && reg != &g_hba.Port->Registers->SACT)) {
+        *(volatile reg32_t*)reg = value;
+        return;
+    }
+
+    issued = value & ~*reg;
+    *(volatile reg32_t*)reg |= value;
+    if (reg == &g_hba.Port->Registers->CI) {
+        for (i = 0; i < 32; i++) {
+            if (issued & (1U << i)) {
+                hba_accept(i);
+            }
+        }
+    }
+}
+
+static uint64_t
+hba_seek_time(uint64_t track)
+{
+    uint64_t distance = track > g_hba.Track ? track - g_hba.Track : g_hba.Track - track;
+    if (!distance) {
+        return 0;
+    }
+    return (uint64_t)(SEEK_SETTLE_NS + (SEEK_FULL_NS - SEEK_SETTLE_NS) * sqrt((double)distance / (double)DISK_TRACKS));
+}
+
+// Time until the first sector of the command passes under the head
+static uint64_t
+hba_access_time(struct hba_command* command)
+{
+    uint64_t seek    = hba_seek_time(command->Sector / SECTORS_PER_TRACK);
+    uint64_t arrival = (g_hba.Now + COMMAND_NS + seek) % ROTATION_NS;
+    uint64_t angle   = ((command->Sector % SECTORS_PER_TRACK) * ROTATION_NS) / SECTORS_PER_TRACK;
+    return COMMAND_NS + seek + ((angle + ROTATION_NS - arrival) % ROTATION_NS);
+}
+
+static void
+hba_transfer(int slot, struct hba_command* command)
+{
+    AHCICommandList_t*   commandList = (AHCICommandList_t*)g_hba.Port->CommandListDMA.buffer;
+    AHCICommandHeader_t* header      = &commandList->Headers[slot];
+    AHCICommandTable_t*  table       = AhciPortGetCommandTable(g_hba.Port, slot);
+    size_t               expected    = (size_t)command->Count * SECTOR_SIZE;
+    size_t               transferred = 0;
+    int                  i;
+
+    if (memcmp(&table->FISCommand[0], &command->Fis, sizeof(FISRegisterH2D_t))) {
+        HBA_ERROR("command table of slot %i was modified while in flight", slot);
+    }
+
+    for (i = 0; i < header->TableLength; i++) {
+        AHCIPrdtEntry_t* prdt    = &table->PrdtEntry[i];
+        uint8_t*         address = (uint8_t*)(uintptr_t)(prdt->DataBaseAddress |
+            ((uint64_t)prdt->DataBaseAddressUpper << 32));
+        size_t           length  = (prdt->Descriptor & 0x3FFFFF) + 1;
+        size_t           j;
+
+        if (((prdt->Descriptor & AHCI_PRDT_IOC) != 0) != (i == header->TableLength - 1)) {
+            HBA_ERROR("slot %i has interrupt on completion set on entry %i of %i", slot, i, header->TableLength);
+        }
+        if (transferred + length > expected) {
+            HBA_ERROR("slot %i describes more than %" PRIuIN " bytes", slot, expected);
+            return;
+        }
+
+        // Identify data is left as zeroes, everything else is a pattern of the sector
+        for (j = 0; j < length && command->Fis.Command != AtaPIOIdentifyDevice; j += sizeof(uint32_t)) {
+            size_t   offset = transferred + j;
+            uint64_t sector = command->Sector + (offset / SECTOR_SIZE);
+            uint32_t word   = sector_word(sector, (int)((offset % SECTOR_SIZE) / sizeof(uint32_t)));
+            if (command->Write) {
+                if (*(uint32_t*)(address + j) != word) {
+                    HBA_ERROR("slot %i wrote the wrong data to sector %" PRIu64, slot, sector);
+                    return;
+                }
+            }
+            else {
+                *(uint32_t*)(address + j) = word;
+            }
+        }
+        transferred += length;
+    }
+
+    if (transferred != expected) {
+        HBA_ERROR("slot %i describes %" PRIuIN " bytes, the command is %" PRIuIN, slot, transferred, expected);
+    }
+    header->PRDByteCount = command->Queued ? 0 : (uint32_t)transferred;
+}
+
+// Executes the next command the device picks and raises the completion interrupt,
+// queued commands are serviced in shortest access time order
+static int
+hba_step(void)
+{
+    AHCIFis_t*          receivedFis = (AHCIFis_t*)g_hba.Port->RecievedFisDMA.buffer;
+    struct hba_command* command = NULL;
+    uint64_t            bestTime = 0;
+    uint64_t            oldest = UINT64_MAX;
+    int                 slot = -1;
+    int                 i;
+
+    for (i = 0; i < 32; i++) {
+        if (g_hba.Accepted & (1U << i)) {
+            uint64_t accessTime = hba_access_time(&g_hba.Commands[i]);
+            oldest = MIN(oldest, g_hba.Commands[i].Sequence);
+            if (slot == -1 || accessTime < bestTime) {
+                slot     = i;
+                bestTime = accessTime;
+            }
+        }
+    }
+    if (slot == -1) {
+        return 0;
+    }
+
+    command = &g_hba.Commands[slot];
+    if (command->Sequence != oldest) {
+        g_hba.OutOfOrder++;
+    }
+
+    g_hba.Now  += bestTime + ((uint64_t)command->Count * ROTATION_NS) / SECTORS_PER_TRACK;
+    g_hba.Track = (command->Sector + command->Count - 1) / SECTORS_PER_TRACK;
+    hba_transfer(slot, command);
+
+    g_hba.Accepted &= ~(1U << slot);
+    if (command->Queued) {
+        receivedFis->DeviceBits.Type   = FISDeviceBits;
+        receivedFis->DeviceBits.Status = ATA_STS_DEV_READY;
+        receivedFis->DeviceBits.Error  = 0;
+        g_hba.Port->Registers->SACT &= ~(1U << slot);
+        atomic_fetch_or(&g_hba.Controller->InterruptResource.PortInterruptStatus[g_hba.Port->Index], AHCI_PORT_IE_SDBE);
+    }
+    else {
+        receivedFis->RegisterD2H.Type   = FISRegisterD2H;
+        receivedFis->RegisterD2H.Status = ATA_STS_DEV_READY;
+        g_hba.Port->Registers->CI &= ~(1U << slot);
+        atomic_fetch_or(&g_hba.Controller->InterruptResource.PortInterruptStatus[g_hba.Port->Index], AHCI_PORT_IE_DHRE);
+    }
+    AhciPortInterruptHandler(g_hba.Controller, g_hba.Port);
+    return 1;
+}
+
+/**
+ * Manager functions used by the driver sources
+ */
+static AhciDevice_t g_device;
+static int          g_identifyResponses;
+
+size_t     AhciManagerGetFrameSize(void) { return DMA_PAGE_SIZE; }
+OsStatus_t AhciManagerRegisterDevice(AhciController_t* controller, AhciPort_t* port, uint32_t signature) { return OsSuccess; }
+void       AhciManagerUnregisterDevice(AhciController_t* controller, AhciPort_t* port) { }
+
+void
+AhciManagerHandleControlResponse(AhciPort_t* port, AhciTransaction_t* transaction)
+{
+    g_identifyResponses++;
+}
+
+AhciDevice_t*
+AhciManagerGetDevice(UUId_t deviceId)
+{
+    return deviceId == g_device.Descriptor.Device ? &g_device : NULL;
+}
+
+struct request {
+    uint64_t   Sector;
+    size_t     Sectors;
+    int        Direction;
+    int        Buffer;
+    int        Done;
+    OsStatus_t Status;
+    size_t     Transferred;
+};
+
+static struct request g_ioRequests[REQUEST_COUNT];
+static UUId_t         g_buffers[BUFFER_COUNT];
+static int            g_freeBuffers[BUFFER_COUNT];
+static int            g_freeBufferCount;
+static int            g_completed;
+static int            g_dataErrors;
+static UUId_t         g_largeBuffer;
+
+static uint8_t*
+request_buffer(struct request* request)
+{
+    return request->Buffer == -1 ? g_dmaBuffers[g_largeBuffer].buffer : g_dmaBuffers[g_buffers[request->Buffer]].buffer;
+}
+
+void
+ctt_storage_transfer_response(struct gracht_message* message, OsStatus_t status, size_t sectorsTransferred)
+{
+    struct request* request = &g_ioRequests[message->Request];
+    uint32_t*       words   = (uint32_t*)request_buffer(request);
+    size_t          i;
+
+    request->Done        = 1;
+    request->Status      = status;
+    request->Transferred = sectorsTransferred;
+    if (request->Direction == __STORAGE_OPERATION_READ) {
+        for (i = 0; i < (request->Sectors * SECTOR_SIZE) / sizeof(uint32_t); i++) {
+            uint64_t sector = request->Sector + ((i * sizeof(uint32_t)) / SECTOR_SIZE);
+            if (words[i] != sector_word(sector, (int)(i % (SECTOR_SIZE / sizeof(uint32_t))))) {
+                g_dataErrors++;
+                break;
+            }
+        }
+    }
+    if (request->Buffer != -1) {
+        g_freeBuffers[g_freeBufferCount++] = request->Buffer;
+    }
+    g_completed++;
+}
+
+static int
+submit_request(int index, uint64_t sector, size_t sectors, int direction)
+{
+    struct request*       request = &g_ioRequests[index];
+    struct gracht_message message = { 0, index };
+    uint32_t*             words;
+    OsStatus_t            status;
+    size_t                i;
+
+    memset(request, 0, sizeof(struct request));
+    request->Sector    = sector;
+    request->Sectors   = sectors;
+    request->Direction = direction;
+    request->Buffer    = sectors * SECTOR_SIZE > DMA_PAGE_SIZE ? -1 : g_freeBuffers[--g_freeBufferCount];
+
+    words = (uint32_t*)request_buffer(request);
+    for (i = 0; i < (sectors * SECTOR_SIZE) / sizeof(uint32_t); i++) {
+        words[i] = direction == __STORAGE_OPERATION_WRITE ?
+            sector_word(sector + ((i * sizeof(uint32_t)) / SECTOR_SIZE), (int)(i % (SECTOR_SIZE / sizeof(uint32_t)))) : 0;
+    }
+
+    status = AhciTransactionStorageCreate(&g_device, &message, direction, sector,
+        request->Buffer == -1 ? g_largeBuffer : g_buffers[request->Buffer], 0, sectors);
+    CHECK(TEST_NAME, status == OsSuccess, "request %i failed to queue: %i", index, status);
+    return 0;
+}
+
+static uint64_t
+random_sector(uint32_t* seed)
+{
+    uint64_t value;
+    *seed ^= *seed << 13; *seed ^= *seed >> 17; *seed ^= *seed << 5;
+    value = *seed;
+    *seed ^= *seed << 13; *seed ^= *seed >> 17; *seed ^= *seed << 5;
+    value = (value << 32) | *seed;
+    return (value % (DISK_SECTORS - 8)) & ~7ULL;
+}
+
+static int
+check_requests(int count)
+{
+    int i;
+
+    CHECK(TEST_NAME, g_hba.Errors == 0, "hba reported %i errors", g_hba.Errors);
+    CHECK(TEST_NAME, g_dataErrors == 0, "%i requests read the wrong data", g_dataErrors);
+    for (i = 0; i < count; i++) {
+        CHECK(TEST_NAME, g_ioRequests[i].Done, "request %i never completed", i);
+        CHECK(TEST_NAME, g_ioRequests[i].Status == OsSuccess, "request %i completed with %i", i, g_ioRequests[i].Status);
+        CHECK(TEST_NAME, g_ioRequests[i].Transferred == g_ioRequests[i].Sectors, "request %i transferred %" PRIuIN " of %" PRIuIN " sectors",
+            i, g_ioRequests[i].Transferred, g_ioRequests[i].Sectors);
+    }
+    CHECK(TEST_NAME, g_hba.Accepted == 0 && atomic_load(&g_hba.Port->Slots) == 0, "slots are still in use after completion");
+    CHECK(TEST_NAME, list_count(&g_hba.Port->Transactions) == 0, "transactions are left on the port");
+    return 0;
+}
+
+// Keeps <depth> random 4KB requests outstanding and returns the IOPS of the simulated disk
+static int
+run_requests(int count, int depth, int direction, double* iopsOut)
+{
+    uint32_t seed = 0x2545F491;
+    uint64_t start = g_hba.Now;
+    int      submitted = 0;
+
+    g_completed  = 0;
+    g_hba.OutOfOrder = 0;
+    g_hba.MaxOutstanding = 0;
+    while (g_completed < count) {
+        while (submitted - g_completed < depth && submitted < count) {
+            if (submit_request(submitted, random_sector(&seed), 8, direction)) {
+                return -1;
+            }
+            submitted++;
+        }
+        CHECK(TEST_NAME, hba_step(), "no command in flight with %i requests outstanding", submitted - g_completed);
+    }
+
+    *iopsOut = (double)count / ((double)(g_hba.Now - start) / 1000000000.0);
+    return check_requests(count);
+}
+
+static int
+test_ordering(void)
+{
+    double iops;
+    int    i;
+
+    // More requests than slots, the rest must wait on the port until slots free up
+    g_completed = 0;
+    g_hba.OutOfOrder = 0;
+    g_hba.MaxOutstanding = 0;
+    for (i = 0; i < 48; i++) {
+        if (submit_request(i, (uint64_t)((i * 7919) % 48) * 65536, 8, (i & 1) ? __STORAGE_OPERATION_WRITE : __STORAGE_OPERATION_READ)) {
+            return -1;
+        }
+    }
+    CHECK(TEST_NAME, g_hba.MaxOutstanding == 32, "%i commands were issued for 48 requests", g_hba.MaxOutstanding);
+    while (hba_step());
+    CHECK(TEST_NAME, g_completed == 48, "%i of 48 requests completed", g_completed);
+    CHECK(TEST_NAME, g_hba.OutOfOrder > 0, "all commands completed in issue order");
+    if (check_requests(48)) {
+        return -1;
+    }
+    printf("48 mixed requests: %i completed out of order, %i outstanding at most\n", g_hba.OutOfOrder, g_hba.MaxOutstanding);
+
+    // A non-queued command must wait for the queued ones to drain, and hold back
+    // the queued commands behind it
+    g_completed = 0;
+    for (i = 0; i < 8; i++) {
+        CHECK(TEST_NAME, !submit_request(i, (uint64_t)i * 1000000, 8, __STORAGE_OPERATION_READ), "submit failed");
+    }
+    CHECK(TEST_NAME, AhciTransactionControlCreate(&g_device, AtaPIOIdentifyDevice, 512, __STORAGE_OPERATION_READ) == OsSuccess,
+        "failed to queue identify");
+    for (i = 8; i < 16; i++) {
+        CHECK(TEST_NAME, !submit_request(i, (uint64_t)i * 1000000, 8, __STORAGE_OPERATION_READ), "submit failed");
+    }
+    CHECK(TEST_NAME, g_hba.MaxOutstanding == 32 && g_hba.Accepted == 0xFF, "requests behind the identify were issued early (0x%x)",
+        g_hba.Accepted);
+    while (hba_step());
+    CHECK(TEST_NAME, g_identifyResponses == 1 && g_completed == 16, "identify %i, %i of 16 requests completed",
+        g_identifyResponses, g_completed);
+    if (check_requests(16)) {
+        return -1;
+    }
+
+    // A 2MB transfer of single pages needs more PRDT entries than a command table holds,
+    // and is dispatched in several rounds of the same slot
+    g_completed = 0;
+    i = g_hba.QueuedCommands;
+    CHECK(TEST_NAME, !submit_request(0, 123456 * 8, 4096, __STORAGE_OPERATION_READ), "submit failed");
+    CHECK(TEST_NAME, !submit_request(1, 777, 8, __STORAGE_OPERATION_READ), "submit failed");
+    while (hba_step());
+    if (check_requests(2)) {
+        return -1;
+    }
+    CHECK(TEST_NAME, g_hba.QueuedCommands - i == 4, "2MB and 4KB reads took %i commands", g_hba.QueuedCommands - i);
+    return run_requests(256, 32, __STORAGE_OPERATION_READ, &iops);
+}
+
+static int
+test_slot_race(void)
+{
+    AhciPort_t* port = g_hba.Port;
+    int         slot;
+
+    // A non-queued command takes a slot while a queued command is being allocated
+    // next to a queued command in flight, the retry must see it and back off
+    CHECK(TEST_NAME, AhciPortAllocateCommandSlot(port, 1, &slot) == OsSuccess && slot == 0, "queued slot allocation failed");
+    g_racedSlots = 1U << 1;
+    g_raceArmed  = 1;
+    CHECK(TEST_NAME, AhciPortAllocateCommandSlot(port, 1, &slot) == OsBusy,
+        "queued command got slot %i next to a non-queued command", slot);
+    CHECK(TEST_NAME, !g_raceArmed, "slot allocation never raced");
+    AhciPortFreeCommandSlot(port, 1);
+
+    // And the other way around, a queued command sneaks in before a non-queued one
+    AhciPortFreeCommandSlot(port, 0);
+    g_racedSlots = 1U << 0;
+    g_raceArmed  = 1;
+    atomic_fetch_or(&port->QueuedSlots, g_racedSlots);
+    CHECK(TEST_NAME, AhciPortAllocateCommandSlot(port, 0, &slot) == OsBusy,
+        "non-queued command got slot %i next to a queued command", slot);
+    AhciPortFreeCommandSlot(port, 0);
+    CHECK(TEST_NAME, atomic_load(&port->Slots) == 0 && atomic_load(&port->QueuedSlots) == 0, "slots are left in use");
+    return 0;
+}
+
+static int
+setup_port(void)
+{
+    static AhciController_t controller;
+    AhciPort_t*             port;
+    int                     i;
+
+    controller.Registers = aligned_alloc(DMA_PAGE_SIZE, 0x2000);
+    memset(controller.Registers, 0, 0x2000);
+    controller.Registers->Capabilities = AHCI_CAPABILITIES_SNCQ | AHCI_CAPABILITIES_S64A | (31 << 8);
+
+    port = AhciPortCreate(&controller, 0, 0);
+    CHECK(TEST_NAME, port != NULL, "failed to create port");
+    CHECK(TEST_NAME, AhciPortRebase(&controller, port) == OsSuccess, "failed to rebase port");
+    CHECK(TEST_NAME, port->SlotCount == 32, "port has %i slots", port->SlotCount);
+    controller.Ports[0] = port;
+    g_hba.Controller    = &controller;
+    g_hba.Port          = port;
+
+    g_device.Controller     = &controller;
+    g_device.Port           = port;
+    g_device.Type           = DeviceATA;
+    g_device.HasDMAEngine   = 1;
+    g_device.HasNCQ         = 1;
+    g_device.QueueDepth     = 32;
+    g_device.AddressingMode = AHCI_DEVICE_MODE_LBA48;
+    g_device.SectorSize     = SECTOR_SIZE;
+    g_device.SectorCount    = DISK_SECTORS;
+
+    for (i = 0; i < BUFFER_COUNT; i++) {
+        struct dma_buffer_info info = { "request", DMA_PAGE_SIZE, DMA_PAGE_SIZE, 0 };
+        struct dma_attachment  attachment;
+        CHECK(TEST_NAME, dma_create(&info, &attachment) == OsSuccess, "failed to create buffer");
+        g_buffers[i] = attachment.handle;
+        g_freeBuffers[g_freeBufferCount++] = i;
+    }
+    {
+        struct dma_buffer_info info = { "large", 4096 * SECTOR_SIZE, 4096 * SECTOR_SIZE, 0 };
+        struct dma_attachment  attachment;
+        CHECK(TEST_NAME, dma_create(&info, &attachment) == OsSuccess, "failed to create buffer");
+        g_largeBuffer = attachment.handle;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const int depths[] = { 1, 8, 32 };
+    double           iops;
+    int              i;
+
+    if (setup_port() || test_slot_race() || test_ordering()) {
+        return -1;
+    }
+
+    printf("%i random 4KB reads per run on a simulated 7200rpm disk\n", REQUEST_COUNT);
+    g_device.HasNCQ = 0;
+    if (run_requests(REQUEST_COUNT, 32, __STORAGE_OPERATION_READ, &iops)) {
+        return -1;
+    }
+    printf("DMA READ EXT     queue depth 32: %7.1f IOPS, %i commands out of order, %i outstanding\n",
+        iops, g_hba.OutOfOrder, g_hba.MaxOutstanding);
+
+    g_device.HasNCQ = 1;
+    for (i = 0; i < (int)SIZEOF_ARRAY(depths); i++) {
+        if (run_requests(REQUEST_COUNT, depths[i], __STORAGE_OPERATION_READ, &iops)) {
+            return -1;
+        }
+        printf("READ FPDMA QUEUED queue depth %2i: %7.1f IOPS, %i commands out of order, %i outstanding\n",
+            depths[i], iops, g_hba.OutOfOrder, g_hba.MaxOutstanding);
+    }
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}
@@ -20,6 +20,7 @@ typedef unsigned int UUId_t;
 #include <inttypes.h>
 #include <stddef.h>
 #include <stdarg.h>
+#include <time.h>
 
 #define PRIxIN "lx"
 #define PRIuIN "lu"
@@ -31,3 +32,21 @@ typedef unsigned int UUId_t;
 
 #define MIN(a,b)                                (((a)<(b))?(a):(b))
 #define MAX(a,b)                                (((a)>(b))?(a):(b))
+
+// Fails the calling test function when the condition does not hold, the message is
+// reported under the name of the test
+#define CHECK(name, condition, ...) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s: ", name); fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); \
+        return -1; \
+    } } while (0)
+
+#define TEST_PASSED(name) printf("%s: all tests passed\n", name)
+
+static inline uint64_t
+NowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
@@ -0,0 +1,386 @@
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#define _CRT_UNUSED(x) (void)(x)
+#define StrUTF8                    0
+#define MSTRING_NOT_FOUND          -1
+#define MSTRING_NO_MATCH           0
+#define MSTRING_FULL_MATCH         1
+
+// Skip the service header, the test provides the parts of it the caches use
+#define _VFS_INTERFACE_H_
+#define __FILE_CREATE               0x00000001
+#define __FILE_CREATE_RECURSIVE     0x00000002
+#define __FILE_TRUNCATE             0x00000004
+#define __FILE_FAILONEXIST          0x00000008
+#define FILE_FLAG_DIRECTORY         0x00000001
+
+#define VFS_DENTRY_CAPACITY 512
+#define VFS_DENTRY_UNKNOWN  0
+#define VFS_DENTRY_POSITIVE 1
+#define VFS_DENTRY_NEGATIVE 2
+
+typedef struct MString {
+    char*  Data;
+    size_t Length;
+} MString_t;
+
+static MString_t*
+MStringCreate(const char* data, int type)
+{
+    MString_t* string = malloc(sizeof(MString_t));
+    assert(string != NULL);
+    string->Length = strlen(data);
+    string->Data   = malloc(string->Length + 1);
+    assert(string->Data != NULL);
+    memcpy(string->Data, data, string->Length + 1);
+    return string;
+}
+
+static void MStringDestroy(MString_t* string) { if (string) { free(string->Data); free(string); } }
+static const char* MStringRaw(MString_t* string) { return string ? string->Data : NULL; }
+static size_t MStringLength(MString_t* string) { return string->Length; }
+
+static MString_t*
+MStringSubString(MString_t* string, int index, int length)
+{
+    MString_t* sub = MStringCreate("", StrUTF8);
+    if (length < 0) {
+        length = (int)string->Length - index;
+    }
+    free(sub->Data);
+    sub->Data = malloc(length + 1);
+    assert(sub->Data != NULL);
+    memcpy(sub->Data, string->Data + index, length);
+    sub->Data[length] = '\0';
+    sub->Length       = length;
+    return sub;
+}
+
+static int
+MStringCompare(MString_t* first, MString_t* second, int ignoreCase)
+{
+    if (first->Length != second->Length) {
+        return MSTRING_NO_MATCH;
+    }
+    return (ignoreCase ? strcasecmp(first->Data, second->Data) : strcmp(first->Data, second->Data)) ?
+        MSTRING_NO_MATCH : MSTRING_FULL_MATCH;
+}
+
+typedef struct {
+    unsigned int Flags;
+} OsFileDescriptor_t;
+
+typedef struct FileSystemEntry {
+    OsFileDescriptor_t Descriptor;
+    MString_t*         Path;
+    MString_t*         Name;
+    int                References;
+    uintptr_t*         System;
+} FileSystemEntry_t;
+
+typedef struct { int Unused; } FileSystemDescriptor_t;
+
+typedef struct FileSystemModule {
+    OsStatus_t (*OpenEntry)(FileSystemDescriptor_t*, MString_t*, FileSystemEntry_t**);
+    OsStatus_t (*CreatePath)(FileSystemDescriptor_t*, MString_t*, unsigned int, FileSystemEntry_t**);
+    OsStatus_t (*CloseEntry)(FileSystemDescriptor_t*, FileSystemEntry_t*);
+    OsStatus_t (*ChangeFileSize)(FileSystemDescriptor_t*, FileSystemEntry_t*, uint64_t);
+} FileSystemModule_t;
+
+typedef enum FileSystemState {
+    FSCreated,
+    FSLoaded,
+    FSUnloaded,
+    FSError
+} FileSystemState_t;
+
+typedef struct FileSystem {
+    FileSystemState_t      state;
+    MString_t*             identifier;
+    FileSystemDescriptor_t descriptor;
+    FileSystemModule_t*    module;
+} FileSystem_t;
+
+typedef struct {
+    uint64_t DentryHits;
+    uint64_t DentryNegativeHits;
+    uint64_t DentryMisses;
+    uint64_t DentryFlushes;
+    size_t   DentryCount;
+} OsFileCacheStatistics_t;
+
+static void VfsPageCacheInvalidate(FileSystemEntry_t* entry) { _CRT_UNUSED(entry); }
+
+// The process manager is told about every path that is created
+static int g_notifications;
+static void VfsNotifyPathChanged(MString_t* path) { g_notifications++; }
+
+void* dsalloc(size_t size) { return malloc(size); }
+void  dsfree(void* pointer) { free(pointer); }
+
+#include "../librt/libds/hashtable.c"
+#include "../librt/libds/hash_sip.c"
+#include "../services/filemanager/dentry.c"
+#include "../services/filemanager/cache.c"
+
+#define STATS 100000
+
+#define TEST_NAME "dentry_cache_test"
+
+// The filesystem is a flat list of the paths that exist, every lookup walks the
+// path from the root like the real filesystems do and counts a read per component
+#define MAX_PATHS 64
+
+static char* g_paths[MAX_PATHS];
+static int   g_pathCount;
+static int   g_lookups;
+static int   g_componentReads;
+
+static int
+PathExists(const char* path)
+{
+    for (int i = 0; i < g_pathCount; i++) {
+        if (!strcasecmp(g_paths[i], path)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+AddPath(const char* path)
+{
+    if (!PathExists(path)) {
+        assert(g_pathCount < MAX_PATHS);
+        g_paths[g_pathCount++] = strdup(path);
+    }
+}
+
+static void
+RemovePath(const char* path)
+{
+    for (int i = 0; i < g_pathCount; i++) {
+        if (!strcasecmp(g_paths[i], path)) {
+            free(g_paths[i]);
+            g_paths[i] = g_paths[--g_pathCount];
+            return;
+        }
+    }
+}
+
+static FileSystemEntry_t*
+CreateEntry(void)
+{
+    FileSystemEntry_t* entry = calloc(1, sizeof(FileSystemEntry_t));
+    assert(entry != NULL);
+    return entry;
+}
+
+static OsStatus_t
+FsOpenEntry(FileSystemDescriptor_t* descriptor, MString_t* path, FileSystemEntry_t** entryOut)
+{
+    char prefix[256];
+
+    _CRT_UNUSED(descriptor);
+    g_lookups++;
+    for (size_t i = 0; i <= MStringLength(path); i++) {
+        if (MStringRaw(path)[i] != '/' && MStringRaw(path)[i] != '\0') {
+            continue;
+        }
+
+        g_componentReads++;
+        memcpy(prefix, MStringRaw(path), i);
+        prefix[i] = '\0';
+        if (!PathExists(prefix)) {
+            return OsDoesNotExist;
+        }
+    }
+
+    *entryOut = CreateEntry();
+    return OsSuccess;
+}
+
+static OsStatus_t
+FsCreatePath(FileSystemDescriptor_t* descriptor, MString_t* path, unsigned int options, FileSystemEntry_t** entryOut)
+{
+    char prefix[256];
+
+    _CRT_UNUSED(descriptor);
+    for (size_t i = 0; i < MStringLength(path); i++) {
+        if (MStringRaw(path)[i] != '/') {
+            continue;
+        }
+
+        memcpy(prefix, MStringRaw(path), i);
+        prefix[i] = '\0';
+        if (!PathExists(prefix)) {
+            if (!(options & __FILE_CREATE_RECURSIVE)) {
+                return OsDoesNotExist;
+            }
+            AddPath(prefix);
+        }
+    }
+
+    AddPath(MStringRaw(path));
+    *entryOut = CreateEntry();
+    return OsSuccess;
+}
+
+static OsStatus_t
+FsCloseEntry(FileSystemDescriptor_t* descriptor, FileSystemEntry_t* entry)
+{
+    _CRT_UNUSED(descriptor);
+    MStringDestroy(entry->Path);
+    free(entry);
+    return OsSuccess;
+}
+
+static FileSystemModule_t g_module = { FsOpenEntry, FsCreatePath, FsCloseEntry, NULL };
+static FileSystem_t       g_fileSystem;
+
+static OsStatus_t
+Stat(const char* path, unsigned int options)
+{
+    MString_t*         string = MStringCreate(path, StrUTF8);
+    FileSystemEntry_t* entry;
+    OsStatus_t         status = VfsCacheGetFile(string, options, &entry);
+    MStringDestroy(string);
+    return status;
+}
+
+// The filemanager removes the file from both caches once the filesystem has deleted it
+static void
+Delete(const char* path)
+{
+    MString_t* string = MStringCreate(path, StrUTF8);
+    RemovePath(strchr(path, ':') + 2);
+    VfsCacheRemoveFile(string);
+    VfsDentryUpdate(string, 0);
+    MStringDestroy(string);
+}
+
+static int
+test_negative_entries(void)
+{
+    OsFileCacheStatistics_t statistics;
+    int                     lookups;
+
+    // Repeated misses are answered from the negative entry
+    g_lookups = 0;
+    for (int i = 0; i < 10; i++) {
+        CHECK(TEST_NAME, Stat("st0:/shared/lib/libfoo.dll", 0) == OsDoesNotExist, "missing path was found");
+    }
+    CHECK(TEST_NAME, g_lookups == 1, "missing path was looked up %i times", g_lookups);
+
+    // A missing directory covers everything below it
+    CHECK(TEST_NAME, Stat("st0:/opt", 0) == OsDoesNotExist, "missing directory was found");
+    lookups = g_lookups;
+    CHECK(TEST_NAME, Stat("st0:/opt/bin/app", 0) == OsDoesNotExist &&
+          Stat("st0:/OPT/lib", 0) == OsDoesNotExist, "path below a missing directory was found");
+    CHECK(TEST_NAME, g_lookups == lookups, "paths below a missing directory were looked up");
+
+    // Creating a path replaces the negative entries of it and its parents
+    g_notifications = 0;
+    CHECK(TEST_NAME, Stat("st0:/opt/bin/app", __FILE_CREATE | __FILE_CREATE_RECURSIVE) == OsSuccess, "create failed");
+    CHECK(TEST_NAME, Stat("st0:/opt/bin", 0) == OsSuccess && Stat("st0:/Opt/Bin/App", 0) == OsSuccess,
+          "created path was not found");
+    CHECK(TEST_NAME, g_notifications == 1, "%i notifications were sent for one created path", g_notifications);
+    CHECK(TEST_NAME, Stat("st0:/opt/lib", 0) == OsDoesNotExist, "sibling of created path was found");
+
+    // Deleting a directory hides everything that was cached below it
+    Delete("st0:/opt/bin/app");
+    Delete("st0:/opt/bin");
+    CHECK(TEST_NAME, Stat("st0:/opt/bin/app", 0) == OsDoesNotExist, "deleted file was found");
+    CHECK(TEST_NAME, Stat("st0:/opt/bin", __FILE_CREATE) == OsSuccess, "recreate failed");
+    CHECK(TEST_NAME, Stat("st0:/opt/bin/app", 0) == OsDoesNotExist, "file of the deleted directory came back");
+
+    // Paths on filesystems that are not mounted do not exist
+    CHECK(TEST_NAME, Stat("rm0:/bin/app", 0) == OsDoesNotExist, "path on unknown filesystem was found");
+    CHECK(TEST_NAME, Stat("st0:/bin/App.app", 0) == OsSuccess, "existing path was not found");
+
+    VfsDentryGetStatistics(&statistics);
+    CHECK(TEST_NAME, statistics.DentryNegativeHits >= 12, "negative hits were not counted");
+    printf("dentry: hits %" PRIu64 ", negative hits %" PRIu64 ", misses %" PRIu64 ", entries %zu\n",
+           statistics.DentryHits, statistics.DentryNegativeHits, statistics.DentryMisses, statistics.DentryCount);
+    return 0;
+}
+
+static int
+test_capacity(void)
+{
+    OsFileCacheStatistics_t before, after;
+    char                    path[64];
+
+    // The cache is dropped once it is full, every answer must stay correct
+    VfsDentryGetStatistics(&before);
+    for (int i = 0; i < 4 * VFS_DENTRY_CAPACITY; i++) {
+        sprintf(&path[0], "st0:/missing/%i", i);
+        CHECK(TEST_NAME, Stat(&path[0], 0) == OsDoesNotExist, "missing path %i was found", i);
+    }
+    CHECK(TEST_NAME, Stat("st0:/bin/App.app", 0) == OsSuccess, "existing path was lost");
+
+    VfsDentryGetStatistics(&after);
+    CHECK(TEST_NAME, after.DentryFlushes > before.DentryFlushes, "cache was never flushed");
+    CHECK(TEST_NAME, after.DentryCount <= VFS_DENTRY_CAPACITY, "cache grew beyond its capacity");
+
+    // Once unmounted, the paths of a filesystem can't be resolved
+    VfsDentryUnmount(&g_fileSystem);
+    CHECK(TEST_NAME, Stat("st0:/shared/lib/other.dll", 0) == OsDoesNotExist, "path of unmounted filesystem was found");
+    VfsDentryMount(&g_fileSystem);
+    CHECK(TEST_NAME, Stat("st0:/shared/lib/other.dll", 0) == OsDoesNotExist, "missing path was found after remount");
+    return 0;
+}
+
+static int
+bench_stat(const char* path, OsStatus_t expected)
+{
+    OsFileCacheStatistics_t before, after;
+    uint64_t                start;
+
+    VfsDentryGetStatistics(&before);
+    g_lookups        = 0;
+    g_componentReads = 0;
+    start            = NowNs();
+    for (int i = 0; i < STATS; i++) {
+        CHECK(TEST_NAME, Stat(path, 0) == expected, "stat of %s returned the wrong status", path);
+    }
+    VfsDentryGetStatistics(&after);
+
+    printf("stat %-42s %6.1f ns, %i fs lookups and %i component reads for %i stats, negative hits %" PRIu64 "\n",
+           path, (double)(NowNs() - start) / STATS, g_lookups, g_componentReads, STATS,
+           after.DentryNegativeHits - before.DentryNegativeHits);
+    CHECK(TEST_NAME, g_lookups <= 1, "repeated stats reached the filesystem");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    AddPath("");
+    AddPath("bin");
+    AddPath("bin/App.app");
+    AddPath("shared");
+    AddPath("shared/lib");
+
+    g_fileSystem.state      = FSLoaded;
+    g_fileSystem.identifier = MStringCreate("st0", StrUTF8);
+    g_fileSystem.module     = &g_module;
+
+    VfsCacheInitialize();
+    VfsDentryInitialize();
+    VfsDentryMount(&g_fileSystem);
+
+    if (test_negative_entries() || test_capacity() ||
+        bench_stat("st0:/bin/App.app", OsSuccess) ||
+        bench_stat("st0:/shared/lib/libmissing.dll", OsDoesNotExist) ||
+        bench_stat("st0:/shared/lib/gone/deep/libmissing.dll", OsDoesNotExist)) {
+        return -1;
+    }
+
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}
@@ -0,0 +1,262 @@
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+#include <inttypes.h>
+
+#define UUID_INVALID   (UUId_t)0xFFFFFFFF
+
+// Skip the service header, the test provides the parts of it the handle index uses
+#define _VFS_INTERFACE_H_
+#define VFS_CLIENT_BUFFER_SLOTS 4
+#define DMA_ACCESS_WRITE        0x1
+
+typedef struct FileSystemEntryHandle {
+    element_t header;
+    UUId_t    Id;
+    UUId_t    Owner;
+    uint64_t  Position;
+} FileSystemEntryHandle_t;
+
+typedef struct {
+    uint64_t BufferHits;
+    uint64_t BufferMisses;
+} OsFileCacheStatistics_t;
+
+struct dma_attachment {
+    UUId_t handle;
+    void*  buffer;
+    size_t length;
+};
+
+// The dma buffers of the clients, every call into the dma interface is a system call
+#define BUFFER_COUNT 8
+#define BUFFER_SIZE  0x10000
+
+static uint8_t* g_buffers[BUFFER_COUNT];
+static size_t   g_bufferLengths[BUFFER_COUNT];
+static int      g_syscalls;
+static int      g_attached;
+static int      g_mapped;
+
+static OsStatus_t
+dma_attach(UUId_t handle, struct dma_attachment* attachment)
+{
+    g_syscalls++;
+    if (handle >= BUFFER_COUNT) {
+        return OsDoesNotExist;
+    }
+    attachment->handle = handle;
+    attachment->buffer = NULL;
+    attachment->length = g_bufferLengths[handle];
+    g_attached++;
+    return OsSuccess;
+}
+
+static OsStatus_t
+dma_attachment_map(struct dma_attachment* attachment, unsigned int accessFlags)
+{
+    g_syscalls++;
+    attachment->buffer = g_buffers[attachment->handle];
+    g_mapped++;
+    return OsSuccess;
+}
+
+static OsStatus_t
+dma_attachment_refresh_map(struct dma_attachment* attachment)
+{
+    g_syscalls++;
+    attachment->length = g_bufferLengths[attachment->handle];
+    return OsSuccess;
+}
+
+static OsStatus_t
+dma_attachment_unmap(struct dma_attachment* attachment)
+{
+    g_syscalls++;
+    attachment->buffer = NULL;
+    g_mapped--;
+    return OsSuccess;
+}
+
+static OsStatus_t
+dma_detach(struct dma_attachment* attachment)
+{
+    g_syscalls++;
+    g_attached--;
+    return OsSuccess;
+}
+
+void* dsalloc(size_t size) { return malloc(size); }
+void  dsfree(void* pointer) { free(pointer); }
+
+#include "../librt/libds/hashtable.c"
+#include "../services/filemanager/handles.c"
+
+#define READS        1000000
+#define READ_SIZE    512
+#define OPEN_HANDLES 256
+#define CLIENTS      16
+
+#define TEST_NAME "file_handle_bench"
+
+static FileSystemEntryHandle_t g_openHandles[OPEN_HANDLES];
+static list_t                  g_handleList = LIST_INIT;
+static uint8_t                 g_file[BUFFER_SIZE];
+
+static void
+open_handles(void)
+{
+    list_construct(&g_handleList);
+    for (int i = 0; i < OPEN_HANDLES; i++) {
+        g_openHandles[i].Id       = 10000 + i;
+        g_openHandles[i].Owner    = 1 + (i % CLIENTS);
+        g_openHandles[i].Position = 0;
+        ELEMENT_INIT(&g_openHandles[i].header, (uintptr_t)g_openHandles[i].Id, &g_openHandles[i]);
+        list_append(&g_handleList, &g_openHandles[i].header);
+        assert(VfsHandleRegister(&g_openHandles[i]) == OsSuccess);
+    }
+}
+
+static int
+test_buffers(void)
+{
+    OsFileCacheStatistics_t statistics;
+    void*                   buffer;
+    int                     syscalls;
+
+    // Reusing a buffer costs nothing after the first transfer
+    CHECK(TEST_NAME, VfsClientMapBuffer(1, 0, READ_SIZE, &buffer) == OsSuccess && buffer == g_buffers[0], "map failed");
+    syscalls = g_syscalls;
+    CHECK(TEST_NAME, VfsClientMapBuffer(1, 0, READ_SIZE, &buffer) == OsSuccess && buffer == g_buffers[0], "remap failed");
+    CHECK(TEST_NAME, g_syscalls == syscalls, "cached buffer was mapped again");
+
+    // Buffers of other clients are mapped on their own
+    CHECK(TEST_NAME, VfsClientMapBuffer(2, 0, READ_SIZE, &buffer) == OsSuccess && g_attached == 2, "shared buffer failed");
+    CHECK(TEST_NAME, VfsClientMapBuffer(99, 0, READ_SIZE, &buffer) == OsInvalidParameters, "client without files mapped");
+    CHECK(TEST_NAME, VfsClientMapBuffer(1, BUFFER_COUNT, READ_SIZE, &buffer) == OsInvalidParameters, "invalid buffer mapped");
+
+    // Once the slots are used the least recently used buffer is released
+    for (UUId_t i = 1; i < VFS_CLIENT_BUFFER_SLOTS; i++) {
+        CHECK(TEST_NAME, VfsClientMapBuffer(1, i, READ_SIZE, &buffer) == OsSuccess, "map of buffer %u failed", i);
+    }
+    CHECK(TEST_NAME, VfsClientMapBuffer(1, 0, READ_SIZE, &buffer) == OsSuccess, "map failed");
+    CHECK(TEST_NAME, VfsClientMapBuffer(1, VFS_CLIENT_BUFFER_SLOTS, READ_SIZE, &buffer) == OsSuccess, "map failed");
+    CHECK(TEST_NAME, g_attached == VFS_CLIENT_BUFFER_SLOTS + 1, "%i buffers attached", g_attached);
+    syscalls = g_syscalls;
+    CHECK(TEST_NAME, VfsClientMapBuffer(1, 0, READ_SIZE, &buffer) == OsSuccess && g_syscalls == syscalls,
+          "recently used buffer was evicted");
+    CHECK(TEST_NAME, VfsClientMapBuffer(1, 1, READ_SIZE, &buffer) == OsSuccess && g_syscalls > syscalls,
+          "least recently used buffer was not evicted");
+
+    // A buffer that has grown since it was mapped is mapped again
+    g_bufferLengths[0] = 2 * BUFFER_SIZE;
+    syscalls           = g_syscalls;
+    CHECK(TEST_NAME, VfsClientMapBuffer(1, 0, BUFFER_SIZE + READ_SIZE, &buffer) == OsSuccess && g_syscalls == syscalls + 1,
+          "grown buffer was not refreshed");
+    g_bufferLengths[0] = BUFFER_SIZE;
+
+    // Closing the last file of a client releases its buffers
+    for (int i = 0; i < OPEN_HANDLES; i++) {
+        VfsHandleUnregister(&g_openHandles[i]);
+        CHECK(TEST_NAME, VfsHandleLookup(g_openHandles[i].Id) == NULL, "closed handle was found");
+    }
+    CHECK(TEST_NAME, g_attached == 0 && g_mapped == 0, "%i buffers still attached after close", g_attached);
+    CHECK(TEST_NAME, g_clients.element_count == 0, "clients were not released");
+
+    VfsClientGetStatistics(&statistics);
+    printf("buffers: hits %" PRIu64 ", misses %" PRIu64 "\n", statistics.BufferHits, statistics.BufferMisses);
+    return 0;
+}
+
+// A read as the filemanager did it before, the handle is found by walking the list of
+// all open handles and the buffer is attached and mapped for every transfer
+static OsStatus_t
+read_list(UUId_t processId, UUId_t handle, UUId_t bufferHandle)
+{
+    FileSystemEntryHandle_t* entry = list_find_value(&g_handleList, (void*)(uintptr_t)handle);
+    struct dma_attachment    attachment;
+
+    if (!entry || entry->Owner != processId) {
+        return OsInvalidParameters;
+    }
+
+    if (dma_attach(bufferHandle, &attachment) != OsSuccess ||
+        dma_attachment_map(&attachment, DMA_ACCESS_WRITE) != OsSuccess) {
+        return OsInvalidParameters;
+    }
+
+    memcpy(attachment.buffer, &g_file[entry->Position % BUFFER_SIZE], READ_SIZE);
+    entry->Position += READ_SIZE;
+
+    dma_attachment_unmap(&attachment);
+    dma_detach(&attachment);
+    return OsSuccess;
+}
+
+static OsStatus_t
+read_indexed(UUId_t processId, UUId_t handle, UUId_t bufferHandle)
+{
+    FileSystemEntryHandle_t* entry = VfsHandleLookup(handle);
+    void*                    buffer;
+
+    if (!entry || entry->Owner != processId) {
+        return OsInvalidParameters;
+    }
+
+    if (VfsClientMapBuffer(processId, bufferHandle, READ_SIZE, &buffer) != OsSuccess) {
+        return OsInvalidParameters;
+    }
+
+    memcpy(buffer, &g_file[entry->Position % BUFFER_SIZE], READ_SIZE);
+    entry->Position += READ_SIZE;
+    return OsSuccess;
+}
+
+static int
+bench_reads(const char* name, OsStatus_t (*read)(UUId_t, UUId_t, UUId_t))
+{
+    uint64_t start;
+    int      syscalls = g_syscalls;
+
+    // The handles of the clients are spread over the list, the last opened are read
+    start = NowNs();
+    for (int i = 0; i < READS; i++) {
+        FileSystemEntryHandle_t* handle = &g_openHandles[OPEN_HANDLES - 1 - (i % CLIENTS)];
+        CHECK(TEST_NAME, read(handle->Owner, handle->Id, handle->Owner % BUFFER_COUNT) == OsSuccess, "read failed");
+    }
+
+    printf("%-8s %i x %i byte reads: %6.1f ns per read, %.3f dma calls per read\n", name, READS, READ_SIZE,
+           (double)(NowNs() - start) / READS, (double)(g_syscalls - syscalls) / READS);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 0; i < BUFFER_COUNT; i++) {
+        g_buffers[i]       = malloc(2 * BUFFER_SIZE);
+        g_bufferLengths[i] = BUFFER_SIZE;
+    }
+
+    VfsHandlesInitialize();
+    open_handles();
+    if (test_buffers()) {
+        return -1;
+    }
+
+    open_handles();
+    if (bench_reads("list", read_list) || bench_reads("indexed", read_indexed)) {
+        return -1;
+    }
+
+    for (int i = 0; i < OPEN_HANDLES; i++) {
+        VfsHandleUnregister(&g_openHandles[i]);
+    }
+    CHECK(TEST_NAME, g_attached == 0, "%i buffers still attached", g_attached);
+
+    for (int i = 0; i < BUFFER_COUNT; i++) {
+        free(g_buffers[i]);
+    }
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}
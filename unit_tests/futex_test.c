@@ -0,0 +1,382 @@
+
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define _Out_Opt_
+
+typedef int IntStatus_t;
+
+static IntStatus_t InterruptDisable(void) { return 0; }
+static void        InterruptRestoreState(IntStatus_t State) { (void)State; }
+static UUId_t      ArchGetProcessorCoreId(void) { return 0; }
+
+// Every host thread acts as a kernel thread, blocking parks it on an event
+typedef struct SchedulerObject {
+    element_t       Header;
+    list_t*         WaitQueueHandle;
+    pthread_mutex_t Lock;
+    pthread_cond_t  Condition;
+    int             Signalled;
+    OsStatus_t      TimeoutReason;
+} SchedulerObject_t;
+
+typedef struct Thread {
+    SchedulerObject_t Object;
+    UUId_t            Handle;
+} Thread_t;
+
+static __thread Thread_t* g_currentThread;
+static _Atomic(int)       g_blocked;
+
+static void*              GetProcessorCore(UUId_t CoreId) { (void)CoreId; return NULL; }
+static Thread_t*          CpuCoreCurrentThread(void* Core) { (void)Core; return g_currentThread; }
+static SchedulerObject_t* ThreadSchedulerHandle(Thread_t* Thread) { return &Thread->Object; }
+static UUId_t             ThreadCurrentHandle(void) { return g_currentThread->Handle; }
+
+static void
+SchedulerBlock(list_t* BlockQueue, size_t Timeout)
+{
+    (void)Timeout;
+    ELEMENT_INIT(&g_currentThread->Object.Header, 0, &g_currentThread->Object);
+    g_currentThread->Object.WaitQueueHandle = BlockQueue;
+    g_currentThread->Object.TimeoutReason   = OsSuccess;
+    list_append(BlockQueue, &g_currentThread->Object.Header);
+    atomic_fetch_add(&g_blocked, 1);
+}
+
+static OsStatus_t
+SchedulerQueueObject(SchedulerObject_t* Object)
+{
+    pthread_mutex_lock(&Object->Lock);
+    Object->Signalled = 1;
+    pthread_cond_signal(&Object->Condition);
+    pthread_mutex_unlock(&Object->Lock);
+    return OsSuccess;
+}
+
+static void
+ThreadingYield(void)
+{
+    SchedulerObject_t* object = &g_currentThread->Object;
+
+    pthread_mutex_lock(&object->Lock);
+    while (!object->Signalled) {
+        pthread_cond_wait(&object->Condition, &object->Lock);
+    }
+    object->Signalled = 0;
+    pthread_mutex_unlock(&object->Lock);
+    atomic_fetch_sub(&g_blocked, 1);
+}
+
+static int SchedulerGetTimeoutReason(void) { return g_currentThread->Object.TimeoutReason; }
+
+// Cancels the block like a signal or termination does, without the futex knowing
+static void
+SchedulerExpediteObject(SchedulerObject_t* Object)
+{
+    (void)list_remove(Object->WaitQueueHandle, &Object->Header);
+    Object->TimeoutReason = OsInterrupted;
+    SchedulerQueueObject(Object);
+}
+
+typedef struct MemorySpaceContext { int Unused; } MemorySpaceContext_t;
+typedef struct MemorySpace { MemorySpaceContext_t* Context; } MemorySpace_t;
+
+static MemorySpaceContext_t g_context;
+static MemorySpace_t        g_memorySpace = { &g_context };
+
+static MemorySpace_t* GetCurrentMemorySpace(void) { return &g_memorySpace; }
+static size_t         GetMemorySpacePageSize(void) { return 0x1000; }
+
+#define MAPPING_COMMIT         0x00000080U
+#define MAPPING_VIRTUAL_GLOBAL 0x00000002U
+#define DIVUP(a, b)            ((a / b) + (((a % b) > 0) ? 1 : 0))
+typedef uintptr_t vaddr_t;
+
+static size_t g_mappedBytes;
+
+static OsStatus_t
+MemorySpaceMap(MemorySpace_t* MemorySpace, vaddr_t* Address, uintptr_t* PhysicalAddressValues,
+    size_t Length, unsigned int MemoryFlags, unsigned int PlacementFlags)
+{
+    void* memory = aligned_alloc(0x1000, DIVUP(Length, 0x1000) * 0x1000);
+    if (!memory) {
+        return OsOutOfMemory;
+    }
+    g_mappedBytes += Length;
+    *Address       = (vaddr_t)memory;
+    return OsSuccess;
+}
+
+// Shared futexes are keyed by their physical address, identity map them
+static OsStatus_t
+GetMemorySpaceMapping(MemorySpace_t* MemorySpace, uintptr_t Address, int PageCount, uintptr_t* Physical)
+{
+    *Physical = Address;
+    return OsSuccess;
+}
+
+typedef struct PhysicalMemory {
+    size_t PageCount;
+} PhysicalMemory_t;
+
+typedef struct SystemMachine {
+    _Atomic(int)     NumberOfCores;
+    PhysicalMemory_t PhysicalMemory;
+} SystemMachine_t;
+
+static SystemMachine_t  g_machine;
+static SystemMachine_t* GetMachine(void) { return &g_machine; }
+
+static void PhysicalMemoryGetStatistics(PhysicalMemory_t* PhysicalMemory, size_t* PageCountOut,
+    size_t* FreePagesOut, size_t* FreeBlocks)
+{
+    *PageCountOut = PhysicalMemory->PageCount;
+    *FreePagesOut = PhysicalMemory->PageCount;
+    (void)FreeBlocks;
+}
+
+#include "../kernel/scheduling/futex.c"
+
+#define WAITER_COUNT   16
+#define PARKED_COUNT   1024
+#define WAKE_COUNT     (1024 * 1024)
+
+#define TEST_NAME "futex_test"
+
+struct waiter {
+    pthread_t     thread;
+    Thread_t      kthread;
+    _Atomic(int)* futex;
+    _Atomic(int)* futex2;
+    int           value;
+    OsStatus_t    status;
+    _Atomic(int)  done;
+};
+
+static void*
+waiter_main(void* context)
+{
+    struct waiter* waiter = context;
+
+    g_currentThread = &waiter->kthread;
+    if (waiter->futex2) {
+        waiter->status = FutexWaitOperation(waiter->futex, waiter->value, waiter->futex2, 1,
+            FUTEX_OP(FUTEX_OP_SET, 0, 0, 0), FUTEX_WAIT_PRIVATE, 0);
+    }
+    else {
+        waiter->status = FutexWait(waiter->futex, waiter->value, FUTEX_WAIT_PRIVATE, 0);
+    }
+    atomic_store(&waiter->done, 1);
+    return NULL;
+}
+
+static void
+start_waiters(struct waiter* waiters, int count, _Atomic(int)* futex, int stride)
+{
+    int blocked = atomic_load(&g_blocked);
+    int i;
+
+    for (i = 0; i < count; i++) {
+        waiters[i].kthread.Handle = (UUId_t)i + 1;
+        waiters[i].futex          = futex + (i * stride);
+        waiters[i].value          = atomic_load(waiters[i].futex);
+        atomic_store(&waiters[i].done, 0);
+        waiters[i].kthread.Object.Signalled = 0;
+        pthread_mutex_init(&waiters[i].kthread.Object.Lock, NULL);
+        pthread_cond_init(&waiters[i].kthread.Object.Condition, NULL);
+        pthread_create(&waiters[i].thread, NULL, waiter_main, &waiters[i]);
+    }
+
+    // Wait for all of them to be queued
+    while (atomic_load(&g_blocked) != blocked + count) {
+        sched_yield();
+    }
+}
+
+static int
+count_done(struct waiter* waiters, int count)
+{
+    int done = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        done += atomic_load(&waiters[i].done);
+    }
+    return done;
+}
+
+static int
+wait_done(struct waiter* waiters, int count, int expected)
+{
+    unsigned long long timeout = NowNs() + 2000000000ULL;
+    while (count_done(waiters, count) < expected && NowNs() < timeout) {
+        sched_yield();
+    }
+
+    // Give extra wakeups a chance to show up
+    usleep(10000);
+    return count_done(waiters, count);
+}
+
+static void
+join_waiters(struct waiter* waiters, int count)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        pthread_join(waiters[i].thread, NULL);
+        pthread_mutex_destroy(&waiters[i].kthread.Object.Lock);
+        pthread_cond_destroy(&waiters[i].kthread.Object.Condition);
+    }
+}
+
+static int
+test_wait_wake(void)
+{
+    static struct waiter waiters[WAITER_COUNT];
+    static _Atomic(int)  futex = 0;
+    static Thread_t      main;
+    int                  done;
+
+    g_currentThread = &main;
+    CHECK(TEST_NAME, FutexWait(&futex, 1, FUTEX_WAIT_PRIVATE, 0) == OsExists, "wait on a changed value blocked");
+    CHECK(TEST_NAME, FutexWake(&futex, 1, FUTEX_WAKE_PRIVATE) == OsDoesNotExist, "wake without waiters succeeded");
+
+    start_waiters(&waiters[0], WAITER_COUNT, &futex, 0);
+    CHECK(TEST_NAME, FutexWake(&futex, 1, 0) == OsDoesNotExist, "shared wake woke private waiters");
+    CHECK(TEST_NAME, FutexWake(&futex, 3, FUTEX_WAKE_PRIVATE) == OsSuccess, "wake failed");
+    done = wait_done(&waiters[0], WAITER_COUNT, 3);
+    CHECK(TEST_NAME, done == 3, "woke %i waiters, expected 3", done);
+
+    CHECK(TEST_NAME, FutexWake(&futex, INT_MAX, FUTEX_WAKE_PRIVATE) == OsSuccess, "wake all failed");
+    done = wait_done(&waiters[0], WAITER_COUNT, WAITER_COUNT);
+    CHECK(TEST_NAME, done == WAITER_COUNT, "woke %i waiters, expected %i", done, WAITER_COUNT);
+    join_waiters(&waiters[0], WAITER_COUNT);
+    CHECK(TEST_NAME, FutexWake(&futex, INT_MAX, FUTEX_WAKE_PRIVATE) == OsDoesNotExist, "waiters were left queued");
+    return 0;
+}
+
+static int
+test_requeue(void)
+{
+    static struct waiter waiters[WAITER_COUNT];
+    static _Atomic(int)  cond  = 5;
+    static _Atomic(int)  mutex = 2;
+    int                  done;
+
+    start_waiters(&waiters[0], WAITER_COUNT, &cond, 0);
+    CHECK(TEST_NAME, FutexRequeue(&cond, 1, &mutex, INT_MAX, 4, FUTEX_WAKE_PRIVATE) == OsInterrupted,
+        "requeue with a stale value succeeded");
+    CHECK(TEST_NAME, wait_done(&waiters[0], WAITER_COUNT, 0) == 0, "stale requeue woke waiters");
+
+    // Wake one and move the rest, like a broadcast on a condition
+    CHECK(TEST_NAME, FutexRequeue(&cond, 1, &mutex, INT_MAX, 5, FUTEX_WAKE_PRIVATE) == OsSuccess, "requeue failed");
+    done = wait_done(&waiters[0], WAITER_COUNT, 1);
+    CHECK(TEST_NAME, done == 1, "requeue woke %i waiters, expected 1", done);
+    CHECK(TEST_NAME, FutexWake(&cond, INT_MAX, FUTEX_WAKE_PRIVATE) == OsDoesNotExist, "waiters were left on the condition");
+
+    // The requeued waiters are now woken one at the time by the mutex
+    CHECK(TEST_NAME, FutexWake(&mutex, 1, FUTEX_WAKE_PRIVATE) == OsSuccess, "wake on the mutex failed");
+    done = wait_done(&waiters[0], WAITER_COUNT, 2);
+    CHECK(TEST_NAME, done == 2, "mutex wake woke %i waiters, expected 2", done);
+    CHECK(TEST_NAME, FutexWake(&mutex, INT_MAX, FUTEX_WAKE_PRIVATE) == OsSuccess, "wake all on the mutex failed");
+    done = wait_done(&waiters[0], WAITER_COUNT, WAITER_COUNT);
+    CHECK(TEST_NAME, done == WAITER_COUNT, "woke %i waiters, expected %i", done, WAITER_COUNT);
+    join_waiters(&waiters[0], WAITER_COUNT);
+    return 0;
+}
+
+// The two ways a condition wait returns without being woken must be told apart, only
+// the first one leaves the mutex with the caller
+static int
+test_interrupted(void)
+{
+    static struct waiter waiters[1];
+    static _Atomic(int)  cond;
+    static _Atomic(int)  mutex;
+    static Thread_t      main;
+
+    g_currentThread = &main;
+    atomic_store(&cond, 7);
+    atomic_store(&mutex, 1);
+    CHECK(TEST_NAME, FutexWaitOperation(&cond, 6, &mutex, 1, FUTEX_OP(FUTEX_OP_SET, 0, 0, 0), FUTEX_WAIT_PRIVATE, 0) == OsExists,
+        "wait on a changed value did not report it");
+    CHECK(TEST_NAME, atomic_load(&mutex) == 1, "mutex was released by a wait that never queued");
+
+    // A queued waiter has released the mutex by the time it is interrupted
+    waiters[0].futex2 = &mutex;
+    start_waiters(&waiters[0], 1, &cond, 0);
+    CHECK(TEST_NAME, atomic_load(&mutex) == 0, "queued waiter did not release the mutex");
+    SchedulerExpediteObject(&waiters[0].kthread.Object);
+    CHECK(TEST_NAME, wait_done(&waiters[0], 1, 1) == 1, "interrupted waiter did not return");
+    join_waiters(&waiters[0], 1);
+    CHECK(TEST_NAME, waiters[0].status == OsInterrupted, "interrupted wait returned %i", waiters[0].status);
+    CHECK(TEST_NAME, FutexWake(&cond, INT_MAX, FUTEX_WAKE_PRIVATE) == OsDoesNotExist, "interrupted waiter was left queued");
+    return 0;
+}
+
+// Parks a thread on each of a large number of futexes and measures a wake of futexes
+// without waiters, which has to walk the bucket it hashes to.
+static int
+bench_buckets(const char* name)
+{
+    static struct waiter waiters[PARKED_COUNT];
+    static _Atomic(int)  futexes[PARKED_COUNT * 2];
+    unsigned long long   start;
+    unsigned long long   end;
+    size_t               longest = 0;
+    size_t               i;
+    int                  done;
+
+    start_waiters(&waiters[0], PARKED_COUNT, &futexes[0], 2);
+    for (i = 0; i <= FutexBucketMask; i++) {
+        longest = MAX(longest, (size_t)FutexBuckets[i].Waiters.count);
+    }
+
+    start = NowNs();
+    for (i = 0; i < WAKE_COUNT; i++) {
+        if (FutexWake(&futexes[((i % PARKED_COUNT) * 2) + 1], 1, FUTEX_WAKE_PRIVATE) != OsDoesNotExist) {
+            CHECK(TEST_NAME, 0, "%s: wake of an empty futex woke a waiter", name);
+        }
+    }
+    end = NowNs();
+
+    for (i = 0; i < PARKED_COUNT; i++) {
+        FutexWake(&futexes[i * 2], 1, FUTEX_WAKE_PRIVATE);
+    }
+    done = wait_done(&waiters[0], PARKED_COUNT, PARKED_COUNT);
+    CHECK(TEST_NAME, done == PARKED_COUNT, "%s: woke %i waiters, expected %i", name, done, PARKED_COUNT);
+    join_waiters(&waiters[0], PARKED_COUNT);
+
+    printf("%-6s %6" PRIuIN " buckets, %i waiters: longest chain %3" PRIuIN ", wake %6.1f ns\n",
+        name, FutexBucketMask + 1, PARKED_COUNT, longest, (double)(end - start) / WAKE_COUNT);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static Thread_t main;
+
+    g_currentThread = &main;
+    atomic_store(&g_machine.NumberOfCores, 16);
+    g_machine.PhysicalMemory.PageCount = 256 * 1024; // 1GB
+    FutexInitialize();
+
+    if (test_wait_wake() || test_requeue() || test_interrupted() || bench_buckets("boot")) {
+        return -1;
+    }
+
+    FutexInitializeBuckets();
+    CHECK(TEST_NAME, FutexBucketMask + 1 == 16 * FUTEX_BUCKETS_PER_CORE, "table has %" PRIuIN " buckets", FutexBucketMask + 1);
+    CHECK(TEST_NAME, g_mappedBytes == (FutexBucketMask + 1) * sizeof(FutexBucket_t),
+          "table of %" PRIuIN " bytes was not allocated from pages", g_mappedBytes);
+    if (test_wait_wake() || test_requeue() || test_interrupted() || bench_buckets("scaled")) {
+        return -1;
+    }
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}
@@ -0,0 +1,303 @@
+
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define _In_Opt_
+#define _CRT_UNUSED(x) (void)x
+#define UUID_INVALID   (UUId_t)0xFFFFFFFF
+
+#define OS_IRQ_SPINLOCK_INIT { ATOMIC_FLAG_INIT }
+
+typedef struct Semaphore { int Value; } Semaphore_t;
+#define SEMAPHORE_INIT(Value, Maximum) { Value }
+static void SemaphoreSignal(Semaphore_t* Semaphore, int Value) { Semaphore->Value += Value; }
+static void SemaphoreWait(Semaphore_t* Semaphore, size_t Timeout) { (void)Timeout; Semaphore->Value--; }
+
+typedef struct Mutex { atomic_flag Value; } Mutex_t;
+#define MUTEX_FLAG_PLAIN     0
+#define OS_MUTEX_INIT(Flags) { ATOMIC_FLAG_INIT }
+static void MutexLock(Mutex_t* Mutex)   { while (atomic_flag_test_and_set(&Mutex->Value)); }
+static void MutexUnlock(Mutex_t* Mutex) { atomic_flag_clear(&Mutex->Value); }
+
+// The janitor is not running, so the clean queue is drained by the test
+typedef struct queue { element_t* head; element_t* tail; } queue_t;
+#define QUEUE_INIT { NULL, NULL }
+
+static void
+queue_push(queue_t* Queue, element_t* Element)
+{
+    Element->next = NULL;
+    if (Queue->tail) Queue->tail->next = Element;
+    else             Queue->head = Element;
+    Queue->tail = Element;
+}
+
+static element_t*
+queue_pop(queue_t* Queue)
+{
+    element_t* Element = Queue->head;
+    if (Element) {
+        Queue->head = Element->next;
+        if (!Queue->head) Queue->tail = NULL;
+    }
+    return Element;
+}
+
+static OsStatus_t
+ThreadCreate(const char* Name, void (*Function)(void*), void* Arguments, unsigned int Flags,
+    UUId_t MemorySpace, size_t KernelStackSize, size_t UserStackSize, UUId_t* Handle)
+{
+    return OsNotSupported;
+}
+
+static void ThreadingYield(void) { sched_yield(); }
+
+void* dsalloc(size_t size) { return malloc(size); }
+void  dsfree(void* pointer) { free(pointer); }
+
+#include "../librt/libds/hashtable.c"
+#include "../librt/libds/hash_sip.c"
+#include "../kernel/handle.c"
+
+#define MAX_HANDLES    (1024 * 1024)
+#define LOOKUP_COUNT   (1024 * 1024)
+#define HOT_HANDLES    64
+
+#define TEST_NAME "handle_bench"
+
+static UUId_t    g_handles[MAX_HANDLES];
+static uint32_t  g_order[LOOKUP_COUNT];
+static int       g_destroyed = 0;
+
+static void
+resource_destructor(void* Resource)
+{
+    g_destroyed++;
+}
+
+static void
+drain_clean_queue(void)
+{
+    ReleaseRemovedHandles();
+}
+
+static int
+test_handles(void)
+{
+    UUId_t handle;
+    UUId_t stale;
+    UUId_t found;
+    void*  resource;
+
+    handle = CreateHandle(HandleTypeGeneric, resource_destructor, &g_destroyed);
+    CHECK(TEST_NAME, handle != UUID_INVALID && handle != 0, "invalid handle id %u", handle);
+    CHECK(TEST_NAME, LookupHandle(handle) == &g_destroyed, "lookup failed");
+    CHECK(TEST_NAME, LookupHandleOfType(handle, HandleTypeGeneric) == &g_destroyed, "typed lookup failed");
+    CHECK(TEST_NAME, LookupHandleOfType(handle, HandleTypeThread) == NULL, "lookup of the wrong type succeeded");
+    CHECK(TEST_NAME, LookupHandle(UUID_INVALID) == NULL && LookupHandle(0) == NULL, "reserved ids resolved");
+
+    CHECK(TEST_NAME, RegisterHandlePath(handle, "/test/handle") == OsSuccess, "failed to register path");
+    CHECK(TEST_NAME, RegisterHandlePath(handle, "/test/other") == OsExists, "registered a second path");
+    CHECK(TEST_NAME, LookupHandleByPath("/test/handle", &found) == OsSuccess && found == handle, "path lookup failed");
+    CHECK(TEST_NAME, LookupHandleByPath("/test/none", &found) == OsDoesNotExist, "lookup of unknown path succeeded");
+
+    // References keep the handle alive until the last destroy
+    CHECK(TEST_NAME, AcquireHandle(handle, &resource) == OsSuccess && resource == &g_destroyed, "acquire failed");
+    DestroyHandle(handle);
+    CHECK(TEST_NAME, LookupHandle(handle) != NULL, "handle destroyed while referenced");
+    DestroyHandle(handle);
+    CHECK(TEST_NAME, LookupHandle(handle) == NULL, "handle still resolves after destroy");
+    CHECK(TEST_NAME, LookupHandleByPath("/test/handle", &found) == OsDoesNotExist, "path still resolves after destroy");
+    drain_clean_queue();
+    CHECK(TEST_NAME, g_destroyed == 1, "destructor was called %i times", g_destroyed);
+
+    // Cycle a slot until it gets reused, the stale id must never resolve to the new handle
+    stale = handle;
+    do {
+        handle = CreateHandle(HandleTypeGeneric, NULL, &g_handles[0]);
+        CHECK(TEST_NAME, handle != stale, "stale id was handed out again");
+        if ((handle & HANDLE_INDEX_MASK) == (stale & HANDLE_INDEX_MASK)) {
+            break;
+        }
+        DestroyHandle(handle);
+    } while (1);
+    CHECK(TEST_NAME, LookupHandle(stale) == NULL, "stale id resolved to a reused slot");
+    CHECK(TEST_NAME, AcquireHandle(stale, NULL) == OsDoesNotExist, "stale id was acquired");
+    DestroyHandle(stale);
+    CHECK(TEST_NAME, LookupHandle(handle) != NULL, "destroying a stale id destroyed the new handle");
+    DestroyHandle(handle);
+    drain_clean_queue();
+    return 0;
+}
+
+#define READER_COUNT  4
+#define CHURN_HANDLES 64
+#define CHURN_ROUNDS  20000
+
+static _Atomic(UUId_t) g_churn[CHURN_HANDLES];
+static _Atomic(int)    g_churnDone;
+static _Atomic(int)    g_churnErrors;
+
+static void*
+churn_reader(void* context)
+{
+    uint32_t seed = (uint32_t)(uintptr_t)context * 2654435761U + 1;
+    (void)context;
+
+    while (!atomic_load(&g_churnDone)) {
+        int   index;
+        void* resource;
+
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        index    = (int)(seed % CHURN_HANDLES);
+        resource = LookupHandleOfType(atomic_load(&g_churn[index]), HandleTypeGeneric);
+        if (resource && resource != &g_churn[index]) {
+            atomic_fetch_add(&g_churnErrors, 1);
+        }
+    }
+    return NULL;
+}
+
+// Readers look up handles while they are destroyed and freed, the instances must not
+// be freed while a reader can still hold them
+static int
+test_concurrent_destroy(void)
+{
+    pthread_t readers[READER_COUNT];
+    int       i;
+
+    for (i = 0; i < CHURN_HANDLES; i++) {
+        atomic_store(&g_churn[i], CreateHandle(HandleTypeGeneric, NULL, (void*)&g_churn[i]));
+    }
+    for (i = 0; i < READER_COUNT; i++) {
+        pthread_create(&readers[i], NULL, churn_reader, (void*)(uintptr_t)i);
+    }
+
+    for (i = 0; i < CHURN_ROUNDS; i++) {
+        int    index = i % CHURN_HANDLES;
+        UUId_t old   = atomic_load(&g_churn[index]);
+        atomic_store(&g_churn[index], CreateHandle(HandleTypeGeneric, NULL, (void*)&g_churn[index]));
+        DestroyHandle(old);
+        if ((i % 8) == 7) {
+            drain_clean_queue();
+        }
+    }
+
+    atomic_store(&g_churnDone, 1);
+    for (i = 0; i < READER_COUNT; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    for (i = 0; i < CHURN_HANDLES; i++) {
+        DestroyHandle(atomic_load(&g_churn[i]));
+    }
+    drain_clean_queue();
+    CHECK(TEST_NAME, atomic_load(&g_churnErrors) == 0, "%i lookups returned the wrong resource", atomic_load(&g_churnErrors));
+    return 0;
+}
+
+static int
+bench_handles(int handleCount)
+{
+    unsigned long long start;
+    unsigned long long end;
+    double             lookup;
+    double             hot;
+    double             acquire;
+    double             path;
+    uint32_t           seed = 0x12345678;
+    char               name[32];
+    UUId_t             found;
+    void*              resource;
+    int                i;
+
+    for (i = 0; i < handleCount; i++) {
+        g_handles[i] = CreateHandle(HandleTypeGeneric, NULL, &g_handles[i]);
+        CHECK(TEST_NAME, g_handles[i] != UUID_INVALID, "failed to create handle %i", i);
+    }
+    for (i = 0; i < LOOKUP_COUNT; i++) {
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        g_order[i] = seed % (uint32_t)handleCount;
+    }
+
+    start = NowNs();
+    for (i = 0; i < LOOKUP_COUNT; i++) {
+        if (LookupHandleOfType(g_handles[g_order[i]], HandleTypeGeneric) != &g_handles[g_order[i]]) {
+            CHECK(TEST_NAME, 0, "lookup of handle %u failed", g_order[i]);
+        }
+    }
+    end    = NowNs();
+    lookup = (double)(end - start) / LOOKUP_COUNT;
+
+    // A thread making syscalls usually touches a few handles, while the table holds all
+    // handles in the system
+    start = NowNs();
+    for (i = 0; i < LOOKUP_COUNT; i++) {
+        int index = (int)(g_order[i] % MIN(handleCount, HOT_HANDLES));
+        if (LookupHandleOfType(g_handles[index], HandleTypeGeneric) != &g_handles[index]) {
+            CHECK(TEST_NAME, 0, "lookup of handle %i failed", index);
+        }
+    }
+    end = NowNs();
+    hot = (double)(end - start) / LOOKUP_COUNT;
+
+    start = NowNs();
+    for (i = 0; i < LOOKUP_COUNT; i++) {
+        if (AcquireHandle(g_handles[g_order[i]], &resource) != OsSuccess) {
+            CHECK(TEST_NAME, 0, "acquire of handle %u failed", g_order[i]);
+        }
+        DestroyHandle(g_handles[g_order[i]]);
+    }
+    end     = NowNs();
+    acquire = (double)(end - start) / LOOKUP_COUNT;
+
+    // Register a path for every 16th handle
+    for (i = 0; i < handleCount; i += 16) {
+        snprintf(&name[0], sizeof(name), "/handles/%i", i);
+        CHECK(TEST_NAME, RegisterHandlePath(g_handles[i], &name[0]) == OsSuccess, "failed to register %s", &name[0]);
+    }
+    start = NowNs();
+    for (i = 0; i < LOOKUP_COUNT / 16; i++) {
+        int index = (int)(g_order[i] & ~15U);
+        snprintf(&name[0], sizeof(name), "/handles/%i", index);
+        if (LookupHandleByPath(&name[0], &found) != OsSuccess || found != g_handles[index]) {
+            CHECK(TEST_NAME, 0, "path lookup of %s failed", &name[0]);
+        }
+    }
+    end  = NowNs();
+    path = (double)(end - start) / (LOOKUP_COUNT / 16);
+
+    for (i = 0; i < handleCount; i++) {
+        DestroyHandle(g_handles[i]);
+    }
+    drain_clean_queue();
+    for (i = 0; i < handleCount; i += 997) {
+        CHECK(TEST_NAME, LookupHandle(g_handles[i]) == NULL, "handle %i resolves after destroy", i);
+    }
+
+    printf("handles %8i: lookup %6.1f ns (%i hot handles %5.1f ns), acquire+destroy %6.1f ns, path lookup %6.1f ns\n",
+        handleCount, lookup, HOT_HANDLES, hot, acquire, path);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const int handleCounts[] = { 1000, 10000, 100000, 1000000 };
+    int              i;
+
+    if (InitializeHandles() != OsSuccess || test_handles() || test_concurrent_destroy()) {
+        return -1;
+    }
+
+    printf("%i random lookups per run\n", LOOKUP_COUNT);
+    for (i = 0; i < (int)SIZEOF_ARRAY(handleCounts); i++) {
+        if (bench_handles(handleCounts[i])) {
+            return -1;
+        }
+    }
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}
@@ -0,0 +1,250 @@
+
+#define __TEST
+
+#include "heap_mock.h"
+
+#define OBJECT_SIZE  64
+#define BATCH_SIZE   16
+#define ITERATIONS   200000
+
+#define LATENCY_ITERATIONS 20000
+
+#define TEST_NAME "heap_bench"
+
+enum bench_mode {
+    BENCH_SLAB,
+    BENCH_MAGAZINE,
+    BENCH_KMALLOC
+};
+
+struct bench_thread {
+    pthread_t       thread;
+    UUId_t          core;
+    enum bench_mode mode;
+    MemoryCache_t*  cache;
+    int             errors;
+};
+
+static pthread_barrier_t g_barrier;
+
+static void*
+bench_worker(void* context)
+{
+    struct bench_thread* worker = context;
+    uintptr_t*           objects[BATCH_SIZE];
+    int                  i, j;
+
+    g_currentCore = worker->core;
+    pthread_barrier_wait(&g_barrier);
+
+    // Allocate a batch, tag every object with the core id to detect objects that
+    // are handed out twice, and free the batch again
+    for (i = 0; i < ITERATIONS / BATCH_SIZE; i++) {
+        for (j = 0; j < BATCH_SIZE; j++) {
+            objects[j] = (worker->mode == BENCH_KMALLOC) ?
+                kmalloc(OBJECT_SIZE) : MemoryCacheAllocate(worker->cache);
+            if (!objects[j]) {
+                worker->errors++;
+                return NULL;
+            }
+            objects[j][0] = (uintptr_t)worker->core;
+            objects[j][1] = (uintptr_t)objects[j];
+        }
+
+        for (j = 0; j < BATCH_SIZE; j++) {
+            if (objects[j][0] != (uintptr_t)worker->core || objects[j][1] != (uintptr_t)objects[j]) {
+                worker->errors++;
+            }
+
+            if (worker->mode == BENCH_KMALLOC) kfree(objects[j]);
+            else                               MemoryCacheFree(worker->cache, objects[j]);
+        }
+    }
+    return NULL;
+}
+
+static int
+run_bench(const char* name, enum bench_mode mode, MemoryCache_t* cache, int coreCount)
+{
+    struct bench_thread workers[MOCK_MAX_CORES];
+    unsigned long long  start;
+    unsigned long long  end;
+    double              seconds;
+    int                 errors = 0;
+    int                 i;
+
+    mock_set_core_count(coreCount);
+    pthread_barrier_init(&g_barrier, NULL, (unsigned)coreCount + 1);
+    for (i = 0; i < coreCount; i++) {
+        workers[i].core   = (UUId_t)i;
+        workers[i].mode   = mode;
+        workers[i].cache  = cache;
+        workers[i].errors = 0;
+        pthread_create(&workers[i].thread, NULL, bench_worker, &workers[i]);
+    }
+
+    pthread_barrier_wait(&g_barrier);
+    start = NowNs();
+    for (i = 0; i < coreCount; i++) {
+        pthread_join(workers[i].thread, NULL);
+        errors += workers[i].errors;
+    }
+    end = NowNs();
+    pthread_barrier_destroy(&g_barrier);
+
+    CHECK(TEST_NAME, errors == 0, "%s: %i corrupted or failed allocations on %i cores", name, errors, coreCount);
+
+    seconds = (double)(end - start) / 1000000000.0;
+    printf("%-9s cores %2i: %8.2f Mops/s\n", name, coreCount,
+        ((double)ITERATIONS * 2.0 * coreCount) / seconds / 1000000.0);
+    return 0;
+}
+
+static int
+test_reap(void)
+{
+    MemoryCache_t* cache;
+    void*          objects[256];
+    size_t         pagesBefore;
+    int            pagesFreed;
+    int            i;
+
+    mock_set_core_count(4);
+    cache = MemoryCacheCreate("reap_cache", OBJECT_SIZE, 0, 0, 0, NULL, NULL);
+    CHECK(TEST_NAME, cache != NULL, "failed to create cache");
+
+    // Spread the objects over the per-cpu caches of all cores
+    for (i = 0; i < 256; i++) {
+        objects[i] = MemoryCacheAllocate(cache);
+        CHECK(TEST_NAME, objects[i] != NULL, "allocation %i failed", i);
+    }
+    for (i = 0; i < 256; i++) {
+        g_currentCore = (UUId_t)(i % 4);
+        MemoryCacheFree(cache, objects[i]);
+    }
+    g_currentCore = 0;
+    CHECK(TEST_NAME, cache->CpuCaches != NULL, "per-cpu caches were not created");
+    CHECK(TEST_NAME, cache->NumberOfFreeObjects < 256, "objects did not stay in the magazines");
+
+    // Reaping must return every object to the slabs, and release all of them
+    pagesBefore = atomic_load(&g_pagesMapped);
+    pagesFreed  = MemoryCacheReap();
+    CHECK(TEST_NAME, pagesFreed > 0, "reap did not free any pages");
+    CHECK(TEST_NAME, cache->FreeSlabs.head == NULL && cache->PartialSlabs.head == NULL && cache->FullSlabs.head == NULL,
+        "slabs remain after reap");
+    CHECK(TEST_NAME, cache->NumberOfFreeObjects == 0, "free object count is %i after reap", cache->NumberOfFreeObjects);
+    CHECK(TEST_NAME, atomic_load(&g_pagesMapped) < pagesBefore, "pages were not unmapped, %" PRIuIN " before and %" PRIuIN " after",
+        pagesBefore, atomic_load(&g_pagesMapped));
+    for (i = 0; i < 4; i++) {
+        CHECK(TEST_NAME, cache->CpuCaches[i].Loaded == NULL && cache->CpuCaches[i].Previous == NULL,
+            "core %i still has magazines", i);
+    }
+
+    // The cache must remain usable
+    objects[0] = MemoryCacheAllocate(cache);
+    CHECK(TEST_NAME, objects[0] != NULL, "allocation after reap failed");
+    MemoryCacheFree(cache, objects[0]);
+    MemoryCacheDestroy(cache);
+    return 0;
+}
+
+static int
+bench_free_latency(int slabCount)
+{
+    MemoryCache_t*     cache;
+    void**             objects;
+    unsigned long long start;
+    unsigned long long end;
+    double             cacheFree;
+    double             kmallocFree;
+    int                objectCount;
+    int                i;
+
+    mock_set_core_count(1);
+    cache = MemoryCacheCreate("latency_cache", OBJECT_SIZE, 0, 0, HEAP_SLAB_NO_ATOMIC_CACHE, NULL, NULL);
+    CHECK(TEST_NAME, cache != NULL, "failed to create cache");
+
+    objectCount = slabCount * cache->ObjectCount;
+    objects     = malloc((size_t)objectCount * sizeof(void*));
+    CHECK(TEST_NAME, objects != NULL, "out of host memory");
+
+    // Fill the requested number of slabs, then free and reallocate random objects
+    srand(1);
+    for (i = 0; i < objectCount; i++) {
+        objects[i] = MemoryCacheAllocate(cache);
+        CHECK(TEST_NAME, objects[i] != NULL, "allocation %i failed", i);
+    }
+
+    start = NowNs();
+    for (i = 0; i < LATENCY_ITERATIONS; i++) {
+        int index = rand() % objectCount;
+        MemoryCacheFree(cache, objects[index]);
+        objects[index] = MemoryCacheAllocate(cache);
+    }
+    end       = NowNs();
+    cacheFree = (double)(end - start) / (double)LATENCY_ITERATIONS;
+
+    for (i = 0; i < objectCount; i++) {
+        MemoryCacheFree(cache, objects[i]);
+        objects[i] = kmalloc(OBJECT_SIZE);
+        CHECK(TEST_NAME, objects[i] != NULL, "kmalloc %i failed", i);
+    }
+    MemoryCacheDestroy(cache);
+
+    start = NowNs();
+    for (i = 0; i < LATENCY_ITERATIONS; i++) {
+        int index = rand() % objectCount;
+        kfree(objects[index]);
+        objects[index] = kmalloc(OBJECT_SIZE);
+    }
+    end         = NowNs();
+    kmallocFree = (double)(end - start) / (double)LATENCY_ITERATIONS;
+
+    for (i = 0; i < objectCount; i++) {
+        kfree(objects[i]);
+    }
+    free(objects);
+    (void)MemoryCacheReap();
+
+    printf("slabs %6i: MemoryCacheFree %8.1f ns, kfree %8.1f ns (including reallocation)\n",
+        slabCount, cacheFree, kmallocFree);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const int coreCounts[] = { 1, 2, 4, 8 };
+    static const int slabCounts[] = { 100, 1000, 10000, 20000 };
+    MemoryCache_t*   slabCache;
+    MemoryCache_t*   magazineCache;
+    int              i;
+
+    mock_initialize_heap();
+    if (test_reap()) {
+        return -1;
+    }
+
+    printf("%i frees with live slabs\n", LATENCY_ITERATIONS);
+    for (i = 0; i < (int)SIZEOF_ARRAY(slabCounts); i++) {
+        if (bench_free_latency(slabCounts[i])) {
+            return -1;
+        }
+    }
+
+    slabCache     = MemoryCacheCreate("slab_cache", OBJECT_SIZE, 0, 0, HEAP_SLAB_NO_ATOMIC_CACHE, NULL, NULL);
+    magazineCache = MemoryCacheCreate("magazine_cache", OBJECT_SIZE, 0, 0, 0, NULL, NULL);
+
+    printf("%i allocations and frees per core, batches of %i\n", ITERATIONS, BATCH_SIZE);
+    for (i = 0; i < (int)SIZEOF_ARRAY(coreCounts); i++) {
+        if (run_bench("slab", BENCH_SLAB, slabCache, coreCounts[i]) ||
+            run_bench("magazine", BENCH_MAGAZINE, magazineCache, coreCounts[i]) ||
+            run_bench("kmalloc", BENCH_KMALLOC, NULL, coreCounts[i])) {
+            return -1;
+        }
+    }
+
+    MemoryCacheDestroy(slabCache);
+    MemoryCacheDestroy(magazineCache);
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}
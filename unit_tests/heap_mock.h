@@ -0,0 +1,189 @@
+/**
+ * Machine model for compiling the kernel heap in the unit test environment.
+ * Every simulated core is a host thread that is bound to a core id, which
+ * matches the kernel where the per-cpu caches are used with interrupts disabled.
+ */
+
+#define KERNEL_MOCK_HEAP
+
+#include "kernel_mock.h"
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define CpuFunctionCustom 0
+#define MAPPING_COMMIT    0x1
+#define MAPPING_DOMAIN    0x2
+#define MAPPING_USERSPACE 0x4
+#define MAPPING_VIRTUAL_GLOBAL 0x1
+
+#define LODWORD(l)      ((uint32_t)(uintptr_t)(l))
+#define WRITELINE(...)  do { printf(__VA_ARGS__); printf("\n"); } while (0)
+#define _CRT_UNUSED(x)  (void)x
+
+#include "../kernel/include/heap.h"
+
+typedef int   IntStatus_t;
+typedef void* MemorySpace_t;
+typedef uintptr_t vaddr_t;
+
+typedef struct Mutex {
+    pthread_mutex_t Lock;
+} Mutex_t;
+
+#define MUTEX_FLAG_RECURSIVE 0x1
+
+static void
+MutexConstruct(Mutex_t* Mutex, unsigned int Flags)
+{
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    if (Flags & MUTEX_FLAG_RECURSIVE) {
+        pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    }
+    pthread_mutex_init(&Mutex->Lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+}
+
+static void MutexLock(Mutex_t* Mutex)   { pthread_mutex_lock(&Mutex->Lock); }
+static void MutexUnlock(Mutex_t* Mutex) { pthread_mutex_unlock(&Mutex->Lock); }
+
+typedef struct PhysicalMemory {
+    size_t PageCount;
+    size_t FreePages;
+} PhysicalMemory_t;
+
+static void PhysicalMemoryGetStatistics(PhysicalMemory_t* PhysicalMemory, size_t* PageCountOut,
+    size_t* FreePagesOut, size_t* FreeBlocks)
+{
+    *PageCountOut = PhysicalMemory->PageCount;
+    *FreePagesOut = PhysicalMemory->FreePages;
+    (void)FreeBlocks;
+}
+
+typedef struct SystemMachine {
+    _Atomic(int) NumberOfCores;
+    _Atomic(int) NumberOfActiveCores;
+    PhysicalMemory_t PhysicalMemory;
+    struct {
+        uintptr_t StartAddress;
+        size_t    Length;
+    } GlobalAccessMemory;
+} SystemMachine_t;
+
+#define MOCK_MAX_CORES     16
+#define MOCK_PAGE_SIZE     0x1000
+#define MOCK_GLOBAL_MEMORY (2UL * 1024 * 1024 * 1024)
+#define MOCK_MAX_PAGES     256
+
+static SystemMachine_t  g_machine;
+static __thread UUId_t  g_currentCore = 0;
+static _Atomic(size_t)  g_pagesMapped = ATOMIC_VAR_INIT(0);
+
+// The global access memory is a reserved host region that is handed out page aligned
+// from the top, released mappings are kept on a free list per page count
+static pthread_mutex_t  g_globalLock = PTHREAD_MUTEX_INITIALIZER;
+static uintptr_t        g_globalNext;
+static void*            g_globalFree[MOCK_MAX_PAGES + 1];
+
+static SystemMachine_t* GetMachine(void) { return &g_machine; }
+static UUId_t ArchGetProcessorCoreId(void) { return g_currentCore; }
+static IntStatus_t InterruptDisable(void) { return 0; }
+static IntStatus_t InterruptRestoreState(IntStatus_t State) { return State; }
+
+static size_t GetMemorySpacePageSize(void) { return MOCK_PAGE_SIZE; }
+static MemorySpace_t* GetCurrentMemorySpace(void) { return NULL; }
+
+static OsStatus_t
+MemorySpaceMap(MemorySpace_t* MemorySpace, vaddr_t* Address, uintptr_t* Pages,
+    size_t Length, unsigned int MemoryFlags, unsigned int PlacementFlags)
+{
+    size_t pageCount = Length / MOCK_PAGE_SIZE;
+    void*  memory    = NULL;
+    (void)MemorySpace; (void)Pages; (void)MemoryFlags; (void)PlacementFlags;
+
+    assert(pageCount <= MOCK_MAX_PAGES);
+    pthread_mutex_lock(&g_globalLock);
+    if (g_globalFree[pageCount]) {
+        memory                  = g_globalFree[pageCount];
+        g_globalFree[pageCount] = *(void**)memory;
+    }
+    else if (g_globalNext + Length <= g_machine.GlobalAccessMemory.StartAddress + g_machine.GlobalAccessMemory.Length) {
+        memory        = (void*)g_globalNext;
+        g_globalNext += Length;
+    }
+    pthread_mutex_unlock(&g_globalLock);
+
+    if (!memory) {
+        return OsOutOfMemory;
+    }
+    atomic_fetch_add(&g_pagesMapped, Length / GetMemorySpacePageSize());
+    *Address = (vaddr_t)memory;
+    return OsSuccess;
+}
+
+static OsStatus_t
+MemorySpaceUnmap(MemorySpace_t* MemorySpace, vaddr_t Address, size_t Length)
+{
+    size_t pageCount = Length / MOCK_PAGE_SIZE;
+    (void)MemorySpace;
+
+    atomic_fetch_sub(&g_pagesMapped, pageCount);
+    pthread_mutex_lock(&g_globalLock);
+    *(void**)Address        = g_globalFree[pageCount];
+    g_globalFree[pageCount] = (void*)Address;
+    pthread_mutex_unlock(&g_globalLock);
+    return OsSuccess;
+}
+
+static OsStatus_t
+GetMemorySpaceMapping(MemorySpace_t* MemorySpace, vaddr_t Address, int PageCount, uintptr_t* DmaOut)
+{
+    (void)MemorySpace; (void)PageCount;
+    *DmaOut = Address;
+    return OsSuccess;
+}
+
+// Messages to other cores are executed by the calling thread on behalf of the
+// target cores, which is only valid while the other simulated cores are idle
+static int
+ProcessorMessageSend(int ExcludeSelf, int Type, void (*Function)(void*), void* Argument, int Async)
+{
+    UUId_t currentCore = g_currentCore;
+    int    executions  = 0;
+    int    i;
+    (void)Type; (void)Async;
+
+    for (i = 0; i < atomic_load(&g_machine.NumberOfActiveCores); i++) {
+        if (ExcludeSelf && (UUId_t)i == currentCore) {
+            continue;
+        }
+        g_currentCore = (UUId_t)i;
+        Function(Argument);
+        executions++;
+    }
+    g_currentCore = currentCore;
+    return executions;
+}
+
+static void
+mock_initialize_heap(void)
+{
+    void* region = mmap(NULL, MOCK_GLOBAL_MEMORY, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(region != MAP_FAILED);
+
+    g_machine.GlobalAccessMemory.StartAddress = (uintptr_t)region;
+    g_machine.GlobalAccessMemory.Length       = MOCK_GLOBAL_MEMORY;
+    g_globalNext                              = (uintptr_t)region;
+    MemoryCacheInitialize();
+}
+
+static void
+mock_set_core_count(int coreCount)
+{
+    atomic_store(&g_machine.NumberOfCores, MOCK_MAX_CORES);
+    atomic_store(&g_machine.NumberOfActiveCores, coreCount);
+}
+
+#include "../kernel/memory/heap.c"
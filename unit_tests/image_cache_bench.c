@@ -0,0 +1,695 @@
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#define StrUTF8            0
+#define MSTRING_NO_MATCH   0
+#define MSTRING_FULL_MATCH 1
+
+#define DECL_STRUCT(Type) typedef struct Type Type##_t
+#define PACKED_TYPESTRUCT(Name, Body) typedef struct __attribute__((packed)) Name Body Name##_t
+#define ISINRANGE(x, lo, hi) (((x) >= (lo)) && ((x) < (hi)))
+#define DIVUP(a, b)          ((a / b) + (((a % b) > 0) ? 1 : 0))
+#define _CRT_UNUSED(x)       (void)(x)
+
+#define MEMORY_COMMIT     0x1
+#define MEMORY_READ       0x2
+#define MEMORY_WRITE      0x4
+#define MEMORY_EXECUTABLE 0x8
+
+#define PAGE_SIZE 0x1000
+
+typedef void* Handle_t;
+
+typedef union LargeUInteger {
+    uint64_t QuadPart;
+} LargeUInteger_t;
+
+typedef struct {
+    long            Id;
+    long            StorageId;
+    unsigned int    Flags;
+    unsigned int    Permissions;
+    LargeUInteger_t Size;
+    struct timespec CreatedAt;
+    struct timespec ModifiedAt;
+    struct timespec AccessedAt;
+} OsFileDescriptor_t;
+
+typedef struct OsImageCacheStatistics {
+    uint64_t Hits;
+    uint64_t Misses;
+    size_t   Images;
+    size_t   Mappings;
+    size_t   SharedBytes;
+    size_t   SavedBytes;
+} OsImageCacheStatistics_t;
+
+// Skip the process manager header, the cache only needs the statistics type
+#define __PROCESS_INTERFACE__
+
+// The loader only needs a handful of string operations
+typedef struct MString {
+    char*  Data;
+    size_t Length;
+} MString_t;
+
+static MString_t*
+MStringCreate(const char* data, int type)
+{
+    MString_t* string = malloc(sizeof(MString_t));
+    assert(string != NULL);
+    string->Length = strlen(data);
+    string->Data   = strdup(data);
+    assert(string->Data != NULL);
+    return string;
+}
+
+static void        MStringDestroy(MString_t* string) { if (string) { free(string->Data); free(string); } }
+static const char* MStringRaw(MString_t* string) { return string ? string->Data : NULL; }
+
+static MString_t*
+MStringSubString(MString_t* string, int index, int length)
+{
+    MString_t* sub = MStringCreate(string->Data + index, StrUTF8);
+    if (length >= 0 && (size_t)length < sub->Length) {
+        sub->Data[length] = '\0';
+        sub->Length       = length;
+    }
+    return sub;
+}
+
+static int
+MStringFindReverse(MString_t* string, int character, int startIndex)
+{
+    char* found = strrchr(string->Data, character);
+    return found ? (int)(found - string->Data) : -1;
+}
+
+static int
+MStringCompare(MString_t* first, MString_t* second, int ignoreCase)
+{
+    return (ignoreCase ? strcasecmp(first->Data, second->Data) : strcmp(first->Data, second->Data)) ?
+        MSTRING_NO_MATCH : MSTRING_FULL_MATCH;
+}
+
+void* dsalloc(size_t size) { return malloc(size); }
+void  dsfree(void* pointer) { free(pointer); }
+void  dswarning(const char* fmt, ...) { }
+
+void dserror(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+#include "../librt/libds/pe/pe.h"
+
+// The files the loader reads, every read is a full copy like the process manager does
+struct SyntheticFile {
+    const char*     Path;
+    uint8_t*        Data;
+    size_t          Length;
+    long            Id;
+    struct timespec ModifiedAt;
+};
+
+#define FILE_COUNT 2
+static struct SyntheticFile g_files[FILE_COUNT];
+static int                  g_fileReads;
+static int                  g_cacheEnabled;
+
+static struct SyntheticFile*
+FindFile(const char* path)
+{
+    for (int i = 0; i < FILE_COUNT; i++) {
+        if (g_files[i].Path && !strcmp(g_files[i].Path, path)) {
+            return &g_files[i];
+        }
+    }
+    return NULL;
+}
+
+// The memory space of a process, private mappings are pages of its own, shared
+// mappings are the pages of the snapshot
+#define MAX_MAPPINGS 16
+
+struct Mapping {
+    uintptr_t Address;
+    uint8_t*  Memory;
+    size_t    Length;
+    int       Shared;
+};
+
+struct ImageSpace {
+    struct Mapping Mappings[MAX_MAPPINGS];
+    int            Count;
+    size_t         PrivatePages;
+    size_t         SharedPages;
+};
+
+static struct ImageSpace* g_lastSpace;
+static size_t             g_snapshotBytes;
+
+uintptr_t  GetPageSize(void) { return PAGE_SIZE; }
+uintptr_t  GetBaseAddress(void) { return 0x400000; }
+clock_t    GetTimestamp(void) { return clock(); }
+
+OsStatus_t
+ResolveFilePath(UUId_t owner, MString_t* path, MString_t** fullPath)
+{
+    char buffer[64];
+    snprintf(&buffer[0], sizeof(buffer), "/bin/%s", MStringRaw(path));
+    *fullPath = MStringCreate(&buffer[0], StrUTF8);
+    return OsSuccess;
+}
+
+OsStatus_t
+LoadFile(MString_t* path, void** buffer, size_t* length)
+{
+    struct SyntheticFile* file = FindFile(MStringRaw(path));
+    if (!file) {
+        return OsDoesNotExist;
+    }
+
+    *buffer = malloc(file->Length);
+    assert(*buffer != NULL);
+    memcpy(*buffer, file->Data, file->Length);
+    *length = file->Length;
+    g_fileReads++;
+    return OsSuccess;
+}
+
+void UnloadFile(MString_t* path, void* buffer) { free(buffer); }
+int  IsFileVerified(MString_t* path, void* buffer) { return 0; }
+void MarkFileVerified(MString_t* path, void* buffer) { }
+
+OsStatus_t
+CreateImageSpace(MemorySpaceHandle_t* handle)
+{
+    g_lastSpace = calloc(1, sizeof(struct ImageSpace));
+    assert(g_lastSpace != NULL);
+    *handle = g_lastSpace;
+    return OsSuccess;
+}
+
+static struct Mapping*
+AddMapping(struct ImageSpace* space, uintptr_t address, uint8_t* memory, size_t length, int shared)
+{
+    struct Mapping* mapping;
+    size_t          pages = DIVUP(length, PAGE_SIZE);
+
+    assert(space->Count < MAX_MAPPINGS && (address % PAGE_SIZE) == 0);
+    mapping          = &space->Mappings[space->Count++];
+    mapping->Address = address;
+    mapping->Memory  = memory;
+    mapping->Length  = length;
+    mapping->Shared  = shared;
+    if (shared) space->SharedPages  += pages;
+    else        space->PrivatePages += pages;
+    return mapping;
+}
+
+// New pages are zeroed, and the loader gets a pointer it can write them through
+OsStatus_t
+AcquireImageMapping(MemorySpaceHandle_t handle, uintptr_t* address, size_t length,
+                    unsigned int flags, MemoryMapHandle_t* handleOut)
+{
+    size_t   pageLength = DIVUP(length, PAGE_SIZE) * PAGE_SIZE;
+    uint8_t* memory     = aligned_alloc(PAGE_SIZE, pageLength);
+
+    assert(memory != NULL);
+    memset(memory, 0, pageLength);
+    *handleOut = AddMapping(handle, *address, memory, length, 0);
+    *address   = (uintptr_t)memory;
+    return OsSuccess;
+}
+
+void ReleaseImageMapping(MemoryMapHandle_t handle) { }
+
+OsStatus_t
+ShareImageMapping(MemorySpaceHandle_t handle, void* source, uintptr_t address, size_t length, unsigned int flags)
+{
+    assert(((uintptr_t)source % PAGE_SIZE) == 0 && !(flags & MEMORY_WRITE));
+    AddMapping(handle, address, source, length, 1);
+    return OsSuccess;
+}
+
+static void
+DestroyImageSpace(struct ImageSpace* space)
+{
+    for (int i = 0; i < space->Count; i++) {
+        if (!space->Mappings[i].Shared) {
+            free(space->Mappings[i].Memory);
+        }
+    }
+    free(space);
+}
+
+// Reads memory of a process at the address the process sees it at
+static void*
+ReadImage(struct ImageSpace* space, uintptr_t address)
+{
+    for (int i = 0; i < space->Count; i++) {
+        struct Mapping* mapping = &space->Mappings[i];
+        if (address >= mapping->Address && address < mapping->Address + mapping->Length) {
+            return mapping->Memory + (address - mapping->Address);
+        }
+    }
+    return NULL;
+}
+
+OsStatus_t
+MemoryAllocate(void* hint, size_t length, unsigned int flags, void** memoryOut)
+{
+    assert((length % PAGE_SIZE) == 0 && (flags & MEMORY_COMMIT));
+    *memoryOut = aligned_alloc(PAGE_SIZE, length);
+    if (!*memoryOut) {
+        return OsOutOfMemory;
+    }
+    g_snapshotBytes += length;
+    return OsSuccess;
+}
+
+OsStatus_t
+MemoryFree(void* memory, size_t length)
+{
+    free(memory);
+    g_snapshotBytes -= length;
+    return OsSuccess;
+}
+
+// Files that can't be looked up are not cached, which is how the cache is disabled
+OsStatus_t
+GetFileInformationFromPath(const char* path, OsFileDescriptor_t* information)
+{
+    struct SyntheticFile* file = FindFile(path);
+    if (!file || !g_cacheEnabled) {
+        return OsDoesNotExist;
+    }
+
+    memset(information, 0, sizeof(OsFileDescriptor_t));
+    information->Id            = file->Id;
+    information->StorageId     = 1;
+    information->Size.QuadPart = file->Length;
+    information->ModifiedAt    = file->ModifiedAt;
+    return OsSuccess;
+}
+
+#include "../librt/libds/hashtable.c"
+#include "../librt/libds/pe/load.c"
+#include "../librt/libds/pe/utilities.c"
+#include "../librt/libds/pe/verify.c"
+#include "../services/processmanager/image_cache.c"
+
+#define INSTANCES    50
+#define EXPORTS      500
+#define IMPORTS      200
+#define APP_BASE     0x140000000ULL
+#define LIBRARY_BASE 0x180000000ULL
+#define HEADER_SIZE  0x400
+#define POINTER_STEP 64
+
+#define TEST_NAME "image_cache_bench"
+
+// The image is built as it is laid out in memory, the file alignment is the page size
+struct SyntheticImage {
+    uint8_t*              Data;
+    size_t                Length;
+    uint64_t              Base;
+    PeHeader_t*           Header;
+    PeOptionalHeader64_t* OptHeader;
+    PeSectionHeader_t*    Sections;
+    uint16_t*             Relocations;
+    uint32_t              RelocationBlock;
+};
+
+static uint32_t
+AddSection(struct SyntheticImage* image, const char* name, size_t size, uint32_t flags)
+{
+    PeSectionHeader_t* section = &image->Sections[image->Header->NumSections++];
+    uint32_t           rva     = (uint32_t)image->Length;
+
+    memcpy(&section->Name[0], name, strlen(name));
+    section->VirtualAddress = rva;
+    section->VirtualSize    = (uint32_t)size;
+    section->RawAddress     = rva;
+    section->RawSize        = (uint32_t)size;
+    section->Flags          = flags | PE_SECTION_READ;
+
+    image->Length = rva + DIVUP(size, PAGE_SIZE) * PAGE_SIZE;
+    image->Data   = realloc(image->Data, image->Length);
+    assert(image->Data != NULL);
+    memset(image->Data + rva, 0, image->Length - rva);
+
+    // The headers move with the buffer
+    image->Header    = (PeHeader_t*)(image->Data + 0x80);
+    image->OptHeader = (PeOptionalHeader64_t*)(image->Data + 0x80 + sizeof(PeHeader_t));
+    image->Sections  = (PeSectionHeader_t*)(image->Data + 0x80 + sizeof(PeHeader_t) + sizeof(PeOptionalHeader64_t));
+    return rva;
+}
+
+static void
+CreateImage(struct SyntheticImage* image, uint64_t base)
+{
+    MzHeader_t* dosHeader;
+
+    memset(image, 0, sizeof(struct SyntheticImage));
+    image->Length = PAGE_SIZE;
+    image->Data   = calloc(1, PAGE_SIZE);
+    image->Base   = base;
+    assert(image->Data != NULL);
+
+    dosHeader                  = (MzHeader_t*)image->Data;
+    dosHeader->Signature       = MZ_MAGIC;
+    dosHeader->PeHeaderAddress = 0x80;
+
+    image->Header                          = (PeHeader_t*)(image->Data + 0x80);
+    image->Header->Magic                   = PE_MAGIC;
+    image->Header->Machine                 = PE_CURRENT_MACHINE;
+    image->OptHeader                       = (PeOptionalHeader64_t*)(image->Data + 0x80 + sizeof(PeHeader_t));
+    image->OptHeader->Base.Architecture    = PE_ARCHITECTURE_64;
+    image->OptHeader->BaseAddress          = base;
+    image->OptHeader->SectionAlignment     = PAGE_SIZE;
+    image->OptHeader->FileAlignment        = PAGE_SIZE;
+    image->OptHeader->SizeOfHeaders        = HEADER_SIZE;
+    image->OptHeader->NumDataDirectories   = PE_NUM_DIRECTORIES;
+    image->Sections = (PeSectionHeader_t*)(image->Data + 0x80 + sizeof(PeHeader_t) + sizeof(PeOptionalHeader64_t));
+}
+
+// Fills a section with code-like bytes and an absolute pointer into the image every
+// POINTER_STEP bytes, which all need relocating when the image is loaded elsewhere
+static void
+FillSection(struct SyntheticImage* image, uint32_t rva, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        image->Data[rva + i] = (uint8_t)rand();
+    }
+    for (size_t i = 0; i < size; i += POINTER_STEP) {
+        *(uint64_t*)&image->Data[rva + i] = image->Base + 0x1000 + (i % 0x1000);
+    }
+}
+
+static void
+AddRelocations(struct SyntheticImage* image, uint32_t* rvas, size_t* sizes, int count)
+{
+    size_t   length = 0;
+    uint32_t rva;
+    uint8_t* block;
+
+    for (int i = 0; i < count; i++) {
+        length += (sizes[i] / PAGE_SIZE) * (8 + 2 * (PAGE_SIZE / POINTER_STEP));
+    }
+
+    rva   = AddSection(image, ".reloc", length, PE_SECTION_DATA | PE_SECTION_DISCARDABLE);
+    block = image->Data + rva;
+    for (int i = 0; i < count; i++) {
+        for (size_t page = 0; page < sizes[i]; page += PAGE_SIZE) {
+            uint32_t* blockHeader = (uint32_t*)block;
+            uint16_t* entries     = (uint16_t*)&blockHeader[2];
+
+            blockHeader[0] = rvas[i] + (uint32_t)page;
+            blockHeader[1] = 8 + 2 * (PAGE_SIZE / POINTER_STEP);
+            for (int j = 0; j < PAGE_SIZE / POINTER_STEP; j++) {
+                entries[j] = (uint16_t)((PE_RELOCATION_RELATIVE64 << 12) | (j * POINTER_STEP));
+            }
+            block += blockHeader[1];
+        }
+    }
+    image->OptHeader->Directories[PE_SECTION_BASE_RELOCATION].AddressRVA = rva;
+    image->OptHeader->Directories[PE_SECTION_BASE_RELOCATION].Size       = (uint32_t)length;
+}
+
+static void
+FinishImage(struct SyntheticImage* image, struct SyntheticFile* file, const char* path, long id)
+{
+    MzHeader_t* dosHeader = (MzHeader_t*)image->Data;
+    size_t      checksumOffset = dosHeader->PeHeaderAddress + sizeof(PeHeader_t) +
+        offsetof(PeOptionalHeader64_t, ImageChecksum);
+
+    image->OptHeader->SizeOfImage   = (uint32_t)image->Length;
+    image->OptHeader->ImageChecksum = PeCalculateChecksum(image->Data, image->Length, checksumOffset);
+
+    file->Path   = path;
+    file->Data   = image->Data;
+    file->Length = image->Length;
+    file->Id     = id;
+}
+
+static void
+BuildLibrary(void)
+{
+    struct SyntheticImage image;
+    PeExportDirectory_t*  exports;
+    uint32_t              rvas[2];
+    size_t                sizes[2] = { 0x40000, 0x4000 };
+    uint32_t              rdata;
+    uint32_t*             functions;
+    uint32_t*             names;
+    uint16_t*             ordinals;
+    char*                 nameBuffer;
+
+    CreateImage(&image, LIBRARY_BASE);
+    image.Header->Attributes = PE_ATTRIBUTE_DLL;
+
+    rvas[0] = AddSection(&image, ".text", sizes[0], PE_SECTION_CODE | PE_SECTION_EXECUTE);
+    FillSection(&image, rvas[0], sizes[0]);
+
+    rdata      = AddSection(&image, ".rdata", 0x10000, PE_SECTION_DATA);
+    exports    = (PeExportDirectory_t*)(image.Data + rdata);
+    functions  = (uint32_t*)(image.Data + rdata + sizeof(PeExportDirectory_t));
+    names      = functions + EXPORTS;
+    ordinals   = (uint16_t*)(names + EXPORTS);
+    nameBuffer = (char*)(ordinals + EXPORTS);
+
+    exports->OrdinalBase        = 1;
+    exports->NumberOfFunctions  = EXPORTS;
+    exports->NumberOfNames      = EXPORTS;
+    exports->AddressOfFunctions = (uint32_t)((uint8_t*)functions - image.Data);
+    exports->AddressOfNames     = (uint32_t)((uint8_t*)names - image.Data);
+    exports->AddressOfOrdinals  = (uint32_t)((uint8_t*)ordinals - image.Data);
+    for (int i = 0; i < EXPORTS; i++) {
+        functions[i] = rvas[0] + 8 + (uint32_t)i * 16;
+        ordinals[i]  = (uint16_t)(i + 1);
+        names[i]     = (uint32_t)((uint8_t*)nameBuffer - image.Data);
+        nameBuffer  += sprintf(nameBuffer, "library_function_%i", i) + 1;
+    }
+    image.OptHeader->Directories[PE_SECTION_EXPORT].AddressRVA = rdata;
+    image.OptHeader->Directories[PE_SECTION_EXPORT].Size       = (uint32_t)((uint8_t*)nameBuffer - (image.Data + rdata));
+
+    rvas[1] = AddSection(&image, ".data", sizes[1], PE_SECTION_DATA | PE_SECTION_WRITE);
+    FillSection(&image, rvas[1], sizes[1]);
+
+    AddRelocations(&image, rvas, sizes, 2);
+    FinishImage(&image, &g_files[1], "/bin/lib.dll", 2);
+}
+
+static void
+BuildApplication(void)
+{
+    struct SyntheticImage image;
+    PeImportDescriptor_t* descriptor;
+    uint32_t              rvas[1];
+    size_t                sizes[1] = { 0x10000 };
+    uint32_t              idata;
+    uint64_t*             iat;
+    uint8_t*              names;
+
+    CreateImage(&image, APP_BASE);
+    rvas[0] = AddSection(&image, ".text", sizes[0], PE_SECTION_CODE | PE_SECTION_EXECUTE);
+    FillSection(&image, rvas[0], sizes[0]);
+    image.OptHeader->Base.EntryPoint = rvas[0];
+
+    // The import descriptors, address table and names live in one writable section
+    idata      = AddSection(&image, ".idata", 0x4000, PE_SECTION_DATA | PE_SECTION_WRITE);
+    descriptor = (PeImportDescriptor_t*)(image.Data + idata);
+    iat        = (uint64_t*)(image.Data + idata + 0x100);
+    names      = (uint8_t*)(iat + IMPORTS + 1);
+
+    descriptor->ImportAddressTable = idata + 0x100;
+    descriptor->ModuleName         = (uint32_t)(names - image.Data);
+    names += sprintf((char*)names, "lib.dll") + 1;
+    for (int i = 0; i < IMPORTS; i++) {
+        int                       function = (i * 7) % EXPORTS;
+        PeImportNameDescriptor_t* name     = (PeImportNameDescriptor_t*)names;
+
+        iat[i]            = (uint64_t)(names - image.Data);
+        name->OrdinalHint = (uint16_t)function;
+        names += sizeof(uint16_t) + sprintf((char*)&name->Name[0], "library_function_%i", function) + 1;
+    }
+    image.OptHeader->Directories[PE_SECTION_IMPORT].AddressRVA = idata;
+    image.OptHeader->Directories[PE_SECTION_IMPORT].Size       = 2 * sizeof(PeImportDescriptor_t);
+
+    AddRelocations(&image, rvas, sizes, 1);
+    FinishImage(&image, &g_files[0], "/bin/app.exe", 1);
+}
+
+struct Instance {
+    PeExecutable_t*    Image;
+    struct ImageSpace* Space;
+};
+
+// The process must see the same memory whether the image came from the cache or not
+static int
+VerifyInstance(struct Instance* instance)
+{
+    PeExecutable_t* library;
+    uint64_t*       pointer;
+    uint64_t*       iat;
+
+    CHECK(TEST_NAME, instance->Image->Libraries->count == 1, "library was not loaded");
+    library = instance->Image->Libraries->head->value;
+
+    for (uint32_t offset = 0; offset < 0x40000; offset += 0x1040) {
+        pointer = ReadImage(instance->Space, library->VirtualAddress + 0x1000 + offset);
+        CHECK(TEST_NAME, pointer && *pointer == library->VirtualAddress + 0x1000 + (offset % 0x1000),
+              "library pointer at 0x%x was not relocated", offset);
+    }
+
+    iat = ReadImage(instance->Space, instance->Image->VirtualAddress + 0x11100);
+    CHECK(TEST_NAME, iat != NULL, "import address table is not mapped");
+    for (int i = 0; i < IMPORTS; i++) {
+        CHECK(TEST_NAME, iat[i] == library->VirtualAddress + 0x1000 + 8 + ((i * 7) % EXPORTS) * 16,
+              "import %i is bound to 0x%" PRIx64, i, iat[i]);
+    }
+    return 0;
+}
+
+static int
+SpawnInstances(const char* name, struct Instance* instances)
+{
+    size_t   privatePages = 0;
+    size_t   sharedPages  = 0;
+    int      fileReads    = g_fileReads;
+    uint64_t start;
+    uint64_t elapsed = 0;
+
+    for (int i = 0; i < INSTANCES; i++) {
+        MString_t* path = MStringCreate("app.exe", StrUTF8);
+
+        start = NowNs();
+        CHECK(TEST_NAME, PeLoadImage(1, NULL, path, &instances[i].Image) == OsSuccess, "spawn %i failed", i);
+        elapsed += NowNs() - start;
+
+        MStringDestroy(path);
+        instances[i].Space = g_lastSpace;
+        if (VerifyInstance(&instances[i])) {
+            return -1;
+        }
+        privatePages += instances[i].Space->PrivatePages;
+        sharedPages  += instances[i].Space->SharedPages;
+    }
+
+    printf("%-8s %i instances: %8.1f us per spawn, %3i file reads, %5zu private pages, %5zu shared pages\n",
+           name, INSTANCES, (double)elapsed / INSTANCES / 1000.0, g_fileReads - fileReads,
+           privatePages, sharedPages);
+    return 0;
+}
+
+static void
+ExitInstances(struct Instance* instances)
+{
+    for (int i = 0; i < INSTANCES; i++) {
+        PeUnloadLibrary(NULL, instances[i].Image);
+        DestroyImageSpace(instances[i].Space);
+    }
+}
+
+static int
+test_cache(void)
+{
+    struct Instance          instances[INSTANCES];
+    OsImageCacheStatistics_t statistics;
+    size_t                   uncachedPages = 0;
+    size_t                   cachedPages   = 0;
+    int                      fileReads;
+
+    g_cacheEnabled = 0;
+    if (SpawnInstances("uncached", instances)) {
+        return -1;
+    }
+    for (int i = 0; i < INSTANCES; i++) {
+        uncachedPages += instances[i].Space->PrivatePages;
+    }
+    ExitInstances(instances);
+    CHECK(TEST_NAME, g_images.element_count == 0, "images were cached while disabled");
+
+    // Only the first instance reads the files, the rest share the snapshots
+    g_cacheEnabled = 1;
+    fileReads      = g_fileReads;
+    if (SpawnInstances("cached", instances)) {
+        return -1;
+    }
+    for (int i = 0; i < INSTANCES; i++) {
+        cachedPages += instances[i].Space->PrivatePages;
+    }
+    CHECK(TEST_NAME, g_fileReads - fileReads == FILE_COUNT, "files were read %i times", g_fileReads - fileReads);
+    CHECK(TEST_NAME, cachedPages * 4 < uncachedPages, "%zu private pages with sharing, %zu without", cachedPages, uncachedPages);
+
+    ImageCacheGetStatistics(&statistics);
+    printf("cache: %zu images, %zu mappings, %zu KB shared per image set, %zu KB saved, %zu KB of snapshots\n",
+           statistics.Images, statistics.Mappings, statistics.SharedBytes / 1024, statistics.SavedBytes / 1024,
+           g_snapshotBytes / 1024);
+    CHECK(TEST_NAME, statistics.Images == FILE_COUNT && statistics.Mappings == (INSTANCES - 1) * FILE_COUNT,
+          "statistics are wrong");
+    CHECK(TEST_NAME, statistics.Hits == (INSTANCES - 1) * FILE_COUNT, "%" PRIu64 " hits", statistics.Hits);
+
+    // A library that is replaced on disk is read again, and the old snapshot
+    // stays alive until the processes that map it are gone
+    g_files[1].ModifiedAt.tv_sec++;
+    fileReads = g_fileReads;
+    {
+        struct Instance instance;
+        MString_t*      path = MStringCreate("app.exe", StrUTF8);
+        CHECK(TEST_NAME, PeLoadImage(1, NULL, path, &instance.Image) == OsSuccess, "spawn after update failed");
+        MStringDestroy(path);
+        instance.Space = g_lastSpace;
+        CHECK(TEST_NAME, VerifyInstance(&instance) == 0 && g_fileReads - fileReads == 1,
+              "updated library was not read again");
+        PeUnloadLibrary(NULL, instance.Image);
+        DestroyImageSpace(instance.Space);
+    }
+    ExitInstances(instances);
+
+    ImageCacheGetStatistics(&statistics);
+    CHECK(TEST_NAME, statistics.Images == FILE_COUNT && statistics.Mappings == 0, "images are still mapped after exit");
+    return 0;
+}
+
+// Drops the snapshots nothing uses anymore
+static void
+FlushCache(void)
+{
+    struct ImageTrimContext context = { .Count = 0 };
+    hashtable_enumerate(&g_images, __CollectUnused, &context);
+    for (int i = 0; i < context.Count; i++) {
+        __RemoveEntry(context.Unused[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    srand(1);
+    ImageCacheInitialize();
+    BuildApplication();
+    BuildLibrary();
+
+    if (test_cache()) {
+        return -1;
+    }
+
+    FlushCache();
+    CHECK(TEST_NAME, g_images.element_count == 0 && g_snapshotBytes == 0, "snapshots were not freed");
+    hashtable_destroy(&g_images);
+    for (int i = 0; i < FILE_COUNT; i++) {
+        free(g_files[i].Data);
+    }
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}
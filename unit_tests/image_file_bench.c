@@ -0,0 +1,540 @@
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define StrUTF8            0
+#define MSTRING_NO_MATCH   0
+#define MSTRING_FULL_MATCH 1
+
+#define DECL_STRUCT(Type) typedef struct Type Type##_t
+#define PACKED_TYPESTRUCT(Name, Body) typedef struct __attribute__((packed)) Name Body Name##_t
+#define ISINRANGE(x, lo, hi) (((x) >= (lo)) && ((x) < (hi)))
+#define DIVUP(a, b)          ((a / b) + (((a % b) > 0) ? 1 : 0))
+#define _CRT_UNUSED(x)       (void)(x)
+
+#define MEMORY_COMMIT     0x1
+#define MEMORY_READ       0x2
+#define MEMORY_WRITE      0x4
+#define MEMORY_EXECUTABLE 0x8
+
+#define FILE_MAPPING_READ 0x1
+
+#define PAGE_SIZE 0x1000
+
+typedef void* Handle_t;
+
+typedef union LargeUInteger {
+    uint64_t QuadPart;
+} LargeUInteger_t;
+
+typedef struct {
+    long            Id;
+    long            StorageId;
+    unsigned int    Flags;
+    unsigned int    Permissions;
+    LargeUInteger_t Size;
+    struct timespec CreatedAt;
+    struct timespec ModifiedAt;
+    struct timespec AccessedAt;
+} OsFileDescriptor_t;
+
+// Skip the process manager header, the image file tracking declares what it exports
+#define __PROCESS_INTERFACE__
+#define ENTRY(...)
+#define EXIT(...)
+
+// The loader only needs a handful of string operations
+typedef struct MString {
+    char*  Data;
+    size_t Length;
+} MString_t;
+
+static MString_t*
+MStringCreate(const char* data, int type)
+{
+    MString_t* string = malloc(sizeof(MString_t));
+    assert(string != NULL);
+    string->Length = strlen(data);
+    string->Data   = strdup(data);
+    assert(string->Data != NULL);
+    return string;
+}
+
+static void        MStringDestroy(MString_t* string) { if (string) { free(string->Data); free(string); } }
+static const char* MStringRaw(MString_t* string) { return string ? string->Data : NULL; }
+
+static MString_t*
+MStringSubString(MString_t* string, int index, int length)
+{
+    MString_t* sub = MStringCreate(string->Data + index, StrUTF8);
+    if (length >= 0 && (size_t)length < sub->Length) {
+        sub->Data[length] = '\0';
+        sub->Length       = length;
+    }
+    return sub;
+}
+
+static int
+MStringFindReverse(MString_t* string, int character, int startIndex)
+{
+    char* found = strrchr(string->Data, character);
+    return found ? (int)(found - string->Data) : -1;
+}
+
+static int
+MStringCompare(MString_t* first, MString_t* second, int ignoreCase)
+{
+    return (ignoreCase ? strcasecmp(first->Data, second->Data) : strcmp(first->Data, second->Data)) ?
+        MSTRING_NO_MATCH : MSTRING_FULL_MATCH;
+}
+
+void* dsalloc(size_t size) { return malloc(size); }
+void  dsfree(void* pointer) { free(pointer); }
+void  dswarning(const char* fmt, ...) { }
+void  dserror(const char* fmt, ...) { }
+
+#include "../librt/libds/pe/pe.h"
+
+// The image file on disk, the loader resolves every path to it
+static char g_path[64];
+
+uintptr_t  GetPageSize(void) { return PAGE_SIZE; }
+uintptr_t  GetBaseAddress(void) { return 0x400000; }
+clock_t    GetTimestamp(void) { return clock(); }
+
+OsStatus_t
+ResolveFilePath(UUId_t owner, MString_t* path, MString_t** fullPath)
+{
+    *fullPath = MStringCreate(&g_path[0], StrUTF8);
+    return OsSuccess;
+}
+
+OsStatus_t
+GetFileInformationFromFd(int fd, OsFileDescriptor_t* information)
+{
+    struct stat status;
+    if (fstat(fd, &status)) {
+        return OsError;
+    }
+
+    memset(information, 0, sizeof(OsFileDescriptor_t));
+    information->Id            = (long)status.st_ino;
+    information->StorageId     = (long)status.st_dev;
+    information->Size.QuadPart = (uint64_t)status.st_size;
+    information->ModifiedAt    = status.st_mtim;
+    return OsSuccess;
+}
+
+// File mappings are trap buffers, every page is read from the file with a request
+// to the file manager the first time it is touched, as the memory event handler does
+struct FileMapping {
+    uint8_t* Memory;
+    size_t   Length;
+    int      Fd;
+};
+
+#define MAX_FILE_MAPPINGS 4
+
+static struct FileMapping g_fileMappings[MAX_FILE_MAPPINGS];
+static volatile size_t    g_pageReads;
+static int                g_mappingEnabled;
+
+static void
+HandleMappingFault(int signal, siginfo_t* info, void* context)
+{
+    uint8_t* address = info->si_addr;
+
+    for (int i = 0; i < MAX_FILE_MAPPINGS; i++) {
+        struct FileMapping* mapping = &g_fileMappings[i];
+        if (mapping->Memory && address >= mapping->Memory && address < mapping->Memory + mapping->Length) {
+            uint8_t* page = mapping->Memory + ((size_t)(address - mapping->Memory) & ~(size_t)(PAGE_SIZE - 1));
+            mprotect(page, PAGE_SIZE, PROT_READ | PROT_WRITE);
+            if (pread(mapping->Fd, page, PAGE_SIZE, page - mapping->Memory) < 0) {
+                _exit(-1);
+            }
+            mprotect(page, PAGE_SIZE, PROT_READ);
+            g_pageReads++;
+            return;
+        }
+    }
+    _exit(-1);
+}
+
+OsStatus_t
+CreateFileMapping(int fd, int flags, uint64_t offset, size_t length, void** memoryOut)
+{
+    size_t pageLength = DIVUP(length, PAGE_SIZE) * PAGE_SIZE;
+
+    if (!g_mappingEnabled) {
+        return OsNotSupported;
+    }
+
+    for (int i = 0; i < MAX_FILE_MAPPINGS; i++) {
+        if (!g_fileMappings[i].Memory) {
+            void* memory = mmap(NULL, pageLength, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) {
+                return OsOutOfMemory;
+            }
+            g_fileMappings[i].Memory = memory;
+            g_fileMappings[i].Length = pageLength;
+            g_fileMappings[i].Fd     = fd;
+            *memoryOut = memory;
+            return OsSuccess;
+        }
+    }
+    return OsOutOfMemory;
+}
+
+OsStatus_t
+DestroyFileMapping(void* memory)
+{
+    for (int i = 0; i < MAX_FILE_MAPPINGS; i++) {
+        if (g_fileMappings[i].Memory == memory) {
+            munmap(memory, g_fileMappings[i].Length);
+            g_fileMappings[i].Memory = NULL;
+            return OsSuccess;
+        }
+    }
+    return OsDoesNotExist;
+}
+
+// The memory space of the process, the sections are private pages of its own
+#define MAX_MAPPINGS 8
+
+struct Mapping {
+    uintptr_t Address;
+    uint8_t*  Memory;
+    size_t    Length;
+};
+
+struct ImageSpace {
+    struct Mapping Mappings[MAX_MAPPINGS];
+    int            Count;
+};
+
+static struct ImageSpace* g_lastSpace;
+
+OsStatus_t
+CreateImageSpace(MemorySpaceHandle_t* handle)
+{
+    g_lastSpace = calloc(1, sizeof(struct ImageSpace));
+    assert(g_lastSpace != NULL);
+    *handle = g_lastSpace;
+    return OsSuccess;
+}
+
+OsStatus_t
+AcquireImageMapping(MemorySpaceHandle_t handle, uintptr_t* address, size_t length,
+                    unsigned int flags, MemoryMapHandle_t* handleOut)
+{
+    struct ImageSpace* space      = handle;
+    size_t             pageLength = DIVUP(length, PAGE_SIZE) * PAGE_SIZE;
+    struct Mapping*    mapping;
+
+    assert(space->Count < MAX_MAPPINGS);
+    mapping          = &space->Mappings[space->Count++];
+    mapping->Address = *address;
+    mapping->Memory  = aligned_alloc(PAGE_SIZE, pageLength);
+    mapping->Length  = length;
+    assert(mapping->Memory != NULL);
+    memset(mapping->Memory, 0, pageLength);
+
+    *handleOut = mapping;
+    *address   = (uintptr_t)mapping->Memory;
+    return OsSuccess;
+}
+
+void ReleaseImageMapping(MemoryMapHandle_t handle) { }
+
+static void
+DestroyImageSpace(struct ImageSpace* space)
+{
+    for (int i = 0; i < space->Count; i++) {
+        free(space->Mappings[i].Memory);
+    }
+    free(space);
+}
+
+static void*
+ReadImage(struct ImageSpace* space, uintptr_t address)
+{
+    for (int i = 0; i < space->Count; i++) {
+        struct Mapping* mapping = &space->Mappings[i];
+        if (address >= mapping->Address && address < mapping->Address + mapping->Length) {
+            return mapping->Memory + (address - mapping->Address);
+        }
+    }
+    return NULL;
+}
+
+// Every load is a fresh load, the image cache is measured on its own
+OsStatus_t ShareImageMapping(MemorySpaceHandle_t space, void* source, uintptr_t address, size_t length,
+                             unsigned int flags) { return OsNotSupported; }
+PeImageCache_t* AcquireImageCache(MString_t* path, uintptr_t base) { return NULL; }
+OsStatus_t CreateImageCache(MString_t* path, uintptr_t base, size_t length, int sectionCount,
+                            PeImageCache_t** cacheOut) { return OsNotSupported; }
+void       PublishImageCache(PeImageCache_t* cache) { }
+void       ReleaseImageCache(PeImageCache_t* cache) { }
+
+#include "../librt/libds/hashtable.c"
+#include "../librt/libds/pe/load.c"
+#include "../librt/libds/pe/utilities.c"
+#include "../librt/libds/pe/verify.c"
+
+#undef TRACE
+#define TRACE(...)
+#include "../services/processmanager/image_file.c"
+
+#define ITERATIONS  20
+#define CODE_SIZE   0x200000
+#define DATA_SIZE   0x10000
+#define DEBUG_SIZE  (18 * 1024 * 1024)
+#define HEADER_SIZE 0x400
+
+#define TEST_NAME "image_file_bench"
+
+static uint8_t* g_image;
+static size_t   g_imageLength;
+static uint32_t g_checksumOffset;
+
+// A 20MB executable the way toolchains leave it with symbols, the code and data are
+// followed by debug information that is part of the file but never loaded
+static void
+BuildImage(void)
+{
+    MzHeader_t*           dosHeader;
+    PeHeader_t*           header;
+    PeOptionalHeader64_t* optHeader;
+    PeSectionHeader_t*    sections;
+    uint32_t              dataRva = PAGE_SIZE + CODE_SIZE;
+
+    g_imageLength = dataRva + DATA_SIZE + DEBUG_SIZE;
+    g_image       = calloc(1, g_imageLength);
+    assert(g_image != NULL);
+
+    dosHeader                  = (MzHeader_t*)g_image;
+    dosHeader->Signature       = MZ_MAGIC;
+    dosHeader->PeHeaderAddress = 0x80;
+
+    header                    = (PeHeader_t*)(g_image + 0x80);
+    header->Magic             = PE_MAGIC;
+    header->Machine           = PE_CURRENT_MACHINE;
+    header->NumSections       = 2;
+    header->SymbolTableOffset = dataRva + DATA_SIZE;
+
+    optHeader                     = (PeOptionalHeader64_t*)(g_image + 0x80 + sizeof(PeHeader_t));
+    optHeader->Base.Architecture  = PE_ARCHITECTURE_64;
+    optHeader->Base.EntryPoint    = PAGE_SIZE;
+    optHeader->BaseAddress        = GetBaseAddress();
+    optHeader->SectionAlignment   = PAGE_SIZE;
+    optHeader->FileAlignment      = PAGE_SIZE;
+    optHeader->SizeOfHeaders      = HEADER_SIZE;
+    optHeader->SizeOfImage        = dataRva + DATA_SIZE;
+    optHeader->NumDataDirectories = PE_NUM_DIRECTORIES;
+
+    sections = (PeSectionHeader_t*)(g_image + 0x80 + sizeof(PeHeader_t) + sizeof(PeOptionalHeader64_t));
+    memcpy(&sections[0].Name[0], ".text", 5);
+    sections[0].VirtualAddress = PAGE_SIZE;
+    sections[0].VirtualSize    = CODE_SIZE;
+    sections[0].RawAddress     = PAGE_SIZE;
+    sections[0].RawSize        = CODE_SIZE;
+    sections[0].Flags          = PE_SECTION_CODE | PE_SECTION_EXECUTE | PE_SECTION_READ;
+
+    memcpy(&sections[1].Name[0], ".data", 5);
+    sections[1].VirtualAddress = dataRva;
+    sections[1].VirtualSize    = DATA_SIZE;
+    sections[1].RawAddress     = dataRva;
+    sections[1].RawSize        = DATA_SIZE;
+    sections[1].Flags          = PE_SECTION_DATA | PE_SECTION_READ | PE_SECTION_WRITE;
+
+    for (size_t i = PAGE_SIZE; i < g_imageLength; i++) {
+        g_image[i] = (uint8_t)rand();
+    }
+
+    g_checksumOffset = dosHeader->PeHeaderAddress + sizeof(PeHeader_t) + offsetof(PeOptionalHeader64_t, ImageChecksum);
+    optHeader->ImageChecksum = PeCalculateChecksum(g_image, g_imageLength, g_checksumOffset);
+}
+
+// Rewrites the file, and gives it a new modification time like an update would
+static int
+WriteImage(time_t modifiedAt)
+{
+    struct timespec times[2] = { { modifiedAt, 0 }, { modifiedAt, 0 } };
+    int             fd       = open(&g_path[0], O_WRONLY | O_TRUNC);
+
+    CHECK(TEST_NAME, fd >= 0, "failed to open %s: %i", &g_path[0], errno);
+    CHECK(TEST_NAME, write(fd, g_image, g_imageLength) == (ssize_t)g_imageLength, "failed to write image");
+    CHECK(TEST_NAME, futimens(fd, &times[0]) == 0, "failed to set the modification time");
+    close(fd);
+    return 0;
+}
+
+static void
+ForgetVerifiedFiles(void)
+{
+    hashtable_destroy(&g_openFiles);
+    hashtable_destroy(&g_verifiedFiles);
+    ImageFileInitialize();
+}
+
+static OsStatus_t
+LoadImage(PeExecutable_t** imageOut, struct ImageSpace** spaceOut)
+{
+    MString_t* path = MStringCreate("app.exe", StrUTF8);
+    OsStatus_t status;
+
+    g_lastSpace = NULL;
+    status      = PeLoadImage(1, NULL, path, imageOut);
+    MStringDestroy(path);
+    *spaceOut = g_lastSpace;
+    return status;
+}
+
+static void
+UnloadImage(PeExecutable_t* image, struct ImageSpace* space)
+{
+    PeUnloadLibrary(NULL, image);
+    DestroyImageSpace(space);
+}
+
+// The process must see the same memory however the file was read
+static int
+VerifyImage(PeExecutable_t* image, struct ImageSpace* space)
+{
+    uint8_t* code = ReadImage(space, image->VirtualAddress + PAGE_SIZE);
+    uint8_t* data = ReadImage(space, image->VirtualAddress + PAGE_SIZE + CODE_SIZE);
+
+    CHECK(TEST_NAME, image->EntryAddress == image->VirtualAddress + PAGE_SIZE, "entry point is wrong");
+    CHECK(TEST_NAME, code && !memcmp(code, g_image + PAGE_SIZE, CODE_SIZE), "code differs from the file");
+    CHECK(TEST_NAME, data && !memcmp(data, g_image + PAGE_SIZE + CODE_SIZE, DATA_SIZE), "data differs from the file");
+    CHECK(TEST_NAME, g_openFiles.element_count == 0, "file was left open after loading");
+    return 0;
+}
+
+static int
+BenchLoads(const char* name, int mapped, int verified, double* usOut)
+{
+    PeExecutable_t*    image;
+    struct ImageSpace* space;
+    size_t             pageReads = 0;
+    uint64_t           elapsed   = 0;
+    uint64_t           start;
+
+    g_mappingEnabled = mapped;
+    for (int i = 0; i < ITERATIONS; i++) {
+        if (!verified) {
+            ForgetVerifiedFiles();
+        }
+
+        g_pageReads = 0;
+        start       = NowNs();
+        CHECK(TEST_NAME, LoadImage(&image, &space) == OsSuccess, "%s load %i failed", name, i);
+        elapsed += NowNs() - start;
+
+        pageReads += g_pageReads;
+        if (VerifyImage(image, space)) {
+            return -1;
+        }
+        UnloadImage(image, space);
+    }
+
+    *usOut = (double)elapsed / ITERATIONS / 1000.0;
+    printf("%-17s %zu KB image: %8.1f us to entry, %5zu pages read from the file\n", name,
+           g_imageLength / 1024, *usOut, mapped ? pageReads / ITERATIONS : g_imageLength / PAGE_SIZE);
+    if (mapped && verified) {
+        CHECK(TEST_NAME, pageReads / ITERATIONS < (g_imageLength / PAGE_SIZE) / 4,
+              "%zu pages were read from a verified file", pageReads / ITERATIONS);
+    }
+    return 0;
+}
+
+static int
+test_verification(void)
+{
+    PeExecutable_t*    image;
+    struct ImageSpace* space;
+
+    g_mappingEnabled = 1;
+    ForgetVerifiedFiles();
+
+    // The first load of a file checksums it, later loads of the same version do not
+    g_pageReads = 0;
+    CHECK(TEST_NAME, LoadImage(&image, &space) == OsSuccess && VerifyImage(image, space) == 0, "first load failed");
+    UnloadImage(image, space);
+    CHECK(TEST_NAME, g_pageReads == g_imageLength / PAGE_SIZE, "%zu pages were read to verify the file", g_pageReads);
+    CHECK(TEST_NAME, g_verifiedFiles.element_count == 1, "file was not marked verified");
+
+    g_pageReads = 0;
+    CHECK(TEST_NAME, LoadImage(&image, &space) == OsSuccess && VerifyImage(image, space) == 0, "second load failed");
+    UnloadImage(image, space);
+    CHECK(TEST_NAME, g_pageReads < g_imageLength / PAGE_SIZE, "verified file was read in full");
+
+    // A file that changed is checksummed again, and a corrupt file is refused
+    g_image[g_imageLength - 1] ^= 0xFF;
+    if (WriteImage(2000)) {
+        return -1;
+    }
+    CHECK(TEST_NAME, LoadImage(&image, &space) != OsSuccess, "corrupt file was loaded");
+    if (space) {
+        DestroyImageSpace(space);
+    }
+    CHECK(TEST_NAME, g_openFiles.element_count == 0, "corrupt file was left open");
+
+    g_image[g_imageLength - 1] ^= 0xFF;
+    if (WriteImage(3000)) {
+        return -1;
+    }
+    CHECK(TEST_NAME, LoadImage(&image, &space) == OsSuccess && VerifyImage(image, space) == 0, "restored file failed");
+    UnloadImage(image, space);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction action = { 0 };
+    double           readChecksum;
+    double           mappedChecksum;
+    double           mappedVerified;
+    int              fd;
+
+    action.sa_sigaction = HandleMappingFault;
+    action.sa_flags     = SA_SIGINFO | SA_NODEFER;
+    sigaction(SIGSEGV, &action, NULL);
+    sigaction(SIGBUS, &action, NULL);
+
+    srand(1);
+    BuildImage();
+    snprintf(&g_path[0], sizeof(g_path), "/tmp/image_file_bench_XXXXXX");
+    fd = mkstemp(&g_path[0]);
+    CHECK(TEST_NAME, fd >= 0, "failed to create image file: %i", errno);
+    close(fd);
+    if (WriteImage(1000)) {
+        return -1;
+    }
+
+    ImageFileInitialize();
+    if (test_verification() ||
+        BenchLoads("read + checksum", 0, 0, &readChecksum) ||
+        BenchLoads("mapped + checksum", 1, 0, &mappedChecksum) ||
+        BenchLoads("mapped + verified", 1, 1, &mappedVerified)) {
+        unlink(&g_path[0]);
+        return -1;
+    }
+    CHECK(TEST_NAME, mappedVerified < readChecksum, "verified image was slower to load than reading it");
+
+    unlink(&g_path[0]);
+    hashtable_destroy(&g_openFiles);
+    hashtable_destroy(&g_verifiedFiles);
+    free(g_image);
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}
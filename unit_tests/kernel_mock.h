@@ -0,0 +1,164 @@
+/**
+ * Kernel definitions for the unit test environment. Used together with
+ * the headers in kernel_stubs to compile kernel sources on the host.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "common.h"
+
+#undef TRACE
+#define TRACE(...)
+#undef WARNING
+#define WARNING(...)
+
+#define OsExists            (int)3
+#define OsDoesNotExist      (int)4
+#define OsInvalidParameters (int)5
+#define OsTimeout           (int)6
+#define OsInterrupted       (int)7
+#define OsNotSupported      (int)8
+#define OsBusy              (int)9
+
+#define KERNELAPI
+#define KERNELABI
+
+#define __MASK                  (~(size_t)0)
+#define SIZEOF_ARRAY(Array)     (sizeof(Array) / sizeof((Array)[0]))
+#define WRITE_VOLATILE(x, v)    (*(volatile __typeof__(x)*)&(x) = (v))
+#define READ_VOLATILE(x)        (*(volatile __typeof__(x)*)&(x))
+#define smp_mb()                atomic_thread_fence(memory_order_seq_cst)
+#define smp_rmb()               atomic_thread_fence(memory_order_acquire)
+#define smp_wmb()               atomic_thread_fence(memory_order_release)
+
+#define FATAL_SCOPE_KERNEL 0
+#define FATAL(Scope, ...)  do { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); abort(); } while (0)
+
+// Tests that compile the kernel heap get the real allocator
+#ifndef KERNEL_MOCK_HEAP
+#define kmalloc(Size) malloc(Size)
+#define kfree(Memory) free(Memory)
+#endif
+
+typedef struct IrqSpinlock {
+    atomic_flag Value;
+} IrqSpinlock_t;
+
+static inline void IrqSpinlockConstruct(IrqSpinlock_t* Lock) { atomic_flag_clear(&Lock->Value); }
+static inline void IrqSpinlockAcquire(IrqSpinlock_t* Lock) { while (atomic_flag_test_and_set(&Lock->Value)); }
+static inline void IrqSpinlockRelease(IrqSpinlock_t* Lock) { atomic_flag_clear(&Lock->Value); }
+
+// Minimal list element compatible with <ds/list.h>
+typedef struct element {
+    struct element* next;
+    struct element* previous;
+    void*           key;
+    void*           value;
+} element_t;
+
+typedef struct list {
+    element_t* head;
+    element_t* tail;
+    int        count;
+} list_t;
+
+#define LIST_INIT               { NULL, NULL, 0 }
+#define LIST_ENUMERATE_CONTINUE (int)0x0
+#define LIST_ENUMERATE_STOP     (int)0x1
+#define LIST_ENUMERATE_REMOVE   (int)0x2
+
+#define _foreach(i, collection) for (i = (collection)->head; i != NULL; i = i->next)
+#define foreach(i, collection) element_t* i; _foreach(i, collection)
+
+#define ELEMENT_INIT(Element, Key, Value) do { \
+    (Element)->next = NULL; (Element)->previous = NULL; \
+    (Element)->key = (void*)(uintptr_t)(Key); (Element)->value = (void*)(Value); } while (0)
+
+static inline void
+list_construct(list_t* List)
+{
+    List->head  = NULL;
+    List->tail  = NULL;
+    List->count = 0;
+}
+
+static inline int
+list_count(list_t* List)
+{
+    return List->count;
+}
+
+static inline element_t*
+list_front(list_t* List)
+{
+    return List->head;
+}
+
+static inline void*
+list_find_value(list_t* List, void* Key)
+{
+    element_t* i;
+    _foreach(i, List) {
+        if (i->key == Key) {
+            return i->value;
+        }
+    }
+    return NULL;
+}
+
+static inline void
+list_append(list_t* List, element_t* Element)
+{
+    Element->next     = NULL;
+    Element->previous = List->tail;
+    if (List->tail) List->tail->next = Element;
+    else            List->head       = Element;
+    List->tail = Element;
+    List->count++;
+}
+
+static inline int
+list_remove(list_t* List, element_t* Element)
+{
+    if (Element->previous) Element->previous->next = Element->next;
+    else                   List->head              = Element->next;
+    if (Element->next)     Element->next->previous = Element->previous;
+    else                   List->tail              = Element->previous;
+    Element->next = Element->previous = NULL;
+    List->count--;
+    return 0;
+}
+
+static inline void
+list_enumerate(list_t* List, int (*Callback)(int, element_t*, void*), void* Context)
+{
+    element_t* i = List->head;
+    int        index = 0;
+    while (i != NULL) {
+        element_t* next   = i->next;
+        int        action = Callback(index++, i, Context);
+        if (action & LIST_ENUMERATE_REMOVE) {
+            list_remove(List, i);
+        }
+        if (action & LIST_ENUMERATE_STOP) {
+            break;
+        }
+        i = next;
+    }
+}
+
+static inline void
+list_clear(list_t* List, void (*Cleanup)(element_t*, void*), void* Context)
+{
+    element_t* i = List->head;
+    while (i != NULL) {
+        element_t* next = i->next;
+        Cleanup(i, Context);
+        i = next;
+    }
+    list_construct(List);
+}
+
@@ -0,0 +1,4 @@
+/**
+ * Kernel header stub for the unit test environment, the definitions
+ * are provided by the unit test that includes the kernel source.
+ */
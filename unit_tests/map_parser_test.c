@@ -3,29 +3,270 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "common.h"
+
+#undef TRACE
+#define TRACE(...)
+
 #include "../services/processmanager/map_parser.c"
+#include "../services/processmanager/symbol_index.c"
 
-// ./map_parser_test /home/philip/Source/vali-userspace/mesa/build/vali-amd64/gallium-osmesa.map
-int main(int argc, char **argv)
+#define SECTIONS   3
+#define SYMBOLS    20000
+#define ALIAS_STEP 50
+#define LOOKUPS    200000
+#define ITERATIONS 20
+
+#define TEST_NAME "map_parser_test"
+
+struct expected_symbol {
+    char      name[32];
+    uintptr_t address;
+};
+
+static struct expected_symbol g_expected[SYMBOLS];
+
+// Generates a map in the linker format, the sections are listed in reverse address
+// order and every ALIAS_STEP symbol shares the address of the symbol before it
+static char*
+GenerateMap(size_t* lengthOut)
 {
-    struct symbol_context* symbolContext;
-    FILE* file;
-    long  fileSize;
-    void* fileBuffer;
-    int   status;
+    static const char* sectionNames[SECTIONS] = { ".data", ".rdata", ".text" };
+    char*              map        = malloc((size_t)SYMBOLS * 128 + 4096);
+    size_t             length     = 0;
+    int                perSection = SYMBOLS / SECTIONS;
+    int                index      = 0;
+    int                section;
+
+    length += sprintf(&map[length], " Address  Size     Align Out     In      Symbol\n");
+    for (section = 0; section < SECTIONS; section++) {
+        uintptr_t base    = 0x1000 + (uintptr_t)(SECTIONS - 1 - section) * 0x100000;
+        int       count   = section == SECTIONS - 1 ? SYMBOLS - index : perSection;
+        uintptr_t address = base;
+        int       i;
+
+        length += sprintf(&map[length], "%08lx %08x  4096 %s\n", base, 0x100000, sectionNames[section]);
+        for (i = 0; i < count; i++, index++) {
+            if ((i % 16) == 0) {
+                length += sprintf(&map[length], "%08lx %08x    16         src/file%i.o:(%s)\n",
+                                  address, 0x400, index / 16, sectionNames[section]);
+            }
+
+            if (i && (index % ALIAS_STEP) == 0) {
+                address = g_expected[index - 1].address;
+            }
+
+            snprintf(&g_expected[index].name[0], sizeof(g_expected[index].name), "symbol_%i", index);
+            g_expected[index].address = address;
+            length += sprintf(&map[length], "%08lx %08x     0                 %s\n",
+                              address, 0x10, &g_expected[index].name[0]);
+            address += 0x10 + (index % 7) * 4;
+        }
+    }
+
+    *lengthOut = length;
+    return map;
+}
+
+// Reference lookup on the generated symbols in map file order
+static const char*
+ReferenceLookup(uintptr_t offset)
+{
+    const struct expected_symbol* best = NULL;
+    int                           i;
+
+    for (i = 0; i < SYMBOLS; i++) {
+        if (g_expected[i].address <= offset && (!best || g_expected[i].address >= best->address)) {
+            best = &g_expected[i];
+        }
+    }
+    return best ? &best->name[0] : NULL;
+}
+
+// Linear scan over the sorted symbols, used as the throughput baseline
+static struct map_symbol*
+LinearLookup(struct symbol_context* symbolContext, uintptr_t offset)
+{
+    int i;
+    for (i = 0; i < symbolContext->symbol_count; i++) {
+        if (i == (symbolContext->symbol_count - 1)) {
+            return &symbolContext->symbols[i];
+        }
+
+        if (offset >= symbolContext->symbols[i].address &&
+            offset <  symbolContext->symbols[i + 1].address) {
+            return &symbolContext->symbols[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+DestroyContext(struct symbol_context* symbolContext)
+{
+    free(symbolContext->section_storage);
+    free(symbolContext->file_storage);
+    free(symbolContext->symbol_storage);
+    free(symbolContext->symbols);
+    memset(symbolContext, 0, sizeof(struct symbol_context));
+}
+
+static uintptr_t
+ProbeAddress(int probe)
+{
+    // walk every symbol start and the bytes in between, plus the space outside the image
+    uintptr_t base = g_expected[probe % SYMBOLS].address;
+    return base + (uintptr_t)((probe / SYMBOLS) % 24) - 4;
+}
+
+static int
+test_lookup(struct symbol_context* symbolContext)
+{
+    struct map_symbol* symbol;
+    int                i;
+
+    for (i = 1; i < symbolContext->symbol_count; i++) {
+        CHECK(TEST_NAME, symbolContext->symbols[i - 1].address <= symbolContext->symbols[i].address,
+              "symbols %i and %i are not sorted", i - 1, i);
+    }
+
+    for (i = 0; i < SYMBOLS * 24; i += 31) {
+        uintptr_t   offset   = ProbeAddress(i);
+        const char* expected = ReferenceLookup(offset);
+
+        symbol = SymbolContextFind(symbolContext, offset);
+        CHECK(TEST_NAME, (symbol == NULL) == (expected == NULL), "offset 0x%lx resolved to %s, expected %s",
+              offset, symbol ? symbol->name : "<none>", expected ? expected : "<none>");
+        if (symbol) {
+            CHECK(TEST_NAME, !strcmp(symbol->name, expected), "offset 0x%lx resolved to %s, expected %s",
+                  offset, symbol->name, expected);
+            CHECK(TEST_NAME, symbol->address <= offset, "offset 0x%lx resolved past the symbol", offset);
+        }
+    }
+
+    CHECK(TEST_NAME, SymbolContextFind(symbolContext, 0) == NULL, "offset before the first symbol resolved");
+    symbol = SymbolContextFind(symbolContext, ~(uintptr_t)0);
+    CHECK(TEST_NAME, symbol == &symbolContext->symbols[symbolContext->symbol_count - 1], "last symbol does not cover the image end");
+    return 0;
+}
 
-    if (argc < 2) {
-        fprintf(stderr, "map_parser_test: invalid number of arguments, %i\n", argc);
+static int
+test_index(struct symbol_context* symbolContext)
+{
+    struct symbol_context       indexContext = { 0 };
+    struct symbol_index_header* header;
+    struct symbol_index_entry*  entries;
+    void*                       index;
+    size_t                      indexLength;
+    uint64_t                    address;
+    uint32_t                    nameOffset;
+    int                         i;
+
+    CHECK(TEST_NAME, SymbolBuildIndex(symbolContext, &index, &indexLength) == OsSuccess, "failed to build index");
+    CHECK(TEST_NAME, SymbolParseIndexFile(&indexContext, index, indexLength) == OsSuccess, "failed to load index");
+    CHECK(TEST_NAME, indexContext.symbol_count == symbolContext->symbol_count, "index has %i symbols, expected %i",
+          indexContext.symbol_count, symbolContext->symbol_count);
+    for (i = 0; i < indexContext.symbol_count; i++) {
+        CHECK(TEST_NAME, indexContext.symbols[i].address == symbolContext->symbols[i].address &&
+              indexContext.symbols[i].length == symbolContext->symbols[i].length &&
+              !strcmp(indexContext.symbols[i].name, symbolContext->symbols[i].name),
+              "index symbol %i differs", i);
+    }
+    if (test_lookup(&indexContext)) {
         return -1;
     }
+    DestroyContext(&indexContext);
+
+    // malformed indices are rejected
+    header  = index;
+    entries = (struct symbol_index_entry*)(header + 1);
+    CHECK(TEST_NAME, SymbolParseIndexFile(&indexContext, index, indexLength - 1) == OsError, "truncated index was loaded");
+    CHECK(TEST_NAME, SymbolParseIndexFile(&indexContext, index, sizeof(struct symbol_index_header) - 1) == OsError,
+          "truncated header was loaded");
+
+    header->magic++;
+    CHECK(TEST_NAME, SymbolParseIndexFile(&indexContext, index, indexLength) == OsError, "index with invalid magic was loaded");
+    header->magic--;
+
+    nameOffset             = entries[1].name_offset;
+    entries[1].name_offset = header->string_pool_size;
+    CHECK(TEST_NAME, SymbolParseIndexFile(&indexContext, index, indexLength) == OsError, "index with invalid name was loaded");
+    entries[1].name_offset = nameOffset;
+
+    address            = entries[1].address;
+    entries[1].address = entries[2].address + 1;
+    CHECK(TEST_NAME, SymbolParseIndexFile(&indexContext, index, indexLength) == OsError, "unsorted index was loaded");
+    entries[1].address = address;
+
+    CHECK(TEST_NAME, SymbolParseIndexFile(&indexContext, index, indexLength) == OsSuccess, "restored index failed to load");
+    DestroyContext(&indexContext);
+    free(index);
+    return 0;
+}
+
+static int
+test_throughput(struct symbol_context* symbolContext, void* map, size_t mapLength)
+{
+    struct symbol_context context = { 0 };
+    void*                 index;
+    size_t                indexLength;
+    uintptr_t             checksum = 0;
+    uint64_t              start;
+    uint64_t              linear;
+    uint64_t              binary;
+    uint64_t              parsed;
+    uint64_t              loaded;
+    int                   i;
+
+    start = NowNs();
+    for (i = 0; i < LOOKUPS / 100; i++) {
+        checksum += LinearLookup(symbolContext, ProbeAddress(i * 7919))->address;
+    }
+    linear = (NowNs() - start) / (LOOKUPS / 100);
+
+    start = NowNs();
+    for (i = 0; i < LOOKUPS; i++) {
+        struct map_symbol* symbol = SymbolContextFind(symbolContext, ProbeAddress(i * 7919));
+        checksum += symbol ? symbol->address : 0;
+    }
+    binary = (NowNs() - start) / LOOKUPS;
+
+    CHECK(TEST_NAME, SymbolBuildIndex(symbolContext, &index, &indexLength) == OsSuccess, "failed to build index");
+
+    start = NowNs();
+    for (i = 0; i < ITERATIONS; i++) {
+        CHECK(TEST_NAME, SymbolParseMapFile(&context, map, mapLength) == OsSuccess, "failed to parse map");
+        DestroyContext(&context);
+    }
+    parsed = (NowNs() - start) / ITERATIONS;
+
+    start = NowNs();
+    for (i = 0; i < ITERATIONS; i++) {
+        CHECK(TEST_NAME, SymbolParseIndexFile(&context, index, indexLength) == OsSuccess, "failed to load index");
+        DestroyContext(&context);
+    }
+    loaded = (NowNs() - start) / ITERATIONS;
+
+    printf("%i symbols: lookup linear %7" PRIu64 " ns, binary %4" PRIu64 " ns (checksum %lx)\n",
+           symbolContext->symbol_count, linear, binary, checksum);
+    printf("%i symbols: load map %zu bytes %8" PRIu64 " ns, index %zu bytes %7" PRIu64 " ns\n",
+           symbolContext->symbol_count, mapLength, parsed, indexLength, loaded);
+    free(index);
+    return 0;
+}
+
+static void*
+ReadFile(const char* path, size_t* lengthOut)
+{
+    FILE* file;
+    long  fileSize;
+    void* fileBuffer;
 
-    printf("opening file %s\n", argv[1]);
-    file = fopen(argv[1], "r");
+    file = fopen(path, "r");
     if (!file) {
-        // map did not exist
-        fprintf(stderr, "map file not found at %s\n", argv[1]);
-        return -1;
+        return NULL;
     }
 
     fseek(file, 0, SEEK_END);
@@ -33,26 +274,56 @@ int main(int argc, char **argv)
     rewind(file);
 
     fileBuffer = malloc(fileSize);
-    if (!fileBuffer) {
-        fclose(file);
-        return -1;
+    if (fileBuffer && fread(fileBuffer, 1, fileSize, file) != (size_t)fileSize) {
+        free(fileBuffer);
+        fileBuffer = NULL;
     }
-
-    fread(fileBuffer, 1, fileSize, file);
     fclose(file);
 
-    printf("creating context\n");
-    symbolContext = (struct symbol_context*)malloc(sizeof(struct symbol_context));
-    if (!symbolContext) {
-        free(fileBuffer);
-        return -1;
+    *lengthOut = (size_t)fileSize;
+    return fileBuffer;
+}
+
+// ./map_parser_test /home/philip/Source/vali-userspace/mesa/build/vali-amd64/gallium-osmesa.map
+// Without arguments a generated map is used and lookups are verified against it
+int main(int argc, char **argv)
+{
+    struct symbol_context symbolContext = { 0 };
+    size_t                mapLength;
+    void*                 map;
+    int                   status;
+
+    if (argc >= 2) {
+        printf("opening file %s\n", argv[1]);
+        map = ReadFile(argv[1], &mapLength);
+        if (!map) {
+            fprintf(stderr, "map file not found at %s\n", argv[1]);
+            return -1;
+        }
+
+        status = SymbolParseMapFile(&symbolContext, map, mapLength);
+        printf("status of parse: %i, %i symbols\n", status, symbolContext.symbol_count);
+        if (status == OsSuccess) {
+            status = test_throughput(&symbolContext, map, mapLength);
+        }
+        DestroyContext(&symbolContext);
+        free(map);
+        return status;
     }
 
-    printf("parsing map file data\n");
-    status = SymbolParseMapFile(symbolContext, fileBuffer, fileSize);
+    map    = GenerateMap(&mapLength);
+    status = SymbolParseMapFile(&symbolContext, map, mapLength);
+    CHECK(TEST_NAME, status == OsSuccess, "failed to parse map, status %i", status);
+    CHECK(TEST_NAME, symbolContext.symbol_count == SYMBOLS, "parsed %i symbols, expected %i",
+          symbolContext.symbol_count, SYMBOLS);
 
-    printf("status of parse: %i\n", status);
+    if (test_lookup(&symbolContext) || test_index(&symbolContext) ||
+        test_throughput(&symbolContext, map, mapLength)) {
+        return -1;
+    }
 
-    free(fileBuffer);
-    return status;
+    DestroyContext(&symbolContext);
+    free(map);
+    TEST_PASSED(TEST_NAME);
+    return 0;
 }
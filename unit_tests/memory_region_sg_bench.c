@@ -0,0 +1,321 @@
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+
+#define _InOut_
+#define UUID_INVALID   (UUId_t)0xFFFFFFFF
+#define LODWORD(l)     ((uint32_t)(l))
+#define DIVUP(a, b)    ((a / b) + (((a % b) > 0) ? 1 : 0))
+
+#define PAGE_SIZE 0x1000
+
+typedef uintptr_t vaddr_t;
+typedef struct MemorySpace { int Unused; } MemorySpace_t;
+
+#define MAPPING_USERSPACE       0x1
+#define MAPPING_PERSISTENT      0x2
+#define MAPPING_VIRTUAL_GLOBAL  0x1
+#define MAPPING_VIRTUAL_PROCESS 0x2
+#define MAPPING_PHYSICAL_FIXED  0x4
+
+typedef struct Mutex { int Locked; } Mutex_t;
+#define MUTEX_FLAG_PLAIN 0
+static void MutexConstruct(Mutex_t* Mutex, unsigned int Flags) { Mutex->Locked = 0; }
+static void MutexLock(Mutex_t* Mutex)   { assert(!Mutex->Locked); Mutex->Locked = 1; }
+static void MutexUnlock(Mutex_t* Mutex) { assert(Mutex->Locked); Mutex->Locked = 0; }
+
+struct dma_sg {
+    uintptr_t address;
+    size_t    length;
+};
+
+// The handle table only ever holds the regions of the test
+#include <handle.h>
+#define MAX_REGIONS 8
+
+static void* g_regions[MAX_REGIONS];
+static int   g_regionCount;
+
+UUId_t CreateHandle(HandleType_t Type, HandleDestructorFn Destructor, void* Resource)
+{
+    assert(g_regionCount < MAX_REGIONS);
+    g_regions[g_regionCount] = Resource;
+    return (UUId_t)++g_regionCount;
+}
+
+void* LookupHandleOfType(UUId_t Handle, HandleType_t Type)
+{
+    return (Handle && Handle <= (UUId_t)g_regionCount) ? g_regions[Handle - 1] : NULL;
+}
+
+OsStatus_t AcquireHandle(UUId_t Handle, void** ResourceOut)
+{
+    *ResourceOut = LookupHandleOfType(Handle, HandleTypeMemoryRegion);
+    return *ResourceOut ? OsSuccess : OsDoesNotExist;
+}
+
+// Physical memory is handed out in runs of 1 to 16 pages with holes between them,
+// so the regions are as scattered as they are on a system that has been running
+static uintptr_t g_nextPhysical = 0x100000;
+static int       g_runLeft;
+static vaddr_t   g_nextVirtual  = 0x40000000;
+
+static size_t         GetMemorySpacePageSize(void) { return PAGE_SIZE; }
+static MemorySpace_t* GetCurrentMemorySpace(void) { static MemorySpace_t space; return &space; }
+
+static OsStatus_t
+MemorySpaceMapReserved(MemorySpace_t* MemorySpace, vaddr_t* Address, size_t Size,
+                       unsigned int MemoryFlags, unsigned int PlacementFlags)
+{
+    *Address      = g_nextVirtual;
+    g_nextVirtual += DIVUP(Size, PAGE_SIZE) * PAGE_SIZE;
+    return OsSuccess;
+}
+
+static OsStatus_t
+MemorySpaceCommit(MemorySpace_t* MemorySpace, vaddr_t Address, uintptr_t* PhysicalAddressValues,
+                  size_t Size, unsigned int PlacementFlags)
+{
+    if (PlacementFlags & MAPPING_PHYSICAL_FIXED) {
+        return OsSuccess;
+    }
+
+    for (size_t i = 0; i < DIVUP(Size, PAGE_SIZE); i++) {
+        if (!g_runLeft) {
+            g_runLeft       = 1 + (rand() % 16);
+            g_nextPhysical += PAGE_SIZE * (1 + (rand() % 4));
+        }
+        PhysicalAddressValues[i] = g_nextPhysical;
+        g_nextPhysical          += PAGE_SIZE;
+        g_runLeft--;
+    }
+    return OsSuccess;
+}
+
+static OsStatus_t MemorySpaceUnmap(MemorySpace_t* MemorySpace, vaddr_t Address, size_t Size) { return OsSuccess; }
+static OsStatus_t IsMemorySpacePagePresent(MemorySpace_t* MemorySpace, vaddr_t Address) { return OsSuccess; }
+
+static OsStatus_t
+GetMemorySpaceMapping(MemorySpace_t* MemorySpace, vaddr_t Address, int PageCount, uintptr_t* DmaVectorOut)
+{
+    return OsNotSupported;
+}
+
+static OsStatus_t
+MemorySpaceMap(MemorySpace_t* MemorySpace, vaddr_t* Address, uintptr_t* PhysicalAddressValues,
+               size_t Length, unsigned int MemoryFlags, unsigned int PlacementFlags)
+{
+    return OsNotSupported;
+}
+
+static void ReadVolatileMemory(const volatile void* Source, volatile void* Destination, size_t Length) { }
+static void WriteVolatileMemory(volatile void* Destination, void* Source, size_t Length) { }
+
+#include "../kernel/memory/memory_region.c"
+
+#define ITERATIONS 2000
+#define RANGES     20000
+
+#define TEST_NAME "memory_region_sg_bench"
+
+// Retrieves the table the way dma_get_sg_table does, a count and then a fill
+static struct dma_sg*
+GetSgTable(UUId_t handle, int* countOut)
+{
+    struct dma_sg* table;
+
+    if (MemoryRegionGetSg(handle, countOut, NULL) != OsSuccess) {
+        return NULL;
+    }
+
+    table = malloc(sizeof(struct dma_sg) * *countOut);
+    if (table && MemoryRegionGetSg(handle, countOut, table) != OsSuccess) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+static uintptr_t
+PhysicalOf(MemoryRegion_t* region, size_t offset)
+{
+    uintptr_t page = region->Pages[offset / PAGE_SIZE];
+    return page ? page + (offset % PAGE_SIZE) : 0;
+}
+
+// Every byte of the buffer must be described once, at the address it is mapped to
+static int
+verify_table(MemoryRegion_t* region, struct dma_sg* table, int count, size_t offset, size_t length)
+{
+    for (int i = 0; i < count; i++) {
+        CHECK(TEST_NAME, table[i].length > 0 && table[i].length <= length, "entry %i has length %zu", i, table[i].length);
+        for (size_t j = 0; j < table[i].length; j += PAGE_SIZE - ((offset + j) % PAGE_SIZE)) {
+            uintptr_t expected = PhysicalOf(region, offset + j);
+            CHECK(TEST_NAME, (table[i].address ? table[i].address + j : 0) == expected,
+                  "entry %i maps offset 0x%zx to 0x%" PRIxIN " instead of 0x%" PRIxIN,
+                  i, offset + j, table[i].address + j, expected);
+        }
+        offset += table[i].length;
+        length -= table[i].length;
+    }
+    CHECK(TEST_NAME, length == 0, "table is 0x%zx bytes short", length);
+    return 0;
+}
+
+static int
+test_region(size_t size)
+{
+    MemoryRegion_t* region;
+    struct dma_sg*  table;
+    struct dma_sg*  cached;
+    void*           kernelMapping;
+    void*           userMapping;
+    UUId_t          handle;
+    int             count;
+    int             cachedCount;
+
+    CHECK(TEST_NAME, MemoryRegionCreate(size / 2, size, 0, &kernelMapping, &userMapping, &handle) == OsSuccess,
+          "region creation failed");
+    region = LookupHandleOfType(handle, HandleTypeMemoryRegion);
+
+    table = GetSgTable(handle, &count);
+    CHECK(TEST_NAME, table != NULL && verify_table(region, table, count, 0, size) == 0, "table is wrong");
+
+    // The second request is served from the cache
+    cached = GetSgTable(handle, &cachedCount);
+    CHECK(TEST_NAME, cached != NULL && cachedCount == count && !memcmp(table, cached, sizeof(struct dma_sg) * count),
+          "cached table differs");
+    free(cached);
+
+    // Fewer entries than the table holds can be requested
+    cachedCount = 2;
+    cached      = malloc(sizeof(struct dma_sg) * 2);
+    CHECK(TEST_NAME, MemoryRegionGetSg(handle, &cachedCount, cached) == OsSuccess && cachedCount == 2 &&
+          !memcmp(table, cached, sizeof(struct dma_sg) * 2), "partial table differs");
+    free(cached);
+    free(table);
+
+    // Committing the rest of the buffer must invalidate the cached table
+    CHECK(TEST_NAME, MemoryRegionCommit(handle, userMapping, userMapping, size) == OsSuccess, "commit failed");
+    table = GetSgTable(handle, &count);
+    CHECK(TEST_NAME, table != NULL && verify_table(region, table, count, 0, size) == 0, "table is stale after commit");
+    free(table);
+
+    // Sub-ranges are trimmed to the requested range and clamped to the buffer
+    for (int i = 0; i < RANGES; i++) {
+        size_t offset = (size_t)rand() % size;
+        size_t length = 1 + ((size_t)rand() % (size / 4));
+
+        CHECK(TEST_NAME, MemoryRegionGetSgRange(handle, offset, length, &count, NULL) == OsSuccess, "range count failed");
+        table = malloc(sizeof(struct dma_sg) * count);
+        CHECK(TEST_NAME, MemoryRegionGetSgRange(handle, offset, length, &count, table) == OsSuccess, "range fill failed");
+        CHECK(TEST_NAME, verify_table(region, table, count, offset, MIN(length, size - offset)) == 0,
+              "range 0x%zx+0x%zx is wrong", offset, length);
+        free(table);
+    }
+    CHECK(TEST_NAME, MemoryRegionGetSgRange(handle, size, 1, &count, NULL) == OsInvalidParameters, "range past the end");
+    CHECK(TEST_NAME, MemoryRegionGetSgRange(handle, 0, 0, &count, NULL) == OsInvalidParameters, "empty range");
+    return 0;
+}
+
+// Regions with more entries than the heap can cache are walked on every request
+static int
+test_uncached_region(size_t size)
+{
+    MemoryRegion_t* region;
+    struct dma_sg*  table;
+    struct dma_sg   partial[2];
+    void*           kernelMapping;
+    void*           userMapping;
+    UUId_t          handle;
+    int             count;
+
+    CHECK(TEST_NAME, MemoryRegionCreate(size, size, 0, &kernelMapping, &userMapping, &handle) == OsSuccess,
+          "region creation failed");
+    region = LookupHandleOfType(handle, HandleTypeMemoryRegion);
+
+    table = GetSgTable(handle, &count);
+    CHECK(TEST_NAME, table != NULL && verify_table(region, table, count, 0, size) == 0, "uncached table is wrong");
+    CHECK(TEST_NAME, region->SgList == NULL, "table of %i entries was cached", count);
+    CHECK(TEST_NAME, (sizeof(struct dma_sg) + sizeof(size_t)) * count > SG_CACHE_MAX_BYTES,
+          "region of %i entries fits the cache", count);
+
+    count = 2;
+    CHECK(TEST_NAME, MemoryRegionGetSg(handle, &count, &partial[0]) == OsSuccess && count == 2 &&
+          !memcmp(table, &partial[0], sizeof(partial)), "partial uncached table differs");
+    free(table);
+
+    for (int i = 0; i < RANGES / 100; i++) {
+        size_t offset = (size_t)rand() % size;
+        size_t length = 1 + ((size_t)rand() % (size / 64));
+
+        CHECK(TEST_NAME, MemoryRegionGetSgRange(handle, offset, length, &count, NULL) == OsSuccess, "range count failed");
+        table = malloc(sizeof(struct dma_sg) * count);
+        CHECK(TEST_NAME, MemoryRegionGetSgRange(handle, offset, length, &count, table) == OsSuccess, "range fill failed");
+        CHECK(TEST_NAME, verify_table(region, table, count, offset, MIN(length, size - offset)) == 0,
+              "uncached range 0x%zx+0x%zx is wrong", offset, length);
+        free(table);
+    }
+    CHECK(TEST_NAME, MemoryRegionGetSgRange(handle, size, 1, &count, NULL) == OsInvalidParameters, "range past the end");
+    return 0;
+}
+
+static int
+bench_region(size_t size)
+{
+    MemoryRegion_t* region;
+    struct dma_sg   range[4];
+    void*           kernelMapping;
+    void*           userMapping;
+    UUId_t          handle;
+    uint64_t        start;
+    uint64_t        rebuilt;
+    uint64_t        cached;
+    uint64_t        ranged;
+    int             count;
+
+    CHECK(TEST_NAME, MemoryRegionCreate(size, size, 0, &kernelMapping, &userMapping, &handle) == OsSuccess,
+          "region creation failed");
+    region = LookupHandleOfType(handle, HandleTypeMemoryRegion);
+
+    // Previously the table was computed from the pages on every request
+    start = NowNs();
+    for (int i = 0; i < ITERATIONS; i++) {
+        __InvalidateSgList(region);
+        free(GetSgTable(handle, &count));
+    }
+    rebuilt = (NowNs() - start) / ITERATIONS;
+
+    start = NowNs();
+    for (int i = 0; i < ITERATIONS; i++) {
+        free(GetSgTable(handle, &count));
+    }
+    cached = (NowNs() - start) / ITERATIONS;
+
+    // A 64KB transfer somewhere in the buffer only needs the entries it touches
+    start = NowNs();
+    for (int i = 0; i < ITERATIONS; i++) {
+        int rangeCount = 4;
+        MemoryRegionGetSgRange(handle, ((size_t)i * 0x10000) % size, 0x10000, &rangeCount, &range[0]);
+    }
+    ranged = (NowNs() - start) / ITERATIONS;
+
+    printf("%3zu MB region, %5i entries: rebuilt %9" PRIu64 " ns, cached %7" PRIu64 " ns, 64KB range %4" PRIu64 " ns\n",
+           size >> 20, count, rebuilt, cached, ranged);
+    CHECK(TEST_NAME, cached < rebuilt, "cached table was slower than rebuilding it");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    srand(1);
+    if (test_region(1024 * 1024) || test_region(16 * 1024 * 1024) ||
+        test_uncached_region(512 * 1024 * 1024) ||
+        bench_region(1024 * 1024) || bench_region(64 * 1024 * 1024)) {
+        return -1;
+    }
+
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}
@@ -0,0 +1,608 @@
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+
+#define _InOut_
+#define OsDeviceError  (int)10
+#define LODWORD(l)     ((uint32_t)(l))
+#define DIVUP(a, b)    ((a / b) + (((a % b) > 0) ? 1 : 0))
+#define PACKED_TYPESTRUCT(name, body) typedef struct __attribute__((packed)) name body name##_t
+
+// The host has no monotonic timespec_get
+#define TIME_MONOTONIC             1
+#define timespec_get(ts, base)     clock_gettime(CLOCK_MONOTONIC, ts)
+
+// The parts of the ddk the mfs header uses
+typedef struct MString MString_t;
+typedef union { uint64_t QuadPart; } LargeUInteger_t;
+
+typedef struct {
+    unsigned int    Flags;
+    LargeUInteger_t Size;
+} OsFileDescriptor_t;
+
+typedef struct FileSystemEntry {
+    OsFileDescriptor_t Descriptor;
+    MString_t*         Path;
+    MString_t*         Name;
+} FileSystemEntry_t;
+
+typedef struct FileSystemEntryHandle {
+    FileSystemEntry_t* Entry;
+    UUId_t             Id;
+    uint64_t           Position;
+} FileSystemEntryHandle_t;
+
+typedef struct FileSystemDescriptor {
+    struct { struct { size_t SectorSize; } descriptor; } Disk;
+    uintptr_t* ExtensionData;
+} FileSystemDescriptor_t;
+
+typedef struct StorageTransferSegment {
+    uint64_t Sector;
+    UUId_t   BufferHandle;
+    size_t   BufferOffset;
+    size_t   SectorCount;
+} StorageTransferSegment_t;
+
+struct dma_attachment {
+    UUId_t handle;
+    void*  buffer;
+    size_t length;
+};
+
+#include "../modules/filesystems/mfs/bucket_map.c"
+
+// A 256MB image of 4KB buckets, only the metadata area is kept in memory
+#define SECTOR_SIZE        512
+#define SECTORS_PER_BUCKET 8
+#define BUCKET_SIZE        (SECTOR_SIZE * SECTORS_PER_BUCKET)
+#define BUCKET_COUNT       65536
+#define MASTER_SECTOR      4
+#define MIRROR_SECTOR      5
+#define MAP_BUCKET         8
+#define MAP_SIZE           (BUCKET_COUNT * 8)
+#define JOURNAL_BUCKET     (MAP_BUCKET + (MAP_SIZE / BUCKET_SIZE))
+#define FIRST_FREE         (JOURNAL_BUCKET + MFS_JOURNALSIZE)
+#define IMAGE_SECTORS      (FIRST_FREE * SECTORS_PER_BUCKET)
+
+// The aging workload, writers append to their files in small chunks at the same
+// time and files are deleted at random to keep the volume between the marks
+#define WRITERS            32
+#define MAX_FILES          8192
+#define AGING_STEPS        400000
+#define HIGH_MARK          ((BUCKET_COUNT * 80) / 100)
+#define LOW_MARK           ((BUCKET_COUNT * 65) / 100)
+
+// Disk model for the sequential read, every extent costs a seek
+#define SEEK_MS            8.0
+#define BANDWIDTH_MBS      150.0
+
+#define JOURNAL_HANDLE 1
+#define MAP_HANDLE     2
+
+typedef struct File {
+    uint32_t Start;
+    uint32_t Allocated; // In buckets
+    uint32_t Size;      // In buckets
+    uint32_t Target;
+} File_t;
+
+typedef struct Policy {
+    const char* Name;
+    OsStatus_t (*Grow)(File_t*, uint32_t);
+    OsStatus_t (*Free)(FileSystemDescriptor_t*, uint32_t, uint32_t);
+} Policy_t;
+
+static FileSystemDescriptor_t g_fileSystem;
+static MfsInstance_t          g_mfs;
+static uint8_t                g_disk[IMAGE_SECTORS * SECTOR_SIZE];
+static File_t                 g_files[MAX_FILES];
+static int                    g_fileCount;
+static uint64_t               g_allocated;
+static uint64_t               g_growCalls;
+static uint64_t               g_growTime;
+
+static uint8_t*
+BufferOf(UUId_t handle)
+{
+    return handle == JOURNAL_HANDLE ? (uint8_t*)g_mfs.JournalBuffer.buffer : (uint8_t*)g_mfs.BucketMap;
+}
+
+OsStatus_t
+MfsReadSectors(FileSystemDescriptor_t* FileSystem, UUId_t BufferHandle, size_t BufferOffset,
+               uint64_t Sector, size_t Count, size_t* SectorsRead)
+{
+    assert(Sector + Count <= IMAGE_SECTORS);
+    memcpy(BufferOf(BufferHandle) + BufferOffset, &g_disk[Sector * SECTOR_SIZE], Count * SECTOR_SIZE);
+    *SectorsRead = Count;
+    return OsSuccess;
+}
+
+OsStatus_t
+MfsWriteSectors(FileSystemDescriptor_t* FileSystem, UUId_t BufferHandle, size_t BufferOffset,
+                uint64_t Sector, size_t Count, size_t* SectorsWritten)
+{
+    assert(Sector + Count <= IMAGE_SECTORS);
+    memcpy(&g_disk[Sector * SECTOR_SIZE], BufferOf(BufferHandle) + BufferOffset, Count * SECTOR_SIZE);
+    *SectorsWritten = Count;
+    return OsSuccess;
+}
+
+// The allocator used before the free space index, it takes buckets from the
+// head of the free chain and puts freed chains back at the head
+static OsStatus_t
+FirstFitAllocate(size_t BucketCount, MapRecord_t* RecordResult)
+{
+    uint32_t    PreviousBucket = 0;
+    uint32_t    Bucket         = g_mfs.MasterRecord.FreeBucket;
+    size_t      Counter        = BucketCount;
+    MapRecord_t Record;
+
+    RecordResult->Link   = Bucket;
+    RecordResult->Length = 0;
+    while (Counter > 0) {
+        if (MfsGetBucketLink(&g_fileSystem, Bucket, &Record) != OsSuccess) {
+            return OsError;
+        }
+
+        if (Record.Length > Counter) {
+            MapRecord_t Update = { MFS_ENDOFCHAIN, (uint32_t)Counter };
+            MapRecord_t Next   = { Record.Link, Record.Length - (uint32_t)Counter };
+
+            if (RecordResult->Length == 0) {
+                RecordResult->Length = Update.Length;
+            }
+            if (MfsSetBucketLink(&g_fileSystem, Bucket, &Update, 1) != OsSuccess ||
+                MfsSetBucketLink(&g_fileSystem, Bucket + Counter, &Next, 1) != OsSuccess) {
+                return OsError;
+            }
+            g_mfs.MasterRecord.FreeBucket = Bucket + Counter;
+            return MfsUpdateMasterRecord(&g_fileSystem);
+        }
+
+        if (RecordResult->Length == 0) {
+            RecordResult->Length = Record.Length;
+        }
+        Counter        -= Record.Length;
+        PreviousBucket  = Bucket;
+        Bucket          = Record.Link;
+    }
+
+    Record.Link = MFS_ENDOFCHAIN;
+    if (MfsSetBucketLink(&g_fileSystem, PreviousBucket, &Record, 0) != OsSuccess) {
+        return OsError;
+    }
+    g_mfs.MasterRecord.FreeBucket = Bucket;
+    return MfsUpdateMasterRecord(&g_fileSystem);
+}
+
+static OsStatus_t
+FirstFitFree(FileSystemDescriptor_t* FileSystem, uint32_t StartBucket, uint32_t StartLength)
+{
+    uint32_t    PreviousBucket = MFS_ENDOFCHAIN;
+    MapRecord_t Record;
+
+    Record.Link = StartBucket;
+    while (Record.Link != MFS_ENDOFCHAIN) {
+        PreviousBucket = Record.Link;
+        if (MfsGetBucketLink(FileSystem, Record.Link, &Record) != OsSuccess) {
+            return OsError;
+        }
+    }
+
+    Record.Link = g_mfs.MasterRecord.FreeBucket;
+    if (MfsSetBucketLink(FileSystem, PreviousBucket, &Record, 0) != OsSuccess) {
+        return OsError;
+    }
+    g_mfs.MasterRecord.FreeBucket = StartBucket;
+    return MfsUpdateMasterRecord(FileSystem);
+}
+
+static uint32_t
+LastRun(File_t* file, MapRecord_t* last)
+{
+    uint32_t bucket = file->Start;
+
+    assert(MfsGetBucketLink(&g_fileSystem, bucket, last) == OsSuccess);
+    while (last->Link != MFS_ENDOFCHAIN) {
+        bucket = last->Link;
+        assert(MfsGetBucketLink(&g_fileSystem, bucket, last) == OsSuccess);
+    }
+    return bucket;
+}
+
+// Growing a file as MfsEnsureRecordSpace did before
+static OsStatus_t
+FirstFitGrow(File_t* file, uint32_t buckets)
+{
+    MapRecord_t link, last;
+    uint32_t    bucket;
+
+    if (FirstFitAllocate(buckets, &link) != OsSuccess) {
+        return OsError;
+    }
+
+    if (file->Start == MFS_ENDOFCHAIN) {
+        file->Start = link.Link;
+    }
+    else {
+        bucket = LastRun(file, &last);
+        assert(MfsSetBucketLink(&g_fileSystem, bucket, &link, 0) == OsSuccess);
+    }
+    file->Allocated += buckets;
+    return OsSuccess;
+}
+
+// Growing a file as MfsEnsureRecordSpace does now, with the hint, the
+// reservation for sequential writers and extending the last run in place
+static OsStatus_t
+IndexedGrow(File_t* file, uint32_t buckets)
+{
+    MapRecord_t link, last;
+    uint32_t    bucket  = MFS_ENDOFCHAIN;
+    uint32_t    hint    = MFS_ENDOFCHAIN;
+    uint32_t    reserve = 0;
+
+    if (file->Start != MFS_ENDOFCHAIN) {
+        bucket  = LastRun(file, &last);
+        hint    = bucket + last.Length;
+        reserve = MIN(file->Allocated, MFS_PREALLOCATION);
+    }
+
+    if (reserve > buckets && MfsAllocateBuckets(&g_fileSystem, hint, reserve, &link) == OsSuccess) {
+        buckets = reserve;
+    }
+    else if (MfsAllocateBuckets(&g_fileSystem, hint, buckets, &link) != OsSuccess) {
+        return OsError;
+    }
+
+    if (file->Start == MFS_ENDOFCHAIN) {
+        file->Start = link.Link;
+    }
+    else if (link.Link == hint) {
+        MapRecord_t continued;
+        assert(MfsGetBucketLink(&g_fileSystem, link.Link, &continued) == OsSuccess);
+        last.Link    = continued.Link;
+        last.Length += continued.Length;
+        assert(MfsSetBucketLink(&g_fileSystem, bucket, &last, 1) == OsSuccess);
+    }
+    else {
+        assert(MfsSetBucketLink(&g_fileSystem, bucket, &link, 0) == OsSuccess);
+    }
+    file->Allocated += buckets;
+    return OsSuccess;
+}
+
+static void
+Format(void)
+{
+    MasterRecord_t master = { 0 };
+    uint32_t*      map    = (uint32_t*)&g_disk[MAP_BUCKET * BUCKET_SIZE];
+    size_t         read;
+
+    memset(g_disk, 0, sizeof(g_disk));
+    master.Magic        = MFS_BOOTRECORD_MAGIC;
+    master.FreeBucket   = FIRST_FREE;
+    master.JournalIndex = JOURNAL_BUCKET;
+    master.MapSector    = MAP_BUCKET * SECTORS_PER_BUCKET;
+    master.MapSize      = MAP_SIZE;
+    memcpy(&g_disk[MASTER_SECTOR * SECTOR_SIZE], &master, sizeof(MasterRecord_t));
+    memcpy(&g_disk[MIRROR_SECTOR * SECTOR_SIZE], &master, sizeof(MasterRecord_t));
+    map[FIRST_FREE * 2]       = MFS_ENDOFCHAIN;
+    map[(FIRST_FREE * 2) + 1] = BUCKET_COUNT - FIRST_FREE;
+
+    free(g_mfs.BucketMap);
+    free(g_mfs.DirtyMap);
+    memcpy(&g_mfs.MasterRecord, &master, sizeof(MasterRecord_t));
+    g_mfs.DirtyCount        = 0;
+    g_mfs.MasterRecordDirty = 0;
+    g_mfs.DirtySince        = 0;
+    assert(MfsReplayJournal(&g_fileSystem) == OsSuccess);
+    g_mfs.BucketMap = malloc(MAP_SIZE);
+    g_mfs.DirtyMap  = calloc(DIVUP(MAP_SIZE, (SECTOR_SIZE * 8)), 1);
+    assert(g_mfs.BucketMap && g_mfs.DirtyMap);
+    assert(MfsReadSectors(&g_fileSystem, MAP_HANDLE, 0, master.MapSector, MAP_SIZE / SECTOR_SIZE, &read) == OsSuccess);
+    assert(MfsBuildFreeIndex(&g_fileSystem) == OsSuccess);
+
+    g_fileCount = 0;
+    g_allocated = 0;
+    g_growCalls = 0;
+    g_growTime  = 0;
+}
+
+static void
+DeleteFile(const Policy_t* policy, int index)
+{
+    File_t file = g_files[index];
+
+    g_files[index] = g_files[--g_fileCount];
+    if (file.Start != MFS_ENDOFCHAIN) {
+        assert(policy->Free(&g_fileSystem, file.Start, 1) == OsSuccess);
+    }
+    g_allocated -= file.Allocated;
+}
+
+static uint32_t
+RandomTarget(unsigned int* seed)
+{
+    // Mostly small files and a few large ones
+    uint32_t shift = rand_r(seed) % 10;
+    return 1 + (rand_r(seed) % (4u << shift));
+}
+
+// The first WRITERS files are the ones being written, a finished file is swapped
+// out of the writer slots and a new one takes its place
+static void
+Age(const Policy_t* policy)
+{
+    unsigned int seed = 2020;
+    int          step;
+    int          i;
+
+    for (i = 0; i < WRITERS; i++) {
+        g_files[i].Start     = MFS_ENDOFCHAIN;
+        g_files[i].Allocated = 0;
+        g_files[i].Size      = 0;
+        g_files[i].Target    = RandomTarget(&seed);
+    }
+    g_fileCount = WRITERS;
+
+    for (step = 0; step < AGING_STEPS; step++) {
+        int      writer = rand_r(&seed) % WRITERS;
+        File_t*  file   = &g_files[writer];
+        uint32_t chunk  = 1 + (rand_r(&seed) % 4);
+
+        chunk = MIN(chunk, file->Target - file->Size);
+
+        if (file->Size + chunk > file->Allocated) {
+            unsigned long long start = NowNs();
+            uint32_t           before = file->Allocated;
+            assert(policy->Grow(file, file->Size + chunk - file->Allocated) == OsSuccess);
+            g_growTime += NowNs() - start;
+            g_growCalls++;
+            g_allocated += file->Allocated - before;
+        }
+        file->Size += chunk;
+
+        if (file->Size == file->Target) {
+            assert(g_fileCount < MAX_FILES);
+            g_files[g_fileCount++] = *file;
+            file->Start     = MFS_ENDOFCHAIN;
+            file->Allocated = 0;
+            file->Size      = 0;
+            file->Target    = RandomTarget(&seed);
+        }
+
+        if (g_allocated > HIGH_MARK) {
+            while (g_allocated > LOW_MARK && g_fileCount > WRITERS) {
+                DeleteFile(policy, WRITERS + (rand_r(&seed) % (g_fileCount - WRITERS)));
+            }
+        }
+    }
+}
+
+// Extents are the physically contiguous pieces of the file
+static uint32_t
+CountExtents(File_t* file)
+{
+    MapRecord_t record;
+    uint32_t    bucket = file->Start;
+    uint32_t    end    = MFS_ENDOFCHAIN;
+    uint32_t    count  = 0;
+
+    while (bucket != MFS_ENDOFCHAIN) {
+        assert(MfsGetBucketLink(&g_fileSystem, bucket, &record) == OsSuccess);
+        if (bucket != end) {
+            count++;
+        }
+        end    = bucket + record.Length;
+        bucket = record.Link;
+    }
+    return count;
+}
+
+static int
+CompareRuns(const void* left, const void* right)
+{
+    const MapRecord_t* l = left;
+    const MapRecord_t* r = right;
+    return (l->Link > r->Link) - (l->Link < r->Link);
+}
+
+// Walks the free chain, adjacent free runs count as one extent
+static void
+FreeSpace(uint32_t* extents, uint32_t* largest, uint64_t* total)
+{
+    MapRecord_t* runs  = malloc(sizeof(MapRecord_t) * BUCKET_COUNT);
+    uint32_t     bucket = g_mfs.MasterRecord.FreeBucket;
+    uint32_t     count  = 0;
+    uint32_t     length = 0;
+    uint32_t     i;
+
+    assert(runs != NULL);
+    while (bucket != MFS_ENDOFCHAIN) {
+        MapRecord_t record;
+        assert(count < BUCKET_COUNT);
+        assert(MfsGetBucketLink(&g_fileSystem, bucket, &record) == OsSuccess);
+        runs[count].Link   = bucket;
+        runs[count].Length = record.Length;
+        count++;
+        bucket = record.Link;
+    }
+    qsort(runs, count, sizeof(MapRecord_t), CompareRuns);
+
+    *extents = 0;
+    *largest = 0;
+    *total   = 0;
+    for (i = 0; i < count; i++) {
+        assert(i == 0 || runs[i - 1].Link + runs[i - 1].Length <= runs[i].Link);
+        if (i == 0 || runs[i - 1].Link + runs[i - 1].Length != runs[i].Link) {
+            (*extents)++;
+            length = 0;
+        }
+        length  += runs[i].Length;
+        *total  += runs[i].Length;
+        *largest = MAX(*largest, length);
+    }
+    free(runs);
+}
+
+static void
+Report(const Policy_t* policy)
+{
+    uint64_t extents = 0, buckets = 0, freeTotal;
+    uint32_t freeExtents, largest;
+    double   seconds = 0.0;
+    int      i;
+
+    for (i = 0; i < g_fileCount; i++) {
+        uint32_t count = CountExtents(&g_files[i]);
+        extents += count;
+        buckets += g_files[i].Size;
+        seconds += (count * SEEK_MS / 1000.0) + ((g_files[i].Size * (double)BUCKET_SIZE) / (BANDWIDTH_MBS * 1024 * 1024));
+    }
+    FreeSpace(&freeExtents, &largest, &freeTotal);
+
+    printf("%-10s %5d files, %6.2f extents per file, %6u free extents, largest free %6u buckets, "
+           "sequential read %6.1f MB/s, %5.0f ns per grow\n",
+           policy->Name, g_fileCount, (double)extents / g_fileCount, freeExtents, largest,
+           ((buckets * (double)BUCKET_SIZE) / (1024 * 1024)) / seconds, (double)g_growTime / g_growCalls);
+}
+
+// The index must match what building it from the free chain gives, and the free
+// space and the files must cover the volume without overlap
+static void
+CheckIndex(void)
+{
+    MfsFreeExtent_t* byPosition = malloc(sizeof(MfsFreeExtent_t) * g_mfs.FreeExtentCount);
+    MfsFreeExtent_t* bySize     = malloc(sizeof(MfsFreeExtent_t) * g_mfs.FreeExtentCount);
+    uint8_t*         used       = calloc(BUCKET_COUNT, 1);
+    size_t           count      = g_mfs.FreeExtentCount;
+    uint64_t         freeCount  = g_mfs.FreeBucketCount;
+    uint64_t         marked     = 0;
+    size_t           i;
+    int              j;
+
+    assert(byPosition && bySize && used);
+    memcpy(byPosition, g_mfs.FreeByPosition, sizeof(MfsFreeExtent_t) * count);
+    memcpy(bySize, g_mfs.FreeBySize, sizeof(MfsFreeExtent_t) * count);
+    assert(MfsBuildFreeIndex(&g_fileSystem) == OsSuccess);
+    assert(g_mfs.FreeExtentCount == count && g_mfs.FreeBucketCount == freeCount);
+    assert(!memcmp(byPosition, g_mfs.FreeByPosition, sizeof(MfsFreeExtent_t) * count));
+    for (i = 0; i < count; i++) {
+        assert(bySize[i].Bucket == g_mfs.FreeBySize[i].Bucket && bySize[i].Length == g_mfs.FreeBySize[i].Length);
+    }
+
+    for (i = 0; i < count; i++) {
+        uint32_t b;
+        for (b = byPosition[i].Bucket; b < byPosition[i].Bucket + byPosition[i].Length; b++) {
+            assert(!used[b]);
+            used[b] = 1;
+            marked++;
+        }
+        // Free runs next to each other are always merged
+        assert(i == 0 || byPosition[i - 1].Bucket + byPosition[i - 1].Length < byPosition[i].Bucket);
+    }
+
+    for (j = 0; j < g_fileCount; j++) {
+        MapRecord_t record;
+        uint32_t    bucket = g_files[j].Start;
+        uint32_t    length = 0;
+        while (bucket != MFS_ENDOFCHAIN) {
+            uint32_t b;
+            assert(MfsGetBucketLink(&g_fileSystem, bucket, &record) == OsSuccess);
+            for (b = bucket; b < bucket + record.Length; b++) {
+                assert(!used[b]);
+                used[b] = 1;
+                marked++;
+            }
+            length += record.Length;
+            bucket  = record.Link;
+        }
+        assert(length == g_files[j].Allocated);
+    }
+    assert(marked == BUCKET_COUNT - FIRST_FREE);
+
+    free(byPosition);
+    free(bySize);
+    free(used);
+}
+
+static void
+TestAllocator(void)
+{
+    static const Policy_t policy = { "indexed", IndexedGrow, MfsFreeBuckets };
+    MapRecord_t           record;
+    File_t                file = { MFS_ENDOFCHAIN, 0, 0, 0 };
+    uint32_t              hole;
+
+    // A file that grows alone stays in a single extent
+    Format();
+    g_files[g_fileCount++] = file;
+    while (g_files[0].Allocated < 1000) {
+        assert(IndexedGrow(&g_files[0], 3) == OsSuccess);
+    }
+    assert(CountExtents(&g_files[0]) == 1);
+    CheckIndex();
+
+    // Allocations go to the smallest hole that fits
+    assert(MfsAllocateBuckets(&g_fileSystem, MFS_ENDOFCHAIN, 4, &record) == OsSuccess);
+    assert(MfsAllocateBuckets(&g_fileSystem, MFS_ENDOFCHAIN, 16, &record) == OsSuccess);
+    assert(MfsAllocateBuckets(&g_fileSystem, MFS_ENDOFCHAIN, 4, &record) == OsSuccess);
+    hole = record.Link - 16;
+    assert(MfsFreeBuckets(&g_fileSystem, hole, 1) == OsSuccess);
+    assert(MfsAllocateBuckets(&g_fileSystem, MFS_ENDOFCHAIN, 10, &record) == OsSuccess);
+    assert(record.Link == hole && record.Length == 10);
+
+    // Releasing everything merges the free space back into one extent
+    Format();
+    Age(&policy);
+    CheckIndex();
+    while (g_fileCount) {
+        DeleteFile(&policy, g_fileCount - 1);
+    }
+    assert(g_mfs.FreeExtentCount == 1);
+    assert(g_mfs.FreeByPosition[0].Bucket == FIRST_FREE && g_mfs.FreeByPosition[0].Length == BUCKET_COUNT - FIRST_FREE);
+    assert(g_mfs.FreeBucketCount == BUCKET_COUNT - FIRST_FREE);
+    printf("allocator: ok\n");
+}
+
+static void
+BenchAging(void)
+{
+    static const Policy_t policies[] = {
+        { "first-fit", FirstFitGrow, FirstFitFree },
+        { "indexed",   IndexedGrow,  MfsFreeBuckets }
+    };
+    size_t i;
+
+    printf("aged %u steps, %d writers, %uMB volume between %u%% and %u%% full\n",
+           AGING_STEPS, WRITERS, (BUCKET_COUNT * BUCKET_SIZE) / (1024 * 1024), 65, 80);
+    for (i = 0; i < SIZEOF_ARRAY(policies); i++) {
+        Format();
+        Age(&policies[i]);
+        Report(&policies[i]);
+    }
+}
+
+int main(void)
+{
+    g_mfs.SectorsPerBucket         = SECTORS_PER_BUCKET;
+    g_mfs.BucketCount              = BUCKET_COUNT;
+    g_mfs.BucketsPerSectorInMap    = SECTOR_SIZE / 8;
+    g_mfs.MasterRecordSector       = MASTER_SECTOR;
+    g_mfs.MasterRecordMirrorSector = MIRROR_SECTOR;
+    g_mfs.JournalBuffer.handle     = JOURNAL_HANDLE;
+    g_mfs.JournalBuffer.length     = (MFS_JOURNAL_TARGETS + 1) * SECTOR_SIZE;
+    g_mfs.JournalBuffer.buffer     = malloc(g_mfs.JournalBuffer.length);
+    g_fileSystem.Disk.descriptor.SectorSize = SECTOR_SIZE;
+    g_fileSystem.ExtensionData     = (uintptr_t*)&g_mfs;
+    assert(g_mfs.JournalBuffer.buffer != NULL);
+
+    TestAllocator();
+    BenchAging();
+    TEST_PASSED("mfs_allocator_bench");
+    return 0;
+}
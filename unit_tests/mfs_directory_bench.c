@@ -0,0 +1,563 @@
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+#include <ctype.h>
+
+#define _InOut_
+#define OsDeviceError        (int)10
+#define OsPathIsNotDirectory (int)11
+#define LODWORD(l)           ((uint32_t)(l))
+#define HIDWORD(l)           ((uint32_t)((uint64_t)(l) >> 32))
+#define DIVUP(a, b)          ((a / b) + (((a % b) > 0) ? 1 : 0))
+#define PACKED_TYPESTRUCT(name, body) typedef struct __attribute__((packed)) name body name##_t
+
+// The host has no monotonic timespec_get
+#define TIME_MONOTONIC             1
+#define timespec_get(ts, base)     clock_gettime(CLOCK_MONOTONIC, ts)
+
+// The parts of the vfs interface the records use
+#define __FILE_CREATE_RECURSIVE    0x00000002
+#define __FILE_DIRECTORY           0x00001000
+#define __FILE_LINK                0x00002000
+#define FILE_FLAG_DIRECTORY        0x00000001
+#define FILE_FLAG_LINK             0x00000002
+#define FILE_PERMISSION_READ       0x00000001
+#define FILE_PERMISSION_WRITE      0x00000002
+#define FILE_PERMISSION_EXECUTE    0x00000004
+
+// A minimal utf8 string, case is ignored for ascii characters like libds does
+#define StrUTF8                    0
+#define MSTRING_NOT_FOUND          -1
+#define MSTRING_NO_MATCH           0
+#define MSTRING_FULL_MATCH         1
+#define MSTRING_PARTIAL_MATCH      2
+
+typedef struct MString {
+    char*  Data;
+    size_t Length;
+} MString_t;
+
+static MString_t*
+MStringCreate(const char* data, int type)
+{
+    MString_t* string = malloc(sizeof(MString_t));
+    assert(string != NULL);
+    string->Length = strlen(data);
+    string->Data   = malloc(string->Length + 1);
+    assert(string->Data != NULL);
+    memcpy(string->Data, data, string->Length + 1);
+    return string;
+}
+
+static MString_t* MStringClone(MString_t* string) { return MStringCreate(string->Data, StrUTF8); }
+static void MStringDestroy(MString_t* string) { if (string) { free(string->Data); free(string); } }
+static const char* MStringRaw(MString_t* string) { return string ? string->Data : NULL; }
+static size_t MStringLength(MString_t* string) { return string->Length; }
+static size_t MStringSize(MString_t* string) { return string->Length; }
+
+static int
+MStringFind(MString_t* string, char character, int start)
+{
+    char* match = strchr(string->Data + start, character);
+    return match ? (int)(match - string->Data) : MSTRING_NOT_FOUND;
+}
+
+static MString_t*
+MStringSubString(MString_t* string, int index, int length)
+{
+    MString_t* sub = MStringCreate("", StrUTF8);
+    free(sub->Data);
+    sub->Data = malloc(length + 1);
+    assert(sub->Data != NULL);
+    memcpy(sub->Data, string->Data + index, length);
+    sub->Data[length] = '\0';
+    sub->Length       = length;
+    return sub;
+}
+
+static int
+MStringCompare(MString_t* first, MString_t* second, int ignoreCase)
+{
+    if (!first->Length || !second->Length || first->Length != second->Length) {
+        return MSTRING_NO_MATCH;
+    }
+    for (size_t i = 0; i < first->Length; i++) {
+        char a = first->Data[i], b = second->Data[i];
+        if (ignoreCase && (unsigned char)a < 0x80) { a = tolower(a); b = tolower(b); }
+        if (a != b) {
+            return MSTRING_NO_MATCH;
+        }
+    }
+    return MSTRING_FULL_MATCH;
+}
+
+// The parts of the ddk the mfs driver uses
+typedef union { uint64_t QuadPart; } LargeUInteger_t;
+
+typedef struct {
+    UUId_t          StorageId;
+    unsigned int    Flags;
+    unsigned int    Permissions;
+    LargeUInteger_t Size;
+} OsFileDescriptor_t;
+
+typedef struct FileSystemEntry {
+    OsFileDescriptor_t Descriptor;
+    MString_t*         Path;
+    MString_t*         Name;
+} FileSystemEntry_t;
+
+typedef struct FileSystemEntryHandle {
+    FileSystemEntry_t* Entry;
+    UUId_t             Id;
+    uint64_t           Position;
+} FileSystemEntryHandle_t;
+
+struct StorageQueue;
+
+typedef struct FileSystemDescriptor {
+    struct {
+        UUId_t driver_id;
+        UUId_t device_id;
+        struct { size_t SectorSize; } descriptor;
+        struct StorageQueue* queue;
+        OsStatus_t (*transfer)(struct StorageQueue*, int, uint64_t, UUId_t, size_t, size_t, size_t*);
+    } Disk;
+    uint64_t   SectorStart;
+    uintptr_t* ExtensionData;
+} FileSystemDescriptor_t;
+
+typedef struct StorageTransferSegment {
+    uint64_t Sector;
+    UUId_t   BufferHandle;
+    size_t   BufferOffset;
+    size_t   SectorCount;
+} StorageTransferSegment_t;
+
+struct dma_attachment {
+    UUId_t handle;
+    void*  buffer;
+    size_t length;
+};
+
+// Transfers go through the request queue of the disk, the storage service is never used
+#define __STORAGE_OPERATION_READ   0
+#define __STORAGE_OPERATION_WRITE  1
+struct vali_link_message { struct { int unused; } base; };
+#define VALI_MSG_INIT_HANDLE(handle)                { { 0 } }
+#define GetGrachtClient()                           NULL
+#define gracht_client_wait_message(...)             abort()
+#define ctt_storage_transfer(...)                   abort()
+#define ctt_storage_transfer_result(...)            abort()
+#define ctt_storage_submit(...)                     abort()
+#define ctt_storage_submit_result(...)              abort()
+#define ctt_storage_poll(...)                       abort()
+#define ctt_storage_poll_result(c, m, status, ...)  (*(status) = OsError, abort())
+
+#include "../modules/filesystems/mfs/bucket_map.c"
+#include "../modules/filesystems/mfs/directory_index.c"
+#include "../modules/filesystems/mfs/records.c"
+#include "../modules/filesystems/mfs/utilities.c"
+
+void MfsInvalidateExtents(MfsEntry_t* Entry) { }
+
+// A 160MB image of 4KB buckets
+#define SECTOR_SIZE        512
+#define SECTORS_PER_BUCKET 8
+#define BUCKET_SIZE        (SECTOR_SIZE * SECTORS_PER_BUCKET)
+#define BUCKET_COUNT       40960
+#define MASTER_SECTOR      4
+#define MIRROR_SECTOR      5
+#define MAP_BUCKET         8
+#define MAP_SIZE           (BUCKET_COUNT * 8)
+#define JOURNAL_BUCKET     (MAP_BUCKET + (MAP_SIZE / BUCKET_SIZE))
+#define ROOT_BUCKET        (JOURNAL_BUCKET + MFS_JOURNALSIZE)
+#define FIRST_FREE         (ROOT_BUCKET + MFS_ROOTSIZE)
+#define IMAGE_SECTORS      (BUCKET_COUNT * SECTORS_PER_BUCKET)
+
+#define BENCH_ENTRIES      100000
+#define LINEAR_SAMPLES     200
+
+#define TRANSFER_HANDLE 1
+#define INDEX_HANDLE    2
+#define JOURNAL_HANDLE  3
+#define MAP_HANDLE      4
+
+static FileSystemDescriptor_t g_fileSystem;
+static MfsInstance_t          g_mfs;
+static uint8_t*               g_disk;
+static uint64_t               g_reads;
+static uint64_t               g_writes;
+
+static uint8_t*
+BufferOf(UUId_t handle)
+{
+    switch (handle) {
+        case TRANSFER_HANDLE: return g_mfs.TransferBuffer.buffer;
+        case INDEX_HANDLE:    return g_mfs.IndexBuffer.buffer;
+        case JOURNAL_HANDLE:  return g_mfs.JournalBuffer.buffer;
+        default:              return (uint8_t*)g_mfs.BucketMap;
+    }
+}
+
+static OsStatus_t
+DiskTransfer(struct StorageQueue* queue, int direction, uint64_t sector, UUId_t bufferHandle,
+             size_t bufferOffset, size_t sectorCount, size_t* sectorsTransferred)
+{
+    assert(sector + sectorCount <= IMAGE_SECTORS);
+    if (direction == __STORAGE_OPERATION_READ) {
+        memcpy(BufferOf(bufferHandle) + bufferOffset, &g_disk[sector * SECTOR_SIZE], sectorCount * SECTOR_SIZE);
+        g_reads++;
+    }
+    else {
+        memcpy(&g_disk[sector * SECTOR_SIZE], BufferOf(bufferHandle) + bufferOffset, sectorCount * SECTOR_SIZE);
+        g_writes++;
+    }
+    *sectorsTransferred = sectorCount;
+    return OsSuccess;
+}
+
+static uint64_t
+Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+// Loads the volume like FsInitialize does, the metadata that was not flushed is lost
+static void
+Mount(void)
+{
+    size_t read;
+
+    free(g_mfs.BucketMap);
+    free(g_mfs.DirtyMap);
+    free(g_mfs.FreeByPosition);
+    free(g_mfs.FreeBySize);
+    g_mfs.FreeByPosition     = NULL;
+    g_mfs.FreeBySize         = NULL;
+    g_mfs.FreeExtentCount    = 0;
+    g_mfs.FreeExtentCapacity = 0;
+    g_mfs.DirtyCount         = 0;
+    g_mfs.MasterRecordDirty  = 0;
+    g_mfs.DirtySince         = 0;
+
+    memcpy(&g_mfs.MasterRecord, &g_disk[MASTER_SECTOR * SECTOR_SIZE], sizeof(MasterRecord_t));
+    assert(MfsReplayJournal(&g_fileSystem) == OsSuccess);
+    g_mfs.BucketMap = malloc(MAP_SIZE);
+    g_mfs.DirtyMap  = calloc(DIVUP(MAP_SIZE, (SECTOR_SIZE * 8)), 1);
+    assert(g_mfs.BucketMap && g_mfs.DirtyMap);
+    assert(MfsReadSectors(&g_fileSystem, MAP_HANDLE, 0, g_mfs.MasterRecord.MapSector,
+                          MAP_SIZE / SECTOR_SIZE, &read) == OsSuccess);
+    assert(MfsBuildFreeIndex(&g_fileSystem) == OsSuccess);
+
+    memset(&g_mfs.RootRecord, 0, sizeof(FileRecord_t));
+    g_mfs.RootRecord.Flags       = MFS_FILERECORD_INUSE | MFS_FILERECORD_SYSTEM | MFS_FILERECORD_DIRECTORY;
+    g_mfs.RootRecord.StartBucket = g_mfs.MasterRecord.RootIndex;
+    g_mfs.RootRecord.StartLength = MFS_ROOTSIZE;
+    if (g_mfs.MasterRecord.RootHashIndex != 0) {
+        g_mfs.RootRecord.Flags    |= MFS_FILERECORD_INDEXED;
+        g_mfs.RootRecord.SparseMap = g_mfs.MasterRecord.RootHashIndex;
+    }
+}
+
+static void
+Format(void)
+{
+    MasterRecord_t master = { 0 };
+    uint32_t*      map;
+
+    memset(g_disk, 0, (size_t)IMAGE_SECTORS * SECTOR_SIZE);
+    map = (uint32_t*)&g_disk[MAP_BUCKET * BUCKET_SIZE];
+    master.Magic        = MFS_BOOTRECORD_MAGIC;
+    master.FreeBucket   = FIRST_FREE;
+    master.RootIndex    = ROOT_BUCKET;
+    master.JournalIndex = JOURNAL_BUCKET;
+    master.MapSector    = MAP_BUCKET * SECTORS_PER_BUCKET;
+    master.MapSize      = MAP_SIZE;
+    memcpy(&g_disk[MASTER_SECTOR * SECTOR_SIZE], &master, sizeof(MasterRecord_t));
+    memcpy(&g_disk[MIRROR_SECTOR * SECTOR_SIZE], &master, sizeof(MasterRecord_t));
+    map[ROOT_BUCKET * 2]       = MFS_ENDOFCHAIN;
+    map[(ROOT_BUCKET * 2) + 1] = MFS_ROOTSIZE;
+    map[FIRST_FREE * 2]        = MFS_ENDOFCHAIN;
+    map[(FIRST_FREE * 2) + 1]  = BUCKET_COUNT - FIRST_FREE;
+    Mount();
+}
+
+static MString_t*
+PathOf(const char* directory, int index)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "%s%sentry-%d", directory, directory[0] ? "/" : "", index);
+    return MStringCreate(path, StrUTF8);
+}
+
+static void
+DestroyEntry(MfsEntry_t* entry)
+{
+    MStringDestroy(entry->Base.Name);
+    free(entry);
+}
+
+static OsStatus_t
+Create(const char* directory, int index, unsigned int flags)
+{
+    MString_t*  path = PathOf(directory, index);
+    MfsEntry_t* entry = NULL;
+    OsStatus_t  osStatus;
+
+    osStatus = MfsCreateRecord(&g_fileSystem, flags, path, &entry);
+    MStringDestroy(path);
+    if (osStatus == OsSuccess) {
+        DestroyEntry(entry);
+    }
+    return osStatus;
+}
+
+static OsStatus_t
+Locate(const char* path, MfsEntry_t* entry)
+{
+    MString_t* string = MStringCreate(path, StrUTF8);
+    OsStatus_t osStatus;
+
+    memset(entry, 0, sizeof(MfsEntry_t));
+    osStatus = MfsLocateRecord(&g_fileSystem, entry, string);
+    MStringDestroy(string);
+    return osStatus;
+}
+
+static int
+Exists(const char* directory, int index)
+{
+    MString_t* path = PathOf(directory, index);
+    MfsEntry_t entry;
+    OsStatus_t osStatus;
+
+    osStatus = Locate(MStringRaw(path), &entry);
+    if (osStatus == OsSuccess) {
+        char expected[32];
+        snprintf(expected, sizeof(expected), "entry-%d", index);
+        assert(strcmp(MStringRaw(entry.Base.Name), expected) == 0);
+        MStringDestroy(entry.Base.Name);
+    }
+    MStringDestroy(path);
+    return osStatus == OsSuccess;
+}
+
+// Deletes the record in the same order as FsDeleteEntry
+static void
+Delete(const char* directory, int index)
+{
+    MString_t* path = PathOf(directory, index);
+    MfsEntry_t entry;
+
+    assert(Locate(MStringRaw(path), &entry) == OsSuccess);
+    if (entry.StartBucket != MFS_ENDOFCHAIN) {
+        assert(MfsFreeBuckets(&g_fileSystem, entry.StartBucket, entry.StartLength) == OsSuccess);
+    }
+    assert(MfsFreeDirectoryIndex(&g_fileSystem, &entry) == OsSuccess);
+    assert(MfsUpdateRecord(&g_fileSystem, &entry, MFS_ACTION_DELETE) == OsSuccess);
+    assert(MfsRemoveIndexedRecord(&g_fileSystem, &entry) == OsSuccess);
+    MStringDestroy(entry.Base.Name);
+    MStringDestroy(path);
+}
+
+// Looks up a name by scanning the directory like drivers without the index do
+static OsStatus_t
+LocateLinear(MfsEntry_t* directory, int index)
+{
+    MfsEntry_t unindexed = *directory;
+    MfsEntry_t result    = { { { 0 } } };
+    char       name[32];
+    MString_t* string;
+    OsStatus_t osStatus;
+
+    snprintf(name, sizeof(name), "entry-%d", index);
+    string              = MStringCreate(name, StrUTF8);
+    unindexed.HashIndex = 0;
+    osStatus = __FindEntryOrFreeInDirectoryBucket(&g_fileSystem, &g_mfs, &unindexed, string, 0, &result, NULL);
+    MStringDestroy(result.Base.Name);
+    MStringDestroy(string);
+    return osStatus;
+}
+
+static uint32_t
+ChainLength(uint32_t bucket)
+{
+    uint32_t length = 0;
+    while (bucket != MFS_ENDOFCHAIN) {
+        MapRecord_t record;
+        assert(MfsGetBucketLink(&g_fileSystem, bucket, &record) == OsSuccess);
+        length += record.Length;
+        bucket  = record.Link;
+    }
+    return length;
+}
+
+static void
+TestIndexedDirectory(void)
+{
+    const int  count = 3000;
+    MfsEntry_t directory;
+    uint32_t   length;
+    MfsEntry_t entry;
+    uint32_t   index;
+
+    Format();
+    assert(Create("", 0, __FILE_DIRECTORY) == OsSuccess);
+    assert(Locate("entry-0", &directory) == OsSuccess);
+    assert(!(directory.NativeFlags & MFS_FILERECORD_INDEXED));
+    MStringDestroy(directory.Base.Name);
+
+    // Creating the directories along the path stays supported
+    assert(Create("entry-0/sub", 1, __FILE_CREATE_RECURSIVE) == OsSuccess);
+    assert(Exists("entry-0/sub", 1));
+
+    for (int i = 0; i < count; i++) {
+        assert(Create("entry-0", i, 0) == OsSuccess);
+        if (i == MFS_DIRECTORYINDEX_THRESHOLD - 3) {
+            assert(Locate("entry-0", &directory) == OsSuccess);
+            assert(!(directory.NativeFlags & MFS_FILERECORD_INDEXED));
+            MStringDestroy(directory.Base.Name);
+        }
+    }
+    assert(Create("entry-0", 7, 0) == OsExists);
+
+    // The directory record references the index once the threshold is passed
+    assert(Locate("entry-0", &directory) == OsSuccess);
+    assert(directory.NativeFlags & MFS_FILERECORD_INDEXED);
+    assert(directory.HashIndex != 0);
+    MStringDestroy(directory.Base.Name);
+
+    for (int i = 0; i < count; i++) {
+        assert(Exists("entry-0", i));
+        assert(LocateLinear(&directory, i) == OsExists);
+    }
+    assert(!Exists("entry-0", count));
+    assert(Locate("ENTRY-0/Entry-17", &entry) == OsSuccess);
+    assert(entry.ParentIndex == directory.HashIndex);
+    MStringDestroy(entry.Base.Name);
+
+    // Deleted records are removed from the index and reused by the next creations
+    length = ChainLength(directory.StartBucket);
+    for (int i = 0; i < count; i += 3) {
+        Delete("entry-0", i);
+    }
+    for (int i = 0; i < count; i++) {
+        assert(Exists("entry-0", i) == ((i % 3) != 0));
+        assert((LocateLinear(&directory, i) == OsExists) == ((i % 3) != 0));
+    }
+    for (int i = count; i < count + (count / 3); i++) {
+        assert(Create("entry-0", i, 0) == OsSuccess);
+    }
+    assert(ChainLength(directory.StartBucket) == length);
+
+    // The index of the root directory is kept in the master-record
+    for (int i = 1; i < MFS_DIRECTORYINDEX_THRESHOLD + 16; i++) {
+        assert(Create("", i, 0) == OsSuccess);
+    }
+    assert(g_mfs.MasterRecord.RootHashIndex != 0);
+    index = g_mfs.MasterRecord.RootHashIndex;
+    assert(MfsFlushMetadata(&g_fileSystem) == OsSuccess);
+    Mount();
+    assert(g_mfs.MasterRecord.RootHashIndex == index);
+    for (int i = 1; i < MFS_DIRECTORYINDEX_THRESHOLD + 16; i++) {
+        assert(Exists("", i));
+    }
+    for (int i = 0; i < count + (count / 3); i++) {
+        assert(Exists("entry-0", i) == ((i % 3) != 0 || i >= count));
+    }
+
+    // Deleting an indexed directory releases its index
+    Delete("", 0);
+    assert(!Exists("entry-0", 1));
+    printf("mfs_directory_bench: indexed directory tests passed\n");
+}
+
+static void
+BenchLargeDirectory(void)
+{
+    MfsEntry_t directory;
+    uint64_t   reads, writes, start, elapsed;
+    uint64_t   linearReads = 0, linearTime = 0;
+    unsigned   seed = 1;
+
+    Format();
+    assert(Create("", 0, __FILE_DIRECTORY) == OsSuccess);
+
+    reads  = g_reads;
+    writes = g_writes;
+    start  = Now();
+    for (int i = 0; i < BENCH_ENTRIES; i++) {
+        assert(Create("entry-0", i, 0) == OsSuccess);
+    }
+    elapsed = Now() - start;
+    printf("create %d entries: %6.2f us, %5.2f reads, %5.2f writes per entry\n", BENCH_ENTRIES,
+           (double)elapsed / BENCH_ENTRIES / 1000.0, (double)(g_reads - reads) / BENCH_ENTRIES,
+           (double)(g_writes - writes) / BENCH_ENTRIES);
+
+    assert(Locate("entry-0", &directory) == OsSuccess);
+    assert(directory.NativeFlags & MFS_FILERECORD_INDEXED);
+    MStringDestroy(directory.Base.Name);
+
+    reads = g_reads;
+    start = Now();
+    for (int i = 0; i < BENCH_ENTRIES; i++) {
+        assert(Exists("entry-0", i));
+    }
+    elapsed = Now() - start;
+    printf("indexed lookup: %6.2f us, %5.2f reads per lookup\n",
+           (double)elapsed / BENCH_ENTRIES / 1000.0, (double)(g_reads - reads) / BENCH_ENTRIES);
+    reads = g_reads;
+    start = Now();
+    for (int i = 0; i < BENCH_ENTRIES; i++) {
+        assert(!Exists("entry-0", BENCH_ENTRIES + i));
+    }
+    elapsed = Now() - start;
+    printf("indexed miss:   %6.2f us, %5.2f reads per lookup\n",
+           (double)elapsed / BENCH_ENTRIES / 1000.0, (double)(g_reads - reads) / BENCH_ENTRIES);
+
+    // Scanning is measured on a sample, every creation had to scan the whole directory
+    for (int i = 0; i < LINEAR_SAMPLES; i++) {
+        int index = rand_r(&seed) % BENCH_ENTRIES;
+        reads = g_reads;
+        start = Now();
+        assert(LocateLinear(&directory, index) == OsExists);
+        linearTime  += Now() - start;
+        linearReads += g_reads - reads;
+    }
+    printf("linear lookup:  %6.2f us, %5.2f reads per lookup\n",
+           (double)linearTime / LINEAR_SAMPLES / 1000.0, (double)linearReads / LINEAR_SAMPLES);
+}
+
+int main(void)
+{
+    g_disk = malloc((size_t)IMAGE_SECTORS * SECTOR_SIZE);
+    assert(g_disk != NULL);
+
+    g_mfs.SectorsPerBucket         = SECTORS_PER_BUCKET;
+    g_mfs.BucketCount              = BUCKET_COUNT;
+    g_mfs.BucketsPerSectorInMap    = SECTOR_SIZE / 8;
+    g_mfs.MasterRecordSector       = MASTER_SECTOR;
+    g_mfs.MasterRecordMirrorSector = MIRROR_SECTOR;
+    g_mfs.TransferBuffer.handle    = TRANSFER_HANDLE;
+    g_mfs.TransferBuffer.length    = BUCKET_SIZE * MFS_ROOTSIZE;
+    g_mfs.TransferBuffer.buffer    = malloc(g_mfs.TransferBuffer.length);
+    g_mfs.IndexBuffer.handle       = INDEX_HANDLE;
+    g_mfs.IndexBuffer.length       = BUCKET_SIZE;
+    g_mfs.IndexBuffer.buffer       = malloc(g_mfs.IndexBuffer.length);
+    g_mfs.JournalBuffer.handle     = JOURNAL_HANDLE;
+    g_mfs.JournalBuffer.length     = (MFS_JOURNAL_TARGETS + 1) * SECTOR_SIZE;
+    g_mfs.JournalBuffer.buffer     = malloc(g_mfs.JournalBuffer.length);
+    g_fileSystem.Disk.descriptor.SectorSize = SECTOR_SIZE;
+    g_fileSystem.Disk.transfer     = DiskTransfer;
+    g_fileSystem.ExtensionData     = (uintptr_t*)&g_mfs;
+    assert(g_mfs.TransferBuffer.buffer && g_mfs.IndexBuffer.buffer && g_mfs.JournalBuffer.buffer);
+
+    TestIndexedDirectory();
+    BenchLargeDirectory();
+    TEST_PASSED("mfs_directory_bench");
+    return 0;
+}
@@ -0,0 +1,445 @@
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+
+#define _InOut_
+#define OsDeviceError  (int)10
+#define LODWORD(l)     ((uint32_t)(l))
+#define DIVUP(a, b)    ((a / b) + (((a % b) > 0) ? 1 : 0))
+#define PACKED_TYPESTRUCT(name, body) typedef struct __attribute__((packed)) name body name##_t
+
+#define FILE_FLAG_DIRECTORY       0x00000001
+#define __STORAGE_OPERATION_READ  0x00000001
+#define __STORAGE_OPERATION_WRITE 0x00000002
+
+// The parts of the ddk the mfs header and file operations use
+typedef struct MString MString_t;
+#define MStringRaw(String) "test-file"
+
+typedef union { uint64_t QuadPart; } LargeUInteger_t;
+
+typedef struct {
+    unsigned int    Flags;
+    LargeUInteger_t Size;
+} OsFileDescriptor_t;
+
+typedef struct FileSystemEntry {
+    OsFileDescriptor_t Descriptor;
+    MString_t*         Path;
+    MString_t*         Name;
+} FileSystemEntry_t;
+
+typedef struct FileSystemEntryHandle {
+    FileSystemEntry_t* Entry;
+    UUId_t             Id;
+    uint64_t           Position;
+} FileSystemEntryHandle_t;
+
+typedef struct FileSystemDescriptor {
+    struct { struct { size_t SectorSize; } descriptor; } Disk;
+    uintptr_t* ExtensionData;
+} FileSystemDescriptor_t;
+
+typedef struct StorageTransferSegment {
+    uint64_t Sector;
+    UUId_t   BufferHandle;
+    size_t   BufferOffset;
+    size_t   SectorCount;
+} StorageTransferSegment_t;
+
+struct dma_attachment {
+    UUId_t handle;
+    void*  buffer;
+    size_t length;
+};
+
+#include "../modules/filesystems/mfs/extents.c"
+#include "../modules/filesystems/mfs/file_operations.c"
+
+// A 1GB image of 4KB buckets, nearly all of it is a single file made of
+// small runs of buckets in random order
+#define SECTOR_SIZE        512
+#define SECTORS_PER_BUCKET 8
+#define BUCKET_SIZE        (SECTOR_SIZE * SECTORS_PER_BUCKET)
+#define BUCKET_COUNT       ((1024 * 1024 * 1024) / BUCKET_SIZE)
+#define MAX_RUN            8
+#define SEEK_COUNT         2000
+#define READ_SIZE          4096
+
+#define TRANSFER_HANDLE 1
+#define USER_HANDLE     2
+
+typedef struct Run {
+    uint32_t Bucket;
+    uint32_t Length;
+} Run_t;
+
+static FileSystemDescriptor_t g_fileSystem;
+static MfsInstance_t          g_mfs;
+static uint32_t*              g_fileBuckets;  // Disk bucket of every bucket of the file
+static uint32_t               g_fileLength;   // In buckets
+static uint8_t*               g_userBuffer;
+static uint64_t               g_linkLookups;
+static int                    g_freeCalls;
+static int                    g_failTransfers;
+
+// The disk contents are not stored, every 8 bytes of a sector hold the sector number
+static void
+FillFromDisk(UUId_t handle, size_t offset, uint64_t sector, size_t count)
+{
+    uint8_t*  buffer = (handle == TRANSFER_HANDLE) ? (uint8_t*)g_mfs.TransferBuffer.buffer : g_userBuffer;
+    uint64_t* words  = (uint64_t*)(buffer + offset);
+    size_t    i;
+
+    assert(sector + count <= (uint64_t)BUCKET_COUNT * SECTORS_PER_BUCKET);
+    for (i = 0; i < (count * SECTOR_SIZE) / sizeof(uint64_t); i++) {
+        words[i] = sector + (i / (SECTOR_SIZE / sizeof(uint64_t)));
+    }
+}
+
+OsStatus_t
+MfsReadSectors(FileSystemDescriptor_t* FileSystem, UUId_t BufferHandle, size_t BufferOffset,
+               uint64_t Sector, size_t Count, size_t* SectorsRead)
+{
+    FillFromDisk(BufferHandle, BufferOffset, Sector, Count);
+    *SectorsRead = Count;
+    return OsSuccess;
+}
+
+OsStatus_t
+MfsWriteSectors(FileSystemDescriptor_t* FileSystem, UUId_t BufferHandle, size_t BufferOffset,
+                uint64_t Sector, size_t Count, size_t* SectorsWritten)
+{
+    *SectorsWritten = Count;
+    return OsSuccess;
+}
+
+OsStatus_t
+MfsTransferSegments(FileSystemDescriptor_t* FileSystem, int Direction,
+                    StorageTransferSegment_t* Segments, size_t Count, size_t* SectorsTransferred)
+{
+    size_t i;
+
+    *SectorsTransferred = 0;
+    if (g_failTransfers) {
+        return OsDeviceError;
+    }
+    for (i = 0; i < Count; i++) {
+        FillFromDisk(Segments[i].BufferHandle, Segments[i].BufferOffset, Segments[i].Sector, Segments[i].SectorCount);
+        *SectorsTransferred += Segments[i].SectorCount;
+    }
+    return OsSuccess;
+}
+
+OsStatus_t
+MfsGetBucketLink(FileSystemDescriptor_t* FileSystem, uint32_t Bucket, MapRecord_t* Link)
+{
+    MfsInstance_t* Mfs = (MfsInstance_t*)FileSystem->ExtensionData;
+
+    g_linkLookups++;
+    if (Bucket < Mfs->BucketCount) {
+        Link->Link   = Mfs->BucketMap[(Bucket * 2)];
+        Link->Length = Mfs->BucketMap[(Bucket * 2) + 1];
+        return OsSuccess;
+    }
+    return OsInvalidParameters;
+}
+
+OsStatus_t
+MfsEnsureRecordSpace(FileSystemDescriptor_t* FileSystem, MfsEntry_t* Entry, uint64_t SpaceRequired)
+{
+    return SpaceRequired <= Entry->AllocatedSize ? OsSuccess : OsDeviceError;
+}
+
+OsStatus_t
+MfsFreeBuckets(FileSystemDescriptor_t* FileSystem, uint32_t StartBucket, uint32_t StartLength)
+{
+    g_freeCalls++;
+    return OsSuccess;
+}
+
+// The seek used before the extent index, it follows the chain from the start of the file
+static OsStatus_t
+ChainWalkSeek(
+    _In_ FileSystemDescriptor_t* FileSystem,
+    _In_ MfsEntryHandle_t*       Handle,
+    _In_ uint64_t                AbsolutePosition)
+{
+    MfsEntry_t* Entry             = (MfsEntry_t*)Handle->Base.Entry;
+    uint64_t    PositionBoundLow  = 0;
+    uint64_t    PositionBoundHigh = (uint64_t)Entry->StartLength * BUCKET_SIZE;
+    uint32_t    BucketPtr         = Entry->StartBucket;
+    uint32_t    BucketLength      = Entry->StartLength;
+    MapRecord_t Link;
+
+    while (!(AbsolutePosition >= PositionBoundLow && AbsolutePosition < (PositionBoundLow + PositionBoundHigh))) {
+        if (MfsGetBucketLink(FileSystem, BucketPtr, &Link) != OsSuccess) {
+            return OsDeviceError;
+        }
+        if (Link.Link == MFS_ENDOFCHAIN) {
+            break;
+        }
+        BucketPtr = Link.Link;
+        if (MfsGetBucketLink(FileSystem, BucketPtr, &Link) != OsSuccess) {
+            return OsDeviceError;
+        }
+        BucketLength      = Link.Length;
+        PositionBoundLow += PositionBoundHigh;
+        PositionBoundHigh = (uint64_t)BucketLength * BUCKET_SIZE;
+    }
+
+    Handle->DataBucketPosition = BucketPtr;
+    Handle->DataBucketLength   = BucketLength;
+    Handle->BucketByteBoundary = PositionBoundLow;
+    Handle->Base.Position      = AbsolutePosition;
+    return OsSuccess;
+}
+
+// Splits the buckets after the first into runs and links them in random order
+static void
+BuildImage(MfsEntry_t* entry, uint32_t* runCount)
+{
+    Run_t*       runs   = malloc(sizeof(Run_t) * BUCKET_COUNT);
+    unsigned int seed   = 1234;
+    uint32_t     count  = 0;
+    uint32_t     bucket = 1;
+    uint32_t     i, j;
+
+    assert(runs != NULL);
+    while (bucket < BUCKET_COUNT) {
+        uint32_t length = 1 + (rand_r(&seed) % MAX_RUN);
+        runs[count].Bucket = bucket;
+        runs[count].Length = MIN(length, BUCKET_COUNT - bucket);
+        count++;
+        bucket += runs[count - 1].Length;
+    }
+
+    for (i = count - 1; i > 0; i--) {
+        Run_t swap;
+        j = rand_r(&seed) % (i + 1);
+        swap    = runs[i];
+        runs[i] = runs[j];
+        runs[j] = swap;
+    }
+
+    g_fileLength = 0;
+    for (i = 0; i < count; i++) {
+        g_mfs.BucketMap[runs[i].Bucket * 2]       = (i + 1 < count) ? runs[i + 1].Bucket : MFS_ENDOFCHAIN;
+        g_mfs.BucketMap[(runs[i].Bucket * 2) + 1] = runs[i].Length;
+        for (j = 0; j < runs[i].Length; j++) {
+            g_fileBuckets[g_fileLength++] = runs[i].Bucket + j;
+        }
+    }
+
+    memset(entry, 0, sizeof(MfsEntry_t));
+    entry->StartBucket                   = runs[0].Bucket;
+    entry->StartLength                   = runs[0].Length;
+    entry->AllocatedSize                 = (uint64_t)g_fileLength * BUCKET_SIZE;
+    entry->Base.Descriptor.Size.QuadPart = entry->AllocatedSize;
+    *runCount = count;
+    free(runs);
+}
+
+static void
+OpenHandle(MfsEntry_t* entry, MfsEntryHandle_t* handle)
+{
+    memset(handle, 0, sizeof(MfsEntryHandle_t));
+    handle->Base.Entry         = &entry->Base;
+    handle->DataBucketPosition = entry->StartBucket;
+    handle->DataBucketLength   = entry->StartLength;
+}
+
+static int
+CheckRead(uint64_t position, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        uint64_t offset   = position + i;
+        uint64_t sector   = ((uint64_t)g_fileBuckets[offset / BUCKET_SIZE] * SECTORS_PER_BUCKET) +
+                            ((offset % BUCKET_SIZE) / SECTOR_SIZE);
+        uint8_t  expected = (uint8_t)(sector >> ((offset % sizeof(uint64_t)) * 8));
+        if (g_userBuffer[i] != expected) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void
+TestSequentialRead(MfsEntry_t* entry)
+{
+    MfsEntryHandle_t handle;
+    size_t           read;
+    uint64_t         position = 0;
+    int              i;
+
+    // Odd sizes cross both sector and bucket boundaries
+    OpenHandle(entry, &handle);
+    for (i = 0; i < 4096; i++) {
+        size_t length = 1 + (size_t)((i * 7919) % (3 * BUCKET_SIZE));
+        assert(FsReadFromFile(&g_fileSystem, &handle, USER_HANDLE, g_userBuffer, 0, length, &read) == OsSuccess);
+        assert(read == length);
+        assert(CheckRead(position, length));
+        position            += read;
+        handle.Base.Position = position;
+    }
+    MfsInvalidateExtents(entry);
+    printf("sequential read: ok\n");
+}
+
+static void
+TestSeekEdges(MfsEntry_t* entry)
+{
+    MfsEntryHandle_t handle;
+    MfsEntry_t       empty;
+    size_t           read;
+    uint64_t         size = entry->Base.Descriptor.Size.QuadPart;
+
+    // The last byte of the file, and a position past the chain
+    OpenHandle(entry, &handle);
+    assert(FsSeekInFile(&g_fileSystem, &handle, size - 1) == OsSuccess);
+    assert(handle.DataBucketPosition == g_fileBuckets[g_fileLength - 1] - (handle.DataBucketLength - 1));
+    assert(FsReadFromFile(&g_fileSystem, &handle, USER_HANDLE, g_userBuffer, 0, 16, &read) == OsSuccess);
+    assert(read == 1 && CheckRead(size - 1, 1));
+
+    assert(FsSeekInFile(&g_fileSystem, &handle, 0) == OsSuccess);
+    assert(FsSeekInFile(&g_fileSystem, &handle, size + (16 * BUCKET_SIZE)) == OsSuccess);
+    assert(handle.BucketByteBoundary == size - ((uint64_t)handle.DataBucketLength * BUCKET_SIZE));
+    assert(handle.Base.Position == size + (16 * BUCKET_SIZE));
+
+    // A file without buckets
+    memset(&empty, 0, sizeof(MfsEntry_t));
+    empty.StartBucket = MFS_ENDOFCHAIN;
+    OpenHandle(&empty, &handle);
+    assert(FsSeekInFile(&g_fileSystem, &handle, 0) == OsSuccess);
+    assert(handle.DataBucketPosition == MFS_ENDOFCHAIN && empty.ExtentCount == 0);
+    printf("seek edges: ok\n");
+}
+
+static void
+TestFailedRead(MfsEntry_t* entry)
+{
+    MfsEntryHandle_t handle;
+    uint64_t         position = ((uint64_t)entry->StartLength - 1) * BUCKET_SIZE;
+    size_t           read;
+
+    // The batch covers the end of the first run and the start of the next, so the
+    // handle has moved on to the next run when the batch fails
+    OpenHandle(entry, &handle);
+    handle.Base.Position = position;
+    g_failTransfers = 1;
+    assert(FsReadFromFile(&g_fileSystem, &handle, USER_HANDLE, g_userBuffer, 0, 2 * BUCKET_SIZE, &read) == OsDeviceError);
+    g_failTransfers = 0;
+    assert(read == 0);
+    assert(handle.BucketByteBoundary <= position &&
+           position < handle.BucketByteBoundary + ((uint64_t)handle.DataBucketLength * BUCKET_SIZE));
+
+    // The handle continues from what was actually read
+    assert(FsReadFromFile(&g_fileSystem, &handle, USER_HANDLE, g_userBuffer, 0, 2 * BUCKET_SIZE, &read) == OsSuccess);
+    assert(read == 2 * BUCKET_SIZE && CheckRead(position, read));
+    printf("failed read: ok\n");
+}
+
+static void
+TestInvalidation(MfsEntry_t* entry)
+{
+    MfsEntryHandle_t handle;
+    MfsEntry_t       copy;
+    uint64_t         lookups;
+
+    OpenHandle(entry, &handle);
+    assert(FsSeekInFile(&g_fileSystem, &handle, entry->Base.Descriptor.Size.QuadPart - 1) == OsSuccess);
+    assert(entry->ExtentCount > 1);
+
+    // A seek that is served from the index does not touch the map
+    lookups = g_linkLookups;
+    assert(FsSeekInFile(&g_fileSystem, &handle, entry->Base.Descriptor.Size.QuadPart / 2) == OsSuccess);
+    assert(g_linkLookups == lookups);
+
+    // Truncating frees the chain and the index
+    memcpy(&copy, entry, sizeof(MfsEntry_t));
+    assert(FsChangeFileSize(&g_fileSystem, &copy.Base, 0) == OsSuccess);
+    assert(g_freeCalls == 1);
+    assert(copy.Extents == NULL && copy.ExtentCount == 0 && copy.StartBucket == MFS_ENDOFCHAIN);
+    OpenHandle(&copy, &handle);
+    assert(FsSeekInFile(&g_fileSystem, &handle, 4096) == OsSuccess);
+    assert(handle.DataBucketPosition == MFS_ENDOFCHAIN);
+    entry->Extents = NULL;
+    entry->ExtentCount = 0;
+    entry->ExtentCapacity = 0;
+    printf("invalidation: ok\n");
+}
+
+static double
+RandomSeekRead(MfsEntry_t* entry, int indexed, uint64_t* lookups)
+{
+    MfsEntryHandle_t   handle;
+    unsigned int       seed  = 99;
+    uint64_t           size  = entry->Base.Descriptor.Size.QuadPart;
+    unsigned long long start, end;
+    size_t             read;
+    int                i;
+
+    OpenHandle(entry, &handle);
+    g_linkLookups = 0;
+    start = NowNs();
+    for (i = 0; i < SEEK_COUNT; i++) {
+        uint64_t position = (((uint64_t)rand_r(&seed) << 16) ^ (uint64_t)rand_r(&seed)) % (size - READ_SIZE);
+        if (indexed) {
+            assert(FsSeekInFile(&g_fileSystem, &handle, position) == OsSuccess);
+        }
+        else {
+            assert(ChainWalkSeek(&g_fileSystem, &handle, position) == OsSuccess);
+        }
+        assert(FsReadFromFile(&g_fileSystem, &handle, USER_HANDLE, g_userBuffer, 0, READ_SIZE, &read) == OsSuccess);
+        assert(read == READ_SIZE);
+        assert(CheckRead(position, READ_SIZE));
+    }
+    end = NowNs();
+    *lookups = g_linkLookups;
+    return (double)(end - start) / (double)SEEK_COUNT;
+}
+
+int main(void)
+{
+    MfsEntry_t entry;
+    uint32_t   runCount;
+    uint64_t   walkLookups, indexLookups;
+    double     walk, indexed;
+
+    g_mfs.SectorsPerBucket         = SECTORS_PER_BUCKET;
+    g_mfs.BucketCount              = BUCKET_COUNT;
+    g_mfs.BucketMap                = calloc((size_t)BUCKET_COUNT * 2, sizeof(uint32_t));
+    g_mfs.TransferBuffer.handle    = TRANSFER_HANDLE;
+    g_mfs.TransferBuffer.length    = 0x10000;
+    g_mfs.TransferBuffer.buffer    = malloc(g_mfs.TransferBuffer.length);
+    g_fileSystem.Disk.descriptor.SectorSize = SECTOR_SIZE;
+    g_fileSystem.ExtensionData     = (uintptr_t*)&g_mfs;
+    g_fileBuckets                  = malloc(sizeof(uint32_t) * BUCKET_COUNT);
+    g_userBuffer                   = malloc(4 * BUCKET_SIZE);
+    assert(g_mfs.BucketMap && g_mfs.TransferBuffer.buffer && g_fileBuckets && g_userBuffer);
+
+    BuildImage(&entry, &runCount);
+    printf("image: %u buckets of %u bytes in %u runs\n", g_fileLength, BUCKET_SIZE, runCount);
+
+    TestSequentialRead(&entry);
+    TestSeekEdges(&entry);
+    TestFailedRead(&entry);
+    MfsInvalidateExtents(&entry);
+    TestInvalidation(&entry);
+
+    walk    = RandomSeekRead(&entry, 0, &walkLookups);
+    indexed = RandomSeekRead(&entry, 1, &indexLookups);
+    printf("random seek+read of %u bytes, %d times\n", READ_SIZE, SEEK_COUNT);
+    printf("  chain walk:   %10.1f ns per seek+read, %llu map lookups\n", walk, (unsigned long long)walkLookups);
+    printf("  extent index: %10.1f ns per seek+read, %llu map lookups (%zu extents)\n",
+           indexed, (unsigned long long)indexLookups, entry.ExtentCount);
+    printf("  %.1fx faster\n", walk / indexed);
+    assert(indexLookups < walkLookups / 100);
+
+    MfsInvalidateExtents(&entry);
+    TEST_PASSED("mfs_extent_test");
+    return 0;
+}
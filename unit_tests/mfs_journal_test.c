@@ -0,0 +1,477 @@
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+#include <setjmp.h>
+
+#define _InOut_
+#define OsDeviceError  (int)10
+#define LODWORD(l)     ((uint32_t)(l))
+#define DIVUP(a, b)    ((a / b) + (((a % b) > 0) ? 1 : 0))
+#define PACKED_TYPESTRUCT(name, body) typedef struct __attribute__((packed)) name body name##_t
+
+// The host has no monotonic timespec_get
+#define TIME_MONOTONIC             1
+#define timespec_get(ts, base)     clock_gettime(CLOCK_MONOTONIC, ts)
+
+// The parts of the ddk the mfs header uses
+typedef struct MString MString_t;
+typedef union { uint64_t QuadPart; } LargeUInteger_t;
+
+typedef struct {
+    unsigned int    Flags;
+    LargeUInteger_t Size;
+} OsFileDescriptor_t;
+
+typedef struct FileSystemEntry {
+    OsFileDescriptor_t Descriptor;
+    MString_t*         Path;
+    MString_t*         Name;
+} FileSystemEntry_t;
+
+typedef struct FileSystemEntryHandle {
+    FileSystemEntry_t* Entry;
+    UUId_t             Id;
+    uint64_t           Position;
+} FileSystemEntryHandle_t;
+
+typedef struct FileSystemDescriptor {
+    struct { struct { size_t SectorSize; } descriptor; } Disk;
+    uintptr_t* ExtensionData;
+} FileSystemDescriptor_t;
+
+typedef struct StorageTransferSegment {
+    uint64_t Sector;
+    UUId_t   BufferHandle;
+    size_t   BufferOffset;
+    size_t   SectorCount;
+} StorageTransferSegment_t;
+
+struct dma_attachment {
+    UUId_t handle;
+    void*  buffer;
+    size_t length;
+};
+
+#include "../modules/filesystems/mfs/bucket_map.c"
+
+// A 16MB image of 2KB buckets. Only the metadata area is kept in memory, the
+// bucket map code never touches the data buckets.
+#define SECTOR_SIZE        512
+#define SECTORS_PER_BUCKET 4
+#define BUCKET_COUNT       8192
+#define MASTER_SECTOR      4
+#define MIRROR_SECTOR      5
+#define MAP_BUCKET         8
+#define MAP_SIZE           (BUCKET_COUNT * 8)
+#define JOURNAL_BUCKET     (MAP_BUCKET + (MAP_SIZE / (SECTOR_SIZE * SECTORS_PER_BUCKET)))
+#define FIRST_FREE         (JOURNAL_BUCKET + MFS_JOURNALSIZE)
+#define IMAGE_SECTORS      (FIRST_FREE * SECTORS_PER_BUCKET)
+
+#define WORKLOAD_OPS       400
+#define SYNC_INTERVAL      32
+#define MAX_FILES          256
+#define MAX_ALLOCATED      (BUCKET_COUNT / 2)
+
+#define JOURNAL_HANDLE 1
+#define MAP_HANDLE     2
+
+typedef struct File {
+    uint32_t Start;
+    uint32_t Buckets;
+} File_t;
+
+typedef struct Snapshot {
+    uint32_t       Map[BUCKET_COUNT * 2];
+    MasterRecord_t Master;
+    File_t         Files[MAX_FILES];
+    int            FileCount;
+} Snapshot_t;
+
+static FileSystemDescriptor_t g_fileSystem;
+static MfsInstance_t          g_mfs;
+static uint8_t                g_disk[IMAGE_SECTORS * SECTOR_SIZE];
+static uint8_t                g_saved[IMAGE_SECTORS * SECTOR_SIZE];
+static File_t                 g_files[MAX_FILES];
+static int                    g_fileCount;
+static Snapshot_t             g_durable;
+static Snapshot_t             g_crashed;
+
+static jmp_buf  g_crashPoint;
+static int      g_trackDurable;
+static uint64_t g_crashAt;
+static uint64_t g_writes;
+static uint64_t g_writeSectors;
+
+static void TakeSnapshot(Snapshot_t* snapshot);
+
+static uint8_t*
+BufferOf(UUId_t handle)
+{
+    return handle == JOURNAL_HANDLE ? (uint8_t*)g_mfs.JournalBuffer.buffer : (uint8_t*)g_mfs.BucketMap;
+}
+
+OsStatus_t
+MfsReadSectors(FileSystemDescriptor_t* FileSystem, UUId_t BufferHandle, size_t BufferOffset,
+               uint64_t Sector, size_t Count, size_t* SectorsRead)
+{
+    assert(Sector + Count <= IMAGE_SECTORS);
+    memcpy(BufferOf(BufferHandle) + BufferOffset, &g_disk[Sector * SECTOR_SIZE], Count * SECTOR_SIZE);
+    *SectorsRead = Count;
+    return OsSuccess;
+}
+
+// A crash tears the write, only the first half of the sectors reach the disk
+OsStatus_t
+MfsWriteSectors(FileSystemDescriptor_t* FileSystem, UUId_t BufferHandle, size_t BufferOffset,
+                uint64_t Sector, size_t Count, size_t* SectorsWritten)
+{
+    size_t written = Count;
+
+    assert(Sector + Count <= IMAGE_SECTORS);
+    g_writes++;
+    if (g_crashAt && g_writes == g_crashAt) {
+        written = Count / 2;
+    }
+
+    memcpy(&g_disk[Sector * SECTOR_SIZE], BufferOf(BufferHandle) + BufferOffset, written * SECTOR_SIZE);
+    if (written != Count) {
+        longjmp(g_crashPoint, 1);
+    }
+    g_writeSectors += Count;
+    *SectorsWritten = Count;
+
+    // Every completed flush makes the current state the one a crash must fall back to
+    if (g_trackDurable && Sector == JOURNAL_BUCKET * SECTORS_PER_BUCKET &&
+        ((JournalHeader_t*)g_mfs.JournalBuffer.buffer)->Count == 0) {
+        TakeSnapshot(&g_durable);
+    }
+    return OsSuccess;
+}
+
+static void
+Format(int journal)
+{
+    MasterRecord_t master = { 0 };
+    uint32_t*      map    = (uint32_t*)&g_disk[MAP_BUCKET * SECTORS_PER_BUCKET * SECTOR_SIZE];
+
+    memset(g_disk, 0, sizeof(g_disk));
+    master.Magic        = MFS_BOOTRECORD_MAGIC;
+    master.FreeBucket   = FIRST_FREE;
+    master.JournalIndex = journal ? JOURNAL_BUCKET : 0;
+    master.MapSector    = MAP_BUCKET * SECTORS_PER_BUCKET;
+    master.MapSize      = MAP_SIZE;
+    memcpy(&g_disk[MASTER_SECTOR * SECTOR_SIZE], &master, sizeof(MasterRecord_t));
+    memcpy(&g_disk[MIRROR_SECTOR * SECTOR_SIZE], &master, sizeof(MasterRecord_t));
+
+    map[FIRST_FREE * 2]       = MFS_ENDOFCHAIN;
+    map[(FIRST_FREE * 2) + 1] = BUCKET_COUNT - FIRST_FREE;
+}
+
+// The same order as FsInitialize, the journal is replayed before the map is loaded
+static void
+Mount(void)
+{
+    size_t read;
+
+    g_trackDurable = 0;
+    free(g_mfs.BucketMap);
+    free(g_mfs.DirtyMap);
+    memset(&g_mfs.MasterRecord, 0, sizeof(MasterRecord_t));
+    g_mfs.BucketMap         = NULL;
+    g_mfs.DirtyMap          = NULL;
+    g_mfs.DirtyCount        = 0;
+    g_mfs.MasterRecordDirty = 0;
+    g_mfs.DirtySince        = 0;
+
+    memcpy(&g_mfs.MasterRecord, &g_disk[MASTER_SECTOR * SECTOR_SIZE], sizeof(MasterRecord_t));
+    assert(g_mfs.MasterRecord.Magic == MFS_BOOTRECORD_MAGIC);
+    assert(MfsReplayJournal(&g_fileSystem) == OsSuccess);
+
+    g_mfs.BucketMap = malloc(MAP_SIZE);
+    g_mfs.DirtyMap  = calloc(DIVUP(MAP_SIZE, (SECTOR_SIZE * 8)), 1);
+    assert(g_mfs.BucketMap && g_mfs.DirtyMap);
+    assert(MfsReadSectors(&g_fileSystem, MAP_HANDLE, 0, g_mfs.MasterRecord.MapSector,
+                          MAP_SIZE / SECTOR_SIZE, &read) == OsSuccess);
+    assert(MfsBuildFreeIndex(&g_fileSystem) == OsSuccess);
+}
+
+static void
+TakeSnapshot(Snapshot_t* snapshot)
+{
+    memcpy(snapshot->Map, g_mfs.BucketMap, MAP_SIZE);
+    memcpy(&snapshot->Master, &g_mfs.MasterRecord, sizeof(MasterRecord_t));
+    memcpy(snapshot->Files, g_files, sizeof(File_t) * g_fileCount);
+    snapshot->FileCount = g_fileCount;
+}
+
+static uint32_t
+AllocatedBuckets(void)
+{
+    uint32_t count = 0;
+    int      i;
+
+    for (i = 0; i < g_fileCount; i++) {
+        count += g_files[i].Buckets;
+    }
+    return count;
+}
+
+// Files are created, deleted and grown like MfsEnsureRecordSpace does, the list
+// of files is only updated when a record would be written
+static void
+RunWorkload(unsigned int seed, int ops)
+{
+    MapRecord_t record, link;
+    int         i;
+
+    g_trackDurable = 1;
+    for (i = 0; i < ops; i++) {
+        int      action  = rand_r(&seed) % 10;
+        uint32_t buckets = 1 + (rand_r(&seed) % 24);
+
+        if (g_fileCount && (action >= 8 || g_fileCount == MAX_FILES ||
+                            AllocatedBuckets() + buckets > MAX_ALLOCATED)) {
+            int    index = rand_r(&seed) % g_fileCount;
+            File_t file  = g_files[index];
+
+            g_files[index] = g_files[--g_fileCount];
+            assert(MfsFreeBuckets(&g_fileSystem, file.Start, 1) == OsSuccess);
+        }
+        else if (g_fileCount && action >= 5) {
+            int      index = rand_r(&seed) % g_fileCount;
+            uint32_t last  = g_files[index].Start;
+
+            assert(MfsGetBucketLink(&g_fileSystem, last, &link) == OsSuccess);
+            while (link.Link != MFS_ENDOFCHAIN) {
+                last = link.Link;
+                assert(MfsGetBucketLink(&g_fileSystem, last, &link) == OsSuccess);
+            }
+
+            // Buckets that continue the last run extend it
+            assert(MfsAllocateBuckets(&g_fileSystem, last + link.Length, buckets, &record) == OsSuccess);
+            if (record.Link == last + link.Length) {
+                MapRecord_t continued;
+                assert(MfsGetBucketLink(&g_fileSystem, record.Link, &continued) == OsSuccess);
+                link.Link    = continued.Link;
+                link.Length += continued.Length;
+                assert(MfsSetBucketLink(&g_fileSystem, last, &link, 1) == OsSuccess);
+            }
+            else {
+                assert(MfsSetBucketLink(&g_fileSystem, last, &record, 0) == OsSuccess);
+            }
+            g_files[index].Buckets += buckets;
+        }
+        else {
+            assert(MfsAllocateBuckets(&g_fileSystem, MFS_ENDOFCHAIN, buckets, &record) == OsSuccess);
+            g_files[g_fileCount].Start   = record.Link;
+            g_files[g_fileCount].Buckets = buckets;
+            g_fileCount++;
+        }
+
+        if ((i % SYNC_INTERVAL) == (SYNC_INTERVAL - 1)) {
+            assert(MfsFlushMetadata(&g_fileSystem) == OsSuccess);
+        }
+    }
+}
+
+static void
+MarkRun(uint8_t* used, uint32_t bucket, uint32_t length)
+{
+    uint32_t i;
+
+    assert(length > 0 && bucket >= FIRST_FREE && bucket + length <= BUCKET_COUNT);
+    for (i = bucket; i < bucket + length; i++) {
+        assert(!used[i]);
+        used[i] = 1;
+    }
+}
+
+// The free list and the chains of the files must be well-formed and not share buckets
+static void
+CheckConsistency(Snapshot_t* state)
+{
+    uint8_t* used = calloc(BUCKET_COUNT, 1);
+    uint32_t bucket;
+    int      i;
+
+    assert(used != NULL);
+    for (bucket = state->Master.FreeBucket; bucket != MFS_ENDOFCHAIN; bucket = state->Map[bucket * 2]) {
+        assert(bucket < BUCKET_COUNT);
+        MarkRun(used, bucket, state->Map[(bucket * 2) + 1]);
+    }
+
+    for (i = 0; i < state->FileCount; i++) {
+        uint32_t buckets = 0;
+        for (bucket = state->Files[i].Start; bucket != MFS_ENDOFCHAIN; bucket = state->Map[bucket * 2]) {
+            assert(bucket < BUCKET_COUNT);
+            MarkRun(used, bucket, state->Map[(bucket * 2) + 1]);
+            buckets += state->Map[(bucket * 2) + 1];
+        }
+        assert(buckets >= state->Files[i].Buckets);
+    }
+    free(used);
+}
+
+// Returns 0 if the disk holds the last flushed state, 1 if it holds the state of the
+// flush that was interrupted
+static int
+VerifyRecovered(void)
+{
+    JournalHeader_t header;
+    Snapshot_t*     match = NULL;
+    MasterRecord_t  mirror;
+
+    if (!memcmp(g_mfs.BucketMap, g_durable.Map, MAP_SIZE) &&
+        !memcmp(&g_mfs.MasterRecord, &g_durable.Master, sizeof(MasterRecord_t))) {
+        match = &g_durable;
+    }
+    else if (!memcmp(g_mfs.BucketMap, g_crashed.Map, MAP_SIZE) &&
+             !memcmp(&g_mfs.MasterRecord, &g_crashed.Master, sizeof(MasterRecord_t))) {
+        match = &g_crashed;
+    }
+    assert(match != NULL);
+    CheckConsistency(match);
+
+    memcpy(&mirror, &g_disk[MIRROR_SECTOR * SECTOR_SIZE], sizeof(MasterRecord_t));
+    assert(!memcmp(&mirror, &g_mfs.MasterRecord, sizeof(MasterRecord_t)));
+    memcpy(&header, &g_disk[JOURNAL_BUCKET * SECTORS_PER_BUCKET * SECTOR_SIZE], sizeof(JournalHeader_t));
+    assert(header.Count == 0);
+    return match == &g_crashed;
+}
+
+static void
+Reset(int journal)
+{
+    Format(journal);
+    g_fileCount = 0;
+    g_crashAt   = 0;
+    Mount();
+    TakeSnapshot(&g_durable);
+    g_writes       = 0;
+    g_writeSectors = 0;
+}
+
+static int
+JournalCommitted(void)
+{
+    JournalHeader_t* header = (JournalHeader_t*)&g_disk[JOURNAL_BUCKET * SECTORS_PER_BUCKET * SECTOR_SIZE];
+    return header->Magic == MFS_JOURNAL_MAGIC && header->Count != 0;
+}
+
+static void
+TestCrashRecovery(void)
+{
+    uint64_t     totalWrites;
+    volatile int j;
+    int          newer = 0, replays = 0, replayCrashes = 0;
+    uint64_t     k;
+
+    // A run without crashes tells how many writes there are to crash at
+    Reset(1);
+    RunWorkload(42, WORKLOAD_OPS);
+    totalWrites = g_writes;
+    assert(MfsFlushMetadata(&g_fileSystem) == OsSuccess);
+    TakeSnapshot(&g_durable);
+    Mount();
+    assert(VerifyRecovered() == 0);
+
+    for (k = 1; k <= totalWrites; k++) {
+        Reset(1);
+        g_crashAt = k;
+        if (!setjmp(g_crashPoint)) {
+            RunWorkload(42, WORKLOAD_OPS);
+            assert(0 && "the crash was not reached");
+        }
+        TakeSnapshot(&g_crashed);
+        g_crashAt = 0;
+
+        // Crash again while the journal is replayed, the replay must be repeatable
+        if (JournalCommitted()) {
+            replays++;
+            memcpy(g_saved, g_disk, sizeof(g_disk));
+            for (j = 1; j <= 8; j++) {
+                memcpy(g_disk, g_saved, sizeof(g_disk));
+                g_writes  = 0;
+                g_crashAt = j;
+                if (!setjmp(g_crashPoint)) {
+                    Mount();
+                    g_crashAt = 0;
+                    break;
+                }
+                g_crashAt = 0;
+                replayCrashes++;
+                Mount();
+                VerifyRecovered();
+            }
+            memcpy(g_disk, g_saved, sizeof(g_disk));
+        }
+
+        Mount();
+        newer += VerifyRecovered();
+    }
+    printf("crash recovery: %llu crash points, %d recovered the interrupted batch, %d replayed the journal, "
+           "%d crashes during replay: ok\n",
+           (unsigned long long)totalWrites, newer, replays, replayCrashes);
+}
+
+static void
+TestWriteCount(void)
+{
+    uint64_t throughWrites, throughSectors, i;
+    unsigned int seed = 7;
+    MapRecord_t  record;
+
+    // Writing every change through, as the map was updated before
+    Reset(0);
+    for (i = 0; i < 1000; i++) {
+        assert(MfsAllocateBuckets(&g_fileSystem, MFS_ENDOFCHAIN, 1 + (rand_r(&seed) % 24), &record) == OsSuccess);
+        assert(MfsFlushMetadata(&g_fileSystem) == OsSuccess);
+        if (i & 1) {
+            assert(MfsFreeBuckets(&g_fileSystem, record.Link, 1) == OsSuccess);
+            assert(MfsFlushMetadata(&g_fileSystem) == OsSuccess);
+        }
+    }
+    throughWrites  = g_writes;
+    throughSectors = g_writeSectors;
+
+    // Batched through the journal
+    seed = 7;
+    Reset(1);
+    for (i = 0; i < 1000; i++) {
+        assert(MfsAllocateBuckets(&g_fileSystem, MFS_ENDOFCHAIN, 1 + (rand_r(&seed) % 24), &record) == OsSuccess);
+        if (i & 1) {
+            assert(MfsFreeBuckets(&g_fileSystem, record.Link, 1) == OsSuccess);
+        }
+    }
+    assert(MfsFlushMetadata(&g_fileSystem) == OsSuccess);
+    printf("1000 allocations and 500 frees: write-through %llu writes (%llu sectors), journaled batches %llu writes (%llu sectors)\n",
+           (unsigned long long)throughWrites, (unsigned long long)throughSectors,
+           (unsigned long long)g_writes, (unsigned long long)g_writeSectors);
+    assert(g_writes < throughWrites);
+
+    // The batched image must be as well-formed
+    Mount();
+    TakeSnapshot(&g_durable);
+    CheckConsistency(&g_durable);
+}
+
+int main(void)
+{
+    g_mfs.SectorsPerBucket         = SECTORS_PER_BUCKET;
+    g_mfs.BucketCount              = BUCKET_COUNT;
+    g_mfs.BucketsPerSectorInMap    = SECTOR_SIZE / 8;
+    g_mfs.MasterRecordSector       = MASTER_SECTOR;
+    g_mfs.MasterRecordMirrorSector = MIRROR_SECTOR;
+    g_mfs.JournalBuffer.handle     = JOURNAL_HANDLE;
+    g_mfs.JournalBuffer.length     = (MFS_JOURNAL_TARGETS + 1) * SECTOR_SIZE;
+    g_mfs.JournalBuffer.buffer     = malloc(g_mfs.JournalBuffer.length);
+    g_fileSystem.Disk.descriptor.SectorSize = SECTOR_SIZE;
+    g_fileSystem.ExtensionData     = (uintptr_t*)&g_mfs;
+    assert(g_mfs.JournalBuffer.buffer != NULL);
+
+    TestCrashRecovery();
+    TestWriteCount();
+    TEST_PASSED("mfs_journal_test");
+    return 0;
+}
@@ -0,0 +1,390 @@
+
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+
+#define _Out_Opt_
+#define OsDeviceError  (int)10
+#define UUID_INVALID   (UUId_t)0xFFFFFFFF
+#define LODWORD(l)     ((uint32_t)(l))
+#define DIVUP(a, b)    ((a / b) + (((a % b) > 0) ? 1 : 0))
+
+// Skip the service header, the test provides the parts of it the page cache uses
+#define _VFS_INTERFACE_H_
+#define __FILE_OPERATION_NONE       0x00000000
+#define __FILE_READ_ACCESS          0x00000001
+#define __FILE_WRITE_ACCESS         0x00000002
+#define __FILE_VOLATILE             0x00000400
+#define FILE_FLAG_DIRECTORY         0x00000001
+
+#define VFS_PAGECACHE_PAGE_SIZE     0x1000
+#define VFS_PAGECACHE_READAHEAD_MIN 4
+#define VFS_PAGECACHE_READAHEAD_MAX 32
+#define VFS_PAGECACHE_BUDGET        (512 * 1024)
+
+typedef struct MString MString_t;
+#define MStringRaw(String) "test-file"
+
+typedef union { uint64_t QuadPart; } LargeUInteger_t;
+
+typedef struct {
+    unsigned int    Flags;
+    LargeUInteger_t Size;
+} OsFileDescriptor_t;
+
+typedef struct FileSystemEntry {
+    OsFileDescriptor_t Descriptor;
+    MString_t*         Path;
+    uintptr_t*         System;
+} FileSystemEntry_t;
+
+typedef struct FileSystemEntryHandle {
+    FileSystemEntry_t* Entry;
+    UUId_t             Id;
+    UUId_t             Owner;
+    unsigned int       Access;
+    unsigned int       Options;
+    unsigned int       LastOperation;
+    uint64_t           Position;
+    void*              OutBuffer;
+} FileSystemEntryHandle_t;
+
+typedef struct { struct { struct { size_t SectorSize; } descriptor; } Disk; } FileSystemDescriptor_t;
+
+typedef struct FileSystemModule {
+    OsStatus_t (*OpenHandle)(FileSystemDescriptor_t*, FileSystemEntry_t*, FileSystemEntryHandle_t**);
+    OsStatus_t (*CloseHandle)(FileSystemDescriptor_t*, FileSystemEntryHandle_t*);
+    OsStatus_t (*ReadEntry)(FileSystemDescriptor_t*, FileSystemEntryHandle_t*, UUId_t, void*, size_t, size_t, size_t*);
+    OsStatus_t (*WriteEntry)(FileSystemDescriptor_t*, FileSystemEntryHandle_t*, UUId_t, void*, size_t, size_t, size_t*);
+    OsStatus_t (*SeekInEntry)(FileSystemDescriptor_t*, FileSystemEntryHandle_t*, uint64_t);
+} FileSystemModule_t;
+
+typedef struct FileSystem {
+    FileSystemDescriptor_t descriptor;
+    FileSystemModule_t*    module;
+} FileSystem_t;
+
+typedef struct {
+    uint64_t Hits;
+    uint64_t Misses;
+    uint64_t ReadAheadPages;
+    uint64_t WriteBackPages;
+    uint64_t Evictions;
+    size_t   PagesUsed;
+    size_t   PageBudget;
+    size_t   PageSize;
+} OsFileCacheStatistics_t;
+
+struct dma_buffer_info {
+    const char*  name;
+    size_t       length;
+    size_t       capacity;
+    unsigned int flags;
+};
+
+struct dma_attachment {
+    UUId_t handle;
+    void*  buffer;
+    size_t length;
+};
+
+static OsStatus_t
+dma_create(struct dma_buffer_info* info, struct dma_attachment* attachment)
+{
+    attachment->handle = 1;
+    attachment->buffer = malloc(info->capacity);
+    attachment->length = info->length;
+    return OsSuccess;
+}
+
+void* dsalloc(size_t size) { return malloc(size); }
+void  dsfree(void* pointer) { free(pointer); }
+
+#include "../librt/libds/hashtable.c"
+#include "../services/filemanager/page_cache.c"
+
+#define FILE_SIZE   (4 * 1024 * 1024)
+#define OPERATIONS  20000
+
+#define TEST_NAME "page_cache_test"
+
+// The filesystem is a flat byte array, writes are only accepted at or below the size
+// that has been written to it, like a filesystem that allocates on write
+static uint8_t* g_disk;
+static uint64_t g_diskSize;
+static int      g_transfers;
+static int      g_invalidSeeks;
+
+// A second file with its own disk, writes to it can be made to fail
+static FileSystemEntry_t g_other;
+static uint8_t*          g_otherDisk;
+static uint64_t          g_otherDiskSize;
+static int               g_otherWritesFail;
+
+#define DISK(handle)      ((handle)->Entry == &g_other ? g_otherDisk : g_disk)
+#define DISK_SIZE(handle) (*((handle)->Entry == &g_other ? &g_otherDiskSize : &g_diskSize))
+
+static OsStatus_t
+mock_open_handle(FileSystemDescriptor_t* fs, FileSystemEntry_t* entry, FileSystemEntryHandle_t** handleOut)
+{
+    *handleOut = calloc(1, sizeof(FileSystemEntryHandle_t));
+    return OsSuccess;
+}
+
+static OsStatus_t
+mock_close_handle(FileSystemDescriptor_t* fs, FileSystemEntryHandle_t* handle)
+{
+    free(handle);
+    return OsSuccess;
+}
+
+static OsStatus_t
+mock_read(FileSystemDescriptor_t* fs, FileSystemEntryHandle_t* handle, UUId_t bufferHandle,
+    void* buffer, size_t offset, size_t length, size_t* bytesRead)
+{
+    uint64_t size = handle->Entry->Descriptor.Size.QuadPart;
+
+    g_transfers++;
+    *bytesRead = 0;
+    if (handle->Position >= size) {
+        return OsSuccess;
+    }
+    length = (size_t)MIN((uint64_t)length, size - handle->Position);
+    if (handle->Position + length > DISK_SIZE(handle)) {
+        g_invalidSeeks++;
+    }
+    memcpy((uint8_t*)buffer + offset, DISK(handle) + handle->Position, length);
+    *bytesRead = length;
+    return OsSuccess;
+}
+
+static OsStatus_t
+mock_write(FileSystemDescriptor_t* fs, FileSystemEntryHandle_t* handle, UUId_t bufferHandle,
+    void* buffer, size_t offset, size_t length, size_t* bytesWritten)
+{
+    g_transfers++;
+    if (handle->Entry == &g_other && g_otherWritesFail) {
+        return OsDeviceError;
+    }
+    if (handle->Position > DISK_SIZE(handle)) {
+        g_invalidSeeks++;
+    }
+
+    memcpy(DISK(handle) + handle->Position, (uint8_t*)buffer + offset, length);
+    DISK_SIZE(handle) = MAX(DISK_SIZE(handle), handle->Position + length);
+    *bytesWritten = length;
+    return OsSuccess;
+}
+
+static OsStatus_t
+mock_seek(FileSystemDescriptor_t* fs, FileSystemEntryHandle_t* handle, uint64_t position)
+{
+    handle->Position = position;
+    return OsSuccess;
+}
+
+static FileSystemModule_t g_module = { mock_open_handle, mock_close_handle, mock_read, mock_write, mock_seek };
+static FileSystem_t       g_fileSystem;
+static FileSystemEntry_t  g_entry;
+static uint8_t*           g_shadow;
+static uint8_t*           g_buffer;
+
+static void
+setup_file(uint64_t size)
+{
+    uint64_t i;
+
+    g_fileSystem.descriptor.Disk.descriptor.SectorSize = 512;
+    g_fileSystem.module = &g_module;
+    g_entry.System      = (uintptr_t*)&g_fileSystem;
+    g_entry.Descriptor.Size.QuadPart = size;
+    for (i = 0; i < size; i++) {
+        g_shadow[i] = g_disk[i] = (uint8_t)(i * 7 + (i >> 12));
+    }
+    g_diskSize = size;
+}
+
+static int
+test_consistency(void)
+{
+    FileSystemEntryHandle_t handle = { &g_entry, 1, 1, __FILE_READ_ACCESS | __FILE_WRITE_ACCESS, 0 };
+    OsFileCacheStatistics_t stats;
+    uint32_t                seed = 0x2545F491;
+    size_t                  transferred;
+    int                     i;
+
+    setup_file(FILE_SIZE / 2);
+    CHECK(TEST_NAME, VfsPageCacheIsCacheable(&handle), "file handle is not cacheable");
+    handle.Options = __FILE_VOLATILE;
+    CHECK(TEST_NAME, !VfsPageCacheIsCacheable(&handle), "volatile handle is cacheable");
+    handle.Options = 0;
+
+    for (i = 0; i < OPERATIONS; i++) {
+        uint64_t size = g_entry.Descriptor.Size.QuadPart;
+        size_t   length;
+        int      j;
+
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        handle.Position = seed % (size + 1);
+        length          = 1 + ((seed >> 8) % ((seed & 1) ? 512 : 40000));
+
+        if ((seed >> 4) % 3 == 0 && handle.Position + length <= FILE_SIZE) {
+            for (j = 0; j < (int)length; j++) {
+                g_buffer[j] = (uint8_t)(seed + j);
+            }
+            CHECK(TEST_NAME, VfsPageCacheWrite(&handle, g_buffer, length, &transferred) == OsSuccess &&
+                  transferred == length, "write of %zu bytes at %" PRIu64 " failed", length, handle.Position);
+            memcpy(g_shadow + handle.Position, g_buffer, length);
+            CHECK(TEST_NAME, g_entry.Descriptor.Size.QuadPart == MAX(size, handle.Position + length), "size was not updated");
+        }
+        else {
+            size_t expected = (size_t)MIN((uint64_t)length, size - handle.Position);
+            CHECK(TEST_NAME, VfsPageCacheRead(&handle, g_buffer, length, &transferred) == OsSuccess &&
+                  transferred == expected, "read of %zu bytes at %" PRIu64 " returned %zu", length,
+                  handle.Position, transferred);
+            CHECK(TEST_NAME, !memcmp(g_buffer, g_shadow + handle.Position, transferred),
+                  "read at %" PRIu64 " returned stale data", handle.Position);
+        }
+
+        if ((i % 5000) == 4999) {
+            CHECK(TEST_NAME, VfsPageCacheFlush(&g_entry) == OsSuccess, "flush failed");
+            CHECK(TEST_NAME, g_diskSize == g_entry.Descriptor.Size.QuadPart, "disk size %" PRIu64 " after flush, file size %"
+                  PRIu64, g_diskSize, g_entry.Descriptor.Size.QuadPart);
+            CHECK(TEST_NAME, !memcmp(g_disk, g_shadow, (size_t)g_diskSize), "disk does not match after flush");
+        }
+    }
+
+    CHECK(TEST_NAME, g_invalidSeeks == 0, "%i transfers started beyond the data on disk", g_invalidSeeks);
+    VfsPageCacheGetStatistics(&stats);
+    CHECK(TEST_NAME, stats.PagesUsed <= stats.PageBudget, "%zu pages used of %zu", stats.PagesUsed, stats.PageBudget);
+    CHECK(TEST_NAME, stats.Evictions != 0, "budget was never reached");
+
+    // Invalidation drops the dirty data
+    handle.Position = 0;
+    memset(g_buffer, 0xAA, VFS_PAGECACHE_PAGE_SIZE);
+    CHECK(TEST_NAME, VfsPageCacheWrite(&handle, g_buffer, VFS_PAGECACHE_PAGE_SIZE, &transferred) == OsSuccess, "write failed");
+    VfsPageCacheInvalidate(&g_entry);
+    CHECK(TEST_NAME, VfsPageCacheRead(&handle, g_buffer, VFS_PAGECACHE_PAGE_SIZE, &transferred) == OsSuccess &&
+          !memcmp(g_buffer, g_disk, VFS_PAGECACHE_PAGE_SIZE), "invalidated page was read back");
+    VfsPageCacheInvalidate(&g_entry);
+    return 0;
+}
+
+// Reads g_entry from the start until the whole cache has been replaced once
+static int
+read_entry_through_cache(void)
+{
+    FileSystemEntryHandle_t handle = { &g_entry, 1, 1, __FILE_READ_ACCESS, 0 };
+    size_t                  transferred;
+
+    while (handle.Position < VFS_PAGECACHE_BUDGET * 2) {
+        CHECK(TEST_NAME, VfsPageCacheRead(&handle, g_buffer, 3 * VFS_PAGECACHE_PAGE_SIZE, &transferred) == OsSuccess &&
+              transferred == 3 * VFS_PAGECACHE_PAGE_SIZE, "read at %" PRIu64 " failed", handle.Position);
+        CHECK(TEST_NAME, !memcmp(g_buffer, g_shadow + handle.Position, transferred),
+              "read at %" PRIu64 " returned data of another file", handle.Position);
+        handle.Position += transferred;
+    }
+    return 0;
+}
+
+static int
+test_cross_file_eviction(void)
+{
+    FileSystemEntryHandle_t handle = { &g_other, 2, 1, __FILE_READ_ACCESS | __FILE_WRITE_ACCESS, 0 };
+    size_t                  transferred;
+    size_t                  length   = 8 * VFS_PAGECACHE_PAGE_SIZE;
+    uint8_t*                expected = malloc(length);
+
+    setup_file(FILE_SIZE);
+    g_other.System                   = (uintptr_t*)&g_fileSystem;
+    g_other.Descriptor.Size.QuadPart = length;
+    g_otherDisk                      = calloc(1, length);
+    g_otherDiskSize                  = length;
+
+    // Dirty pages of the other file are the oldest pages, reading g_entry evicts them
+    // in the middle of its read-ahead
+    memset(expected, 0x5A, length);
+    CHECK(TEST_NAME, VfsPageCacheWrite(&handle, expected, length, &transferred) == OsSuccess, "write failed");
+    if (read_entry_through_cache()) {
+        return -1;
+    }
+    CHECK(TEST_NAME, !memcmp(g_otherDisk, expected, length), "evicted dirty pages were not written back");
+
+    // Dirty pages that fail to write back are kept instead of dropped
+    handle.Position = 0;
+    memset(expected, 0xC3, length);
+    CHECK(TEST_NAME, VfsPageCacheWrite(&handle, expected, length, &transferred) == OsSuccess, "write failed");
+    g_otherWritesFail = 1;
+    if (read_entry_through_cache()) {
+        return -1;
+    }
+
+    handle.Position = 0;
+    memset(g_buffer, 0, length);
+    CHECK(TEST_NAME, VfsPageCacheRead(&handle, g_buffer, length, &transferred) == OsSuccess && transferred == length,
+          "read of other file failed");
+    CHECK(TEST_NAME, !memcmp(g_buffer, expected, length), "dirty pages were dropped after failed write-back");
+
+    g_otherWritesFail = 0;
+    CHECK(TEST_NAME, VfsPageCacheFlush(&g_other) == OsSuccess, "flush failed");
+    CHECK(TEST_NAME, !memcmp(g_otherDisk, expected, length), "kept dirty pages were not written back");
+
+    VfsPageCacheInvalidate(&g_other);
+    VfsPageCacheInvalidate(&g_entry);
+    free(g_otherDisk);
+    free(expected);
+    return 0;
+}
+
+static int
+bench_sequential(size_t chunkSize)
+{
+    FileSystemEntryHandle_t handle = { &g_entry, 1, 1, __FILE_READ_ACCESS, 0 };
+    OsFileCacheStatistics_t before, after;
+    size_t                  transferred;
+    int                     direct;
+    int                     cached;
+
+    setup_file(FILE_SIZE);
+    VfsPageCacheGetStatistics(&before);
+
+    // Without the cache every client transfer is a filesystem transfer
+    direct          = (int)DIVUP((size_t)FILE_SIZE, chunkSize);
+    g_transfers     = 0;
+    handle.Position = 0;
+    while (handle.Position < FILE_SIZE) {
+        CHECK(TEST_NAME, VfsPageCacheRead(&handle, g_buffer, chunkSize, &transferred) == OsSuccess &&
+              !memcmp(g_buffer, g_disk + handle.Position, transferred), "sequential read failed");
+        handle.Position += transferred;
+    }
+    cached = g_transfers;
+    VfsPageCacheGetStatistics(&after);
+
+    printf("sequential %6zu byte reads: %5i fs transfers (%5i direct), hits %6" PRIu64 ", misses %4" PRIu64
+           ", read-ahead pages %5" PRIu64 "\n", chunkSize, cached, direct, after.Hits - before.Hits,
+           after.Misses - before.Misses, after.ReadAheadPages - before.ReadAheadPages);
+    CHECK(TEST_NAME, cached <= direct, "read-ahead issued more transfers than direct reads");
+    CHECK(TEST_NAME, cached <= (FILE_SIZE / (VFS_PAGECACHE_READAHEAD_MAX * VFS_PAGECACHE_PAGE_SIZE)) + 8,
+          "read-ahead window did not grow, %i transfers", cached);
+    VfsPageCacheInvalidate(&g_entry);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    g_disk   = malloc(FILE_SIZE);
+    g_shadow = malloc(FILE_SIZE);
+    g_buffer = malloc(FILE_SIZE);
+
+    VfsPageCacheInitialize();
+    if (test_consistency() || test_cross_file_eviction() || bench_sequential(512) || bench_sequential(4096) || bench_sequential(65536)) {
+        return -1;
+    }
+
+    free(g_disk);
+    free(g_shadow);
+    free(g_buffer);
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}
@@ -0,0 +1,380 @@
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <strings.h>
+
+#define StrUTF8           0
+#define MSTRING_NOT_FOUND -1
+#define FsOk              0
+#define UUID_INVALID      (UUId_t)0xFFFFFFFF
+#define _CRT_UNUSED(x)    (void)(x)
+
+typedef struct {
+    unsigned int Flags;
+} OsFileDescriptor_t;
+
+typedef struct OsImageCacheStatistics {
+    uint64_t PathHits;
+    uint64_t PathNegativeHits;
+    uint64_t PathMisses;
+    uint64_t PathInvalidations;
+    size_t   PathEntries;
+} OsImageCacheStatistics_t;
+
+// Skip the process manager and loader headers, the test provides the parts of them
+// the path resolution uses
+#define __PROCESS_INTERFACE__
+#define __PE_IMAGE_LOADER__
+#define ENTRY(...)
+#define EXIT(...)
+#undef TRACE
+#define TRACE(...)
+
+typedef struct MString {
+    char*  Data;
+    size_t Length;
+} MString_t;
+
+static MString_t*
+MStringCreate(const char* data, int type)
+{
+    MString_t* string = malloc(sizeof(MString_t));
+    assert(string != NULL);
+    string->Data   = strdup(data ? data : "");
+    string->Length = strlen(string->Data);
+    return string;
+}
+
+static void        MStringDestroy(MString_t* string) { if (string) { free(string->Data); free(string); } }
+static const char* MStringRaw(MString_t* string) { return string->Data; }
+static MString_t*  MStringClone(MString_t* string) { return MStringCreate(string->Data, StrUTF8); }
+
+static void
+MStringAppend(MString_t* string, MString_t* append)
+{
+    string->Data = realloc(string->Data, string->Length + append->Length + 1);
+    assert(string->Data != NULL);
+    memcpy(string->Data + string->Length, append->Data, append->Length + 1);
+    string->Length += append->Length;
+}
+
+static void
+MStringAppendCharacter(MString_t* string, int character)
+{
+    char buffer[2] = { (char)character, '\0' };
+    MString_t append = { .Data = &buffer[0], .Length = 1 };
+    MStringAppend(string, &append);
+}
+
+static void
+MStringReset(MString_t* string, const char* data, int type)
+{
+    free(string->Data);
+    string->Data   = strdup(data);
+    string->Length = strlen(data);
+}
+
+static int
+MStringFind(MString_t* string, int character, int startIndex)
+{
+    char* found = strchr(string->Data + startIndex, character);
+    return found ? (int)(found - string->Data) : MSTRING_NOT_FOUND;
+}
+
+static int
+MStringFindCString(MString_t* string, const char* substring)
+{
+    char* found = strstr(string->Data, substring);
+    return found ? (int)(found - string->Data) : MSTRING_NOT_FOUND;
+}
+
+void* dsalloc(size_t size) { return malloc(size); }
+void  dsfree(void* pointer) { free(pointer); }
+
+// The processes that load libraries, only the working directory is used
+typedef struct Process {
+    UUId_t     Id;
+    MString_t* WorkingDirectory;
+} Process_t;
+
+#define PROCESS_COUNT 2
+
+static Process_t g_processes[PROCESS_COUNT];
+
+static Process_t*
+AcquireProcess(UUId_t handle)
+{
+    for (int i = 0; i < PROCESS_COUNT; i++) {
+        if (g_processes[i].Id == handle) {
+            return &g_processes[i];
+        }
+    }
+    return NULL;
+}
+
+static void ReleaseProcess(Process_t* process) { }
+
+// The filesystem, every query is a request to the filemanager
+#define MAX_FILES 64
+
+static char* g_files[MAX_FILES];
+static int   g_requests;
+
+static void
+Canonicalize(const char* path, char* buffer, size_t length)
+{
+    if (!strncmp(path, "$bin/", 5)) {
+        snprintf(buffer, length, "/bin/%s", path + 5);
+    }
+    else if (!strncmp(path, "$sys/", 5)) {
+        snprintf(buffer, length, "/sys/%s", path + 5);
+    }
+    else {
+        snprintf(buffer, length, "%s", path);
+    }
+}
+
+static int
+FindFile(const char* path)
+{
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (g_files[i] && !strcmp(g_files[i], path)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static OsStatus_t
+GetFileInformationFromPath(const char* path, OsFileDescriptor_t* information)
+{
+    char canonicalized[_MAXPATH];
+
+    g_requests++;
+    Canonicalize(path, &canonicalized[0], sizeof(canonicalized));
+    return FindFile(&canonicalized[0]) >= 0 ? FsOk : OsError;
+}
+
+static OsStatus_t
+PathCanonicalize(const char* path, char* buffer, size_t length)
+{
+    g_requests++;
+    Canonicalize(path, buffer, length);
+    return OsSuccess;
+}
+
+#include "../librt/libds/hashtable.c"
+#include "../services/processmanager/path_cache.c"
+
+// The filemanager tells the process manager about every path it creates or removes
+static void
+CreateFile(const char* path)
+{
+    int index = FindFile(path);
+    for (int i = 0; index < 0 && i < MAX_FILES; i++) {
+        if (!g_files[i]) {
+            g_files[i] = strdup(path);
+            index      = i;
+        }
+    }
+    assert(index >= 0);
+    PathCacheInvalidate(path);
+}
+
+static void
+DeletePath(const char* path)
+{
+    size_t length = strlen(path);
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (g_files[i] && !strncmp(g_files[i], path, length) &&
+            (g_files[i][length] == '\0' || g_files[i][length] == '/')) {
+            free(g_files[i]);
+            g_files[i] = NULL;
+        }
+    }
+    PathCacheInvalidate(path);
+}
+
+#define APPLICATION_ID 1
+#define OTHER_ID       2
+#define LIBRARIES      30
+#define LOCAL          5
+#define OPTIONAL       2
+#define ITERATIONS     2000
+
+#define TEST_NAME "path_cache_bench"
+
+static int
+Resolve(UUId_t processId, const char* name, char* buffer, size_t length)
+{
+    MString_t* path = MStringCreate(name, StrUTF8);
+    MString_t* fullPath;
+    OsStatus_t status;
+
+    status = ResolveFilePath(processId, path, &fullPath);
+    MStringDestroy(path);
+    if (status != OsSuccess) {
+        snprintf(buffer, length, "<none>");
+        return -1;
+    }
+    snprintf(buffer, length, "%s", MStringRaw(fullPath));
+    MStringDestroy(fullPath);
+    return 0;
+}
+
+// The application is resolved by the process manager before the process exists, and
+// its libraries from the working directory of the application. A few optional
+// libraries are probed for but not installed.
+static int
+Spawn(char results[][64])
+{
+    char name[32];
+    int  i;
+
+    Resolve(UUID_INVALID, "app.app", results[0], 64);
+    for (i = 0; i < LIBRARIES + OPTIONAL; i++) {
+        snprintf(&name[0], sizeof(name), i < LIBRARIES ? "lib%i.dll" : "plugin%i.dll", i);
+        Resolve(APPLICATION_ID, &name[0], results[1 + i], 64);
+    }
+    return 0;
+}
+
+static int
+test_spawn(void)
+{
+    char     cold[1 + LIBRARIES + OPTIONAL][64];
+    char     warm[1 + LIBRARIES + OPTIONAL][64];
+    int      coldRequests;
+    int      warmRequests;
+    uint64_t start;
+    uint64_t uncached;
+    uint64_t cached;
+
+    memset(cold, 0, sizeof(cold));
+    memset(warm, 0, sizeof(warm));
+    g_requests = 0;
+    Spawn(cold);
+    coldRequests = g_requests;
+
+    g_requests = 0;
+    Spawn(warm);
+    warmRequests = g_requests;
+
+    CHECK(TEST_NAME, !strcmp(cold[0], "/bin/app.app"), "application resolved to %s", cold[0]);
+    CHECK(TEST_NAME, !strcmp(cold[1], "/apps/demo/lib0.dll") && !strcmp(cold[1 + LOCAL], "/bin/lib5.dll"),
+          "libraries resolved to %s and %s", cold[1], cold[1 + LOCAL]);
+    CHECK(TEST_NAME, !strcmp(cold[1 + LIBRARIES], "<none>"), "optional library resolved to %s", cold[1 + LIBRARIES]);
+    CHECK(TEST_NAME, !memcmp(cold, warm, sizeof(cold)), "cached resolutions differ");
+    CHECK(TEST_NAME, warmRequests == 0, "warm spawn made %i requests", warmRequests);
+
+    start = NowNs();
+    for (int i = 0; i < ITERATIONS; i++) {
+        PathCacheInvalidate(NULL);
+        Spawn(cold);
+    }
+    uncached = (NowNs() - start) / ITERATIONS;
+
+    start = NowNs();
+    for (int i = 0; i < ITERATIONS; i++) {
+        Spawn(warm);
+    }
+    cached = (NowNs() - start) / ITERATIONS;
+
+    printf("%i libraries: cold spawn %3i requests %7" PRIu64 " ns, warm spawn %i requests %6" PRIu64 " ns\n",
+           LIBRARIES, coldRequests, uncached, warmRequests, cached);
+    return 0;
+}
+
+static int
+test_invalidation(void)
+{
+    OsImageCacheStatistics_t statistics;
+    char                     result[64];
+    int                      entries;
+
+    // A library that appears in the working directory takes precedence from now on,
+    // the other resolutions are untouched
+    CHECK(TEST_NAME, Resolve(APPLICATION_ID, "lib10.dll", &result[0], sizeof(result)) == 0 &&
+          !strcmp(&result[0], "/bin/lib10.dll"), "lib10.dll resolved to %s", &result[0]);
+    entries = (int)g_paths.element_count;
+    CreateFile("/apps/demo/lib10.dll");
+    CHECK(TEST_NAME, (int)g_paths.element_count == entries - 1, "%i resolutions were dropped",
+          entries - (int)g_paths.element_count);
+    g_requests = 0;
+    CHECK(TEST_NAME, Resolve(APPLICATION_ID, "lib10.dll", &result[0], sizeof(result)) == 0 &&
+          !strcmp(&result[0], "/apps/demo/lib10.dll"), "lib10.dll resolved to %s", &result[0]);
+    CHECK(TEST_NAME, Resolve(APPLICATION_ID, "LIB11.DLL", &result[0], sizeof(result)) == -1 &&
+          Resolve(APPLICATION_ID, "lib11.dll", &result[0], sizeof(result)) == 0, "lib11.dll failed");
+    CHECK(TEST_NAME, g_requests == 4, "%i requests after one library moved", g_requests);
+
+    // Negative entries answer repeated probes, and go away once the library exists
+    g_requests = 0;
+    for (int i = 0; i < 10; i++) {
+        CHECK(TEST_NAME, Resolve(APPLICATION_ID, "plugin30.dll", &result[0], sizeof(result)) == -1, "missing library found");
+    }
+    CHECK(TEST_NAME, g_requests == 0, "missing library was probed %i times", g_requests);
+    CreateFile("/bin/plugin30.dll");
+    CHECK(TEST_NAME, Resolve(APPLICATION_ID, "plugin30.dll", &result[0], sizeof(result)) == 0 &&
+          !strcmp(&result[0], "/bin/plugin30.dll"), "installed library resolved to %s", &result[0]);
+
+    // Resolutions are per working directory
+    CHECK(TEST_NAME, Resolve(OTHER_ID, "lib0.dll", &result[0], sizeof(result)) == -1 &&
+          Resolve(OTHER_ID, "lib5.dll", &result[0], sizeof(result)) == 0,
+          "libraries of another working directory were mixed up");
+
+    // Removing a directory drops everything that was resolved below it
+    DeletePath("/apps/demo");
+    CHECK(TEST_NAME, Resolve(APPLICATION_ID, "lib0.dll", &result[0], sizeof(result)) == -1, "deleted library found");
+    CHECK(TEST_NAME, Resolve(APPLICATION_ID, "lib5.dll", &result[0], sizeof(result)) == 0, "library in $bin was lost");
+
+    // Filesystems that come or go may change any path
+    PathCacheInvalidate("");
+    CHECK(TEST_NAME, g_paths.element_count == 0, "%zu resolutions survived a mount", g_paths.element_count);
+
+    // The cache never grows past its capacity
+    for (int i = 0; i < 2 * PATH_CACHE_CAPACITY; i++) {
+        char name[32];
+        snprintf(&name[0], sizeof(name), "missing%i.dll", i);
+        Resolve(APPLICATION_ID, &name[0], &result[0], sizeof(result));
+        CHECK(TEST_NAME, g_paths.element_count <= PATH_CACHE_CAPACITY, "cache grew to %zu", g_paths.element_count);
+    }
+
+    PathCacheGetStatistics(&statistics);
+    printf("paths: hits %" PRIu64 ", negative hits %" PRIu64 ", misses %" PRIu64 ", invalidations %" PRIu64 "\n",
+           statistics.PathHits, statistics.PathNegativeHits, statistics.PathMisses, statistics.PathInvalidations);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char path[64];
+
+    g_processes[0].Id               = APPLICATION_ID;
+    g_processes[0].WorkingDirectory = MStringCreate("/apps/demo", StrUTF8);
+    g_processes[1].Id               = OTHER_ID;
+    g_processes[1].WorkingDirectory = MStringCreate("/apps/other", StrUTF8);
+
+    CreateFile("/bin/app.app");
+    for (int i = 0; i < LIBRARIES; i++) {
+        snprintf(&path[0], sizeof(path), i < LOCAL ? "/apps/demo/lib%i.dll" : "/bin/lib%i.dll", i);
+        CreateFile(&path[0]);
+    }
+
+    PathCacheInitialize();
+    if (test_spawn() || test_invalidation()) {
+        return -1;
+    }
+
+    PathCacheInvalidate(NULL);
+    hashtable_destroy(&g_paths);
+    for (int i = 0; i < MAX_FILES; i++) {
+        free(g_files[i]);
+    }
+    for (int i = 0; i < PROCESS_COUNT; i++) {
+        MStringDestroy(g_processes[i].WorkingDirectory);
+    }
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}
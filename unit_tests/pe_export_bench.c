@@ -0,0 +1,354 @@
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#define StrUTF8            0
+#define MSTRING_NO_MATCH   0
+#define MSTRING_FULL_MATCH 1
+
+#define DECL_STRUCT(Type) typedef struct Type Type##_t
+#define PACKED_TYPESTRUCT(Name, Body) typedef struct __attribute__((packed)) Name Body Name##_t
+#define ISINRANGE(x, lo, hi) (((x) >= (lo)) && ((x) < (hi)))
+#define DIVUP(a, b)          ((a / b) + (((a % b) > 0) ? 1 : 0))
+#define _CRT_UNUSED(x)      (void)(x)
+
+#define MEMORY_READ       0x1
+#define MEMORY_WRITE      0x2
+#define MEMORY_EXECUTABLE 0x4
+
+typedef void* Handle_t;
+
+// The loader only needs a handful of string operations
+typedef struct MString {
+    char*  Data;
+    size_t Length;
+} MString_t;
+
+static MString_t*
+MStringCreate(const char* data, int type)
+{
+    MString_t* string = malloc(sizeof(MString_t));
+    assert(string != NULL);
+    string->Length = strlen(data);
+    string->Data   = strdup(data);
+    assert(string->Data != NULL);
+    return string;
+}
+
+static void        MStringDestroy(MString_t* string) { if (string) { free(string->Data); free(string); } }
+static const char* MStringRaw(MString_t* string) { return string ? string->Data : NULL; }
+
+static MString_t*
+MStringSubString(MString_t* string, int index, int length)
+{
+    MString_t* sub = MStringCreate(string->Data + index, StrUTF8);
+    if (length >= 0 && (size_t)length < sub->Length) {
+        sub->Data[length] = '\0';
+        sub->Length       = length;
+    }
+    return sub;
+}
+
+static int
+MStringFindReverse(MString_t* string, int character, int startIndex)
+{
+    char* found = strrchr(string->Data, character);
+    return found ? (int)(found - string->Data) : -1;
+}
+
+static int
+MStringCompare(MString_t* first, MString_t* second, int ignoreCase)
+{
+    return (ignoreCase ? strcasecmp(first->Data, second->Data) : strcmp(first->Data, second->Data)) ?
+        MSTRING_NO_MATCH : MSTRING_FULL_MATCH;
+}
+
+void* dsalloc(size_t size) { return malloc(size); }
+void  dsfree(void* pointer) { free(pointer); }
+void  dswarning(const char* fmt, ...) { }
+
+void dserror(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+// The images are never loaded from disk, the importer resolves the library it
+// imports from among the libraries it already has loaded
+#include "../librt/libds/pe/pe.h"
+
+uintptr_t  GetPageSize(void) { return 0x1000; }
+uintptr_t  GetBaseAddress(void) { return 0x400000; }
+clock_t    GetTimestamp(void) { return clock(); }
+OsStatus_t ResolveFilePath(UUId_t owner, MString_t* path, MString_t** fullPath) { return OsNotSupported; }
+OsStatus_t LoadFile(MString_t* path, void** buffer, size_t* length) { return OsNotSupported; }
+void       UnloadFile(MString_t* path, void* buffer) { }
+OsStatus_t CreateImageSpace(MemorySpaceHandle_t* handle) { return OsNotSupported; }
+OsStatus_t AcquireImageMapping(MemorySpaceHandle_t space, uintptr_t* address, size_t length,
+                               unsigned int flags, MemoryMapHandle_t* handle) { return OsNotSupported; }
+void       ReleaseImageMapping(MemoryMapHandle_t handle) { }
+OsStatus_t ShareImageMapping(MemorySpaceHandle_t space, void* source, uintptr_t address, size_t length,
+                             unsigned int flags) { return OsNotSupported; }
+PeImageCache_t* AcquireImageCache(MString_t* path, uintptr_t base) { return NULL; }
+OsStatus_t CreateImageCache(MString_t* path, uintptr_t base, size_t length, int sectionCount,
+                            PeImageCache_t** cacheOut) { return OsNotSupported; }
+void       PublishImageCache(PeImageCache_t* cache) { }
+void       ReleaseImageCache(PeImageCache_t* cache) { }
+OsStatus_t PeValidateImageBuffer(uint8_t* buffer, size_t length, unsigned int flags) { return OsSuccess; }
+int        IsFileVerified(MString_t* path, void* buffer) { return 0; }
+void       MarkFileVerified(MString_t* path, void* buffer) { }
+
+#include "../librt/libds/hashtable.c"
+#include "../librt/libds/pe/load.c"
+#include "../librt/libds/pe/utilities.c"
+
+#define EXPORTS     5000
+#define IMPORTS     2000
+#define ITERATIONS  20
+#define IMAGE_BASE  0x10000000
+#define SECTION_RVA 0x1000
+
+#define TEST_NAME "pe_export_bench"
+
+// A section of an image, the data of the section is the buffer itself
+struct SyntheticSection {
+    uint8_t* Buffer;
+    size_t   Length;
+    size_t   Used;
+};
+
+static uint32_t
+SectionAllocate(struct SyntheticSection* section, size_t length)
+{
+    uint32_t rva = (uint32_t)(SECTION_RVA + section->Used);
+    section->Used += (length + 7) & ~(size_t)7;
+    assert(section->Used <= section->Length);
+    return rva;
+}
+
+static void* SectionPointer(struct SyntheticSection* section, uint32_t rva) { return section->Buffer + (rva - SECTION_RVA); }
+
+static void
+ExportName(char* buffer, int index)
+{
+    // Names share long prefixes like the exports of a C library do
+    sprintf(buffer, "__vali_export_function_%05i", index);
+}
+
+static uintptr_t ExportAddress(int index) { return IMAGE_BASE + SECTION_RVA + (uintptr_t)index * 16; }
+
+// Builds the export directory of the library, the names are sorted as the linker emits them
+static OsStatus_t
+build_library(PeExecutable_t* library, struct SyntheticSection* section)
+{
+    PeExportDirectory_t* directory;
+    uint32_t             directoryRva;
+    uint32_t*            names;
+    uint16_t*            ordinals;
+    uint32_t*            functions;
+    SectionMapping_t     mapping;
+    char                 name[64];
+
+    directoryRva = SectionAllocate(section, sizeof(PeExportDirectory_t));
+    directory    = SectionPointer(section, directoryRva);
+    directory->NumberOfFunctions  = EXPORTS;
+    directory->NumberOfNames      = EXPORTS;
+    directory->OrdinalBase        = 0;
+    directory->AddressOfNames     = SectionAllocate(section, EXPORTS * sizeof(uint32_t));
+    directory->AddressOfOrdinals  = SectionAllocate(section, EXPORTS * sizeof(uint16_t));
+    directory->AddressOfFunctions = SectionAllocate(section, EXPORTS * sizeof(uint32_t));
+
+    names     = SectionPointer(section, directory->AddressOfNames);
+    ordinals  = SectionPointer(section, directory->AddressOfOrdinals);
+    functions = SectionPointer(section, directory->AddressOfFunctions);
+    for (int i = 0; i < EXPORTS; i++) {
+        ExportName(&name[0], i);
+        names[i]     = SectionAllocate(section, strlen(&name[0]) + 1);
+        ordinals[i]  = (uint16_t)i;
+        functions[i] = (uint32_t)(ExportAddress(i) - IMAGE_BASE);
+        strcpy(SectionPointer(section, names[i]), &name[0]);
+    }
+
+    memset(library, 0, sizeof(PeExecutable_t));
+    library->Name               = MStringCreate("synthetic.dll", StrUTF8);
+    library->VirtualAddress     = IMAGE_BASE;
+    library->CodeBase           = IMAGE_BASE;
+    library->NextLoadingAddress = IMAGE_BASE + 0x1000000;
+    library->References         = 1;
+
+    mapping.Handle      = NULL;
+    mapping.BasePointer = section->Buffer;
+    mapping.RVA         = SECTION_RVA;
+    mapping.Size        = section->Length;
+    return PeHandleExports(NULL, library, &mapping, 1, (uint8_t*)directory,
+        (size_t)(directory->AddressOfNames - directoryRva));
+}
+
+// Builds an import descriptor for the library, every other import carries a valid hint
+static PeImportDescriptor_t*
+build_importer(PeExecutable_t* importer, PeExecutable_t* library, struct SyntheticSection* section, int* expected)
+{
+    PeImportDescriptor_t* descriptors;
+    uint32_t              descriptorsRva;
+    char                  name[64];
+
+    descriptorsRva = SectionAllocate(section, sizeof(PeImportDescriptor_t) * 2);
+    descriptors    = SectionPointer(section, descriptorsRva);
+    memset(descriptors, 0, sizeof(PeImportDescriptor_t) * 2);
+    descriptors[0].ModuleName         = SectionAllocate(section, 16);
+    descriptors[0].ImportAddressTable = SectionAllocate(section, (IMPORTS + 1) * sizeof(uint64_t));
+    strcpy(SectionPointer(section, descriptors[0].ModuleName), "synthetic.dll");
+
+    for (int i = 0; i < IMPORTS; i++) {
+        PeImportNameDescriptor_t* nameDescriptor;
+        uint32_t                  nameRva;
+
+        expected[i] = rand() % EXPORTS;
+        ExportName(&name[0], expected[i]);
+        nameRva        = SectionAllocate(section, sizeof(uint16_t) + strlen(&name[0]) + 1);
+        nameDescriptor = SectionPointer(section, nameRva);
+        nameDescriptor->OrdinalHint = (i & 1) ? (uint16_t)expected[i] : (uint16_t)(rand() % EXPORTS);
+        strcpy((char*)&nameDescriptor->Name[0], &name[0]);
+    }
+
+    memset(importer, 0, sizeof(PeExecutable_t));
+    importer->Name         = MStringCreate("importer.app", StrUTF8);
+    importer->Architecture = PE_ARCHITECTURE_64;
+    importer->Libraries    = malloc(sizeof(list_t));
+    list_construct(importer->Libraries);
+    ELEMENT_INIT(&library->Header, 0, library);
+    list_append(importer->Libraries, &library->Header);
+    return descriptors;
+}
+
+// The import address table initially holds the name rvas, the loader replaces them
+static void
+reset_imports(PeImportDescriptor_t* descriptor, struct SyntheticSection* section, uint64_t* names)
+{
+    memcpy(SectionPointer(section, descriptor->ImportAddressTable), names, (IMPORTS + 1) * sizeof(uint64_t));
+}
+
+// Resolution as it was before the index, a scan of the export table for every import
+static PeExportedFunction_t*
+resolve_linear(PeExecutable_t* library, PeImportNameDescriptor_t* descriptor)
+{
+    PeExportedFunction_t* exports = library->ExportedFunctions;
+
+    if (descriptor->OrdinalHint != 0) {
+        for (int i = 0; i < library->NumberOfExportedFunctions; i++) {
+            if (exports[i].Ordinal == descriptor->OrdinalHint &&
+                !strcmp(exports[i].Name, (const char*)&descriptor->Name[0])) {
+                return &exports[i];
+            }
+        }
+    }
+
+    for (int i = 0; i < library->NumberOfExportedFunctions; i++) {
+        if (exports[i].Name != NULL && !strcmp(exports[i].Name, (const char*)&descriptor->Name[0])) {
+            return &exports[i];
+        }
+    }
+    return NULL;
+}
+
+static int
+test_lookups(PeExecutable_t* library)
+{
+    char name[64];
+
+    for (int i = 0; i < EXPORTS; i++) {
+        ExportName(&name[0], i);
+        CHECK(TEST_NAME, PeResolveFunction(library, &name[0]) == ExportAddress(i), "export %s resolved wrong", &name[0]);
+    }
+    CHECK(TEST_NAME, PeResolveFunction(library, "__vali_export_function_99999") == 0, "missing export was found");
+    CHECK(TEST_NAME, PeResolveFunction(library, "") == 0, "empty name was found");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct SyntheticSection librarySection  = { NULL, 1024 * 1024, 0 };
+    struct SyntheticSection importerSection = { NULL, 1024 * 1024, 0 };
+    PeExecutable_t*         library = malloc(sizeof(PeExecutable_t));
+    PeExecutable_t          importer;
+    PeImportDescriptor_t*   descriptor;
+    SectionMapping_t        mapping;
+    uint64_t*               names;
+    uint64_t*               table;
+    uint64_t                start;
+    uint64_t                linear;
+    uint64_t                indexed;
+    int                     expected[IMPORTS];
+
+    srand(1);
+    librarySection.Buffer  = calloc(1, librarySection.Length);
+    importerSection.Buffer = calloc(1, importerSection.Length);
+    names                  = calloc(IMPORTS + 1, sizeof(uint64_t));
+
+    CHECK(TEST_NAME, build_library(library, &librarySection) == OsSuccess, "exports failed");
+    CHECK(TEST_NAME, library->NumberOfExportedFunctions == EXPORTS, "%i exports", library->NumberOfExportedFunctions);
+    if (test_lookups(library)) {
+        return -1;
+    }
+
+    descriptor = build_importer(&importer, library, &importerSection, &expected[0]);
+    table      = SectionPointer(&importerSection, descriptor->ImportAddressTable);
+
+    // Record the name rvas of the import address table before it is resolved
+    for (int i = 0, rva = (int)(descriptor->ImportAddressTable + (IMPORTS + 1) * sizeof(uint64_t)); i < IMPORTS; i++) {
+        char name[64];
+        ExportName(&name[0], expected[i]);
+        names[i] = (uint64_t)rva;
+        rva     += ((int)(sizeof(uint16_t) + strlen(&name[0]) + 1) + 7) & ~7;
+    }
+
+    mapping.Handle      = NULL;
+    mapping.BasePointer = importerSection.Buffer;
+    mapping.RVA         = SECTION_RVA;
+    mapping.Size        = importerSection.Length;
+
+    start = NowNs();
+    for (int j = 0; j < ITERATIONS; j++) {
+        reset_imports(descriptor, &importerSection, names);
+        for (int i = 0; i < IMPORTS; i++) {
+            PeImportNameDescriptor_t* nameDescriptor = SectionPointer(&importerSection, (uint32_t)table[i]);
+            table[i] = resolve_linear(library, nameDescriptor)->Address;
+        }
+    }
+    linear = (NowNs() - start) / ITERATIONS;
+
+    start = NowNs();
+    for (int j = 0; j < ITERATIONS; j++) {
+        reset_imports(descriptor, &importerSection, names);
+        CHECK(TEST_NAME, PeHandleImports(NULL, &importer, &mapping, 1, (uint8_t*)descriptor,
+            sizeof(PeImportDescriptor_t) * 2) == OsSuccess, "imports failed");
+    }
+    indexed = (NowNs() - start) / ITERATIONS;
+
+    for (int i = 0; i < IMPORTS; i++) {
+        CHECK(TEST_NAME, table[i] == ExportAddress(expected[i]), "import %i resolved to 0x%" PRIx64, i, table[i]);
+    }
+    CHECK(TEST_NAME, table[IMPORTS] == 0, "import table terminator was overwritten");
+
+    printf("%i imports from %i exports: linear %8.1f us, indexed %6.1f us (%.0fx)\n",
+           IMPORTS, EXPORTS, linear / 1000.0, indexed / 1000.0, (double)linear / (double)indexed);
+    CHECK(TEST_NAME, indexed < linear, "indexed resolution was slower than the linear scan");
+
+    // The importer took a reference on the library when it resolved it
+    CHECK(TEST_NAME, library->References == 1 + ITERATIONS, "library has %i references", library->References);
+    list_remove(importer.Libraries, &library->Header);
+    MStringDestroy(importer.Name);
+    free(importer.Libraries);
+    PeUnloadImage(library);
+    free(librarySection.Buffer);
+    free(importerSection.Buffer);
+    free(names);
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}
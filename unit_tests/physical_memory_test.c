@@ -0,0 +1,309 @@
+
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+#include <pthread.h>
+
+#define _Out_Opt_
+#define DIVUP(a, b) (((a) + ((b) - 1)) / (b))
+
+typedef int IntStatus_t;
+
+static __thread UUId_t g_currentCore = 0;
+
+static UUId_t      ArchGetProcessorCoreId(void) { return g_currentCore; }
+static IntStatus_t InterruptDisable(void) { return 0; }
+static void        InterruptRestoreState(IntStatus_t State) { (void)State; }
+
+#include "../kernel/include/physical_memory.h"
+#include "../kernel/memory/physical_memory.c"
+
+#define PAGE_SIZE   0x1000
+#define PAGE_COUNT  (64 * 1024)       // 256MB
+#define HOLE_START  (0x9F000)         // Simulate the bios area and a reserved hole
+#define HOLE_END    (0x100000)
+
+#define THREAD_COUNT 4
+#define ITERATIONS   200000
+
+#define TEST_NAME "physical_memory_test"
+
+static PhysicalMemory_t g_memory;
+static void*            g_storage;
+static uint8_t*         g_owned;    // Reference of the pages handed out
+
+static void
+setup_memory(void)
+{
+    free(g_storage);
+    g_storage = malloc(PhysicalMemoryCalculateSize(PAGE_COUNT));
+    PhysicalMemoryConstruct(&g_memory, g_storage, PAGE_COUNT, PAGE_SIZE);
+    PhysicalMemoryAddRange(&g_memory, 0x1000, HOLE_START);
+    PhysicalMemoryAddRange(&g_memory, HOLE_END, (uintptr_t)PAGE_COUNT * PAGE_SIZE);
+    memset(g_owned, 0, PAGE_COUNT);
+}
+
+static size_t
+expected_free_pages(void)
+{
+    return PAGE_COUNT - 1 - ((HOLE_END - HOLE_START) / PAGE_SIZE);
+}
+
+static int
+own_pages(uintptr_t* pages, int count)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        size_t frame = pages[i] / PAGE_SIZE;
+        CHECK(TEST_NAME, (pages[i] % PAGE_SIZE) == 0, "page 0x%" PRIxIN " is not aligned", pages[i]);
+        CHECK(TEST_NAME, frame > 0 && frame < PAGE_COUNT, "page 0x%" PRIxIN " is out of range", pages[i]);
+        CHECK(TEST_NAME, pages[i] < HOLE_START || pages[i] >= HOLE_END, "page 0x%" PRIxIN " is reserved", pages[i]);
+        CHECK(TEST_NAME, !g_owned[frame], "page 0x%" PRIxIN " was handed out twice", pages[i]);
+        g_owned[frame] = 1;
+    }
+    return 0;
+}
+
+static void
+disown_pages(uintptr_t* pages, int count)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        g_owned[pages[i] / PAGE_SIZE] = 0;
+    }
+}
+
+// Drain the per-cpu lists of all cores by freeing through a core without a list
+static void
+drain_cpu_caches(void)
+{
+    UUId_t core = g_currentCore;
+    int    i;
+
+    g_currentCore = PHYSICAL_MEMORY_MAX_CPUS;
+    for (i = 0; i < PHYSICAL_MEMORY_MAX_CPUS; i++) {
+        PhysicalMemoryCpuCache_t* cache = &g_memory.CpuCaches[i];
+        PhysicalMemoryFree(&g_memory, cache->Count, &cache->Pages[0]);
+        cache->Count = 0;
+    }
+    g_currentCore = core;
+}
+
+static int
+check_statistics(size_t freePagesExpected)
+{
+    size_t blocks[PHYSICAL_MEMORY_ORDER_COUNT];
+    size_t pageCount;
+    size_t freePages;
+    size_t blockPages = 0;
+    size_t cachedPages = 0;
+    int    i;
+
+    PhysicalMemoryGetStatistics(&g_memory, &pageCount, &freePages, &blocks[0]);
+    for (i = 0; i < PHYSICAL_MEMORY_ORDER_COUNT; i++) {
+        uint32_t frame = g_memory.FreeLists[i];
+        size_t   listed = 0;
+
+        while (frame != PHYSICAL_PAGE_NONE) {
+            CHECK(TEST_NAME, (frame & ((1U << i) - 1)) == 0, "block %u of order %i is misaligned", frame, i);
+            CHECK(TEST_NAME, g_memory.Pages[frame].Order == i && g_memory.Pages[frame].Free, "block %u has wrong state", frame);
+            listed++;
+            frame = g_memory.Pages[frame].Next;
+        }
+        CHECK(TEST_NAME, listed == blocks[i], "order %i lists %" PRIuIN " blocks, stats say %" PRIuIN, i, listed, blocks[i]);
+        blockPages += blocks[i] << i;
+    }
+    for (i = 0; i < PHYSICAL_MEMORY_MAX_CPUS; i++) {
+        cachedPages += (size_t)g_memory.CpuCaches[i].Count;
+    }
+
+    CHECK(TEST_NAME, pageCount == PAGE_COUNT, "page count is %" PRIuIN, pageCount);
+    CHECK(TEST_NAME, freePages == blockPages + cachedPages, "free pages %" PRIuIN " do not match the free blocks", freePages);
+    CHECK(TEST_NAME, freePages == freePagesExpected, "%" PRIuIN " free pages, expected %" PRIuIN, freePages, freePagesExpected);
+    return 0;
+}
+
+static int
+test_random(void)
+{
+    static uintptr_t* allocations[1024];
+    static int        counts[1024];
+    size_t            pagesOut = 0;
+    int               i;
+
+    setup_memory();
+    srand(1);
+    for (i = 0; i < 100000; i++) {
+        int index = rand() % 1024;
+        if (allocations[index]) {
+            disown_pages(allocations[index], counts[index]);
+            PhysicalMemoryFree(&g_memory, counts[index], allocations[index]);
+            pagesOut -= (size_t)counts[index];
+            free(allocations[index]);
+            allocations[index] = NULL;
+        }
+        else {
+            int        count = (rand() % 4) ? (1 + rand() % 16) : (1 + rand() % 300);
+            int        contiguous = count <= 16 && (rand() % 8) == 0;
+            OsStatus_t status;
+
+            g_currentCore        = (UUId_t)(rand() % 4);
+            allocations[index]   = malloc(sizeof(uintptr_t) * (size_t)count);
+            counts[index]        = count;
+            status = contiguous ? PhysicalMemoryAllocateContiguous(&g_memory, count, allocations[index]) :
+                PhysicalMemoryAllocate(&g_memory, count, allocations[index]);
+            CHECK(TEST_NAME, status == OsSuccess, "allocation of %i pages failed, %" PRIuIN " pages allocated", count, pagesOut);
+            if (own_pages(allocations[index], count)) {
+                return -1;
+            }
+            pagesOut += (size_t)count;
+        }
+        if ((i % 10000) == 0 && check_statistics(expected_free_pages() - pagesOut)) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < 1024; i++) {
+        if (allocations[i]) {
+            disown_pages(allocations[i], counts[i]);
+            PhysicalMemoryFree(&g_memory, counts[i], allocations[i]);
+            free(allocations[i]);
+            allocations[i] = NULL;
+        }
+    }
+    g_currentCore = 0;
+    CHECK(TEST_NAME, !check_statistics(expected_free_pages()), "statistics are wrong after freeing everything");
+
+    // Once the per-cpu lists are drained everything must have merged back into
+    // the same blocks the memory was added as
+    drain_cpu_caches();
+    CHECK(TEST_NAME, !check_statistics(expected_free_pages()), "statistics are wrong after draining");
+    CHECK(TEST_NAME, g_memory.FreeBlocks[PHYSICAL_MEMORY_ORDER_COUNT - 1] == (PAGE_COUNT >> (PHYSICAL_MEMORY_ORDER_COUNT - 1)) - 1,
+        "memory did not coalesce, %" PRIuIN " max order blocks", g_memory.FreeBlocks[PHYSICAL_MEMORY_ORDER_COUNT - 1]);
+    return 0;
+}
+
+static int
+test_contiguous(void)
+{
+    uintptr_t pages[1024];
+    int       counts[] = { 1, 2, 3, 16, 100, 512, 1000, 1024 };
+    int       i, j;
+
+    setup_memory();
+    for (i = 0; i < (int)SIZEOF_ARRAY(counts); i++) {
+        size_t alignment = 1;
+        while (alignment < (size_t)counts[i]) {
+            alignment <<= 1;
+        }
+
+        CHECK(TEST_NAME, PhysicalMemoryAllocateContiguous(&g_memory, counts[i], &pages[0]) == OsSuccess,
+            "contiguous allocation of %i pages failed", counts[i]);
+        CHECK(TEST_NAME, ((pages[0] / PAGE_SIZE) % alignment) == 0, "run of %i pages is not aligned", counts[i]);
+        for (j = 1; j < counts[i]; j++) {
+            CHECK(TEST_NAME, pages[j] == pages[j - 1] + PAGE_SIZE, "run of %i pages is not contiguous", counts[i]);
+        }
+        if (own_pages(&pages[0], counts[i])) {
+            return -1;
+        }
+    }
+    CHECK(TEST_NAME, PhysicalMemoryAllocateContiguous(&g_memory, 1025, &pages[0]) == OsInvalidParameters,
+        "run larger than the max order was accepted");
+
+    // Exhaust the memory, allocations must fail without handing out anything
+    g_currentCore = PHYSICAL_MEMORY_MAX_CPUS;
+    while (PhysicalMemoryAllocate(&g_memory, 1024, &pages[0]) == OsSuccess) {
+        if (own_pages(&pages[0], 1024)) {
+            return -1;
+        }
+    }
+    CHECK(TEST_NAME, PhysicalMemoryAllocateContiguous(&g_memory, 1024, &pages[0]) == OsOutOfMemory,
+        "contiguous allocation succeeded on exhausted memory");
+    g_currentCore = 0;
+    return 0;
+}
+
+struct bench_thread {
+    pthread_t thread;
+    UUId_t    core;
+    int       errors;
+};
+
+static pthread_barrier_t g_barrier;
+
+static void*
+bench_worker(void* context)
+{
+    struct bench_thread* worker = context;
+    uintptr_t            pages[8];
+    int                  i, j;
+
+    g_currentCore = worker->core;
+    pthread_barrier_wait(&g_barrier);
+    for (i = 0; i < ITERATIONS / 8; i++) {
+        for (j = 0; j < 8; j++) {
+            if (PhysicalMemoryAllocate(&g_memory, 1, &pages[j]) != OsSuccess) {
+                worker->errors++;
+                return NULL;
+            }
+        }
+        PhysicalMemoryFree(&g_memory, 8, &pages[0]);
+    }
+    return NULL;
+}
+
+static int
+run_bench(const char* name, int threadCount, int cached)
+{
+    struct bench_thread workers[THREAD_COUNT];
+    unsigned long long  start;
+    unsigned long long  end;
+    int                 errors = 0;
+    int                 i;
+
+    setup_memory();
+    pthread_barrier_init(&g_barrier, NULL, (unsigned)threadCount + 1);
+    for (i = 0; i < threadCount; i++) {
+        workers[i].core   = cached ? (UUId_t)i : PHYSICAL_MEMORY_MAX_CPUS;
+        workers[i].errors = 0;
+        pthread_create(&workers[i].thread, NULL, bench_worker, &workers[i]);
+    }
+
+    pthread_barrier_wait(&g_barrier);
+    start = NowNs();
+    for (i = 0; i < threadCount; i++) {
+        pthread_join(workers[i].thread, NULL);
+        errors += workers[i].errors;
+    }
+    end = NowNs();
+    pthread_barrier_destroy(&g_barrier);
+
+    CHECK(TEST_NAME, errors == 0, "%s: %i allocations failed", name, errors);
+    CHECK(TEST_NAME, !check_statistics(expected_free_pages()), "%s: pages were lost", name);
+    printf("%-8s threads %i: %8.2f Mpages/s\n", name, threadCount,
+        ((double)ITERATIONS * threadCount) / ((double)(end - start) / 1000.0));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    g_owned = malloc(PAGE_COUNT);
+    if (test_random() || test_contiguous()) {
+        return -1;
+    }
+
+    printf("%i single page allocations and frees per thread\n", ITERATIONS);
+    for (i = 1; i <= THREAD_COUNT; i *= 2) {
+        if (run_bench("direct", i, 0) || run_bench("per-cpu", i, 1)) {
+            return -1;
+        }
+    }
+
+    free(g_owned);
+    free(g_storage);
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}
@@ -0,0 +1,119 @@
+
+#define __TEST
+
+#include "scheduler_mock.h"
+
+#define OBJECT_COUNT 256
+#define ITERATIONS   1000000
+
+static Thread_t g_threads[OBJECT_COUNT];
+
+static int
+setup_objects(int levelCount)
+{
+    Scheduler_t* scheduler = &g_cores[0].Scheduler;
+    int          highestLevel = SCHEDULER_LEVEL_LOW;
+    int          i;
+
+    memset(scheduler, 0, sizeof(Scheduler_t));
+    for (i = 0; i < OBJECT_COUNT; i++) {
+        // Spread the objects over the <levelCount> lowest priority levels, which
+        // is the worst case for a scan from the top
+        int level = SCHEDULER_LEVEL_LOW - (i % levelCount);
+
+        g_threads[i].Name   = "bench";
+        g_threads[i].Handle = SchedulerCreateObject(&g_threads[i], 0);
+        UpdatePressureForObject(scheduler, g_threads[i].Handle, level);
+        SchedulerQueueObject(g_threads[i].Handle);
+        highestLevel = MIN(highestLevel, level);
+    }
+    return highestLevel;
+}
+
+static void
+cleanup_objects(void)
+{
+    int i;
+    for (i = 0; i < OBJECT_COUNT; i++) {
+        SchedulerDestroyObject(g_threads[i].Handle);
+    }
+}
+
+static int
+bench_level_count(int levelCount)
+{
+    SchedulerObject_t* current = NULL;
+    unsigned long long start;
+    unsigned long long end;
+    size_t             deadline;
+    int                expectedLevel;
+    int                i;
+
+    expectedLevel = setup_objects(levelCount);
+
+    start = NowNs();
+    for (i = 0; i < ITERATIONS; i++) {
+        Thread_t* next = SchedulerAdvance(current, 0, 1, &deadline);
+        if (!next) {
+            fprintf(stderr, "scheduler_bench: no object returned at iteration %i\n", i);
+            return -1;
+        }
+
+        current = next->Handle;
+        if (current->Queue != expectedLevel) {
+            fprintf(stderr, "scheduler_bench: picked level %i, expected %i\n", current->Queue, expectedLevel);
+            return -1;
+        }
+    }
+    end = NowNs();
+
+    printf("levels %2i: %6.1f ns per SchedulerAdvance\n",
+        levelCount, (double)(end - start) / (double)ITERATIONS);
+
+    // Hand the running object back so all objects can be destroyed
+    (void)ExecuteEvent(current, EVENT_SCHEDULE);
+    cleanup_objects();
+    return 0;
+}
+
+static int
+test_bitmap_consistency(void)
+{
+    Scheduler_t* scheduler = &g_cores[0].Scheduler;
+    int          i;
+
+    (void)setup_objects(SCHEDULER_LEVEL_COUNT - 1);
+    SchedulerBoost(scheduler);
+    for (i = 0; i < SCHEDULER_LEVEL_COUNT; i++) {
+        int occupied = (scheduler->QueueBitmap[i / SCHEDULER_BITMAP_BITS] >> (i % SCHEDULER_BITMAP_BITS)) & 1;
+        if (occupied != (scheduler->Queues[i].Head != NULL)) {
+            fprintf(stderr, "scheduler_bench: bitmap mismatch for level %i after boost\n", i);
+            return -1;
+        }
+    }
+
+    if (GetFirstOccupiedQueue(scheduler) != 0) {
+        fprintf(stderr, "scheduler_bench: boost did not move objects to level 0\n");
+        return -1;
+    }
+    cleanup_objects();
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const int levelCounts[] = { 1, 8, 32, SCHEDULER_LEVEL_COUNT - 1 };
+    int              i;
+
+    if (test_bitmap_consistency()) {
+        return -1;
+    }
+
+    printf("%i runnable objects, %i iterations\n", OBJECT_COUNT, ITERATIONS);
+    for (i = 0; i < (int)SIZEOF_ARRAY(levelCounts); i++) {
+        if (bench_level_count(levelCounts[i])) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,166 @@
+
+#define __TEST
+
+#include "scheduler_mock.h"
+
+#define OBJECT_COUNT 32
+
+static Thread_t g_threads[OBJECT_COUNT];
+
+#define TEST_NAME "scheduler_migration_test"
+
+static void
+setup_objects_on_core0(int coreCount)
+{
+    int i;
+
+    mock_set_core_count(coreCount);
+
+    // Create all objects while only the first core is visible
+    g_coreCount = 1;
+    for (i = 0; i < OBJECT_COUNT; i++) {
+        g_threads[i].Name   = "worker";
+        g_threads[i].Handle = SchedulerCreateObject(&g_threads[i], 0);
+        SchedulerQueueObject(g_threads[i].Handle);
+    }
+    g_coreCount = coreCount;
+}
+
+static void
+cleanup_objects(void)
+{
+    int i;
+    for (i = 0; i < OBJECT_COUNT; i++) {
+        kfree(g_threads[i].Handle);
+    }
+}
+
+static Thread_t*
+advance_core(int core, SchedulerObject_t* current, size_t passed, size_t* deadline)
+{
+    Thread_t* next;
+    g_currentCore = core;
+    next = SchedulerAdvance(current, 0, passed, deadline);
+    g_currentCore = 0;
+    return next;
+}
+
+static int
+check_accounting(void)
+{
+    unsigned long bandwidth[MOCK_MAX_CORES] = { 0 };
+    int           objects[MOCK_MAX_CORES]   = { 0 };
+    int           i;
+
+    for (i = 0; i < OBJECT_COUNT; i++) {
+        SchedulerObject_t* object = g_threads[i].Handle;
+        bandwidth[object->CoreId] += object->TimeSlice;
+        objects[object->CoreId]++;
+    }
+
+    for (i = 0; i < g_coreCount; i++) {
+        Scheduler_t* scheduler = &g_cores[i].Scheduler;
+        CHECK(TEST_NAME, atomic_load(&scheduler->Bandwidth) == bandwidth[i], "bandwidth mismatch on core %i", i);
+        CHECK(TEST_NAME, atomic_load(&scheduler->ObjectCount) == objects[i], "object count mismatch on core %i", i);
+    }
+    return 0;
+}
+
+static int
+test_idle_steal(void)
+{
+    SchedulerObject_t* running;
+    Thread_t*          next;
+    size_t             deadline;
+
+    setup_objects_on_core0(2);
+
+    // Objects queued during the current generation of core 0 are not stealable
+    next = advance_core(1, NULL, 1, &deadline);
+    CHECK(TEST_NAME, next == NULL, "stole an object queued in the current generation");
+    CHECK(TEST_NAME, deadline == SCHEDULER_BALANCE_INTERVAL, "idle core did not keep ticking, deadline %" PRIuIN, deadline);
+
+    next    = advance_core(0, NULL, 1, &deadline);
+    running = next->Handle;
+
+    next = advance_core(1, NULL, 1, &deadline);
+    CHECK(TEST_NAME, next != NULL, "idle core did not steal");
+    CHECK(TEST_NAME, next->Handle != running, "stole the running object");
+    CHECK(TEST_NAME, next->Handle->CoreId == 1, "stolen object was not moved to core 1");
+    CHECK(TEST_NAME, SchedulerGetMigrations(&g_cores[1].Scheduler) == 1, "migration was not counted");
+    CHECK(TEST_NAME, atomic_load(&next->Handle->State) == STATE_RUNNING, "stolen object is not running");
+    CHECK(TEST_NAME, !check_accounting(), "accounting failed after steal");
+
+    cleanup_objects();
+    return 0;
+}
+
+static int
+test_bound_objects(void)
+{
+    Thread_t* next;
+    size_t    deadline;
+    int       i;
+
+    setup_objects_on_core0(2);
+    for (i = 0; i < OBJECT_COUNT; i++) {
+        g_threads[i].Handle->Flags |= SCHEDULER_FLAG_BOUND;
+    }
+
+    (void)advance_core(0, NULL, 1, &deadline);
+    next = advance_core(1, NULL, 1, &deadline);
+    CHECK(TEST_NAME, next == NULL, "stole a bound object");
+    CHECK(TEST_NAME, SchedulerGetMigrations(&g_cores[1].Scheduler) == 0, "migration counted for bound object");
+
+    cleanup_objects();
+    return 0;
+}
+
+static int
+test_balancing(void)
+{
+    SchedulerObject_t* current[MOCK_MAX_CORES] = { NULL };
+    const int          coreCount = 4;
+    size_t             deadline;
+    unsigned long      minBandwidth = __MASK;
+    unsigned long      maxBandwidth = 0;
+    int                step;
+    int                i;
+
+    setup_objects_on_core0(coreCount);
+
+    // Round robin the cores for a simulated 10 seconds
+    for (step = 0; step < 1000; step++) {
+        for (i = 0; i < coreCount; i++) {
+            Thread_t* next = advance_core(i, current[i], 10, &deadline);
+            current[i] = (next != NULL) ? next->Handle : NULL;
+            if (current[i] != NULL) {
+                CHECK(TEST_NAME, current[i]->CoreId == (UUId_t)i, "core %i runs an object owned by core %u", i, current[i]->CoreId);
+            }
+        }
+    }
+    CHECK(TEST_NAME, !check_accounting(), "accounting failed after balancing");
+
+    for (i = 0; i < coreCount; i++) {
+        unsigned long bandwidth = atomic_load(&g_cores[i].Scheduler.Bandwidth);
+        minBandwidth = MIN(minBandwidth, bandwidth);
+        maxBandwidth = MAX(maxBandwidth, bandwidth);
+        printf("core %i: %2i objects, bandwidth %3lu, migrations %" PRIuIN "\n", i,
+            atomic_load(&g_cores[i].Scheduler.ObjectCount), bandwidth,
+            SchedulerGetMigrations(&g_cores[i].Scheduler));
+    }
+    CHECK(TEST_NAME, (maxBandwidth - minBandwidth) <= SCHEDULER_BALANCE_THRESHOLD + (2 * SCHEDULER_TIMESLICE_INITIAL),
+        "load was not balanced, skew %lu", maxBandwidth - minBandwidth);
+
+    cleanup_objects();
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (test_idle_steal() || test_bound_objects() || test_balancing()) {
+        return -1;
+    }
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}
@@ -0,0 +1,105 @@
+/**
+ * Single core machine model for compiling the kernel scheduler in the
+ * unit test environment.
+ */
+
+#include "kernel_mock.h"
+
+#define THREADING_IDLE    0x1
+#define CpuStateRunning   0x1
+#define CpuFunctionCustom 0
+
+typedef struct Scheduler Scheduler_t;
+typedef struct SystemCpuCore SystemCpuCore_t;
+typedef struct Thread Thread_t;
+
+typedef struct SystemCpu {
+    SystemCpuCore_t* Cores;
+} SystemCpu_t;
+
+typedef struct SystemDomain {
+    SystemCpu_t CoreGroup;
+} SystemDomain_t;
+
+typedef struct SystemMachine {
+    SystemCpu_t  Processor;
+    _Atomic(int) NumberOfActiveCores;
+} SystemMachine_t;
+
+#include "../kernel/include/scheduler.h"
+
+struct SystemCpuCore {
+    UUId_t      Id;
+    Scheduler_t Scheduler;
+    Thread_t*   CurrentThread;
+};
+
+struct Thread {
+    struct SchedulerObject* Handle;
+    const char*             Name;
+};
+
+// Tests select the number of cores and which core is executing
+#define MOCK_MAX_CORES 8
+
+static SystemCpuCore_t g_cores[MOCK_MAX_CORES];
+static int             g_coreCount   = 1;
+static int             g_currentCore = 0;
+static SystemMachine_t g_machine = { { &g_cores[0] }, 1 };
+
+static void
+mock_set_core_count(int coreCount)
+{
+    int i;
+    memset(&g_cores[0], 0, sizeof(g_cores));
+    for (i = 0; i < coreCount; i++) {
+        g_cores[i].Id = (UUId_t)i;
+    }
+    g_coreCount   = coreCount;
+    g_currentCore = 0;
+    atomic_store(&g_machine.NumberOfActiveCores, coreCount);
+}
+
+static SystemCpuCore_t* CpuCoreCurrent(void) { return &g_cores[g_currentCore]; }
+static SystemCpuCore_t* GetProcessorCore(UUId_t CoreId) { return &g_cores[CoreId]; }
+static SystemCpuCore_t* CpuCoreNext(SystemCpuCore_t* Core)
+{
+    int index = (int)(Core - &g_cores[0]) + 1;
+    return index < g_coreCount ? &g_cores[index] : NULL;
+}
+static Scheduler_t* CpuCoreScheduler(SystemCpuCore_t* Core) { return &Core->Scheduler; }
+static UUId_t CpuCoreId(SystemCpuCore_t* Core) { return Core->Id; }
+static int CpuCoreState(SystemCpuCore_t* Core) { (void)Core; return CpuStateRunning; }
+static Thread_t* CpuCoreCurrentThread(SystemCpuCore_t* Core) { return Core->CurrentThread; }
+static SystemDomain_t* GetCurrentDomain(void) { return NULL; }
+static SystemMachine_t* GetMachine(void) { return &g_machine; }
+static UUId_t ArchGetProcessorCoreId(void) { return (UUId_t)g_currentCore; }
+static void ArchStallProcessorCore(size_t Milliseconds) { (void)Milliseconds; }
+static const char* ThreadName(Thread_t* Thread) { return Thread->Name; }
+static struct SchedulerObject* ThreadSchedulerHandle(Thread_t* Thread) { return Thread->Handle; }
+static int ThreadIsCurrentIdle(UUId_t CoreId) { (void)CoreId; return 0; }
+static void ThreadingYield(void) { }
+
+// Tests can install a hook to observe which tick values the scheduler reads
+static void (*g_tickHook)(clock_t*) = NULL;
+static void TimersGetSystemTick(clock_t* Tick)
+{
+    *Tick = 0;
+    if (g_tickHook) {
+        g_tickHook(Tick);
+    }
+}
+
+// Messages to other cores are executed synchronously on the target core
+static OsStatus_t TxuMessageSend(UUId_t CoreId, int Type, void (*Function)(void*), void* Argument, int Async)
+{
+    int previousCore = g_currentCore;
+    (void)Type; (void)Async;
+
+    g_currentCore = (int)CoreId;
+    Function(Argument);
+    g_currentCore = previousCore;
+    return OsSuccess;
+}
+
+#include "../kernel/scheduling/scheduler.c"
@@ -0,0 +1,260 @@
+
+#define __TEST
+
+#include "scheduler_mock.h"
+
+#define OBJECT_COUNT 64
+#define STEP_COUNT   200000
+
+// Reference model of the sleep queue that decrements every sleeper on each
+// scheduler advance, objects put to sleep during the advance are skipped.
+struct reference_sleeper {
+    int      sleeping;
+    int      just_added;
+    size_t   time_left;
+    uint64_t deadline;
+    size_t   sequence;
+};
+
+static Thread_t                 g_threads[OBJECT_COUNT];
+static struct reference_sleeper g_reference[OBJECT_COUNT];
+static uint64_t                 g_referenceClock;
+static size_t                   g_referenceSequence;
+
+static int g_wakeups[OBJECT_COUNT];
+static int g_wakeupCount;
+
+static void
+record_wakeup(clock_t* tick)
+{
+    int i;
+    for (i = 0; i < OBJECT_COUNT; i++) {
+        if (tick == &g_threads[i].Handle->InterruptedAt) {
+            g_wakeups[g_wakeupCount++] = i;
+            return;
+        }
+    }
+}
+
+static int
+wakes_before(int i, int j)
+{
+    if (g_reference[i].deadline != g_reference[j].deadline) {
+        return g_reference[i].deadline < g_reference[j].deadline;
+    }
+    return g_reference[i].sequence < g_reference[j].sequence;
+}
+
+static size_t
+reference_advance(size_t passed, int* expired)
+{
+    size_t next = __MASK;
+    int    i;
+
+    g_referenceClock += passed;
+    for (i = 0; i < OBJECT_COUNT; i++) {
+        struct reference_sleeper* sleeper = &g_reference[i];
+        expired[i] = 0;
+        if (!sleeper->sleeping) {
+            continue;
+        }
+
+        if (!sleeper->just_added) {
+            sleeper->time_left -= MIN(sleeper->time_left, passed);
+            if (!sleeper->time_left) {
+                sleeper->sleeping = 0;
+                expired[i] = 1;
+                continue;
+            }
+        }
+        sleeper->just_added = 0;
+        next = MIN(next, sleeper->time_left);
+    }
+    return next;
+}
+
+static int
+run_stress(unsigned int seed)
+{
+    Scheduler_t*       scheduler = &g_cores[0].Scheduler;
+    SchedulerObject_t* current   = NULL;
+    int                expired[OBJECT_COUNT];
+    int                totalWakeups = 0;
+    int                step;
+    int                i;
+
+    srand(seed);
+    memset(scheduler, 0, sizeof(Scheduler_t));
+    memset(g_reference, 0, sizeof(g_reference));
+    g_referenceClock    = 0;
+    g_referenceSequence = 0;
+    g_tickHook          = record_wakeup;
+
+    for (i = 0; i < OBJECT_COUNT; i++) {
+        g_threads[i].Name   = "sleeper";
+        g_threads[i].Handle = SchedulerCreateObject(&g_threads[i], 0);
+        SchedulerQueueObject(g_threads[i].Handle);
+    }
+
+    for (step = 0; step < STEP_COUNT; step++) {
+        size_t    passed = (size_t)(rand() % 16);
+        size_t    expectedDeadline;
+        size_t    referenceNext;
+        size_t    deadline;
+        Thread_t* next;
+
+        // Let the running object go to sleep
+        if (current != NULL && (rand() % 2)) {
+            Thread_t* thread  = current->Object;
+            size_t    timeout = 1 + (size_t)(rand() % 100);
+            int       index   = (int)(thread - &g_threads[0]);
+            clock_t   interruptedAt;
+
+            g_cores[0].CurrentThread = thread;
+            (void)SchedulerSleep(timeout, &interruptedAt);
+
+            g_reference[index].sleeping   = 1;
+            g_reference[index].just_added = 1;
+            g_reference[index].time_left  = timeout;
+            g_reference[index].deadline   = g_referenceClock + passed + timeout;
+            g_reference[index].sequence   = g_referenceSequence++;
+        }
+
+        // Wake up a random sleeper early
+        if (!(rand() % 8)) {
+            int index = rand() % OBJECT_COUNT;
+            if (g_reference[index].sleeping && !g_reference[index].just_added) {
+                SchedulerExpediteObject(g_threads[index].Handle);
+                g_reference[index].sleeping = 0;
+            }
+        }
+
+        g_wakeupCount = 0;
+        next          = SchedulerAdvance(current, 0, passed, &deadline);
+        referenceNext = reference_advance(passed, expired);
+        current       = (next != NULL) ? next->Handle : NULL;
+
+        for (i = 0; i < OBJECT_COUNT; i++) {
+            SchedulerObject_t* object = g_threads[i].Handle;
+            if (expired[i] && object->TimeoutReason != OsTimeout) {
+                fprintf(stderr, "scheduler_sleep_test: object %i did not time out at step %i\n", i, step);
+                return -1;
+            }
+
+            if (g_reference[i].sleeping != IsInSleepQueue(scheduler, object)) {
+                fprintf(stderr, "scheduler_sleep_test: object %i sleep state mismatch at step %i\n", i, step);
+                return -1;
+            }
+        }
+
+        for (i = 0; i < g_wakeupCount; i++) {
+            if (!expired[g_wakeups[i]]) {
+                fprintf(stderr, "scheduler_sleep_test: object %i woke up early at step %i\n", g_wakeups[i], step);
+                return -1;
+            }
+
+            if (i > 0 && !wakes_before(g_wakeups[i - 1], g_wakeups[i])) {
+                fprintf(stderr, "scheduler_sleep_test: wakeup order mismatch at step %i\n", step);
+                return -1;
+            }
+        }
+
+        for (i = 0; i < OBJECT_COUNT; i++) {
+            g_wakeupCount -= expired[i];
+        }
+        if (g_wakeupCount != 0) {
+            fprintf(stderr, "scheduler_sleep_test: missing wakeups at step %i\n", step);
+            return -1;
+        }
+
+        if (next != NULL) {
+            expectedDeadline = MIN(next->Handle->TimeSlice, referenceNext);
+            totalWakeups++;
+        }
+        else {
+            expectedDeadline = (referenceNext == __MASK) ? 0 : referenceNext;
+        }
+
+        if (deadline != expectedDeadline) {
+            fprintf(stderr, "scheduler_sleep_test: deadline %" PRIuIN " expected %" PRIuIN " at step %i\n",
+                deadline, expectedDeadline, step);
+            return -1;
+        }
+    }
+
+    g_tickHook = NULL;
+    if (current != NULL) {
+        (void)ExecuteEvent(current, EVENT_SCHEDULE);
+    }
+    for (i = 0; i < OBJECT_COUNT; i++) {
+        SchedulerDestroyObject(g_threads[i].Handle);
+    }
+
+    printf("seed %u: %i steps, %i scheduled\n", seed, STEP_COUNT, totalWakeups);
+    return 0;
+}
+
+static int
+bench_sleepers(int sleeperCount)
+{
+    Scheduler_t*       scheduler = &g_cores[0].Scheduler;
+    Thread_t*          threads;
+    unsigned long long start;
+    unsigned long long end;
+    size_t             deadline;
+    int                i;
+
+    memset(scheduler, 0, sizeof(Scheduler_t));
+    threads = calloc((size_t)sleeperCount, sizeof(Thread_t));
+    if (!threads) {
+        return -1;
+    }
+
+    // Park all the threads with long timeouts
+    for (i = 0; i < sleeperCount; i++) {
+        clock_t interruptedAt;
+
+        threads[i].Name   = "sleeper";
+        threads[i].Handle = SchedulerCreateObject(&threads[i], 0);
+        SchedulerQueueObject(threads[i].Handle);
+        (void)SchedulerAdvance(NULL, 0, 0, &deadline);
+
+        g_cores[0].CurrentThread = &threads[i];
+        (void)SchedulerSleep(1000000 + (size_t)i, &interruptedAt);
+        (void)SchedulerAdvance(threads[i].Handle, 0, 0, &deadline);
+    }
+
+    // Measure the tick cost while nothing expires
+    start = NowNs();
+    for (i = 0; i < 100000; i++) {
+        (void)SchedulerAdvance(NULL, 0, 1, &deadline);
+    }
+    end = NowNs();
+    printf("sleepers %6i: %6.1f ns per tick\n", sleeperCount, (double)(end - start) / 100000.0);
+
+    for (i = 0; i < sleeperCount; i++) {
+        SchedulerDestroyObject(threads[i].Handle);
+    }
+    free(threads);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const int sleeperCounts[] = { 16, 1024, 16384 };
+    unsigned int     seed;
+    int              i;
+
+    for (seed = 1; seed <= 4; seed++) {
+        if (run_stress(seed)) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < (int)SIZEOF_ARRAY(sleeperCounts); i++) {
+        if (bench_sleepers(sleeperCounts[i])) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,673 @@
+
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define _Out_Opt_
+#define _CRT_UNUSED(x) (void)x
+#define OsDeviceError  (int)10
+#define UUID_INVALID   (UUId_t)0xFFFFFFFF
+
+#define PACKED_TYPESTRUCT(name, body) typedef struct __attribute__((packed)) name body name##_t
+#define LOBYTE(l)  ((uint8_t)(uint16_t)(l))
+#define HIBYTE(l)  ((uint8_t)((((uint16_t)(l)) >> 8) & 0xFF))
+#define LODWORD(l) ((uint32_t)(l))
+#define HIDWORD(l) ((uint32_t)(((uint64_t)(l)) >> 32))
+#define LOWORD(l)  ((uint16_t)(uint32_t)(l))
+
+typedef uint32_t reg32_t;
+typedef int      spinlock_t;
+
+typedef struct BusDevice { int Id; } BusDevice_t;
+typedef struct DeviceIo { int Id; } DeviceIo_t;
+
+typedef union {
+    struct { uint32_t LowPart; uint32_t HighPart; } u;
+    uint64_t QuadPart;
+} LargeUInteger_t;
+
+#define __STORAGE_OPERATION_READ  0x00000001
+#define __STORAGE_OPERATION_WRITE 0x00000002
+#define __STORAGE_SUBMIT_NOTIFY   0x00000001
+#define __STORAGE_MAX_SEGMENTS    64
+#define __STORAGE_MAX_FINISHED    256
+
+typedef struct StorageDescriptor {
+    UUId_t       Driver;
+    UUId_t       Device;
+    unsigned int Flags;
+    char         Model[64];
+    char         Serial[32];
+    size_t       SectorSize;
+    uint64_t     SectorCount;
+} StorageDescriptor_t;
+
+typedef struct StorageTransferSegment {
+    uint64_t Sector;
+    UUId_t   BufferHandle;
+    size_t   BufferOffset;
+    size_t   SectorCount;
+} StorageTransferSegment_t;
+
+// Dma buffers are plain host memory, physical addresses are the virtual addresses
+#define DMA_UNCACHEABLE 0x00000002U
+#define DMA_CLEAN       0x00000004U
+#define DMA_PAGE_SIZE   0x1000
+
+struct dma_sg {
+    uintptr_t address;
+    size_t    length;
+};
+
+struct dma_sg_table {
+    struct dma_sg* entries;
+    int            count;
+};
+
+struct dma_buffer_info {
+    const char*  name;
+    size_t       length;
+    size_t       capacity;
+    unsigned int flags;
+};
+
+struct dma_attachment {
+    UUId_t handle;
+    void*  buffer;
+    size_t length;
+};
+
+static struct dma_attachment g_dmaBuffers[16];
+static int                   g_dmaBufferCount = 1;
+
+static OsStatus_t
+dma_create(struct dma_buffer_info* info, struct dma_attachment* attachment)
+{
+    size_t length = (info->capacity + DMA_PAGE_SIZE - 1) & ~(size_t)(DMA_PAGE_SIZE - 1);
+    if (g_dmaBufferCount == SIZEOF_ARRAY(g_dmaBuffers)) {
+        return OsOutOfMemory;
+    }
+
+    attachment->handle = (UUId_t)g_dmaBufferCount;
+    attachment->buffer = aligned_alloc(DMA_PAGE_SIZE, length);
+    attachment->length = info->length;
+    memset(attachment->buffer, 0, length);
+    g_dmaBuffers[g_dmaBufferCount++] = *attachment;
+    return OsSuccess;
+}
+
+static OsStatus_t
+dma_attach(UUId_t handle, struct dma_attachment* attachment)
+{
+    if (handle == 0 || handle >= (UUId_t)g_dmaBufferCount) {
+        return OsDoesNotExist;
+    }
+    *attachment = g_dmaBuffers[handle];
+    return OsSuccess;
+}
+
+static OsStatus_t dma_detach(struct dma_attachment* attachment) { return OsSuccess; }
+static OsStatus_t dma_attachment_unmap(struct dma_attachment* attachment) { return OsSuccess; }
+
+// The buffers are physically contiguous, so only the requested range is described
+static OsStatus_t
+dma_get_sg_table(struct dma_attachment* attachment, struct dma_sg_table* table, int maxCount)
+{
+    table->count   = 1;
+    table->entries = malloc(sizeof(struct dma_sg));
+    table->entries[0].address = (uintptr_t)attachment->buffer;
+    table->entries[0].length  = attachment->length;
+    return OsSuccess;
+}
+
+static OsStatus_t
+dma_sg_table_offset(struct dma_sg_table* table, size_t offset, int* sgIndex, size_t* sgOffset)
+{
+    if (offset >= table->entries[0].length) {
+        return OsInvalidParameters;
+    }
+    *sgIndex  = 0;
+    *sgOffset = offset;
+    return OsSuccess;
+}
+
+/**
+ * The gracht link is a socket pair between the client thread and the driver
+ * thread, so every call is a real round trip through the host kernel
+ */
+struct gracht_message {
+    int client;
+};
+
+typedef struct gracht_server gracht_server_t;
+static gracht_server_t* __crt_get_module_server(void) { return NULL; }
+
+#define GRACHT_MESSAGE_DEFERRABLE_SIZE(message) sizeof(struct gracht_message)
+
+static void
+gracht_server_defer_message(struct gracht_message* message, struct gracht_message* deferred)
+{
+    *deferred = *message;
+}
+
+enum sys_transfer_direction {
+    SYS_TRANSFER_DIRECTION_READ  = __STORAGE_OPERATION_READ,
+    SYS_TRANSFER_DIRECTION_WRITE = __STORAGE_OPERATION_WRITE
+};
+
+enum bench_call {
+    CALL_TRANSFER,
+    CALL_SUBMIT,
+    CALL_POLL,
+    CALL_EVENT,
+    CALL_EXIT
+};
+
+struct bench_message {
+    int                      Call;
+    int                      Status;
+    uint64_t                 Arguments[4];
+    uint32_t                 SegmentCount;
+    StorageTransferSegment_t Segments[__STORAGE_MAX_SEGMENTS];
+};
+
+#define MESSAGE_SIZE(message) (offsetof(struct bench_message, Segments) + \
+    (message)->SegmentCount * sizeof(StorageTransferSegment_t))
+
+static void
+bench_send(int socket, struct bench_message* message)
+{
+    ssize_t written = send(socket, message, MESSAGE_SIZE(message), 0);
+    assert(written == (ssize_t)MESSAGE_SIZE(message));
+}
+
+static void
+bench_reply(struct gracht_message* message, int call, OsStatus_t status, uint64_t value)
+{
+    struct bench_message reply = { 0 };
+    reply.Call         = call;
+    reply.Status       = (int)status;
+    reply.Arguments[0] = value;
+    bench_send(message->client, &reply);
+}
+
+static void ctt_storage_transfer_response(struct gracht_message* message, OsStatus_t status, size_t sectorsTransferred) {
+    bench_reply(message, CALL_TRANSFER, status, sectorsTransferred);
+}
+static void ctt_storage_submit_response(struct gracht_message* message, OsStatus_t status, UUId_t requestId) {
+    bench_reply(message, CALL_SUBMIT, status, requestId);
+}
+static void ctt_storage_poll_response(struct gracht_message* message, OsStatus_t status, size_t sectorsTransferred) {
+    bench_reply(message, CALL_POLL, status, sectorsTransferred);
+}
+
+static void
+ctt_storage_event_transfer_complete_single(gracht_server_t* server, int client, UUId_t deviceId,
+    UUId_t requestId, OsStatus_t status, size_t sectorsTransferred)
+{
+    struct bench_message event = { 0 };
+    event.Call         = CALL_EVENT;
+    event.Status       = (int)status;
+    event.Arguments[0] = requestId;
+    event.Arguments[1] = sectorsTransferred;
+    bench_send(client, &event);
+}
+
+static int thrd_sleepex(size_t milliseconds) { return 0; }
+
+#define WaitForConditionWithFault(fault, condition, runs, wait) \
+    fault = 0; \
+    for (unsigned int timeout_ = 0; !(condition); timeout_++) { \
+        if (timeout_ >= runs) { fault = 1; break; } \
+        thrd_sleepex(wait); \
+    }
+
+// Writes to CI are routed through the mock HBA to let it pick up the commands as they are issued
+static void hba_write_register(reg32_t* reg, reg32_t value);
+
+#undef WRITE_VOLATILE
+#define WRITE_VOLATILE(x, v) hba_write_register((reg32_t*)&(x), (reg32_t)(v))
+
+#include "../modules/storage/ahci/dispatch.c"
+#include "../modules/storage/ahci/port.c"
+#include "../modules/storage/ahci/transactions.c"
+
+#define TEST_NAME "storage_batch_bench"
+
+// An in-memory disk of 128MB, commands complete as soon as the driver thread gets to them
+#define SECTOR_SIZE    512
+#define DISK_SECTORS   (256 * 1024)
+#define READ_COUNT     19200
+#define LARGE_SECTORS  (0x10000 + 8)
+
+static struct {
+    AhciController_t* Controller;
+    AhciPort_t*       Port;
+    uint8_t*          Disk;
+    reg32_t           Accepted;
+    int               Commands;
+    int               Errors;
+} g_hba;
+
+static void
+hba_write_register(reg32_t* reg, reg32_t value)
+{
+    if (!g_hba.Port || reg != &g_hba.Port->Registers->CI) {
+        *(volatile reg32_t*)reg = value;
+        return;
+    }
+    g_hba.Accepted |= value & ~*reg;
+    *(volatile reg32_t*)reg |= value;
+}
+
+static void
+hba_execute(int slot)
+{
+    AHCICommandList_t*   commandList = (AHCICommandList_t*)g_hba.Port->CommandListDMA.buffer;
+    AHCICommandHeader_t* header      = &commandList->Headers[slot];
+    AHCICommandTable_t*  table       = AhciPortGetCommandTable(g_hba.Port, slot);
+    FISRegisterH2D_t*    fis         = (FISRegisterH2D_t*)&table->FISCommand[0];
+    AHCIFis_t*           receivedFis = (AHCIFis_t*)g_hba.Port->RecievedFisDMA.buffer;
+    size_t               transferred = 0;
+    uint64_t             sector;
+    size_t               count;
+    int                  i;
+
+    sector = (uint64_t)fis->SectorNo | ((uint64_t)fis->CylinderLow << 8) |
+        ((uint64_t)fis->CylinderHigh << 16) | ((uint64_t)fis->SectorNoExtended << 24) |
+        ((uint64_t)fis->CylinderLowExtended << 32) | ((uint64_t)fis->CylinderHighExtended << 40);
+    count  = ((size_t)fis->Count ? (size_t)fis->Count : 0x10000) * SECTOR_SIZE;
+    if (fis->Command != AtaDMAReadExt && fis->Command != AtaDMAWriteExt) {
+        fprintf(stderr, "storage_batch_bench: hba: unsupported command 0x%x\n", fis->Command);
+        g_hba.Errors++;
+    }
+    else if ((sector * SECTOR_SIZE) + count > (size_t)DISK_SECTORS * SECTOR_SIZE) {
+        fprintf(stderr, "storage_batch_bench: hba: access beyond the disk at sector %" PRIu64 "\n", sector);
+        g_hba.Errors++;
+    }
+    else {
+        for (i = 0; i < header->TableLength && transferred < count; i++) {
+            AHCIPrdtEntry_t* prdt    = &table->PrdtEntry[i];
+            uint8_t*         address = (uint8_t*)(uintptr_t)(prdt->DataBaseAddress |
+                ((uint64_t)prdt->DataBaseAddressUpper << 32));
+            size_t           length  = MIN((size_t)(prdt->Descriptor & 0x3FFFFF) + 1, count - transferred);
+            uint8_t*         disk    = g_hba.Disk + (sector * SECTOR_SIZE) + transferred;
+
+            if (fis->Command == AtaDMAWriteExt) memcpy(disk, address, length);
+            else                                memcpy(address, disk, length);
+            transferred += length;
+        }
+    }
+
+    header->PRDByteCount            = (uint32_t)transferred;
+    receivedFis->RegisterD2H.Type   = FISRegisterD2H;
+    receivedFis->RegisterD2H.Status = ATA_STS_DEV_READY;
+    g_hba.Port->Registers->CI &= ~(1U << slot);
+    g_hba.Accepted            &= ~(1U << slot);
+    g_hba.Commands++;
+    atomic_fetch_or(&g_hba.Controller->InterruptResource.PortInterruptStatus[g_hba.Port->Index], AHCI_PORT_IE_DHRE);
+    AhciPortInterruptHandler(g_hba.Controller, g_hba.Port);
+}
+
+// Runs commands until the device is idle, the interrupt handler issues
+// the transactions that were waiting for a slot
+static void
+hba_run(void)
+{
+    while (g_hba.Accepted) {
+        int slot;
+        for (slot = 0; slot < 32; slot++) {
+            if (g_hba.Accepted & (1U << slot)) {
+                hba_execute(slot);
+            }
+        }
+    }
+}
+
+/**
+ * Manager functions used by the driver sources
+ */
+static AhciDevice_t g_device;
+
+size_t     AhciManagerGetFrameSize(void) { return DMA_PAGE_SIZE; }
+OsStatus_t AhciManagerRegisterDevice(AhciController_t* controller, AhciPort_t* port, uint32_t signature) { return OsSuccess; }
+void       AhciManagerUnregisterDevice(AhciController_t* controller, AhciPort_t* port) { }
+void       AhciManagerHandleControlResponse(AhciPort_t* port, AhciTransaction_t* transaction) { }
+
+AhciDevice_t*
+AhciManagerGetDevice(UUId_t deviceId)
+{
+    return deviceId == g_device.Descriptor.Device ? &g_device : NULL;
+}
+
+static void*
+driver_thread(void* context)
+{
+    int                  socket = *(int*)context;
+    struct bench_message request;
+
+    while (recv(socket, &request, sizeof(request), 0) > 0) {
+        struct gracht_message message = { socket };
+        switch (request.Call) {
+            case CALL_TRANSFER: {
+                ctt_storage_transfer_invocation(&message, (UUId_t)request.Arguments[0], (int)request.Arguments[1],
+                    LODWORD(request.Arguments[2]), HIDWORD(request.Arguments[2]),
+                    (UUId_t)request.Arguments[3], 0, 8);
+            } break;
+            case CALL_SUBMIT: {
+                ctt_storage_submit_invocation(&message, (UUId_t)request.Arguments[0], (int)request.Arguments[1],
+                    (const uint8_t*)&request.Segments[0], request.SegmentCount * sizeof(StorageTransferSegment_t),
+                    (unsigned int)request.Arguments[2]);
+            } break;
+            case CALL_POLL: {
+                ctt_storage_poll_invocation(&message, (UUId_t)request.Arguments[0], (UUId_t)request.Arguments[1],
+                    (uint8_t)request.Arguments[2]);
+            } break;
+            default: {
+                return NULL;
+            }
+        }
+        hba_run();
+    }
+    return NULL;
+}
+
+static int            g_socket;
+static UUId_t         g_buffer;
+static uint64_t       g_sectors[READ_COUNT];
+static struct bench_message g_reply;
+
+static int
+call(struct bench_message* request, int expected)
+{
+    bench_send(g_socket, request);
+    CHECK(TEST_NAME, recv(g_socket, &g_reply, sizeof(g_reply), 0) > 0, "link closed");
+    CHECK(TEST_NAME, g_reply.Call == expected, "expected reply %i, got %i", expected, g_reply.Call);
+    return 0;
+}
+
+static int
+wait_event(void)
+{
+    CHECK(TEST_NAME, recv(g_socket, &g_reply, sizeof(g_reply), 0) > 0, "link closed");
+    CHECK(TEST_NAME, g_reply.Call == CALL_EVENT, "expected an event, got %i", g_reply.Call);
+    return 0;
+}
+
+static int
+check_data(size_t offset, uint64_t sector, size_t count)
+{
+    uint8_t* buffer = (uint8_t*)g_dmaBuffers[g_buffer].buffer + offset;
+    CHECK(TEST_NAME, !memcmp(buffer, g_hba.Disk + (sector * SECTOR_SIZE), count * SECTOR_SIZE),
+        "data read at sector %" PRIu64 " does not match the disk", sector);
+    return 0;
+}
+
+static int
+submit(size_t count, unsigned int flags, UUId_t* requestId)
+{
+    struct bench_message request = { 0 };
+    size_t               i;
+
+    request.Call         = CALL_SUBMIT;
+    request.Arguments[0] = g_device.Descriptor.Device;
+    request.Arguments[1] = __STORAGE_OPERATION_READ;
+    request.Arguments[2] = flags;
+    request.SegmentCount = (uint32_t)count;
+    for (i = 0; i < count; i++) {
+        request.Segments[i].Sector       = g_sectors[i];
+        request.Segments[i].BufferHandle = g_buffer;
+        request.Segments[i].BufferOffset = i * DMA_PAGE_SIZE;
+        request.Segments[i].SectorCount  = 8;
+    }
+    if (call(&request, CALL_SUBMIT)) {
+        return -1;
+    }
+    CHECK(TEST_NAME, g_reply.Status == OsSuccess, "submit failed with %i", g_reply.Status);
+    *requestId = (UUId_t)g_reply.Arguments[0];
+    return 0;
+}
+
+static int
+poll_request(UUId_t requestId, int block)
+{
+    struct bench_message request = { 0 };
+    request.Call         = CALL_POLL;
+    request.Arguments[0] = g_device.Descriptor.Device;
+    request.Arguments[1] = requestId;
+    request.Arguments[2] = (uint64_t)block;
+    return call(&request, CALL_POLL);
+}
+
+static int
+test_requests(void)
+{
+    struct bench_message request = { 0 };
+    UUId_t               requestId;
+    int                  i;
+
+    for (i = 0; i < __STORAGE_MAX_SEGMENTS; i++) {
+        g_sectors[i] = (uint64_t)(i * 7919 % (DISK_SECTORS / 8)) * 8;
+    }
+
+    // More segments than slots, the result is kept until it is polled and only once
+    CHECK(TEST_NAME, !submit(__STORAGE_MAX_SEGMENTS, 0, &requestId), "submit failed");
+    CHECK(TEST_NAME, !poll_request(requestId, 0), "poll failed");
+    CHECK(TEST_NAME, g_reply.Status == OsSuccess && g_reply.Arguments[0] == __STORAGE_MAX_SEGMENTS * 8,
+        "request completed with %i, %" PRIu64 " sectors", g_reply.Status, g_reply.Arguments[0]);
+    CHECK(TEST_NAME, !poll_request(requestId, 0) && g_reply.Status == OsDoesNotExist, "request was polled twice");
+    for (i = 0; i < __STORAGE_MAX_SEGMENTS; i++) {
+        CHECK(TEST_NAME, !check_data((size_t)i * DMA_PAGE_SIZE, g_sectors[i], 8), "segment %i", i);
+    }
+    CHECK(TEST_NAME, list_count(&g_requests) == 0 && list_count(&g_hba.Port->Transactions) == 0, "requests were left behind");
+
+    // Notified requests are released when the event is sent
+    CHECK(TEST_NAME, !submit(3, __STORAGE_SUBMIT_NOTIFY, &requestId) && !wait_event(), "notify failed");
+    CHECK(TEST_NAME, g_reply.Arguments[0] == requestId && g_reply.Status == OsSuccess && g_reply.Arguments[1] == 24,
+        "event for request %" PRIu64 " with %i, %" PRIu64 " sectors", g_reply.Arguments[0], g_reply.Status, g_reply.Arguments[1]);
+    CHECK(TEST_NAME, !poll_request(requestId, 1) && g_reply.Status == OsDoesNotExist, "notified request could be polled");
+
+    // A segment larger than a command is split, and one past the end of the disk is truncated
+    request.Call         = CALL_SUBMIT;
+    request.Arguments[0] = g_device.Descriptor.Device;
+    request.Arguments[1] = __STORAGE_OPERATION_READ;
+    request.SegmentCount = 2;
+    request.Segments[0].Sector       = 1000;
+    request.Segments[0].BufferHandle = g_buffer;
+    request.Segments[0].BufferOffset = 0;
+    request.Segments[0].SectorCount  = LARGE_SECTORS;
+    request.Segments[1].Sector       = DISK_SECTORS - 8;
+    request.Segments[1].BufferHandle = g_buffer;
+    request.Segments[1].BufferOffset = LARGE_SECTORS * SECTOR_SIZE;
+    request.Segments[1].SectorCount  = 16;
+    i = g_hba.Commands;
+    CHECK(TEST_NAME, !call(&request, CALL_SUBMIT) && g_reply.Status == OsSuccess, "submit failed");
+    CHECK(TEST_NAME, !poll_request((UUId_t)g_reply.Arguments[0], 1), "poll failed");
+    CHECK(TEST_NAME, g_reply.Status == OsSuccess && g_reply.Arguments[0] == LARGE_SECTORS + 8,
+        "split request completed with %i, %" PRIu64 " sectors", g_reply.Status, g_reply.Arguments[0]);
+    CHECK(TEST_NAME, g_hba.Commands - i == 3, "split request took %i commands", g_hba.Commands - i);
+    CHECK(TEST_NAME, !check_data(0, 1000, LARGE_SECTORS) && !check_data(LARGE_SECTORS * SECTOR_SIZE, DISK_SECTORS - 8, 8),
+        "split request");
+
+    // Requests are validated before anything is queued
+    request.Segments[0].BufferHandle = 0;
+    request.SegmentCount = 1;
+    CHECK(TEST_NAME, !call(&request, CALL_SUBMIT) && g_reply.Status == OsSuccess, "submit failed");
+    CHECK(TEST_NAME, !poll_request((UUId_t)g_reply.Arguments[0], 1) && g_reply.Status == OsInvalidParameters,
+        "bad buffer completed with %i", g_reply.Status);
+    request.SegmentCount = 0;
+    CHECK(TEST_NAME, !call(&request, CALL_SUBMIT) && g_reply.Status == OsInvalidParameters, "empty submit was accepted");
+    CHECK(TEST_NAME, !poll_request(12345, 0) && g_reply.Status == OsDoesNotExist, "unknown request was found");
+
+    // Results that are never polled are capped, the oldest are dropped first
+    CHECK(TEST_NAME, !submit(1, 0, &requestId), "submit failed");
+    for (i = 0; i < __STORAGE_MAX_FINISHED; i++) {
+        UUId_t nextId;
+        CHECK(TEST_NAME, !submit(1, 0, &nextId) && nextId == requestId + i + 1, "submit failed");
+    }
+    CHECK(TEST_NAME, !poll_request(requestId + __STORAGE_MAX_FINISHED, 1) && g_reply.Status == OsSuccess, "last request was dropped");
+    CHECK(TEST_NAME, !poll_request(requestId, 0) && g_reply.Status == OsDoesNotExist, "oldest request was kept");
+    for (i = 1; i < __STORAGE_MAX_FINISHED; i++) {
+        CHECK(TEST_NAME, !poll_request(requestId + i, 0) && g_reply.Status == OsSuccess, "request %i was dropped", i);
+    }
+    CHECK(TEST_NAME, g_hba.Errors == 0, "hba reported %i errors", g_hba.Errors);
+    return 0;
+}
+
+// 4KB random reads with one blocking transfer call each, like MfsReadSectors
+static int
+bench_transfer(double* nsOut)
+{
+    struct bench_message request = { 0 };
+    unsigned long long   start;
+    int                  i;
+
+    request.Call         = CALL_TRANSFER;
+    request.Arguments[0] = g_device.Descriptor.Device;
+    request.Arguments[1] = __STORAGE_OPERATION_READ;
+    request.Arguments[3] = g_buffer;
+
+    start = NowNs();
+    for (i = 0; i < READ_COUNT; i++) {
+        request.Arguments[2] = g_sectors[i];
+        if (call(&request, CALL_TRANSFER)) {
+            return -1;
+        }
+        CHECK(TEST_NAME, g_reply.Status == OsSuccess && g_reply.Arguments[0] == 8, "read %i failed", i);
+    }
+    *nsOut = (double)(NowNs() - start) / READ_COUNT;
+    return check_data(0, g_sectors[READ_COUNT - 1], 8);
+}
+
+// The same reads as submits of <batch> segments, completed by a blocking poll or the event
+static int
+bench_submit(int batch, int notify, double* nsOut)
+{
+    unsigned long long start;
+    UUId_t             requestId;
+    int                i;
+
+    start = NowNs();
+    for (i = 0; i < READ_COUNT; i += batch) {
+        struct bench_message request = { 0 };
+        int                  j;
+
+        request.Call         = CALL_SUBMIT;
+        request.Arguments[0] = g_device.Descriptor.Device;
+        request.Arguments[1] = __STORAGE_OPERATION_READ;
+        request.Arguments[2] = notify ? __STORAGE_SUBMIT_NOTIFY : 0;
+        request.SegmentCount = (uint32_t)batch;
+        for (j = 0; j < batch; j++) {
+            request.Segments[j].Sector       = g_sectors[i + j];
+            request.Segments[j].BufferHandle = g_buffer;
+            request.Segments[j].BufferOffset = (size_t)j * DMA_PAGE_SIZE;
+            request.Segments[j].SectorCount  = 8;
+        }
+        if (call(&request, CALL_SUBMIT)) {
+            return -1;
+        }
+        CHECK(TEST_NAME, g_reply.Status == OsSuccess, "submit %i failed", i);
+        requestId = (UUId_t)g_reply.Arguments[0];
+        if (notify ? wait_event() : poll_request(requestId, 1)) {
+            return -1;
+        }
+        CHECK(TEST_NAME, g_reply.Status == OsSuccess && g_reply.Arguments[notify ? 1 : 0] == (uint64_t)batch * 8,
+            "request %u failed with %i", requestId, g_reply.Status);
+    }
+    *nsOut = (double)(NowNs() - start) / READ_COUNT;
+    return check_data((size_t)(batch - 1) * DMA_PAGE_SIZE, g_sectors[READ_COUNT - 1], 8);
+}
+
+static int
+setup_port(void)
+{
+    static AhciController_t controller;
+    struct dma_buffer_info  info = { "reads", (LARGE_SECTORS + 16) * SECTOR_SIZE, (LARGE_SECTORS + 16) * SECTOR_SIZE, 0 };
+    struct dma_attachment   attachment;
+    AhciPort_t*             port;
+    size_t                  i;
+
+    controller.Registers = aligned_alloc(DMA_PAGE_SIZE, 0x2000);
+    memset(controller.Registers, 0, 0x2000);
+    controller.Registers->Capabilities = AHCI_CAPABILITIES_S64A | (31 << 8);
+
+    port = AhciPortCreate(&controller, 0, 0);
+    CHECK(TEST_NAME, port != NULL, "failed to create port");
+    CHECK(TEST_NAME, AhciPortRebase(&controller, port) == OsSuccess, "failed to rebase port");
+    controller.Ports[0] = port;
+    g_hba.Controller    = &controller;
+    g_hba.Port          = port;
+
+    g_device.Descriptor.Device = 1;
+    g_device.Controller        = &controller;
+    g_device.Port              = port;
+    g_device.Type              = DeviceATA;
+    g_device.HasDMAEngine      = 1;
+    g_device.AddressingMode    = AHCI_DEVICE_MODE_LBA48;
+    g_device.SectorSize        = SECTOR_SIZE;
+    g_device.SectorCount       = DISK_SECTORS;
+
+    g_hba.Disk = malloc((size_t)DISK_SECTORS * SECTOR_SIZE);
+    for (i = 0; i < ((size_t)DISK_SECTORS * SECTOR_SIZE) / sizeof(uint32_t); i++) {
+        ((uint32_t*)g_hba.Disk)[i] = (uint32_t)(i * 0x9E3779B1U);
+    }
+
+    CHECK(TEST_NAME, dma_create(&info, &attachment) == OsSuccess, "failed to create buffer");
+    g_buffer = attachment.handle;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const int     batches[] = { 1, 8, 16, 64 };
+    struct bench_message request = { CALL_EXIT };
+    pthread_t            driver;
+    int                  sockets[2];
+    uint32_t             seed = 0x2545F491;
+    double               ns;
+    int                  i;
+
+    if (setup_port()) {
+        return -1;
+    }
+    CHECK(TEST_NAME, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) == 0, "failed to create the link");
+    g_socket = sockets[0];
+    pthread_create(&driver, NULL, driver_thread, &sockets[1]);
+
+    if (test_requests()) {
+        return -1;
+    }
+
+    for (i = 0; i < READ_COUNT; i++) {
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        g_sectors[i] = (uint64_t)(seed % (DISK_SECTORS / 8)) * 8;
+    }
+
+    printf("%i random 4KB reads per run from an in-memory disk\n", READ_COUNT);
+    if (bench_transfer(&ns)) {
+        return -1;
+    }
+    printf("transfer per read:             %7.2f us/read, %5i calls\n", ns / 1000.0, READ_COUNT);
+    for (i = 0; i < (int)SIZEOF_ARRAY(batches); i++) {
+        if (bench_submit(batches[i], 0, &ns)) {
+            return -1;
+        }
+        printf("submit %2i segments + poll:     %7.2f us/read, %5i calls\n", batches[i], ns / 1000.0,
+            2 * (READ_COUNT / batches[i]));
+    }
+    if (bench_submit(64, 1, &ns)) {
+        return -1;
+    }
+    printf("submit 64 segments + event:    %7.2f us/read, %5i calls\n", ns / 1000.0, READ_COUNT / 64);
+
+    bench_send(g_socket, &request);
+    pthread_join(driver, NULL);
+    CHECK(TEST_NAME, g_hba.Errors == 0, "hba reported %i errors", g_hba.Errors);
+    CHECK(TEST_NAME, list_count(&g_requests) == 0 && list_count(&g_hba.Port->Transactions) == 0, "requests were left behind");
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}
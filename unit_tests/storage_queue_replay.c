@@ -0,0 +1,660 @@
+#define __TEST
+
+#include "kernel_mock.h"
+#include <assert.h>
+#include <pthread.h>
+#include <threads.h>
+#include <unistd.h>
+
+#define _In_Opt_
+#define __STORAGE_OPERATION_READ  0x00000001
+#define __STORAGE_OPERATION_WRITE 0x00000002
+#define __STORAGE_MAX_SEGMENTS    64
+#define __STORAGE_MAX_FINISHED    256
+
+// Skip the service header, the test provides the parts of it the queue uses
+#define _VFS_INTERFACE_H_
+#define VFS_STORAGEQUEUE_FIFO          0
+#define VFS_STORAGEQUEUE_DEADLINE      1
+#define VFS_STORAGEQUEUE_READ_EXPIRE   50
+#define VFS_STORAGEQUEUE_WRITE_EXPIRE  500
+#define VFS_STORAGEQUEUE_WRITE_STARVE  2
+#define VFS_STORAGEQUEUE_MAX_BYTES     (256 * 1024)
+#define VFS_STORAGEQUEUE_HISTOGRAM     16
+
+// The host has no monotonic timespec_get
+#define TIME_MONOTONIC             1
+#define timespec_get(ts, base)     clock_gettime(CLOCK_MONOTONIC, ts)
+
+typedef struct StorageTransferSegment {
+    uint64_t Sector;
+    UUId_t   BufferHandle;
+    size_t   BufferOffset;
+    size_t   SectorCount;
+} StorageTransferSegment_t;
+
+typedef struct StorageQueue StorageQueue_t;
+typedef OsStatus_t (*StorageQueueDispatch_t)(void* context, int direction,
+    StorageTransferSegment_t* segments, size_t count, size_t* sectorsTransferred);
+
+typedef struct StorageQueueStatistics {
+    size_t   Depth;
+    size_t   MaxDepth;
+    uint64_t Requests;
+    uint64_t Dispatches;
+    uint64_t Merges;
+    uint64_t Expired;
+    uint64_t Latency[VFS_STORAGEQUEUE_HISTOGRAM];
+} StorageQueueStatistics_t;
+
+#include "../services/filemanager/storage/queue.c"
+
+#define SECTOR_SIZE    512
+#define DISK_SECTORS   (64 * 1024)
+#define MAX_STREAMS    16
+#define MAX_OPS        (64 * 1024)
+#define MAX_SECTORS    64
+#define CALL_OVERHEAD  30000 // ns per call to the driver
+#define SECTOR_TIME    200   // ns per sector transferred
+
+#define MODE_DIRECT    -1
+
+// Every sector holds words of (tag << 24 | sector), the tag is 0 until a
+// stream writes the sector, which it does with tag stream + 1
+#define SECTOR_WORD(Tag, Sector) (((uint32_t)(Tag) << 24) | ((uint32_t)(Sector) & 0xFFFFFF))
+
+typedef struct TraceOp {
+    int      Stream;
+    int      Direction;
+    uint64_t Sector;
+    size_t   SectorCount;
+} TraceOp_t;
+
+typedef struct Trace {
+    const char* Name;
+    TraceOp_t*  Ops;
+    size_t      OpCount;
+    int         Streams;
+} Trace_t;
+
+// RAM block device, it serves one call at a time like a single hardware queue
+static pthread_mutex_t g_deviceLock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t*        g_disk;
+static uint8_t*        g_buffers[MAX_STREAMS];
+static uint64_t        g_driverCalls;
+static uint64_t        g_driverSegments;
+static int             g_gateClosed;
+static pthread_mutex_t g_gateLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_gateOpen = PTHREAD_COND_INITIALIZER;
+
+// Calls recorded by the ordering tests
+typedef struct DispatchRecord {
+    int                      Direction;
+    size_t                   Count;
+    StorageTransferSegment_t Segments[4];
+} DispatchRecord_t;
+
+static DispatchRecord_t g_records[32];
+static int              g_recordCount;
+
+static void
+DeviceService(size_t sectors)
+{
+    struct timespec ts = { 0, CALL_OVERHEAD + (long)(sectors * SECTOR_TIME) };
+    nanosleep(&ts, NULL);
+}
+
+static OsStatus_t
+RamDispatch(
+        _In_  void*                     context,
+        _In_  int                       direction,
+        _In_  StorageTransferSegment_t* segments,
+        _In_  size_t                    count,
+        _Out_ size_t*                   sectorsTransferred)
+{
+    size_t total = 0;
+    size_t i;
+    (void)context;
+
+    pthread_mutex_lock(&g_gateLock);
+    while (g_gateClosed) {
+        pthread_cond_wait(&g_gateOpen, &g_gateLock);
+    }
+    pthread_mutex_unlock(&g_gateLock);
+
+    pthread_mutex_lock(&g_deviceLock);
+    if (g_recordCount < (int)SIZEOF_ARRAY(g_records)) {
+        DispatchRecord_t* record = &g_records[g_recordCount++];
+        record->Direction = direction;
+        record->Count     = count;
+        memcpy(&record->Segments[0], segments, sizeof(StorageTransferSegment_t) * MIN(count, (size_t)4));
+    }
+
+    for (i = 0; i < count; i++) {
+        uint8_t* disk   = g_disk + segments[i].Sector * SECTOR_SIZE;
+        uint8_t* buffer = g_buffers[segments[i].BufferHandle] + segments[i].BufferOffset;
+        size_t   length = segments[i].SectorCount * SECTOR_SIZE;
+
+        assert(segments[i].Sector + segments[i].SectorCount <= DISK_SECTORS);
+        assert(i == 0 || segments[i].Sector == segments[i - 1].Sector + segments[i - 1].SectorCount);
+        if (direction == __STORAGE_OPERATION_READ) memcpy(buffer, disk, length);
+        else                                       memcpy(disk, buffer, length);
+        total += segments[i].SectorCount;
+    }
+    g_driverCalls++;
+    g_driverSegments += count;
+    DeviceService(total);
+    pthread_mutex_unlock(&g_deviceLock);
+
+    *sectorsTransferred = total;
+    return OsSuccess;
+}
+
+static void
+ResetDevice(void)
+{
+    uint32_t* words = (uint32_t*)g_disk;
+    size_t    i;
+
+    for (i = 0; i < (DISK_SECTORS * SECTOR_SIZE) / sizeof(uint32_t); i++) {
+        words[i] = SECTOR_WORD(0, i / (SECTOR_SIZE / sizeof(uint32_t)));
+    }
+    g_driverCalls    = 0;
+    g_driverSegments = 0;
+    g_recordCount    = 0;
+}
+
+static void
+FillSectors(uint8_t* buffer, int tag, uint64_t sector, size_t count)
+{
+    uint32_t* words = (uint32_t*)buffer;
+    size_t    i;
+
+    for (i = 0; i < (count * SECTOR_SIZE) / sizeof(uint32_t); i++) {
+        words[i] = SECTOR_WORD(tag, sector + (i / (SECTOR_SIZE / sizeof(uint32_t))));
+    }
+}
+
+// Every sector must be whole and come from the right place, and may only carry
+// the tag of the stream that owns it
+static int
+CheckSectors(uint8_t* buffer, const int* owners, uint64_t sector, size_t count)
+{
+    uint32_t* words = (uint32_t*)buffer;
+    size_t    i, j;
+
+    for (i = 0; i < count; i++) {
+        uint32_t first = words[i * (SECTOR_SIZE / sizeof(uint32_t))];
+        uint32_t tag   = first >> 24;
+
+        if ((first & 0xFFFFFF) != ((sector + i) & 0xFFFFFF)) {
+            return 0;
+        }
+        if (tag != 0 && (int)tag != owners[sector + i] + 1) {
+            return 0;
+        }
+        for (j = 1; j < SECTOR_SIZE / sizeof(uint32_t); j++) {
+            if (words[i * (SECTOR_SIZE / sizeof(uint32_t)) + j] != first) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * Traces
+ */
+static TraceOp_t g_ops[MAX_OPS];
+static int       g_owners[DISK_SECTORS];
+
+static void
+AddOp(Trace_t* trace, int stream, int direction, uint64_t sector, size_t count)
+{
+    TraceOp_t* op = &trace->Ops[trace->OpCount];
+
+    assert(op < &g_ops[MAX_OPS]);
+    op->Stream      = stream;
+    op->Direction   = direction;
+    op->Sector      = sector;
+    op->SectorCount = count;
+    trace->OpCount++;
+    trace->Streams = MAX(trace->Streams, stream + 1);
+}
+
+// Eight readers walking a file in round robin chunks, like parallel read-ahead
+static void
+GenerateInterleaved(Trace_t* trace)
+{
+    int chunk, stream;
+
+    trace->Name = "interleaved readers";
+    for (chunk = 0; chunk < 512; chunk++) {
+        for (stream = 0; stream < 8; stream++) {
+            AddOp(trace, stream, __STORAGE_OPERATION_READ, 1024 + ((chunk * 8 + stream) * 8), 8);
+        }
+    }
+}
+
+// Random reads of a static region, while page write-back flushes a file in single pages
+static void
+GenerateMixed(Trace_t* trace)
+{
+    unsigned int seed = 42;
+    int          i, stream;
+
+    trace->Name = "random reads, write-back";
+    for (i = 0; i < 512; i++) {
+        for (stream = 0; stream < 4; stream++) {
+            AddOp(trace, stream, __STORAGE_OPERATION_READ, (rand_r(&seed) % 2000) * 8, 8);
+        }
+        for (stream = 4; stream < 8; stream++) {
+            AddOp(trace, stream, __STORAGE_OPERATION_WRITE, 16384 + ((i * 4 + (stream - 4)) * 8), 8);
+        }
+    }
+}
+
+// Small records of a metadata table, each overwritten and read back by its owner
+// while the other streams read the table
+static void
+GenerateMetadata(Trace_t* trace)
+{
+    unsigned int seed = 7;
+    int          i, stream;
+
+    trace->Name = "hot metadata";
+    for (i = 0; i < 1024; i++) {
+        for (stream = 0; stream < 8; stream++) {
+            uint64_t record = 512 + (rand_r(&seed) % 32) * 8 + stream;
+            AddOp(trace, stream, (i & 1) ? __STORAGE_OPERATION_READ : __STORAGE_OPERATION_WRITE, record, 1);
+        }
+    }
+}
+
+// Lines of "stream R|W sector count"
+static int
+LoadTrace(Trace_t* trace, const char* path)
+{
+    FILE* file = fopen(path, "r");
+    char  direction;
+    int   stream;
+    unsigned long long sector;
+    unsigned long      count;
+
+    if (!file) {
+        return -1;
+    }
+
+    trace->Name = path;
+    while (fscanf(file, " %d %c %llu %lu", &stream, &direction, &sector, &count) == 4) {
+        if (stream < 0 || stream >= MAX_STREAMS || !count || count > MAX_SECTORS ||
+            sector + count > DISK_SECTORS || (direction != 'R' && direction != 'W')) {
+            fclose(file);
+            return -1;
+        }
+        AddOp(trace, stream, direction == 'R' ? __STORAGE_OPERATION_READ : __STORAGE_OPERATION_WRITE,
+              sector, count);
+    }
+    fclose(file);
+    return trace->OpCount ? 0 : -1;
+}
+
+// A sector may only be written by one stream, so its final contents are known
+static int
+AssignOwners(Trace_t* trace)
+{
+    size_t i, j;
+
+    for (i = 0; i < DISK_SECTORS; i++) {
+        g_owners[i] = -1;
+    }
+    for (i = 0; i < trace->OpCount; i++) {
+        TraceOp_t* op = &trace->Ops[i];
+        if (op->Direction != __STORAGE_OPERATION_WRITE) {
+            continue;
+        }
+        for (j = 0; j < op->SectorCount; j++) {
+            if (g_owners[op->Sector + j] != -1 && g_owners[op->Sector + j] != op->Stream) {
+                return -1;
+            }
+            g_owners[op->Sector + j] = op->Stream;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Replay
+ */
+typedef struct ReplayContext {
+    Trace_t*        Trace;
+    StorageQueue_t* Queue;
+    int             Stream;
+    int             Errors;
+} ReplayContext_t;
+
+static void*
+ReplayStream(void* argument)
+{
+    ReplayContext_t* context = argument;
+    uint8_t*         buffer  = g_buffers[context->Stream];
+    size_t           i;
+
+    for (i = 0; i < context->Trace->OpCount; i++) {
+        TraceOp_t*               op = &context->Trace->Ops[i];
+        StorageTransferSegment_t segment = { op->Sector, (UUId_t)op->Stream, 0, op->SectorCount };
+        size_t                   transferred = 0;
+        OsStatus_t               status;
+
+        if (op->Stream != context->Stream) {
+            continue;
+        }
+
+        if (op->Direction == __STORAGE_OPERATION_WRITE) {
+            FillSectors(buffer, op->Stream + 1, op->Sector, op->SectorCount);
+        }
+
+        if (context->Queue) {
+            status = StorageQueueTransfer(context->Queue, op->Direction, op->Sector,
+                                          (UUId_t)op->Stream, 0, op->SectorCount, &transferred);
+        }
+        else {
+            status = RamDispatch(NULL, op->Direction, &segment, 1, &transferred);
+        }
+
+        if (status != OsSuccess || transferred != op->SectorCount) {
+            context->Errors++;
+        }
+        else if (op->Direction == __STORAGE_OPERATION_READ &&
+                 !CheckSectors(buffer, g_owners, op->Sector, op->SectorCount)) {
+            context->Errors++;
+        }
+    }
+    return NULL;
+}
+
+static const char*
+ModeName(int mode)
+{
+    switch (mode) {
+        case MODE_DIRECT:              return "direct";
+        case VFS_STORAGEQUEUE_FIFO:    return "fifo";
+        case VFS_STORAGEQUEUE_DEADLINE: return "deadline";
+        default:                       return "?";
+    }
+}
+
+static uint64_t
+Replay(Trace_t* trace, int mode)
+{
+    pthread_t                threads[MAX_STREAMS];
+    ReplayContext_t          contexts[MAX_STREAMS];
+    StorageQueueStatistics_t stats;
+    StorageQueue_t*          queue = NULL;
+    unsigned long long       start, end;
+    uint64_t                 calls;
+    int                      errors = 0;
+    int                      i;
+
+    ResetDevice();
+    if (mode != MODE_DIRECT) {
+        queue = StorageQueueCreate(mode, SECTOR_SIZE, RamDispatch, NULL);
+        assert(queue != NULL);
+    }
+
+    start = NowNs();
+    for (i = 0; i < trace->Streams; i++) {
+        contexts[i].Trace  = trace;
+        contexts[i].Queue  = queue;
+        contexts[i].Stream = i;
+        contexts[i].Errors = 0;
+        pthread_create(&threads[i], NULL, ReplayStream, &contexts[i]);
+    }
+    for (i = 0; i < trace->Streams; i++) {
+        pthread_join(threads[i], NULL);
+        errors += contexts[i].Errors;
+    }
+    end = NowNs();
+
+    // The last write of every owned sector must be on the disk
+    for (i = 0; i < DISK_SECTORS; i++) {
+        if (g_owners[i] != -1 && (g_disk[(size_t)i * SECTOR_SIZE + 3] != (uint8_t)(g_owners[i] + 1))) {
+            errors++;
+        }
+    }
+
+    calls = g_driverCalls;
+    printf("  %-9s %8zu ops %8llu driver calls %8llu segments %8.1f ms",
+           ModeName(mode), trace->OpCount, (unsigned long long)calls,
+           (unsigned long long)g_driverSegments, (double)(end - start) / 1000000.0);
+    if (queue) {
+        StorageQueueGetStatistics(queue, &stats);
+        assert(stats.Requests == trace->OpCount);
+        assert(stats.Depth == 0);
+        printf(" %8llu merged %4zu max depth %6llu expired\n",
+               (unsigned long long)stats.Merges, stats.MaxDepth, (unsigned long long)stats.Expired);
+        printf("            latency us:");
+        for (i = 0; i < VFS_STORAGEQUEUE_HISTOGRAM; i++) {
+            if (stats.Latency[i]) {
+                printf(" [%u+]=%llu", 1U << i, (unsigned long long)stats.Latency[i]);
+            }
+        }
+        printf("\n");
+        StorageQueueDestroy(queue);
+    }
+    else {
+        printf("\n");
+    }
+
+    if (errors) {
+        printf("  %d transfers returned wrong data\n", errors);
+        exit(1);
+    }
+    return calls;
+}
+
+/**
+ * Ordering tests, the first dispatch is held back until the other requests have queued
+ */
+typedef struct TransferContext {
+    StorageQueue_t* Queue;
+    int             Direction;
+    uint64_t        Sector;
+    UUId_t          Handle;
+    size_t          Offset;
+    size_t          Count;
+    OsStatus_t      Status;
+    size_t          Transferred;
+    pthread_t       Thread;
+} TransferContext_t;
+
+static void*
+TransferThread(void* argument)
+{
+    TransferContext_t* context = argument;
+    context->Status = StorageQueueTransfer(context->Queue, context->Direction, context->Sector,
+                                           context->Handle, context->Offset, context->Count,
+                                           &context->Transferred);
+    return NULL;
+}
+
+static void
+StartTransfer(TransferContext_t* context, StorageQueue_t* queue, int direction,
+              uint64_t sector, UUId_t handle, size_t offset, size_t count)
+{
+    context->Queue     = queue;
+    context->Direction = direction;
+    context->Sector    = sector;
+    context->Handle    = handle;
+    context->Offset    = offset;
+    context->Count     = count;
+    pthread_create(&context->Thread, NULL, TransferThread, context);
+}
+
+static void
+WaitForDepth(StorageQueue_t* queue, size_t depth)
+{
+    StorageQueueStatistics_t stats;
+    do {
+        usleep(1000);
+        StorageQueueGetStatistics(queue, &stats);
+    } while (stats.Depth < depth);
+}
+
+static void
+SetGate(int closed)
+{
+    pthread_mutex_lock(&g_gateLock);
+    g_gateClosed = closed;
+    pthread_cond_broadcast(&g_gateOpen);
+    pthread_mutex_unlock(&g_gateLock);
+}
+
+static void
+TestMergeAndBarrier(void)
+{
+    StorageQueue_t*   queue = StorageQueueCreate(VFS_STORAGEQUEUE_DEADLINE, SECTOR_SIZE, RamDispatch, NULL);
+    TransferContext_t first, low, high, other, read;
+    int               i;
+
+    for (i = 0; i < DISK_SECTORS; i++) g_owners[i] = -1;
+    for (i = 8; i < 32; i++)            g_owners[i] = 0;
+    ResetDevice();
+
+    // Occupy the driver
+    SetGate(1);
+    StartTransfer(&first, queue, __STORAGE_OPERATION_READ, 1000, 3, 0, 1);
+    usleep(10000);
+
+    // Two writes that continue in the same buffer, and one into another buffer
+    FillSectors(g_buffers[0], 1, 8, 16);
+    FillSectors(g_buffers[1], 1, 24, 8);
+    StartTransfer(&high, queue, __STORAGE_OPERATION_WRITE, 16, 0, 8 * SECTOR_SIZE, 8);
+    StartTransfer(&low, queue, __STORAGE_OPERATION_WRITE, 8, 0, 0, 8);
+    StartTransfer(&other, queue, __STORAGE_OPERATION_WRITE, 24, 1, 0, 8);
+    WaitForDepth(queue, 3);
+
+    // This read must not pass the writes
+    StartTransfer(&read, queue, __STORAGE_OPERATION_READ, 12, 2, 0, 16);
+    usleep(10000);
+    SetGate(0);
+
+    pthread_join(first.Thread, NULL);
+    pthread_join(high.Thread, NULL);
+    pthread_join(low.Thread, NULL);
+    pthread_join(other.Thread, NULL);
+    pthread_join(read.Thread, NULL);
+
+    assert(first.Status == OsSuccess && first.Transferred == 1);
+    assert(low.Status == OsSuccess && low.Transferred == 8);
+    assert(high.Status == OsSuccess && high.Transferred == 8);
+    assert(other.Status == OsSuccess && other.Transferred == 8);
+    assert(read.Status == OsSuccess && read.Transferred == 16);
+
+    assert(g_recordCount == 3);
+    assert(g_records[1].Direction == __STORAGE_OPERATION_WRITE);
+    assert(g_records[1].Count == 2);
+    assert(g_records[1].Segments[0].Sector == 8 && g_records[1].Segments[0].SectorCount == 16);
+    assert(g_records[1].Segments[0].BufferHandle == 0 && g_records[1].Segments[0].BufferOffset == 0);
+    assert(g_records[1].Segments[1].Sector == 24 && g_records[1].Segments[1].BufferHandle == 1);
+    assert(g_records[2].Direction == __STORAGE_OPERATION_READ);
+    assert(CheckSectors(g_buffers[2], g_owners, 12, 16));
+    assert(g_buffers[2][3] == 1);
+
+    StorageQueueDestroy(queue);
+    printf("merge and barrier: ok\n");
+}
+
+static void
+TestOverwrite(void)
+{
+    StorageQueue_t*   queue = StorageQueueCreate(VFS_STORAGEQUEUE_DEADLINE, SECTOR_SIZE, RamDispatch, NULL);
+    TransferContext_t first, older, newer;
+    int               i;
+
+    for (i = 0; i < DISK_SECTORS; i++) g_owners[i] = -1;
+    ResetDevice();
+
+    SetGate(1);
+    StartTransfer(&first, queue, __STORAGE_OPERATION_READ, 1000, 3, 0, 1);
+    usleep(10000);
+
+    // A newer write that covers an older one from another buffer replaces it, the
+    // sweep starts at the newer one as it has the lowest sector
+    FillSectors(g_buffers[0], 1, 100, 2);
+    FillSectors(g_buffers[1], 2, 96, 8);
+    StartTransfer(&older, queue, __STORAGE_OPERATION_WRITE, 100, 0, 0, 2);
+    WaitForDepth(queue, 1);
+    StartTransfer(&newer, queue, __STORAGE_OPERATION_WRITE, 96, 1, 0, 8);
+    WaitForDepth(queue, 2);
+    SetGate(0);
+
+    pthread_join(first.Thread, NULL);
+    pthread_join(older.Thread, NULL);
+    pthread_join(newer.Thread, NULL);
+
+    assert(older.Status == OsSuccess && older.Transferred == 2);
+    assert(newer.Status == OsSuccess && newer.Transferred == 8);
+    for (i = 96; i < 104; i++) {
+        assert(g_disk[(size_t)i * SECTOR_SIZE + 3] == 2);
+    }
+    assert(g_recordCount == 2);
+    assert(g_records[1].Count == 1 && g_records[1].Segments[0].Sector == 96);
+
+    StorageQueueDestroy(queue);
+    printf("overwrite: ok\n");
+}
+
+int main(int argc, char** argv)
+{
+    Trace_t  traces[3];
+    size_t   traceCount = 0;
+    uint64_t direct, fifo, deadline;
+    size_t   i;
+
+    g_disk = malloc(DISK_SECTORS * SECTOR_SIZE);
+    assert(g_disk != NULL);
+    for (i = 0; i < MAX_STREAMS; i++) {
+        g_buffers[i] = malloc(MAX_SECTORS * SECTOR_SIZE);
+        assert(g_buffers[i] != NULL);
+    }
+
+    TestMergeAndBarrier();
+    TestOverwrite();
+
+    memset(&traces[0], 0, sizeof(traces));
+    if (argc > 1) {
+        traces[0].Ops = &g_ops[0];
+        if (LoadTrace(&traces[0], argv[1])) {
+            printf("failed to load trace %s\n", argv[1]);
+            return 1;
+        }
+        traceCount = 1;
+    }
+    else {
+        void (*generators[])(Trace_t*) = { GenerateInterleaved, GenerateMixed, GenerateMetadata };
+        size_t used = 0;
+        for (i = 0; i < SIZEOF_ARRAY(generators); i++) {
+            traces[i].Ops = &g_ops[used];
+            generators[i](&traces[i]);
+            used += traces[i].OpCount;
+        }
+        traceCount = SIZEOF_ARRAY(generators);
+    }
+
+    for (i = 0; i < traceCount; i++) {
+        if (AssignOwners(&traces[i])) {
+            printf("trace %s writes sectors from several streams\n", traces[i].Name);
+            return 1;
+        }
+
+        printf("%s, %d streams\n", traces[i].Name, traces[i].Streams);
+        direct   = Replay(&traces[i], MODE_DIRECT);
+        fifo     = Replay(&traces[i], VFS_STORAGEQUEUE_FIFO);
+        deadline = Replay(&traces[i], VFS_STORAGEQUEUE_DEADLINE);
+        printf("  driver calls: fifo %.2fx, deadline %.2fx fewer than direct\n",
+               (double)direct / (double)fifo, (double)direct / (double)deadline);
+    }
+    TEST_PASSED("storage_queue_replay");
+    return 0;
+}
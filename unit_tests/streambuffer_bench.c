@@ -0,0 +1,255 @@
+
+#define __TEST
+
+#include "kernel_mock.h"
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define _InOut_
+#define OsInvalidParameters (int)5
+
+typedef struct FutexParameters {
+    _Atomic(int)* _futex0;
+    _Atomic(int)* _futex1;
+    int           _val0;
+    int           _val1;
+    int           _val2;
+    int           _flags;
+    size_t        _timeout;
+} FutexParameters_t;
+
+void* dsalloc(size_t size) { return malloc(size); }
+void  dsfree(void* pointer) { free(pointer); }
+
+// Streams are private to the process here, so the host futex can be used directly
+void
+dswait(FutexParameters_t* params)
+{
+    syscall(SYS_futex, params->_futex0, FUTEX_WAIT_PRIVATE, params->_val0, NULL, NULL, 0);
+}
+
+void
+dswake(FutexParameters_t* params)
+{
+    syscall(SYS_futex, params->_futex0, FUTEX_WAKE_PRIVATE, params->_val0, NULL, NULL, 0);
+}
+
+#include "../librt/libds/streambuffer.c"
+
+#define STREAM_CAPACITY (64 * 1024)
+#define CHUNK_SIZE      256
+#define BYTES_PER_RUN   (128 * 1024 * 1024)
+#define MAX_PRODUCERS   16
+
+#define TEST_NAME "streambuffer_bench"
+
+struct chunk {
+    uint32_t producer;
+    uint32_t sequence;
+    uint8_t  payload[CHUNK_SIZE - 8];
+};
+
+struct producer {
+    pthread_t       thread;
+    streambuffer_t* stream;
+    uint32_t        id;
+    uint32_t        count;
+    int             packets;
+};
+
+static void
+fill_chunk(struct chunk* chunk, uint32_t producer, uint32_t sequence)
+{
+    chunk->producer = producer;
+    chunk->sequence = sequence;
+    memset(&chunk->payload[0], (int)(producer + sequence) & 0xFF, sizeof(chunk->payload));
+}
+
+static int
+verify_chunk(struct chunk* chunk, uint32_t* sequences, int producers)
+{
+    CHECK(TEST_NAME, chunk->producer < (uint32_t)producers, "chunk from unknown producer %u", chunk->producer);
+    CHECK(TEST_NAME, chunk->sequence == sequences[chunk->producer], "producer %u sent %u, expected %u",
+        chunk->producer, chunk->sequence, sequences[chunk->producer]);
+    CHECK(TEST_NAME, chunk->payload[0] == (uint8_t)(chunk->producer + chunk->sequence) &&
+          chunk->payload[sizeof(chunk->payload) - 1] == chunk->payload[0],
+          "payload of chunk %u from producer %u is corrupt", chunk->sequence, chunk->producer);
+    sequences[chunk->producer]++;
+    return 0;
+}
+
+static void*
+producer_main(void* context)
+{
+    struct producer* producer = context;
+    struct chunk     chunk;
+    unsigned int     base, state;
+    uint32_t         i;
+
+    for (i = 0; i < producer->count; i++) {
+        fill_chunk(&chunk, producer->id, i);
+        if (producer->packets) {
+            streambuffer_write_packet_start(producer->stream, sizeof(chunk), 0, &base, &state);
+            streambuffer_write_packet_data(producer->stream, &chunk, sizeof(chunk), &state);
+            streambuffer_write_packet_end(producer->stream, base, sizeof(chunk));
+        }
+        else {
+            streambuffer_stream_out(producer->stream, &chunk, sizeof(chunk), 0);
+        }
+    }
+    return NULL;
+}
+
+static int
+test_rounding(void)
+{
+    streambuffer_t* stream;
+    uint8_t         storage[sizeof(streambuffer_t) + 1000];
+
+    streambuffer_construct((streambuffer_t*)&storage[0], 1000, 0);
+    CHECK(TEST_NAME, ((streambuffer_t*)&storage[0])->capacity == 512, "constructed capacity of 1000 is %" PRIuIN,
+        ((streambuffer_t*)&storage[0])->capacity);
+    CHECK(TEST_NAME, streambuffer_create(1000, 0, &stream) == OsSuccess && stream->capacity == 1024,
+        "created capacity of 1000 is not 1024");
+    free(stream);
+    CHECK(TEST_NAME, streambuffer_create(0, 0, &stream) == OsInvalidParameters, "created an empty stream");
+    return 0;
+}
+
+// Run data through the buffer while the indices wrap around at UINT_MAX, with reads and
+// writes of sizes that rarely line up with the end of the buffer
+static int
+test_wrap_around(void)
+{
+    streambuffer_t* stream;
+    uint8_t         in[1000];
+    uint8_t         out[1000];
+    unsigned int    base, state;
+    uint32_t        seed = 1;
+    uint8_t         next_in = 0;
+    uint8_t         next_out = 0;
+    size_t          available;
+    int             i, j;
+
+    CHECK(TEST_NAME, streambuffer_create(4096, 0, &stream) == OsSuccess, "failed to create stream");
+    stream->producer_index = stream->producer_comitted_index = UINT_MAX - 50000;
+    stream->consumer_index = stream->consumer_comitted_index = UINT_MAX - 50000;
+
+    for (i = 0; i < 20000; i++) {
+        size_t length;
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        length = 1 + (seed % sizeof(in));
+
+        streambuffer_get_bytes_available_out(stream, &available);
+        if (available >= length + sizeof(sb_packethdr_t) && (seed & 0x100)) {
+            if ((seed & 0x200) || available != stream->capacity) {
+                for (j = 0; j < (int)length; j++) {
+                    in[j] = next_in++;
+                }
+                CHECK(TEST_NAME, streambuffer_stream_out(stream, &in[0], length, STREAMBUFFER_NO_BLOCK) == length,
+                    "failed to write %" PRIuIN " bytes", length);
+            }
+            else {
+                // Packets can only be mixed in while the stream is empty
+                memset(&in[0], (int)(seed & 0xFF), length);
+                CHECK(TEST_NAME, streambuffer_write_packet_start(stream, length, STREAMBUFFER_NO_BLOCK, &base, &state) == length,
+                    "failed to start packet of %" PRIuIN " bytes", length);
+                streambuffer_write_packet_data(stream, &in[0], length, &state);
+                streambuffer_write_packet_end(stream, base, length);
+
+                CHECK(TEST_NAME, streambuffer_read_packet_start(stream, STREAMBUFFER_NO_BLOCK, &base, &state) == length,
+                    "failed to read the packet back");
+                streambuffer_read_packet_data(stream, &out[0], length, &state);
+                streambuffer_read_packet_end(stream, base, length);
+                CHECK(TEST_NAME, !memcmp(&in[0], &out[0], length), "packet of %" PRIuIN " bytes was corrupted", length);
+            }
+        }
+        else {
+            size_t bytes_read = streambuffer_stream_in(stream, &out[0], length,
+                STREAMBUFFER_NO_BLOCK | STREAMBUFFER_ALLOW_PARTIAL);
+            for (j = 0; j < (int)bytes_read; j++) {
+                CHECK(TEST_NAME, out[j] == next_out, "read %u, expected %u", out[j], next_out);
+                next_out++;
+            }
+        }
+    }
+
+    CHECK(TEST_NAME, atomic_load(&stream->producer_index) < (UINT_MAX - 50000), "indices never wrapped around");
+    free(stream);
+    return 0;
+}
+
+static int
+run_bench(int producerCount, int packets)
+{
+    static struct producer producers[MAX_PRODUCERS];
+    streambuffer_t*        stream;
+    uint32_t               sequences[MAX_PRODUCERS] = { 0 };
+    uint32_t               perProducer = BYTES_PER_RUN / CHUNK_SIZE / (uint32_t)producerCount;
+    size_t                 chunkCount  = (size_t)perProducer * (size_t)producerCount;
+    unsigned long long     start;
+    unsigned long long     end;
+    struct chunk           chunk;
+    unsigned int           base, state;
+    size_t                 i;
+    int                    j;
+
+    CHECK(TEST_NAME, streambuffer_create(STREAM_CAPACITY, STREAMBUFFER_MULTIPLE_WRITERS, &stream) == OsSuccess,
+        "failed to create stream");
+
+    start = NowNs();
+    for (j = 0; j < producerCount; j++) {
+        producers[j].stream  = stream;
+        producers[j].id      = (uint32_t)j;
+        producers[j].count   = perProducer;
+        producers[j].packets = packets;
+        pthread_create(&producers[j].thread, NULL, producer_main, &producers[j]);
+    }
+
+    for (i = 0; i < chunkCount; i++) {
+        if (packets) {
+            CHECK(TEST_NAME, streambuffer_read_packet_start(stream, 0, &base, &state) == sizeof(chunk), "bad packet length");
+            streambuffer_read_packet_data(stream, &chunk, sizeof(chunk), &state);
+            streambuffer_read_packet_end(stream, base, sizeof(chunk));
+        }
+        else {
+            CHECK(TEST_NAME, streambuffer_stream_in(stream, &chunk, sizeof(chunk), 0) == sizeof(chunk), "short read");
+        }
+        if (verify_chunk(&chunk, &sequences[0], producerCount)) {
+            return -1;
+        }
+    }
+    end = NowNs();
+
+    for (j = 0; j < producerCount; j++) {
+        pthread_join(producers[j].thread, NULL);
+    }
+    free(stream);
+
+    printf("%-7s producers %2i: %8.1f MB/s\n", packets ? "packet" : "stream", producerCount,
+        ((double)chunkCount * CHUNK_SIZE / (1024.0 * 1024.0)) / ((double)(end - start) / 1000000000.0));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const int producerCounts[] = { 1, 4, 16 };
+    int              i;
+
+    if (test_rounding() || test_wrap_around()) {
+        return -1;
+    }
+
+    printf("%i MB through a %i KB stream in %i byte chunks, one consumer\n",
+        BYTES_PER_RUN / (1024 * 1024), STREAM_CAPACITY / 1024, CHUNK_SIZE);
+    for (i = 0; i < (int)SIZEOF_ARRAY(producerCounts); i++) {
+        if (run_bench(producerCounts[i], 0) || run_bench(producerCounts[i], 1)) {
+            return -1;
+        }
+    }
+    TEST_PASSED(TEST_NAME);
+    return 0;
+}